@@ -107,6 +107,10 @@ main() {
         mkdir -p out/unified_sites
         $compressor -c /tmp/sites.yml > "out/unified_sites/${output_name}.sites.yml.${compress_ext}"
     fi
+    if [ -f /tmp/sites.cflat ]; then
+        mkdir -p out/unified_sites
+        $compressor -c /tmp/sites.cflat > "out/unified_sites/${output_name}.sites.cflat.${compress_ext}"
+    fi
 
     ls -Rlh GLnexus.DB
     ls -Rlh out
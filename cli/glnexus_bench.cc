@@ -0,0 +1,396 @@
+// Benchmark the GLnexus phases on a synthetic cohort: generate gVCFs for a
+// given number of samples and variant density, then time the bulk load,
+// allele discovery, unification and genotyping separately, reporting the
+// throughput per core and the peak resident memory after each. The cohort is
+// a deterministic function of the parameters and the seed, so that runs of
+// different builds are comparable.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "service.h"
+#include "unifier.h"
+#include "BCFKeyValueData.h"
+#include "RocksKeyValue.h"
+#include "perf.h"
+#include "executor.h"
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/stdout_sinks.h"
+#include "cli_utils.h"
+
+using namespace std;
+using namespace GLnexus;
+
+auto console = spdlog::stderr_logger_mt("GLnexus");
+
+struct cohort_spec {
+    size_t samples = 100;
+    size_t contigs = 1;
+    size_t contig_length = 1000000;
+    double variants_per_kbp = 1.0;     // cohort-wide variant sites
+    size_t mean_band_length = 100;     // reference confidence blocks
+    uint64_t seed = 42;
+};
+
+// Portable uniform draws from the (standardized) mt19937_64 output, rather
+// than the implementation-defined std distributions, so that the cohort is
+// the same whatever the standard library.
+class rng {
+    mt19937_64 gen_;
+public:
+    rng(uint64_t seed) : gen_(seed) {}
+    double uniform() { return (gen_() >> 11) / 9007199254740992.0; } // 2^53
+    uint64_t below(uint64_t n) { return uint64_t(uniform() * n); }
+};
+
+// The reference base at a position: a hash, so that all the gVCFs agree
+// without our keeping the reference sequence.
+static char ref_base(size_t rid, uint64_t pos) {
+    uint64_t h = (pos + 1) * 0x9E3779B97F4A7C15ULL ^ (rid + 1) * 0xC2B2AE3D27D4EB4FULL;
+    h ^= h >> 31;
+    return "ACGT"[h & 3];
+}
+
+struct variant_site {
+    size_t rid;
+    uint64_t pos;                      // 0-based
+    bool deletion;                     // 2bp REF -> 1bp ALT, else a SNV
+    char alt;
+    double frequency;
+};
+
+static vector<variant_site> generate_sites(const cohort_spec& spec) {
+    rng r(spec.seed);
+    vector<variant_site> ans;
+    uint64_t spacing = max(uint64_t(2), uint64_t(1000.0 / spec.variants_per_kbp));
+    for (size_t rid = 0; rid < spec.contigs; rid++) {
+        for (uint64_t pos = 1 + r.below(spacing); pos + 2 < spec.contig_length;
+             pos += 3 + r.below(2*spacing)) {
+            variant_site v;
+            v.rid = rid;
+            v.pos = pos;
+            v.deletion = r.uniform() < 0.1;
+            char ref = ref_base(rid, pos);
+            do {
+                v.alt = "ACGT"[r.below(4)];
+            } while (v.alt == ref);
+            if (v.deletion) {
+                v.alt = ref;
+            }
+            // mostly rare variants, as in real cohorts
+            double u = r.uniform();
+            v.frequency = 0.001 + 0.5 * u * u * u;
+            ans.push_back(v);
+        }
+    }
+    return ans;
+}
+
+static string header_of(const cohort_spec& spec, const string& sample) {
+    ostringstream os;
+    os << "##fileformat=VCFv4.1\n"
+       << "##ALT=<ID=NON_REF,Description=\"Represents any possible alternative allele at this location\">\n"
+       << "##INFO=<ID=END,Number=1,Type=Integer,Description=\"Stop position of the interval\">\n"
+       << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n"
+       << "##FORMAT=<ID=AD,Number=.,Type=Integer,Description=\"Allelic depths for the ref and alt alleles in the order listed\">\n"
+       << "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Approximate read depth\">\n"
+       << "##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Genotype Quality\">\n"
+       << "##FORMAT=<ID=MIN_DP,Number=1,Type=Integer,Description=\"Minimum DP observed within the GVCF block\">\n"
+       << "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Normalized, Phred-scaled likelihoods for genotypes\">\n";
+    for (size_t rid = 0; rid < spec.contigs; rid++) {
+        os << "##contig=<ID=chr" << (rid+1) << ",length=" << spec.contig_length << ">\n";
+    }
+    os << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\t" << sample << "\n";
+    return os.str();
+}
+
+// Emit reference confidence blocks covering [beg,end) (0-based)
+static void write_ref_bands(ostream& out, rng& r, const cohort_spec& spec, size_t rid,
+                            uint64_t beg, uint64_t end, size_t& records) {
+    while (beg < end) {
+        uint64_t len = min(end - beg, 1 + r.below(2*spec.mean_band_length));
+        int dp = 10 + r.below(30);
+        int gq = min(99, int(r.below(3*dp)));
+        out << "chr" << (rid+1) << '\t' << (beg+1) << "\t.\t" << ref_base(rid, beg)
+            << "\t<NON_REF>\t.\t.\tEND=" << (beg+len) << "\tGT:DP:GQ:MIN_DP:PL\t0/0:"
+            << dp << ':' << gq << ':' << max(1, dp - int(r.below(5))) << ":0," << gq << ',' << (10*gq+9) << '\n';
+        beg += len;
+        records++;
+    }
+}
+
+// Write sample i's gVCF, returning the number of records
+static Status write_gvcf(const cohort_spec& spec, const vector<variant_site>& sites, size_t i,
+                         const string& filename, size_t& records) {
+    rng r(spec.seed * 1000003 + i + 1);
+    ofstream out(filename, ios::trunc);
+    if (!out.good()) {
+        return Status::IOError("creating", filename);
+    }
+    out << header_of(spec, "SYN" + to_string(i+1));
+    records = 0;
+
+    size_t si = 0;
+    for (size_t rid = 0; rid < spec.contigs; rid++) {
+        uint64_t covered = 0;   // next position not yet covered by a record
+        for (; si < sites.size() && sites[si].rid == rid; si++) {
+            const variant_site& v = sites[si];
+            int copies = (r.uniform() < v.frequency) + (r.uniform() < v.frequency);
+            if (!copies || v.pos < covered) {
+                continue;
+            }
+            write_ref_bands(out, r, spec, rid, covered, v.pos, records);
+            int dp = 10 + r.below(30);
+            int alt_reads = copies == 2 ? dp : dp/2;
+            int gq = 20 + r.below(80);
+            string ref(1, ref_base(rid, v.pos));
+            if (v.deletion) {
+                ref += ref_base(rid, v.pos+1);
+            }
+            out << "chr" << (rid+1) << '\t' << (v.pos+1) << "\t.\t" << ref << '\t' << v.alt
+                << ",<NON_REF>\t" << (10*gq) << "\t.\t.\tGT:AD:DP:GQ:PL\t"
+                << (copies == 2 ? "1/1" : "0/1") << ':' << (dp-alt_reads) << ',' << alt_reads << ",0:"
+                << dp << ':' << gq << ':';
+            if (copies == 2) {
+                out << (30*gq) << ',' << (3*gq) << ",0," << (30*gq) << ',' << (3*gq+3) << ',' << (30*gq+30);
+            } else {
+                out << (10*gq) << ",0," << (10*gq) << ',' << (10*gq+3) << ',' << (10*gq+6) << ',' << (20*gq);
+            }
+            out << '\n';
+            records++;
+            covered = v.pos + ref.size();
+        }
+        write_ref_bands(out, r, spec, rid, covered, spec.contig_length, records);
+    }
+    out.close();
+    if (out.fail()) {
+        return Status::IOError("writing", filename);
+    }
+    return Status::OK();
+}
+
+// Measures one phase: wall time, CPU time and peak RSS so far
+class phase_meter {
+    string name_;
+    chrono::steady_clock::time_point t0_;
+    double cpu0_;
+    perf::snapshot perf0_;
+
+    static double cpu_seconds() {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    }
+
+public:
+    phase_meter(const string& name)
+        : name_(name), t0_(chrono::steady_clock::now()), cpu0_(cpu_seconds()), perf0_(perf::current()) {}
+
+    // Report the phase, with throughput in terms of items processed
+    Status finish(size_t threads, const string& items_name, uint64_t items, ostream* json) {
+        uint64_t elapsed_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0_).count();
+        double secs = max(elapsed_ms, uint64_t(1)) / 1000.0;
+        double cpu = cpu_seconds() - cpu0_;
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        uint64_t peak_rss_kb = ru.ru_maxrss;
+        double per_core = items / secs / threads;
+
+        console->info("{}: {:.2f}s ({:.2f} CPU-s, {:.0f}% of {} threads), {} {} = {:.1f}/s/core, peak RSS {} MiB",
+                      name_, secs, cpu, 100.0 * cpu / secs / threads, threads, items, items_name,
+                      per_core, peak_rss_kb / 1024);
+        if (json) {
+            perf::snapshot stats = perf::current();
+            stats -= perf0_;
+            map<string,uint64_t> extra = {
+                {"threads", threads},
+                {"cpu_ms", uint64_t(cpu * 1000)},
+                {items_name, items},
+                {items_name + "_per_core_per_s", uint64_t(per_core)},
+                {"peak_rss_kb", peak_rss_kb}
+            };
+            return perf::report_json(name_, elapsed_ms, stats, extra, *json);
+        }
+        return Status::OK();
+    }
+};
+
+static Status run(const cohort_spec& spec, const string& dir, const string& config_name,
+                  size_t threads, size_t mem_budget, ostream* json) {
+    Status s;
+    if (mkdir(dir.c_str(), 0755) != 0) {
+        return Status::IOError("creating (mustn't already exist)", dir);
+    }
+
+    // generate the cohort (untimed)
+    console->info("generating {} gVCFs of {} contig(s) x {} bp, {} variants/kbp",
+                  spec.samples, spec.contigs, spec.contig_length, spec.variants_per_kbp);
+    vector<variant_site> sites = generate_sites(spec);
+    vector<string> gvcfs;
+    size_t total_records = 0;
+    for (size_t i = 0; i < spec.samples; i++) {
+        gvcfs.push_back(dir + "/SYN" + to_string(i+1) + ".gvcf");
+        size_t records = 0;
+        S(write_gvcf(spec, sites, i, gvcfs.back(), records));
+        total_records += records;
+    }
+    console->info("generated {} cohort variant sites, {} gVCF records", sites.size(), total_records);
+
+    unifier_config unifier_cfg;
+    genotyper_config genotyper_cfg;
+    string cfg_txt, cfg_crc32c;
+    S(cli::utils::load_config(console, config_name, unifier_cfg, genotyper_cfg, cfg_txt, cfg_crc32c));
+
+    // bulk load
+    string dbpath = dir + "/GLnexus.DB";
+    vector<pair<string,size_t>> contigs;
+    unique_ptr<KeyValue::DB> db;
+    {
+        phase_meter meter("bulk_load");
+        S(cli::utils::db_init(console, dbpath, gvcfs[0], contigs));
+        S(cli::utils::db_bulk_load(console, mem_budget, threads, gvcfs, dbpath, vector<range>(),
+                                   contigs, &db));
+        S(meter.finish(threads, "gvcf_records", total_records, json));
+    }
+
+    unique_ptr<BCFKeyValueData> data;
+    S(BCFKeyValueData::Open(db.get(), data, mem_budget / 16));
+    service_config svccfg;
+    svccfg.threads = threads;
+    unique_ptr<Service> svc;
+    S(Service::Start(svccfg, *data, *data, svc));
+    string sampleset;
+    S(data->all_samples_sampleset(sampleset));
+
+    vector<range> ranges;
+    for (size_t rid = 0; rid < contigs.size(); rid++) {
+        ranges.push_back(range(rid, 0, contigs[rid].second));
+    }
+
+    // discovery
+    discovered_alleles dsals;
+    unsigned N = 0;
+    {
+        phase_meter meter("discover");
+        S(svc->discover_alleles(sampleset, ranges, N, dsals, unifier_cfg.min_allele_copy_number == 0));
+        S(meter.finish(threads, "gvcf_records", total_records, json));
+    }
+
+    // unification (of all contigs at once, in parallel chunks)
+    vector<unified_site> usites;
+    {
+        phase_meter meter("unify");
+        size_t alleles = dsals.size();
+        unifier_stats ustats;
+        executor pool(threads);
+        S(unified_sites(unifier_cfg, N, dsals, usites, ustats, pool));
+        S(meter.finish(threads, "alleles", alleles, json));
+    }
+
+    // genotyping
+    {
+        phase_meter meter("genotype");
+        S(svc->genotype_sites(genotyper_cfg, sampleset, usites, dir + "/bench.bcf"));
+        S(meter.finish(threads, "genotype_calls", usites.size() * N, json));
+    }
+    return Status::OK();
+}
+
+void help(const char* prog) {
+    cerr << "Usage: " << prog << " [options]" << endl
+         << "Benchmark GLnexus on a synthetic cohort, reporting each phase's throughput and peak memory." << endl << endl
+         << "Options:" << endl
+         << "  --dir DIR, -d DIR              scratch directory (mustn't already exist; default: ./GLnexus.bench)" << endl
+         << "  --samples N, -n N              cohort size (default: 100)" << endl
+         << "  --contigs N, -C N              number of contigs (default: 1)" << endl
+         << "  --length N, -L N               contig length, bp (default: 1000000)" << endl
+         << "  --density X, -D X              cohort variant sites per kbp (default: 1.0)" << endl
+         << "  --band-length N, -B N          mean reference confidence block length, bp (default: 100)" << endl
+         << "  --seed N, -s N                 random seed (default: 42)" << endl
+         << "  --config X, -c X               configuration preset name or .yml filename (default: gatk)" << endl
+         << "  --mem-gbytes X, -m X           memory budget, in gbytes (default: most of system memory)" << endl
+         << "  --threads X, -t X              thread budget (default: all hardware threads)" << endl
+         << "  --json FILE, -j FILE           append a one-line JSON report of each phase to FILE (\"-\" for stdout)" << endl
+         << "  --help, -h                     print this help message" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    spdlog::set_level(spdlog::level::info);
+    spdlog::set_pattern("[%t] %+");
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"dir", required_argument, 0, 'd'},
+        {"samples", required_argument, 0, 'n'},
+        {"contigs", required_argument, 0, 'C'},
+        {"length", required_argument, 0, 'L'},
+        {"density", required_argument, 0, 'D'},
+        {"band-length", required_argument, 0, 'B'},
+        {"seed", required_argument, 0, 's'},
+        {"config", required_argument, 0, 'c'},
+        {"mem-gbytes", required_argument, 0, 'm'},
+        {"threads", required_argument, 0, 't'},
+        {"json", required_argument, 0, 'j'},
+        {0, 0, 0, 0}
+    };
+
+    cohort_spec spec;
+    string dir = "GLnexus.bench", config_name = "gatk", json_filename;
+    size_t mem_budget = 0, threads = 0;
+    int c;
+    while (-1 != (c = getopt_long(argc, argv, "hd:n:C:L:D:B:s:c:m:t:j:", long_options, nullptr))) {
+        switch (c) {
+            case 'd': dir = optarg; break;
+            case 'n': spec.samples = strtoull(optarg, nullptr, 10); break;
+            case 'C': spec.contigs = strtoull(optarg, nullptr, 10); break;
+            case 'L': spec.contig_length = strtoull(optarg, nullptr, 10); break;
+            case 'D': spec.variants_per_kbp = strtod(optarg, nullptr); break;
+            case 'B': spec.mean_band_length = strtoull(optarg, nullptr, 10); break;
+            case 's': spec.seed = strtoull(optarg, nullptr, 10); break;
+            case 'c': config_name = optarg; break;
+            case 'm': mem_budget = strtoull(optarg, nullptr, 10) << 30; break;
+            case 't': threads = strtoull(optarg, nullptr, 10); break;
+            case 'j': json_filename = optarg; break;
+            case 'h':
+            case '?':
+                help(argv[0]);
+                return c == 'h' ? 0 : 1;
+            default:
+                abort();
+        }
+    }
+    if (optind != argc || spec.samples == 0 || spec.contigs == 0 || spec.contig_length < 100 ||
+        !(spec.variants_per_kbp > 0 && spec.variants_per_kbp <= 300) || spec.mean_band_length == 0) {
+        help(argv[0]);
+        return 1;
+    }
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+
+    ofstream json_file;
+    ostream* json = nullptr;
+    if (json_filename == "-") {
+        json = &cout;
+    } else if (!json_filename.empty()) {
+        json_file.open(json_filename, ios::app);
+        if (!json_file.good()) {
+            console->error("Failed to open {}", json_filename);
+            return 1;
+        }
+        json = &json_file;
+    }
+
+    Status s = run(spec, dir, config_name, threads, mem_budget, json);
+    if (s.bad()) {
+        console->error("Benchmark failed: {}", s.str());
+        return 1;
+    }
+    return 0;
+}
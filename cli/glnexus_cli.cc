@@ -12,7 +12,7 @@
 #include "unifier.h"
 #include "BCFKeyValueData.h"
 #include "RocksKeyValue.h"
-#include "ctpl_stl.h"
+#include "executor.h"
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/stdout_sinks.h"
 #include "cli_utils.h"
@@ -45,12 +45,51 @@ static int all_steps(const vector<string> &vcf_files,
                      size_t mem_budget, size_t nr_threads,
                      bool debug,
                      bool iter_compare,
-                     size_t bucket_size) {
+                     size_t bucket_size,
+                     bool adaptive_buckets,
+                     size_t output_shards,
+                     bool compact_ref_bands,
+                     size_t pipeline_depth,
+                     const string &perf_report,
+                     bool numa,
+                     size_t prefetch_distance,
+                     size_t compression_dict_bytes,
+                     bool spill_alleles,
+                     bool sparse,
+                     size_t sample_tile_size) {
     GLnexus::Status s;
     GLnexus::unifier_config unifier_cfg;
     GLnexus::genotyper_config genotyper_cfg;
     string cfg_txt, cfg_crc32c;
 
+    // per-phase performance reports, if requested: begin_phase() notes the
+    // counters at the start of a phase, and end_phase() reports the change
+    auto phase_t0 = std::chrono::steady_clock::now();
+    GLnexus::perf::snapshot phase_perf;
+    map<string,uint64_t> phase_db_stats;
+    auto begin_phase = [&](GLnexus::KeyValue::DB* db) {
+        phase_t0 = std::chrono::steady_clock::now();
+        phase_perf = GLnexus::perf::current();
+        phase_db_stats.clear();
+        if (db) {
+            ignore_retval(db->statistics(phase_db_stats));
+        }
+    };
+    auto end_phase = [&](const string& phase, const map<string,uint64_t>& db_stats) {
+        if (perf_report.empty()) {
+            return GLnexus::Status::OK();
+        }
+        return GLnexus::cli::utils::write_perf_report(perf_report, phase, phase_t0, phase_perf,
+                                                      phase_db_stats, db_stats);
+    };
+    auto db_statistics = [](GLnexus::KeyValue::DB* db) {
+        map<string,uint64_t> ans;
+        if (db) {
+            ignore_retval(db->statistics(ans));
+        }
+        return ans;
+    };
+
     if (vcf_files.empty()) {
         console->error("No source GVCF files specified");
         return 1;
@@ -63,7 +102,7 @@ static int all_steps(const vector<string> &vcf_files,
     // initilize empty database
     vector<pair<string,size_t> > contigs;
     H("initialize database", GLnexus::cli::utils::db_init(console, dbpath, vcf_files[0], contigs,
-                                                          bucket_size));
+                                                          bucket_size, adaptive_buckets));
 
     {
         // sanity check, see that we can get the contigs back
@@ -78,15 +117,23 @@ static int all_steps(const vector<string> &vcf_files,
         nr_threads = std::thread::hardware_concurrency();
     }
 
-    // Load the GVCFs into the database
+    // Load the GVCFs into the database. The database's block cache and the
+    // later steps' caches and results in flight share one memory budget.
+    GLnexus::memory_budget budget(GLnexus::RocksKeyValue::calculate_mem_budget(mem_budget));
     unique_ptr<GLnexus::KeyValue::DB> db;
     {
         // use an empty range filter
         vector<GLnexus::range> ranges;
+        GLnexus::BCFKeyValueData::import_options import_opts;
+        import_opts.compact_ref_bands = compact_ref_bands;
+        import_opts.sample_tile_size = sample_tile_size;
+        begin_phase(nullptr);
         H("bulk load into DB",
-          GLnexus::cli::utils::db_bulk_load(console, mem_budget, nr_threads, vcf_files, dbpath, ranges, contigs, &db, false));
+          GLnexus::cli::utils::db_bulk_load(console, mem_budget, nr_threads, vcf_files, dbpath, ranges, contigs, &db, false,
+                                            import_opts, compression_dict_bytes, &budget));
     }
     assert(db);
+    H("write performance report", end_phase("bulk_load", db_statistics(db.get())));
 
     if (iter_compare) {
         H("compare database iteration methods",
@@ -103,48 +150,123 @@ static int all_steps(const vector<string> &vcf_files,
     } else {
         H("parse the bed file", GLnexus::cli::utils::parse_bed_file(console, bedfilename, contigs, ranges));
     }
-    GLnexus::discovered_alleles dsals;
-    unsigned sample_count = 0;
-    auto nr_threads_m2 = nr_threads > 2 ? nr_threads-2 : 1; // reserve threads for DB bg compactions
-    H("discover alleles",
-      GLnexus::cli::utils::discover_alleles(console, nr_threads_m2, db.get(), ranges, contigs, dsals, sample_count,
-                                            unifier_cfg.min_allele_copy_number == 0));
-    if (debug) {
-        string filename("/tmp/dsals.yml");
-        console->info("Writing discovered alleles as YAML to {}", filename);
-        H("serialize discovered alleles to a file",
-          GLnexus::cli::utils::yaml_write_discovered_alleles_to_file(dsals, contigs, sample_count, filename));
-    }
 
-    // partition dsals by contig to reduce peak memory usage in the unifier
-    std::vector<GLnexus::discovered_alleles> dsals_by_contig(contigs.size());
-    for (auto p = dsals.begin(); p != dsals.end(); dsals.erase(p++)) {
-        UNPAIR(*p, al, dai);
-        assert(al.pos.rid >= 0 && al.pos.rid < contigs.size());
-        dsals_by_contig[al.pos.rid][al] = dai;
+    genotyper_cfg.output_residuals = debug;
+    if (sparse) {
+        genotyper_cfg.output_format = GLnexus::GLnexusOutputFormat::SPARSE;
+    }
+    vector<string> hdr_lines = {
+        ("##GLnexusConfigName="+config_name),
+        ("##GLnexusConfigCRC32C="+cfg_crc32c),
+        ("##GLnexusConfig="+cfg_txt)
+    };
+    auto DX_JOB_ID = std::getenv("DX_JOB_ID");
+    if (DX_JOB_ID) {
+        // if running in DNAnexus, record job ID in header
+        hdr_lines.push_back(string("##DX_JOB_ID=")+DX_JOB_ID);
     }
+    string outfile("-");
+    auto nr_threads_m2 = nr_threads > 2 ? nr_threads-2 : 1; // reserve threads for DB bg compactions
 
-    // unify sites (parallel over dsals_by_contig)
-    ctpl::thread_pool unify_pool(nr_threads_m2);
-    vector<future<GLnexus::Status>> statuses;
-    vector<vector<GLnexus::unified_site>> sites_by_contig(contigs.size());
-    vector<GLnexus::unifier_stats> stats_by_contig(contigs.size());
-    for (size_t i = 0; i < contigs.size(); i++) {
-        statuses.push_back(unify_pool.push([&, i](int tid){
-            return GLnexus::cli::utils::unify_sites(console, unifier_cfg, contigs, dsals_by_contig[i],
-                                                    sample_count, sites_by_contig[i], stats_by_contig[i]);
-        }));
+    if (pipeline_depth) {
+        // discover, unify and genotype contig by contig, overlapping the
+        // steps and never holding the whole cohort's alleles or sites
+        if (debug) {
+            console->warn("Discovered alleles and unified sites aren't written out in pipelined mode");
+        }
+        GLnexus::unifier_stats stats;
+        begin_phase(db.get());
+        H("discover, unify and genotype",
+          GLnexus::cli::utils::discover_unify_genotype(console, mem_budget, nr_threads_m2, db.get(), ranges, contigs,
+                                                       unifier_cfg, genotyper_cfg, hdr_lines, outfile,
+                                                       pipeline_depth, stats, numa, prefetch_distance,
+                                                       &budget));
+        H("write performance report", end_phase("discover_unify_genotype", db_statistics(db.get())));
+        console->info("unified cleanly {} ALT alleles. {} ALT alleles were {} and {} were filtered out on quality thresholds.",
+                      stats.unified_alleles, stats.lost_alleles,
+                      (unifier_cfg.monoallelic_sites_for_lost_alleles ? "additionally included in monoallelic sites" : "lost due to failure to unify"),
+                      stats.filtered_alleles);
+        console->info("Finishing database compaction...");
+        db.reset();
+        return 0;
     }
 
+    unsigned sample_count = 0;
     vector<GLnexus::unified_site> sites;
     GLnexus::unifier_stats stats;
-    for (size_t i = 0; i < contigs.size(); i++) {
-        H("unify sites", statuses[i].get());
-        stats += stats_by_contig[i];
-        auto& sites_i = sites_by_contig[i];
-        sites.insert(sites.end(), make_move_iterator(sites_i.begin()),
-                                  make_move_iterator(sites_i.end()));
-        sites_i.clear();
+    if (spill_alleles) {
+        // discover with bounded memory, spilling the alleles to scratch files
+        // beside the database, and unify them contig by contig as they're
+        // merged back
+        if (debug) {
+            console->warn("Discovered alleles aren't written out with --spill-alleles");
+        }
+        size_t alleles_budget = budget.total() / 4;
+        GLnexus::executor unify_pool(nr_threads_m2);
+        begin_phase(db.get());
+        H("discover alleles and unify sites",
+          GLnexus::cli::utils::discover_alleles_spilling(console, nr_threads_m2, db.get(), ranges, contigs,
+                                                         alleles_budget, dbpath + ".alleles.", sample_count,
+                                                         unifier_cfg.min_allele_copy_number == 0,
+                                                         [&](int, GLnexus::discovered_alleles& dsals) {
+                GLnexus::unifier_stats contig_stats;
+                GLnexus::Status s = GLnexus::cli::utils::unify_sites(console, unifier_cfg, contigs, dsals,
+                                                                     sample_count, sites, contig_stats,
+                                                                     &unify_pool);
+                stats += contig_stats;
+                return s;
+            }, &budget));
+        H("write performance report", end_phase("discover_unify", db_statistics(db.get())));
+    } else {
+        GLnexus::discovered_alleles dsals;
+        begin_phase(db.get());
+        H("discover alleles",
+          GLnexus::cli::utils::discover_alleles(console, nr_threads_m2, db.get(), ranges, contigs, dsals, sample_count,
+                                                unifier_cfg.min_allele_copy_number == 0, &budget));
+        H("write performance report", end_phase("discover", db_statistics(db.get())));
+        if (debug) {
+            string filename("/tmp/dsals.yml");
+            console->info("Writing discovered alleles as YAML to {}", filename);
+            H("serialize discovered alleles to a file",
+              GLnexus::cli::utils::yaml_write_discovered_alleles_to_file(dsals, contigs, sample_count, filename));
+            filename = "/tmp/dsals.cflat";
+            console->info("Writing discovered alleles in binary form to {}", filename);
+            H("serialize discovered alleles to a binary file",
+              GLnexus::cli::utils::capnp_write_discovered_alleles_to_file(dsals, contigs, sample_count, filename));
+        }
+
+        // partition dsals by contig to reduce peak memory usage in the unifier
+        std::vector<GLnexus::discovered_alleles> dsals_by_contig(contigs.size());
+        for (auto& p : dsals) {
+            assert(p.first.pos.rid >= 0 && p.first.pos.rid < contigs.size());
+            dsals_by_contig[p.first.pos.rid].push_back_sorted(move(p));
+        }
+        dsals.clear();
+
+        // unify sites (parallel over dsals_by_contig, and within each contig
+        // over chunks of its alleles, so that the largest contigs don't dominate)
+        begin_phase(nullptr);
+        GLnexus::executor unify_pool(nr_threads_m2);
+        vector<future<GLnexus::Status>> statuses;
+        vector<vector<GLnexus::unified_site>> sites_by_contig(contigs.size());
+        vector<GLnexus::unifier_stats> stats_by_contig(contigs.size());
+        for (size_t i = 0; i < contigs.size(); i++) {
+            statuses.push_back(unify_pool.push([&, i](int tid){
+                return GLnexus::cli::utils::unify_sites(console, unifier_cfg, contigs, dsals_by_contig[i],
+                                                        sample_count, sites_by_contig[i], stats_by_contig[i],
+                                                        &unify_pool);
+            }));
+        }
+
+        for (size_t i = 0; i < contigs.size(); i++) {
+            H("unify sites", statuses[i].get());
+            stats += stats_by_contig[i];
+            auto& sites_i = sites_by_contig[i];
+            sites.insert(sites.end(), make_move_iterator(sites_i.begin()),
+                                      make_move_iterator(sites_i.end()));
+            sites_i.clear();
+        }
+        H("write performance report", end_phase("unify", {}));
     }
     assert(std::is_sorted(sites.begin(), sites.end()));
 
@@ -157,26 +279,23 @@ static int all_steps(const vector<string> &vcf_files,
         console->info("Writing unified sites as YAML to {}", filename);
         H("write unified sites to file",
           GLnexus::cli::utils::write_unified_sites_to_file(sites, contigs, filename));
+        filename = "/tmp/sites.cflat";
+        console->info("Writing unified sites in binary form to {}", filename);
+        H("write unified sites to a binary file",
+          GLnexus::cli::utils::capnp_write_unified_sites_to_file(sites, contigs, filename));
     }
 
     console->info("Finishing database compaction...");
     db.reset();
 
     // genotype
-    genotyper_cfg.output_residuals = debug;
-    vector<string> hdr_lines = {
-        ("##GLnexusConfigName="+config_name),
-        ("##GLnexusConfigCRC32C="+cfg_crc32c),
-        ("##GLnexusConfig="+cfg_txt)
-    };
-    auto DX_JOB_ID = std::getenv("DX_JOB_ID");
-    if (DX_JOB_ID) {
-        // if running in DNAnexus, record job ID in header
-        hdr_lines.push_back(string("##DX_JOB_ID=")+DX_JOB_ID);
-    }
-    string outfile("-");
+    map<string,uint64_t> genotype_db_stats;
+    begin_phase(nullptr);
     H("genotype",
-      GLnexus::cli::utils::genotype(console, mem_budget, nr_threads, dbpath, genotyper_cfg, sites, hdr_lines, outfile));
+      GLnexus::cli::utils::genotype(console, mem_budget, nr_threads, dbpath, genotyper_cfg, sites, hdr_lines, outfile,
+                                    output_shards, &genotype_db_stats, numa,
+                                    prefetch_distance));
+    H("write performance report", end_phase("genotype", genotype_db_stats));
 
     return 0;
 }
@@ -193,10 +312,30 @@ void help(const char* prog) {
 
          << "  --more-PL, -P                  include PL from reference bands and other cases omitted by default" << endl
          << "  --squeeze, -S                  reduce pVCF size by suppressing detail in cells derived from reference bands" << endl
-         << "  --trim-uncalled-alleles, -a    remove alleles with no output GT calls in postprocessing" << endl << endl
+         << "  --trim-uncalled-alleles, -a    remove alleles with no output GT calls in postprocessing" << endl
+         << "  --sparse                       emit sparse VCF text instead of BCF: each record's most frequent cells and the" << endl
+         << "                                 others by sample index (see ##GLnexusSparse in its header; glnexus_dist desparse decodes it)" << endl
+         << "  --compact-ref-bands, -r        merge runs of adjacent, similar reference bands as they're loaded (smaller" << endl
+         << "                                 database and faster I/O, at the cost of GQ/DP resolution in reference calls)" << endl
+         << "  --adaptive-buckets, -A         size each contig's database buckets according to the density of the first gVCF's" << endl
+         << "                                 records on it, rather than uniformly" << endl
+         << "  --sample-tiles N               store each multi-sample gVCF as tiles of N consecutive samples, so that reading" << endl
+         << "                                 a subset of the samples decodes only their tiles (default: 0, untiled)" << endl
+         << "  --zstd-dict KB, -z KB          compress the database buckets with Zstandard dictionaries of this size, trained" << endl
+         << "                                 on them as they're loaded (default: 0, disabled)" << endl << endl
 
          << "  --mem-gbytes X, -m X           memory budget, in gbytes (default: most of system memory)" << endl
-         << "  --threads X, -t X              thread budget (default: all hardware threads)" << endl << endl
+         << "  --threads X, -t X              thread budget (default: all hardware threads)" << endl
+         << "  --output-shards N, -o N        genotype N shards of the sites concurrently, each with its own writer (default: 1)" << endl
+         << "  --spill-alleles, -s            hold at most a quarter of the memory budget of discovered alleles, spilling them" << endl
+         << "                                 to scratch files beside the database and merging them back contig by contig" << endl
+         << "  --pipeline N, -p N             discover, unify and genotype contig by contig, N contigs at a time, overlapping the" << endl
+         << "                                 steps and freeing each contig's intermediate results as soon as it's written" << endl
+         << "  --numa                         on a multi-socket host, divide the genotyping threads and cache among the NUMA" << endl
+         << "                                 nodes, each working on its own shards of the sites" << endl
+         << "  --prefetch N, -F N             read the database buckets N site groups ahead of the genotyping, on separate I/O" << endl
+         << "                                 threads (default: 0, disabled)" << endl
+         << "  --perf-report FILE             append a one-line JSON report of each phase's performance counters to FILE" << endl << endl
 
          << "  --help, -h                     print this help message" << endl
          << endl << "Configuration presets:" << endl;
@@ -235,8 +374,19 @@ int main(int argc, char *argv[]) {
         {"mem-gbytes", required_argument, 0, 'm'},
         {"threads", required_argument, 0, 't'},
         {"bucket_size", required_argument, 0, 'x'},
+        {"adaptive-buckets", no_argument, 0, 'A'},
         {"debug", no_argument, 0, 'g'},
         {"iter_compare", no_argument, 0, 'i'},
+        {"output-shards", required_argument, 0, 'o'},
+        {"compact-ref-bands", no_argument, 0, 'r'},
+        {"pipeline", required_argument, 0, 'p'},
+        {"perf-report", required_argument, 0, 'R'},
+        {"numa", no_argument, 0, 'N'},
+        {"prefetch", required_argument, 0, 'F'},
+        {"zstd-dict", required_argument, 0, 'z'},
+        {"spill-alleles", no_argument, 0, 's'},
+        {"sparse", no_argument, 0, 'E'},
+        {"sample-tiles", required_argument, 0, 'T'},
         {0, 0, 0, 0}
     };
 
@@ -249,11 +399,17 @@ int main(int argc, char *argv[]) {
     bool list_of_files = false;
     bool debug = false;
     bool iter_compare = false;
-    string bedfilename;
-    size_t mem_budget = 0, nr_threads = 0;
+    bool compact_ref_bands = false;
+    bool adaptive_buckets = false;
+    bool numa = false;
+    bool spill_alleles = false;
+    bool sparse = false;
+    string bedfilename, perf_report;
+    size_t mem_budget = 0, nr_threads = 0, output_shards = 1, pipeline_depth = 0, prefetch_distance = 0;
+    size_t compression_dict_bytes = 0, sample_tile_size = 0;
     size_t bucket_size = GLnexus::BCFKeyValueData::default_bucket_size;
 
-    while (-1 != (c = getopt_long(argc, argv, "hPSadil:b:x:m:t:c:",
+    while (-1 != (c = getopt_long(argc, argv, "hPSadil:rANsb:x:m:t:c:o:p:R:F:z:",
                                   long_options, nullptr))) {
         switch (c) {
             case 'd':
@@ -292,6 +448,25 @@ int main(int argc, char *argv[]) {
                 debug = true;
                 break;
 
+            case 'r':
+                compact_ref_bands = true;
+                break;
+
+            case 'A':
+                adaptive_buckets = true;
+                break;
+
+            case 'N':
+                numa = true;
+                break;
+
+            case 's':
+                spill_alleles = true;
+                break;
+            case 'E':
+                sparse = true;
+                break;
+
             case 'h':
             case '?':
                 help(argv[0]);
@@ -327,6 +502,55 @@ int main(int argc, char *argv[]) {
                 }
                 break;
 
+            case 'o':
+                output_shards = strtoull(optarg, nullptr, 10);
+                if (output_shards == 0 || output_shards > 1024) {
+                    cerr << "invalid --output-shards" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'R':
+                perf_report = string(optarg);
+                if (perf_report.empty()) {
+                    cerr << "invalid --perf-report filename" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'p':
+                pipeline_depth = strtoull(optarg, nullptr, 10);
+                if (pipeline_depth == 0 || pipeline_depth > 1024) {
+                    cerr << "invalid --pipeline" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'F':
+                prefetch_distance = strtoull(optarg, nullptr, 10);
+                if (prefetch_distance == 0 || prefetch_distance > 1024) {
+                    cerr << "invalid --prefetch" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'z':
+                compression_dict_bytes = strtoull(optarg, nullptr, 10);
+                if (compression_dict_bytes == 0 || compression_dict_bytes > 16*1024) {
+                    cerr << "invalid --zstd-dict" << endl;
+                    return 1;
+                }
+                compression_dict_bytes <<= 10;
+                break;
+
+            case 'T':
+                sample_tile_size = strtoull(optarg, nullptr, 10);
+                if (sample_tile_size == 0 || sample_tile_size > 1000000) {
+                    cerr << "invalid --sample-tiles" << endl;
+                    return 1;
+                }
+                break;
+
             default:
                 abort ();
         }
@@ -358,5 +582,7 @@ int main(int argc, char *argv[]) {
     }
 
     return all_steps(vcf_files, bedfilename, dbpath, config_name, more_PL, squeeze, trim_uncalled_alleles,
-                     mem_budget, nr_threads, debug, iter_compare, bucket_size);
+                     mem_budget, nr_threads, debug, iter_compare, bucket_size, adaptive_buckets, output_shards,
+                     compact_ref_bands, pipeline_depth, perf_report, numa, prefetch_distance,
+                     compression_dict_bytes, spill_alleles, sparse, sample_tile_size);
 }
@@ -0,0 +1,748 @@
+// Distributed GLnexus: the steps of glnexus_cli divided into range shards
+// processed by separate worker hosts, with a coordinator splitting the ranges
+// and combining the shards' results (see cli_utils.h). The steps exchange
+// files named after a common prefix, which the orchestration (e.g. a DNAnexus
+// workflow) moves between the hosts:
+//
+//   coordinator: init, [load,] split         -> PREFIX.shardI.bed
+//   worker I:    [load --bed PREFIX.shardI.bed,] discover
+//                                            -> PREFIX.shardI.dsals.cflat
+//   coordinator: unify                       -> PREFIX.shardI.sites.cflat
+//   worker I:    genotype                    -> PREFIX.shardI.bcf
+//   coordinator: concat                      -> pVCF
+//
+// Each worker has either a copy of the database loaded by the coordinator, or
+// its own partition holding just its shard's ranges, loaded into a copy of the
+// initialized (empty) database. On preemptible hosts, genotype --checkpoint N
+// commits the worker's progress every N sites, so that the worker restarted
+// on the same files resumes rather than starting over.
+//
+// Alternatively the loading itself can be divided by gVCF: each host loads a
+// subset of them into its own copy of the initialized database, and then
+//
+//   coordinator: merge DB...                 -> the complete database
+//
+// combines those without re-reading any gVCF.
+//
+// As the cohort grows, gVCFs loaded into the database since a run PRIOR may be
+// added to its output without genotyping the prior samples afresh at sites
+// left unchanged, for each shard:
+//
+//   worker I:    [load,] grow PRIOR PREFIX   -> PREFIX.shardI.{bed,dsals.cflat,sites.cflat,bcf}
+//   coordinator: concat PREFIX               -> pVCF
+//
+// Each shard's sites are unified from its own alleles alone.
+//
+// Once loaded, the coordinator may also write an image of the database
+//
+//   coordinator: image FILE                  -> FILE
+//
+// for the workers to discover and genotype from, memory-mapping it, by
+// passing --dir FILE.
+//
+// Output configured as SPARSE (.svcf) is decoded to VCF or BCF by
+//
+//   any host:    desparse SVCF [OUTPUT]      -> VCF (or BCF)
+//
+// Lastly, a host may keep the database open, its caches warm, to answer
+// on-demand queries of small ranges (e.g. genotype a gene) with low latency:
+//
+//   server:      serve SOCKET                (until interrupted)
+//   client:      query SOCKET REQUEST...     -> the output, on standard output
+//
+// REQUEST is "discover RANGES [SAMPLESET]" or "genotype RANGES [SAMPLESET]"
+// (see cli::utils::serve).
+
+#include <iostream>
+#include <fstream>
+#include <getopt.h>
+#include <csignal>
+#include <cstdlib>
+#include <thread>
+#include "service.h"
+#include "unifier.h"
+#include "BCFKeyValueData.h"
+#include "executor.h"
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/stdout_sinks.h"
+#include "cli_utils.h"
+
+using namespace std;
+
+auto console = spdlog::stderr_logger_mt("GLnexus");
+GLnexus::Status s;
+#define H(desc,expr) \
+    s = expr; \
+    if (s.bad()) { \
+        console->error("Failed to {}: {}", desc, s.str()); \
+        return 1; \
+    }
+
+struct options {
+    string dbpath = "GLnexus.DB";
+    string config_name = "gatk";
+    string bedfilename;
+    bool more_PL = false, squeeze = false, trim_uncalled_alleles = false;
+    bool list_of_files = false, adaptive_buckets = false;
+    size_t mem_budget = 0, nr_threads = 0, prefetch_distance = 0, compression_dict_bytes = 0;
+    size_t shards = 0, checkpoint_sites = 0, sample_tile_size = 0;
+    size_t max_queries = 4;
+    uint64_t deadline_ms = 0;
+    long shard = -1;
+    size_t bucket_size = GLnexus::BCFKeyValueData::default_bucket_size;
+    vector<string> args;
+};
+
+static string shard_filename(const string& prefix, size_t i, const string& ext) {
+    return prefix + ".shard" + to_string(i) + ext;
+}
+
+// the output file extension for the genotyper configuration
+static string output_ext(const GLnexus::genotyper_config& cfg) {
+    switch (cfg.output_format) {
+        case GLnexus::GLnexusOutputFormat::VCF: return ".vcf";
+        case GLnexus::GLnexusOutputFormat::SPARSE: return ".svcf";
+        default: return ".bcf";
+    }
+}
+
+static int load_config(const options& opts, GLnexus::unifier_config& unifier_cfg,
+                       GLnexus::genotyper_config& genotyper_cfg, vector<string>& hdr_lines) {
+    string cfg_txt, cfg_crc32c;
+    H("load unifier/genotyper configuration",
+      GLnexus::cli::utils::load_config(console, opts.config_name, unifier_cfg, genotyper_cfg, cfg_txt, cfg_crc32c,
+                                       opts.more_PL, opts.squeeze, opts.trim_uncalled_alleles));
+    hdr_lines = {
+        ("##GLnexusConfigName="+opts.config_name),
+        ("##GLnexusConfigCRC32C="+cfg_crc32c),
+        ("##GLnexusConfig="+cfg_txt)
+    };
+    auto DX_JOB_ID = std::getenv("DX_JOB_ID");
+    if (DX_JOB_ID) {
+        hdr_lines.push_back(string("##DX_JOB_ID=")+DX_JOB_ID);
+    }
+    return 0;
+}
+
+// init GVCF: initialize an empty database with the contigs of the exemplar gVCF
+static int init(const options& opts) {
+    if (opts.args.size() != 1) {
+        console->error("init: expected one exemplar gVCF");
+        return 1;
+    }
+    vector<pair<string,size_t>> contigs;
+    H("initialize database", GLnexus::cli::utils::db_init(console, opts.dbpath, opts.args[0], contigs,
+                                                          opts.bucket_size, opts.adaptive_buckets));
+    return 0;
+}
+
+// load GVCF...: load gVCFs into the initialized database (just the records
+// overlapping the --bed ranges, if given, to make a worker's partition)
+static int load(const options& opts) {
+    vector<string> vcf_files;
+    if (opts.list_of_files) {
+        for (const string& fn : opts.args) {
+            string gvcf;
+            ifstream infile(fn);
+            while (getline(infile, gvcf)) {
+                vcf_files.push_back(gvcf);
+            }
+            if (infile.bad() || !infile.eof()) {
+                H("read input file list", GLnexus::Status::IOError("reading", fn));
+            }
+        }
+    } else {
+        vcf_files = opts.args;
+    }
+    if (vcf_files.empty()) {
+        console->error("load: no source GVCF files specified");
+        return 1;
+    }
+
+    vector<pair<string,size_t>> contigs;
+    H("read the contigs from the database",
+      GLnexus::cli::utils::db_get_contigs(console, opts.dbpath, contigs));
+    vector<GLnexus::range> ranges;
+    if (!opts.bedfilename.empty()) {
+        H("parse the bed file", GLnexus::cli::utils::parse_bed_file(console, opts.bedfilename, contigs, ranges));
+    }
+    size_t nr_threads = opts.nr_threads ? opts.nr_threads : std::thread::hardware_concurrency();
+    GLnexus::BCFKeyValueData::import_options import_opts;
+    import_opts.sample_tile_size = opts.sample_tile_size;
+    H("bulk load into DB",
+      GLnexus::cli::utils::db_bulk_load(console, opts.mem_budget, nr_threads, vcf_files, opts.dbpath,
+                                        ranges, contigs, nullptr, false, import_opts,
+                                        opts.compression_dict_bytes));
+    return 0;
+}
+
+// merge DB...: merge databases loaded from other subsets of the gVCFs (each
+// into a copy of the same initialized database) into the --dir database
+static int merge(const options& opts) {
+    if (opts.args.empty()) {
+        console->error("merge: no source databases specified");
+        return 1;
+    }
+    size_t nr_threads = opts.nr_threads ? opts.nr_threads : std::thread::hardware_concurrency();
+    H("merge databases",
+      GLnexus::cli::utils::db_merge(console, opts.mem_budget, nr_threads, opts.dbpath, opts.args,
+                                    opts.compression_dict_bytes));
+    return 0;
+}
+
+// image FILE: write an immutable, memory-mappable image of the --dir
+// database, which the workers may then use in its place (--dir FILE)
+static int image(const options& opts) {
+    if (opts.args.size() != 1) {
+        console->error("image: expected FILE");
+        return 1;
+    }
+    H("write database image", GLnexus::cli::utils::db_image(console, opts.dbpath, opts.args[0]));
+    return 0;
+}
+
+// split PREFIX: divide the --bed ranges (or the full length of all contigs)
+// into up to --shards shards, writing PREFIX.shardI.bed and the number of
+// shards on standard output
+static int split(const options& opts) {
+    if (opts.args.size() != 1 || opts.shards == 0) {
+        console->error("split: expected --shards N and PREFIX");
+        return 1;
+    }
+    const string& prefix = opts.args[0];
+    vector<pair<string,size_t>> contigs;
+    H("read the contigs from the database",
+      GLnexus::cli::utils::db_get_contigs(console, opts.dbpath, contigs));
+    vector<GLnexus::range> ranges;
+    if (opts.bedfilename.empty()) {
+        for (int rid = 0; rid < contigs.size(); ++rid) {
+            ranges.push_back(GLnexus::range(rid, 0, contigs[rid].second));
+        }
+    } else {
+        H("parse the bed file", GLnexus::cli::utils::parse_bed_file(console, opts.bedfilename, contigs, ranges));
+    }
+
+    vector<vector<GLnexus::range>> shards;
+    H("split the ranges", GLnexus::cli::utils::split_ranges(ranges, opts.shards, shards));
+    for (size_t i = 0; i < shards.size(); i++) {
+        H("write shard bed file",
+          GLnexus::cli::utils::write_bed_file(shards[i], contigs, shard_filename(prefix, i, ".bed")));
+    }
+    console->info("split {} ranges into {} shards", ranges.size(), shards.size());
+    cout << shards.size() << endl;
+    return 0;
+}
+
+// discover PREFIX: discover the alleles in shard --shard I, writing
+// PREFIX.shardI.dsals.cflat
+static int discover(const options& opts) {
+    if (opts.args.size() != 1 || opts.shard < 0) {
+        console->error("discover: expected --shard I and PREFIX");
+        return 1;
+    }
+    const string& prefix = opts.args[0];
+    GLnexus::unifier_config unifier_cfg;
+    GLnexus::genotyper_config genotyper_cfg;
+    vector<string> hdr_lines;
+    if (load_config(opts, unifier_cfg, genotyper_cfg, hdr_lines)) {
+        return 1;
+    }
+
+    vector<pair<string,size_t>> contigs;
+    H("read the contigs from the database",
+      GLnexus::cli::utils::db_get_contigs(console, opts.dbpath, contigs));
+    vector<GLnexus::range> ranges;
+    H("parse the shard's bed file",
+      GLnexus::cli::utils::parse_bed_file(console, shard_filename(prefix, opts.shard, ".bed"), contigs, ranges));
+
+    GLnexus::discovered_alleles dsals;
+    unsigned sample_count = 0;
+    H("discover alleles",
+      GLnexus::cli::utils::discover_alleles(console, opts.mem_budget, opts.nr_threads, opts.dbpath, ranges,
+                                            contigs, dsals, sample_count,
+                                            unifier_cfg.min_allele_copy_number == 0));
+    H("write discovered alleles",
+      GLnexus::cli::utils::capnp_write_discovered_alleles_to_file(dsals, contigs, sample_count,
+                                                                  shard_filename(prefix, opts.shard, ".dsals.cflat")));
+    return 0;
+}
+
+// unify PREFIX: merge the --shards shards' discovered alleles and unify the
+// sites, writing each shard's to PREFIX.shardI.sites.cflat
+static int unify(const options& opts) {
+    if (opts.args.size() != 1 || opts.shards == 0) {
+        console->error("unify: expected --shards N and PREFIX");
+        return 1;
+    }
+    const string& prefix = opts.args[0];
+    GLnexus::unifier_config unifier_cfg;
+    GLnexus::genotyper_config genotyper_cfg;
+    vector<string> hdr_lines;
+    if (load_config(opts, unifier_cfg, genotyper_cfg, hdr_lines)) {
+        return 1;
+    }
+
+    vector<pair<string,size_t>> contigs;
+    H("read the contigs from the database",
+      GLnexus::cli::utils::db_get_contigs(console, opts.dbpath, contigs));
+    vector<vector<GLnexus::range>> shards(opts.shards);
+    vector<string> dsals_filenames;
+    for (size_t i = 0; i < opts.shards; i++) {
+        H("parse the shard's bed file",
+          GLnexus::cli::utils::parse_bed_file(console, shard_filename(prefix, i, ".bed"), contigs, shards[i]));
+        dsals_filenames.push_back(shard_filename(prefix, i, ".dsals.cflat"));
+    }
+
+    GLnexus::discovered_alleles dsals;
+    unsigned sample_count = 0;
+    H("merge the shards' discovered alleles",
+      GLnexus::cli::utils::merge_discovered_alleles_files(dsals_filenames, contigs, dsals, sample_count));
+
+    // unify sites contig by contig, as in glnexus_cli
+    std::vector<GLnexus::discovered_alleles> dsals_by_contig(contigs.size());
+    for (auto& p : dsals) {
+        assert(p.first.pos.rid >= 0 && p.first.pos.rid < contigs.size());
+        dsals_by_contig[p.first.pos.rid].push_back_sorted(move(p));
+    }
+    dsals.clear();
+    size_t nr_threads = opts.nr_threads ? opts.nr_threads : std::thread::hardware_concurrency();
+    GLnexus::executor unify_pool(nr_threads);
+    vector<GLnexus::unified_site> sites;
+    GLnexus::unifier_stats stats;
+    for (size_t i = 0; i < contigs.size(); i++) {
+        GLnexus::unifier_stats stats_i;
+        H("unify sites",
+          GLnexus::cli::utils::unify_sites(console, unifier_cfg, contigs, dsals_by_contig[i], sample_count,
+                                           sites, stats_i, &unify_pool));
+        stats += stats_i;
+    }
+    console->info("unified to {} sites cleanly with {} ALT alleles. {} ALT alleles were {} and {} were filtered out on quality thresholds.",
+                  sites.size(), stats.unified_alleles, stats.lost_alleles,
+                  (unifier_cfg.monoallelic_sites_for_lost_alleles ? "additionally included in monoallelic sites" : "lost due to failure to unify"),
+                  stats.filtered_alleles);
+
+    vector<vector<GLnexus::unified_site>> sites_by_shard;
+    H("divide the sites among the shards", GLnexus::cli::utils::split_sites(sites, shards, sites_by_shard));
+    for (size_t i = 0; i < opts.shards; i++) {
+        H("write the shard's unified sites",
+          GLnexus::cli::utils::capnp_write_unified_sites_to_file(sites_by_shard[i], contigs,
+                                                                 shard_filename(prefix, i, ".sites.cflat")));
+    }
+    return 0;
+}
+
+// genotype PREFIX: genotype shard --shard I, writing PREFIX.shardI.bcf (.vcf, .svcf)
+static int genotype(const options& opts) {
+    if (opts.args.size() != 1 || opts.shard < 0) {
+        console->error("genotype: expected --shard I and PREFIX");
+        return 1;
+    }
+    const string& prefix = opts.args[0];
+    GLnexus::unifier_config unifier_cfg;
+    GLnexus::genotyper_config genotyper_cfg;
+    vector<string> hdr_lines;
+    if (load_config(opts, unifier_cfg, genotyper_cfg, hdr_lines)) {
+        return 1;
+    }
+
+    vector<pair<string,size_t>> contigs;
+    H("read the contigs from the database",
+      GLnexus::cli::utils::db_get_contigs(console, opts.dbpath, contigs));
+    vector<GLnexus::unified_site> sites;
+    {
+        string filename = shard_filename(prefix, opts.shard, ".sites.cflat");
+        ifstream ifs(filename, std::ifstream::in | std::ifstream::binary);
+        if (!ifs.good()) {
+            H("read the shard's unified sites", GLnexus::Status::IOError("could not open file for reading", filename));
+        }
+        H("read the shard's unified sites", GLnexus::cli::utils::unified_sites_of_capnp_stream(ifs, contigs, sites));
+    }
+
+    H("genotype",
+      GLnexus::cli::utils::genotype_shard(console, opts.mem_budget, opts.nr_threads, opts.dbpath, genotyper_cfg,
+                                          sites, hdr_lines, opts.shard,
+                                          shard_filename(prefix, opts.shard, output_ext(genotyper_cfg)),
+                                          opts.prefetch_distance, opts.checkpoint_sites));
+    return 0;
+}
+
+// grow PRIOR PREFIX: update shard --shard I of run PRIOR for the samples since
+// loaded into the database (see cli::utils::genotype_incremental), writing
+// PREFIX.shardI.bcf (.vcf) along with the files a further grow will need
+static int grow(const options& opts) {
+    if (opts.args.size() != 2 || opts.shard < 0) {
+        console->error("grow: expected --shard I, PRIOR and PREFIX");
+        return 1;
+    }
+    const string& prior = opts.args[0];
+    const string& prefix = opts.args[1];
+    GLnexus::unifier_config unifier_cfg;
+    GLnexus::genotyper_config genotyper_cfg;
+    vector<string> hdr_lines;
+    if (load_config(opts, unifier_cfg, genotyper_cfg, hdr_lines)) {
+        return 1;
+    }
+
+    vector<pair<string,size_t>> contigs;
+    H("read the contigs from the database",
+      GLnexus::cli::utils::db_get_contigs(console, opts.dbpath, contigs));
+    vector<GLnexus::range> ranges;
+    H("parse the shard's bed file",
+      GLnexus::cli::utils::parse_bed_file(console, shard_filename(prior, opts.shard, ".bed"), contigs, ranges));
+    H("write the shard's bed file",
+      GLnexus::cli::utils::write_bed_file(ranges, contigs, shard_filename(prefix, opts.shard, ".bed")));
+
+    const string ext = output_ext(genotyper_cfg);
+    GLnexus::unifier_stats stats;
+    H("genotype incrementally",
+      GLnexus::cli::utils::genotype_incremental(console, opts.mem_budget, opts.nr_threads, opts.dbpath,
+                                                ranges, contigs, unifier_cfg, genotyper_cfg, hdr_lines,
+                                                shard_filename(prior, opts.shard, ".dsals.cflat"),
+                                                shard_filename(prior, opts.shard, ".sites.cflat"),
+                                                shard_filename(prior, opts.shard, ext),
+                                                shard_filename(prefix, opts.shard, ".dsals.cflat"),
+                                                shard_filename(prefix, opts.shard, ".sites.cflat"),
+                                                shard_filename(prefix, opts.shard, ext), stats));
+    return 0;
+}
+
+// concat PREFIX [OUTPUT]: concatenate the --shards shards' outputs into
+// OUTPUT (default: standard output)
+static int concat(const options& opts) {
+    if (opts.args.empty() || opts.args.size() > 2 || opts.shards == 0) {
+        console->error("concat: expected --shards N, PREFIX and optionally OUTPUT");
+        return 1;
+    }
+    const string& prefix = opts.args[0];
+    GLnexus::unifier_config unifier_cfg;
+    GLnexus::genotyper_config genotyper_cfg;
+    vector<string> hdr_lines;
+    if (load_config(opts, unifier_cfg, genotyper_cfg, hdr_lines)) {
+        return 1;
+    }
+
+    vector<string> parts;
+    for (size_t i = 0; i < opts.shards; i++) {
+        parts.push_back(shard_filename(prefix, i, output_ext(genotyper_cfg)));
+    }
+    string outfile = opts.args.size() == 2 ? opts.args[1] : "-";
+    H("concatenate the shards", GLnexus::Service::concatenate_shards(genotyper_cfg, parts, outfile));
+    return 0;
+}
+
+// desparse SVCF [OUTPUT]: decode SPARSE output into OUTPUT (default:
+// standard output), as BCF if its name ends in .bcf, otherwise VCF
+static int desparse(const options& opts) {
+    if (opts.args.empty() || opts.args.size() > 2) {
+        console->error("desparse: expected SVCF and optionally OUTPUT");
+        return 1;
+    }
+    GLnexus::unifier_config unifier_cfg;
+    GLnexus::genotyper_config genotyper_cfg;
+    vector<string> hdr_lines;
+    if (load_config(opts, unifier_cfg, genotyper_cfg, hdr_lines)) {
+        return 1;
+    }
+
+    string outfile = opts.args.size() == 2 ? opts.args[1] : "-";
+    genotyper_cfg.output_format = outfile.size() > 4 && outfile.substr(outfile.size()-4) == ".bcf"
+                                    ? GLnexus::GLnexusOutputFormat::BCF : GLnexus::GLnexusOutputFormat::VCF;
+    genotyper_cfg.output_index = false;
+    H("decode the sparse output", GLnexus::Service::sparse_to_vcf(genotyper_cfg, opts.args[0], outfile));
+    return 0;
+}
+
+static std::atomic<bool> serve_stop(false);
+
+static void stop_serving(int) {
+    serve_stop = true;
+}
+
+// serve SOCKET: answer queries on the Unix domain socket until interrupted
+static int serve(const options& opts) {
+    if (opts.args.size() != 1) {
+        console->error("serve: expected SOCKET");
+        return 1;
+    }
+    GLnexus::unifier_config unifier_cfg;
+    GLnexus::genotyper_config genotyper_cfg;
+    vector<string> hdr_lines;
+    if (load_config(opts, unifier_cfg, genotyper_cfg, hdr_lines)) {
+        return 1;
+    }
+    signal(SIGINT, stop_serving);
+    signal(SIGTERM, stop_serving);
+    H("serve queries",
+      GLnexus::cli::utils::serve(console, opts.mem_budget, opts.nr_threads, opts.dbpath, unifier_cfg,
+                                 genotyper_cfg, hdr_lines, opts.prefetch_distance, opts.args[0],
+                                 opts.max_queries, opts.deadline_ms, serve_stop));
+    return 0;
+}
+
+// query SOCKET REQUEST...: send a request to the server, writing its output
+// on standard output
+static int query(const options& opts) {
+    if (opts.args.size() < 2) {
+        console->error("query: expected SOCKET and REQUEST");
+        return 1;
+    }
+    string request;
+    for (size_t i = 1; i < opts.args.size(); i++) {
+        request += (i > 1 ? " " : "") + opts.args[i];
+    }
+    H("query", GLnexus::cli::utils::query_server(opts.args[0], request, cout));
+    return 0;
+}
+
+void help(const char* prog) {
+    cout << "Usage: " << prog << " COMMAND [options] ARGS..." << endl
+         << "Run GLnexus across hosts, each genotyping shards of the ranges." << endl << endl
+         << "Commands (see the top of glnexus_dist.cc for the workflow):" << endl
+         << "  init GVCF                      initialize an empty database with the contigs of an exemplar gVCF" << endl
+         << "  load GVCF...                   load gVCFs into the database (with --bed: just those ranges, for a partition)" << endl
+         << "  merge DB...                    merge databases loaded with other gVCFs (copies of the same initialized one)" << endl
+         << "  image FILE                     write an immutable image of the database, usable in its place by discover & genotype" << endl
+         << "  split PREFIX                   divide the ranges into --shards, writing PREFIX.shardI.bed; prints how many" << endl
+         << "  discover PREFIX                discover alleles in shard --shard I" << endl
+         << "  unify PREFIX                   merge the --shards shards' alleles and unify the sites, dividing them among the shards" << endl
+         << "  genotype PREFIX                genotype shard --shard I, writing PREFIX.shardI.bcf (.vcf or .svcf if so configured)" << endl
+         << "  grow PRIOR PREFIX              add the samples loaded since run PRIOR to its shard --shard I, reusing the prior" << endl
+         << "                                 genotypes at unchanged sites; writes PREFIX.shardI.{bed,dsals.cflat,sites.cflat,bcf}" << endl
+         << "  concat PREFIX [OUTPUT]         concatenate the --shards shards' outputs (default: to standard output)" << endl
+         << "  desparse SVCF [OUTPUT]         decode SPARSE output to VCF, or BCF if OUTPUT ends in .bcf (default: VCF to standard output)" << endl
+         << "  serve SOCKET                   keep the database open, answering queries on the Unix socket until interrupted" << endl
+         << "  query SOCKET REQUEST...        send a request (discover|genotype RANGES [SAMPLESET]) to the server" << endl << endl
+
+         << "Options:" << endl
+         << "  --dir DIR, -d DIR              database path (default: ./GLnexus.DB)" << endl
+         << "  --config X, -c X               configuration preset name or .yml filename (default: gatk)" << endl
+         << "  --bed FILE, -b FILE            three-column BED file with ranges to analyze (split) or load (load)" << endl
+         << "  --shards N, -n N               number of shards" << endl
+         << "  --shard I, -i I                this worker's shard number, from 0" << endl
+         << "  --list, -l                     expect given files to contain lists of gVCF filenames, one per line" << endl
+         << "  --more-PL, -P                  as for glnexus_cli" << endl
+         << "  --squeeze, -S                  as for glnexus_cli" << endl
+         << "  --trim-uncalled-alleles, -a    as for glnexus_cli" << endl
+         << "  --bucket_size N, -x N          database bucket size (init)" << endl
+         << "  --adaptive-buckets, -A         as for glnexus_cli (init)" << endl
+         << "  --mem-gbytes X, -m X           memory budget, in gbytes (default: most of system memory)" << endl
+         << "  --threads X, -t X              thread budget (default: all hardware threads)" << endl
+         << "  --prefetch N, -F N             as for glnexus_cli (genotype)" << endl
+         << "  --checkpoint N, -k N           genotype in resumable chunks of N sites, committing each to PREFIX.shardI.bcf.checkpoint;" << endl
+         << "                                 rerunning after an interruption skips those done (genotype)" << endl
+         << "  --queries N, -q N              number of queries answered concurrently (serve; default: 4)" << endl
+         << "  --deadline MS, -D MS           abort queries taking longer than this many milliseconds (serve)" << endl
+         << "  --zstd-dict KB, -z KB          as for glnexus_cli (load, merge)" << endl
+         << "  --sample-tiles N               as for glnexus_cli (load)" << endl
+         << "  --help, -h                     print this help message" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    spdlog::set_level(spdlog::level::info);
+    spdlog::set_pattern("[%t] %+");
+    GLnexus::cli::utils::detect_jemalloc(console);
+
+    if (argc < 2) {
+        help(argv[0]);
+        return 1;
+    }
+    const string command = argv[1];
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {"dir", required_argument, 0, 'd'},
+        {"config", required_argument, 0, 'c'},
+        {"bed", required_argument, 0, 'b'},
+        {"shards", required_argument, 0, 'n'},
+        {"shard", required_argument, 0, 'i'},
+        {"list", no_argument, 0, 'l'},
+        {"more-PL", no_argument, 0, 'P'},
+        {"squeeze", no_argument, 0, 'S'},
+        {"trim-uncalled-alleles", no_argument, 0, 'a'},
+        {"bucket_size", required_argument, 0, 'x'},
+        {"adaptive-buckets", no_argument, 0, 'A'},
+        {"mem-gbytes", required_argument, 0, 'm'},
+        {"threads", required_argument, 0, 't'},
+        {"prefetch", required_argument, 0, 'F'},
+        {"checkpoint", required_argument, 0, 'k'},
+        {"queries", required_argument, 0, 'q'},
+        {"deadline", required_argument, 0, 'D'},
+        {"zstd-dict", required_argument, 0, 'z'},
+        {"sample-tiles", required_argument, 0, 'T'},
+        {0, 0, 0, 0}
+    };
+
+    options opts;
+    int c;
+    // parse the options following the command
+    optind = 2;
+    while (-1 != (c = getopt_long(argc, argv, "hlPSaAd:c:b:n:i:x:m:t:F:k:q:D:z:",
+                                  long_options, nullptr))) {
+        switch (c) {
+            case 'd':
+                opts.dbpath = string(optarg);
+                break;
+
+            case 'c':
+                opts.config_name = string(optarg);
+                break;
+
+            case 'b':
+                opts.bedfilename = string(optarg);
+                if (opts.bedfilename.empty()) {
+                    cerr << "invalid BED filename" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'n':
+                opts.shards = strtoull(optarg, nullptr, 10);
+                if (opts.shards == 0 || opts.shards > 100000) {
+                    cerr << "invalid --shards" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'i':
+                opts.shard = strtol(optarg, nullptr, 10);
+                if (opts.shard < 0 || opts.shard >= 100000) {
+                    cerr << "invalid --shard" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'l':
+                opts.list_of_files = true;
+                break;
+
+            case 'P':
+                opts.more_PL = true;
+                break;
+
+            case 'S':
+                opts.squeeze = true;
+                break;
+
+            case 'a':
+                opts.trim_uncalled_alleles = true;
+                break;
+
+            case 'A':
+                opts.adaptive_buckets = true;
+                break;
+
+            case 'x':
+                opts.bucket_size = strtoul(optarg, nullptr, 10);
+                if (opts.bucket_size == 0 || opts.bucket_size > 1000000000) {
+                    cerr << "bucket size should be in (1,1e9]" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'm':
+                opts.mem_budget = strtoull(optarg, nullptr, 10);
+                if (opts.mem_budget == 0 || opts.mem_budget > 16*1024) {
+                    cerr << "invalid --mem-gbytes" << endl;
+                    return 1;
+                }
+                opts.mem_budget <<= 30;
+                break;
+
+            case 't':
+                opts.nr_threads = strtoull(optarg, nullptr, 10);
+                if (opts.nr_threads == 0 || opts.nr_threads > 1024) {
+                    cerr << "invalid --threads" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'F':
+                opts.prefetch_distance = strtoull(optarg, nullptr, 10);
+                if (opts.prefetch_distance == 0 || opts.prefetch_distance > 1024) {
+                    cerr << "invalid --prefetch" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'k':
+                opts.checkpoint_sites = strtoull(optarg, nullptr, 10);
+                if (opts.checkpoint_sites == 0) {
+                    cerr << "invalid --checkpoint" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'q':
+                opts.max_queries = strtoull(optarg, nullptr, 10);
+                if (opts.max_queries == 0 || opts.max_queries > 1024) {
+                    cerr << "invalid --queries" << endl;
+                    return 1;
+                }
+                break;
+            case 'D':
+                opts.deadline_ms = strtoull(optarg, nullptr, 10);
+                if (opts.deadline_ms == 0) {
+                    cerr << "invalid --deadline" << endl;
+                    return 1;
+                }
+                break;
+            case 'z':
+                opts.compression_dict_bytes = strtoull(optarg, nullptr, 10);
+                if (opts.compression_dict_bytes == 0 || opts.compression_dict_bytes > 16*1024) {
+                    cerr << "invalid --zstd-dict" << endl;
+                    return 1;
+                }
+                opts.compression_dict_bytes <<= 10;
+                break;
+            case 'T':
+                opts.sample_tile_size = strtoull(optarg, nullptr, 10);
+                if (opts.sample_tile_size == 0 || opts.sample_tile_size > 1000000) {
+                    cerr << "invalid --sample-tiles" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'h':
+            case '?':
+                help(argv[0]);
+                exit(0);
+                break;
+
+            default:
+                abort ();
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        opts.args.push_back(string(argv[i]));
+    }
+
+    if (command == "init") {
+        return init(opts);
+    } else if (command == "load") {
+        return load(opts);
+    } else if (command == "merge") {
+        return merge(opts);
+    } else if (command == "image") {
+        return image(opts);
+    } else if (command == "split") {
+        return split(opts);
+    } else if (command == "discover") {
+        return discover(opts);
+    } else if (command == "unify") {
+        return unify(opts);
+    } else if (command == "genotype") {
+        return genotype(opts);
+    } else if (command == "grow") {
+        return grow(opts);
+    } else if (command == "concat") {
+        return concat(opts);
+    } else if (command == "desparse") {
+        return desparse(opts);
+    } else if (command == "serve") {
+        return serve(opts);
+    } else if (command == "query") {
+        return query(opts);
+    }
+    help(argv[0]);
+    return 1;
+}
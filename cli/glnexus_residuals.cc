@@ -0,0 +1,42 @@
+// Convert binary residuals (genotyper_config residuals_format: BINARY) to the
+// YAML format, for downstream QC
+
+#include <iostream>
+#include <fstream>
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/stdout_sinks.h"
+#include "residuals.h"
+
+using namespace std;
+
+auto console = spdlog::stderr_logger_mt("GLnexus");
+
+// Expected usage:
+//    glnexus_residuals residuals.cflat.gz [residuals.yml]
+//
+int main(int argc, char *argv[]) {
+    spdlog::set_pattern("[%t] %+");
+    if (argc < 2 || argc > 3) {
+        cout << "Usage: " << argv[0] << " residuals.cflat.gz [residuals.yml]" << endl
+             << "Convert GLnexus binary residuals to YAML, writing to the given file or standard output." << endl;
+        return 1;
+    }
+
+    GLnexus::Status s;
+    if (argc == 3) {
+        ofstream ofs(argv[2], ofstream::out | ofstream::trunc);
+        if (!ofs.good()) {
+            s = GLnexus::Status::IOError("opening", argv[2]);
+        } else {
+            s = GLnexus::residuals_yaml_of_binary(argv[1], ofs);
+            ofs.close();
+        }
+    } else {
+        s = GLnexus::residuals_yaml_of_binary(argv[1], cout);
+    }
+    if (s.bad()) {
+        console->error("Failed to convert residuals: {}", s.str());
+        return 1;
+    }
+    return 0;
+}
@@ -3,6 +3,11 @@
 #include "data.h"
 #include "KeyValue.h"
 #include "BCFSerialize.h"
+#include "memory_budget.h"
+
+namespace ctpl {
+    class thread_pool;
+}
 
 namespace GLnexus {
 
@@ -12,6 +17,11 @@ struct BCFKeyValueData_body;
 /// given key-value database. One imported gVCF file (potentially with
 /// multiple samples) becomes a data set. The key schema permits efficient
 /// retrieval by genomic range across the datasets.
+///
+/// The database keeps a dictionary of sample and data set IDs, assigned as
+/// they're imported, and keys the stored buckets by data set ID. Databases
+/// initialized by older versions lack it; their buckets are keyed by data
+/// set name, and the ID lookups return NotImplemented.
 class BCFKeyValueData : public Metadata, public BCFData {
 private:
     // pImpl idiom
@@ -25,12 +35,32 @@ public:
 
     /// Initialize a brand-new database, which SHOULD be empty to begin with.
     /// Contigs are stored and an empty sample set "*" is created.
+    /// The records are stored in buckets of interval_len bp, or if
+    /// contig_interval_lens is nonempty, of the given length on each contig
+    /// (e.g. shorter on contigs with denser records; see
+    /// cli::utils::adaptive_bucket_lengths).
     static Status InitializeDB(KeyValue::DB* db,
                                const std::vector<std::pair<std::string,size_t> >& contigs,
-                               int interval_len = default_bucket_size);
+                               int interval_len = default_bucket_size,
+                               const std::vector<int>& contig_interval_lens = {});
 
     /// Open an existing database
-    static Status Open(KeyValue::DB* db, std::unique_ptr<BCFKeyValueData>& ans);
+    ///
+    /// bucket_cache_bytes: if nonzero, keep a cache of decoded bucket records
+    /// of about this size, shared by all queries, so that repeated queries
+    /// touching the same buckets needn't deserialize them over again.
+    ///
+    /// bucket_cache_partitions: divide the cache evenly into this many
+    /// partitions, one for each NUMA node of a NUMA-aware Service (see
+    /// service_config::numa); queries from worker threads on each node use
+    /// that node's partition.
+    ///
+    /// budget: if provided, the bucket cache reserves its size from it (as
+    /// much as is available) until the BCFKeyValueData is destroyed. The
+    /// budget must outlive it.
+    static Status Open(KeyValue::DB* db, std::unique_ptr<BCFKeyValueData>& ans,
+                       size_t bucket_cache_bytes = 0, size_t bucket_cache_partitions = 1,
+                       memory_budget* budget = nullptr);
 
     virtual ~BCFKeyValueData();
 
@@ -41,6 +71,10 @@ public:
     Status sample_dataset(const std::string& sample, std::string& ans) const override;
     Status all_samples_sampleset(std::string& ans) override;
     Status sample_count(size_t& ans) const override;
+    Status sample_id(const std::string& sample, uint32_t& ans) const override;
+    Status dataset_id(const std::string& dataset, uint32_t& ans) const override;
+    Status sample_name(uint32_t id, std::string& ans) const override;
+    Status dataset_name(uint32_t id, std::string& ans) const override;
 
     Status new_sampleset(MetadataCache& metadata, const std::string& sampleset,
                          const std::set<std::string>& samples);
@@ -53,13 +87,23 @@ public:
                           std::shared_ptr<const bcf_hdr_t>* hdr) override;
     Status dataset_range(const std::string& dataset, const bcf_hdr_t* hdr,
                          const range& pos, bcf_predicate predicate,
-                         std::vector<std::shared_ptr<bcf1_t>>* records) override;
+                         std::vector<std::shared_ptr<bcf1_t>>* records,
+                         const bcf_field_selection* fields = nullptr) override;
 
     Status sampleset_range(const MetadataCache& metadata, const std::string& sampleset,
                            const range& pos, bcf_predicate predicate,
                            std::shared_ptr<const std::set<std::string>>& samples,
                            std::shared_ptr<const std::set<std::string>>& datasets,
-                           std::vector<std::unique_ptr<RangeBCFIterator>>& iterators) override;
+                           std::vector<std::unique_ptr<RangeBCFIterator>>& iterators,
+                           const bcf_field_selection* fields = nullptr) override;
+
+    /// Read the buckets in range of each of the sample set's datasets with a
+    /// batch of reads per bucket. With the bucket cache, the buckets are
+    /// decoded into it (unless already there); otherwise the reads just warm
+    /// the database's own caches.
+    Status prefetch(const MetadataCache& metadata, const std::string& sampleset,
+                    const range& pos, bcf_predicate predicate,
+                    const bcf_field_selection* fields = nullptr) override;
 
     // Provide a way to call the non-optimized base implementation of
     // sampleset_range. Mostly for unit testing.
@@ -67,7 +111,15 @@ public:
                                 const range& pos, bcf_predicate predicate,
                                 std::shared_ptr<const std::set<std::string>>& samples,
                                 std::shared_ptr<const std::set<std::string>>& datasets,
-                                std::vector<std::unique_ptr<RangeBCFIterator>>& iterators);
+                                std::vector<std::unique_ptr<RangeBCFIterator>>& iterators,
+                                const bcf_field_selection* fields = nullptr);
+
+    /// Determine whether the data set has any variant records (other than gVCF
+    /// reference bands) overlapping the range. This is fast if the database
+    /// has the variant record index (as databases initialized by this version
+    /// do), which it can check without reading any reference bands.
+    Status dataset_has_variants(const std::string& dataset, const bcf_hdr_t* hdr,
+                                const range& pos, bool& ans);
 
     struct import_result {
         std::set<std::string> samples;
@@ -78,6 +130,7 @@ public:
         uint64_t buckets = 0;     // # buckets
         uint64_t duplicate_records = 0; // # of records duplicated in multiple buckets
         uint64_t skipped_records = 0; // # of records skipped in source gVCF for various caller-specific reasons
+        uint64_t compacted_records = 0; // # of reference bands merged into the preceding band (see import_options)
 
         import_result& add_bucket(uint64_t bucket_records, size_t bucket_bytes, uint64_t duplicates) {
             records += bucket_records;
@@ -102,10 +155,57 @@ public:
             buckets += rhs.buckets;
             duplicate_records += rhs.duplicate_records;
             skipped_records += rhs.skipped_records;
+            compacted_records += rhs.compacted_records;
             return *this;
         }
     };
 
+    struct import_options {
+        /// Compact runs of consecutive reference bands into single bands, as
+        /// they're stored. Applies to single-sample gVCFs only. Two adjacent
+        /// bands in the same bucket are merged if they have identical
+        /// alleles, QUAL, FILTER, INFO (except END), GT and non-integer
+        /// FORMAT fields, and their GQs (along with those of the run so far)
+        /// lie within ref_band_gq_tolerance of each other. The merged band
+        /// spans both, with the element-wise minimum of the integer FORMAT
+        /// fields (e.g. GQ, DP, MIN_DP, PL), so it remains an ordinary,
+        /// conservative reference band to the rest of the system. Reduces
+        /// database size and I/O, at the cost of resolution in the GQ/DP of
+        /// reference calls.
+        bool compact_ref_bands = false;
+        int ref_band_gq_tolerance = 10;
+
+        /// If provided (with more than one thread), an indexed gVCF (CSI for
+        /// BCF, tabix or CSI for bgzipped VCF) is imported in chunks read
+        /// and stored concurrently on this pool, each contig being divided
+        /// at bucket boundaries (unless compact_ref_bands). Bands spanning a
+        /// chunk boundary are found by querying the index at the start of
+        /// the following chunk, so the stored data are the same as if the
+        /// file were read sequentially. The caller must not be waiting on
+        /// this pool from within one of its own tasks.
+        ctpl::thread_pool* pool = nullptr;
+
+        /// If nonzero, a gVCF with more samples than this is stored as
+        /// several data sets ("sample tiles") named dataset.tile0,
+        /// dataset.tile1, ..., each holding up to this many of its
+        /// consecutive samples. Reading a subset of the samples then decodes
+        /// only the records of the tiles containing them, rather than those
+        /// of the whole wide gVCF. The gVCF is read through once per tile.
+        size_t sample_tile_size = 0;
+
+        /// If provided, the gVCFs' BGZF blocks are inflated on this htslib
+        /// thread pool (which may be shared by concurrent imports), ahead of
+        /// the reading thread's parsing. It must outlive the imports.
+        htsThreadPool* hts_pool = nullptr;
+
+        /// If nonzero, a gVCF read sequentially (i.e. not in chunks) is
+        /// parsed on a separate thread, up to about this many records ahead
+        /// of the bucket building. A gVCF with INFO/FORMAT fields undeclared
+        /// in its header is then read through a second time without parsing
+        /// ahead, since the records parsed so far encode them inconsistently.
+        size_t parse_ahead = 0;
+    };
+
     /// Import a new data set (a gVCF file, possibly containing multiple samples).
     /// The data set name must be unique.
     /// The sample names in the data set (gVCF column names) must be unique.
@@ -115,7 +215,15 @@ public:
     Status import_gvcf(MetadataCache& metadata, const std::string& dataset,
                        const std::string& filename,
                        const std::set<range>& range_filter,
-                       import_result& rslt);
+                       import_result& rslt,
+                       const import_options& opts);
+
+    Status import_gvcf(MetadataCache& metadata, const std::string& dataset,
+                       const std::string& filename,
+                       const std::set<range>& range_filter,
+                       import_result& rslt) {
+        return import_gvcf(metadata, dataset, filename, range_filter, rslt, import_options());
+    }
 
     Status import_gvcf(MetadataCache& metadata, const std::string& dataset,
                        const std::string& filename,
@@ -125,6 +233,38 @@ public:
         samples_imported = move(rslt.samples);
         return s;
     }
+
+    /// Reserve a block of consecutive data set IDs for the given data sets,
+    /// about to be imported (e.g. concurrently, in any order). Each then
+    /// takes its ID from the block, in the given order, so that data sets
+    /// loaded together (say, a cohort) are adjacent in each bucket's key
+    /// order. A data set stored as sample tiles is assigned its IDs as usual,
+    /// and IDs reserved for imports which don't happen go unused. No effect
+    /// if the database predates the ID dictionary.
+    Status reserve_dataset_ids(const std::vector<std::string>& datasets);
+
+    struct merge_result {
+        std::set<std::string> datasets, samples;
+        uint64_t buckets = 0;   // # buckets copied
+        size_t bytes = 0;       // total BCF bytes copied
+    };
+
+    /// Merge in all the data sets and samples of another database, built
+    /// independently (e.g. by importing another subset of the gVCFs), without
+    /// re-parsing any gVCF: its buckets are copied as they are, with just the
+    /// data set part of their keys rewritten, and its named sample sets are
+    /// added. The databases must have the same contigs and bucket lengths,
+    /// and no data sets or samples in common.
+    Status merge_database(MetadataCache& metadata, BCFKeyValueData& src, merge_result& rslt);
+
+    /// Store a compact binary snapshot of the sample and data set metadata
+    /// (the ID dictionary, each sample's data set and the sample sets, as
+    /// they are now), read at open in a single lookup and queried in place,
+    /// so that opening a database of many samples is fast. Call it once
+    /// loading is done. Importing more data sets makes the snapshot stale, in
+    /// which case it's ignored until written again. NotImplemented if the
+    /// database predates the ID dictionary.
+    Status write_metadata_snapshot();
 };
 
 /// Get the bucket key prefix length for the bcf collection. This is used with
@@ -13,6 +13,20 @@ Status bcf_raw_read_header(const uint8_t* buf, int hdrlen,
 // Write BCF header
 std::string bcf_write_header(const bcf_hdr_t *hdr);
 
+// Write BCF header without its samples (or the FORMAT column heading), as
+// bcf_hdr_subset would leave it selecting none: the part of the header common
+// to single-sample gVCFs from the same caller and reference
+std::string bcf_write_header_template(const bcf_hdr_t *hdr);
+
+// Make a header with the given samples, sharing the header records and the
+// INFO/FORMAT/FILTER and contig dictionaries of tmpl (which must have no
+// samples, and is kept alive by the result). This is much cheaper than parsing
+// the full header. The result must not be modified, as by bcf_hdr_add_hrec,
+// though it may be copied with bcf_hdr_dup.
+Status bcf_hdr_share(const std::shared_ptr<const bcf_hdr_t>& tmpl,
+                     const std::vector<std::string>& samples,
+                     std::shared_ptr<const bcf_hdr_t>& ans);
+
 // The following three functions, prefixed with bcf_raw, are copied
 // and modified from the htslib sources. They are used to read/write
 // uncompressed BCF records from/to memory. They are declared for
@@ -35,6 +49,114 @@ Status bcf_raw_read_from_mem(const uint8_t *buf, int start, size_t len, bcf1_t *
 // Quickly read the range from the BCF record (without deserializing it entirely)
 Status bcf_raw_range(const uint8_t *buf, int start, size_t len, range& rng);
 
+// Read-only, non-allocating view of a serialized BCF record, pointing
+// directly into the buffer it was read from (e.g. a database bucket). The
+// fixed fields are decoded eagerly from the 32-byte record header; the
+// alleles, INFO and FORMAT fields are decoded lazily, on request, from the
+// packed sections. This allows record filters to inspect the few fields they
+// need without copying the record into a bcf1_t and unpacking it.
+//
+// The view is valid only as long as the underlying buffer.
+class bcf_raw_view {
+    int32_t rid_ = -1, pos_ = -1, rlen_ = 0;
+    float qual_ = 0;
+    uint32_t n_allele_ = 0, n_info_ = 0, n_fmt_ = 0, n_sample_ = 0;
+    int is_gvcf_ref_ = -1; // unknown
+
+    // packed sections: shared (ID, alleles, FILTER, INFO) and indiv (FORMAT)
+    const uint8_t *shared_ = nullptr, *indiv_ = nullptr;
+    size_t shared_len_ = 0, indiv_len_ = 0;
+
+    Status skip_to_info(size_t& ofs) const;
+
+public:
+    // View the serialized record starting at [buf+start], as written by
+    // bcf_raw_write_to_mem. Sets reclen to the length of the record.
+    static Status of_mem(const uint8_t *buf, int start, size_t len,
+                         bcf_raw_view& ans, int& reclen);
+
+    // View the packed sections of a bcf1_t. The record must not have been
+    // modified since it was read (since that leaves the packed sections out
+    // of date), but need not have been unpacked.
+    static Status of_bcf1(const bcf1_t *v, bcf_raw_view& ans);
+
+    int32_t rid() const noexcept { return rid_; }
+    int32_t pos() const noexcept { return pos_; }
+    int32_t rlen() const noexcept { return rlen_; }
+    range rng() const noexcept { return range(rid_, pos_, pos_ + rlen_); }
+    float qual() const noexcept { return qual_; }
+    uint32_t n_allele() const noexcept { return n_allele_; }
+    uint32_t n_info() const noexcept { return n_info_; }
+    uint32_t n_fmt() const noexcept { return n_fmt_; }
+    uint32_t n_sample() const noexcept { return n_sample_; }
+
+    // Get allele i (0 = REF). The string is not NUL-terminated.
+    Status allele(unsigned i, const char*& str, size_t& len) const;
+
+    // As is_gvcf_ref_record()
+    Status is_gvcf_ref_record(bool& ans) const;
+
+    // Supply the result of is_gvcf_ref_record() if it's already known (e.g.
+    // from a stored column), sparing the decoding of the alleles
+    void hint_gvcf_ref_record(bool is_ref) noexcept { is_gvcf_ref_ = is_ref ? 1 : 0; }
+
+    // Locate the INFO field with the given header ID (see bcf_hdr_id2int).
+    // Sets type (BCF_BT_*), the number of values n, and a pointer to them.
+    // Returns NotFound if the record has no such field.
+    Status info(int id, int& type, int& n, const uint8_t*& data) const;
+
+    // Locate the FORMAT field with the given header ID. Sets type (BCF_BT_*),
+    // the number of values per sample n, and a pointer to the n*n_sample()
+    // values (sample-major). Returns NotFound if the record has no such
+    // field.
+    Status format(int id, int& type, int& n, const uint8_t*& data) const;
+
+    // Copy the record into a bcf1_t (in packed form), like
+    // bcf_raw_read_from_mem. If info_ids/format_ids are given, they're sorted
+    // header IDs of the only INFO/FORMAT fields to retain; the rest are
+    // omitted from the copy (saving the cost of copying and unpacking them).
+    // As with bcf_raw_read_from_mem, a reused bcf1_t should first be
+    // sanitized with bcf_clear1.
+    Status read(bcf1_t *v, const std::vector<int>* info_ids = nullptr,
+                const std::vector<int>* format_ids = nullptr) const;
+};
+
+// An integer FORMAT field split out of a serialized record by
+// bcf_raw_split_int_formats, e.g. to be stored in a column of its own: its
+// header ID, position among the record's FORMAT fields, type (BCF_BT_INT*),
+// number of values per sample, and the n_values = width*n_sample values
+// (sample-major, in the BCF encoding of type).
+struct bcf_raw_format_entry {
+    int32_t key = -1;
+    unsigned position = 0;
+    int type = 0;
+    uint32_t width = 0;
+    size_t n_values = 0;
+    const uint8_t *data = nullptr;
+};
+
+// Split the integer FORMAT fields out of the serialized record buf[0,len),
+// writing the record without them into rest, and the fields into entries, in
+// order of position. The data pointers point into buf. Fields whose key and
+// type descriptor aren't encoded as htslib does (so that
+// bcf_raw_splice_formats couldn't restore them byte for byte) stay in rest.
+Status bcf_raw_split_int_formats(const uint8_t *buf, size_t len, std::vector<uint8_t>& rest,
+                                 std::vector<bcf_raw_format_entry>& entries);
+
+// Reverse bcf_raw_split_int_formats: write into ans the record rest[0,len)
+// with the FORMAT fields split out of it (all of them, in order of position)
+// restored to their positions, except those whose data is null, which are
+// omitted.
+Status bcf_raw_splice_formats(const uint8_t *rest, size_t len,
+                              const std::vector<bcf_raw_format_entry>& entries,
+                              std::vector<uint8_t>& ans);
+
+// bcf_predicate accepting variant records only, i.e. rejecting gVCF reference
+// bands. A BCFData implementation may recognize this predicate and serve the
+// query from an index of the variant records, without reading the reference
+// bands at all.
+Status bcf_variant_predicate(const bcf_hdr_t* hdr, const bcf_raw_view& rec, bool& retval);
+
 // convert a BCF record into a VCF string (no newline)
 std::shared_ptr<std::string> bcf1_to_string(const bcf_hdr_t *hdr, const bcf1_t *bcf);
 
@@ -53,6 +53,17 @@ public:
     // have undefined results.
     virtual Status next() = 0;
 
+    // Advance the iterator to the first key equal to or greater than the
+    // given one, which should be greater than the current key. The base
+    // implementation steps through the intervening keys with next();
+    // derived classes may seek directly.
+    virtual Status seek(const std::string& key) {
+        Status s;
+        while (valid() && this->key().str() < key) {
+            S(next());
+        }
+        return Status::OK();
+    }
 };
 
 /// A DB snapshot providing consistent multiple reads if possible. Thread-safe.
@@ -78,6 +89,23 @@ public:
         return s;
     }
 
+    /// Get the values corresponding to several keys at once, storing each
+    /// key's value (if any) and status (OK, NotFound or an error code) at the
+    /// same index of values and statuses. Returns a bad status only if the
+    /// lookups couldn't be performed at all. The base implementation calls
+    /// get0 for each key; derived classes may batch the lookups more
+    /// efficiently.
+    virtual Status multi_get0(CollectionHandle coll, const std::vector<std::string>& keys,
+                              std::vector<std::shared_ptr<Data>>& values,
+                              std::vector<Status>& statuses) const {
+        values.assign(keys.size(), nullptr);
+        statuses.assign(keys.size(), Status::OK());
+        for (size_t i = 0; i < keys.size(); i++) {
+            statuses[i] = get0(coll, keys[i], values[i]);
+        }
+        return Status::OK();
+    }
+
     /// Create an iterator positioned at the first key equal to or greater
     /// than the given one. If key is empty then position at the beginning of
     /// the collection.
@@ -124,6 +152,17 @@ public:
     /// Begin preparing a batch of writes.
     virtual Status begin_writes(std::unique_ptr<WriteBatch>& writes) = 0;
 
+    /// Begin preparing a (possibly very large) batch of writes, usually in
+    /// increasing key order within each collection, which the database
+    /// streams to storage rather than buffering in memory (e.g. by writing
+    /// sorted files for direct ingestion). The writes aren't necessarily
+    /// applied atomically, and keys shouldn't be repeated within the batch.
+    /// Returns NotImplemented if the database doesn't support this, in which
+    /// case the caller should use ordinary, memory-bounded write batches.
+    virtual Status begin_sorted_writes(std::unique_ptr<WriteBatch>& writes) {
+        return Status::NotImplemented();
+    }
+
     // Base implementations of Reader and WriteBatch interfaces. They simply
     // create a snapshot just to read one record (or begin one iterator), or
     // apply a "batch" of one write. Derived classes may want to provide more
@@ -134,6 +173,13 @@ public:
 
     /// Ensure all writes are flushed to storage
     virtual Status flush() = 0;
+
+    /// Report the database engine's own cumulative performance counters
+    /// (e.g. block cache hits, bytes read), keyed by name, if it keeps any.
+    virtual Status statistics(std::map<std::string,uint64_t>& ans) const {
+        ans.clear();
+        return Status::OK();
+    }
 };
 
 }}
@@ -0,0 +1,30 @@
+#ifndef GLNEXUS_MMAP_INTF_H
+#define GLNEXUS_MMAP_INTF_H
+
+// Implement a KeyValue interface to an immutable database image: a single
+// file holding each collection's records in key order, with a fixed-width
+// offset index, memory-mapped for reading. Lookups binary-search the index
+// and iterators step through it, the keys and values being read in place
+// from the mapping (zero-copy). This suits the read-only phases
+// (discovery, genotyping) after a database has been loaded into RocksDB and
+// converted with Write.
+//
+#include "KeyValue.h"
+namespace GLnexus {
+namespace MmapKeyValue {
+
+/// Write an image of the given collections of a database to a new file
+/// (failing if the path exists already).
+Status Write(const KeyValue::DB& src, const std::vector<std::string>& collections,
+             const std::string& path);
+
+/// Whether the path is a database image (as opposed to e.g. a RocksDB
+/// directory)
+bool IsImage(const std::string& path);
+
+/// Open a database image. Writes to it fail.
+Status Open(const std::string& path, std::unique_ptr<KeyValue::DB>& db);
+
+}}
+
+#endif
@@ -4,6 +4,8 @@
 // Implement a KeyValue interface to a RocksDB on-disk database.
 //
 #include "KeyValue.h"
+#include "memory_budget.h"
+#include <set>
 namespace GLnexus {
 namespace RocksKeyValue {
 
@@ -38,6 +40,22 @@ struct config {
     OpenMode mode = OpenMode::NORMAL;
     size_t mem_budget = 0;
     size_t thread_budget = 0;
+
+    /// If nonzero, each table file written to the dict_collections (by
+    /// flushes, compactions and sorted writes) is compressed with a Zstandard
+    /// dictionary of up to this size, trained on a sample of the file's blocks
+    /// and stored in it. This suits collections of many structurally similar
+    /// values. It only affects writing; the files remain readable whatever
+    /// the configuration.
+    size_t compression_dict_bytes = 0;
+    std::set<std::string> dict_collections;
+
+    /// If provided, the database is sized by the budget's total (rather than
+    /// mem_budget) and its block cache reserves its capacity from the
+    /// budget, as much as is available, until the database is closed. (The
+    /// memtables aren't charged; they're large only in bulk-load mode, and
+    /// flushed at its end.) The budget must outlive the database.
+    memory_budget* budget = nullptr;
 };
 
 /// Initialize a new database. The parent directory must exist. Fails if the
@@ -49,6 +67,10 @@ Status Open(const std::string& dbPath, const config& cfg, std::unique_ptr<KeyVal
 
 // Delete an existing database.
 Status destroy(const std::string dbPath);
+
+/// Given a user-specified memory budget (zero if none), calculate the
+/// practical effective memory budget: most of the system memory, if not less.
+size_t calculate_mem_budget(size_t specified_mem_budget);
 }}
 
 #endif
@@ -1,6 +1,7 @@
 #ifndef GLNEXUS_APPLET_UTILS_H
 #define GLNEXUS_APPLET_UTILS_H
 
+#include <atomic>
 #include <string>
 #include <vector>
 #include <map>
@@ -9,6 +10,7 @@
 #include "RocksKeyValue.h"
 #include "BCFKeyValueData.h"
 #include "unifier.h"
+#include "perf.h"
 
 namespace GLnexus {
 namespace cli {
@@ -77,6 +79,31 @@ Status unified_sites_of_yaml_stream(std::istream &is,
                                     const std::vector<std::pair<std::string,size_t> > &contigs,
                                     std::vector<unified_site> &sites);
 
+// Binary (capnp) counterparts of the above, much more compact and faster to
+// read and write; the YAML forms remain preferable for debugging. The
+// streams are written and read a chunk of entries at a time. The contigs are
+// stored along with the unified sites too, and must match those supplied to
+// the reader.
+Status capnp_stream_of_discovered_alleles(unsigned N, const std::vector<std::pair<std::string,size_t> > &contigs,
+                                          const discovered_alleles &dsals,
+                                          std::ostream &os);
+Status discovered_alleles_of_capnp_stream(std::istream &is,
+                                          unsigned &N, std::vector<std::pair<std::string,size_t> > &contigs,
+                                          discovered_alleles &dsals);
+Status capnp_write_discovered_alleles_to_file(const discovered_alleles &dsals,
+                                              const std::vector<std::pair<std::string,size_t>> &contigs,
+                                              unsigned int sample_count,
+                                              const std::string &filename);
+Status capnp_stream_of_unified_sites(const std::vector<unified_site> &sites,
+                                     const std::vector<std::pair<std::string,size_t> > &contigs,
+                                     std::ostream &os);
+Status capnp_write_unified_sites_to_file(const std::vector<unified_site> &sites,
+                                         const std::vector<std::pair<std::string,size_t>> &contigs,
+                                         const std::string &filename);
+Status unified_sites_of_capnp_stream(std::istream &is,
+                                     const std::vector<std::pair<std::string,size_t> > &contigs,
+                                     std::vector<unified_site> &sites);
+
 // Check if a file exists
 bool check_file_exists(const std::string &path);
 
@@ -100,19 +127,40 @@ std::string describe_config_presets();
 
 RocksKeyValue::prefix_spec* GLnexus_prefix_spec();
 
-// Initialize a database. Fills in the contigs.
+// Choose the bucket length for each contig according to the density of the
+// exemplar gVCF's records on it (counted from its index, if available), so
+// that the buckets hold about as many records as bucket_size buckets would
+// at the mean density: shorter on dense contigs, longer on sparse ones,
+// within a factor of 8 either way.
+Status adaptive_bucket_lengths(std::shared_ptr<spdlog::logger> logger,
+                               const std::string &exemplar_gvcf,
+                               const std::vector<std::pair<std::string,size_t>> &contigs,
+                               size_t bucket_size,
+                               std::vector<int> &ans);
+
+// Initialize a database. Fills in the contigs. If adaptive_buckets, then the
+// bucket length of each contig is set by adaptive_bucket_lengths.
 Status db_init(std::shared_ptr<spdlog::logger> logger,
                const std::string &dbpath,
                const std::string &exemplar_gvcf,
                std::vector<std::pair<std::string,size_t>> &contigs, // output parameter
-               size_t bucket_size = BCFKeyValueData::default_bucket_size);
+               size_t bucket_size = BCFKeyValueData::default_bucket_size,
+               bool adaptive_buckets = false);
 
 // Read the contigs from a database
 Status db_get_contigs(std::shared_ptr<spdlog::logger> logger,
                       const std::string &dbpath,
                       std::vector<std::pair<std::string,size_t> > &contigs);
 
-// Load gvcf files into a database in parallel
+// Load gvcf files into a database in parallel. The dataset names are inferred
+// from the gVCF filenames, and the datasets get consecutive IDs in the order
+// of gvcfs (see BCFKeyValueData::reserve_dataset_ids), so that a cohort
+// loaded together is clustered in each bucket. If compression_dict_bytes is nonzero, the
+// buckets are compressed with Zstandard dictionaries of that size trained on
+// them (see RocksKeyValue::config), improving compression of the many
+// similar buckets of gVCFs from the same caller. If budget is provided, the
+// database is sized by it (rather than mem_budget) and its block cache draws
+// from it while the database is open (see RocksKeyValue::config).
 Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                     size_t mem_budget, size_t nr_threads,
                     const std::vector<std::string> &gvcfs,
@@ -120,9 +168,33 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                     const std::vector<range> &ranges,   // limit the bulk load to these ranges
                     std::vector<std::pair<std::string,size_t>> &contigs, // output param
                     std::unique_ptr<KeyValue::DB> *db_out = nullptr, // if supplied, return db ptr (after flush)
-                    bool delete_gvcf_after_load = false);
+                    bool delete_gvcf_after_load = false,
+                    const BCFKeyValueData::import_options& import_opts = BCFKeyValueData::import_options(),
+                    size_t compression_dict_bytes = 0,
+                    memory_budget* budget = nullptr);
+
+// Merge databases built independently (e.g. by db_bulk_load of disjoint
+// subsets of the gVCFs, in parallel on different hosts) into the one at
+// dbpath, without re-importing any gVCF. All the databases must have been
+// initialized with the same contigs and bucket size, and no two may share
+// any dataset or sample. compression_dict_bytes: as for db_bulk_load.
+Status db_merge(std::shared_ptr<spdlog::logger> logger,
+                size_t mem_budget, size_t nr_threads,
+                const std::string &dbpath,
+                const std::vector<std::string> &src_dbpaths,
+                size_t compression_dict_bytes = 0);
+
+// Write an immutable image of the loaded database (see MmapKeyValue) to a new
+// file at image_path. The read-only functions (db_get_contigs, discovery,
+// genotyping) accept the image's path in place of the database's, mapping it.
+Status db_image(std::shared_ptr<spdlog::logger> logger,
+                const std::string &dbpath, const std::string &image_path);
 
 // Discover alleles in the database. Return discovered alleles, and the sample count.
+// The version given a database path opens it under a memory budget of
+// mem_budget (see memory_budget.h), which the discovery results in flight
+// draw from along with the database's caches; the version given an open
+// database does so if budget is provided.
 Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
                         size_t mem_budget, size_t nr_threads,
                         const std::string &dbpath,
@@ -137,28 +209,232 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
                         const std::vector<std::pair<std::string,size_t> > &contigs,
                         discovered_alleles &dsals,
                         unsigned &sample_count,
-                        bool include_zero_copies = false);
+                        bool include_zero_copies = false,
+                        memory_budget* budget = nullptr);
+
+// Discover alleles in the database as above, holding no more than about
+// mem_budget bytes of them in memory: as the alleles discovered so far
+// outgrow it, they're spilled to a scratch file (named spill_prefix and a
+// number, removed on return) as a sorted run. The runs are then merged a
+// chunk at a time. The result is passed to per_contig one contig at a time,
+// in order (for each contig, even if it has no alleles), so that only the
+// largest contig's alleles need be held at once. The alleles are the same as
+// discover_alleles would return. If budget is provided, the Service draws
+// from it, and the alleles' mem_budget is reserved from it for the duration
+// (reduced to what it can grant).
+Status discover_alleles_spilling(std::shared_ptr<spdlog::logger> logger,
+                                 size_t nr_threads, KeyValue::DB *db,
+                                 const std::vector<range> &ranges,
+                                 const std::vector<std::pair<std::string,size_t> > &contigs,
+                                 size_t mem_budget, const std::string &spill_prefix,
+                                 unsigned &sample_count,
+                                 bool include_zero_copies,
+                                 const std::function<Status(int,discovered_alleles&)>& per_contig,
+                                 memory_budget* budget = nullptr);
 
 
 // Run unifier on given discovered alleles.
 // input dsals is cleared by side-effect to save memory
 // output sites is appended to (not cleared!)
+// If a pool is given, then the alleles are unified in parallel chunks on it
+// (see unified_sites).
 Status unify_sites(std::shared_ptr<spdlog::logger> logger,
                    const unifier_config &unifier_cfg,
                    const std::vector<std::pair<std::string,size_t> > &contigs,
                    discovered_alleles &dsals,
                    unsigned sample_count,
                    std::vector<unified_site> &sites,
-                   GLnexus::unifier_stats& stats);
+                   GLnexus::unifier_stats& stats,
+                   executor* pool = nullptr);
 
 // if the file name is "-", then output is written to stdout.
+// mem_budget: the memory budget (see memory_budget.h) shared by the
+// database's block cache, the decoded bucket cache and the genotyping results
+// in flight; if 0, most of the system memory (without the bucket cache)
+// output_shards > 1 genotypes that many contiguous shards of the sites
+// concurrently, concatenating them at the end (Service::genotype_sites_sharded)
+// numa: on a multi-socket host, divide the threads and the decoded bucket
+// cache among the NUMA nodes (see service_config::numa), with at least one
+// output shard per node
+// prefetch_distance: read the buckets for this many site groups ahead of
+// the genotyping (see service_config::prefetch_distance); 0 disables
 Status genotype(std::shared_ptr<spdlog::logger> logger,
                 size_t mem_budget, size_t nr_threads,
                 const std::string &dbpath,
                 const GLnexus::genotyper_config &genotyper_cfg,
                 const std::vector<unified_site> &sites,
                 const std::vector<std::string> &extra_header_lines,
-                const std::string &output_filename);
+                const std::string &output_filename,
+                size_t output_shards = 1,
+                std::map<std::string,uint64_t>* db_stats = nullptr,
+                bool numa = false, size_t prefetch_distance = 0);
+
+// Distributed execution, for cohorts outgrowing one host: a coordinator
+// divides the ranges into shards (split_ranges), which workers process each
+// with its own read-only copy of the database (or a partition of it, loaded
+// with just the shard's ranges). The workers discover the alleles in their
+// shards, writing them with capnp_write_discovered_alleles_to_file; the
+// coordinator merges them (merge_discovered_alleles_files), unifies the
+// sites and divides them among the shards (split_sites); the workers
+// genotype their shards' sites (genotype_shard); and lastly the coordinator
+// concatenates the shards' outputs (Service::concatenate_shards). The
+// glnexus_dist tool provides these steps as subcommands.
+
+// Divide the ranges into up to n shards of consecutive ranges, of about equal
+// total length. Ranges aren't themselves divided, so there may be fewer than
+// n shards.
+Status split_ranges(const std::vector<range>& ranges, size_t n,
+                    std::vector<std::vector<range>>& shards);
+
+// Write the ranges to a three-column BED file (as read by parse_bed_file)
+Status write_bed_file(const std::vector<range>& ranges,
+                      const std::vector<std::pair<std::string,size_t> >& contigs,
+                      const std::string& filename);
+
+// Load and merge the (capnp) discovered alleles of the shards, which must have
+// the same contigs and sample count
+Status merge_discovered_alleles_files(const std::vector<std::string>& filenames,
+                                      const std::vector<std::pair<std::string,size_t> >& contigs,
+                                      discovered_alleles& dsals,
+                                      unsigned& sample_count);
+
+// Divide the (sorted) sites among the shards from split_ranges, each going to
+// the last shard beginning at or before it
+Status split_sites(const std::vector<unified_site>& sites,
+                   const std::vector<std::vector<range>>& shards,
+                   std::vector<std::vector<unified_site>>& ans);
+
+// Genotype the sites of shard number part into output_filename, with
+// Service::genotype_sites_shard; otherwise as genotype(). If checkpoint_sites
+// is nonzero, the shard is instead genotyped resumably in chunks of that many
+// sites (Service::genotype_sites_checkpointed), checkpointed in the directory
+// output_filename + ".checkpoint", so that a worker restarted after
+// preemption picks up where it left off.
+Status genotype_shard(std::shared_ptr<spdlog::logger> logger,
+                      size_t mem_budget, size_t nr_threads,
+                      const std::string &dbpath,
+                      const GLnexus::genotyper_config &genotyper_cfg,
+                      const std::vector<unified_site> &sites,
+                      const std::vector<std::string> &extra_header_lines,
+                      size_t part,
+                      const std::string &output_filename,
+                      size_t prefetch_distance = 0,
+                      size_t checkpoint_sites = 0);
+
+// Append a one-line JSON performance report (see perf.h) for a phase of the
+// operation to the given file: the process-wide counters accumulated since
+// the snapshot perf_since, taken at t0, and the database statistics
+// accumulated between db_stats_since and db_stats (see KeyValue::DB::statistics)
+Status write_perf_report(const std::string& filename, const std::string& phase,
+                         std::chrono::steady_clock::time_point t0, const perf::snapshot& perf_since,
+                         const std::map<std::string,uint64_t>& db_stats_since,
+                         const std::map<std::string,uint64_t>& db_stats);
+
+// Discover alleles, unify sites and genotype them contig by contig, as a
+// pipeline: genotyping of one contig proceeds while the following contigs'
+// alleles are discovered and unified, and each contig's discovered alleles and
+// sites are freed as soon as it's been genotyped. pipeline_depth contigs are
+// in flight at once. This produces the same output as genotype() on the sites
+// from unify_sites() on discover_alleles() without holding all the
+// intermediate results in memory at once (but doesn't provide them either).
+// numa and prefetch_distance are as for genotype(). If budget is provided,
+// the bucket cache and the results in flight draw from it (see
+// memory_budget.h); it should be the one the database was opened with, if
+// any.
+Status discover_unify_genotype(std::shared_ptr<spdlog::logger> logger,
+                               size_t mem_budget, size_t nr_threads,
+                               KeyValue::DB *db,
+                               const std::vector<range> &ranges,
+                               const std::vector<std::pair<std::string,size_t> > &contigs,
+                               const unifier_config &unifier_cfg,
+                               const GLnexus::genotyper_config &genotyper_cfg,
+                               const std::vector<std::string> &extra_header_lines,
+                               const std::string &output_filename,
+                               size_t pipeline_depth,
+                               GLnexus::unifier_stats& stats,
+                               bool numa = false, size_t prefetch_distance = 0,
+                               memory_budget* budget = nullptr);
+
+// Incremental cohort growth: update the output of a previous run for the
+// samples since added to the database (those not in prior_output_filename).
+// Discovers alleles in the added samples only, merging them with the prior
+// run's discovered alleles; unifies the sites; and genotypes them with
+// Service::genotype_sites_incremental, which at sites whose genotypes are
+// reusable genotypes just the added samples, appending their columns to the
+// prior records. The merged discovered alleles and the sites are written
+// (capnp) to alleles_filename and sites_filename, for the next increment.
+// The prior alleles and sites files are likewise capnp, as are those of a
+// non-incremental run written with capnp_write_discovered_alleles_to_file &
+// capnp_write_unified_sites_to_file. db must be writable (to record the
+// added samples' sample set); the second form opens the database at dbpath
+// read-write for the purpose.
+Status genotype_incremental(std::shared_ptr<spdlog::logger> logger,
+                            size_t mem_budget, size_t nr_threads,
+                            KeyValue::DB *db,
+                            const std::vector<range> &ranges,
+                            const std::vector<std::pair<std::string,size_t> > &contigs,
+                            const unifier_config &unifier_cfg,
+                            const GLnexus::genotyper_config &genotyper_cfg,
+                            const std::vector<std::string> &extra_header_lines,
+                            const std::string &prior_alleles_filename,
+                            const std::string &prior_sites_filename,
+                            const std::string &prior_output_filename,
+                            const std::string &alleles_filename,
+                            const std::string &sites_filename,
+                            const std::string &output_filename,
+                            GLnexus::unifier_stats& stats);
+Status genotype_incremental(std::shared_ptr<spdlog::logger> logger,
+                            size_t mem_budget, size_t nr_threads,
+                            const std::string &dbpath,
+                            const std::vector<range> &ranges,
+                            const std::vector<std::pair<std::string,size_t> > &contigs,
+                            const unifier_config &unifier_cfg,
+                            const GLnexus::genotyper_config &genotyper_cfg,
+                            const std::vector<std::string> &extra_header_lines,
+                            const std::string &prior_alleles_filename,
+                            const std::string &prior_sites_filename,
+                            const std::string &prior_output_filename,
+                            const std::string &alleles_filename,
+                            const std::string &sites_filename,
+                            const std::string &output_filename,
+                            GLnexus::unifier_stats& stats);
+
+// Query server: a long-running process holding the database open, so that
+// its caches (metadata, block and decoded bucket caches) stay warm across
+// on-demand queries of small ranges, which it answers concurrently on one
+// Service. It listens on a Unix domain socket at socket_path (replacing a
+// stale socket there), reading one request line from each connection:
+//
+//   discover RANGES [SAMPLESET]   -> the discovered alleles, as YAML
+//   genotype RANGES [SAMPLESET]   -> discover, unify and genotype the sites in
+//                                    the ranges, per the configuration (VCF, BCF
+//                                    or SPARSE, without residuals or index)
+//
+// RANGES is a comma-separated list as for parse_ranges, and SAMPLESET an
+// existing sample set (default: all samples). The response is a line "OK"
+// and the output's length in bytes, followed by the output, or "ERROR" and
+// the error; then the connection is closed. Up to max_concurrent requests are processed at once, the rest
+// waiting their turn on the socket. If deadline_ms is nonzero, requests
+// taking longer are aborted. Each request's latency is logged. Returns once
+// stop is set (e.g. by a signal handler), after finishing the requests in
+// progress.
+Status serve(std::shared_ptr<spdlog::logger> logger,
+             size_t mem_budget, size_t nr_threads,
+             const std::string &dbpath,
+             const unifier_config &unifier_cfg,
+             const GLnexus::genotyper_config &genotyper_cfg,
+             const std::vector<std::string> &extra_header_lines,
+             size_t prefetch_distance,
+             const std::string &socket_path,
+             size_t max_concurrent, uint64_t deadline_ms,
+             std::atomic<bool>& stop);
+
+// Send a request to the query server at socket_path, writing the output to
+// out. A server error is returned as FAILURE, with its message; output cut
+// short of its stated length (e.g. the server failed while sending it) as
+// IOError.
+Status query_server(const std::string &socket_path, const std::string &request,
+                    std::ostream &out);
 
 // compare different implementations of database iteration methods.
 //
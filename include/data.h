@@ -53,6 +53,26 @@ public:
 
     /// Return the count of all samples in the database.
     virtual Status sample_count(size_t& ans) const = 0;
+
+    /// Get the dense integer ID of a sample or data set, or vice versa.
+    ///
+    /// IDs are assigned consecutively (from zero) to samples and data sets
+    /// as they're added, and never change. Query paths can thus represent
+    /// sets of them as sorted vectors of integers rather than sets of strings
+    /// (see MetadataCache::sampleset_ids), converting back to names only for
+    /// output. Implementations which don't assign IDs return NotImplemented.
+    virtual Status sample_id(const std::string& sample, uint32_t& ans) const {
+        return Status::NotImplemented();
+    }
+    virtual Status dataset_id(const std::string& dataset, uint32_t& ans) const {
+        return Status::NotImplemented();
+    }
+    virtual Status sample_name(uint32_t id, std::string& ans) const {
+        return Status::NotImplemented();
+    }
+    virtual Status dataset_name(uint32_t id, std::string& ans) const {
+        return Status::NotImplemented();
+    }
 };
 
 
@@ -75,11 +95,52 @@ public:
     Status sample_dataset(const std::string& sample, std::string& ans) const override;
     Status all_samples_sampleset(std::string& ans) override;
     Status sample_count(size_t& ans) const override;
+    Status sample_id(const std::string& sample, uint32_t& ans) const override;
+    Status dataset_id(const std::string& dataset, uint32_t& ans) const override;
+    Status sample_name(uint32_t id, std::string& ans) const override;
+    Status dataset_name(uint32_t id, std::string& ans) const override;
 
     const std::vector<std::pair<std::string,size_t> >& contigs() const;
     Status sampleset_datasets(const std::string& sampleset,
                               std::shared_ptr<const std::set<std::string> >& samples,
                               std::shared_ptr<const std::set<std::string>>& datasets) const;
+
+    /// The IDs of the samples in a sample set, and of the data sets
+    /// containing them, each in ascending order. NotImplemented if the
+    /// underlying Metadata doesn't assign IDs.
+    Status sampleset_ids(const std::string& sampleset,
+                         std::shared_ptr<const std::vector<uint32_t>>& sample_ids,
+                         std::shared_ptr<const std::vector<uint32_t>>& dataset_ids) const;
+};
+
+/// Concurrent cache of how each data set's samples correspond to a given
+/// list of samples, such as those of a sample set (in sorted order). Both
+/// discovery and genotyping need this for every data set they touch, at every
+/// site; sample sets and data sets being immutable, it can be worked out just
+/// once per (sample set, data set) and shared.
+class DatasetSampleIndex {
+    struct body;
+    std::unique_ptr<body> body_;
+
+    DatasetSampleIndex(const DatasetSampleIndex&) = delete;
+
+public:
+    struct entry {
+        /// The data set's samples which are in the list: mapping[i] = j if the
+        /// i'th sample in the data set's BCF header is samples[j].
+        std::map<int,int> mapping;
+        /// ...the same BCF sample indices i, in ascending order
+        std::vector<unsigned> bcf_samples;
+    };
+
+    explicit DatasetSampleIndex(const std::vector<std::string>& samples);
+    ~DatasetSampleIndex();
+
+    const std::vector<std::string>& samples() const;
+
+    /// Get the entry for the data set, building it from its header the first
+    /// time. The entry is immutable, and valid as long as the pointer is held.
+    std::shared_ptr<const entry> get(const std::string& dataset, const bcf_hdr_t* hdr);
 };
 
 /// Iterate over BCF records within some range.
@@ -121,21 +182,25 @@ public:
     /// should yield variant records only, while min_alleles=0 will
     /// yield all records.
     ///
-    /// Note: the BCF record is provided in packed form to the predicate
-    /// function. It can unpack it if needed, in which case, it will not be
-    /// unpacked again by the dataset_range function.
+    /// Note: the predicate function is applied to a view of the serialized
+    /// record (bcf_raw_view), before the record is copied and unpacked.
+    ///
+    /// fields: if non-null, the INFO and FORMAT fields the caller needs; the
+    /// records may lack any others. Otherwise, all fields are retained.
     ///
     /// The provided header must match the data set, otherwise the behavior is undefined!
     virtual Status dataset_range(const std::string& dataset, const bcf_hdr_t* hdr,
                                  const range& pos, bcf_predicate predicate,
-                                 std::vector<std::shared_ptr<bcf1_t>>* records) = 0;
+                                 std::vector<std::shared_ptr<bcf1_t>>* records,
+                                 const bcf_field_selection* fields = nullptr) = 0;
 
     /// Wrapper for dataset_range which first fetches the appropriate header
     /// (useful if the caller doesn't already have the header in hand)
     virtual Status dataset_range_and_header(const std::string& dataset,
                                             const range& pos, bcf_predicate predicate,
                                             std::shared_ptr<const bcf_hdr_t>* hdr,
-                                            std::vector<std::shared_ptr<bcf1_t>>* records);
+                                            std::vector<std::shared_ptr<bcf1_t>>* records,
+                                            const bcf_field_selection* fields = nullptr);
 
     /// Get iterators for BCF records overlapping the given range in all
     /// datasets containing at least one sample in the designated sample set.
@@ -146,11 +211,26 @@ public:
     /// relevant data set (possibly yielding zero records in some steps) --
     /// that is, they will all reach their end after the same number of steps.
     /// The iterators together will produce each relevant record exactly once.
+    /// The fields selection is as in dataset_range; if non-null, it must
+    /// remain valid for the lifetime of the iterators.
     virtual Status sampleset_range(const MetadataCache& metadata, const std::string& sampleset,
                                    const range& pos, bcf_predicate predicate,
                                    std::shared_ptr<const std::set<std::string>>& samples,
                                    std::shared_ptr<const std::set<std::string>>& datasets,
-                                   std::vector<std::unique_ptr<RangeBCFIterator>>& iterators);
+                                   std::vector<std::unique_ptr<RangeBCFIterator>>& iterators,
+                                   const bcf_field_selection* fields = nullptr);
+
+    /// Advise that a sampleset_range query with the same arguments will
+    /// follow shortly. The implementation may read (and decode into any cache
+    /// it keeps) the pertinent data now, so that the query needn't wait for
+    /// storage. This blocks while it reads; callers run it on separate I/O
+    /// threads ahead of the query (see service_config::prefetch_distance).
+    /// The base implementation does nothing.
+    virtual Status prefetch(const MetadataCache& metadata, const std::string& sampleset,
+                            const range& pos, bcf_predicate predicate,
+                            const bcf_field_selection* fields = nullptr) {
+        return Status::OK();
+    }
 };
 
 }
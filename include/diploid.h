@@ -30,6 +30,19 @@ Status bcf_alleles_topAQ(const bcf_hdr_t* hdr, bcf1_t* record, const std::vector
 Status alleles_topAQ(unsigned n_allele, unsigned n_sample, const std::vector<unsigned>& samples,
                      const std::vector<double>& gl, std::vector<top_AQ>& ans);
 
+// Batch kernels on flat PL buffers with genotypes(n_allele) entries for each
+// sample, as from bcf_get_format_int32. These use AVX2 instructions if the CPU
+// supports them. Both return false if there's a negative PL entry.
+
+// Convert n PLs to genotype log-likelihoods, as bcf_get_genotype_log_likelihoods
+bool PL_log_likelihoods(const int32_t* pl, size_t n, double* gll);
+
+// Compute the AQ of each allele in each of the given samples, as
+// alleles_topAQ would from the log-likelihoods, filling ans with
+// ans[al*samples.size()+i] for sample samples[i]
+bool PL_alleles_AQ(unsigned n_allele, unsigned n_sample, const std::vector<unsigned>& samples,
+                   const int32_t* pl, std::vector<int>& ans);
+
 namespace trio {
 int mendelian_inconsistencies(int gt_p1, int gt_p2, int gt_ch);
 }
@@ -7,11 +7,14 @@
 namespace GLnexus {
 
 // Discover alleles from a RangeBCFIterator. Records not contained within pos will be ignored.
+// sample_index: if provided, an index of the samples (in order), used to
+// find each dataset's relevant samples instead of looking them up anew.
 Status discover_alleles_from_iterator(const std::set<std::string>& samples,
                                       const range& pos,
                                       RangeBCFIterator& iterator,
                                       discovered_alleles& dsals,
-                                      bool include_zero_copies = false);
+                                      bool include_zero_copies = false,
+                                      DatasetSampleIndex* sample_index = nullptr);
 
 // verify that the discovered_alleles has a REF allele for each ALT allele, and that the REF
 // alleles are all consistent with each other.
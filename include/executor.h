@@ -0,0 +1,154 @@
+#ifndef GLNEXUS_EXECUTOR_H
+#define GLNEXUS_EXECUTOR_H
+
+// Work-stealing thread pool for the Service's compute tasks, and task groups
+// for nested parallelism on it.
+//
+// Each worker thread has its own deque of tasks: tasks submitted by a worker
+// go onto its deque, which it runs newest-first (keeping nested work local),
+// while idle workers steal the oldest tasks from the others' deques. Tasks
+// submitted from other threads go onto a shared queue.
+//
+// A task may fan out further tasks in a task_group and wait for them. Rather
+// than blocking, the waiting thread runs the group's tasks which haven't yet
+// started, so it only waits for those already under way on other threads.
+// Thus waiting on a group is safe from within a task on the same executor,
+// however deeply nested, and the waiting thread keeps its core busy.
+//
+// On multi-socket hosts the workers can be divided among the NUMA nodes, each
+// group pinned to its node's CPUs. Each node then has its own shared queue,
+// tasks may be directed to a particular node, and idle workers look for work
+// on their own node before stealing from others.
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace GLnexus {
+
+// The CPUs of each NUMA node of this host, from sysfs; empty if the host has
+// just one node (or the topology isn't available).
+std::vector<std::vector<int>> numa_nodes();
+
+class executor {
+    struct body;
+    std::unique_ptr<body> body_;
+
+    executor(const executor&) = delete;
+
+public:
+    using task = std::function<void(int)>;
+
+    explicit executor(size_t threads);
+
+    // Divide the workers among the given NUMA nodes (see numa_nodes())
+    // according to their CPU counts, pinning each to its node's CPUs. If
+    // nodes is empty, this is the same as the above.
+    executor(size_t threads, const std::vector<std::vector<int>>& nodes);
+
+    // Runs any remaining queued tasks, then joins the worker threads
+    ~executor();
+
+    size_t size() const;
+
+    // Number of NUMA nodes among which the workers are divided (1 if not
+    // NUMA-aware)
+    size_t nodes() const;
+
+    // Enqueue a task, to be called with the index of the worker running it.
+    // Tasks mustn't throw. If node is given (modulo nodes()), the task is
+    // queued for that node's workers, otherwise a worker's tasks go onto its
+    // own deque and others' are spread across the nodes.
+    void submit(task t, int node = -1);
+
+    // Enqueue f(tid) as with ctpl::thread_pool::push, returning a future of
+    // its result
+    template<typename F>
+    auto push(F&& f, int node = -1) -> std::future<typename std::result_of<F(int)>::type> {
+        using R = typename std::result_of<F(int)>::type;
+        auto pt = std::make_shared<std::packaged_task<R(int)>>(std::forward<F>(f));
+        auto fut = pt->get_future();
+        submit([pt](int tid) { (*pt)(tid); }, node);
+        return fut;
+    }
+
+    // The index of the calling thread among this executor's workers, or -1
+    int current_worker() const;
+
+    // The NUMA node of the calling thread, if it's a worker of a NUMA-aware
+    // executor, or -1
+    static int current_node();
+
+    // Make current_node() report the given node on the calling thread, which
+    // mustn't be a worker; returns the previous value, to be restored later.
+    // This lets a helper thread (e.g. reading ahead into a NUMA node's bucket
+    // cache partition) act on behalf of a node's workers.
+    static int set_current_node(int node);
+};
+
+class task_group {
+    struct state;
+    executor& ex_;
+    int node_;
+    std::shared_ptr<state> st_;
+
+    task_group(const task_group&) = delete;
+
+    // Add a task to the group's queue, and submit to the executor a ticket
+    // to run the next queued task
+    void enqueue(std::function<void()> fn);
+
+    // Run the group's next queued task on the calling thread, if any
+    static bool run_one(state& st);
+
+    // Wait until either ready() or the group has a queued task (or finished)
+    void wait_until(const std::function<bool()>& ready);
+
+public:
+    // node: as for executor::submit, for all the group's tasks
+    explicit task_group(executor& ex, int node = -1);
+
+    // Waits for the group's tasks
+    ~task_group();
+
+    executor& get_executor() { return ex_; }
+
+    // Run fn() in the group. It mustn't throw.
+    void run(std::function<void()> fn) { enqueue(std::move(fn)); }
+
+    // Run f() in the group, returning a future of its result (wait on it
+    // with get() below)
+    template<typename F>
+    auto push(F&& f) -> std::future<typename std::result_of<F()>::type> {
+        using R = typename std::result_of<F()>::type;
+        auto pt = std::make_shared<std::packaged_task<R()>>(std::forward<F>(f));
+        auto fut = pt->get_future();
+        enqueue([pt]() { (*pt)(); });
+        return fut;
+    }
+
+    // Get the result of a future from push(), running the group's queued
+    // tasks on the calling thread until it's ready
+    template<typename T>
+    T get(std::future<T>& fut) {
+        auto ready = [&fut]() {
+            return fut.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        };
+        while (!ready()) {
+            if (!run_one(*st_)) {
+                wait_until(ready);
+            }
+        }
+        return fut.get();
+    }
+
+    // Wait for all the group's tasks (including any they add to the group),
+    // running them on the calling thread if they haven't yet started
+    void wait();
+};
+
+}
+
+#endif
@@ -7,21 +7,81 @@
 #include <memory>
 #include "residuals.h"
 
+
 namespace GLnexus {
 
+class executor;
+
+// Preparation of a genotyper_config for genotyping many sites, such as
+// validating and resolving the FORMAT fields to lift over, done just once
+// instead of for each site.
+struct genotyper_plan;
+Status prepare_genotyper_plan(const genotyper_config& cfg, std::shared_ptr<const genotyper_plan>& ans);
+
 // Genotype a site.
 //
-// residual_rec: in case there are call losses, generate a YAML formatted record giving
-// the context. This is used offline to improve the algorithms.
+// residual_rec: in case there are call losses, generate a record giving the
+// context, in cfg.residuals_format (see residuals.h). This is used offline to
+// improve the algorithms.
 //
 // May set ans to nullptr if the site ends up with all ALT alleles trimmed.
+//
+// If a pool is provided and the sample set has more than slice_samples
+// samples, then the datasets are divided into slices of roughly that many
+// samples, which are retrieved and genotyped concurrently on the pool, each
+// filling in its own samples' calls and FORMAT fields; these are then combined
+// into the output record, which is identical to that of the sequential
+// procedure. The calling thread works on the slices too, so it may itself be
+// a task on the pool.
+//
+// plan: from prepare_genotyper_plan on cfg; prepared for this site if null.
+//
+// sample_index: an index of samples (see DatasetSampleIndex), shared across
+// calls so that each dataset's samples are mapped onto them just once; built
+// for this site if null.
 Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data,
                      const unified_site& site,
                      const std::string& sampleset, const std::vector<std::string>& samples,
                      const bcf_hdr_t* hdr, std::shared_ptr<bcf1_t>& ans,
                      bool residualsFlag,
                      std::shared_ptr<std::string> &residual_rec,
-                     std::atomic<bool>* abort = nullptr);
+                     std::atomic<bool>* abort = nullptr,
+                     executor* pool = nullptr, size_t slice_samples = 0,
+                     const genotyper_plan* plan = nullptr,
+                     DatasetSampleIndex* sample_index = nullptr);
+
+// Genotype the group of sites [first,last) from sites, which must all lie on
+// the same contig (and ought to be near each other). Each dataset's records
+// overlapping the group are retrieved just once and then applied to each of
+// the sites, instead of querying (and deserializing) the same storage buckets
+// over again for each site. Results are identical to calling genotype_site on
+// each site in turn; ans and residual_recs are filled with last-first entries
+// corresponding to the sites. The pool, slice_samples, plan and sample_index
+// are as for genotype_site.
+Status genotype_site_group(const genotyper_config& cfg, MetadataCache& cache, BCFData& data,
+                           const std::vector<unified_site>& sites, size_t first, size_t last,
+                           const std::string& sampleset, const std::vector<std::string>& samples,
+                           const bcf_hdr_t* hdr, std::vector<std::shared_ptr<bcf1_t>>& ans,
+                           bool residualsFlag,
+                           std::vector<std::shared_ptr<std::string>>& residual_recs,
+                           std::atomic<bool>* abort = nullptr,
+                           executor* pool = nullptr, size_t slice_samples = 0,
+                           const genotyper_plan* plan = nullptr,
+                           DatasetSampleIndex* sample_index = nullptr);
+
+// Advise data of the query genotype_site_group will make for the same group
+// of sites (see BCFData::prefetch), so that it can be read ahead of time.
+Status prefetch_site_group(const genotyper_config& cfg, const MetadataCache& cache, BCFData& data,
+                           const std::vector<unified_site>& sites, size_t first, size_t last,
+                           const std::string& sampleset, bool residualsFlag);
+
+// Do the genotypes called at the prior site remain valid at site, the same
+// site as unified for a grown cohort? They do if it has the same position,
+// alleles and unification of the input alleles, since each sample's call
+// depends only on those and its own records -- unless genotype revision is
+// enabled, whose prior also depends on the allele frequencies.
+bool genotypes_reusable(const genotyper_config& cfg, const unified_site& prior,
+                        const unified_site& site);
 
 // Reasons for emitting a non-call (.), encoded in the RNC FORMAT field in the
 // output VCF
@@ -0,0 +1,64 @@
+#ifndef GLNEXUS_MEMORY_BUDGET_H
+#define GLNEXUS_MEMORY_BUDGET_H
+
+// A process-wide memory budget, shared by the components which hold
+// substantial memory: the RocksDB block cache, the decoded bucket cache and
+// the Service's in-flight results (genotype_sites' reorder window,
+// discover_alleles' per-range results).
+//
+// Caches reserve their (fixed) sizes when they're created, and return them
+// when they're destroyed. What remains is available to transient usage,
+// which the Service charges to the budget as its tasks produce results and
+// releases as they're consumed. Admission control then holds back further
+// tasks while the budget is spent, so that the total stays within it rather
+// than growing with the width of the cohort or the depth of the queues.
+//
+// Charging is by approximate (estimated) sizes, so the budget bounds the
+// bulk of the memory usage rather than every allocation. Small fixed
+// allowances are reserved for the rest, such as each thread's free list of
+// recycled bcf1_t records (bcf_init_pooled, bounded by BCF_POOL_MAX_BYTES).
+
+#include <cstddef>
+#include <mutex>
+
+namespace GLnexus {
+
+class memory_budget {
+    const size_t total_;
+    mutable std::mutex mu_;
+    size_t reserved_ = 0;   // held by caches
+    size_t in_use_ = 0;     // charged by transient usage
+
+    memory_budget(const memory_budget&) = delete;
+    void operator=(const memory_budget&) = delete;
+
+public:
+    explicit memory_budget(size_t total) : total_(total) {}
+
+    size_t total() const { return total_; }
+    size_t reserved() const;
+    size_t in_use() const;
+
+    // bytes neither reserved nor in use (zero if overcommitted)
+    size_t available() const;
+
+    // Reserve up to the given number of bytes for a cache, returning the
+    // number granted (less than requested if the budget is short of it).
+    size_t reserve(size_t bytes);
+    void unreserve(size_t bytes);
+
+    // Charge transient usage of the given size if it's available, returning
+    // whether it was charged.
+    bool try_acquire(size_t bytes);
+
+    // Charge transient usage unconditionally (e.g. when it's needed for
+    // progress); the budget may be overcommitted as a result.
+    void take(size_t bytes);
+
+    // Release transient usage charged by try_acquire or take.
+    void release(size_t bytes);
+};
+
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef GLNEXUS_PERF_H
+#define GLNEXUS_PERF_H
+
+// Low-overhead instrumentation of the hot paths: event counters and latency
+// histograms kept by each thread without synchronization, and summed across
+// all threads on demand into a snapshot, which can be reported as JSON. The
+// counters are process-wide; the difference between snapshots taken before
+// and after some operation gives that operation's profile (provided nothing
+// else is running concurrently).
+
+#include <chrono>
+#include <map>
+#include <ostream>
+#include <string>
+#include "types.h"
+
+namespace GLnexus {
+namespace perf {
+
+enum class counter : unsigned {
+    buckets_read,           // database buckets read by range queries
+    bucket_bytes_read,      // ...their total size (as stored)
+    records_decoded,        // BCF records deserialized from the buckets
+    records_in_range,       // ...those overlapping the query range
+    bucket_cache_hits,      // decoded bucket cache lookups (if the cache is enabled)
+    bucket_cache_misses,
+    sites_genotyped,
+    output_records,         // pVCF records written
+    output_bytes,           // ...their total size, before BGZF compression
+    stalled_ms,             // time worker threads spent waiting on output serialization
+    buckets_prefetched,     // database buckets read ahead of the queries (see BCFData::prefetch)
+    COUNT
+};
+
+enum class timer : unsigned {
+    fetch,                  // reading a bucket from the database
+    decode,                 // deserializing a bucket's records
+    discover,               // discovering alleles in one range
+    unify,                  // unifying the alleles on one contig (or one chunk of it)
+    genotype,               // genotyping one group of nearby sites (see genotype_grid_bp)
+    write,                  // serializing, compressing & writing one pVCF record
+    COUNT
+};
+
+const char* counter_name(counter c);
+const char* timer_name(timer t);
+
+// latency histogram bins: bin i counts durations d with 2^(i-1) <= d < 2^i
+// microseconds (bin 0 counts d < 1us, and the last bin everything beyond)
+const unsigned HISTOGRAM_BINS = 32;
+
+struct timing {
+    uint64_t count = 0, total_us = 0;
+    uint64_t histogram[HISTOGRAM_BINS] = {0};
+
+    // approximate quantile (upper edge of the bin containing it), in us
+    uint64_t quantile_us(double q) const;
+};
+
+struct snapshot {
+    uint64_t counters[(unsigned)counter::COUNT] = {0};
+    timing timings[(unsigned)timer::COUNT];
+
+    uint64_t operator[](counter c) const { return counters[(unsigned)c]; }
+    const timing& operator[](timer t) const { return timings[(unsigned)t]; }
+
+    snapshot& operator+=(const snapshot& rhs);
+    snapshot& operator-=(const snapshot& rhs);
+};
+
+// Add to this thread's counter
+void count(counter c, uint64_t n = 1);
+
+// Record a duration in this thread's histogram
+void record(timer t, uint64_t us);
+
+// Time the enclosing scope, or until stop() if that's sooner
+class scoped_timer {
+    timer t_;
+    bool running_ = true;
+    std::chrono::steady_clock::time_point t0_;
+public:
+    scoped_timer(timer t) : t_(t), t0_(std::chrono::steady_clock::now()) {}
+    ~scoped_timer() { stop(); }
+    void stop() {
+        if (running_) {
+            record(t_, std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - t0_).count());
+            running_ = false;
+        }
+    }
+};
+
+// Sum the counters of all threads (including those which have exited)
+snapshot current();
+
+// Write a one-line JSON report of a phase of the operation:
+// {"phase":..., "elapsed_ms":..., "counters":{...}, "timers":{...}, "extra":{...}}
+// where each timer gives count, total_ms, p50_us, p99_us, max_us and the
+// nonzero histogram bins. extra holds additional statistics from elsewhere
+// (e.g. the database's own counters).
+Status report_json(const std::string& phase, uint64_t elapsed_ms, const snapshot& stats,
+                   const std::map<std::string,uint64_t>& extra, std::ostream& out);
+
+}}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <fstream>
 #include <memory>
+#include <bgzf.h>
 #include "data.h"
 #include "types.h"
 
@@ -15,8 +16,9 @@ struct DatasetResidual {
     std::vector<std::shared_ptr<bcf1_t>> records;
 };
 
-// Create a YAML node describing a loss. The node is formatted as
-// a string for simplicity. The [sites] variable is a list of
+// Create a record describing a loss. In the YAML format, this is a YAML node
+// formatted as a string for simplicity; in the binary format, a packed capnp
+// ResidualsMessage (see defs.capnp). The [sites] variable is a list of
 // sites, and records in them, to print out.
 Status residuals_gen_record(const unified_site& site,
                             const bcf_hdr_t *gl_hdr,
@@ -24,26 +26,46 @@ Status residuals_gen_record(const unified_site& site,
                             const std::vector<DatasetResidual> &sites,
                             const MetadataCache& cache,
                             const std::vector<std::string>& samples,
-                            std::string &ynode);
+                            std::string &rec,
+                            GLnexusResidualsFormat format = GLnexusResidualsFormat::YAML);
 
 
 class ResidualsFile {
 private:
     std::string filename_;
+    GLnexusResidualsFormat format_;
     std::ofstream ofs_;
+    BGZF* bgzf_ = nullptr;
 
 public:
     // constructor
-    ResidualsFile(std::string filename) : filename_(filename) {}
+    ResidualsFile(std::string filename, GLnexusResidualsFormat format = GLnexusResidualsFormat::YAML)
+        : filename_(filename), format_(format) {}
 
     // destructor
     ~ResidualsFile();
 
     static Status Open(std::string filename, std::unique_ptr<ResidualsFile> &ans);
 
-    // write a YAML record to the end of the file, as an element in a top-level sequence.
+    // Open a file in the residuals format (and compression level) given by
+    // cfg. A binary residuals file is BGZF-compressed and begins with a
+    // header giving the contigs; header=false omits it, for part files to be
+    // concatenated after the first one.
+    static Status Open(const genotyper_config& cfg, std::string filename,
+                       const std::vector<std::pair<std::string,size_t>>& contigs, bool header,
+                       std::unique_ptr<ResidualsFile> &ans);
+
+    // write a record to the end of the file: in the YAML format, as an
+    // element in a top-level sequence.
     Status write_record(std::string &rec);
+
+    // finish writing the file (otherwise done by the destructor)
+    Status close();
 };
 
+// Convert a binary residuals file to the YAML format, writing the same YAML
+// documents as a YAML residuals file would have.
+Status residuals_yaml_of_binary(const std::string& filename, std::ostream& out);
+
 } // namespace GLnexus
 #endif
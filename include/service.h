@@ -6,8 +6,11 @@
 #include <map>
 #include <set>
 #include <memory>
+#include <functional>
 #include "types.h"
 #include "data.h"
+#include "perf.h"
+#include "memory_budget.h"
 
 namespace GLnexus {
 
@@ -16,6 +19,50 @@ struct service_config {
 
     // additional (informational) lines to insert into output pVCF headers
     std::vector<std::string> extra_header_lines;
+
+    // genotype_sites processes consecutive sites in groups falling within
+    // the same window of this many bp (nominally the database bucket size),
+    // retrieving the stored records just once for each group...
+    size_t genotype_grid_bp = 30000;
+    // ...up to this many sites per group
+    size_t genotype_grid_max_sites = 32;
+
+    // genotype_sites worker threads pause when the completed output records
+    // awaiting (in-order) serialization exceed this many bytes
+    size_t genotype_window_bytes = 1ULL << 30;
+
+    // If nonzero, then each site (group) is genotyped using additional
+    // threads when the sample set has more than this many samples, dividing
+    // its datasets into slices of about this many samples (see
+    // genotype_site). This helps to use all the threads when there are few
+    // sites and very many samples, as for targeted panels.
+    size_t genotype_slice_samples = 0;
+
+    // On a multi-socket host, divide the worker threads among the NUMA nodes
+    // (pinning each group to its node's CPUs), and direct the concurrent
+    // parts of genotype_sites_sharded and genotype_sites_pipelined to the
+    // nodes in turn, so that each node works on its own regions of the genome
+    // (and its own partition of a decoded bucket cache; see
+    // BCFKeyValueData::Open).
+    bool numa = false;
+
+    // If nonzero, then while genotype_sites (or the multi-range
+    // discover_alleles) works through its site groups (ranges) in order,
+    // dedicated I/O threads read the database buckets for those up to this
+    // many ahead of the furthest begun, decoding them into the bucket cache
+    // if it's enabled (see BCFData::prefetch). The workers then seldom wait
+    // on storage.
+    size_t prefetch_distance = 0;
+    // ...using this many I/O threads
+    size_t prefetch_threads = 4;
+
+    // If provided, genotype_sites and the multi-range discover_alleles
+    // charge their pending results (completed but not yet written or
+    // consumed) to this budget, and hold back further site groups (ranges)
+    // while it's spent, estimating their results' sizes from those so far.
+    // Enough are always let through to keep the output advancing. The
+    // budget must outlive the service.
+    memory_budget* budget = nullptr;
 };
 
 class Service {
@@ -63,16 +110,137 @@ public:
                             bool include_zero_copies = false,
                             std::atomic<bool>* abort = nullptr);
 
+    /// As above, but merging the alleles discovered in all the ranges into
+    /// one table. Each range's result is merged and freed as soon as those of
+    /// the preceding ranges have been, rather than all being held until the
+    /// end.
+    Status discover_alleles(const std::string& sampleset, const std::vector<range>& ranges,
+                            unsigned& N, discovered_alleles& ans,
+                            bool include_zero_copies = false,
+                            std::atomic<bool>* abort = nullptr);
+
+    /// As above, but passing the result for each range to consumer, in
+    /// order, as soon as it and those of the preceding ranges are available,
+    /// so that the caller needn't hold them all. (The multi-range
+    /// discover_alleles above are implemented with this.) An error from the
+    /// consumer aborts the discovery.
+    Status discover_alleles(const std::string& sampleset, const std::vector<range>& ranges,
+                            unsigned& N, bool include_zero_copies, std::atomic<bool>* abort,
+                            const std::function<Status(discovered_alleles&)>& consumer);
+
     /// Genotype a set of samples at the given sites, producing a BCF file.
     Status genotype_sites(const genotyper_config& cfg, const std::string& sampleset,
                           const std::vector<unified_site>& sites,
                           const std::string& filename,
                           std::atomic<bool>* abort = nullptr);
 
+    /// Like genotype_sites, but splits the sites into the given number of
+    /// contiguous shards, genotyped concurrently, each written to its own
+    /// part file by its own writer. The parts are then concatenated into the
+    /// output file; for BGZF-compressed output this concatenates the blocks
+    /// as-is, without recompression. This relieves the bottleneck of a single
+    /// thread serializing and writing all the output records.
+    Status genotype_sites_sharded(const genotyper_config& cfg, const std::string& sampleset,
+                                  const std::vector<unified_site>& sites, size_t shards,
+                                  const std::string& filename,
+                                  std::atomic<bool>* abort = nullptr);
+
+    /// Genotype one of several shards of the sites, each genotyped
+    /// separately (e.g. by different hosts, with their own copies of the
+    /// database) and then joined by concatenate_shards. The shards must be
+    /// contiguous runs of the sites, numbered by part in order; as with the
+    /// part files of genotype_sites_sharded, only part 0 includes the header
+    /// (also that of any binary residuals). output_index isn't supported
+    /// here, but by concatenate_shards.
+    Status genotype_sites_shard(const genotyper_config& cfg, const std::string& sampleset,
+                                const std::vector<unified_site>& sites, size_t part,
+                                const std::string& filename,
+                                std::atomic<bool>* abort = nullptr);
+
+    /// Concatenate the output files of genotype_sites_shard, in order of
+    /// part, into filename ("-" for standard output) as genotype_sites_sharded
+    /// does its part files, likewise any residuals, and index the result if
+    /// cfg.output_index. With the same cfg and sample set for all the shards,
+    /// the output is the same as that of genotype_sites on all their sites.
+    static Status concatenate_shards(const genotyper_config& cfg, const std::vector<std::string>& parts,
+                                     const std::string& filename);
+
+    /// Decode SPARSE output (see GLnexusOutputFormat) back to the VCF it
+    /// encodes, writing it into filename ("-" for standard output) in
+    /// cfg.output_format, VCF or BCF, with cfg's compression and index options.
+    /// The records are the same as genotype_sites would have written in that
+    /// format.
+    static Status sparse_to_vcf(const genotyper_config& cfg, const std::string& sparse_filename,
+                                const std::string& filename);
+
+    /// Genotype sites generated in consecutive batches, producing the same
+    /// output file as genotype_sites on their concatenation. produce(i, sites)
+    /// is called to generate batch i. Up to max_in_flight batches are produced
+    /// and genotyped concurrently, each into its own part file, so that
+    /// producing later batches (e.g. discovering and unifying the alleles on
+    /// the next contig) overlaps with genotyping the earlier ones. Each batch's
+    /// sites are freed, and its part appended to the output, as soon as it and
+    /// the preceding batches are complete.
+    ///
+    /// produce runs on the "meta" thread pool which drives the batches; it
+    /// may use discover_alleles (which runs on the compute thread pool) but
+    /// not the other genotype_sites operations.
+    Status genotype_sites_pipelined(const genotyper_config& cfg, const std::string& sampleset,
+                                    size_t batches, size_t max_in_flight,
+                                    const std::function<Status(size_t,std::vector<unified_site>&)>& produce,
+                                    const std::string& filename,
+                                    std::atomic<bool>* abort = nullptr);
+
+    /// Genotype the sites resumably, producing the same output file as
+    /// genotype_sites: they're genotyped in consecutive chunks of
+    /// checkpoint_sites, up to max_in_flight at once, each into its own part
+    /// file in checkpoint_dir (created if need be). As each chunk completes,
+    /// its part file is flushed to storage and renamed into place, and then
+    /// the chunk is recorded in a manifest, which is rewritten atomically.
+    /// Calling again with the same arguments after an interruption (e.g. the
+    /// host was preempted) genotypes only the chunks not yet recorded. Once
+    /// all are, the parts are concatenated into filename (as by
+    /// genotype_sites_sharded) and the checkpoint is removed. The manifest
+    /// fingerprints the sample set, sites, chunking and configuration;
+    /// resuming it with any of them different fails. header: whether the
+    /// output includes the header(s); false for the shards after the first
+    /// of genotype_sites_shard. Residuals must be in the binary format.
+    Status genotype_sites_checkpointed(const genotyper_config& cfg, const std::string& sampleset,
+                                       const std::vector<unified_site>& sites,
+                                       size_t checkpoint_sites, size_t max_in_flight,
+                                       const std::string& checkpoint_dir,
+                                       const std::string& filename, bool header = true,
+                                       std::atomic<bool>* abort = nullptr);
+
+    /// Update the output of an earlier genotype_sites for a grown cohort.
+    /// sampleset is the whole cohort, and added_sampleset its samples not in
+    /// prior_filename, which genotype_sites produced from this database for
+    /// prior_sites (with the same cfg; trim_uncalled_alleles isn't
+    /// supported). Where a prior site's genotypes remain valid at one of
+    /// sites (see genotypes_reusable), only the added samples are genotyped,
+    /// and their columns merged with the prior ones; the other sites are
+    /// genotyped afresh for the whole cohort. The output is the same as that
+    /// of genotype_sites(cfg, sampleset, sites, filename), except that any
+    /// residuals cover only the sites genotyped afresh. Sets reused (if
+    /// non-null) to the number of sites reusing prior genotypes.
+    Status genotype_sites_incremental(const genotyper_config& cfg, const std::string& sampleset,
+                                      const std::string& added_sampleset,
+                                      const std::vector<unified_site>& prior_sites,
+                                      const std::string& prior_filename,
+                                      const std::vector<unified_site>& sites,
+                                      const std::string& filename,
+                                      size_t* reused = nullptr,
+                                      std::atomic<bool>* abort = nullptr);
+
     // Report cumulative time (milliseconds) worker threads in the above
     // operations have spent 'stalled' waiting on single-threaded processing
     // steps (e.g. output serialization)
     uint64_t threads_stalled_ms() const;
+
+    // Report the performance counters (see perf.h) accumulated since the
+    // service started. They're process-wide, so they include the activity
+    // of any other services running concurrently.
+    perf::snapshot perf_stats() const;
 };
 
 }
@@ -412,9 +412,130 @@ struct discovered_allele_info {
         return os.str();
     }
 };
-using discovered_alleles = std::map<allele,discovered_allele_info>;
+
+// Table of discovered alleles, sorted by allele. This offers the subset of the
+// std::map interface used throughout, but stores the entries contiguously in
+// a vector instead of a balanced tree: whole-genome discovery may accumulate
+// tens of millions of alleles, and a node-based map makes building, merging
+// and scanning such a table pointer-chasing and allocator-bound.
+//
+// Insertion is cheap when keys arrive in (or near) sorted order, as they do
+// from discovery and from each other's iteration order -- appends are
+// amortized O(1). Random-order insertion is O(n) each, so bulk combination of
+// tables should go through merge_discovered_alleles, which is linear.
+//
+// Iterators (and references) are invalidated by insertion and erasure. The
+// keys are not const in the iterator value type, but must not be modified.
+class discovered_alleles {
+public:
+    using key_type = allele;
+    using mapped_type = discovered_allele_info;
+    using value_type = std::pair<allele,discovered_allele_info>;
+    using container_type = std::vector<value_type>;
+    using iterator = container_type::iterator;
+    using const_iterator = container_type::const_iterator;
+    using size_type = container_type::size_type;
+
+private:
+    container_type entries_;
+
+    static bool entry_lt(const value_type& p, const allele& k) noexcept { return p.first < k; }
+
+public:
+    discovered_alleles() = default;
+    discovered_alleles(std::initializer_list<value_type> il) {
+        for (const auto& p : il) {
+            insert(p);
+        }
+    }
+
+    iterator begin() noexcept { return entries_.begin(); }
+    iterator end() noexcept { return entries_.end(); }
+    const_iterator begin() const noexcept { return entries_.begin(); }
+    const_iterator end() const noexcept { return entries_.end(); }
+    const_iterator cbegin() const noexcept { return entries_.cbegin(); }
+    const_iterator cend() const noexcept { return entries_.cend(); }
+
+    size_type size() const noexcept { return entries_.size(); }
+    bool empty() const noexcept { return entries_.empty(); }
+    void reserve(size_type n) { entries_.reserve(n); }
+    void swap(discovered_alleles& rhs) noexcept { entries_.swap(rhs.entries_); }
+
+    // releases the storage, like std::map::clear
+    void clear() noexcept { container_type().swap(entries_); }
+
+    iterator lower_bound(const allele& k) {
+        return std::lower_bound(entries_.begin(), entries_.end(), k, entry_lt);
+    }
+    const_iterator lower_bound(const allele& k) const {
+        return std::lower_bound(entries_.begin(), entries_.end(), k, entry_lt);
+    }
+    iterator find(const allele& k) {
+        auto p = lower_bound(k);
+        return (p != entries_.end() && p->first == k) ? p : entries_.end();
+    }
+    const_iterator find(const allele& k) const {
+        auto p = lower_bound(k);
+        return (p != entries_.end() && p->first == k) ? p : entries_.end();
+    }
+    size_type count(const allele& k) const { return find(k) != end() ? 1 : 0; }
+
+    // As std::map::insert: no effect if the key is already present.
+    template<class P>
+    std::pair<iterator,bool> insert(P&& p) {
+        if (entries_.empty() || entries_.back().first < p.first) {
+            entries_.emplace_back(std::forward<P>(p));
+            return std::make_pair(entries_.end()-1, true);
+        }
+        auto it = lower_bound(p.first);
+        if (it != entries_.end() && it->first == p.first) {
+            return std::make_pair(it, false);
+        }
+        return std::make_pair(entries_.emplace(it, std::forward<P>(p)), true);
+    }
+
+    mapped_type& operator[](const allele& k) {
+        return insert(std::make_pair(k, mapped_type())).first->second;
+    }
+
+    iterator erase(const_iterator it) { return entries_.erase(it); }
+    size_type erase(const allele& k) {
+        auto p = find(k);
+        if (p == entries_.end()) {
+            return 0;
+        }
+        entries_.erase(p);
+        return 1;
+    }
+
+    // Append an entry known to sort after all present; for use when
+    // constructing a table from sorted input.
+    void push_back_sorted(value_type&& p) {
+        assert(entries_.empty() || entries_.back().first < p.first);
+        entries_.push_back(std::move(p));
+    }
+
+    bool operator==(const discovered_alleles& rhs) const { return entries_ == rhs.entries_; }
+    bool operator!=(const discovered_alleles& rhs) const { return !(*this == rhs); }
+};
+
+// Combine the info of an allele discovered again (ai) into the existing
+// entry (dest), as the merges below do
+Status merge_discovered_allele_info(const allele& allele, const discovered_allele_info& ai,
+                                    discovered_allele_info& dest);
+
+// Add src alleles to dest alleles. Identical alleles are merged, updating
+// topAQ and combining zygosity_by_GQ.
 Status merge_discovered_alleles(const discovered_alleles& src, discovered_alleles& dest);
 
+// Merge all of srcs into dest in one pass (a k-way merge), with the same
+// result as merging each of them into dest in turn. srcs are cleared by
+// side-effect. In case of error, dest is left unspecified.
+Status merge_discovered_alleles(std::vector<discovered_alleles>& srcs, discovered_alleles& dest);
+
+// Approximate memory usage of discovered alleles
+size_t discovered_alleles_bytes(const discovered_alleles& dsals);
+
 Status yaml_of_one_discovered_allele(const allele& allele,
                                      const discovered_allele_info& ainfo,
                                      const std::vector<std::pair<std::string,size_t> >& contigs,
@@ -510,22 +631,36 @@ struct StatsRangeQuery {
     int64_t nBCFRecordsRead;    // how many BCF records were read from the DB
     int64_t nBCFRecordsInRange; // how many were in the requested range
 
+    // decoded bucket cache lookups & evictions (if the cache is enabled)
+    int64_t nBucketCacheHits;
+    int64_t nBucketCacheMisses;
+    int64_t nBucketCacheEvictions;
+
     // constructor
     StatsRangeQuery() {
         nBCFRecordsRead = 0;
         nBCFRecordsInRange = 0;
+        nBucketCacheHits = 0;
+        nBucketCacheMisses = 0;
+        nBucketCacheEvictions = 0;
     }
 
     // copy constructor
     StatsRangeQuery(const StatsRangeQuery &srq) {
         nBCFRecordsRead = srq.nBCFRecordsRead;
         nBCFRecordsInRange = srq.nBCFRecordsInRange;
+        nBucketCacheHits = srq.nBucketCacheHits;
+        nBucketCacheMisses = srq.nBucketCacheMisses;
+        nBucketCacheEvictions = srq.nBucketCacheEvictions;
     }
 
     // Addition
     StatsRangeQuery& operator+=(const StatsRangeQuery& srq) {
         nBCFRecordsRead += srq.nBCFRecordsRead;
         nBCFRecordsInRange += srq.nBCFRecordsInRange;
+        nBucketCacheHits += srq.nBucketCacheHits;
+        nBucketCacheMisses += srq.nBucketCacheMisses;
+        nBucketCacheEvictions += srq.nBucketCacheEvictions;
         return *this;
     }
 
@@ -534,6 +669,11 @@ struct StatsRangeQuery {
         std::ostringstream os;
         os << "Num BCF records read " << std::to_string(nBCFRecordsRead)
            << "  query hits " << std::to_string(nBCFRecordsInRange);
+        if (nBucketCacheHits || nBucketCacheMisses) {
+            os << "  bucket cache hits " << std::to_string(nBucketCacheHits)
+               << " misses " << std::to_string(nBucketCacheMisses)
+               << " evictions " << std::to_string(nBucketCacheEvictions);
+        }
         return os.str();
     }
 };
@@ -599,6 +739,25 @@ enum class GLnexusOutputFormat {
 
     /// Uncompressed vcf (for ease of comparison in small cases)
     VCF,
+
+    /// Sparse vcf: the VCF header (with the samples on a header line of their
+    /// own) and site columns, but in place of the sample columns, each
+    /// record's most frequent cell, standing for every sample not otherwise
+    /// given; its next most frequent, with the runs of samples having it; and
+    /// the other cells, by sample index. For very large cohorts, where most
+    /// cells are alike (0/0 from reference bands, or no-calls), this is far
+    /// smaller and quicker to write and to load. Lossless: sparse_to_vcf
+    /// (cli_utils.h) recovers the VCF. BGZF-compressed if the filename ends
+    /// in .gz, as for VCF.
+    SPARSE,
+};
+
+enum class GLnexusResidualsFormat {
+    /// YAML documents (default option)
+    YAML,
+
+    /// BGZF-compressed capnp messages; see residuals.h
+    BINARY,
 };
 
 enum class RetainedFieldFrom {
@@ -729,13 +888,33 @@ struct genotyper_config {
     std::string ref_dp_format = "MIN_DP";
 
     // Should the genotyper write a record describing each call loss?
-    // If true, the output is recorded in YAML format in the
-    // a file named [BCF/VCF output file].residuals.yml
+    // If true, the output is recorded in a file named
+    // [BCF/VCF output file].residuals.yml, or .residuals.cflat.gz for the
+    // binary residuals_format
     bool output_residuals = false;
 
-    /// Output format (default = bcf), choices = "BCF", "VCF"
+    /// Residuals format (default = YAML), choices = "YAML", "BINARY". The
+    /// binary format is much cheaper to generate, and is written in parallel
+    /// by genotype_sites_sharded & genotype_sites_pipelined; the
+    /// glnexus_residuals tool converts it to YAML.
+    GLnexusResidualsFormat residuals_format = GLnexusResidualsFormat::YAML;
+
+    /// Output format (default = bcf), choices = "BCF", "VCF", "SPARSE"
     GLnexusOutputFormat output_format = GLnexusOutputFormat::BCF;
 
+    /// BGZF compression level for the output, 0-9, or -1 for the htslib
+    /// default. Applies to BCF output, and to VCF (or SPARSE) output written
+    /// to a filename ending in .gz (otherwise it's written uncompressed).
+    int output_compression_level = 1;
+
+    /// Number of dedicated threads compressing output BGZF blocks in parallel
+    /// with genotyping; 0 = automatic, one per four genotyping threads.
+    size_t output_threads = 0;
+
+    /// Write a CSI (BCF) or tabix (VCF.gz, SPARSE .gz) index alongside the
+    /// output file. Requires compressed output to a file (not standard output).
+    bool output_index = false;
+
     // FORMAT fields from the original gvcfs to be lifted over to the output
     std::vector<retained_format_field> liftover_fields;
 
@@ -792,6 +971,20 @@ template<class T> struct htsvecbox {
     }
 };
 
+// Allocate an empty bcf1_t, recycling one released earlier on the same thread
+// if possible. The recycled record keeps its buffers (having been cleared with
+// bcf_clear), so that threads repeatedly deserializing records, such as
+// genotyping workers, do little malloc traffic in the steady state whatever
+// the allocator. The record may be released on any thread.
+std::shared_ptr<bcf1_t> bcf_init_pooled();
+
+// bcf_dup into a pooled record
+std::shared_ptr<bcf1_t> bcf_dup_pooled(bcf1_t* src);
+
+// Bound on the memory each thread's free list of released records retains;
+// callers budgeting memory should allow this for each thread handling records.
+const size_t BCF_POOL_MAX_BYTES = 4 << 20;
+
 // test string against <.*>
 bool is_symbolic_allele(const char*);
 
@@ -799,12 +992,23 @@ bool is_symbolic_allele(const char*);
 /// (or else a "normal" record with at least one specific ALT allele)
 bool is_gvcf_ref_record(const bcf1_t* record);
 
+class bcf_raw_view;
+
 // Predicate function used for filtering BCF records, as they are read from the database.
 // [retval] is set to true, for any record that passes the test.
 //
-// Note: the BCF record may be provided in packed form.  The function
-// can unpack it, and return bad status in case of error (e.g., data
-// corruption).
-typedef Status (*bcf_predicate)(const bcf_hdr_t*, bcf1_t*, bool &retval);
+// Note: the BCF record is provided as a read-only view of its serialized
+// form (see BCFSerialize.h), before it is copied into a bcf1_t, so that
+// rejecting a record is cheap. The function should decode only the fields it
+// needs, and return bad status in case of error (e.g., data corruption).
+typedef Status (*bcf_predicate)(const bcf_hdr_t*, const bcf_raw_view&, bool &retval);
+
+// Names of the INFO and FORMAT fields a caller needs in the BCF records it
+// retrieves from BCFData. The implementation may then omit all other INFO
+// and FORMAT fields from the records, saving the cost of copying and
+// unpacking them. (The ID, alleles and FILTER are always retained.)
+struct bcf_field_selection {
+    std::set<std::string> info, format;
+};
 
 } //namespace GLnexus
@@ -5,6 +5,8 @@
 
 namespace GLnexus {
 
+class executor;
+
 // unification_config...
 struct unifier_stats {
     // # ALT alleles represented in idiomatic sites.
@@ -41,6 +43,20 @@ Status unified_sites(const unifier_config& cfg,
                      std::vector<unified_site>& ans,
                      unifier_stats& stats);
 
+/// As above, but unifying the alleles concurrently on the executor: they're
+/// split, at positions which no discovered allele spans, into chunks of at
+/// least chunk_alleles alleles (but not dividing any active region), which
+/// are unified in parallel and their sites concatenated. The result is
+/// identical to the sequential procedure. This may be called from a task on
+/// the same executor.
+Status unified_sites(const unifier_config& cfg,
+                     unsigned N,
+                     /* const */ discovered_alleles& alleles,
+                     std::vector<unified_site>& ans,
+                     unifier_stats& stats,
+                     executor& pool,
+                     size_t chunk_alleles = 65536);
+
 // Find which range overlaps [pos]. The ranges are assumed to be non-overlapping.
 // (exposed for unit testing)
 Status find_target_range(const std::set<range> &ranges, const range &pos, range &ans);
@@ -4,16 +4,27 @@
 #include "yaml-cpp/yaml.h"
 #include "vcf.h"
 #include "hfile.h"
+#include "tbx.h"
 #include <sstream>
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <assert.h>
 #include <math.h>
 #include <thread>
 #include <mutex>
+#include <future>
+#include <atomic>
+#include <limits>
+#include <list>
+#include <deque>
+#include <condition_variable>
+#include <cstring>
+#include <unordered_map>
 #include <sys/time.h>
 #include "fcmm.hpp"
 #include "khash.h"
+#include "ctpl_stl.h"
 #include <regex>
 #include <endian.h>
 #include <capnp/message.h>
@@ -22,6 +33,8 @@
 using namespace std;
 
 #include "BCFKeyValueData_utils.h"
+#include "perf.h"
+#include "executor.h"
 
 namespace GLnexus {
 
@@ -55,37 +68,510 @@ public:
     }
 };
 using BCFHeaderCache = fcmm::Fcmm<string,shared_ptr<const bcf_hdr_t>,hash<string>,KStringHash>;
+using DatasetKeyCache = fcmm::Fcmm<string,string,hash<string>,KStringHash>;
 // this is not a hard limit but the FCMM performance degrades if it's too low
 const size_t BCF_HEADER_CACHE_SIZE = 65536;
 
+// Decoded records from one stored bucket
+using BCFBucketRecords = vector<shared_ptr<bcf1_t>>;
+
+// Size-bounded LRU cache of decoded bucket records, shared by concurrent
+// queries. It's split into shards, each with its own lock and LRU list, to
+// limit contention among worker threads.
+//
+// It may also be divided into partitions, one for each NUMA node, each
+// caching the buckets decoded by worker threads on that node in memory local
+// to it (see executor). The partitions are independent, so a bucket in
+// demand on several nodes is decoded and cached on each.
+class BCFBucketCache {
+    struct entry {
+        string key;
+        shared_ptr<const BCFBucketRecords> records;
+        size_t bytes;
+    };
+    struct shard {
+        std::mutex mutex;
+        list<entry> lru; // most recently used first
+        unordered_map<string,list<entry>::iterator> index;
+        size_t bytes = 0;
+    };
+    const size_t nshards_, npartitions_, shard_capacity_;
+    unique_ptr<shard[]> shards_;
+
+    shard& shard_of(const string& key) {
+        int node = npartitions_ > 1 ? executor::current_node() : -1;
+        size_t partition = node >= 0 ? (size_t) node % npartitions_ : 0;
+        return shards_[partition*nshards_ + hash<string>()(key) % nshards_];
+    }
+
+public:
+    BCFBucketCache(size_t capacity_bytes, size_t npartitions = 1, size_t nshards = 16)
+        : nshards_(nshards), npartitions_(max(npartitions, (size_t) 1)),
+          shard_capacity_(capacity_bytes / (npartitions_*nshards)),
+          shards_(new shard[npartitions_*nshards]) {}
+
+    bool get(const string& key, shared_ptr<const BCFBucketRecords>& ans) {
+        shard& sh = shard_of(key);
+        lock_guard<std::mutex> lock(sh.mutex);
+        auto p = sh.index.find(key);
+        if (p == sh.index.end()) {
+            return false;
+        }
+        sh.lru.splice(sh.lru.begin(), sh.lru, p->second);
+        ans = p->second->records;
+        return true;
+    }
+
+    // Insert the records (replacing any existing entry for the key), then
+    // evict least-recently used entries to get back within the size bound.
+    // Returns the number of entries evicted.
+    size_t put(const string& key, const shared_ptr<const BCFBucketRecords>& records, size_t bytes) {
+        if (bytes > shard_capacity_) {
+            return 0;
+        }
+        shard& sh = shard_of(key);
+        lock_guard<std::mutex> lock(sh.mutex);
+        auto p = sh.index.find(key);
+        if (p != sh.index.end()) {
+            sh.bytes -= p->second->bytes;
+            sh.lru.erase(p->second);
+            sh.index.erase(p);
+        }
+        sh.lru.push_front(entry{key, records, bytes});
+        sh.index[key] = sh.lru.begin();
+        sh.bytes += bytes;
+
+        size_t evictions = 0;
+        while (sh.bytes > shard_capacity_) {
+            assert(sh.lru.size() > 1);
+            const entry& victim = sh.lru.back();
+            sh.bytes -= victim.bytes;
+            sh.index.erase(victim.key);
+            sh.lru.pop_back();
+            evictions++;
+        }
+        return evictions;
+    }
+};
+
+// Compact binary snapshot of the sample and data set metadata: the ID
+// dictionary, each sample's data set and the membership of the sample sets.
+// It's written to the config collection after loading (see
+// BCFKeyValueData::write_metadata_snapshot) and read at open in a single
+// lookup, then queried in place by binary search, without parsing or
+// building any index, so that opening a database of many samples needn't
+// walk the sampleset, sample_dataset and dictionary collections.
+//
+// It records the "*" sample set version as of its writing; a database into
+// which more data sets have since been imported has a later version, and its
+// stale snapshot is ignored. Sample sets created since are looked up in the
+// database as usual.
+//
+// Layout (integers little-endian, strings by offset and length into the
+// string area at the end):
+//   header:     magic, u64 "*" version, u32 next sample ID, u32 next data
+//               set ID, u32 #samples, u32 #datasets, u32 #samplesets,
+//               u32 #members, u64 string area bytes
+//   samples:    {u32 name offset, u32 name length, u32 ID, u32 data set ID},
+//               sorted by name
+//   datasets:   {u32 name offset, u32 name length, u32 ID, u32 0}, sorted by
+//               name
+//   samplesets: {u32 name offset, u32 name length, u32 first member, u32
+//               #members}, sorted by name
+//   u32 index into samples of each sample ID (NONE if unassigned)
+//   u32 index into datasets of each data set ID (NONE if unassigned)
+//   members:    u32 index into samples of each sample set member, in order
+//   string area
+const char* metadata_snapshot_key = "metadata_snapshot";
+
+class MetadataSnapshot {
+    static constexpr const char* MAGIC = "GLnxMD01";
+    static const size_t HEADER_BYTES = 48, ENTRY_BYTES = 16;
+    static const uint32_t NONE = 0xFFFFFFFF;
+
+    shared_ptr<KeyValue::Data> data_;
+    const char *samples_, *datasets_, *samplesets_, *sample_index_, *dataset_index_,
+               *members_, *strings_;
+    uint32_t nsamples_, ndatasets_, nsamplesets_, nmembers_;
+    uint64_t strings_bytes_;
+
+    MetadataSnapshot() = default;
+
+    static uint32_t u32(const char* p) {
+        uint32_t x;
+        memcpy(&x, p, 4);
+        return le32toh(x);
+    }
+    static uint64_t u64(const char* p) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        return le64toh(x);
+    }
+    static void put32(string& out, uint32_t x) {
+        x = htole32(x);
+        out.append((const char*)&x, 4);
+    }
+    static void put64(string& out, uint64_t x) {
+        x = htole64(x);
+        out.append((const char*)&x, 8);
+    }
+
+    // field i of table entry j
+    static uint32_t field(const char* table, uint32_t j, unsigned i) {
+        return u32(table + size_t(j)*ENTRY_BYTES + 4*i);
+    }
+    string name(const char* table, uint32_t j) const {
+        return string(strings_ + field(table, j, 0), field(table, j, 1));
+    }
+    uint32_t dataset_index(uint32_t id) const {
+        return u32(dataset_index_ + 4*size_t(id));
+    }
+    // binary search a table for the entry with the given name
+    bool find(const char* table, uint32_t n, const string& key, uint32_t& ans) const {
+        uint32_t lo = 0, hi = n;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi-lo)/2;
+            int c = key.compare(0, string::npos, strings_ + field(table, mid, 0), field(table, mid, 1));
+            if (c == 0) {
+                ans = mid;
+                return true;
+            } else if (c < 0) {
+                hi = mid;
+            } else {
+                lo = mid+1;
+            }
+        }
+        return false;
+    }
+
+public:
+    uint64_t version;
+    uint32_t next_sample_id, next_dataset_id;
+
+    // Serialize a snapshot of the given metadata
+    static Status Write(uint64_t version, uint32_t next_sample_id, uint32_t next_dataset_id,
+                        const map<string,pair<uint32_t,string>>& samples, // ID & data set of each
+                        const map<string,uint32_t>& datasets,
+                        const map<string,vector<string>>& samplesets,
+                        string& ans) {
+        string strings;
+        auto add_string = [&strings](const string& s) {
+            size_t off = strings.size();
+            strings += s;
+            return off;
+        };
+        string samples_tbl, datasets_tbl, samplesets_tbl, members;
+        vector<uint32_t> sample_by_id(next_sample_id, NONE), dataset_by_id(next_dataset_id, NONE);
+        map<string,uint32_t> sample_pos;
+        for (const auto& p : datasets) {
+            if (p.second >= next_dataset_id) {
+                return Status::Invalid("metadata snapshot: unexpected data set ID", p.first);
+            }
+            dataset_by_id[p.second] = datasets_tbl.size() / ENTRY_BYTES;
+            put32(datasets_tbl, add_string(p.first));
+            put32(datasets_tbl, p.first.size());
+            put32(datasets_tbl, p.second);
+            put32(datasets_tbl, 0);
+        }
+        for (const auto& p : samples) {
+            auto ds = datasets.find(p.second.second);
+            if (p.second.first >= next_sample_id || ds == datasets.end()) {
+                return Status::Invalid("metadata snapshot: sample lacks ID or data set", p.first);
+            }
+            uint32_t j = samples_tbl.size() / ENTRY_BYTES;
+            sample_by_id[p.second.first] = j;
+            sample_pos[p.first] = j;
+            put32(samples_tbl, add_string(p.first));
+            put32(samples_tbl, p.first.size());
+            put32(samples_tbl, p.second.first);
+            put32(samples_tbl, ds->second);
+        }
+        size_t nmembers = 0;
+        for (const auto& p : samplesets) {
+            put32(samplesets_tbl, add_string(p.first));
+            put32(samplesets_tbl, p.first.size());
+            put32(samplesets_tbl, nmembers);
+            put32(samplesets_tbl, p.second.size());
+            for (const auto& sample : p.second) {
+                auto j = sample_pos.find(sample);
+                if (j == sample_pos.end()) {
+                    return Status::Invalid("metadata snapshot: unknown sample set member", p.first + " " + sample);
+                }
+                put32(members, j->second);
+            }
+            nmembers += p.second.size();
+        }
+        if (strings.size() > numeric_limits<uint32_t>::max() || nmembers > numeric_limits<uint32_t>::max()) {
+            return Status::Invalid("metadata snapshot: too large");
+        }
+
+        ans.clear();
+        ans.append(MAGIC, 8);
+        put64(ans, version);
+        put32(ans, next_sample_id);
+        put32(ans, next_dataset_id);
+        put32(ans, samples.size());
+        put32(ans, datasets.size());
+        put32(ans, samplesets.size());
+        put32(ans, nmembers);
+        put64(ans, strings.size());
+        assert(ans.size() == HEADER_BYTES);
+        ans += samples_tbl;
+        ans += datasets_tbl;
+        ans += samplesets_tbl;
+        for (uint32_t j : sample_by_id) put32(ans, j);
+        for (uint32_t j : dataset_by_id) put32(ans, j);
+        ans += members;
+        ans += strings;
+        return Status::OK();
+    }
+
+    // Check the structure of a stored snapshot and prepare to query it in
+    // place (holding on to the data)
+    static Status Read(const shared_ptr<KeyValue::Data>& data, unique_ptr<MetadataSnapshot>& ans) {
+        const char* invalid = "Corrupt database; bad metadata snapshot";
+        const char* p = data->data;
+        const size_t n = data->size;
+        if (n < HEADER_BYTES || memcmp(p, MAGIC, 8) != 0) {
+            return Status::Invalid(invalid);
+        }
+        unique_ptr<MetadataSnapshot> snap(new MetadataSnapshot);
+        snap->data_ = data;
+        snap->version = u64(p+8);
+        snap->next_sample_id = u32(p+16);
+        snap->next_dataset_id = u32(p+20);
+        snap->nsamples_ = u32(p+24);
+        snap->ndatasets_ = u32(p+28);
+        snap->nsamplesets_ = u32(p+32);
+        snap->nmembers_ = u32(p+36);
+        snap->strings_bytes_ = u64(p+40);
+
+        uint64_t expected = HEADER_BYTES
+            + ENTRY_BYTES * (uint64_t(snap->nsamples_) + snap->ndatasets_ + snap->nsamplesets_)
+            + 4 * (uint64_t(snap->next_sample_id) + snap->next_dataset_id + snap->nmembers_)
+            + snap->strings_bytes_;
+        if (expected != n) {
+            return Status::Invalid(invalid);
+        }
+        snap->samples_ = p + HEADER_BYTES;
+        snap->datasets_ = snap->samples_ + ENTRY_BYTES*size_t(snap->nsamples_);
+        snap->samplesets_ = snap->datasets_ + ENTRY_BYTES*size_t(snap->ndatasets_);
+        snap->sample_index_ = snap->samplesets_ + ENTRY_BYTES*size_t(snap->nsamplesets_);
+        snap->dataset_index_ = snap->sample_index_ + 4*size_t(snap->next_sample_id);
+        snap->members_ = snap->dataset_index_ + 4*size_t(snap->next_dataset_id);
+        snap->strings_ = snap->members_ + 4*size_t(snap->nmembers_);
+
+        // bounds-check all the offsets and indices, so that the lookups
+        // needn't
+        auto check_names = [&](const char* table, uint32_t count) {
+            for (uint32_t j = 0; j < count; j++) {
+                if (uint64_t(field(table, j, 0)) + field(table, j, 1) > snap->strings_bytes_) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        auto check_index = [](const char* index, uint32_t count, uint32_t bound) {
+            for (uint32_t j = 0; j < count; j++) {
+                uint32_t x = u32(index + 4*size_t(j));
+                if (x != NONE && x >= bound) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        if (!check_names(snap->samples_, snap->nsamples_)
+            || !check_names(snap->datasets_, snap->ndatasets_)
+            || !check_names(snap->samplesets_, snap->nsamplesets_)
+            || !check_index(snap->sample_index_, snap->next_sample_id, snap->nsamples_)
+            || !check_index(snap->dataset_index_, snap->next_dataset_id, snap->ndatasets_)
+            || !check_index(snap->members_, snap->nmembers_, snap->nsamples_)) {
+            return Status::Invalid(invalid);
+        }
+        for (uint32_t j = 0; j < snap->nsamples_; j++) {
+            uint32_t id = field(snap->samples_, j, 2), ds = field(snap->samples_, j, 3);
+            if (id >= snap->next_sample_id || ds >= snap->next_dataset_id
+                || snap->dataset_index(ds) == NONE) {
+                return Status::Invalid(invalid);
+            }
+        }
+        for (uint32_t j = 0; j < snap->ndatasets_; j++) {
+            if (field(snap->datasets_, j, 2) >= snap->next_dataset_id) {
+                return Status::Invalid(invalid);
+            }
+        }
+        for (uint32_t j = 0; j < snap->nsamplesets_; j++) {
+            if (uint64_t(field(snap->samplesets_, j, 2)) + field(snap->samplesets_, j, 3) > snap->nmembers_) {
+                return Status::Invalid(invalid);
+            }
+        }
+
+        ans = move(snap);
+        return Status::OK();
+    }
+
+    bool sample(const string& sample, uint32_t& id, uint32_t& dataset_id) const {
+        uint32_t j;
+        if (!find(samples_, nsamples_, sample, j)) {
+            return false;
+        }
+        id = field(samples_, j, 2);
+        dataset_id = field(samples_, j, 3);
+        return true;
+    }
+
+    bool sample_name(uint32_t id, string& ans) const {
+        uint32_t j = id < next_sample_id ? u32(sample_index_ + 4*size_t(id)) : NONE;
+        if (j == NONE) {
+            return false;
+        }
+        ans = name(samples_, j);
+        return true;
+    }
+
+    bool dataset(const string& dataset, uint32_t& id) const {
+        uint32_t j;
+        if (!find(datasets_, ndatasets_, dataset, j)) {
+            return false;
+        }
+        id = field(datasets_, j, 2);
+        return true;
+    }
+
+    bool dataset_name(uint32_t id, string& ans) const {
+        uint32_t j = id < next_dataset_id ? dataset_index(id) : NONE;
+        if (j == NONE) {
+            return false;
+        }
+        ans = name(datasets_, j);
+        return true;
+    }
+
+    // the number of samples in the sample set, if it's in the snapshot
+    bool sampleset_size(const string& sampleset, size_t& ans) const {
+        uint32_t j;
+        if (!find(samplesets_, nsamplesets_, sampleset, j)) {
+            return false;
+        }
+        ans = field(samplesets_, j, 3);
+        return true;
+    }
+
+    bool sampleset_samples(const string& sampleset, shared_ptr<const set<string>>& ans) const {
+        uint32_t j;
+        if (!find(samplesets_, nsamplesets_, sampleset, j)) {
+            return false;
+        }
+        auto samples = make_shared<set<string>>();
+        const uint32_t first = field(samplesets_, j, 2), count = field(samplesets_, j, 3);
+        for (uint32_t k = first; k < first+count; k++) {
+            // the members are in order
+            samples->insert(samples->end(), name(samples_, u32(members_ + 4*size_t(k))));
+        }
+        ans = samples;
+        return true;
+    }
+};
+
+// The header IDs of the INFO/FORMAT fields of a field selection, in order
+struct BCFFieldIDs {
+    vector<int> info, format;
+};
+
+// A stored template header (see put_dataset_header), parsed once and shared by
+// the headers of all the data sets referring to it, along with the field IDs
+// of each field selection queried on them
+struct BCFHeaderTemplate {
+    shared_ptr<const bcf_hdr_t> hdr;
+    std::mutex mutex;
+    map<string,shared_ptr<const BCFFieldIDs>> field_ids; // guarded by mutex
+};
+
 // pImpl idiom
 struct BCFKeyValueData_body {
     KeyValue::DB* db;
     unique_ptr<BCFHeaderCache> header_cache;
+    // the template headers read so far, by key and by the address of the
+    // INFO/FORMAT/FILTER dictionary which their data sets' headers share
+    std::mutex header_templates_mutex;
+    map<string,shared_ptr<BCFHeaderTemplate>> header_templates;
+    map<const void*,shared_ptr<BCFHeaderTemplate>> header_template_dicts;
+    unique_ptr<BCFBucketCache> bucket_cache; // optional
+    memory_budget* budget = nullptr;
+    size_t budget_reserved = 0; // bucket cache size reserved from budget
     std::unique_ptr<BCFBucketRange> rangeHelper;
+    bool variants_index = false; // database has the bcf_variants collection
+    bool dictionary = false; // database has the ID dictionary, and keys buckets by data set ID
+    unique_ptr<DatasetKeyCache> dataset_key_cache; // data set name -> bucket key suffix
     std::mutex mutex;
+    uint32_t next_sample_id = 0, next_dataset_id = 0; // guarded by mutex
+    map<string,uint32_t> reserved_dataset_ids; // by reserve_dataset_ids; guarded by mutex
     ActiveMetadata amd;
+    // the metadata snapshot, if it's up-to-date (accessed with atomic_load
+    // and atomic_store, as imports discard it)
+    shared_ptr<const MetadataSnapshot> snapshot;
     std::mutex statsMutex;
     StatsRangeQuery statsRq; // statistics for range queries
     atomic<size_t> sample_count; // number of samples in the database. could be
                                  // obtained from the size of the current
                                  // all-samples sampleset, but maintained here
                                  // for convenience.
+
+    ~BCFKeyValueData_body() {
+        bucket_cache.reset();
+        if (budget) {
+            budget->unreserve(budget_reserved);
+        }
+    }
 };
 
 auto collections = { "config", "sampleset", "sample_dataset", "header", "bcf" };
 
+// The bcf_variants collection is an index holding a copy of just the variant
+// records (excluding gVCF reference bands) of each bucket of the bcf
+// collection, under the same key; buckets with no variant records are
+// omitted. Databases initialized before its introduction lack it, and are
+// queried without it.
+const char* variants_collection = "bcf_variants";
+
+// The dictionary collection assigns each sample and data set an ID (see
+// Metadata::dataset_id), the bcf collections then keying buckets by data set
+// ID rather than by name. Its key schema:
+//   #samples, #datasets -> the next ID to assign (decimal)
+//   s<sample> -> ID,  S<ID> -> sample
+//   d<dataset> -> ID, D<ID> -> dataset
+// with IDs encoded by encode_id. Databases initialized before its
+// introduction lack it; their buckets are keyed by data set name, and they
+// have no IDs.
+const char* dictionary_collection = "dictionary";
+
+// Prefix of the db parameter keys giving the bucket length of an individual
+// contig (suffixed with its rid), for those contigs whose bucket length
+// differs from interval_len
+const char* contig_interval_len_param = "interval_len_rid";
+
 BCFKeyValueData::BCFKeyValueData() = default;
 BCFKeyValueData::~BCFKeyValueData() = default;
 
 Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
                                      const vector<pair<string,size_t>>& contigs,
-                                     int interval_len) {
+                                     int interval_len,
+                                     const vector<int>& contig_interval_lens) {
     Status s;
 
     // some basic sanity checks
     if (contigs.size() > MAX_NUM_CONTIGS_PER_GVCF)
         return Status::Invalid("Too many contigs ", std::to_string(contigs.size()));
+    if (interval_len <= 0)
+        return Status::Invalid("invalid bucket length ", std::to_string(interval_len));
+    if (!contig_interval_lens.empty()) {
+        if (contig_interval_lens.size() != contigs.size())
+            return Status::Invalid("number of contig bucket lengths doesn't match number of contigs");
+        for (int len : contig_interval_lens) {
+            if (len <= 0)
+                return Status::Invalid("invalid bucket length ", std::to_string(len));
+        }
+    }
     for (const auto& p : contigs) {
         size_t contig_len = p.second;
         if (contig_len > MAX_CONTIG_LEN)
@@ -96,6 +582,8 @@ Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
     for (const auto& coll : collections) {
         S(db->create_collection(coll));
     }
+    S(db->create_collection(variants_collection));
+    S(db->create_collection(dictionary_collection));
 
     KeyValue::CollectionHandle config;
     S(db->collection("config", config));
@@ -126,6 +614,15 @@ Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
         yaml << YAML::Key << "interval_len";
         yaml << YAML::Value << interval_len;
         yaml << YAML::EndMap;
+        // per-contig bucket lengths, where they differ
+        for (size_t rid = 0; rid < contig_interval_lens.size(); rid++) {
+            if (contig_interval_lens[rid] != interval_len) {
+                yaml << YAML::BeginMap;
+                yaml << YAML::Key << (contig_interval_len_param + to_string(rid));
+                yaml << YAML::Value << contig_interval_lens[rid];
+                yaml << YAML::EndMap;
+            }
+        }
         yaml << YAML::EndSeq;
         S(db->put(config, "param", yaml.c_str()));
     }
@@ -142,7 +639,9 @@ Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
     return BCFKeyValueData::Open(db, nop);
 }
 
-Status BCFKeyValueData::Open(KeyValue::DB* db, unique_ptr<BCFKeyValueData>& ans) {
+Status BCFKeyValueData::Open(KeyValue::DB* db, unique_ptr<BCFKeyValueData>& ans,
+                             size_t bucket_cache_bytes, size_t bucket_cache_partitions,
+                             memory_budget* budget) {
     assert(db != nullptr);
 
     // check database has been initialized
@@ -156,6 +655,8 @@ Status BCFKeyValueData::Open(KeyValue::DB* db, unique_ptr<BCFKeyValueData>& ans)
     ans.reset(new BCFKeyValueData());
     ans->body_.reset(new BCFKeyValueData_body);
     ans->body_->db = db;
+    ans->body_->variants_index = db->collection(variants_collection, coll).ok();
+    ans->body_->dictionary = db->collection(dictionary_collection, coll).ok();
 
     // Read the parameters from the DB
     const char *unexpected = "BCFKeyValueData::Open unexpected YAML";
@@ -186,21 +687,94 @@ Status BCFKeyValueData::Open(KeyValue::DB* db, unique_ptr<BCFKeyValueData>& ans)
 
     // Sift through parameters, sanity check
     int interval_len = -1;
+    map<size_t,size_t> contig_interval_len_params;
     for (auto item : param) {
         if (item.first == "interval_len") {
             interval_len = item.second;
+        } else if (item.first.compare(0, strlen(contig_interval_len_param), contig_interval_len_param) == 0) {
+            size_t rid = strtoul(item.first.c_str() + strlen(contig_interval_len_param), nullptr, 10);
+            if (item.second == 0 || item.second > std::numeric_limits<int>::max()) {
+                return Status::Invalid("Corrupt database; bad interval length ", item.first);
+            }
+            contig_interval_len_params[rid] = item.second;
         }
     }
     if (interval_len <= 0) {
         return Status::Invalid("Corrupt database; bad interval length ", std::to_string(interval_len));
     }
+    vector<int> contig_interval_lens;
+    if (!contig_interval_len_params.empty()) {
+        size_t ncontigs = contig_interval_len_params.rbegin()->first + 1;
+        if (ncontigs > MAX_NUM_CONTIGS_PER_GVCF) {
+            return Status::Invalid("Corrupt database; bad contig interval length parameter");
+        }
+        contig_interval_lens.assign(ncontigs, interval_len);
+        for (const auto& p : contig_interval_len_params) {
+            contig_interval_lens[p.first] = p.second;
+        }
+    }
 
-    ans->body_->rangeHelper = make_unique<BCFBucketRange>(interval_len);
+    ans->body_->rangeHelper = make_unique<BCFBucketRange>(interval_len, contig_interval_lens);
     ans->body_->header_cache = make_unique<BCFHeaderCache>(BCF_HEADER_CACHE_SIZE);
+    ans->body_->dataset_key_cache = make_unique<DatasetKeyCache>(BCF_HEADER_CACHE_SIZE);
+    if (budget && bucket_cache_bytes) {
+        bucket_cache_bytes = budget->reserve(bucket_cache_bytes);
+        ans->body_->budget = budget;
+        ans->body_->budget_reserved = bucket_cache_bytes;
+    }
+    if (bucket_cache_bytes) {
+        ans->body_->bucket_cache = make_unique<BCFBucketCache>(bucket_cache_bytes,
+                                                               bucket_cache_partitions);
+    }
+
+    // read the next IDs to assign
+    if (ans->body_->dictionary) {
+        S(db->collection(dictionary_collection, coll));
+        for (auto p : {make_pair("#samples", &ans->body_->next_sample_id),
+                       make_pair("#datasets", &ans->body_->next_dataset_id)}) {
+            string next;
+            s = db->get(coll, p.first, next);
+            if (s.ok()) {
+                uint64_t next_id = strtoull(next.c_str(), nullptr, 10);
+                if (next_id > std::numeric_limits<uint32_t>::max()) {
+                    return Status::Invalid("Corrupt database; bad dictionary counter", p.first);
+                }
+                *p.second = next_id;
+            } else if (s != StatusCode::NOT_FOUND) {
+                return s;
+            }
+        }
+    }
+
+    // load the metadata snapshot, if it's up-to-date
+    if (ans->body_->dictionary) {
+        shared_ptr<KeyValue::Data> data;
+        S(ans->body_->db->collection("config", coll));
+        s = db->get0(coll, metadata_snapshot_key, data);
+        if (s.ok()) {
+            unique_ptr<MetadataSnapshot> snapshot;
+            S(MetadataSnapshot::Read(data, snapshot));
+            string version;
+            S(db->collection("sampleset", coll));
+            S(db->get(coll, "*", version));
+            if (snapshot->version == strtoull(version.c_str(), nullptr, 10)
+                && snapshot->next_sample_id == ans->body_->next_sample_id
+                && snapshot->next_dataset_id == ans->body_->next_dataset_id) {
+                ans->body_->snapshot = move(snapshot);
+            }
+        } else if (s != StatusCode::NOT_FOUND) {
+            return s;
+        }
+    }
 
     // initialize sample_count
     string sampleset;
     S(ans->all_samples_sampleset(sampleset));
+    size_t snapshot_count;
+    if (ans->body_->snapshot && ans->body_->snapshot->sampleset_size(sampleset, snapshot_count)) {
+        ans->body_->sample_count = snapshot_count;
+        return Status::OK();
+    }
     shared_ptr<const set<string>> all_samples;
     S(ans->sampleset_samples(sampleset, all_samples));
     ans->body_->sample_count = all_samples->size();
@@ -265,6 +839,11 @@ Status BCFKeyValueData::sampleset_samples(const string& sampleset,
     // ...
     // the corresponding values are empty.
 
+    auto snapshot = atomic_load(&body_->snapshot);
+    if (snapshot && snapshot->sampleset_samples(sampleset, ans)) {
+        return Status::OK();
+    }
+
     Status s;
     KeyValue::CollectionHandle coll;
     S(body_->db->collection("sampleset",coll));
@@ -293,6 +872,12 @@ Status BCFKeyValueData::sampleset_samples(const string& sampleset,
 }
 
 Status BCFKeyValueData::sample_dataset(const string& sample, string& ans) const {
+    auto snapshot = atomic_load(&body_->snapshot);
+    uint32_t id, dataset_id;
+    if (snapshot && snapshot->sample(sample, id, dataset_id)
+        && snapshot->dataset_name(dataset_id, ans)) {
+        return Status::OK();
+    }
     Status s;
     KeyValue::CollectionHandle coll;
     S(body_->db->collection("sample_dataset",coll));
@@ -302,6 +887,14 @@ Status BCFKeyValueData::sample_dataset(const string& sample, string& ans) const
 Status BCFKeyValueData::all_samples_sampleset(string& ans) {
     Status s;
 
+    // with an up-to-date snapshot, the desired sample set is the one it has
+    auto snapshot = atomic_load(&body_->snapshot);
+    size_t ignore_size;
+    if (snapshot && snapshot->sampleset_size("*@" + to_string(snapshot->version), ignore_size)) {
+        ans = "*@" + to_string(snapshot->version);
+        return Status::OK();
+    }
+
     // Get the current * sample set version number.
     KeyValue::CollectionHandle coll;
     S(body_->db->collection("sampleset",coll));
@@ -400,6 +993,81 @@ Status BCFKeyValueData::sample_count(size_t& ans) const {
     return Status::OK();
 }
 
+// Look up the ID (or name) under the given prefix in the dictionary
+static Status dictionary_get(const BCFKeyValueData_body& body, const string& key, string& ans) {
+    if (!body.dictionary) {
+        return Status::NotImplemented("database predates the ID dictionary");
+    }
+    Status s;
+    KeyValue::CollectionHandle coll;
+    S(body.db->collection(dictionary_collection, coll));
+    return body.db->get(coll, key, ans);
+}
+
+Status BCFKeyValueData::sample_id(const string& sample, uint32_t& ans) const {
+    auto snapshot = atomic_load(&body_->snapshot);
+    uint32_t ignore;
+    if (snapshot && snapshot->sample(sample, ans, ignore)) {
+        return Status::OK();
+    }
+    Status s;
+    string id;
+    S(dictionary_get(*body_, "s" + sample, id));
+    return decode_id(id, ans);
+}
+
+Status BCFKeyValueData::dataset_id(const string& dataset, uint32_t& ans) const {
+    auto snapshot = atomic_load(&body_->snapshot);
+    if (snapshot && snapshot->dataset(dataset, ans)) {
+        return Status::OK();
+    }
+    Status s;
+    string id;
+    S(dictionary_get(*body_, "d" + dataset, id));
+    return decode_id(id, ans);
+}
+
+Status BCFKeyValueData::sample_name(uint32_t id, string& ans) const {
+    auto snapshot = atomic_load(&body_->snapshot);
+    if (snapshot && snapshot->sample_name(id, ans)) {
+        return Status::OK();
+    }
+    return dictionary_get(*body_, "S" + encode_id(id), ans);
+}
+
+Status BCFKeyValueData::dataset_name(uint32_t id, string& ans) const {
+    auto snapshot = atomic_load(&body_->snapshot);
+    if (snapshot && snapshot->dataset_name(id, ans)) {
+        return Status::OK();
+    }
+    return dictionary_get(*body_, "D" + encode_id(id), ans);
+}
+
+// The suffix of the data set's bucket keys: its encoded ID if the database
+// has the dictionary, otherwise its name
+static Status lookup_dataset_key(BCFKeyValueData_body& body, const string& dataset, string& ans) {
+    if (!body.dictionary) {
+        ans = dataset;
+        return Status::OK();
+    }
+    auto cached = body.dataset_key_cache->end();
+    if ((cached = body.dataset_key_cache->find(dataset)) != body.dataset_key_cache->end()) {
+        ans = cached->second;
+        return Status::OK();
+    }
+    auto snapshot = atomic_load(&body.snapshot);
+    uint32_t id;
+    Status s;
+    if (snapshot && snapshot->dataset(dataset, id)) {
+        ans = encode_id(id);
+    } else {
+        S(dictionary_get(body, "d" + dataset, ans));
+        S(decode_id(ans, id));
+    }
+    body.dataset_key_cache->insert(make_pair(dataset, ans));
+    return Status::OK();
+}
+
 shared_ptr<StatsRangeQuery> BCFKeyValueData::getRangeStats() {
     // return a copy of the current statistics
     std::lock_guard<std::mutex> lock(body_->statsMutex);
@@ -407,6 +1075,88 @@ shared_ptr<StatsRangeQuery> BCFKeyValueData::getRangeStats() {
     return statsCopy;
 }
 
+// Data set headers are stored in the header collection as references to
+// template headers -- the header without its samples, which single-sample
+// gVCFs from the same caller and reference have in common -- stored once each
+// under a key of this prefix and their content hash. (Data set names can't
+// begin with it.) Older databases store each data set's full header instead,
+// beginning with the BCF magic.
+const char header_template_prefix = '#';
+
+// Store the data set's header as the key of its template followed by its
+// sample names, storing the template too unless it's there already. templates
+// remembers those seen by previous calls with the same write batch.
+static Status put_dataset_header(KeyValue::DB* db, KeyValue::WriteBatch& wb,
+                                 KeyValue::CollectionHandle coll,
+                                 const string& dataset, const bcf_hdr_t* hdr,
+                                 map<string,string>& templates) {
+    Status s;
+    const string tmpl = bcf_write_header_template(hdr);
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : tmpl) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) hash);
+    const string base = string(1, header_template_prefix) + hex;
+
+    // on the off chance of a hash collision, add a suffix
+    string key = base;
+    for (int i = 1; ; key = base + "." + to_string(i++)) {
+        auto p = templates.find(key);
+        if (p == templates.end()) {
+            string existing;
+            s = db->get(coll, key, existing);
+            if (s == StatusCode::NOT_FOUND) {
+                S(wb.put(coll, key, tmpl));
+                existing = tmpl;
+            } else if (s.bad()) {
+                return s;
+            }
+            p = templates.insert(make_pair(key, move(existing))).first;
+        }
+        if (p->second == tmpl) {
+            break;
+        }
+    }
+
+    string ref = key;
+    for (int i = 0; i < bcf_hdr_nsamples(hdr); i++) {
+        ref += '\0';
+        ref += hdr->samples[i];
+    }
+    return wb.put(coll, dataset, ref);
+}
+
+// Get the template header stored under the key, parsing it if it hasn't been
+// already
+static Status header_template(BCFKeyValueData_body& body, KeyValue::CollectionHandle coll,
+                              const string& key, shared_ptr<BCFHeaderTemplate>& ans) {
+    Status s;
+    std::lock_guard<std::mutex> lock(body.header_templates_mutex);
+    auto p = body.header_templates.find(key);
+    if (p != body.header_templates.end()) {
+        ans = p->second;
+        return Status::OK();
+    }
+
+    string data;
+    S(body.db->get(coll, key, data));
+    shared_ptr<bcf_hdr_t> hdr;
+    int consumed;
+    S(bcf_raw_read_header((const uint8_t*) data.c_str(), data.size(), consumed, hdr));
+    if (bcf_hdr_nsamples(hdr.get()) != 0) {
+        return Status::Invalid("BCFKeyValueData: template header has samples", key);
+    }
+    ans = make_shared<BCFHeaderTemplate>();
+    ans->hdr = hdr;
+    body.header_templates[key] = ans;
+    body.header_template_dicts[hdr->dict[BCF_DT_ID]] = ans;
+    return Status::OK();
+}
+
 Status BCFKeyValueData::dataset_header(const string& dataset,
                                        shared_ptr<const bcf_hdr_t>* hdr) {
     auto cached = body_->header_cache->end();
@@ -424,17 +1174,89 @@ Status BCFKeyValueData::dataset_header(const string& dataset,
     string data;
     S(body_->db->get(coll, dataset, data));
 
-    // Parse the header
-    shared_ptr<bcf_hdr_t> ans;
-    int consumed;
-    S(bcf_raw_read_header((const uint8_t*) data.c_str(), data.size(), consumed, ans));
-    *hdr = ans;
+    if (!data.empty() && data[0] == header_template_prefix) {
+        // Share the template's dictionaries, adding the data set's samples
+        vector<string> fields;
+        size_t pos = 0, nullpos;
+        while ((nullpos = data.find('\0', pos)) != string::npos) {
+            fields.push_back(data.substr(pos, nullpos-pos));
+            pos = nullpos+1;
+        }
+        fields.push_back(data.substr(pos));
+        shared_ptr<BCFHeaderTemplate> tmpl;
+        S(header_template(*body_, coll, fields[0], tmpl));
+        fields.erase(fields.begin());
+        S(bcf_hdr_share(tmpl->hdr, fields, *hdr));
+    } else {
+        // Parse the full header
+        shared_ptr<bcf_hdr_t> ans;
+        int consumed;
+        S(bcf_raw_read_header((const uint8_t*) data.c_str(), data.size(), consumed, ans));
+        *hdr = ans;
+    }
 
     // Memoize it
     body_->header_cache->insert(make_pair(dataset, *hdr));;
     return Status::OK();
 }
 
+// A string identifying the field selection
+static string FieldSelectionKey(const bcf_field_selection& fields) {
+    ostringstream ss;
+    for (const auto& key : fields.info) {
+        ss << key << ',';
+    }
+    ss << '\0';
+    for (const auto& key : fields.format) {
+        ss << key << ',';
+    }
+    return ss.str();
+}
+
+// Resolve the selected fields to their header IDs. These are the same for all
+// the headers sharing a template, so they're resolved just once for those.
+static shared_ptr<const BCFFieldIDs> ResolveFieldIDs(BCFKeyValueData_body& body,
+                                                     const bcf_hdr_t* hdr,
+                                                     const bcf_field_selection& fields) {
+    auto resolve = [&fields](const bcf_hdr_t* hdr) {
+        auto ans = make_shared<BCFFieldIDs>();
+        for (const auto& key : fields.info) {
+            int id = bcf_hdr_id2int(hdr, BCF_DT_ID, key.c_str());
+            if (id >= 0 && bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, id)) {
+                ans->info.push_back(id);
+            }
+        }
+        for (const auto& key : fields.format) {
+            int id = bcf_hdr_id2int(hdr, BCF_DT_ID, key.c_str());
+            if (id >= 0 && bcf_hdr_idinfo_exists(hdr, BCF_HL_FMT, id)) {
+                ans->format.push_back(id);
+            }
+        }
+        sort(ans->info.begin(), ans->info.end());
+        sort(ans->format.begin(), ans->format.end());
+        return ans;
+    };
+
+    shared_ptr<BCFHeaderTemplate> tmpl;
+    {
+        std::lock_guard<std::mutex> lock(body.header_templates_mutex);
+        auto p = body.header_template_dicts.find(hdr->dict[BCF_DT_ID]);
+        if (p != body.header_template_dicts.end()) {
+            tmpl = p->second;
+        }
+    }
+    if (!tmpl) {
+        return resolve(hdr);
+    }
+    const string key = FieldSelectionKey(fields);
+    std::lock_guard<std::mutex> lock(tmpl->mutex);
+    auto& ans = tmpl->field_ids[key];
+    if (!ans) {
+        ans = resolve(tmpl->hdr.get());
+    }
+    return ans;
+}
+
 // Extract bucket records overlapping the query range and satsifying the
 // predicate, if any
 //
@@ -445,16 +1267,28 @@ Status BCFKeyValueData::dataset_header(const string& dataset,
 //                   de-duplicated while scanning. In practice you set
 //                   include_danglers to true on the first bucket you're
 //                   scanning, and false on the rest.
-static Status ScanBCFBucket(const range& bucket, const string& dataset, 
+static Status ScanBCFBucket(BCFKeyValueData_body& body,
+                            const range& bucket, const string& dataset,
                             const KeyValue::Data& data,
                             const bcf_hdr_t* hdr,
                             const range& query,
                             bcf_predicate predicate,
+                            const bcf_field_selection* fields,
                             const bool include_danglers,
                             StatsRangeQuery &srq,
                             vector<shared_ptr<bcf1_t> >& ans) {
     Status s;
     // DO NOT ans.clear(), as caller may intend to accumulate results over consecutive buckets
+    perf::scoped_timer timer(perf::timer::decode);
+    perf::count(perf::counter::buckets_read);
+    perf::count(perf::counter::bucket_bytes_read, data.size);
+    size_t decoded = 0;
+
+    // resolve the selected fields to their header IDs
+    shared_ptr<const BCFFieldIDs> field_ids;
+    if (fields) {
+        field_ids = ResolveFieldIDs(body, hdr, *fields);
+    }
 
     // Ideally capnp wants the data buffer to be word-aligned. This probably
     // doesn't matter on modern x86-64 though. 
@@ -473,9 +1307,28 @@ static Status ScanBCFBucket(const range& bucket, const string& dataset,
         ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)data.data, data.size / sizeof(::capnp::word)));
         capnp::BCFBucket::Reader bucket_reader = message.getRoot<capnp::BCFBucket>();
 
+        // Buckets of format version 1 or later have columns of the record
+        // ranges and types; otherwise we get them from the records.
+        auto records = bucket_reader.getRecords();
+        auto columns = bucket_reader.getColumns();
+        auto begs = columns.getBegs();
+        auto ends = columns.getEnds();
+        auto variant = columns.getVariant();
+        bool columnar = bucket_reader.getVersion() >= 1;
+        if (columnar && (begs.size() != records.size() || ends.size() != records.size() ||
+                         variant.size() != records.size())) {
+            return Status::Invalid("BCFKeyValueData: corrupt bucket columns", dataset + "@" + bucket.str());
+        }
+        // Since version 2, the integer FORMAT fields are stored as columns, to
+        // be spliced back into the records (just those selected, if fields)
+        BCFBucketFormatColumns format_columns;
+        if (format_columns.Init(bucket_reader).bad()) {
+            return Status::Invalid("BCFKeyValueData: corrupt bucket FORMAT columns", dataset + "@" + bucket.str());
+        }
+        vector<uint8_t> spliced;
+
         // Scan: begin at a position informed by the 'skip index'
         //       end on encounting a record whose beg position is >= query.end
-        auto records = bucket_reader.getRecords();
         for (int scan_index = SearchBCFBucketSkipIndex(bucket_reader, query);
              scan_index < records.size(); ++scan_index) {
             srq.nBCFRecordsRead++;
@@ -483,27 +1336,80 @@ static Status ScanBCFBucket(const range& bucket, const string& dataset,
             auto buf = records[scan_index];
             range cur_range(-1,-1,-1);
             assert(buf.begin() != nullptr); assert(buf.size() > 0);
-            S(bcf_raw_range(buf.begin(), 0, buf.size(), cur_range));
+            if (columnar) {
+                cur_range = range(bucket.rid, begs[scan_index], ends[scan_index]);
+                #ifndef NDEBUG
+                range rec_range(-1,-1,-1);
+                S(bcf_raw_range(buf.begin(), 0, buf.size(), rec_range));
+                assert(rec_range == cur_range);
+                #endif
+            } else {
+                S(bcf_raw_range(buf.begin(), 0, buf.size(), cur_range));
+            }
             assert(cur_range.rid == query.rid);
             assert(cur_range.overlaps(bucket));
 
             if (cur_range.overlaps(query) &&
                 (include_danglers || cur_range.beg >= bucket.beg)) {
-                shared_ptr<bcf1_t> vt(bcf_init(), &bcf_destroy);
-                int bytes_read = -1;
-                S(bcf_raw_read_from_mem(buf.begin(), 0, buf.size(), vt.get(), bytes_read));
-                assert(range(vt) == cur_range);
-
+                // the record's bytes, with any FORMAT columns spliced in
+                const uint8_t* rec_buf = buf.begin();
+                size_t rec_len = buf.size();
+                bool spliced_all = false;
+                auto splice = [&](const vector<int>* format_ids) {
+                    if (format_columns.empty()) {
+                        return Status::OK();
+                    }
+                    Status s;
+                    S(format_columns.read(scan_index, buf.begin(), buf.size(), format_ids, spliced));
+                    rec_buf = spliced.data();
+                    rec_len = spliced.size();
+                    return Status::OK();
+                };
+
+                // apply the predicate to the record in place, so that
+                // rejected records are never copied or unpacked. The variant
+                // predicate is answered by the column, without reading the
+                // record at all.
                 bool rec_ok = true;
-                if (predicate != nullptr) {
-                    S(predicate(hdr, vt.get(), rec_ok));
+                if (predicate == bcf_variant_predicate && columnar) {
+                    rec_ok = variant[scan_index];
+                } else if (predicate != nullptr) {
+                    S(splice(nullptr));
+                    spliced_all = true;
+                    bcf_raw_view view;
+                    int reclen = -1;
+                    S(bcf_raw_view::of_mem(rec_buf, 0, rec_len, view, reclen));
+                    if (columnar) {
+                        view.hint_gvcf_ref_record(!variant[scan_index]);
+                    }
+                    S(predicate(hdr, view, rec_ok));
                 }
                 if (rec_ok) {
+                    shared_ptr<bcf1_t> vt = bcf_init_pooled();
+                    if (fields != nullptr) {
+                        // copy only the selected INFO/FORMAT fields, decoding
+                        // only the selected FORMAT columns
+                        if (!spliced_all) {
+                            S(splice(&field_ids->format));
+                        }
+                        bcf_raw_view view;
+                        int reclen = -1;
+                        S(bcf_raw_view::of_mem(rec_buf, 0, rec_len, view, reclen));
+                        S(view.read(vt.get(), &field_ids->info, &field_ids->format));
+                    } else {
+                        if (!spliced_all) {
+                            S(splice(nullptr));
+                        }
+                        int bytes_read = -1;
+                        S(bcf_raw_read_from_mem(rec_buf, 0, rec_len, vt.get(), bytes_read));
+                    }
+                    assert(range(vt) == cur_range);
                     if (bcf_unpack(vt.get(), BCF_UN_ALL) != 0 || vt->errcode != 0) {
                         return Status::IOError("BCFKeyValueData bcf_unpack",
                                                dataset + "@" + query.str());
                     }
                     ans.push_back(vt);
+                    decoded++;
                 }
             } else if (cur_range.beg >= query.end) {
                 break;
@@ -512,9 +1418,79 @@ static Status ScanBCFBucket(const range& bucket, const string& dataset,
     } catch (exception &e) {
         return Status::IOError("exception deserializing BCF bucket", e.what());
     }
+    perf::count(perf::counter::records_decoded, decoded);
+    return Status::OK();
+}
+
+// The decoded bucket cache holds the records passing a given predicate and
+// field selection, so the cache key, in addition to the bucket key, must
+// identify those.
+static string BucketCacheKeySuffix(bcf_predicate predicate, const bcf_field_selection* fields) {
+    ostringstream ss;
+    ss << '\0' << reinterpret_cast<uintptr_t>(predicate);
+    if (fields) {
+        ss << '\0' << FieldSelectionKey(*fields);
+    }
+    return ss.str();
+}
+
+// The collection from which to read buckets for a query with the given
+// predicate: the variant record index, if the query is for variant records
+// only and the database has the index.
+static const char* BCFCollectionFor(const BCFKeyValueData_body& body, bcf_predicate predicate) {
+    if (body.variants_index && predicate == bcf_variant_predicate) {
+        return variants_collection;
+    }
+    return "bcf";
+}
+
+// Approximate memory usage of an unpacked bcf1_t
+static size_t bcf1_bytes(const bcf1_t* x) {
+    return sizeof(bcf1_t) + x->shared.m + x->indiv.m + x->d.m_als
+           + x->n_allele*sizeof(char*) + x->n_info*sizeof(bcf_info_t)
+           + x->n_fmt*sizeof(bcf_fmt_t);
+}
+
+// Decode all the records in the bucket (satisfying the predicate) and add
+// them to the cache. data may be null if there is no such bucket, in which
+// case an empty result is cached.
+static Status DecodeBCFBucketCached(BCFKeyValueData_body& body, const string& cache_key,
+                                    const range& bucket, const string& dataset,
+                                    const KeyValue::Data* data, const bcf_hdr_t* hdr,
+                                    bcf_predicate predicate, const bcf_field_selection* fields,
+                                    StatsRangeQuery& srq,
+                                    shared_ptr<const BCFBucketRecords>& ans) {
+    Status s;
+    assert(body.bucket_cache);
+    auto records = make_shared<BCFBucketRecords>();
+    if (data) {
+        S(ScanBCFBucket(body, bucket, dataset, *data, hdr, bucket, predicate, fields,
+                        true, srq, *records));
+    }
+    size_t bytes = cache_key.size() + sizeof(BCFBucketRecords);
+    for (const auto& rec : *records) {
+        bytes += sizeof(shared_ptr<bcf1_t>) + bcf1_bytes(rec.get());
+    }
+    srq.nBucketCacheEvictions += body.bucket_cache->put(cache_key, records, bytes);
+    ans = records;
     return Status::OK();
 }
 
+// Append the cached bucket records overlapping the query range to ans,
+// as ScanBCFBucket would
+static void SliceBCFBucketRecords(const BCFBucketRecords& records, const range& bucket,
+                                  const range& query, bool include_danglers,
+                                  vector<shared_ptr<bcf1_t>>& ans) {
+    for (const auto& rec : records) {
+        range rng(rec.get());
+        if (rng.overlaps(query) && (include_danglers || rng.beg >= bucket.beg)) {
+            ans.push_back(rec);
+        } else if (rng.beg >= query.end) {
+            break;
+        }
+    }
+}
+
 // Search all the buckets that may hold records within the query range.
 //
 // Return value: list of records that overlap with the query
@@ -525,7 +1501,8 @@ Status BCFKeyValueData::dataset_range(const string& dataset,
                                       const bcf_hdr_t* hdr,
                                       const range& query,
                                       bcf_predicate predicate,
-                                      vector<shared_ptr<bcf1_t>>* records) {
+                                      vector<shared_ptr<bcf1_t>>* records,
+                                      const bcf_field_selection* fields) {
     Status s;
     records->clear();
 
@@ -535,27 +1512,78 @@ Status BCFKeyValueData::dataset_range(const string& dataset,
 
     // Retrieve the pertinent DB entries
     KeyValue::CollectionHandle coll;
-    S(body_->db->collection("bcf",coll));
+    S(body_->db->collection(BCFCollectionFor(*body_, predicate),coll));
+
+    string dskey;
+    S(lookup_dataset_key(*body_, dataset, dskey));
 
     // iterate through the buckets in range
     shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(query);
 
-    bool first = true;
+    string cache_key_suffix;
+    if (body_->bucket_cache) {
+        cache_key_suffix = BucketCacheKeySuffix(predicate, fields);
+    }
+
+    // Look up the buckets in range (except any found in the bucket cache)
+    // with one batch of reads
+    vector<range> buckets;
+    vector<string> keys;
+    vector<shared_ptr<const BCFBucketRecords>> cached;
     StatsRangeQuery accu;
     for (range r = bkExt->begin(); r <= bkExt->end(); r = bkExt->next()) {
         assert(r.overlaps(query));
-        string key = body_->rangeHelper->bucket_key(r, dataset);
-        shared_ptr<KeyValue::Data> data;
-        s = body_->db->get0(coll, key, data);
-        if (s.ok()) {
-            S(ScanBCFBucket(r, dataset, *data, hdr, query, predicate,
+        buckets.push_back(r);
+        cached.push_back(nullptr);
+        string key = body_->rangeHelper->bucket_key(r, dskey);
+        if (body_->bucket_cache) {
+            if (body_->bucket_cache->get(key + cache_key_suffix, cached.back())) {
+                accu.nBucketCacheHits++;
+                perf::count(perf::counter::bucket_cache_hits);
+                continue;
+            }
+            accu.nBucketCacheMisses++;
+            perf::count(perf::counter::bucket_cache_misses);
+        }
+        keys.push_back(move(key));
+    }
+    vector<shared_ptr<KeyValue::Data>> values;
+    vector<Status> statuses;
+    if (!keys.empty()) {
+        perf::scoped_timer timer(perf::timer::fetch);
+        S(body_->db->multi_get0(coll, keys, values, statuses));
+    }
+
+    bool first = true;
+    size_t k = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        const range& r = buckets[i];
+        if (body_->bucket_cache) {
+            if (!cached[i]) {
+                if (statuses[k].bad() && statuses[k] != StatusCode::NOT_FOUND) {
+                    return statuses[k];
+                }
+                S(DecodeBCFBucketCached(*body_, keys[k] + cache_key_suffix, r, dataset,
+                                        statuses[k].ok() ? values[k].get() : nullptr, hdr,
+                                        predicate, fields, accu, cached[i]));
+                k++;
+            }
+            SliceBCFBucketRecords(*cached[i], r, query, first, *records);
+            first = false;
+            continue;
+        }
+        if (statuses[k].ok()) {
+            S(ScanBCFBucket(*body_, r, dataset, *values[k], hdr, query, predicate, fields,
                             first, accu, *records));
-        } else if (s != StatusCode::NOT_FOUND) {
-            return s;
+        } else if (statuses[k] != StatusCode::NOT_FOUND) {
+            return statuses[k];
         }
+        k++;
         first = false;
     }
+    assert(k == keys.size());
     accu.nBCFRecordsInRange += records->size();
+    perf::count(perf::counter::records_in_range, records->size());
 
     // update database statistics
     {
@@ -566,25 +1594,81 @@ Status BCFKeyValueData::dataset_range(const string& dataset,
     return Status::OK();
 }
 
-// BCFKeyValueData::sampleset_range optimized implementation: if the sample
-// set covers >=10% of the samples in the database, produces RangeBCFIterators
-// that use underlying KeyValue::Iterators instead of repeated point lookups
-// (as in the base implementation). One iterator per underlying storage bucket
-// is produced.
-
-class BCFBucketIterator : public RangeBCFIterator {
-    BCFData& data_;
-    BCFKeyValueData_body& body_;
+Status BCFKeyValueData::dataset_has_variants(const string& dataset, const bcf_hdr_t* hdr,
+                                             const range& query, bool& ans) {
+    Status s;
+    ans = false;
+    if (query.rid < 0 || query.beg < 0 || query.end < 0)
+        return Status::Invalid("BCFKeyValueData::dataset_has_variants: invalid query range", query.str());
 
-    bool first_ = true;
-    bcf_predicate predicate_;
-    bool include_danglers_ = true;
+    if (!body_->variants_index) {
+        vector<shared_ptr<bcf1_t>> records;
+        S(dataset_range(dataset, hdr, query, bcf_variant_predicate, &records));
+        ans = !records.empty();
+        return Status::OK();
+    }
 
-    range bucket_, query_;
+    // Look up the buckets in the variant record index; only their range
+    // columns need to be read.
+    KeyValue::CollectionHandle coll;
+    S(body_->db->collection(variants_collection, coll));
+    string dskey;
+    S(lookup_dataset_key(*body_, dataset, dskey));
+    shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(query);
+    for (range r = bkExt->begin(); r <= bkExt->end(); r = bkExt->next()) {
+        shared_ptr<KeyValue::Data> data;
+        s = body_->db->get0(coll, body_->rangeHelper->bucket_key(r, dskey), data);
+        if (s == StatusCode::NOT_FOUND) {
+            continue;
+        } else if (s.bad()) {
+            return s;
+        }
+        try {
+            ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)data->data, data->size / sizeof(::capnp::word)));
+            capnp::BCFBucket::Reader bucket_reader = message.getRoot<capnp::BCFBucket>();
+            auto columns = bucket_reader.getColumns();
+            auto begs = columns.getBegs(), ends = columns.getEnds();
+            if (bucket_reader.getVersion() < 1 || begs.size() != ends.size()) {
+                return Status::Invalid("BCFKeyValueData: corrupt bucket columns", dataset + "@" + r.str());
+            }
+            for (size_t i = 0; i < begs.size() && begs[i] < query.end; i++) {
+                if (range(query.rid, begs[i], ends[i]).overlaps(query)) {
+                    ans = true;
+                    return Status::OK();
+                }
+            }
+        } catch (exception &e) {
+            return Status::IOError("exception deserializing BCF bucket", e.what());
+        }
+    }
+    return Status::OK();
+}
+
+// BCFKeyValueData::sampleset_range optimized implementation: for sample
+// sets of more than one sample, produces RangeBCFIterators that use
+// underlying KeyValue::Iterators instead of repeated point lookups (as in the
+// base implementation), seeking past datasets not in the sample set. One
+// iterator per underlying storage bucket is produced.
+
+class BCFBucketIterator : public RangeBCFIterator {
+    BCFData& data_;
+    const MetadataCache& metadata_;
+    BCFKeyValueData_body& body_;
+
+    bool first_ = true;
+    bcf_predicate predicate_;
+    const bcf_field_selection* fields_;
+    bool include_danglers_ = true;
+
+    range bucket_, query_;
+    // the desired data sets in key order: by ID if the database has the
+    // dictionary, otherwise by name
+    shared_ptr<const vector<uint32_t>> dataset_ids_;
+    vector<uint32_t>::const_iterator dataset_id_;
     shared_ptr<const set<string>> datasets_;
     set<string>::const_iterator dataset_;
 
-    string bucket_prefix_;
+    string bucket_prefix_, cache_key_suffix_;
     shared_ptr<KeyValue::Reader> reader_;
     unique_ptr<KeyValue::Iterator> it_;
 
@@ -594,20 +1678,30 @@ class BCFBucketIterator : public RangeBCFIterator {
                       vector<shared_ptr<bcf1_t>>& records) {
         // precondition: dataset_ != datasets_.end()
 
-        // pull the desired data set ID (and increment the iterator for the next call)
-        dataset = *dataset_++;
+        // pull the desired data set (and increment the iterator for the next
+        // call), naming it by ID if need be
+        Status s;
+        string dskey;
+        if (dataset_ids_) {
+            const uint32_t id = *dataset_id_++;
+            S(metadata_.dataset_name(id, dataset));
+            dskey = encode_id(id);
+        } else {
+            dataset = *dataset_++;
+            dskey = dataset;
+        }
 
         // get the data set header
-        Status s;
         S(data_.dataset_header(dataset, &hdr));
 
+        perf::scoped_timer fetch_timer(perf::timer::fetch);
         if (first_) {
             // first call to next(): begin the iteration at the first dataset
             assert(!it_);
             KeyValue::CollectionHandle coll;
-            S(body_.db->collection("bcf",coll));
+            S(body_.db->collection(BCFCollectionFor(body_, predicate_),coll));
             S(body_.db->iterator(coll,
-                                 body_.rangeHelper->bucket_key(bucket_prefix_, dataset),
+                                 body_.rangeHelper->bucket_key(bucket_prefix_, dskey),
                                  it_));
             assert(it_);
             first_ = false;
@@ -622,9 +1716,13 @@ class BCFBucketIterator : public RangeBCFIterator {
             return Status::OK();
         }
 
-        // advance the KeyValue iterator to the desired dataset
+        // advance the KeyValue iterator to the desired dataset: step to the
+        // next key (usually it, if the sample set includes most of the
+        // datasets), failing which seek directly to it, skipping over any
+        // run of undesired datasets.
         string key_dataset;
-        for (; s.ok() && it_->valid(); s = it_->next()) {
+        bool stepped = false;
+        while (it_->valid()) {
             string key_prefix;
             S(body_.rangeHelper->parse_key(it_->key().str(), key_prefix, key_dataset));
 
@@ -636,42 +1734,81 @@ class BCFBucketIterator : public RangeBCFIterator {
                 return Status::OK();
             }
 
-            if (key_dataset >= dataset) {
+            if (key_dataset >= dskey) {
                 break;
             }
+            if (!stepped) {
+                S(it_->next());
+                stepped = true;
+            } else {
+                S(it_->seek(body_.rangeHelper->bucket_key(bucket_prefix_, dskey)));
+            }
         }
-        if (s.bad()) return s;
         if (!it_->valid()) {
             // wow, we've reached the end of the whole bcf collection
             it_.reset();
             return Status::OK();
         }
-        if (key_dataset != dataset) {
+        if (key_dataset != dskey) {
             // the database contains no bucket corresponding to this dataset,
             // but might have them for subsequent data sets
-            assert(key_dataset > dataset);
+            assert(key_dataset > dskey);
             return Status::OK();
         }
+        fetch_timer.stop();
 
         // extract the records overlapping query_
-        s = ScanBCFBucket(bucket_, dataset, it_->value(), hdr.get(), query_, predicate_,
-                          include_danglers_, stats_, records);
+        if (body_.bucket_cache) {
+            string cache_key = it_->key().str() + cache_key_suffix_;
+            shared_ptr<const BCFBucketRecords> cached;
+            if (body_.bucket_cache->get(cache_key, cached)) {
+                stats_.nBucketCacheHits++;
+                perf::count(perf::counter::bucket_cache_hits);
+            } else {
+                stats_.nBucketCacheMisses++;
+                perf::count(perf::counter::bucket_cache_misses);
+                const KeyValue::Data& data = it_->value();
+                S(DecodeBCFBucketCached(body_, cache_key, bucket_, dataset, &data, hdr.get(),
+                                        predicate_, fields_, stats_, cached));
+            }
+            SliceBCFBucketRecords(*cached, bucket_, query_, include_danglers_, records);
+            stats_.nBCFRecordsInRange += records.size();
+            perf::count(perf::counter::records_in_range, records.size());
+            return Status::OK();
+        }
+        s = ScanBCFBucket(body_, bucket_, dataset, it_->value(), hdr.get(), query_, predicate_,
+                          fields_, include_danglers_, stats_, records);
         if (s.ok()) {
             stats_.nBCFRecordsInRange += records.size();
+            perf::count(perf::counter::records_in_range, records.size());
         }
         return s;
     }
 
 public:
-    BCFBucketIterator(BCFData& data, BCFKeyValueData_body& body, const range& query,
-                      const range& bucket, const std::string& bucket_prefix,
-                      bcf_predicate predicate, bool include_danglers,
+    // dataset_ids: if the database has the dictionary, the IDs of the data
+    // sets (in ascending order); otherwise null, and datasets are iterated
+    // by name
+    BCFBucketIterator(BCFData& data, const MetadataCache& metadata, BCFKeyValueData_body& body,
+                      const range& query, const range& bucket, const std::string& bucket_prefix,
+                      bcf_predicate predicate, const bcf_field_selection* fields,
+                      bool include_danglers,
+                      const shared_ptr<const vector<uint32_t>>& dataset_ids,
                       shared_ptr<const set<string>>& datasets,
                       const shared_ptr<KeyValue::Reader>& reader)
-        : data_(data), body_(body), predicate_(predicate), include_danglers_(include_danglers),
-          bucket_(bucket), query_(query), datasets_(datasets),
+        : data_(data), metadata_(metadata), body_(body), predicate_(predicate), fields_(fields),
+          include_danglers_(include_danglers),
+          bucket_(bucket), query_(query), dataset_ids_(dataset_ids), datasets_(datasets),
           dataset_(datasets->begin()), bucket_prefix_(bucket_prefix),
-          reader_(reader) {}
+          reader_(reader) {
+        if (dataset_ids_) {
+            assert(dataset_ids_->size() == datasets_->size());
+            dataset_id_ = dataset_ids_->begin();
+        }
+        if (body_.bucket_cache) {
+            cache_key_suffix_ = BucketCacheKeySuffix(predicate, fields);
+        }
+    }
 
     virtual ~BCFBucketIterator() {
         lock_guard<mutex> lock(body_.statsMutex);
@@ -680,7 +1817,7 @@ public:
 
     Status next(string& dataset, shared_ptr<const bcf_hdr_t>& hdr,
                 vector<shared_ptr<bcf1_t>>& records) override {
-        if (dataset_ == datasets_->end()) {
+        if (dataset_ids_ ? dataset_id_ == dataset_ids_->end() : dataset_ == datasets_->end()) {
             // we've finished returning all desired results
             it_.reset();
             return Status::NotFound();
@@ -700,20 +1837,28 @@ Status BCFKeyValueData::sampleset_range(const MetadataCache& metadata, const str
                                         const range& pos, bcf_predicate predicate,
                                         shared_ptr<const set<string>>& samples,
                                         shared_ptr<const set<string>>& datasets,
-                                        vector<unique_ptr<RangeBCFIterator>>& iterators) {
+                                        vector<unique_ptr<RangeBCFIterator>>& iterators,
+                                        const bcf_field_selection* fields) {
     Status s;
 
     // resolve samples and datasets
     S(metadata.sampleset_datasets(sampleset, samples, datasets));
 
-    // Heuristic: if the desired sample set has fewer than 10% of the samples
-    // in the database, then dispatch to the repeated-lookup strategy of
-    // sampleset_range_base. This heuristic is wrong if the desired samples
-    // are actually contiguous in the database, though.
-    size_t total_sample_count;
-    S(metadata.sample_count(total_sample_count));
-    if (samples->size() == 1 || samples->size() * 10 < total_sample_count) {
-        return sampleset_range_base(metadata, sampleset, pos, predicate, samples, datasets, iterators);
+    // For a single sample, dispatch to the point-lookup strategy of
+    // sampleset_range_base. Otherwise the bucket iterators below seek past
+    // any runs of undesired datasets, so their cost is at most about that of
+    // one lookup per desired dataset, and much less if the desired datasets
+    // are contiguous in the key order (i.e. their IDs, assigned in the order
+    // they were imported; or in older databases, their names).
+    if (samples->size() == 1) {
+        return sampleset_range_base(metadata, sampleset, pos, predicate, samples, datasets, iterators,
+                                    fields);
+    }
+
+    // the datasets' IDs, if the buckets are keyed by them
+    shared_ptr<const vector<uint32_t>> sample_ids, dataset_ids;
+    if (body_->dictionary) {
+        S(metadata.sampleset_ids(sampleset, sample_ids, dataset_ids));
     }
 
     // get a KeyValue::Reader so that all iterators read from the same
@@ -736,7 +1881,8 @@ Status BCFKeyValueData::sampleset_range(const MetadataCache& metadata, const str
         string bucket = body_->rangeHelper->bucket_prefix(r);
 
         iterators.push_back(make_unique<BCFBucketIterator>
-                            (*this, *body_, pos, r, bucket, predicate, first, datasets, reader));
+                            (*this, metadata, *body_, pos, r, bucket, predicate, fields, first,
+                             dataset_ids, datasets, reader));
         first = false;
     }
 
@@ -749,11 +1895,87 @@ Status BCFKeyValueData::sampleset_range_base(const MetadataCache& metadata, cons
                                              const range& pos, bcf_predicate predicate,
                                              shared_ptr<const set<string>>& samples,
                                              shared_ptr<const set<string>>& datasets,
-                                             vector<unique_ptr<RangeBCFIterator>>& iterators) {
-    return BCFData::sampleset_range(metadata, sampleset, pos, predicate, samples, datasets, iterators);
+                                             vector<unique_ptr<RangeBCFIterator>>& iterators,
+                                             const bcf_field_selection* fields) {
+    return BCFData::sampleset_range(metadata, sampleset, pos, predicate, samples, datasets, iterators,
+                                    fields);
 }
 
 
+Status BCFKeyValueData::prefetch(const MetadataCache& metadata, const string& sampleset,
+                                 const range& pos, bcf_predicate predicate,
+                                 const bcf_field_selection* fields) {
+    Status s;
+    if (pos.rid < 0 || pos.beg < 0 || pos.end < 0)
+        return Status::Invalid("BCFKeyValueData::prefetch: invalid query range", pos.str());
+
+    shared_ptr<const set<string>> samples, datasets;
+    S(metadata.sampleset_datasets(sampleset, samples, datasets));
+    vector<string> dsnames(datasets->begin(), datasets->end()), dskeys;
+    for (const auto& dataset : dsnames) {
+        string dskey;
+        S(lookup_dataset_key(*body_, dataset, dskey));
+        dskeys.push_back(move(dskey));
+    }
+
+    KeyValue::CollectionHandle coll;
+    S(body_->db->collection(BCFCollectionFor(*body_, predicate),coll));
+    string cache_key_suffix;
+    if (body_->bucket_cache) {
+        cache_key_suffix = BucketCacheKeySuffix(predicate, fields);
+    }
+
+    StatsRangeQuery accu;
+    shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(pos);
+    for (range r = bkExt->begin(); r <= bkExt->end(); r = bkExt->next()) {
+        // read the bucket of each dataset (not already in the bucket cache)
+        const string prefix = body_->rangeHelper->bucket_prefix(r);
+        vector<string> keys;
+        vector<size_t> which;
+        for (size_t i = 0; i < dskeys.size(); i++) {
+            string key = body_->rangeHelper->bucket_key(prefix, dskeys[i]);
+            shared_ptr<const BCFBucketRecords> cached;
+            if (body_->bucket_cache && body_->bucket_cache->get(key + cache_key_suffix, cached)) {
+                continue;
+            }
+            keys.push_back(move(key));
+            which.push_back(i);
+        }
+        if (keys.empty()) {
+            continue;
+        }
+        vector<shared_ptr<KeyValue::Data>> values;
+        vector<Status> statuses;
+        S(body_->db->multi_get0(coll, keys, values, statuses));
+
+        for (size_t k = 0; k < keys.size(); k++) {
+            if (statuses[k].bad() && statuses[k] != StatusCode::NOT_FOUND) {
+                return statuses[k];
+            }
+            if (statuses[k].ok()) {
+                perf::count(perf::counter::buckets_prefetched);
+            }
+            if (body_->bucket_cache) {
+                // decode it into the cache (caching the absence of any bucket,
+                // too, as the query would)
+                const string& dataset = dsnames[which[k]];
+                shared_ptr<const bcf_hdr_t> hdr;
+                S(dataset_header(dataset, &hdr));
+                shared_ptr<const BCFBucketRecords> decoded;
+                S(DecodeBCFBucketCached(*body_, keys[k] + cache_key_suffix, r, dataset,
+                                        statuses[k].ok() ? values[k].get() : nullptr, hdr.get(),
+                                        predicate, fields, accu, decoded));
+            }
+        }
+    }
+
+    {
+        std::lock_guard<mutex> lock(body_->statsMutex);
+        body_->statsRq += accu;
+    }
+    return Status::OK();
+}
+
 // Make sure that we the database doesn't already include these datasets and samples.
 static Status verify_dataset_and_samples(BCFKeyValueData_body *body_,
                                          MetadataCache& metadata,
@@ -762,6 +1984,12 @@ static Status verify_dataset_and_samples(BCFKeyValueData_body *body_,
                                          const set<string>& samples) {
     Status s;
 
+    // names beginning with the header template prefix would collide with the
+    // templates' keys in the header collection
+    if (!dataset.empty() && dataset[0] == header_template_prefix) {
+        return Status::Invalid("data set name can't begin with '#'", dataset + " (" + filename + ")");
+    }
+
     KeyValue::CollectionHandle coll;
     S(body_->db->collection("header",coll));
     string data;
@@ -786,26 +2014,42 @@ static Status verify_dataset_and_samples(BCFKeyValueData_body *body_,
     return Status::OK();
 }
 
-// Add a <key,value> pair to the database.
-// The key is a concatenation of the dataset name and the chromosome and genomic range.
-static Status write_bucket(BCFBucketRange& rangeHelper, BulkInsertBuffer& db, KeyValue::CollectionHandle& coll_bcf,
-                    const BCFBucketWriter& writer, unsigned int danglers, const string& dataset,
+// Collections to which buckets are written: bcf, and the variant record index
+// (if the database has it; otherwise null)
+struct BucketCollections {
+    KeyValue::CollectionHandle bcf = nullptr, variants = nullptr;
+};
+
+// Add a <key,value> pair to the database (and the bucket's variant records,
+// if any, to the variant record index).
+// The key is a concatenation of the chromosome and genomic range and the dataset key.
+static Status write_bucket(BCFBucketRange& rangeHelper, BulkInsertBuffer& db, const BucketCollections& colls,
+                    const BCFBucketWriter& writer, unsigned int danglers, const string& dataset_key,
                     const range& rng,
                     BCFKeyValueData::import_result& rslt) {
     if (writer.get_num_entries()) {
         // Generate the key
-        string key = rangeHelper.bucket_key(rng, dataset);
+        string key = rangeHelper.bucket_key(rng, dataset_key);
         Status s;
         string data;
-        //assert(db->get(coll_bcf, key, data) == StatusCode::NOT_FOUND);
+        //assert(db->get(colls.bcf, key, data) == StatusCode::NOT_FOUND);
 
         // extract the data
         S(writer.contents(data));
 
         // write to the database
-        S(db.put(coll_bcf, key, data));
+        S(db.put(colls.bcf, key, data));
         assert(danglers <= writer.get_num_entries());
         rslt.add_bucket(writer.get_num_entries(), data.size(), danglers);
+
+        if (colls.variants) {
+            BCFBucketWriter variants;
+            S(writer.variants(variants));
+            if (variants.get_num_entries()) {
+                S(variants.contents(data));
+                S(db.put(colls.variants, key, data));
+            }
+        }
     } else {
         assert(danglers == 0);
     }
@@ -869,8 +2113,8 @@ static Status write_danglers_to_in_mem_bucket(vector<shared_ptr<bcf1_t>> &dangle
 // and [next_bkt]
 static Status write_danglers_between(BCFBucketRange& rangeHelper,
                                      BulkInsertBuffer& db,
-                                     KeyValue::CollectionHandle& coll_bcf,
-                                     const string& dataset,
+                                     const BucketCollections& colls,
+                                     const string& dataset_key,
                                      range &current_bkt,
                                      BCFKeyValueData::import_result& rslt,
                                      vector<shared_ptr<bcf1_t>> &danglers,
@@ -896,8 +2140,8 @@ static Status write_danglers_between(BCFBucketRange& rangeHelper,
             }
         }
         if (writer.get_num_entries() > 0) {
-            S(write_bucket(rangeHelper, db, coll_bcf, writer, writer.get_num_entries(),
-                           dataset, current, rslt));
+            S(write_bucket(rangeHelper, db, colls, writer, writer.get_num_entries(),
+                           dataset_key, current, rslt));
         }
         prune_danglers(danglers, current);
         current = rangeHelper.inc_bucket(current);
@@ -906,62 +2150,577 @@ static Status write_danglers_between(BCFBucketRange& rangeHelper,
     return Status::OK();
 }
 
-static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
-                                          MetadataCache& metadata,
-                                          KeyValue::DB* db,
-                                          const string& dataset,
-                                          const string& filename,
-                                          const set<range>& range_filter,
-                                          const bcf_hdr_t *hdr,
-                                          vcfFile *vcf,
-                                          BCFKeyValueData::import_result& rslt) {
+// Reference band compaction (see BCFKeyValueData::import_options): the
+// import loop holds back the latest reference band as the current "run",
+// merging subsequent bands into it until it meets one that can't be merged.
+struct ref_band_run {
+    const bcf_hdr_t* hdr;
+    int end_id, gt_id, gq_id;
+    int gq_tolerance;
+
+    std::unique_ptr<bcf1_t, void(*)(bcf1_t*)> rec;
+    bool active = false;
+    bool has_gq = false;
+    int32_t gq_lo = 0, gq_hi = 0;
+    htsvecbox<int32_t> gq, v1, v2;
+
+    ref_band_run(const bcf_hdr_t* hdr_, int gq_tolerance_)
+        : hdr(hdr_), gq_tolerance(gq_tolerance_), rec(bcf_init(), &bcf_destroy) {
+        end_id = bcf_hdr_id2int(hdr, BCF_DT_ID, "END");
+        if (end_id >= 0 && !bcf_hdr_idinfo_exists(hdr, BCF_HL_INFO, end_id)) {
+            end_id = -1;
+        }
+        gt_id = bcf_hdr_id2int(hdr, BCF_DT_ID, "GT");
+        gq_id = bcf_hdr_id2int(hdr, BCF_DT_ID, "GQ");
+        if (gq_id >= 0 && (!bcf_hdr_idinfo_exists(hdr, BCF_HL_FMT, gq_id) ||
+                           bcf_hdr_id2type(hdr, BCF_HL_FMT, gq_id) != BCF_HT_INT)) {
+            gq_id = -1;
+        }
+    }
+
+    // Determine whether the record is a candidate for compaction at all; if
+    // so, leaves it unpacked.
+    bool candidate(bcf1_t* v) {
+        if (end_id < 0 || bcf_hdr_nsamples(hdr) != 1 || v->n_sample != 1 || v->rlen <= 0 ||
+            bcf_unpack(v, BCF_UN_ALL) != 0) {
+            return false;
+        }
+        return is_gvcf_ref_record(v);
+    }
+
+    // Get the record's GQ, if present
+    bool get_gq(bcf1_t* v, int32_t& ans) {
+        if (gq_id >= 0 && bcf_get_format_int32(hdr, v, "GQ", &gq.v, &gq.capacity) == 1 &&
+            gq[0] != bcf_int32_missing && gq[0] != bcf_int32_vector_end) {
+            ans = gq[0];
+            return true;
+        }
+        return false;
+    }
+
+    // Start a new run with the candidate record (taking it over by swapping
+    // it with the run's previous record)
+    void start(std::unique_ptr<bcf1_t, void(*)(bcf1_t*)>& v) {
+        assert(!active);
+        std::swap(rec, v);
+        has_gq = get_gq(rec.get(), gq_lo);
+        gq_hi = gq_lo;
+        active = true;
+    }
+
+    // Determine whether the candidate record v, immediately following the
+    // run, can be merged into it.
+    bool mergeable(bcf1_t* v) {
+        bcf1_t* r = rec.get();
+        assert(active);
+        if (v->rid != r->rid || v->pos != r->pos + r->rlen || v->n_allele != r->n_allele) {
+            return false;
+        }
+        for (unsigned i = 1; i < v->n_allele; i++) {
+            if (strcmp(v->d.allele[i], r->d.allele[i])) {
+                return false;
+            }
+        }
+        if (bcf_float_is_missing(v->qual) != bcf_float_is_missing(r->qual) ||
+            (!bcf_float_is_missing(v->qual) && v->qual != r->qual)) {
+            return false;
+        }
+        if (v->d.n_flt != r->d.n_flt ||
+            !std::equal(v->d.flt, v->d.flt + v->d.n_flt, r->d.flt)) {
+            return false;
+        }
+
+        // INFO fields other than END must be identical
+        int i = 0, j = 0;
+        while (true) {
+            while (i < r->n_info && r->d.info[i].key == end_id) i++;
+            while (j < v->n_info && v->d.info[j].key == end_id) j++;
+            if (i == r->n_info || j == v->n_info) {
+                if (i != r->n_info || j != v->n_info) {
+                    return false;
+                }
+                break;
+            }
+            const bcf_info_t &ri = r->d.info[i], &vi = v->d.info[j];
+            if (ri.key != vi.key || ri.type != vi.type || ri.len != vi.len ||
+                ri.vptr_len != vi.vptr_len || memcmp(ri.vptr, vi.vptr, vi.vptr_len)) {
+                return false;
+            }
+            i++; j++;
+        }
+
+        // FORMAT fields must be the same, with identical values except for
+        // integer fields other than GT
+        if (v->n_fmt != r->n_fmt) {
+            return false;
+        }
+        for (i = 0; i < v->n_fmt; i++) {
+            const bcf_fmt_t &rf = r->d.fmt[i], &vf = v->d.fmt[i];
+            if (rf.id != vf.id || rf.n != vf.n) {
+                return false;
+            }
+            if (vf.id == gt_id || bcf_hdr_id2type(hdr, BCF_HL_FMT, vf.id) != BCF_HT_INT) {
+                if (rf.type != vf.type || rf.size != vf.size || memcmp(rf.p, vf.p, vf.size)) {
+                    return false;
+                }
+            }
+        }
+
+        // GQs must lie within the tolerance
+        int32_t v_gq = 0;
+        if (get_gq(v, v_gq) != has_gq) {
+            return false;
+        }
+        if (has_gq && std::max(gq_hi, v_gq) - std::min(gq_lo, v_gq) > gq_tolerance) {
+            return false;
+        }
+        return true;
+    }
+
+    // Merge the (mergeable) record v into the run, extending it to cover v
+    // and taking the element-wise minimum of integer FORMAT fields (missing
+    // values yield to present ones).
+    Status merge(bcf1_t* v) {
+        bcf1_t* r = rec.get();
+        assert(active);
+        for (int i = 0; i < r->n_fmt; i++) {
+            int id = r->d.fmt[i].id;
+            if (id == gt_id || bcf_hdr_id2type(hdr, BCF_HL_FMT, id) != BCF_HT_INT) {
+                continue;
+            }
+            const char* key = bcf_hdr_int2id(hdr, BCF_DT_ID, id);
+            int n1 = bcf_get_format_int32(hdr, r, key, &v1.v, &v1.capacity);
+            int n2 = bcf_get_format_int32(hdr, v, key, &v2.v, &v2.capacity);
+            if (n1 <= 0 || n1 != n2) {
+                return Status::Failure("ref_band_run::merge: bcf_get_format_int32", key);
+            }
+            for (int k = 0; k < n1; k++) {
+                if (v1[k] == bcf_int32_vector_end || v2[k] == bcf_int32_vector_end) {
+                    v1[k] = bcf_int32_vector_end;
+                } else if (v1[k] == bcf_int32_missing) {
+                    v1[k] = v2[k];
+                } else if (v2[k] != bcf_int32_missing) {
+                    v1[k] = std::min(v1[k], v2[k]);
+                }
+            }
+            if (bcf_update_format_int32(hdr, r, key, v1.v, n1) != 0) {
+                return Status::Failure("ref_band_run::merge: bcf_update_format_int32", key);
+            }
+        }
+
+        int32_t end = v->pos + v->rlen;
+        if (bcf_update_info_int32(hdr, r, "END", &end, 1) != 0) {
+            return Status::Failure("ref_band_run::merge: bcf_update_info_int32");
+        }
+        r->rlen = end - r->pos;
+
+        int32_t v_gq = 0;
+        if (get_gq(v, v_gq)) {
+            assert(has_gq);
+            gq_lo = std::min(gq_lo, v_gq);
+            gq_hi = std::max(gq_hi, v_gq);
+        }
+        return Status::OK();
+    }
+};
+
+// Merge overlapping/abutting ranges in the set (yielding sorted, disjoint
+// ranges)
+static vector<range> merge_ranges(const set<range>& ranges) {
+    vector<range> ans;
+    for (const auto& r : ranges) {
+        if (ans.empty() || !ans.back().merge_contiguous(r)) {
+            ans.push_back(r);
+        }
+    }
+    return ans;
+}
+
+// Determine whether rng overlaps any of the sorted, disjoint ranges
+static bool overlaps_any(const vector<range>& ranges, const range& rng) {
+    // the first range not entirely preceding rng is the only one which might
+    // overlap it
+    auto it = lower_bound(ranges.begin(), ranges.end(), rng,
+                          [](const range& r, const range& q) {
+                              return r.rid < q.rid || (r.rid == q.rid && r.end <= q.beg);
+                          });
+    return it != ranges.end() && it->overlaps(rng);
+}
+
+// Determine whether the headers assign the same IDs to the same contigs and
+// INFO/FORMAT/FILTER fields, so that records parsed with one are encoded the
+// same as with the other
+static bool same_header_dictionaries(const bcf_hdr_t* a, const bcf_hdr_t* b) {
+    for (int dt : {BCF_DT_ID, BCF_DT_CTG}) {
+        if (a->n[dt] != b->n[dt]) {
+            return false;
+        }
+        for (int i = 0; i < a->n[dt]; i++) {
+            const char *ka = a->id[dt][i].key, *kb = b->id[dt][i].key;
+            if (!ka != !kb || (ka && strcmp(ka, kb))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Reads the gVCF records to import, restricted to those overlapping the range
+// filter (if any). If the file has a tabix or CSI index, then the reader
+// seeks directly to each range in turn; otherwise it scans the whole file,
+// testing each record against the ranges by binary search.
+//
+// The reader may also parse the records ahead on a thread of its own (see
+// parse_ahead()), overlapping the VCF parsing with the bucket building.
+class GVCFImportReader {
+    vcfFile* vcf_;
+    const bcf_hdr_t* hdr_;
+
+    // range filter, with overlapping/abutting ranges merged (so sorted and
+    // disjoint)
+    vector<range> ranges_;
+
+    hts_idx_t* idx_ = nullptr; // BCF (CSI)
+    tbx_t* tbx_ = nullptr;     // bgzipped VCF (tabix or CSI)
+    hts_itr_t* itr_ = nullptr; // iterator over ranges_[cur_]
+    size_t cur_ = 0;
+    kstring_t line_ = {0, 0, nullptr};
+    const int header_ids_;
+
+    // header indices of the samples to keep in each record (bcf_subset), if
+    // importing a sample tile
+    vector<int> imap_;
+
+    // Parsing ahead: the thread reads batches of records into the full queue,
+    // recycling those the consumer has finished with from the free queue.
+    // The last batch ends with a nonzero return code for next().
+    static const size_t AHEAD_BATCH = 64;
+    struct ahead_batch {
+        vector<bcf1_t*> recs;
+        size_t n = 0;       // records in the batch
+        int c = 0;          // then this return code, if nonzero
+        bool grew = false;  // the last record added to the header
+
+        ~ahead_batch() {
+            for (bcf1_t* v : recs) {
+                bcf_destroy(v);
+            }
+        }
+    };
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> ahead_hdr_{nullptr, &bcf_hdr_destroy};
+    size_t ahead_depth_ = 0; // max batches in the full queue; 0 unless parsing ahead
+    thread ahead_thread_;
+    mutex ahead_mu_;
+    condition_variable ahead_cv_;
+    deque<unique_ptr<ahead_batch>> ahead_full_, ahead_free_;
+    bool ahead_stop_ = false;
+    // consumer's state
+    unique_ptr<ahead_batch> ahead_cur_;
+    size_t ahead_pos_ = 0;
+    bool ahead_grew_ = false;
+
+    // read the next record from the index iterator for the current range
+    int itr_next(bcf1_t* v) {
+        if (idx_) {
+            int ret = bcf_itr_next(vcf_, itr_, v);
+            return ret >= 0 ? 0 : ret;
+        }
+        int ret = tbx_itr_next(vcf_, tbx_, itr_, &line_);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = vcf_parse(&line_, hdr_, v);
+        return ret == 0 ? 0 : -2;
+    }
+
+    // create the index iterator for the current range; sets itr_ to nullptr
+    // if the index has no records on its contig
+    void itr_make() {
+        assert(itr_ == nullptr && cur_ < ranges_.size());
+        const range& r = ranges_[cur_];
+        if (idx_) {
+            itr_ = bcf_itr_queryi(idx_, r.rid, r.beg, r.end);
+        } else {
+            int tid = tbx_name2id(tbx_, bcf_hdr_id2name(hdr_, r.rid));
+            if (tid >= 0) {
+                itr_ = tbx_itr_queryi(tbx_, tid, r.beg, r.end);
+            }
+        }
+    }
+
+public:
+    GVCFImportReader(vcfFile* vcf, const bcf_hdr_t* hdr, const set<range>& range_filter)
+        : vcf_(vcf), hdr_(hdr), ranges_(merge_ranges(range_filter)), header_ids_(hdr->n[BCF_DT_ID]) {}
+
+    ~GVCFImportReader() {
+        if (ahead_thread_.joinable()) {
+            {
+                lock_guard<mutex> lock(ahead_mu_);
+                ahead_stop_ = true;
+            }
+            ahead_cv_.notify_all();
+            ahead_thread_.join();
+        }
+        if (itr_) hts_itr_destroy(itr_);
+        if (idx_) hts_idx_destroy(idx_);
+        if (tbx_) tbx_destroy(tbx_);
+        free(line_.s);
+    }
+
+    // Load the file's index, if there's a range filter and the index is
+    // available.
+    void load_index(const string& filename) {
+        if (ranges_.empty()) {
+            return;
+        }
+        const htsFormat* fmt = hts_get_format(vcf_);
+        if (fmt->format == bcf) {
+            idx_ = bcf_index_load(filename.c_str());
+        } else if (fmt->format == vcf && fmt->compression == bgzf) {
+            tbx_ = tbx_index_load(filename.c_str());
+        }
+    }
+
+    bool indexed() const noexcept { return idx_ || tbx_; }
+
+    // Determine whether parsing VCF text has added dummy entries to the
+    // header for undeclared INFO/FORMAT fields, shifting the field IDs
+    // encoded into subsequent records. If parsing ahead, the record just
+    // returned by next() was the first to do so, in the reader's own copy of
+    // the header; the records can't then be used with the caller's header.
+    bool header_grew() const noexcept {
+        return ahead_depth_ ? ahead_grew_ : hdr_->n[BCF_DT_ID] != header_ids_;
+    }
+
+    // Determine whether the range overlaps any in the filter
+    bool overlaps_filter(const range& rng) const noexcept {
+        return overlaps_any(ranges_, rng);
+    }
+
+    // Keep only the given samples (by header index) of each record read
+    void set_sample_subset(const vector<int>& imap) { imap_ = imap; }
+    bool subsetting() const noexcept { return !imap_.empty(); }
+
+    // Parse up to about the given number of records ahead of next(), on a
+    // separate thread, using a copy of the header (leaving the caller's header
+    // to other threads). Call after load_index() and set_sample_subset().
+    // Returns false if the header can't be copied exactly.
+    bool parse_ahead(size_t records) {
+        assert(!ahead_depth_ && records);
+        ahead_hdr_.reset(bcf_hdr_dup(hdr_));
+        if (!ahead_hdr_ || !same_header_dictionaries(hdr_, ahead_hdr_.get())) {
+            ahead_hdr_.reset();
+            return false;
+        }
+        hdr_ = ahead_hdr_.get();
+        ahead_depth_ = std::max(records / AHEAD_BATCH, size_t(1));
+        ahead_thread_ = thread([this]() { produce(); });
+        return true;
+    }
+    bool parsing_ahead() const noexcept { return ahead_depth_ > 0; }
+
+    // Read the next record, returning 0 on success, -1 on end of file, or
+    // < -1 on error (like bcf_read)
+    int next(bcf1_t* v) {
+        return ahead_depth_ ? next_ahead(v) : next_record(v);
+    }
+
+private:
+    int next_record(bcf1_t* v) {
+        int c = read(v);
+        if (c == 0 && v->errcode == 0 && !imap_.empty() &&
+            bcf_subset(hdr_, v, imap_.size(), imap_.data()) != 0) {
+            return -2;
+        }
+        return c;
+    }
+
+    // the parse-ahead thread
+    void produce() {
+        while (true) {
+            unique_ptr<ahead_batch> b;
+            {
+                unique_lock<mutex> lock(ahead_mu_);
+                ahead_cv_.wait(lock, [this]{ return ahead_stop_ || ahead_full_.size() < ahead_depth_; });
+                if (ahead_stop_) {
+                    return;
+                }
+                if (!ahead_free_.empty()) {
+                    b = move(ahead_free_.front());
+                    ahead_free_.pop_front();
+                }
+            }
+            if (!b) {
+                b.reset(new ahead_batch);
+            }
+            b->n = 0;
+            b->c = 0;
+            b->grew = false;
+            while (b->n < AHEAD_BATCH && b->c == 0) {
+                if (b->n == b->recs.size()) {
+                    b->recs.push_back(bcf_init());
+                }
+                bcf1_t* v = b->recs[b->n];
+                int c = next_record(v);
+                if (c != 0) {
+                    b->c = c;
+                    break;
+                }
+                b->n++;
+                // the consumer stops at a bad record, or one which added to
+                // the header, so we stop there too
+                if (v->errcode != 0) {
+                    b->c = -2;
+                } else if (hdr_->n[BCF_DT_ID] != header_ids_) {
+                    b->grew = true;
+                    b->c = -2;
+                }
+            }
+            const bool last = b->c != 0;
+            {
+                lock_guard<mutex> lock(ahead_mu_);
+                ahead_full_.push_back(move(b));
+            }
+            ahead_cv_.notify_all();
+            if (last) {
+                return;
+            }
+        }
+    }
+
+    // take the next record parsed ahead, swapping it into v
+    int next_ahead(bcf1_t* v) {
+        while (!ahead_cur_ || ahead_pos_ == ahead_cur_->n) {
+            if (ahead_cur_ && ahead_cur_->c != 0) {
+                return ahead_cur_->c;
+            }
+            {
+                unique_lock<mutex> lock(ahead_mu_);
+                if (ahead_cur_) {
+                    ahead_free_.push_back(move(ahead_cur_));
+                }
+                ahead_cv_.wait(lock, [this]{ return !ahead_full_.empty(); });
+                ahead_cur_ = move(ahead_full_.front());
+                ahead_full_.pop_front();
+            }
+            ahead_cv_.notify_all();
+            ahead_pos_ = 0;
+        }
+        std::swap(*v, *(ahead_cur_->recs[ahead_pos_++]));
+        if (ahead_pos_ == ahead_cur_->n && ahead_cur_->grew) {
+            ahead_grew_ = true;
+        }
+        return 0;
+    }
+
+    int read(bcf1_t* v) {
+        if (ranges_.empty()) {
+            return bcf_read(vcf_, hdr_, v);
+        }
+        if (!indexed()) {
+            int c;
+            while ((c = bcf_read(vcf_, hdr_, v)) == 0 && v->errcode == 0 &&
+                   !overlaps_filter(range(v))) {}
+            return c;
+        }
+        while (cur_ < ranges_.size()) {
+            if (!itr_) {
+                itr_make();
+                if (!itr_) {
+                    cur_++;
+                    continue;
+                }
+            }
+            int c = itr_next(v);
+            if (c == -1) {
+                hts_itr_destroy(itr_);
+                itr_ = nullptr;
+                cur_++;
+                continue;
+            }
+            if (c != 0 || v->errcode != 0) {
+                return c;
+            }
+            range rng(v);
+            // skip records we already read from the previous range
+            if (cur_ > 0 && ranges_[cur_-1].rid == rng.rid && rng.beg < ranges_[cur_-1].end) {
+                continue;
+            }
+            if (ranges_[cur_].overlaps(rng)) {
+                return 0;
+            }
+        }
+        return -1;
+    }
+};
+
+// A tile of a wide gVCF's samples, stored as a dataset of its own (see
+// import_options::sample_tile_size): the gVCF header subset to the tile's
+// samples, and their indices in the gVCF header
+struct sample_tile {
+    string dataset;
+    shared_ptr<bcf_hdr_t> hdr;
+    vector<int> imap;
+};
+
+// Ingest the gVCF records supplied by the reader into buckets.
+//
+// The import of an indexed gVCF may be divided into chunks spanning whole
+// buckets on one contig, which are ingested independently (see
+// bulk_insert_gvcf_key_values below). In that case chunk gives the chunk's
+// range, and the reader supplies the records overlapping it (or overlapping
+// the range filter within it, and its first and last positions), which are
+// then subject to record_filter, the whole range filter, if any. Records
+// beginning before the chunk belong to the preceding chunk; they seed the
+// danglers list, just as if the preceding buckets had been ingested in this
+// thread. Conversely, danglers from the chunk are written only up to its
+// end, unless it's the last one on the contig. Otherwise, chunk is
+// range(-1,-1,-1) and the reader supplies all the records to import.
+static Status ingest_gvcf_records(BCFBucketRange& rangeHelper,
+                                  MetadataCache& metadata,
+                                  KeyValue::DB* db,
+                                  const string& dataset_key,
+                                  const string& filename,
+                                  const bcf_hdr_t *hdr,
+                                  GVCFImportReader& reader,
+                                  const vector<range>* record_filter,
+                                  const range& chunk,
+                                  const BCFKeyValueData::import_options& opts,
+                                  BCFKeyValueData::import_result& rslt) {
     Status s;
-    BulkInsertBuffer buffer(*db);
+    BulkInsertBuffer buffer(*db, true);
     unique_ptr<bcf1_t, void(*)(bcf1_t*)> vt(bcf_init(), &bcf_destroy);
     int prev_pos = -1;
     int prev_rid = -1;
     vector<shared_ptr<bcf1_t>> danglers;
     unsigned int danglers_written_to_current_bucket = 0;
-    // current bucket
+    // current bucket (for a chunk, initially the last bucket of the preceding
+    // chunk, to which the incoming danglers belong)
     range bucket(-1, 0, rangeHelper.interval_len), last_range(-1,-1,-1);
+    if (chunk.rid >= 0 && chunk.beg > 0) {
+        const int len = rangeHelper.interval_len_of(chunk.rid);
+        assert(chunk.beg % len == 0);
+        bucket = range(chunk.rid, chunk.beg - len, chunk.beg);
+    }
     BCFBucketWriter writer;
 
-    KeyValue::CollectionHandle coll_bcf;
-    S(db->collection("bcf", coll_bcf));
-
-    // scan the BCF records
-    int c;
-    for(c = bcf_read(vcf, hdr, vt.get());
-        c == 0 && vt->errcode == 0;
-        c = bcf_read(vcf, hdr, vt.get())) {
-        range vt_rng(vt.get());
-        last_range = vt_rng;
-        if (!range_filter.empty()) {
-            // Test range filter if applicable. It would be nice to use a
-            // tabix index instead.
-            if (all_of(range_filter.begin(), range_filter.end(),
-                       [&vt_rng](const range& r) { return !r.overlaps(vt_rng); })) {
-                continue;
-            }
-        }
-
-        // Check various aspects of the record's validity; e.g. make sure the
-        // records are coordinate sorted. May also indicate we should just drop
-        // the record for various reasons.
-        bool skip_ingestion = false;
-        S(validate_bcf(metadata.contigs(), filename, hdr, vt.get(), prev_rid, prev_pos, skip_ingestion));
-        if (skip_ingestion) {
-            rslt.skipped_records++;
-            continue;
-        }
+    BucketCollections colls;
+    S(db->collection("bcf", colls.bcf));
+    if (db->collection(variants_collection, colls.variants).bad()) {
+        colls.variants = nullptr;
+    }
 
+    // add a record to the current bucket, first moving on to the record's
+    // bucket if necessary
+    auto ingest = [&](bcf1_t* rec) {
+        Status s;
         // should we start a new bucket?
-        if (vt->rid != bucket.rid || vt->pos >= bucket.end) {
+        if (rec->rid != bucket.rid || rec->pos >= bucket.end) {
             // write old bucket K to DB
-            S(write_bucket(rangeHelper, buffer, coll_bcf, writer, danglers_written_to_current_bucket,
-                           dataset, bucket, rslt));
-            range next_bucket = rangeHelper.bucket(vt.get());
-            S(write_danglers_between(rangeHelper, buffer, coll_bcf, dataset, bucket, rslt,
+            S(write_bucket(rangeHelper, buffer, colls, writer, danglers_written_to_current_bucket,
+                           dataset_key, bucket, rslt));
+            range next_bucket = rangeHelper.bucket(rec);
+            S(write_danglers_between(rangeHelper, buffer, colls, dataset_key, bucket, rslt,
                                      danglers, next_bucket));
             bucket = next_bucket;
 
@@ -973,17 +2732,95 @@ static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
             write_danglers_to_in_mem_bucket(danglers, writer, next_bucket);
         }
         // write the record into the bucket
-        S(writer.add(vt.get()));
+        S(writer.add(rec));
         // if it dangles off the end of the bucket, add it to danglers for
         // inclusion in the next bucket
-        if (range(vt.get()).end > bucket.end) {
+        if (range(rec).end > bucket.end) {
             auto dangler = shared_ptr<bcf1_t>(bcf_init(), &bcf_destroy);
-            bcf_copy(dangler.get(), vt.get());
-            assert(range(dangler.get()) == range(vt.get()));
+            bcf_copy(dangler.get(), rec);
+            assert(range(dangler.get()) == range(rec));
             danglers.push_back(dangler);
         }
+        return Status::OK();
+    };
+
+    // reference band compaction state
+    ref_band_run run(hdr, opts.ref_band_gq_tolerance);
+    unique_ptr<bcf1_t, void(*)(bcf1_t*)> run_synced(bcf_init(), &bcf_destroy);
+
+    // scan the BCF records (overlapping the range filter, if any)
+    int c;
+    for(c = reader.next(vt.get());
+        c == 0 && vt->errcode == 0;
+        c = reader.next(vt.get())) {
+        last_range = range(vt.get());
+        if (reader.header_grew()) {
+            if (reader.subsetting()) {
+                // the sample tiles' headers would lack the fields
+                return Status::Invalid("gVCF has INFO/FORMAT fields undeclared in its header, which importing in sample tiles doesn't support", filename);
+            }
+            if (chunk.rid >= 0 || reader.parsing_ahead()) {
+                return Status::Aborted();
+            }
+        }
+        if (record_filter && !overlaps_any(*record_filter, last_range)) {
+            continue;
+        }
+        const bool incoming = chunk.rid >= 0 && vt->pos < chunk.beg;
+        assert(chunk.rid < 0 || (last_range.overlaps(chunk) && vt->pos < chunk.end));
+
+        // Check various aspects of the record's validity; e.g. make sure the
+        // records are coordinate sorted. May also indicate we should just drop
+        // the record for various reasons.
+        bool skip_ingestion = false;
+        S(validate_bcf(metadata.contigs(), filename, hdr, vt.get(), prev_rid, prev_pos, skip_ingestion));
+        if (skip_ingestion) {
+            if (!incoming) {
+                rslt.skipped_records++;
+            }
+            continue;
+        }
+
         prev_rid = vt->rid;
         prev_pos = vt->pos;
+
+        if (incoming) {
+            // belongs to the preceding chunk (which isn't split between
+            // chunks when compacting reference bands), and dangles into
+            // this one
+            assert(!opts.compact_ref_bands);
+            auto dangler = shared_ptr<bcf1_t>(bcf_init(), &bcf_destroy);
+            bcf_copy(dangler.get(), vt.get());
+            danglers.push_back(dangler);
+            continue;
+        }
+
+        if (opts.compact_ref_bands) {
+            bool candidate = run.candidate(vt.get());
+            // merge this reference band into the current run, if possible
+            // (without extending the run into another bucket)
+            if (candidate && run.active &&
+                vt->pos < rangeHelper.bucket(run.rec.get()).end &&
+                run.mergeable(vt.get())) {
+                S(run.merge(vt.get()));
+                rslt.compacted_records++;
+                continue;
+            }
+            // otherwise, write out the current run, and start a new one
+            // with this record if it's a reference band
+            if (run.active) {
+                // bcf_copy syncs the run record, which merge() has updated
+                bcf_copy(run_synced.get(), run.rec.get());
+                S(ingest(run_synced.get()));
+                run.active = false;
+            }
+            if (candidate) {
+                run.start(vt);
+                continue;
+            }
+        }
+
+        S(ingest(vt.get()));
     }
     if (vt->errcode != 0) {
         ostringstream msg;
@@ -995,18 +2832,260 @@ static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
     }
     if (c != -1) return Status::IOError("reading from gVCF file", filename);
 
+    // write out the last reference band run
+    if (run.active) {
+        bcf_copy(run_synced.get(), run.rec.get());
+        S(ingest(run_synced.get()));
+        run.active = false;
+    }
+
     // write out last bucket
-    S(write_bucket(rangeHelper, buffer, coll_bcf, writer, danglers_written_to_current_bucket,
-                    dataset, bucket, rslt));
+    S(write_bucket(rangeHelper, buffer, colls, writer, danglers_written_to_current_bucket,
+                    dataset_key, bucket, rslt));
 
-    // write any last danglers
-    range end_bucket = rangeHelper.bucket_at_end_of_chrom(vt->rid, metadata.contigs());
-    S(write_danglers_between(rangeHelper, buffer, coll_bcf, dataset, bucket, rslt,
-                             danglers, end_bucket));
+    // write any last danglers (up to the end of the chunk, if it doesn't
+    // extend to the end of the contig)
+    if (!danglers.empty()) {
+        range end_bucket = rangeHelper.bucket_at_end_of_chrom(bucket.rid, metadata.contigs());
+        if (chunk.rid >= 0 && (size_t) chunk.end < metadata.contigs()[chunk.rid].second) {
+            const int len = rangeHelper.interval_len_of(chunk.rid);
+            assert(chunk.end % len == 0);
+            end_bucket = range(chunk.rid, chunk.end, chunk.end + len);
+        }
+        S(write_danglers_between(rangeHelper, buffer, colls, dataset_key, bucket, rslt,
+                                 danglers, end_bucket));
+    }
 
     return buffer.flush();
 }
 
+// Determine whether the gVCF has an index (CSI for BCF; tabix or CSI for
+// bgzipped VCF), and if so, the contigs with records according to it
+static bool indexed_contigs(vcfFile* fp, const bcf_hdr_t* hdr, const string& filename,
+                            vector<int>& rids) {
+    rids.clear();
+    const htsFormat* fmt = hts_get_format(fp);
+    hts_idx_t* idx = nullptr;
+    tbx_t* tbx = nullptr;
+    const char** names = nullptr;
+    int n = 0;
+    if (fmt->format == bcf && (idx = bcf_index_load(filename.c_str()))) {
+        names = bcf_index_seqnames(idx, hdr, &n);
+    } else if (fmt->format == vcf && fmt->compression == bgzf && (tbx = tbx_index_load(filename.c_str()))) {
+        names = tbx_seqnames(tbx, &n);
+    } else {
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        int rid = bcf_hdr_name2id(hdr, names[i]);
+        if (rid >= 0) {
+            rids.push_back(rid);
+        }
+    }
+    free(names);
+    if (idx) hts_idx_destroy(idx);
+    if (tbx) tbx_destroy(tbx);
+    sort(rids.begin(), rids.end());
+    return true;
+}
+
+// Divide the import of an indexed gVCF into chunks: the contigs with records
+// (and overlapping the range filter, if any), split at bucket boundaries into
+// pieces of similar length, numbering somewhat more than target. When
+// compacting reference bands, the contigs aren't split, since the compacted
+// bands dangling across the split points couldn't be reproduced.
+static void plan_import_chunks(const BCFBucketRange& rangeHelper,
+                               const vector<pair<string,size_t>>& contigs,
+                               const vector<int>& rids,
+                               const vector<range>& filter,
+                               bool split_contigs,
+                               size_t target,
+                               vector<range>& chunks) {
+    chunks.clear();
+    vector<int> chunk_rids;
+    size_t total = 0;
+    for (int rid : rids) {
+        if (rid < contigs.size() && contigs[rid].second > 0 &&
+            (filter.empty() || overlaps_any(filter, range(rid, 0, contigs[rid].second)))) {
+            chunk_rids.push_back(rid);
+            total += contigs[rid].second;
+        }
+    }
+    for (int rid : chunk_rids) {
+        const size_t contig_len = contigs[rid].second;
+        const size_t len = rangeHelper.interval_len_of(rid);
+        size_t chunk_len = std::numeric_limits<int>::max();
+        if (split_contigs && target > 0) {
+            chunk_len = std::max((total/target + len - 1) / len * len, len);
+        }
+        for (size_t beg = 0; beg < contig_len; beg += chunk_len) {
+            chunks.push_back(range(rid, beg, std::min(beg + chunk_len, contig_len)));
+        }
+    }
+}
+
+// Inflate the gVCF's BGZF blocks on the import's shared htslib thread pool,
+// if any, rather than on the reading thread
+static void use_hts_pool(vcfFile* vcf, const BCFKeyValueData::import_options& opts) {
+    if (opts.hts_pool) {
+        hts_set_opt(vcf, HTS_OPT_THREAD_POOL, opts.hts_pool);
+    }
+}
+
+// Ingest one chunk of an indexed gVCF, reading it through a private file
+// handle (and header). Aborts, setting header_grew, if the VCF has undeclared
+// INFO/FORMAT fields; the chunks' headers would then encode them
+// inconsistently.
+static Status ingest_gvcf_chunk(BCFBucketRange& rangeHelper,
+                                MetadataCache& metadata,
+                                KeyValue::DB* db,
+                                const string& dataset_key,
+                                const string& filename,
+                                const vector<range>& filter,
+                                const range& chunk,
+                                const sample_tile* tile,
+                                const BCFKeyValueData::import_options& opts,
+                                BCFKeyValueData::import_result& rslt,
+                                atomic<bool>& header_grew) {
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(filename.c_str(), "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    if (!vcf) return Status::IOError("opening gVCF file", filename);
+    use_hts_pool(vcf.get(), opts);
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    if (!hdr) return Status::IOError("reading gVCF header", filename);
+
+    // Query the chunk; or, given a range filter, its intersection with the
+    // chunk, along with the first and last positions of the chunk (to pick up
+    // the incoming danglers, and the records dangling off its end which
+    // overlap the filter only beyond it).
+    set<range> query;
+    if (filter.empty()) {
+        query.insert(chunk);
+    } else {
+        for (const auto& r : filter) {
+            auto q = r.intersect(chunk);
+            if (q) {
+                query.insert(*q);
+            }
+        }
+        query.insert(range(chunk.rid, chunk.beg, chunk.beg+1));
+        query.insert(range(chunk.rid, chunk.end-1, chunk.end));
+    }
+    GVCFImportReader reader(vcf.get(), hdr.get(), query);
+    reader.load_index(filename);
+    if (tile) {
+        reader.set_sample_subset(tile->imap);
+    }
+    Status s = ingest_gvcf_records(rangeHelper, metadata, db, dataset_key, filename,
+                                   tile ? tile->hdr.get() : hdr.get(), reader,
+                                   filter.empty() ? nullptr : &filter, chunk, opts, rslt);
+    if (s == StatusCode::ABORTED && reader.header_grew()) {
+        header_grew = true;
+    }
+    return s;
+}
+
+static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
+                                          MetadataCache& metadata,
+                                          KeyValue::DB* db,
+                                          const string& dataset_key,
+                                          const string& filename,
+                                          const set<range>& range_filter,
+                                          const bcf_hdr_t *hdr,
+                                          vcfFile *vcf,
+                                          const sample_tile* tile,
+                                          const BCFKeyValueData::import_options& opts,
+                                          BCFKeyValueData::import_result& rslt) {
+    Status s;
+
+    // import an indexed gVCF in parallel chunks, if so configured
+    vector<int> rids;
+    vector<range> chunks;
+    if (opts.pool && opts.pool->size() > 1 && indexed_contigs(vcf, hdr, filename, rids)) {
+        vector<range> filter = merge_ranges(range_filter);
+        plan_import_chunks(rangeHelper, metadata.contigs(), rids, filter, !opts.compact_ref_bands,
+                           4*opts.pool->size(), chunks);
+        if (chunks.size() > 1) {
+            vector<BCFKeyValueData::import_result> rslts(chunks.size());
+            vector<future<Status>> statuses;
+            atomic<bool> abort(false), header_grew(false);
+            for (size_t i = 0; i < chunks.size(); i++) {
+                statuses.push_back(opts.pool->push([&, i](int tid) {
+                    if (abort) {
+                        return Status::Aborted();
+                    }
+                    Status ls = ingest_gvcf_chunk(rangeHelper, metadata, db, dataset_key, filename,
+                                                  filter, chunks[i], tile, opts, rslts[i], header_grew);
+                    if (ls.bad()) {
+                        abort = true;
+                    }
+                    return ls;
+                }));
+            }
+            // record the first error, if any, other than an abort
+            // precipitated by another chunk's error
+            s = Status::OK();
+            for (size_t i = 0; i < chunks.size(); i++) {
+                Status s_i(statuses[i].get());
+                if (s_i.bad() && (s.ok() || (s == StatusCode::ABORTED && s_i != StatusCode::ABORTED))) {
+                    s = move(s_i);
+                }
+            }
+            if (!header_grew || s != StatusCode::ABORTED) {
+                for (const auto& rslt_i : rslts) {
+                    rslt += rslt_i;
+                }
+                return s;
+            }
+            // Fall back to importing the file sequentially, which will
+            // overwrite all the buckets written by the chunks (the set of
+            // buckets depending only on the records' ranges).
+        }
+    }
+
+    // otherwise scan the records sequentially, parsing them ahead if so
+    // configured
+    {
+        GVCFImportReader reader(vcf, hdr, range_filter);
+        reader.load_index(filename);
+        if (tile) {
+            reader.set_sample_subset(tile->imap);
+        }
+        if (!opts.parse_ahead || !reader.parse_ahead(opts.parse_ahead)) {
+            return ingest_gvcf_records(rangeHelper, metadata, db, dataset_key, filename,
+                                       tile ? tile->hdr.get() : hdr, reader,
+                                       nullptr, range(-1,-1,-1), opts, rslt);
+        }
+        BCFKeyValueData::import_result ahead_rslt;
+        s = ingest_gvcf_records(rangeHelper, metadata, db, dataset_key, filename,
+                                tile ? tile->hdr.get() : hdr, reader,
+                                nullptr, range(-1,-1,-1), opts, ahead_rslt);
+        if (s != StatusCode::ABORTED || !reader.header_grew()) {
+            rslt += ahead_rslt;
+            return s;
+        }
+    }
+    // The gVCF has INFO/FORMAT fields undeclared in its header, which the
+    // records parsed ahead encode inconsistently with our header. Import it
+    // again from the top without parsing ahead, through a new file handle,
+    // overwriting the buckets written so far (as above for the chunks).
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf2(bcf_open(filename.c_str(), "r"),
+                                                [](vcfFile* f) { bcf_close(f); });
+    if (!vcf2) return Status::IOError("opening gVCF file", filename);
+    use_hts_pool(vcf2.get(), opts);
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr2(bcf_hdr_read(vcf2.get()), &bcf_hdr_destroy);
+    if (!hdr2) return Status::IOError("reading gVCF header", filename);
+    // (reading the records with our header, which thus grows as usual)
+    GVCFImportReader reader(vcf2.get(), hdr, range_filter);
+    reader.load_index(filename);
+    if (tile) {
+        reader.set_sample_subset(tile->imap);
+    }
+    return ingest_gvcf_records(rangeHelper, metadata, db, dataset_key, filename,
+                               tile ? tile->hdr.get() : hdr, reader,
+                               nullptr, range(-1,-1,-1), opts, rslt);
+}
+
 
 // Temporary notes on DB schema, to be moved over to wiki.
 //
@@ -1014,21 +3093,77 @@ static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
 //       for each dataset, there is a header stored
 //  sample -> dataset
 //       mapping from sample to dataset, each dataset can store multiple samples.
+//  dictionary
+//       the IDs of the samples and datasets (see dictionary_collection).
 //
+// The datasets (sample tiles) into which a gVCF with nsamples samples is
+// divided upon import, if any
+static vector<string> sample_tile_datasets(const string& dataset, size_t nsamples,
+                                           const BCFKeyValueData::import_options& opts) {
+    vector<string> ans;
+    if (opts.sample_tile_size && nsamples > opts.sample_tile_size) {
+        for (size_t i = 0; i*opts.sample_tile_size < nsamples; i++) {
+            ans.push_back(dataset + ".tile" + to_string(i));
+        }
+    }
+    return ans;
+}
+
+// Assign consecutive IDs to the given numbers of new data sets and samples,
+// persisting the dictionary's counters. The caller must hold body_->mutex.
+static Status assign_ids(BCFKeyValueData_body *body_, size_t ndatasets, size_t nsamples,
+                         uint32_t& first_dataset_id, uint32_t& first_sample_id) {
+    const uint64_t max_id = std::numeric_limits<uint32_t>::max();
+    if (body_->next_dataset_id + ndatasets > max_id || body_->next_sample_id + nsamples > max_id) {
+        return Status::Invalid("BCFKeyValueData: data set or sample IDs exhausted");
+    }
+    Status s;
+    KeyValue::CollectionHandle coll;
+    S(body_->db->collection(dictionary_collection, coll));
+    unique_ptr<KeyValue::WriteBatch> wb;
+    S(body_->db->begin_writes(wb));
+    S(wb->put(coll, "#datasets", to_string(body_->next_dataset_id + ndatasets)));
+    S(wb->put(coll, "#samples", to_string(body_->next_sample_id + nsamples)));
+    S(wb->commit());
+    first_dataset_id = body_->next_dataset_id;
+    first_sample_id = body_->next_sample_id;
+    body_->next_dataset_id += ndatasets;
+    body_->next_sample_id += nsamples;
+    return Status::OK();
+}
+
+Status BCFKeyValueData::reserve_dataset_ids(const vector<string>& datasets) {
+    Status s;
+    std::lock_guard<std::mutex> lock(body_->mutex);
+    if (!body_->dictionary || datasets.empty()) {
+        return Status::OK();
+    }
+    uint32_t first_dataset_id = 0, first_sample_id = 0;
+    S(assign_ids(body_.get(), datasets.size(), 0, first_dataset_id, first_sample_id));
+    for (size_t i = 0; i < datasets.size(); i++) {
+        body_->reserved_dataset_ids[datasets[i]] = first_dataset_id + i;
+    }
+    return Status::OK();
+}
+
 static Status import_gvcf_inner(BCFKeyValueData_body *body_,
                                 MetadataCache& metadata,
                                 const string& dataset,
                                 const string& filename,
                                 const set<range>& range_filter,
+                                const BCFKeyValueData::import_options& opts,
                                 BCFKeyValueData::import_result& rslt) {
     Status s;
     unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(filename.c_str(), "r"),
                                                [](vcfFile* f) { bcf_close(f); });
     if (!vcf) return Status::IOError("opening gVCF file", filename);
+    use_hts_pool(vcf.get(), opts);
     unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
 
     S(vcf_validate_basic_facts(metadata, dataset, filename, hdr.get(), vcf.get(),
                                rslt.samples));
+    vector<string> tile_datasets = sample_tile_datasets(dataset, rslt.samples.size(), opts);
+    uint32_t first_dataset_id = 0, first_sample_id = 0;
 
     // Atomically verify metadata and prepare
     {
@@ -1036,36 +3171,122 @@ static Status import_gvcf_inner(BCFKeyValueData_body *body_,
 
         // verify uniqueness of data set and samples
         S(verify_dataset_and_samples(body_, metadata, dataset, filename, rslt.samples));
+        for (const auto& tile_dataset : tile_datasets) {
+            S(verify_dataset_and_samples(body_, metadata, tile_dataset, filename, {}));
+        }
 
         // Make sure dataset and samples are not being added by another thread/user
         if (body_->amd.datasets.count(dataset) > 0)
             return Status::Exists("data set is currently being added; each input gVCF should have a unique filename",
                                   dataset + " (" + filename + ")");
+        for (const auto& tile_dataset : tile_datasets)
+            if (body_->amd.datasets.count(tile_dataset) > 0)
+                return Status::Exists("data set is currently being added; each input gVCF should have a unique filename",
+                                      tile_dataset + " (" + filename + ")");
 
         for (const auto& sample : rslt.samples)
             if (body_->amd.samples.count(sample) > 0)
                 return Status::Exists("sample is currently being added; each input gVCF should have a unique sample name (header column #10)",
                                       sample + " (" + filename + ")");
 
+        // Assign the IDs of the new data set(s) and samples, taking the data
+        // set's reserved ID, if any. Since the buckets are keyed by data set
+        // ID, the counters are updated right away; IDs assigned to an import
+        // which then fails go unused.
+        if (body_->dictionary) {
+            auto reserved = body_->reserved_dataset_ids.find(dataset);
+            if (reserved != body_->reserved_dataset_ids.end() && tile_datasets.empty()) {
+                uint32_t unused;
+                S(assign_ids(body_, 0, rslt.samples.size(), unused, first_sample_id));
+                first_dataset_id = reserved->second;
+            } else {
+                S(assign_ids(body_, max(tile_datasets.size(), (size_t) 1), rslt.samples.size(),
+                             first_dataset_id, first_sample_id));
+            }
+            if (reserved != body_->reserved_dataset_ids.end()) {
+                body_->reserved_dataset_ids.erase(reserved);
+            }
+        }
+
         // Add to active MD
         body_->amd.add(dataset, rslt.samples);
+        for (const auto& tile_dataset : tile_datasets)
+            body_->amd.datasets.insert(tile_dataset);
+    }
+    // the bucket key suffix of the i'th dataset (tile)
+    auto dataset_key = [&](size_t i) -> string {
+        if (body_->dictionary) {
+            return encode_id(first_dataset_id + i);
+        }
+        return tile_datasets.empty() ? dataset : tile_datasets[i];
+    };
+
+    // Prepare the sample tiles, if any: the header subset to each tile's
+    // consecutive samples
+    vector<sample_tile> tiles;
+    const size_t nsamples = bcf_hdr_nsamples(hdr.get());
+    for (size_t i = 0; i < tile_datasets.size(); i++) {
+        sample_tile tile;
+        tile.dataset = tile_datasets[i];
+        vector<char*> tile_samples;
+        for (size_t j = i*opts.sample_tile_size; j < nsamples && j < (i+1)*opts.sample_tile_size; j++) {
+            tile_samples.push_back(hdr->samples[j]);
+        }
+        tile.imap.resize(tile_samples.size());
+        tile.hdr.reset(bcf_hdr_subset(hdr.get(), tile_samples.size(), tile_samples.data(), tile.imap.data()),
+                       &bcf_hdr_destroy);
+        if (!tile.hdr) {
+            return Status::Failure("bcf_hdr_subset", filename);
+        }
+        // the records will be encoded with the gVCF header's dictionary
+        if (tile.hdr->n[BCF_DT_ID] != hdr->n[BCF_DT_ID]) {
+            return Status::Invalid("gVCF header can't be divided into sample tiles", filename);
+        }
+        tiles.push_back(move(tile));
     }
 
     // bulk insert, non atomic
     //
     // Note: we are not dealing at all with mid-flight failures
-    S(bulk_insert_gvcf_key_values(*body_->rangeHelper, metadata, body_->db,
-                                  dataset, filename, range_filter,
-                                  hdr.get(), vcf.get(), rslt));
+    if (tiles.empty()) {
+        S(bulk_insert_gvcf_key_values(*body_->rangeHelper, metadata, body_->db,
+                                      dataset_key(0), filename, range_filter,
+                                      hdr.get(), vcf.get(), nullptr, opts, rslt));
+    } else {
+        // read through the gVCF once for each tile
+        for (size_t i = 0; i < tiles.size(); i++) {
+            unique_ptr<vcfFile, void(*)(vcfFile*)> tile_vcf(nullptr, [](vcfFile* f) { bcf_close(f); });
+            unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> tile_vcf_hdr(nullptr, &bcf_hdr_destroy);
+            if (i > 0) {
+                tile_vcf.reset(bcf_open(filename.c_str(), "r"));
+                if (!tile_vcf) return Status::IOError("opening gVCF file", filename);
+                use_hts_pool(tile_vcf.get(), opts);
+                tile_vcf_hdr.reset(bcf_hdr_read(tile_vcf.get()));
+                if (!tile_vcf_hdr) return Status::IOError("reading gVCF header", filename);
+            }
+            BCFKeyValueData::import_result tile_rslt;
+            S(bulk_insert_gvcf_key_values(*body_->rangeHelper, metadata, body_->db,
+                                          dataset_key(i), filename, range_filter,
+                                          i > 0 ? tile_vcf_hdr.get() : hdr.get(),
+                                          i > 0 ? tile_vcf.get() : vcf.get(),
+                                          &tiles[i], opts, tile_rslt));
+            if (i == 0) {
+                rslt += tile_rslt;
+            } else {
+                // each tile reads the same gVCF records into its own
+                // buckets, so only count the records once
+                rslt.bytes += tile_rslt.bytes;
+                rslt.max_bytes = max(rslt.max_bytes, tile_rslt.max_bytes);
+                rslt.buckets += tile_rslt.buckets;
+            }
+        }
+    }
 
     // Update metadata atomically, now it will point to all the data
     Status retval = Status::Invalid();
     {
         std::lock_guard<std::mutex> lock(body_->mutex);
 
-        // Serialize header into a string
-        string hdr_data = bcf_write_header(hdr.get());
-
         // Get collection handles and current * sample set version number
         KeyValue::CollectionHandle coll_header, coll_sample_dataset, coll_sampleset;
         S(body_->db->collection("header", coll_header));
@@ -1075,26 +3296,63 @@ static Status import_gvcf_inner(BCFKeyValueData_body *body_,
         S(body_->db->get(coll_sampleset, "*", version_str));
         uint64_t version = strtoull(version_str.c_str(), nullptr, 10);
 
-        // Store header and metadata (with updated version number)
+        // Store header(s) and metadata (with updated version number)
         unique_ptr<KeyValue::WriteBatch> wb;
         S(body_->db->begin_writes(wb));
-        S(wb->put(coll_header, dataset, hdr_data));
-        for (const auto& sample : rslt.samples) {
+        map<string,string> sample_datasets, templates;
+        if (tiles.empty()) {
+            S(put_dataset_header(body_->db, *wb, coll_header, dataset, hdr.get(), templates));
+            for (const auto& sample : rslt.samples) {
+                sample_datasets[sample] = dataset;
+            }
+        } else {
+            for (const auto& tile : tiles) {
+                S(put_dataset_header(body_->db, *wb, coll_header, tile.dataset, tile.hdr.get(), templates));
+                for (int j = 0; j < bcf_hdr_nsamples(tile.hdr.get()); j++) {
+                    sample_datasets[tile.hdr->samples[j]] = tile.dataset;
+                }
+            }
+            assert(sample_datasets.size() == rslt.samples.size());
+        }
+        for (const auto& p : sample_datasets) {
             // place an entry for this sample in the special "*" sample set
-            S(wb->put(coll_sample_dataset, sample, dataset));
-            string key = "*" + string(1,'\0') + sample;
-            assert(key.size() == sample.size()+2);
+            S(wb->put(coll_sample_dataset, p.first, p.second));
+            string key = "*" + string(1,'\0') + p.first;
+            assert(key.size() == p.first.size()+2);
             S(wb->put(coll_sampleset, key, string()));
         }
+        // record the IDs in the dictionary
+        if (body_->dictionary) {
+            KeyValue::CollectionHandle coll_dictionary;
+            S(body_->db->collection(dictionary_collection, coll_dictionary));
+            vector<string> datasets = tile_datasets;
+            if (datasets.empty()) {
+                datasets.push_back(dataset);
+            }
+            for (size_t i = 0; i < datasets.size(); i++) {
+                string id = encode_id(first_dataset_id + i);
+                S(wb->put(coll_dictionary, "d" + datasets[i], id));
+                S(wb->put(coll_dictionary, "D" + id, datasets[i]));
+            }
+            uint32_t sample_id = first_sample_id;
+            for (const auto& sample : rslt.samples) {
+                string id = encode_id(sample_id++);
+                S(wb->put(coll_dictionary, "s" + sample, id));
+                S(wb->put(coll_dictionary, "S" + id, sample));
+            }
+        }
         // update the * sample set version number
         S(wb->put(coll_sampleset, "*", to_string(version+1)));
 
         // Remove from active metadata
         body_->amd.erase(dataset, rslt.samples);
+        for (const auto& tile_dataset : tile_datasets)
+            body_->amd.datasets.erase(tile_dataset);
 
         retval = wb->commit();
         if (retval.ok()) {
             body_->sample_count += rslt.samples.size();
+            atomic_store(&body_->snapshot, shared_ptr<const MetadataSnapshot>());
         }
     }
 
@@ -1106,7 +3364,8 @@ Status BCFKeyValueData::import_gvcf(MetadataCache& metadata,
                                     const string& dataset,
                                     const string& filename,
                                     const set<range>& range_filter,
-                                    import_result& rslt) {
+                                    import_result& rslt,
+                                    const import_options& opts) {
     rslt = import_result(); // hygiene
 
     if (!regex_match(dataset, regex_id)) {
@@ -1118,16 +3377,329 @@ Status BCFKeyValueData::import_gvcf(MetadataCache& metadata,
                                  dataset,
                                  filename,
                                  range_filter,
+                                 opts,
                                  rslt);
 
     if (!s.ok()) {
         // We had a failure, remove from the active metadata
         std::lock_guard<std::mutex> lock(body_->mutex);
         body_->amd.erase(dataset, rslt.samples);
+        for (const auto& tile_dataset : sample_tile_datasets(dataset, rslt.samples.size(), opts))
+            body_->amd.datasets.erase(tile_dataset);
+    }
+
+    return s;
+}
+
+
+// Read all the entries of a collection (of modest size) into a map
+static Status collection_entries(KeyValue::DB* db, const string& collection, map<string,string>& ans) {
+    Status s;
+    KeyValue::CollectionHandle coll;
+    S(db->collection(collection, coll));
+    unique_ptr<KeyValue::Iterator> it;
+    S(db->iterator(coll, "", it));
+    ans.clear();
+    while (it->valid()) {
+        ans[it->key().str()] = it->value().str();
+        S(it->next());
+    }
+    return Status::OK();
+}
+
+Status BCFKeyValueData::merge_database(MetadataCache& metadata, BCFKeyValueData& src,
+                                       merge_result& rslt) {
+    Status s;
+    rslt = merge_result(); // hygiene
+    BCFKeyValueData_body& src_body = *src.body_;
+
+    // the databases must have the same contigs and bucket lengths, so that
+    // the source's buckets can be copied as they are
+    vector<pair<string,size_t>> my_contigs, src_contigs;
+    S(contigs(my_contigs));
+    S(src.contigs(src_contigs));
+    if (my_contigs != src_contigs) {
+        return Status::Invalid("BCFKeyValueData::merge_database: the databases have different contigs");
+    }
+    for (int rid = 0; rid < (int) my_contigs.size(); rid++) {
+        if (body_->rangeHelper->interval_len_of(rid) != src_body.rangeHelper->interval_len_of(rid)) {
+            return Status::Invalid("BCFKeyValueData::merge_database: the databases have different bucket lengths",
+                                   my_contigs[rid].first);
+        }
+    }
+    if (body_->variants_index && !src_body.variants_index) {
+        return Status::Invalid("BCFKeyValueData::merge_database: source database lacks the variant record index");
+    }
+
+    // read the source's metadata: data set headers, sample -> data set, and
+    // the samples of its named sample sets (not the "*" ones, which are
+    // derived from the others)
+    map<string,string> src_header_entries, src_sample_datasets, src_sampleset_entries;
+    S(collection_entries(src_body.db, "header", src_header_entries));
+    S(collection_entries(src_body.db, "sample_dataset", src_sample_datasets));
+    S(collection_entries(src_body.db, "sampleset", src_sampleset_entries));
+    map<string,set<string>> src_samplesets;
+    for (const auto& p : src_sampleset_entries) {
+        const string& key = p.first;
+        if (key.empty() || key[0] == '*') {
+            continue;
+        }
+        size_t nullpos = key.find('\0');
+        if (nullpos == string::npos) {
+            src_samplesets[key];
+        } else {
+            src_samplesets[key.substr(0, nullpos)].insert(key.substr(nullpos+1));
+        }
+    }
+    map<string,shared_ptr<const bcf_hdr_t>> src_headers;
+    for (const auto& p : src_header_entries) {
+        if (!p.first.empty() && p.first[0] == header_template_prefix) {
+            continue;
+        }
+        S(src.dataset_header(p.first, &src_headers[p.first]));
+    }
+    src_header_entries.clear();
+    map<string,set<string>> dataset_samples;
+    for (const auto& p : src_sample_datasets) {
+        rslt.samples.insert(p.first);
+        dataset_samples[p.second].insert(p.first);
+    }
+
+    // The source data sets in the order of their bucket keys. Assigning their
+    // IDs here in the same order keeps the copied buckets in key order, for
+    // efficient sorted writes.
+    vector<pair<string,string>> src_datasets; // (source bucket key suffix, data set)
+    for (const auto& p : src_headers) {
+        string key;
+        S(lookup_dataset_key(src_body, p.first, key));
+        src_datasets.push_back(make_pair(key, p.first));
+        rslt.datasets.insert(p.first);
+    }
+    sort(src_datasets.begin(), src_datasets.end());
+
+    // Atomically verify that the data sets and samples are new here, and
+    // assign their IDs
+    map<string,string> dataset_keys; // source bucket key suffix -> ours
+    set<string> new_samplesets;
+    uint32_t first_dataset_id = 0, first_sample_id = 0;
+    {
+        std::lock_guard<std::mutex> lock(body_->mutex);
+        for (const auto& p : src_datasets) {
+            S(verify_dataset_and_samples(body_.get(), metadata, p.second, "merged database",
+                                         dataset_samples[p.second]));
+            if (body_->amd.datasets.count(p.second) > 0) {
+                return Status::Exists("BCFKeyValueData::merge_database: data set is currently being added", p.second);
+            }
+        }
+        for (const auto& sample : rslt.samples) {
+            if (body_->amd.samples.count(sample) > 0) {
+                return Status::Exists("BCFKeyValueData::merge_database: sample is currently being added", sample);
+            }
+        }
+        // a named sample set already here must have the same samples
+        for (const auto& p : src_samplesets) {
+            shared_ptr<const set<string>> samples;
+            s = metadata.sampleset_samples(p.first, samples);
+            if (s.ok()) {
+                if (*samples != p.second) {
+                    return Status::Exists("BCFKeyValueData::merge_database: the databases have different sample sets of the same name",
+                                          p.first);
+                }
+            } else if (s == StatusCode::NOT_FOUND) {
+                new_samplesets.insert(p.first);
+            } else {
+                return s;
+            }
+        }
+
+        if (body_->dictionary) {
+            S(assign_ids(body_.get(), src_datasets.size(), rslt.samples.size(),
+                         first_dataset_id, first_sample_id));
+        }
+        for (size_t i = 0; i < src_datasets.size(); i++) {
+            dataset_keys[src_datasets[i].first] = body_->dictionary ? encode_id(first_dataset_id + i)
+                                                                     : src_datasets[i].second;
+            body_->amd.datasets.insert(src_datasets[i].second);
+        }
+        for (const auto& sample : rslt.samples) {
+            body_->amd.samples.insert(sample);
+        }
+    }
+
+    // Copy the buckets, rewriting just the data set part of their keys. The
+    // keys order by bucket, then data set, so each collection is a sorted
+    // stream, written straight to storage if the database supports it.
+    auto copy_buckets = [&](BulkInsertBuffer& buf) {
+        Status s;
+        vector<string> colls = { "bcf" };
+        if (body_->variants_index) {
+            colls.push_back(variants_collection);
+        }
+        for (const auto& collnm : colls) {
+            KeyValue::CollectionHandle src_coll, coll;
+            S(src_body.db->collection(collnm, src_coll));
+            S(body_->db->collection(collnm, coll));
+            unique_ptr<KeyValue::Iterator> it;
+            S(src_body.db->iterator(src_coll, "", it));
+            string bucket, dataset_key;
+            while (it->valid()) {
+                S(src_body.rangeHelper->parse_key(it->key().str(), bucket, dataset_key));
+                auto p = dataset_keys.find(dataset_key);
+                if (p == dataset_keys.end()) {
+                    return Status::Invalid("BCFKeyValueData::merge_database: source bucket of an unknown data set");
+                }
+                auto value = it->value();
+                S(buf.put(coll, body_->rangeHelper->bucket_key(bucket, p->second),
+                          string(value.data, value.size)));
+                if (collnm == "bcf") {
+                    rslt.buckets++;
+                    rslt.bytes += value.size;
+                }
+                S(it->next());
+            }
+        }
+        return Status::OK();
+    };
+    {
+        BulkInsertBuffer buf(*body_->db, true);
+        s = copy_buckets(buf);
+        Status s_flush = buf.flush();
+        if (s.ok()) {
+            s = s_flush;
+        }
     }
 
+    // Update the metadata atomically, to point to all the data, as in
+    // import_gvcf
+    std::lock_guard<std::mutex> lock(body_->mutex);
+    auto commit_metadata = [&]() {
+        Status s;
+        KeyValue::CollectionHandle coll_header, coll_sample_dataset, coll_sampleset;
+        S(body_->db->collection("header", coll_header));
+        S(body_->db->collection("sample_dataset", coll_sample_dataset));
+        S(body_->db->collection("sampleset", coll_sampleset));
+        string version_str;
+        S(body_->db->get(coll_sampleset, "*", version_str));
+        uint64_t version = strtoull(version_str.c_str(), nullptr, 10);
+
+        unique_ptr<KeyValue::WriteBatch> wb;
+        S(body_->db->begin_writes(wb));
+        map<string,string> templates;
+        for (const auto& p : src_headers) {
+            S(put_dataset_header(body_->db, *wb, coll_header, p.first, p.second.get(), templates));
+        }
+        for (const auto& p : src_sample_datasets) {
+            S(wb->put(coll_sample_dataset, p.first, p.second));
+            S(wb->put(coll_sampleset, "*" + string(1,'\0') + p.first, string()));
+        }
+        for (const auto& sampleset : new_samplesets) {
+            S(wb->put(coll_sampleset, sampleset, string()));
+            for (const auto& sample : src_samplesets[sampleset]) {
+                S(wb->put(coll_sampleset, sampleset + string(1,'\0') + sample, string()));
+            }
+        }
+        if (body_->dictionary) {
+            KeyValue::CollectionHandle coll_dictionary;
+            S(body_->db->collection(dictionary_collection, coll_dictionary));
+            for (const auto& p : src_datasets) {
+                const string& id = dataset_keys[p.first];
+                S(wb->put(coll_dictionary, "d" + p.second, id));
+                S(wb->put(coll_dictionary, "D" + id, p.second));
+            }
+            uint32_t sample_id = first_sample_id;
+            for (const auto& sample : rslt.samples) {
+                string id = encode_id(sample_id++);
+                S(wb->put(coll_dictionary, "s" + sample, id));
+                S(wb->put(coll_dictionary, "S" + id, sample));
+            }
+        }
+        S(wb->put(coll_sampleset, "*", to_string(version+1)));
+        return wb->commit();
+    };
+    if (s.ok()) {
+        s = commit_metadata();
+    }
+    if (s.ok()) {
+        body_->sample_count += rslt.samples.size();
+        atomic_store(&body_->snapshot, shared_ptr<const MetadataSnapshot>());
+    }
+    for (const auto& p : src_datasets) {
+        body_->amd.datasets.erase(p.second);
+    }
+    for (const auto& sample : rslt.samples) {
+        body_->amd.samples.erase(sample);
+    }
     return s;
 }
 
+Status BCFKeyValueData::write_metadata_snapshot() {
+    if (!body_->dictionary) {
+        return Status::NotImplemented("database predates the ID dictionary");
+    }
+
+    // create the current all-samples sample set, so that it's in the snapshot
+    Status s;
+    string all_samples;
+    S(all_samples_sampleset(all_samples));
+
+    // read the metadata, holding the mutex so that no import commits meanwhile
+    std::lock_guard<std::mutex> lock(body_->mutex);
+    map<string,string> dictionary, sample_datasets, sampleset_entries;
+    S(collection_entries(body_->db, dictionary_collection, dictionary));
+    S(collection_entries(body_->db, "sample_dataset", sample_datasets));
+    S(collection_entries(body_->db, "sampleset", sampleset_entries));
+
+    auto version = sampleset_entries.find("*");
+    if (version == sampleset_entries.end()) {
+        return Status::NotFound("BCFKeyValueData::write_metadata_snapshot: improperly initialized database");
+    }
+    map<string,vector<string>> samplesets;
+    for (const auto& p : sampleset_entries) {
+        size_t nullpos = p.first.find('\0');
+        string sampleset = p.first.substr(0, nullpos);
+        if (sampleset == "*") {
+            continue;
+        }
+        auto& members = samplesets[sampleset];
+        if (nullpos != string::npos) {
+            members.push_back(p.first.substr(nullpos+1));
+        }
+    }
+    map<string,uint32_t> datasets;
+    map<string,pair<uint32_t,string>> samples;
+    for (const auto& p : dictionary) {
+        uint32_t id;
+        if (p.first.size() > 1 && (p.first[0] == 's' || p.first[0] == 'd')) {
+            S(decode_id(p.second, id));
+            if (p.first[0] == 'd') {
+                datasets[p.first.substr(1)] = id;
+            } else {
+                string sample = p.first.substr(1);
+                auto dataset = sample_datasets.find(sample);
+                if (dataset == sample_datasets.end()) {
+                    return Status::Invalid("BCFKeyValueData::write_metadata_snapshot: sample has no data set", sample);
+                }
+                samples[sample] = make_pair(id, dataset->second);
+            }
+        }
+    }
+
+    string data;
+    S(MetadataSnapshot::Write(strtoull(version->second.c_str(), nullptr, 10),
+                              body_->next_sample_id, body_->next_dataset_id,
+                              samples, datasets, samplesets, data));
+    KeyValue::CollectionHandle coll;
+    S(body_->db->collection("config", coll));
+    S(body_->db->put(coll, metadata_snapshot_key, data));
+
+    // use it from now on
+    shared_ptr<KeyValue::Data> stored;
+    S(body_->db->get0(coll, metadata_snapshot_key, stored));
+    unique_ptr<MetadataSnapshot> snapshot;
+    S(MetadataSnapshot::Read(stored, snapshot));
+    atomic_store(&body_->snapshot, shared_ptr<const MetadataSnapshot>(move(snapshot)));
+    return Status::OK();
+}
+
 
 } // namespace GLnexus
@@ -11,8 +11,28 @@ const uint64_t MAX_NUM_CONTIGS_PER_GVCF = 16777216; // 3 bytes wide
 const uint64_t MAX_CONTIG_LEN = 1099511627776;      // 5 bytes wide
 const uint64_t MAX_RECORD_LEN = 100000;
 
+// BCFBucket format version written on import (see defs.capnp)
+const uint16_t BCF_BUCKET_FORMAT_VERSION = 2;
+
 namespace GLnexus {
 
+// Encode a sample or data set ID (see Metadata::dataset_id) in database keys
+// and values: four bytes big-endian, so that keys order by ID
+inline std::string encode_id(uint32_t id) {
+    uint32_t id_be = htobe32(id);
+    return std::string((const char*)&id_be, 4);
+}
+
+inline Status decode_id(const std::string& bytes, uint32_t& ans) {
+    if (bytes.size() != 4) {
+        return Status::Invalid("Corrupt database; bad ID", std::to_string(bytes.size()) + " bytes");
+    }
+    uint32_t id_be;
+    memcpy(&id_be, bytes.data(), 4);
+    ans = be32toh(id_be);
+    return Status::OK();
+}
+
 // Memory efficient representation of a bucket range. This could
 // be turned into a standard C++ iterator, although, that might be
 // a bit of an overkill.
@@ -69,12 +89,24 @@ private:
     BCFBucketRange(const BCFBucketRange&);
     BCFBucketRange& operator=(const BCFBucketRange&);
 
+    // bucket length of each contig, if they vary (otherwise empty)
+    std::vector<int> contig_interval_lens_;
+
 public:
     static const size_t PREFIX_LENGTH = 8;
     int interval_len;
 
     // constructor
-    BCFBucketRange(int interval_len) : interval_len(interval_len) {};
+    BCFBucketRange(int interval_len, const std::vector<int>& contig_interval_lens = {})
+        : contig_interval_lens_(contig_interval_lens), interval_len(interval_len) {};
+
+    // The bucket length on the given contig
+    int interval_len_of(int rid) const {
+        if (rid >= 0 && rid < (int) contig_interval_lens_.size()) {
+            return contig_interval_lens_[rid];
+        }
+        return interval_len;
+    }
 
     // Given the range of a bucket, produce the key prefix for the bucket.
     // Important: the range must be exactly that of the bucket.
@@ -91,27 +123,30 @@ public:
         return string(buf, 8);
     }
 
-    // Produce the complete key for a bucket (given the prefix) in a dataset
-    std::string bucket_key(const std::string& prefix, const std::string& dataset) {
+    // Produce the complete key for a bucket (given the prefix) in a dataset.
+    // dataset_key identifies the data set: its encoded ID in databases with
+    // the ID dictionary, otherwise (in databases initialized before its
+    // introduction) its name.
+    std::string bucket_key(const std::string& prefix, const std::string& dataset_key) {
         assert(prefix.size() == PREFIX_LENGTH);
-        return prefix+dataset;
+        return prefix+dataset_key;
     }
 
-    // Same as bucket_key(bucket_prefix(rng), dataset)
+    // Same as bucket_key(bucket_prefix(rng), dataset_key)
     // Important: the range must be exactly that of the bucket.
     // BCFBucketRange::bucket below translates an arbitrary range into a
     // bucket's range.
-    std::string bucket_key(const range& rng, const std::string& dataset) {
-        return bucket_key(bucket_prefix(rng), dataset);
+    std::string bucket_key(const range& rng, const std::string& dataset_key) {
+        return bucket_key(bucket_prefix(rng), dataset_key);
     }
 
-    // Decompose the key into bucket prefix and dataset
-    Status parse_key(const string& key, string& bucket, string& dataset) {
+    // Decompose the key into bucket prefix and dataset key
+    Status parse_key(const string& key, string& bucket, string& dataset_key) {
         if (key.size() < PREFIX_LENGTH) {
             return Status::Invalid("BCFBucketRange::parse_key: key too small", key);
         }
         bucket = key.substr(0, PREFIX_LENGTH);
-        dataset = key.substr(PREFIX_LENGTH);
+        dataset_key = key.substr(PREFIX_LENGTH);
         return Status::OK();
     }
 
@@ -120,20 +155,22 @@ public:
     // query. This may be multiple buckets, even for small query ranges, to
     // account for the possibility of records spanning multiple buckets.
     std::shared_ptr<BucketExtent> scan(const range& query) {
-        return make_shared<BucketExtent>(query, interval_len);
+        return make_shared<BucketExtent>(query, interval_len_of(query.rid));
     }
 
     // Which bucket does this BCF record start in?
     range bucket(bcf1_t *rec) {
-        int bgn = (rec->pos / interval_len) * interval_len;
-        return range(rec->rid, bgn, bgn + interval_len);
+        int len = interval_len_of(rec->rid);
+        int bgn = (rec->pos / len) * len;
+        return range(rec->rid, bgn, bgn + len);
     }
     // The bucket after [rng], assuming [rng] is a bucket.
     range inc_bucket(range &rng) {
-        assert((rng.end - rng.beg) == interval_len);
+        int len = interval_len_of(rng.rid);
+        assert((rng.end - rng.beg) == len);
         return range(rng.rid,
-                     rng.beg + interval_len,
-                     rng.end + interval_len);
+                     rng.beg + len,
+                     rng.end + len);
     }
 
     // Create a ficticious bucket marking the end of a chromosome.
@@ -141,8 +178,9 @@ public:
                                  const std::vector<std::pair<std::string,size_t> >&contigs) {
         //const string &contig_name = contigs[rid].first;
         size_t contig_len = contigs[rid].second;
-        int bgn = ((contig_len / interval_len) + 2) * interval_len;
-        return range(rid, bgn, bgn + interval_len);
+        int len = interval_len_of(rid);
+        int bgn = ((contig_len / len) + 2) * len;
+        return range(rid, bgn, bgn + len);
     }
 };
 
@@ -159,11 +197,190 @@ public:
 // only if no preceding records in the bucket overlap it. Given this, the
 // scan can begin at the index indicated by the last skip index entry whose
 // beg is <= the query beg, thus 'skipping' the preceding records.
+//
+// Since format version 1, the bucket also stores columns of each record's
+// beg, end, and whether it's a variant record (vs. gVCF reference band). A
+// scan can thus filter and classify the records without touching their
+// bytes. Since version 2, the integer FORMAT fields are stored as columns
+// too (BCFFormatColumn), which BCFBucketFormatColumns splices back into the
+// records read.
+
+// Append the n values of BCF integer type at data to ans, encoded as in
+// BCFFormatColumn.values
+static void EncodeFormatColumnValues(int type, const uint8_t* data, size_t n, std::string& ans) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t x, missing, vector_end;
+        switch (type) {
+            case BCF_BT_INT8:
+                x = ((const int8_t*) data)[i];
+                missing = bcf_int8_missing; vector_end = bcf_int8_vector_end;
+                break;
+            case BCF_BT_INT16: {
+                int16_t x16;
+                memcpy(&x16, data + 2*i, 2);
+                x = x16;
+                missing = bcf_int16_missing; vector_end = bcf_int16_vector_end;
+                break;
+            }
+            default:
+                memcpy(&x, data + 4*i, 4);
+                missing = bcf_int32_missing; vector_end = bcf_int32_vector_end;
+        }
+        uint64_t code = x == missing ? 0 : x == vector_end ? 1
+                        : 2 + uint64_t((uint32_t(x) << 1) ^ uint32_t(x >> 31));
+        while (code >= 0x80) {
+            ans.push_back(char(code | 0x80));
+            code >>= 7;
+        }
+        ans.push_back(char(code));
+    }
+}
+
+// Decode n values encoded by EncodeFormatColumnValues, beginning at buf[ofs],
+// into ans (in the BCF encoding of the integer type)
+static Status DecodeFormatColumnValues(const uint8_t* buf, size_t len, size_t ofs, int type,
+                                       size_t n, std::vector<uint8_t>& ans) {
+    const int size = type == BCF_BT_INT8 ? 1 : type == BCF_BT_INT16 ? 2 : 4;
+    ans.resize(n * size);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t code = 0;
+        for (int shift = 0; ; shift += 7) {
+            if (ofs >= len || shift > 28) {
+                return Status::Invalid("BCFKeyValueData: corrupt FORMAT column values");
+            }
+            uint8_t b = buf[ofs++];
+            code |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                break;
+            }
+        }
+        int32_t x;
+        if (code < 2) {
+            x = code == 0 ? bcf_int32_missing : bcf_int32_vector_end;
+        } else {
+            code -= 2;
+            x = int32_t(uint32_t(code >> 1) ^ -uint32_t(code & 1));
+        }
+        switch (type) {
+            case BCF_BT_INT8: {
+                int8_t x8 = x == bcf_int32_missing ? bcf_int8_missing
+                            : x == bcf_int32_vector_end ? bcf_int8_vector_end : int8_t(x);
+                ans[i] = uint8_t(x8);
+                break;
+            }
+            case BCF_BT_INT16: {
+                int16_t x16 = x == bcf_int32_missing ? bcf_int16_missing
+                              : x == bcf_int32_vector_end ? bcf_int16_vector_end : int16_t(x);
+                memcpy(&ans[2*i], &x16, 2);
+                break;
+            }
+            default:
+                memcpy(&ans[4*i], &x, 4);
+        }
+    }
+    return Status::OK();
+}
+
+// Reader of a bucket's FORMAT columns (format version 2), splicing them back
+// into the records they were split from
+class BCFBucketFormatColumns {
+    struct column {
+        int32_t key;
+        capnp::BCFFormatColumn::Reader reader;
+    };
+    vector<column> columns_;
+    vector<bcf_raw_format_entry> entries_;
+    vector<vector<uint8_t>> values_;
+
+public:
+    // Check the bucket's FORMAT columns (none, before version 2)
+    Status Init(const capnp::BCFBucket::Reader& bucket) {
+        columns_.clear();
+        auto formats = bucket.getColumns().getFormats();
+        const size_t n_records = bucket.getRecords().size();
+        for (auto col : formats) {
+            auto records = col.getRecords();
+            const size_t n = records.size();
+            if (col.getPositions().size() != n || col.getTypes().size() != n ||
+                col.getWidths().size() != n || col.getOffsets().size() != n ||
+                (n && records[n-1] >= n_records)) {
+                return Status::Invalid("BCFKeyValueData: corrupt bucket FORMAT column",
+                                       std::to_string(col.getKey()));
+            }
+            columns_.push_back(column{col.getKey(), col});
+        }
+        return Status::OK();
+    }
+
+    bool empty() const noexcept { return columns_.empty(); }
+
+    // Write into ans record i of the bucket, whose stored bytes are
+    // rest[0,len), with the FORMAT fields of the columns spliced back in:
+    // those with the header IDs in the sorted format_ids, if given, otherwise
+    // all of them.
+    Status read(size_t i, const uint8_t* rest, size_t len, const std::vector<int>* format_ids,
+                vector<uint8_t>& ans) {
+        Status s;
+        if (len < 32) {
+            return Status::Invalid("BCFKeyValueData: corrupt bucket record");
+        }
+        uint32_t x7;
+        memcpy(&x7, rest + 28, 4);
+        const size_t n_sample = x7 & 0xffffff;
+
+        entries_.clear();
+        for (const auto& col : columns_) {
+            // is record i among the column's (ascending) records?
+            auto records = col.reader.getRecords();
+            size_t lo = 0, hi = records.size();
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (records[mid] < i) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            if (lo == records.size() || records[lo] != i) {
+                continue;
+            }
+            bcf_raw_format_entry entry;
+            entry.key = col.key;
+            entry.position = col.reader.getPositions()[lo];
+            entry.type = col.reader.getTypes()[lo];
+            entry.width = col.reader.getWidths()[lo];
+            entry.n_values = size_t(entry.width) * n_sample;
+            if (entry.type != BCF_BT_INT8 && entry.type != BCF_BT_INT16 && entry.type != BCF_BT_INT32) {
+                return Status::Invalid("BCFKeyValueData: corrupt bucket FORMAT column type",
+                                       std::to_string(entry.type));
+            }
+            // decode the values, if selected (otherwise data stays null,
+            // omitting the field)
+            if (!format_ids || binary_search(format_ids->begin(), format_ids->end(), (int) col.key)) {
+                if (values_.size() <= entries_.size()) {
+                    values_.resize(entries_.size() + 1);
+                }
+                auto values = col.reader.getValues();
+                S(DecodeFormatColumnValues(values.begin(), values.size(), col.reader.getOffsets()[lo],
+                                           entry.type, entry.n_values, values_[entries_.size()]));
+                entry.data = values_[entries_.size()].data();
+            }
+            entries_.push_back(entry);
+        }
+        sort(entries_.begin(), entries_.end(),
+             [](const bcf_raw_format_entry& a, const bcf_raw_format_entry& b) {
+                return a.position < b.position;
+             });
+        return bcf_raw_splice_formats(rest, len, entries_, ans);
+    }
+};
 
 class BCFBucketWriter {
     vector<vector<uint8_t>> records_;
     int rid_, last_beg_, end_;
     vector<pair<int,int>> skips_;
+    vector<int> begs_, ends_;
+    vector<bool> variant_;
 
 public:
     BCFBucketWriter()
@@ -174,11 +391,26 @@ public:
     void clear() {
         records_.clear();
         skips_.clear();
+        begs_.clear();
+        ends_.clear();
+        variant_.clear();
         rid_ = last_beg_ = end_ = -1;
     }
 
     Status add(bcf1_t* rec) {
         range rng(rec);
+        if (bcf_unpack(rec, BCF_UN_STR) != 0) {
+            return Status::IOError("BCFBucketWriter: bcf_unpack", rng.str());
+        }
+        size_t reclen = bcf_raw_calc_packed_len(rec);
+        assert(reclen > 0);
+        vector<uint8_t> buf(reclen);
+        bcf_raw_write_to_mem(rec, reclen, buf.data());
+        return add_packed(rng, !is_gvcf_ref_record(rec), move(buf));
+    }
+
+    // add an already-serialized record
+    Status add_packed(const range& rng, bool variant, vector<uint8_t> buf) {
         if (rid_ == -1) {
             rid_ = rng.rid;
         } else if (rid_ != rng.rid) {
@@ -195,26 +427,62 @@ public:
         }
         end_ = max(end_, rng.end);
 
-        size_t reclen = bcf_raw_calc_packed_len(rec);
-        assert(reclen > 0);
-        vector<uint8_t> buf(reclen);
-        bcf_raw_write_to_mem(rec, reclen, buf.data());
+        begs_.push_back(rng.beg);
+        ends_.push_back(rng.end);
+        variant_.push_back(variant);
         records_.push_back(move(buf));
         return Status::OK();
     }
 
+    // Fill ans with only the variant records of this bucket (excluding gVCF
+    // reference bands)
+    Status variants(BCFBucketWriter& ans) const {
+        Status s;
+        ans.clear();
+        for (size_t i = 0; i < records_.size(); i++) {
+            if (variant_[i]) {
+                S(ans.add_packed(range(rid_, begs_[i], ends_[i]), true, records_[i]));
+            }
+        }
+        return Status::OK();
+    }
+
     size_t get_num_entries() const {
         return records_.size();
     }
 
     Status contents(string& ans) const {
+        Status s;
+        // split the integer FORMAT fields out of the records, into a column
+        // for each field
+        struct format_column {
+            vector<uint32_t> records, widths, offsets;
+            vector<uint8_t> positions, types;
+            string values;
+        };
+        map<int32_t, format_column> format_columns;
+        vector<vector<uint8_t>> rests(records_.size());
+        vector<bcf_raw_format_entry> entries;
+        for (size_t i = 0; i < records_.size(); i++) {
+            S(bcf_raw_split_int_formats(records_[i].data(), records_[i].size(), rests[i], entries));
+            for (const auto& entry : entries) {
+                auto& col = format_columns[entry.key];
+                col.records.push_back(i);
+                col.positions.push_back(entry.position);
+                col.types.push_back(entry.type);
+                col.widths.push_back(entry.width);
+                col.offsets.push_back(col.values.size());
+                EncodeFormatColumnValues(entry.type, entry.data, entry.n_values, col.values);
+            }
+        }
+
         try {
             ::capnp::MallocMessageBuilder b;
             auto msg_b = b.initRoot<capnp::BCFBucket>();
-            auto records_b = msg_b.initRecords(records_.size());
-            for (int i = 0; i < records_.size(); i++) {
-                records_b.set(i, kj::arrayPtr((kj::byte*) records_[i].data(), records_[i].size()));
-                assert(records_b[i].begin() != nullptr); assert(records_b[i].size() == records_[i].size());
+            auto records_b = msg_b.initRecords(rests.size());
+            for (int i = 0; i < rests.size(); i++) {
+                records_b.set(i, kj::arrayPtr((kj::byte*) rests[i].data(), rests[i].size()));
+                assert(records_b[i].begin() != nullptr); assert(records_b[i].size() == rests[i].size());
             }
 
             if (skips_.size()) {
@@ -225,6 +493,37 @@ public:
                 }
             }
 
+            msg_b.setVersion(BCF_BUCKET_FORMAT_VERSION);
+            auto columns_b = msg_b.initColumns();
+            auto begs_b = columns_b.initBegs(records_.size());
+            auto ends_b = columns_b.initEnds(records_.size());
+            auto variant_b = columns_b.initVariant(records_.size());
+            for (int i = 0; i < records_.size(); i++) {
+                begs_b.set(i, begs_[i]);
+                ends_b.set(i, ends_[i]);
+                variant_b.set(i, variant_[i]);
+            }
+            auto formats_b = columns_b.initFormats(format_columns.size());
+            int k = 0;
+            for (const auto& p : format_columns) {
+                const format_column& col = p.second;
+                auto col_b = formats_b[k++];
+                col_b.setKey(p.first);
+                auto col_records_b = col_b.initRecords(col.records.size());
+                auto positions_b = col_b.initPositions(col.records.size());
+                auto types_b = col_b.initTypes(col.records.size());
+                auto widths_b = col_b.initWidths(col.records.size());
+                auto offsets_b = col_b.initOffsets(col.records.size());
+                for (size_t j = 0; j < col.records.size(); j++) {
+                    col_records_b.set(j, col.records[j]);
+                    positions_b.set(j, col.positions[j]);
+                    types_b.set(j, col.types[j]);
+                    widths_b.set(j, col.widths[j]);
+                    offsets_b.set(j, col.offsets[j]);
+                }
+                col_b.setValues(kj::arrayPtr((kj::byte*) col.values.data(), col.values.size()));
+            }
+
             auto msg_words = ::capnp::messageToFlatArray(b);
             auto msg_bytes = msg_words.asBytes();
             ans.assign((char*)msg_bytes.begin(), msg_bytes.size());
@@ -242,11 +541,18 @@ public:
                     memcpy(buf+ofs, ans.data(), ans.size());
                     ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)(buf+ofs), ans.size() / sizeof(::capnp::word)));
                     capnp::BCFBucket::Reader bucket_reader = message.getRoot<capnp::BCFBucket>();
+                    // the records as read, with their FORMAT fields spliced
+                    // back in, are the originals
                     auto records = bucket_reader.getRecords();
                     assert(records.size() == records_.size());
+                    BCFBucketFormatColumns format_columns_r;
+                    vector<uint8_t> spliced;
+                    s = format_columns_r.Init(bucket_reader);
+                    assert(s.ok());
                     for (int i = 0; i < records.size(); i++) {
-                        assert(records[i].size() == records_[i].size());
-                        assert(memcmp(records[i].begin(), records_[i].data(), records[i].size()) == 0);
+                        s = format_columns_r.read(i, records[i].begin(), records[i].size(), nullptr, spliced);
+                        assert(s.ok());
+                        assert(spliced == records_[i]);
                     }
                     auto skips = bucket_reader.getSkips();
                     assert(skips.size() == skips_.size());
@@ -254,6 +560,14 @@ public:
                         assert(skips[i].getRecordIndex() == skips_[i].first);
                         assert(skips[i].getPosBeg() == skips_[i].second);
                     }
+                    assert(bucket_reader.getVersion() == BCF_BUCKET_FORMAT_VERSION);
+                    auto columns = bucket_reader.getColumns();
+                    assert(columns.getBegs().size() == records_.size());
+                    for (int i = 0; i < records.size(); i++) {
+                        assert(columns.getBegs()[i] == begs_[i]);
+                        assert(columns.getEnds()[i] == ends_[i]);
+                        assert(columns.getVariant()[i] == variant_[i]);
+                    }
                     free(buf);
                 }
             }
@@ -301,14 +615,18 @@ static int SearchBCFBucketSkipIndex(const capnp::BCFBucket::Reader& bucket, cons
 // This is to reduce database write lock contention during intense multi-
 // threaded bulk loads, as each thread makes fewer larger inserts instead
 // of many smaller inserts.
+// If the database supports sorted writes (KeyValue::DB::begin_sorted_writes),
+// which the bucket keys of one dataset written in genomic order mostly are,
+// then everything goes into one such batch, streamed to storage until flush().
 class BulkInsertBuffer {
     const size_t LIMIT = 16777216;
     KeyValue::DB& db_;
     std::unique_ptr<KeyValue::WriteBatch> buf_;
     size_t bufsz_ = 0;
+    bool sorted_;
 
 public:
-    BulkInsertBuffer(KeyValue::DB& db) : db_(db) {}
+    BulkInsertBuffer(KeyValue::DB& db, bool sorted = false) : db_(db), sorted_(sorted) {}
     ~BulkInsertBuffer() {
         assert(!buf_);
     }
@@ -316,9 +634,17 @@ public:
     Status put(KeyValue::CollectionHandle coll, const std::string& key, const std::string& value) {
         Status s;
         size_t delta = key.size() + value.size() + 32;
-        if (bufsz_ + delta >= LIMIT) {
+        if (!sorted_ && bufsz_ + delta >= LIMIT) {
             S(flush());
         }
+        if (!buf_ && sorted_) {
+            s = db_.begin_sorted_writes(buf_);
+            if (s == StatusCode::NOT_IMPLEMENTED) {
+                sorted_ = false;
+            } else if (s.bad()) {
+                return s;
+            }
+        }
         if (!buf_) {
             S(db_.begin_writes(buf_));
         }
@@ -33,6 +33,7 @@ DEALINGS IN THE SOFTWARE.
 
 #include <assert.h>
 #include <alloca.h>
+#include <algorithm>
 #include <iostream>
 #include "BCFSerialize.h"
 using namespace std;
@@ -153,6 +154,443 @@ Status bcf_raw_range(const uint8_t *buf, int start, size_t len, range& rng) {
     return Status::OK();
 }
 
+// Size in bytes of a value of the given BCF type (BCF_BT_*), or -1 if
+// unknown
+static int raw_type_size(int type) {
+    switch (type) {
+        case BCF_BT_NULL: return 0;
+        case BCF_BT_INT8: return 1;
+        case BCF_BT_INT16: return 2;
+        case BCF_BT_INT32: return 4;
+        case BCF_BT_FLOAT: return 4;
+        case BCF_BT_CHAR: return 1;
+    }
+    return -1;
+}
+
+static Status raw_typed_int(const uint8_t *p, size_t len, size_t& ofs, int32_t& ans);
+
+// Decode the type descriptor at p[ofs], advancing ofs past it
+static Status raw_typed_size(const uint8_t *p, size_t len, size_t& ofs, int& type, int& n) {
+    Status s;
+    BOUNDS_CHECK(ofs + 1, len, "reading BCF type descriptor");
+    type = p[ofs] & 0xf;
+    n = p[ofs] >> 4;
+    ofs++;
+    if (raw_type_size(type) < 0) {
+        return Status::Invalid("BCFSerialize: unknown BCF type", to_string(type));
+    }
+    if (n == 15) {
+        int32_t n32 = 0;
+        S(raw_typed_int(p, len, ofs, n32));
+        if (n32 < 0) {
+            return Status::Invalid("BCFSerialize: negative BCF vector length");
+        }
+        n = n32;
+    }
+    return Status::OK();
+}
+
+// Decode the typed integer at p[ofs], advancing ofs past it
+static Status raw_typed_int(const uint8_t *p, size_t len, size_t& ofs, int32_t& ans) {
+    BOUNDS_CHECK(ofs + 1, len, "reading BCF typed integer");
+    int type = p[ofs] & 0xf;
+    ofs++;
+    switch (type) {
+        case BCF_BT_INT8: {
+            BOUNDS_CHECK(ofs + 1, len, "reading BCF typed integer");
+            ans = (int8_t) p[ofs];
+            ofs += 1;
+            break;
+        }
+        case BCF_BT_INT16: {
+            int16_t x;
+            BOUNDS_CHECK(ofs + 2, len, "reading BCF typed integer");
+            memcpy(&x, &p[ofs], 2);
+            ans = x;
+            ofs += 2;
+            break;
+        }
+        case BCF_BT_INT32: {
+            BOUNDS_CHECK(ofs + 4, len, "reading BCF typed integer");
+            memcpy(&ans, &p[ofs], 4);
+            ofs += 4;
+            break;
+        }
+        default:
+            return Status::Invalid("BCFSerialize: expected typed integer");
+    }
+    return Status::OK();
+}
+
+Status bcf_raw_view::of_mem(const uint8_t *buf, int start, size_t len,
+                            bcf_raw_view& ans, int& reclen) {
+    uint32_t x[8];
+    BOUNDS_CHECK(start + 32, len, "reading header of BCF record");
+    memcpy(x, &buf[start], 32);
+    if (x[0] < 24) {
+        return Status::Invalid("BCFSerialize: corrupt BCF record header");
+    }
+    x[0] -= 24; // to exclude six 32-bit integers
+    BOUNDS_CHECK(start + 32 + size_t(x[0]) + x[1], len, "reading BCF record");
+
+    ans.is_gvcf_ref_ = -1;
+    memcpy(&ans.rid_, &x[2], 4);
+    memcpy(&ans.pos_, &x[3], 4);
+    memcpy(&ans.rlen_, &x[4], 4);
+    memcpy(&ans.qual_, &x[5], 4);
+    ans.n_allele_ = x[6]>>16; ans.n_info_ = x[6]&0xffff;
+    ans.n_fmt_ = x[7]>>24; ans.n_sample_ = x[7]&0xffffff;
+    ans.shared_ = &buf[start + 32];
+    ans.shared_len_ = x[0];
+    ans.indiv_ = ans.shared_ + x[0];
+    ans.indiv_len_ = x[1];
+    // as in bcf_raw_read_from_mem
+    if ((!ans.indiv_len_ || !ans.n_sample_) && ans.n_fmt_) ans.n_fmt_ = 0;
+
+    reclen = 32 + x[0] + x[1];
+    return Status::OK();
+}
+
+Status bcf_raw_view::of_bcf1(const bcf1_t *v, bcf_raw_view& ans) {
+    if (v->d.shared_dirty || v->d.indiv_dirty) {
+        return Status::Invalid("BCFSerialize: bcf_raw_view of modified bcf1_t");
+    }
+    ans.is_gvcf_ref_ = -1;
+    ans.rid_ = v->rid;
+    ans.pos_ = v->pos;
+    ans.rlen_ = v->rlen;
+    ans.qual_ = v->qual;
+    ans.n_allele_ = v->n_allele; ans.n_info_ = v->n_info;
+    ans.n_fmt_ = v->n_fmt; ans.n_sample_ = v->n_sample;
+    ans.shared_ = (const uint8_t*) v->shared.s;
+    ans.shared_len_ = v->shared.l;
+    ans.indiv_ = (const uint8_t*) v->indiv.s;
+    ans.indiv_len_ = v->indiv.l;
+    if ((!ans.indiv_len_ || !ans.n_sample_) && ans.n_fmt_) ans.n_fmt_ = 0;
+    return Status::OK();
+}
+
+Status bcf_raw_view::allele(unsigned i, const char*& str, size_t& len) const {
+    Status s;
+    if (i >= n_allele_) {
+        return Status::Invalid("BCFSerialize: allele index out of range", to_string(i));
+    }
+    // ID, then the alleles, each a typed string
+    size_t ofs = 0;
+    for (unsigned j = 0; j <= i+1; j++) {
+        int type, n;
+        S(raw_typed_size(shared_, shared_len_, ofs, type, n));
+        size_t sz = size_t(n) * raw_type_size(type);
+        BOUNDS_CHECK(ofs + sz, shared_len_, "reading BCF allele");
+        if (j == i+1) {
+            str = (const char*) &shared_[ofs];
+            len = sz;
+        }
+        ofs += sz;
+    }
+    return Status::OK();
+}
+
+Status bcf_raw_view::is_gvcf_ref_record(bool& ans) const {
+    Status s;
+    if (is_gvcf_ref_ >= 0) {
+        ans = (is_gvcf_ref_ == 1);
+        return Status::OK();
+    }
+    ans = (n_allele_ == 1);
+    if (n_allele_ == 2) {
+        const char *alt;
+        size_t len;
+        S(allele(1, alt, len));
+        ans = len >= 2 && alt[0] == '<' && alt[len-1] == '>';
+    }
+    return Status::OK();
+}
+
+Status bcf_variant_predicate(const bcf_hdr_t* hdr, const bcf_raw_view& rec, bool& retval) {
+    Status s;
+    bool is_ref = true;
+    S(rec.is_gvcf_ref_record(is_ref));
+    retval = !is_ref;
+    return Status::OK();
+}
+
+// Set ofs to the beginning of the INFO fields in the shared section, by
+// skipping the ID, alleles and FILTER
+Status bcf_raw_view::skip_to_info(size_t& ofs) const {
+    Status s;
+    ofs = 0;
+    for (unsigned j = 0; j < n_allele_ + 2; j++) {
+        int type, n;
+        S(raw_typed_size(shared_, shared_len_, ofs, type, n));
+        ofs += size_t(n) * raw_type_size(type);
+        BOUNDS_CHECK(ofs, shared_len_, "skipping BCF alleles & FILTER");
+    }
+    return Status::OK();
+}
+
+Status bcf_raw_view::info(int id, int& type, int& n, const uint8_t*& data) const {
+    Status s;
+    size_t ofs;
+    S(skip_to_info(ofs));
+    for (unsigned j = 0; j < n_info_; j++) {
+        int32_t key;
+        S(raw_typed_int(shared_, shared_len_, ofs, key));
+        S(raw_typed_size(shared_, shared_len_, ofs, type, n));
+        size_t sz = size_t(n) * raw_type_size(type);
+        BOUNDS_CHECK(ofs + sz, shared_len_, "reading BCF INFO field");
+        if (key == id) {
+            data = &shared_[ofs];
+            return Status::OK();
+        }
+        ofs += sz;
+    }
+    return Status::NotFound();
+}
+
+Status bcf_raw_view::format(int id, int& type, int& n, const uint8_t*& data) const {
+    Status s;
+    size_t ofs = 0;
+    for (unsigned j = 0; j < n_fmt_; j++) {
+        int32_t key;
+        S(raw_typed_int(indiv_, indiv_len_, ofs, key));
+        S(raw_typed_size(indiv_, indiv_len_, ofs, type, n));
+        size_t sz = size_t(n) * raw_type_size(type) * n_sample_;
+        BOUNDS_CHECK(ofs + sz, indiv_len_, "reading BCF FORMAT field");
+        if (key == id) {
+            data = &indiv_[ofs];
+            return Status::OK();
+        }
+        ofs += sz;
+    }
+    return Status::NotFound();
+}
+
+// Append to dest those of the n (key, typed values) entries beginning at
+// buf[ofs] whose key is in the sorted ids. mult is the number of values per
+// element of the type descriptor (n_sample for FORMAT fields, 1 for INFO).
+static Status raw_select_entries(const uint8_t *buf, size_t len, size_t ofs, unsigned n,
+                                 size_t mult, const vector<int>& ids,
+                                 kstring_t *dest, unsigned& n_kept) {
+    Status s;
+    n_kept = 0;
+    // first pass: measure the retained entries, so we allocate just once
+    size_t ofs0 = ofs, kept_bytes = 0;
+    for (unsigned j = 0; j < n; j++) {
+        size_t entry_beg = ofs;
+        int32_t key;
+        int type, vn;
+        S(raw_typed_int(buf, len, ofs, key));
+        S(raw_typed_size(buf, len, ofs, type, vn));
+        ofs += size_t(vn) * raw_type_size(type) * mult;
+        BOUNDS_CHECK(ofs, len, "reading BCF INFO/FORMAT field");
+        if (binary_search(ids.begin(), ids.end(), key)) {
+            kept_bytes += ofs - entry_beg;
+        }
+    }
+    if (!kept_bytes) {
+        return Status::OK();
+    }
+    ks_resize(dest, dest->l + kept_bytes);
+    // second pass: copy them
+    ofs = ofs0;
+    for (unsigned j = 0; j < n; j++) {
+        size_t entry_beg = ofs;
+        int32_t key;
+        int type, vn;
+        S(raw_typed_int(buf, len, ofs, key));
+        S(raw_typed_size(buf, len, ofs, type, vn));
+        ofs += size_t(vn) * raw_type_size(type) * mult;
+        if (binary_search(ids.begin(), ids.end(), key)) {
+            memcpy(dest->s + dest->l, &buf[entry_beg], ofs - entry_beg);
+            dest->l += ofs - entry_beg;
+            n_kept++;
+        }
+    }
+    assert(dest->l <= dest->m);
+    return Status::OK();
+}
+
+Status bcf_raw_view::read(bcf1_t *v, const vector<int>* info_ids,
+                          const vector<int>* format_ids) const {
+    Status s;
+
+    // shared: ID, alleles and FILTER verbatim, then the INFO fields
+    unsigned n_info = n_info_;
+    size_t info_ofs = shared_len_;
+    if (info_ids) {
+        S(skip_to_info(info_ofs));
+    }
+    ks_resize(&v->shared, info_ofs);
+    memcpy(v->shared.s, shared_, info_ofs);
+    v->shared.l = info_ofs;
+    if (info_ids) {
+        S(raw_select_entries(shared_, shared_len_, info_ofs, n_info_, 1, *info_ids,
+                             &v->shared, n_info));
+    }
+
+    // indiv: the FORMAT fields
+    unsigned n_fmt = n_fmt_;
+    v->indiv.l = 0;
+    if (format_ids) {
+        S(raw_select_entries(indiv_, indiv_len_, 0, n_fmt_, n_sample_, *format_ids,
+                             &v->indiv, n_fmt));
+    } else {
+        ks_resize(&v->indiv, indiv_len_);
+        memcpy(v->indiv.s, indiv_, indiv_len_);
+        v->indiv.l = indiv_len_;
+    }
+
+    v->rid = rid_;
+    v->pos = pos_;
+    v->rlen = rlen_;
+    v->qual = qual_;
+    v->n_allele = n_allele_;
+    v->n_info = n_info;
+    v->n_fmt = n_fmt;
+    v->n_sample = n_sample_;
+    return Status::OK();
+}
+
+// Append x as a typed integer, encoded as by htslib's bcf_enc_int1 (for
+// x >= 0, as FORMAT keys and vector lengths are)
+static void raw_enc_typed_int(int32_t x, vector<uint8_t>& ans) {
+    if (x <= INT8_MAX) {
+        ans.push_back(1 << 4 | BCF_BT_INT8);
+        ans.push_back((uint8_t) x);
+    } else if (x <= INT16_MAX) {
+        int16_t x16 = x;
+        ans.push_back(1 << 4 | BCF_BT_INT16);
+        ans.insert(ans.end(), (uint8_t*) &x16, (uint8_t*) &x16 + 2);
+    } else {
+        ans.push_back(1 << 4 | BCF_BT_INT32);
+        ans.insert(ans.end(), (uint8_t*) &x, (uint8_t*) &x + 4);
+    }
+}
+
+// Append the key and type descriptor of a FORMAT field, encoded as by
+// htslib's bcf_enc_int1 and bcf_enc_size
+static void raw_enc_format_header(int32_t key, int type, uint32_t width, vector<uint8_t>& ans) {
+    raw_enc_typed_int(key, ans);
+    if (width < 15) {
+        ans.push_back(width << 4 | type);
+    } else {
+        ans.push_back(15 << 4 | type);
+        raw_enc_typed_int(width, ans);
+    }
+}
+
+// Write the 32-byte header of a serialized record: that of the record at buf,
+// with the given indiv length and number of FORMAT fields
+static void raw_rewrite_header(const uint8_t *buf, uint32_t indiv_len, uint32_t n_fmt,
+                               vector<uint8_t>& ans) {
+    uint32_t x[8];
+    memcpy(x, buf, 32);
+    x[1] = indiv_len;
+    x[7] = n_fmt << 24 | (x[7] & 0xffffff);
+    memcpy(ans.data(), x, 32);
+}
+
+Status bcf_raw_split_int_formats(const uint8_t *buf, size_t len, vector<uint8_t>& rest,
+                                 vector<bcf_raw_format_entry>& entries) {
+    Status s;
+    bcf_raw_view view;
+    int reclen = -1;
+    S(bcf_raw_view::of_mem(buf, 0, len, view, reclen));
+    uint32_t indiv_len;
+    memcpy(&indiv_len, buf + 4, 4);
+    entries.clear();
+    if (view.n_fmt() == 0) {
+        rest.assign(buf, buf + reclen);
+        return Status::OK();
+    }
+    const size_t shared_end = reclen - indiv_len;
+    const uint8_t *indiv = buf + shared_end;
+
+    rest.assign(buf, buf + shared_end);
+    vector<uint8_t> header;
+    size_t ofs = 0;
+    for (unsigned j = 0; j < view.n_fmt(); j++) {
+        size_t entry_beg = ofs;
+        bcf_raw_format_entry entry;
+        int n;
+        S(raw_typed_int(indiv, indiv_len, ofs, entry.key));
+        S(raw_typed_size(indiv, indiv_len, ofs, entry.type, n));
+        size_t sz = size_t(n) * raw_type_size(entry.type) * view.n_sample();
+        BOUNDS_CHECK(ofs + sz, indiv_len, "reading BCF FORMAT field");
+        bool split = false;
+        if (entry.key >= 0 && (entry.type == BCF_BT_INT8 || entry.type == BCF_BT_INT16 ||
+                               entry.type == BCF_BT_INT32)) {
+            header.clear();
+            raw_enc_format_header(entry.key, entry.type, n, header);
+            split = header.size() == ofs - entry_beg
+                    && memcmp(header.data(), &indiv[entry_beg], header.size()) == 0;
+        }
+        if (split) {
+            entry.position = j;
+            entry.width = n;
+            entry.n_values = size_t(n) * view.n_sample();
+            entry.data = &indiv[ofs];
+            entries.push_back(entry);
+        } else {
+            rest.insert(rest.end(), &indiv[entry_beg], &indiv[ofs + sz]);
+        }
+        ofs += sz;
+    }
+    raw_rewrite_header(buf, rest.size() - shared_end, view.n_fmt() - entries.size(), rest);
+    return Status::OK();
+}
+
+Status bcf_raw_splice_formats(const uint8_t *rest, size_t len,
+                              const vector<bcf_raw_format_entry>& entries,
+                              vector<uint8_t>& ans) {
+    Status s;
+    bcf_raw_view view;
+    int reclen = -1;
+    S(bcf_raw_view::of_mem(rest, 0, len, view, reclen));
+    uint32_t indiv_len;
+    memcpy(&indiv_len, rest + 4, 4);
+    if (entries.empty()) {
+        ans.assign(rest, rest + reclen);
+        return Status::OK();
+    }
+    const size_t shared_end = reclen - indiv_len;
+    const uint8_t *indiv = rest + shared_end;
+
+    ans.assign(rest, rest + shared_end);
+    const unsigned n_fmt = view.n_fmt() + entries.size();
+    unsigned n_kept = 0;
+    size_t ofs = 0, k = 0;
+    for (unsigned j = 0; j < n_fmt; j++) {
+        if (k < entries.size() && entries[k].position == j) {
+            const auto& entry = entries[k++];
+            if (entry.data) {
+                raw_enc_format_header(entry.key, entry.type, entry.width, ans);
+                ans.insert(ans.end(), entry.data,
+                           entry.data + entry.n_values * raw_type_size(entry.type));
+                n_kept++;
+            }
+        } else {
+            // the next field remaining in the record
+            size_t entry_beg = ofs;
+            int32_t key;
+            int type, n;
+            S(raw_typed_int(indiv, indiv_len, ofs, key));
+            S(raw_typed_size(indiv, indiv_len, ofs, type, n));
+            ofs += size_t(n) * raw_type_size(type) * view.n_sample();
+            BOUNDS_CHECK(ofs, indiv_len, "reading BCF FORMAT field");
+            ans.insert(ans.end(), &indiv[entry_beg], &indiv[ofs]);
+            n_kept++;
+        }
+    }
+    if (k != entries.size() || ofs != indiv_len) {
+        return Status::Invalid("BCFSerialize: FORMAT fields don't fit the record");
+    }
+    raw_rewrite_header(rest, ans.size() - shared_end, n_kept, ans);
+    return Status::OK();
+}
+
 // Return 1 if the records are the same, 0 otherwise.
 // This compares most, but not all, fields.
 int bcf_shallow_compare(const bcf1_t *x, const bcf1_t *y) {
@@ -204,28 +642,94 @@ Status bcf_raw_read_header(const uint8_t* buf, int hdrlen,
     return Status::OK();
 }
 
+// frame the header text (with its \0 terminator) as in a BCF file
+static std::string bcf_frame_header(const char *htxt, int hlen) {
+    string rc;
+    rc.reserve(5 + 4 + hlen);
+    rc.append("BCF\2\2", 5);
+    rc.append((const char*) &hlen, 4);
+    rc.append(htxt, hlen);
+    return rc;
+}
+
 std::string bcf_write_header(const bcf_hdr_t *hdr) {
     int hlen;
     char *htxt = bcf_hdr_fmt_text(hdr, 1, &hlen);
     hlen++; // include the \0 byte
-
-    char *buf = (char*) malloc(5 + 4 + hlen);
-    assert(buf != nullptr);
-    int loc = 0;
-    memcpy(&buf[loc], "BCF\2\2", 5);
-    loc += 5;
-    memcpy(&buf[loc], &hlen, 4);
-    loc += 4;
-    memcpy(&buf[loc], htxt, hlen);
-    loc += hlen;
-
-    // cleanup and return
-    string rc(buf, loc);
+    string rc = bcf_frame_header(htxt, hlen);
     free(htxt);
-    free(buf);
     return rc;
 }
 
+std::string bcf_write_header_template(const bcf_hdr_t *hdr) {
+    int hlen;
+    char *htxt = bcf_hdr_fmt_text(hdr, 1, &hlen);
+    string txt(htxt, hlen);
+    free(htxt);
+
+    // cut the #CHROM line short after the eighth (INFO) column
+    size_t chrom = txt.rfind("#CHROM\t");
+    if (chrom != string::npos && (chrom == 0 || txt[chrom-1] == '\n')) {
+        size_t eol = txt.find('\n', chrom);
+        if (eol == string::npos) {
+            eol = txt.size();
+        }
+        size_t col = chrom;
+        for (int i = 0; i < 8 && col < eol; i++) {
+            col = txt.find('\t', col+1);
+        }
+        if (col < eol) {
+            txt.erase(col, eol-col);
+        }
+    }
+    return bcf_frame_header(txt.c_str(), txt.size()+1);
+}
+
+// set the parts of a header that bcf_hdr_share takes from the template: all
+// but the sample dictionary, the translation tables and the scratch space
+static void bcf_hdr_set_shared(bcf_hdr_t *dst, const bcf_hdr_t *src) {
+    for (int i : { BCF_DT_ID, BCF_DT_CTG }) {
+        dst->n[i] = src->n[i];
+        dst->m[i] = src->m[i];
+        dst->id[i] = src->id[i];
+        dst->dict[i] = src->dict[i];
+    }
+    dst->hrec = src->hrec;
+    dst->nhrec = src->nhrec;
+}
+
+Status bcf_hdr_share(const shared_ptr<const bcf_hdr_t>& tmpl,
+                     const vector<string>& samples,
+                     shared_ptr<const bcf_hdr_t>& ans) {
+    if (!tmpl || bcf_hdr_nsamples(tmpl.get()) != 0) {
+        return Status::Invalid("BCFSerialize::bcf_hdr_share: template header has samples");
+    }
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_init("r"), &bcf_hdr_destroy);
+    if (!hdr) {
+        return Status::Failure("BCFSerialize::bcf_hdr_share: bcf_hdr_init");
+    }
+    for (const auto& sample : samples) {
+        if (bcf_hdr_add_sample(hdr.get(), sample.c_str()) != 0) {
+            return Status::Invalid("BCFSerialize::bcf_hdr_share: duplicate sample", sample);
+        }
+    }
+    if (bcf_hdr_sync(hdr.get()) != 0) {
+        return Status::Failure("BCFSerialize::bcf_hdr_share: bcf_hdr_sync");
+    }
+
+    // Point the new header at the template's dictionaries and records,
+    // keeping its own (empty) ones aside to restore before it's destroyed, so
+    // that bcf_hdr_destroy frees only what the header owns.
+    bcf_hdr_t own = *hdr;
+    bcf_hdr_set_shared(hdr.get(), tmpl.get());
+    ans = shared_ptr<const bcf_hdr_t>(hdr.release(), [tmpl, own](const bcf_hdr_t* h) {
+        bcf_hdr_t *mh = const_cast<bcf_hdr_t*>(h);
+        bcf_hdr_set_shared(mh, &own);
+        bcf_hdr_destroy(mh);
+    });
+    return Status::OK();
+}
+
 // convert a BCF record into a string
 shared_ptr<string> bcf1_to_string(const bcf_hdr_t *hdr, const bcf1_t *bcf) {
     kstring_t kstr;
@@ -0,0 +1,377 @@
+// Implement a KeyValue interface to an immutable, memory-mapped database image.
+//
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <assert.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "KeyValue.h"
+#include "MmapKeyValue.h"
+
+using namespace std;
+
+namespace GLnexus {
+namespace MmapKeyValue {
+
+// Image layout (integers u64 little-endian):
+//   header:    magic, #collections, directory offset, file size
+//   data:      for each collection, its records' keys and values, in key
+//              order, each key followed immediately by its value
+//   indices:   for each collection (8-byte aligned), {key offset, value
+//              offset} of each record, then one more entry {end, end}, so
+//              that record i's key spans [key i, value i) and its value
+//              [value i, key i+1)
+//   directory: for each collection, name length, name (padded to 8 bytes),
+//              #records, index offset
+static const char* MAGIC = "GLnxKVI1";
+static const size_t HEADER_BYTES = 32, INDEX_ENTRY_BYTES = 16;
+
+static inline uint64_t u64(const char* p) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return le64toh(x);
+}
+
+static inline void put64(ostream& out, uint64_t x) {
+    x = htole64(x);
+    out.write((const char*)&x, 8);
+}
+
+static inline void pad8(ostream& out) {
+    static const char zeros[8] = {0};
+    uint64_t pos = out.tellp();
+    if (pos % 8) {
+        out.write(zeros, 8 - pos % 8);
+    }
+}
+
+Status Write(const KeyValue::DB& src, const vector<string>& collections, const string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        return Status::Exists("MmapKeyValue::Write: output path exists", path);
+    }
+
+    // The index entries are written to a scratch file alongside as the
+    // records stream in, then appended to the image after each collection,
+    // so that neither need be held in memory.
+    const string index_path = path + ".index";
+    Status s;
+    auto write = [&]() {
+        Status s;
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out.good()) {
+            return Status::IOError("MmapKeyValue::Write: couldn't create", path);
+        }
+        out.write(MAGIC, 8);
+        put64(out, collections.size());
+        put64(out, 0); // directory offset and file size, filled in at the end
+        put64(out, 0);
+
+        vector<pair<uint64_t,uint64_t>> directory; // #records, index offset
+        for (const auto& name : collections) {
+            KeyValue::CollectionHandle coll;
+            S(src.collection(name, coll));
+            ofstream index(index_path, ios::binary | ios::trunc);
+            if (!index.good()) {
+                return Status::IOError("MmapKeyValue::Write: couldn't create", index_path);
+            }
+
+            unique_ptr<KeyValue::Iterator> it;
+            S(src.iterator(coll, "", it));
+            uint64_t n = 0;
+            string prev_key;
+            for (; it->valid(); n++) {
+                KeyValue::Data key = it->key(), value = it->value();
+                if (n && string(key.data, key.size) <= prev_key) {
+                    return Status::Invalid("MmapKeyValue::Write: source keys out of order", name);
+                }
+                prev_key.assign(key.data, key.size);
+                put64(index, out.tellp());
+                out.write(key.data, key.size);
+                put64(index, out.tellp());
+                out.write(value.data, value.size);
+                S(it->next());
+            }
+            uint64_t end = out.tellp();
+            put64(index, end);
+            put64(index, end);
+            index.close();
+            if (index.fail()) {
+                return Status::IOError("MmapKeyValue::Write: writing", index_path);
+            }
+
+            pad8(out);
+            directory.push_back(make_pair(n, uint64_t(out.tellp())));
+            ifstream index_in(index_path, ios::binary);
+            out << index_in.rdbuf();
+            if (!index_in.good() || uint64_t(out.tellp()) != directory.back().second + (n+1)*INDEX_ENTRY_BYTES) {
+                return Status::IOError("MmapKeyValue::Write: copying", index_path);
+            }
+        }
+
+        uint64_t directory_offset = out.tellp();
+        for (size_t i = 0; i < collections.size(); i++) {
+            put64(out, collections[i].size());
+            out.write(collections[i].data(), collections[i].size());
+            pad8(out);
+            put64(out, directory[i].first);
+            put64(out, directory[i].second);
+        }
+        uint64_t size = out.tellp();
+        out.seekp(16);
+        put64(out, directory_offset);
+        put64(out, size);
+        out.close();
+        if (out.fail()) {
+            return Status::IOError("MmapKeyValue::Write: writing", path);
+        }
+        return Status::OK();
+    };
+    s = write();
+    unlink(index_path.c_str());
+    if (s.bad()) {
+        unlink(path.c_str());
+    }
+    return s;
+}
+
+bool IsImage(const string& path) {
+    ifstream in(path, ios::binary);
+    char magic[8];
+    return in.read(magic, 8) && memcmp(magic, MAGIC, 8) == 0;
+}
+
+// the mapped file
+struct mapping {
+    const char* base = nullptr;
+    size_t size = 0;
+    ~mapping() {
+        if (base) {
+            munmap((void*) base, size);
+        }
+    }
+};
+
+// a key or value in the mapping, which it keeps open
+struct MappedData : public KeyValue::Data {
+    shared_ptr<const mapping> m_;
+    MappedData(const char* data, size_t size, const shared_ptr<const mapping>& m)
+        : KeyValue::Data(data, size), m_(m) {}
+};
+
+struct mapped_collection {
+    uint64_t n;           // # records
+    const char* index;    // n+1 entries
+};
+
+class Iterator : public KeyValue::Iterator {
+    shared_ptr<const mapping> m_;
+    const mapped_collection& coll_;
+    uint64_t i_;
+
+    uint64_t offset(uint64_t i, unsigned field) const {
+        return u64(coll_.index + i*INDEX_ENTRY_BYTES + 8*field);
+    }
+
+public:
+    Iterator(const shared_ptr<const mapping>& m, const mapped_collection& coll, uint64_t i)
+        : m_(m), coll_(coll), i_(i) {}
+
+    bool valid() const override {
+        return i_ < coll_.n;
+    }
+
+    KeyValue::Data key() const override {
+        uint64_t k = offset(i_, 0);
+        return KeyValue::Data(m_->base + k, offset(i_, 1) - k);
+    }
+
+    KeyValue::Data value() const override {
+        uint64_t v = offset(i_, 1);
+        return KeyValue::Data(m_->base + v, offset(i_+1, 0) - v);
+    }
+
+    Status next() override {
+        if (i_ < coll_.n) {
+            i_++;
+        }
+        return Status::OK();
+    }
+
+    Status seek(const string& key) override;
+
+    // the index of the first record whose key is equal to or greater than
+    // the given one, from lo
+    static uint64_t lower_bound(const mapping& m, const mapped_collection& coll, const string& key, uint64_t lo) {
+        uint64_t hi = coll.n;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi-lo)/2;
+            const char* entry = coll.index + mid*INDEX_ENTRY_BYTES;
+            uint64_t k = u64(entry), v = u64(entry+8);
+            if (key.compare(0, string::npos, m.base + k, v - k) > 0) {
+                lo = mid+1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+};
+
+Status Iterator::seek(const string& key) {
+    i_ = lower_bound(*m_, coll_, key, i_);
+    return Status::OK();
+}
+
+class DB : public KeyValue::DB {
+    shared_ptr<const mapping> m_;
+    map<string,mapped_collection> colls_;
+
+    DB(const DB&) = delete;
+    void operator=(const DB&) = delete;
+
+    const mapped_collection& coll_of(KeyValue::CollectionHandle coll) const {
+        return *reinterpret_cast<const mapped_collection*>(coll);
+    }
+
+    // the database is immutable, so the DB serves as its own snapshot
+    class Reader : public KeyValue::Reader {
+        const DB& db_;
+    public:
+        Reader(const DB& db) : db_(db) {}
+        Status get0(KeyValue::CollectionHandle coll, const string& key,
+                    shared_ptr<KeyValue::Data>& value) const override {
+            return db_.get0(coll, key, value);
+        }
+        Status iterator(KeyValue::CollectionHandle coll, const string& key,
+                        unique_ptr<KeyValue::Iterator>& it) const override {
+            return db_.iterator(coll, key, it);
+        }
+    };
+
+public:
+    DB() = default;
+
+    static Status Open(const string& path, unique_ptr<KeyValue::DB>& db) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return Status::IOError("MmapKeyValue::Open: couldn't open", path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t) HEADER_BYTES) {
+            close(fd);
+            return Status::Invalid("MmapKeyValue::Open: not a database image", path);
+        }
+        auto m = make_shared<mapping>();
+        void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            return Status::IOError("MmapKeyValue::Open: mmap failed", path);
+        }
+        m->base = (const char*) base;
+        m->size = st.st_size;
+
+        // read & check the directory
+        const char* corrupt = "MmapKeyValue::Open: corrupt database image";
+        if (memcmp(m->base, MAGIC, 8) != 0 || u64(m->base+24) != m->size) {
+            return Status::Invalid(corrupt, path);
+        }
+        unique_ptr<DB> ans(new DB);
+        uint64_t ncolls = u64(m->base+8), pos = u64(m->base+16);
+        for (uint64_t i = 0; i < ncolls; i++) {
+            if (pos + 8 > m->size) {
+                return Status::Invalid(corrupt, path);
+            }
+            uint64_t name_len = u64(m->base+pos);
+            uint64_t name_end = pos + 8 + name_len;
+            uint64_t rec = (name_end + 7) / 8 * 8;
+            if (name_len > m->size || rec + 16 > m->size) {
+                return Status::Invalid(corrupt, path);
+            }
+            string name(m->base+pos+8, name_len);
+            mapped_collection coll;
+            coll.n = u64(m->base+rec);
+            uint64_t index_offset = u64(m->base+rec+8);
+            if (coll.n >= m->size / INDEX_ENTRY_BYTES
+                || index_offset + (coll.n+1)*INDEX_ENTRY_BYTES > m->size) {
+                return Status::Invalid(corrupt, path);
+            }
+            coll.index = m->base + index_offset;
+            // check the ends of the index (not every entry, which would read
+            // through the whole thing)
+            uint64_t first = u64(coll.index), last = u64(coll.index + coll.n*INDEX_ENTRY_BYTES);
+            if (first < HEADER_BYTES || first > last || last > index_offset) {
+                return Status::Invalid(corrupt, path);
+            }
+            ans->colls_[name] = coll;
+            pos = rec + 16;
+        }
+        ans->m_ = m;
+        db = move(ans);
+        return Status::OK();
+    }
+
+    Status collection(const string& name, KeyValue::CollectionHandle& coll) const override {
+        auto p = colls_.find(name);
+        if (p == colls_.end()) {
+            return Status::NotFound("MmapKeyValue::collection", name);
+        }
+        coll = reinterpret_cast<KeyValue::CollectionHandle>(const_cast<mapped_collection*>(&p->second));
+        return Status::OK();
+    }
+
+    Status create_collection(const string& name) override {
+        return Status::Invalid("MmapKeyValue: database image is immutable");
+    }
+
+    Status current(unique_ptr<KeyValue::Reader>& reader) const override {
+        reader = make_unique<Reader>(*this);
+        return Status::OK();
+    }
+
+    Status begin_writes(unique_ptr<KeyValue::WriteBatch>& writes) override {
+        return Status::Invalid("MmapKeyValue: database image is immutable");
+    }
+
+    Status get0(KeyValue::CollectionHandle _coll, const string& key,
+                shared_ptr<KeyValue::Data>& value) const override {
+        const auto& coll = coll_of(_coll);
+        uint64_t i = Iterator::lower_bound(*m_, coll, key, 0);
+        if (i < coll.n) {
+            const char* entry = coll.index + i*INDEX_ENTRY_BYTES;
+            uint64_t k = u64(entry), v = u64(entry+8), end = u64(entry+INDEX_ENTRY_BYTES);
+            if (key.compare(0, string::npos, m_->base + k, v - k) == 0) {
+                value = make_shared<MappedData>(m_->base + v, end - v, m_);
+                return Status::OK();
+            }
+        }
+        return Status::NotFound("key", key);
+    }
+
+    Status iterator(KeyValue::CollectionHandle _coll, const string& key,
+                    unique_ptr<KeyValue::Iterator>& it) const override {
+        const auto& coll = coll_of(_coll);
+        it = make_unique<Iterator>(m_, coll, key.empty() ? 0 : Iterator::lower_bound(*m_, coll, key, 0));
+        return Status::OK();
+    }
+
+    Status put(KeyValue::CollectionHandle coll, const string& key, const KeyValue::Data& value) override {
+        return Status::Invalid("MmapKeyValue: database image is immutable");
+    }
+
+    Status flush() override {
+        return Status::OK();
+    }
+};
+
+Status Open(const string& path, unique_ptr<KeyValue::DB>& db) {
+    return DB::Open(path, db);
+}
+
+}}
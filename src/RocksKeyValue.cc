@@ -8,6 +8,8 @@
 #include <string>
 #include <thread>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <unistd.h>
 #include "KeyValue.h"
 #include "RocksKeyValue.h"
@@ -15,10 +17,12 @@
 #include "rocksdb/slice.h"
 #include "rocksdb/options.h"
 #include "rocksdb/write_batch.h"
+#include "rocksdb/sst_file_writer.h"
 #include "rocksdb/table.h"
 #include "rocksdb/memtablerep.h"
 #include "rocksdb/cache.h"
 #include "rocksdb/slice_transform.h"
+#include "rocksdb/statistics.h"
 
 namespace GLnexus {
 namespace RocksKeyValue {
@@ -34,6 +38,16 @@ private:
     std::unique_ptr<rocksdb::PinnableSlice> ps_;
 };
 
+// expose one of the values from a batched rocksdb::DB::MultiGet, keeping all
+// of them alive together
+struct MultiGetData : public KeyValue::Data {
+    MultiGetData(const std::shared_ptr<std::vector<rocksdb::PinnableSlice>>& values, size_t i)
+        : KeyValue::Data((*values)[i].data(), (*values)[i].size()), values_(values) {}
+
+private:
+    std::shared_ptr<std::vector<rocksdb::PinnableSlice>> values_;
+};
+
 static size_t totalRAM() {
     // http://nadeausoftware.com/articles/2012/09/c_c_tip_how_get_physical_memory_size_system
     static size_t memoized = 0;
@@ -92,22 +106,39 @@ static Status convertStatus(const rocksdb::Status &s)
     }
 }
 
-// Create RocksDB block cache to be shared among all collections in one database
-std::shared_ptr<rocksdb::Cache> NewBlockCache(OpenMode mode, size_t mem_budget) {
+// Create RocksDB block cache to be shared among all collections in one
+// database. If budget is given, the cache's capacity is reserved from it (as
+// much as is available), setting reserved to the amount.
+std::shared_ptr<rocksdb::Cache> NewBlockCache(OpenMode mode, size_t mem_budget,
+                                              memory_budget* budget, size_t& reserved) {
     assert(mem_budget >= size_t(1<<30));
-    if (mode != OpenMode::BULK_LOAD) {
-        return rocksdb::NewLRUCache(mem_budget * 3 / 4, 8);
-    } else {
+    size_t capacity = mem_budget * 3 / 4;
+    int shard_bits = 8;
+    if (mode == OpenMode::BULK_LOAD) {
         // In bulk-load mode we use a lot of memory for write buffers, so
         // provision a smaller block cache to compensate.
-        return rocksdb::NewLRUCache(mem_budget / 4, 6);
+        capacity = mem_budget / 4;
+        shard_bits = 6;
     }
+    reserved = 0;
+    if (budget) {
+        reserved = capacity = budget->reserve(capacity);
+    }
+    return rocksdb::NewLRUCache(capacity, shard_bits);
+}
+
+// The effective memory budget for sizing a database
+static size_t db_mem_budget(const config& opt) {
+    if (opt.budget) {
+        return std::max(opt.budget->total(), size_t(1<<30));
+    }
+    return calculate_mem_budget(opt.mem_budget);
 }
 
 // Reference for RocksDB tuning: https://github.com/facebook/rocksdb/wiki/RocksDB-Tuning-Guide
 void ApplyColumnFamilyOptions(OpenMode mode, size_t prefix_length, size_t mem_budget,
                               std::shared_ptr<rocksdb::Cache> block_cache,
-                              rocksdb::ColumnFamilyOptions& opts) {
+                              rocksdb::ColumnFamilyOptions& opts, size_t dict_bytes = 0) {
     // universal compaction, 1GiB memtable budget
     opts.OptimizeUniversalStyleCompaction(1<<30);
     opts.num_levels = 4;
@@ -140,8 +171,18 @@ void ApplyColumnFamilyOptions(OpenMode mode, size_t prefix_length, size_t mem_bu
     opts.compression_per_level.clear();
     opts.compression = rocksdb::kZSTD;
     opts.compression_opts.level = 2;
-    // compression 'training' not likely to be worthwhile for our 1MB blocks
-    // opts.compression_opts.zstd_max_train_bytes = opts.compression_opts.max_dict_bytes = bbto.block_size * 4;
+    if (dict_bytes) {
+        // Train a dictionary for each file on a sample of its blocks (Zstandard
+        // recommends ~100x the dictionary size), buffering just the sample
+        // rather than the whole file. Set for the bottommost level as well,
+        // which also governs sorted writes' files (SstFileWriter).
+        opts.compression_opts.max_dict_bytes = dict_bytes;
+        opts.compression_opts.zstd_max_train_bytes = 100 * dict_bytes;
+        opts.compression_opts.max_dict_buffer_bytes = opts.compression_opts.zstd_max_train_bytes;
+        opts.bottommost_compression = rocksdb::kZSTD;
+        opts.bottommost_compression_opts = opts.compression_opts;
+        opts.bottommost_compression_opts.enabled = true;
+    }
 
     if (prefix_length) {
         // prefix-based hash indexing for this column family
@@ -205,6 +246,11 @@ void ApplyDBOptions(OpenMode mode, size_t mem_budget, size_t thread_budget,
     opts.access_hint_on_compaction_start = rocksdb::Options::AccessHint::SEQUENTIAL;
     opts.compaction_readahead_size = 16 << 20;
 
+    // keep the (cheap, per-core) ticker counters for DB::statistics(), but
+    // not the histograms and timers
+    opts.statistics = rocksdb::CreateDBStatistics();
+    opts.statistics->set_stats_level(rocksdb::StatsLevel::kExceptHistogramOrTimers);
+
     // legacy issue -- feature not supported by the memtable implemetations we select
     opts.allow_concurrent_memtable_write = false;
 
@@ -216,6 +262,32 @@ void ApplyDBOptions(OpenMode mode, size_t mem_budget, size_t thread_budget,
     }
 }
 
+// Look up a batch of keys with one call to rocksdb::DB::MultiGet, which
+// shares the work of finding the relevant files and may read their blocks
+// in parallel
+static Status MultiGet(rocksdb::DB* db, rocksdb::ColumnFamilyHandle* coll,
+                       const std::vector<std::string>& keys,
+                       std::vector<std::shared_ptr<KeyValue::Data>>& values,
+                       std::vector<Status>& statuses) {
+    values.assign(keys.size(), nullptr);
+    statuses.assign(keys.size(), Status::OK());
+    if (keys.empty()) {
+        return Status::OK();
+    }
+    std::vector<rocksdb::Slice> key_slices(keys.begin(), keys.end());
+    auto pinned = std::make_shared<std::vector<rocksdb::PinnableSlice>>(keys.size());
+    std::vector<rocksdb::Status> rstatuses(keys.size());
+    const rocksdb::ReadOptions r_options;
+    db->MultiGet(r_options, coll, keys.size(), key_slices.data(), pinned->data(), rstatuses.data());
+    for (size_t i = 0; i < keys.size(); i++) {
+        statuses[i] = convertStatus(rstatuses[i]);
+        if (statuses[i].ok()) {
+            values[i] = std::make_shared<MultiGetData>(pinned, i);
+        }
+    }
+    return Status::OK();
+}
+
 class Iterator : public KeyValue::Iterator {
 private:
     std::unique_ptr<rocksdb::Iterator> iter_;
@@ -260,6 +332,21 @@ public:
         }
         return Status::OK();
     }
+
+    Status seek(const std::string& key) override {
+        if (!iter_->status().ok()) {
+            return convertStatus(iter_->status());
+        }
+        iter_->Seek(key);
+        if (!iter_->status().ok()) {
+            return convertStatus(iter_->status());
+        }
+        if (iter_->Valid()) {
+            key_ = iter_->key();
+            value_ = iter_->value();
+        }
+        return Status::OK();
+    }
 };
 
 
@@ -291,6 +378,13 @@ public:
         return convertStatus(s);;
     }
 
+    Status multi_get0(KeyValue::CollectionHandle _coll,
+                      const std::vector<std::string>& keys,
+                      std::vector<std::shared_ptr<KeyValue::Data>>& values,
+                      std::vector<Status>& statuses) const override {
+        return MultiGet(db_, reinterpret_cast<rocksdb::ColumnFamilyHandle*>(_coll), keys, values, statuses);
+    }
+
     Status iterator(KeyValue::CollectionHandle _coll,
                     const std::string& key,
                     std::unique_ptr<KeyValue::Iterator>& it) const override {
@@ -350,26 +444,125 @@ public:
     }
 };
 
+// In bulk-load mode, a sorted batch of writes goes straight into SST files
+// (one per collection), which are ingested into the database upon commit,
+// bypassing the memtables and WAL. If a key isn't greater than its
+// predecessor in the same collection, the current file is ingested and a new
+// one begun; the later write still takes precedence.
+class SortedWriteBatch : public KeyValue::WriteBatch {
+private:
+    struct sst_file {
+        std::unique_ptr<rocksdb::SstFileWriter> writer;
+        std::string path, last_key;
+    };
+
+    rocksdb::DB* db_;
+    const std::string dir_;
+    std::map<rocksdb::ColumnFamilyHandle*, sst_file> files_;
+    std::mutex mu_;
+
+    // No copying allowed
+    SortedWriteBatch(const SortedWriteBatch&) = delete;
+    void operator=(const SortedWriteBatch&) = delete;
+
+    Status ingest(rocksdb::ColumnFamilyHandle* coll, sst_file& f) {
+        assert(f.writer);
+        rocksdb::Status s = f.writer->Finish();
+        f.writer.reset();
+        if (s.ok()) {
+            rocksdb::IngestExternalFileOptions opts;
+            opts.move_files = true;
+            opts.allow_blocking_flush = true;
+            s = db_->IngestExternalFile(coll, {f.path}, opts);
+        }
+        unlink(f.path.c_str());
+        return convertStatus(s);
+    }
+
+public:
+    SortedWriteBatch(rocksdb::DB* db, const std::string& dir)
+        : db_(db), dir_(dir) {}
+
+    ~SortedWriteBatch() {
+        // discard any uncommitted files
+        for (auto& p : files_) {
+            if (p.second.writer) {
+                p.second.writer.reset();
+                unlink(p.second.path.c_str());
+            }
+        }
+    }
+
+    Status put(KeyValue::CollectionHandle _coll,
+               const std::string& key,
+               const KeyValue::Data& value) override {
+        static std::atomic<uint64_t> file_counter(0);
+        auto coll = reinterpret_cast<rocksdb::ColumnFamilyHandle*>(_coll);
+        Status s;
+        std::lock_guard<std::mutex> lock(mu_);
+        sst_file& f = files_[coll];
+        if (f.writer && key <= f.last_key) {
+            S(ingest(coll, f));
+        }
+        if (!f.writer) {
+            std::ostringstream path;
+            path << dir_ << "/GLnexus_ingest." << getpid() << "." << file_counter++ << ".sst";
+            f.path = path.str();
+            f.writer.reset(new rocksdb::SstFileWriter(rocksdb::EnvOptions(), db_->GetOptions(coll), coll));
+            rocksdb::Status rs = f.writer->Open(f.path);
+            if (!rs.ok()) {
+                f.writer.reset();
+                return convertStatus(rs);
+            }
+        }
+        S(convertStatus(f.writer->Put(key, rocksdb::Slice(value.data, value.size))));
+        f.last_key = key;
+        return Status::OK();
+    }
+
+    Status commit() override {
+        Status s;
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto& p : files_) {
+            if (p.second.writer) {
+                S(ingest(p.first, p.second));
+            }
+        }
+        return Status::OK();
+    }
+};
+
 class DB : public KeyValue::DB {
 private:
     rocksdb::DB* db_;
+    std::string dbpath_;
     std::map<const std::string, rocksdb::ColumnFamilyHandle*> coll2handle_;
     OpenMode mode_;
     prefix_spec prefix_spec_;
     size_t mem_budget_ = 0;
+    size_t compression_dict_bytes_ = 0;
+    std::set<std::string> dict_collections_;
     rocksdb::WriteOptions write_options_, batch_write_options_;
     std::shared_ptr<rocksdb::Cache> block_cache_;
+    std::shared_ptr<rocksdb::Statistics> statistics_;
+    memory_budget* budget_ = nullptr;
+    size_t budget_reserved_ = 0; // block cache capacity reserved from budget_
 
     // No copying allowed
     DB(const DB&);
     void operator=(const DB&);
 
-    DB(rocksdb::DB *db, std::map<const std::string, rocksdb::ColumnFamilyHandle*>& coll2handle,
-       OpenMode mode, prefix_spec* pfx, size_t mem_budget, std::shared_ptr<rocksdb::Cache> block_cache)
-        : db_(db), coll2handle_(std::move(coll2handle)),
-          mode_(mode), mem_budget_(mem_budget), block_cache_(block_cache) {
-            if (pfx) {
-                prefix_spec_ = *pfx;
+    DB(rocksdb::DB *db, const std::string& dbpath,
+       std::map<const std::string, rocksdb::ColumnFamilyHandle*>& coll2handle,
+       const config& opt, size_t mem_budget, std::shared_ptr<rocksdb::Cache> block_cache,
+       size_t budget_reserved, std::shared_ptr<rocksdb::Statistics> statistics)
+        : db_(db), dbpath_(dbpath), coll2handle_(std::move(coll2handle)),
+          mode_(opt.mode), mem_budget_(mem_budget),
+          compression_dict_bytes_(opt.compression_dict_bytes), dict_collections_(opt.dict_collections),
+          block_cache_(block_cache), statistics_(statistics),
+          budget_(opt.budget), budget_reserved_(budget_reserved) {
+            if (opt.pfx) {
+                prefix_spec_ = *opt.pfx;
             }
             // prepare write options
             if (mode_ == OpenMode::BULK_LOAD) {
@@ -386,8 +579,8 @@ public:
         if (opt.mode != OpenMode::NORMAL && opt.mode != OpenMode::BULK_LOAD) {
             return Status::Invalid("RocksKeyValue::Initialize: invalid open mode");
         }
-        size_t mem_budget = calculate_mem_budget(opt.mem_budget);
-        auto block_cache = NewBlockCache(opt.mode, mem_budget);
+        size_t mem_budget = db_mem_budget(opt), budget_reserved = 0;
+        auto block_cache = NewBlockCache(opt.mode, mem_budget, opt.budget, budget_reserved);
         rocksdb::Options options;
         ApplyDBOptions(opt.mode, mem_budget, opt.thread_budget, block_cache, options);
         options.create_if_missing = true;
@@ -396,12 +589,16 @@ public:
         rocksdb::DB *rawdb = nullptr;
         rocksdb::Status s = rocksdb::DB::Open(options, dbPath, &rawdb);
         if (!s.ok()) {
+            if (opt.budget) {
+                opt.budget->unreserve(budget_reserved);
+            }
             return convertStatus(s);
         }
         assert(rawdb != nullptr);
 
         std::map<const std::string, rocksdb::ColumnFamilyHandle*> coll2handle;
-        db.reset(new DB(rawdb, coll2handle, opt.mode, opt.pfx, mem_budget, block_cache));
+        db.reset(new DB(rawdb, dbPath, coll2handle, opt, mem_budget, block_cache,
+                        budget_reserved, options.statistics));
         if (!db) {
             delete rawdb;
             return Status::Failure();
@@ -412,8 +609,8 @@ public:
     static Status Open(const std::string& dbPath, const config& opt,
                        std::unique_ptr<KeyValue::DB> &db) {
         // prepare options
-        size_t mem_budget = calculate_mem_budget(opt.mem_budget);
-        auto block_cache = NewBlockCache(opt.mode, mem_budget);
+        size_t mem_budget = db_mem_budget(opt), budget_reserved = 0;
+        auto block_cache = NewBlockCache(opt.mode, mem_budget, opt.budget, budget_reserved);
         rocksdb::Options options;
         ApplyDBOptions(opt.mode, mem_budget, opt.thread_budget, block_cache, options);
         options.create_if_missing = false;
@@ -422,6 +619,9 @@ public:
         std::vector<std::string> column_family_names;
         rocksdb::Status s = rocksdb::DB::ListColumnFamilies(options, dbPath, &column_family_names);
         if (!s.ok()) {
+            if (opt.budget) {
+                opt.budget->unreserve(budget_reserved);
+            }
             return convertStatus(s);
         }
         std::vector<rocksdb::ColumnFamilyDescriptor> column_families;
@@ -431,7 +631,8 @@ public:
             if (opt.pfx && nm == opt.pfx->first) {
                 effective_pfx = opt.pfx->second;
             }
-            ApplyColumnFamilyOptions(opt.mode, effective_pfx, mem_budget, block_cache, colopts);
+            ApplyColumnFamilyOptions(opt.mode, effective_pfx, mem_budget, block_cache, colopts,
+                                     opt.dict_collections.count(nm) ? opt.compression_dict_bytes : 0);
             rocksdb::ColumnFamilyDescriptor cfd;
             cfd.name = nm;
             cfd.options = colopts;
@@ -450,6 +651,9 @@ public:
                                   &column_family_handles, &rawdb);
         }
         if (!s.ok()) {
+            if (opt.budget) {
+                opt.budget->unreserve(budget_reserved);
+            }
             return convertStatus(s);
         }
         assert(rawdb != nullptr);
@@ -459,7 +663,8 @@ public:
         for (size_t i = 0; i < column_families.size(); i++) {
             coll2handle[column_family_names[i]] = column_family_handles[i];
         }
-        db.reset(new DB(rawdb, coll2handle, opt.mode, opt.pfx, mem_budget, block_cache));
+        db.reset(new DB(rawdb, dbPath, coll2handle, opt, mem_budget, block_cache,
+                        budget_reserved, options.statistics));
         if (!db) {
             for (auto h : column_family_handles) {
                 delete h;
@@ -497,6 +702,10 @@ public:
         }
         // delete database
         delete db_;
+        if (budget_) {
+            block_cache_.reset();
+            budget_->unreserve(budget_reserved_);
+        }
     }
 
     Status collection(const std::string& name,
@@ -521,7 +730,8 @@ public:
         if (name == prefix_spec_.first) {
             pfx = prefix_spec_.second;
         }
-        ApplyColumnFamilyOptions(mode_, pfx, mem_budget_, block_cache_, colopts);
+        ApplyColumnFamilyOptions(mode_, pfx, mem_budget_, block_cache_, colopts,
+                                 dict_collections_.count(name) ? compression_dict_bytes_ : 0);
         rocksdb::ColumnFamilyHandle *handle;
         rocksdb::Status s = db_->CreateColumnFamily(colopts, name, &handle);
         if (!s.ok()) {
@@ -545,6 +755,14 @@ public:
         return Status::OK();
     }
 
+    Status begin_sorted_writes(std::unique_ptr<KeyValue::WriteBatch>& writes) override {
+        if (mode_ != OpenMode::BULK_LOAD) {
+            return Status::NotImplemented();
+        }
+        writes = std::make_unique<RocksKeyValue::SortedWriteBatch>(db_, dbpath_);
+        return Status::OK();
+    }
+
     Status get0(KeyValue::CollectionHandle _coll,
                 const std::string& key,
                 std::shared_ptr<KeyValue::Data>& value) const override {
@@ -556,6 +774,13 @@ public:
         return convertStatus(s);
     }
 
+    Status multi_get0(KeyValue::CollectionHandle _coll,
+                      const std::vector<std::string>& keys,
+                      std::vector<std::shared_ptr<KeyValue::Data>>& values,
+                      std::vector<Status>& statuses) const override {
+        return MultiGet(db_, reinterpret_cast<rocksdb::ColumnFamilyHandle*>(_coll), keys, values, statuses);
+    }
+
     Status put(KeyValue::CollectionHandle _coll,
                const std::string& key,
                const KeyValue::Data& value) override {
@@ -577,6 +802,19 @@ public:
         }
         return Status::OK();
     }
+
+    Status statistics(std::map<std::string,uint64_t>& ans) const override {
+        ans.clear();
+        if (statistics_) {
+            for (const auto& p : rocksdb::TickersNameMap) {
+                uint64_t v = statistics_->getTickerCount(p.first);
+                if (v) {
+                    ans[p.second] = v;
+                }
+            }
+        }
+        return Status::OK();
+    }
 };
 
 Status Initialize(const std::string& dbPath, const config& opt, std::unique_ptr<KeyValue::DB>& db)
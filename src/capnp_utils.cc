@@ -0,0 +1,126 @@
+#include "capnp_utils.h"
+#include <assert.h>
+
+using namespace std;
+
+namespace GLnexus {
+
+void capnp_of_range(const range& r, capnp::Range::Builder b) {
+    b.setRid(r.rid);
+    b.setBeg(r.beg);
+    b.setEnd(r.end);
+}
+
+Status range_of_capnp(capnp::Range::Reader r, const vector<pair<string,size_t>>& contigs,
+                      range& ans) {
+    if (r.getRid() < 0 || (size_t) r.getRid() >= contigs.size() || r.getBeg() < 0 || r.getBeg() > r.getEnd()) {
+        return Status::Invalid("invalid range in binary input",
+                               std::to_string(r.getRid()) + ":" + std::to_string(r.getBeg()) + "-" + std::to_string(r.getEnd()));
+    }
+    ans = range(r.getRid(), r.getBeg(), r.getEnd());
+    return Status::OK();
+}
+
+string string_of_capnp(::capnp::Text::Reader t) {
+    return string(t.cStr(), t.size());
+}
+
+void capnp_of_contigs(const vector<pair<string,size_t>>& contigs,
+                      ::capnp::List<capnp::Contig>::Builder b) {
+    assert(b.size() == contigs.size());
+    for (size_t i = 0; i < contigs.size(); i++) {
+        b[i].setName(contigs[i].first.c_str());
+        b[i].setSize(contigs[i].second);
+    }
+}
+
+void contigs_of_capnp(::capnp::List<capnp::Contig>::Reader r,
+                      vector<pair<string,size_t>>& contigs) {
+    contigs.clear();
+    for (auto c : r) {
+        contigs.push_back(make_pair(string_of_capnp(c.getName()), (size_t) c.getSize()));
+    }
+}
+
+void capnp_of_unified_site(const unified_site& us, capnp::UnifiedSite::Builder b) {
+    capnp_of_range(us.pos, b.initRange());
+    if (us.in_target.rid >= 0) {
+        capnp_of_range(us.in_target, b.initInTarget());
+    }
+    auto als = b.initAlleles(us.alleles.size());
+    for (size_t j = 0; j < us.alleles.size(); j++) {
+        const auto& ua = us.alleles[j];
+        als[j].setDna(ua.dna.c_str());
+        capnp_of_range(ua.normalized.pos, als[j].initNormalizedRange());
+        als[j].setNormalizedDna(ua.normalized.dna.c_str());
+        als[j].setQuality(ua.quality);
+        als[j].setFrequency(ua.frequency);
+    }
+    // omit the implicit unification entries, as in unified_site::yaml
+    vector<pair<allele,int>> u;
+    for (const auto& up : us.unification) {
+        const auto& al = us.alleles.at(up.second);
+        if (up.first != allele(us.pos, al.dna) && up.first != al.normalized) {
+            u.push_back(up);
+        }
+    }
+    auto ents = b.initUnification(u.size());
+    for (size_t j = 0; j < u.size(); j++) {
+        capnp_of_range(u[j].first.pos, ents[j].initRange());
+        ents[j].setDna(u[j].first.dna.c_str());
+        ents[j].setTo(u[j].second);
+    }
+    b.setLostAlleleFrequency(us.lost_allele_frequency);
+    b.setQual(us.qual);
+    b.setMonoallelic(us.monoallelic);
+}
+
+Status unified_site_of_capnp(capnp::UnifiedSite::Reader r,
+                             const vector<pair<string,size_t>>& contigs,
+                             unified_site& ans) {
+    Status s;
+    range pos(-1,-1,-1);
+    S(range_of_capnp(r.getRange(), contigs, pos));
+    unified_site us(pos);
+    #define VR(pred,msg) if (!(pred)) return Status::Invalid("unified_site_of_capnp: " msg, pos.str(contigs))
+    if (r.hasInTarget()) {
+        S(range_of_capnp(r.getInTarget(), contigs, us.in_target));
+    }
+    for (auto a : r.getAlleles()) {
+        string dna = string_of_capnp(a.getDna());
+        VR(dna.size() > 0 && is_iupac_nucleotides(dna), "invalid allele dna");
+        unified_allele ua(pos, dna);
+        S(range_of_capnp(a.getNormalizedRange(), contigs, ua.normalized.pos));
+        ua.normalized.dna = string_of_capnp(a.getNormalizedDna());
+        VR(ua.normalized.dna.size() > 0 && is_iupac_nucleotides(ua.normalized.dna), "invalid normalized allele dna");
+        ua.quality = a.getQuality();
+        ua.frequency = a.getFrequency();
+        us.alleles.push_back(move(ua));
+    }
+    VR(us.alleles.size() >= 2, "not enough alleles");
+
+    us.fill_implicit_unification();
+    for (auto e : r.getUnification()) {
+        range urange(-1,-1,-1);
+        S(range_of_capnp(e.getRange(), contigs, urange));
+        VR(urange.rid == pos.rid, "unification entry is on different contig than site");
+        string dna = string_of_capnp(e.getDna());
+        VR(dna.size() > 0 && is_iupac_nucleotides(dna), "invalid dna in unification entry");
+        int to = e.getTo();
+        VR(to >= 0 && to < us.alleles.size(), "invalid 'to' field in unification entry");
+        allele al(urange, dna);
+        auto up = us.unification.find(al);
+        VR(up == us.unification.end() || up->second == to, "inconsistent unification entries");
+        us.unification[al] = to;
+    }
+
+    us.lost_allele_frequency = r.getLostAlleleFrequency();
+    us.qual = r.getQual();
+    VR(us.qual >= 0, "invalid 'qual' field");
+    us.monoallelic = r.getMonoallelic();
+    #undef VR
+    ans = move(us);
+    return Status::OK();
+}
+
+} // namespace GLnexus
@@ -0,0 +1,35 @@
+// Helpers for converting GLnexus types to/from their capnp representations
+// (see capnp/serialize/defs.capnp), shared by the binary intermediate files
+// and the binary residuals.
+
+#ifndef GLNEXUS_CAPNP_UTILS_H
+#define GLNEXUS_CAPNP_UTILS_H
+
+#include <capnp/message.h>
+#include <defs.capnp.h>
+#include "types.h"
+
+namespace GLnexus {
+
+void capnp_of_range(const range& r, capnp::Range::Builder b);
+
+// Validates the range against the contigs
+Status range_of_capnp(capnp::Range::Reader r, const std::vector<std::pair<std::string,size_t>>& contigs,
+                      range& ans);
+
+std::string string_of_capnp(::capnp::Text::Reader t);
+
+void capnp_of_contigs(const std::vector<std::pair<std::string,size_t>>& contigs,
+                      ::capnp::List<capnp::Contig>::Builder b);
+void contigs_of_capnp(::capnp::List<capnp::Contig>::Reader r,
+                      std::vector<std::pair<std::string,size_t>>& contigs);
+
+// The implicit unification entries are omitted, as in unified_site::yaml
+void capnp_of_unified_site(const unified_site& us, capnp::UnifiedSite::Builder b);
+Status unified_site_of_capnp(capnp::UnifiedSite::Reader r,
+                             const std::vector<std::pair<std::string,size_t>>& contigs,
+                             unified_site& ans);
+
+} // namespace GLnexus
+
+#endif
@@ -1,13 +1,19 @@
 #include "cli_utils.h"
 #include "ctpl_stl.h"
+#include "executor.h"
+#include <condition_variable>
+#include <cstring>
 #include <exception>
 #include <fts.h>
 #include <fstream>
 #include <iostream>
 #include <regex>
 #include <sstream>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include "crc32c.h"
 #include "service.h"
@@ -15,6 +21,14 @@
 #include "spdlog/sinks/null_sink.h"
 
 #include "BCFKeyValueData.h"
+#include "MmapKeyValue.h"
+#include "tbx.h"
+#include "thread_pool.h"
+#include <capnp/message.h>
+#include <capnp/serialize-packed.h>
+#include <kj/std/iostream.h>
+#include <defs.capnp.h>
+#include "capnp_utils.h"
 
 // This file has utilities employed by the glnexus applet.
 using namespace std;
@@ -437,6 +451,343 @@ Status unified_sites_of_yaml_stream(std::istream &is,
     return Status::OK();
 }
 
+// Binary serialization of discovered alleles & unified sites, as a stream of
+// packed capnp IntermediateMessages (see capnp/serialize/defs.capnp): a
+// header, chunks of entries, and an eof message.
+
+static const uint16_t intermediate_format_version = 1;
+static const size_t intermediate_chunk_size = 4096;
+
+static Status capnp_write_header(kj::OutputStream& out, unsigned N,
+                                 const vector<pair<string,size_t>>& contigs) {
+    ::capnp::MallocMessageBuilder message;
+    auto hdr = message.initRoot<capnp::IntermediateMessage>().initHeader();
+    hdr.setVersion(intermediate_format_version);
+    hdr.setSampleCount(N);
+    capnp_of_contigs(contigs, hdr.initContigs(contigs.size()));
+    ::capnp::writePackedMessage(out, message);
+    return Status::OK();
+}
+
+static void capnp_write_eof(kj::OutputStream& out) {
+    ::capnp::MallocMessageBuilder message;
+    message.initRoot<capnp::IntermediateMessage>().setEof();
+    ::capnp::writePackedMessage(out, message);
+}
+
+static Status capnp_read_header(kj::BufferedInputStream& in, unsigned& N,
+                                vector<pair<string,size_t>>& contigs) {
+    ::capnp::PackedMessageReader message(in);
+    auto msg = message.getRoot<capnp::IntermediateMessage>();
+    if (!msg.isHeader()) {
+        return Status::Invalid("binary input lacks header");
+    }
+    auto hdr = msg.getHeader();
+    if (hdr.getVersion() != intermediate_format_version) {
+        return Status::Invalid("unsupported binary input format version", std::to_string(hdr.getVersion()));
+    }
+    N = hdr.getSampleCount();
+    contigs_of_capnp(hdr.getContigs(), contigs);
+    return Status::OK();
+}
+
+// Serialize N (sample count), contigs, and discovered alleles in binary form,
+// in a streaming fashion.
+Status capnp_stream_of_discovered_alleles(unsigned N, const vector<pair<string,size_t>> &contigs,
+                                          const discovered_alleles &dsals,
+                                          std::ostream &os) {
+    Status s;
+    try {
+        kj::std::StdOutputStream out(os);
+        S(capnp_write_header(out, N, contigs));
+
+        for (auto p = dsals.begin(); p != dsals.end(); ) {
+            size_t n = std::min(intermediate_chunk_size, (size_t) (dsals.end() - p));
+            ::capnp::MallocMessageBuilder message;
+            auto entries = message.initRoot<capnp::IntermediateMessage>().initDiscoveredAlleles(n);
+            for (size_t i = 0; i < n; i++, p++) {
+                UNPAIR(*p, al, ai)
+                auto b = entries[i];
+                capnp_of_range(al.pos, b.initRange());
+                b.setDna(al.dna.c_str());
+                b.setIsRef(ai.is_ref);
+                b.setAllFiltered(ai.all_filtered);
+                unsigned nAQ;
+                for (nAQ = 0; nAQ < top_AQ::COUNT && ai.topAQ.V[nAQ] >= 0; nAQ++);
+                auto aq = b.initTopAQ(nAQ);
+                for (unsigned j = 0; j < nAQ; j++) {
+                    aq.set(j, ai.topAQ.V[j]);
+                }
+                auto z = b.initZygosityByGQ(zygosity_by_GQ::GQ_BANDS * zygosity_by_GQ::PLOIDY);
+                for (unsigned j = 0; j < zygosity_by_GQ::GQ_BANDS; j++) {
+                    for (unsigned k = 0; k < zygosity_by_GQ::PLOIDY; k++) {
+                        z.set(j*zygosity_by_GQ::PLOIDY + k, ai.zGQ.M[j][k]);
+                    }
+                }
+                if (ai.in_target.rid >= 0) {
+                    capnp_of_range(ai.in_target, b.initInTarget());
+                }
+            }
+            ::capnp::writePackedMessage(out, message);
+        }
+
+        capnp_write_eof(out);
+    } catch (kj::Exception& exn) {
+        return Status::IOError("writing binary discovered alleles", exn.getDescription().cStr());
+    }
+    return os.good() ? Status::OK() : Status::IOError("writing binary discovered alleles");
+}
+
+// Decode a chunk of discovered alleles, adding them to dsals
+static Status discovered_alleles_of_capnp(::capnp::List<capnp::DiscoveredAllele>::Reader entries,
+                                          const vector<pair<string,size_t>> &contigs,
+                                          discovered_alleles &dsals) {
+    Status s;
+    dsals.reserve(dsals.size() + entries.size());
+    for (auto r : entries) {
+        range rng(-1,-1,-1);
+        S(range_of_capnp(r.getRange(), contigs, rng));
+        string dna = string_of_capnp(r.getDna());
+        if (dna.empty() || !is_iupac_nucleotides(dna)) {
+            return Status::Invalid("invalid allele DNA in binary discovered alleles", rng.str(contigs));
+        }
+
+        discovered_allele_info ai;
+        ai.is_ref = r.getIsRef();
+        ai.all_filtered = r.getAllFiltered();
+        auto aq = r.getTopAQ();
+        auto z = r.getZygosityByGQ();
+        if (aq.size() > top_AQ::COUNT || z.size() != zygosity_by_GQ::GQ_BANDS * zygosity_by_GQ::PLOIDY) {
+            return Status::Invalid("unexpected top_AQ/zygosity_by_GQ size in binary discovered alleles", rng.str(contigs));
+        }
+        for (unsigned j = 0; j < aq.size(); j++) {
+            if (aq[j] < 0) {
+                return Status::Invalid("invalid entry in top_AQ", rng.str(contigs));
+            }
+            ai.topAQ.V[j] = aq[j];
+        }
+        for (unsigned j = 0; j < zygosity_by_GQ::GQ_BANDS; j++) {
+            for (unsigned k = 0; k < zygosity_by_GQ::PLOIDY; k++) {
+                ai.zGQ.M[j][k] = z[j*zygosity_by_GQ::PLOIDY + k];
+            }
+        }
+        if (r.hasInTarget()) {
+            S(range_of_capnp(r.getInTarget(), contigs, ai.in_target));
+        }
+
+        if (!dsals.insert(make_pair(allele(rng, dna), ai)).second) {
+            return Status::Invalid("duplicate alleles in binary discovered alleles", rng.str(contigs));
+        }
+    }
+    return Status::OK();
+}
+
+// Load discovered alleles previously serialized with the above function
+Status discovered_alleles_of_capnp_stream(std::istream &is,
+                                          unsigned &N, vector<pair<string,size_t>> &contigs,
+                                          discovered_alleles &dsals) {
+    Status s;
+    contigs.clear();
+    dsals.clear();
+    try {
+        kj::std::StdInputStream in(is);
+        kj::BufferedInputStreamWrapper buffered(in);
+        S(capnp_read_header(buffered, N, contigs));
+        if (contigs.size() == 0) {
+            return Status::Invalid("Empty contigs");
+        }
+
+        while (true) {
+            ::capnp::PackedMessageReader message(buffered);
+            auto msg = message.getRoot<capnp::IntermediateMessage>();
+            if (msg.isEof()) {
+                break;
+            }
+            if (!msg.isDiscoveredAlleles()) {
+                return Status::Invalid("unexpected message in binary discovered alleles");
+            }
+            S(discovered_alleles_of_capnp(msg.getDiscoveredAlleles(), contigs, dsals));
+        }
+    } catch (kj::Exception& exn) {
+        return Status::Invalid("reading binary discovered alleles", exn.getDescription().cStr());
+    }
+    return Status::OK();
+}
+
+// Reads a file of (capnp) discovered alleles one chunk at a time, for merging
+// files too large to load
+class discovered_alleles_file_reader {
+    string filename_;
+    ifstream ifs_;
+    unique_ptr<kj::std::StdInputStream> in_;
+    unique_ptr<kj::BufferedInputStreamWrapper> buffered_;
+    vector<pair<string,size_t>> contigs_;
+    unsigned N_ = 0;
+    bool eof_ = false;
+    discovered_alleles chunk_;
+    discovered_alleles::iterator pos_;
+    unique_ptr<allele> last_; // the last allele of the previous chunk
+
+    // read chunks until a nonempty one or eof, checking that the alleles
+    // remain in order (the entries of each chunk being sorted as decoded)
+    Status read_chunk() {
+        Status s;
+        chunk_.clear();
+        try {
+            while (chunk_.empty() && !eof_) {
+                ::capnp::PackedMessageReader message(*buffered_);
+                auto msg = message.getRoot<capnp::IntermediateMessage>();
+                if (msg.isEof()) {
+                    eof_ = true;
+                } else if (!msg.isDiscoveredAlleles()) {
+                    return Status::Invalid("unexpected message in binary discovered alleles", filename_);
+                } else {
+                    S(discovered_alleles_of_capnp(msg.getDiscoveredAlleles(), contigs_, chunk_));
+                }
+            }
+        } catch (kj::Exception& exn) {
+            return Status::Invalid("reading binary discovered alleles", filename_ + " " + exn.getDescription().cStr());
+        }
+        pos_ = chunk_.begin();
+        if (!chunk_.empty()) {
+            if (last_ && !(*last_ < chunk_.begin()->first)) {
+                return Status::Invalid("binary discovered alleles are out of order", filename_);
+            }
+            last_.reset(new allele((chunk_.end()-1)->first));
+        }
+        return Status::OK();
+    }
+
+public:
+    Status open(const string& filename) {
+        Status s;
+        filename_ = filename;
+        ifs_.open(filename, std::ifstream::in | std::ifstream::binary);
+        if (!ifs_.good()) {
+            return Status::IOError("could not open file for reading", filename);
+        }
+        try {
+            in_.reset(new kj::std::StdInputStream(ifs_));
+            buffered_.reset(new kj::BufferedInputStreamWrapper(*in_));
+            S(capnp_read_header(*buffered_, N_, contigs_));
+        } catch (kj::Exception& exn) {
+            return Status::Invalid("reading binary discovered alleles", filename + " " + exn.getDescription().cStr());
+        }
+        return read_chunk();
+    }
+
+    const vector<pair<string,size_t>>& contigs() const { return contigs_; }
+    unsigned sample_count() const { return N_; }
+
+    // whether there's a current allele, and if so, it
+    bool valid() const { return pos_ != chunk_.end(); }
+    discovered_alleles::value_type& current() { assert(valid()); return *pos_; }
+
+    // advance to the next allele (the current one may have been moved from)
+    Status next() {
+        assert(valid());
+        if (++pos_ == chunk_.end()) {
+            return read_chunk();
+        }
+        return Status::OK();
+    }
+};
+
+// Write the discovered alleles to a file, in binary form
+Status capnp_write_discovered_alleles_to_file(const discovered_alleles &dsals,
+                                              const vector<pair<string,size_t>> &contigs,
+                                              unsigned int sample_count,
+                                              const string &filename) {
+    Status s;
+
+    ofstream ofs(filename, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+    if (!ofs.good())
+        return Status::IOError("could not open file for writing", filename);
+    S(capnp_stream_of_discovered_alleles(sample_count, contigs, dsals, ofs));
+    ofs.close();
+
+    return Status::OK();
+}
+
+// Serialize the unified sites in binary form
+Status capnp_stream_of_unified_sites(const vector<unified_site> &sites,
+                                     const vector<pair<string,size_t>> &contigs,
+                                     std::ostream &os) {
+    Status s;
+    try {
+        kj::std::StdOutputStream out(os);
+        S(capnp_write_header(out, 0, contigs));
+
+        for (size_t p = 0; p < sites.size(); ) {
+            size_t n = std::min(intermediate_chunk_size, sites.size() - p);
+            ::capnp::MallocMessageBuilder message;
+            auto entries = message.initRoot<capnp::IntermediateMessage>().initUnifiedSites(n);
+            for (size_t i = 0; i < n; i++, p++) {
+                capnp_of_unified_site(sites[p], entries[i]);
+            }
+            ::capnp::writePackedMessage(out, message);
+        }
+
+        capnp_write_eof(out);
+    } catch (kj::Exception& exn) {
+        return Status::IOError("writing binary unified sites", exn.getDescription().cStr());
+    }
+    return os.good() ? Status::OK() : Status::IOError("writing binary unified sites");
+}
+
+// Write the unified sites to a file, in binary form
+Status capnp_write_unified_sites_to_file(const vector<unified_site> &sites,
+                                         const vector<pair<string,size_t>> &contigs,
+                                         const string &filename) {
+    Status s;
+
+    ofstream ofs(filename, std::ofstream::out | std::ofstream::trunc | std::ofstream::binary);
+    if (!ofs.good())
+        return Status::IOError("could not open file for writing", filename);
+    S(capnp_stream_of_unified_sites(sites, contigs, ofs));
+    ofs.close();
+
+    return Status::OK();
+}
+
+// Load unified sites previously serialized with the above function
+Status unified_sites_of_capnp_stream(std::istream &is,
+                                     const vector<pair<string,size_t>> &contigs,
+                                     vector<unified_site> &sites) {
+    Status s;
+    sites.clear();
+    try {
+        kj::std::StdInputStream in(is);
+        kj::BufferedInputStreamWrapper buffered(in);
+        unsigned N;
+        vector<pair<string,size_t>> file_contigs;
+        S(capnp_read_header(buffered, N, file_contigs));
+        if (file_contigs != contigs) {
+            return Status::Invalid("contigs in binary unified sites don't match");
+        }
+
+        while (true) {
+            ::capnp::PackedMessageReader message(buffered);
+            auto msg = message.getRoot<capnp::IntermediateMessage>();
+            if (msg.isEof()) {
+                break;
+            }
+            if (!msg.isUnifiedSites()) {
+                return Status::Invalid("unexpected message in binary unified sites");
+            }
+            sites.reserve(sites.size() + msg.getUnifiedSites().size());
+            for (auto r : msg.getUnifiedSites()) {
+                unified_site us(range(-1,-1,-1));
+                S(unified_site_of_capnp(r, contigs, us));
+                sites.push_back(move(us));
+            }
+        }
+    } catch (kj::Exception& exn) {
+        return Status::Invalid("reading binary unified sites", exn.getDescription().cStr());
+    }
+    return Status::OK();
+}
+
 // Check if a file exists
 bool check_file_exists(const string &filename) {
     ifstream ifs(filename);
@@ -1296,13 +1647,143 @@ RocksKeyValue::prefix_spec* GLnexus_prefix_spec() {
     return p.get();
 }
 
+// Compress the bucket collections (bcf and the variant record index) with
+// trained dictionaries of this size, if nonzero
+static void set_compression_dict(RocksKeyValue::config& cfg, size_t compression_dict_bytes) {
+    cfg.compression_dict_bytes = compression_dict_bytes;
+    if (compression_dict_bytes) {
+        cfg.dict_collections = { "bcf", "bcf_variants" };
+    }
+}
+
+// Reserve from the budget the memory retained by the free lists of recycled
+// records (bcf_init_pooled) of the threads handling records: the nr_threads
+// workers, plus the calling thread and the output writer
+static void reserve_bcf_pools(memory_budget& budget, size_t nr_threads) {
+    budget.reserve((nr_threads + 2) * BCF_POOL_MAX_BYTES);
+}
+
+// Open a database for reading: a database image (see db_image) if dbpath is
+// one, otherwise the RocksDB database in read-only mode (its block cache
+// drawing from budget, if provided)
+static Status open_db_read_only(const string& dbpath, size_t mem_budget, size_t nr_threads,
+                                unique_ptr<KeyValue::DB>& db, memory_budget* budget = nullptr) {
+    if (MmapKeyValue::IsImage(dbpath)) {
+        return MmapKeyValue::Open(dbpath, db);
+    }
+    RocksKeyValue::config cfg;
+    cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
+    cfg.pfx = GLnexus_prefix_spec();
+    cfg.mem_budget = mem_budget;
+    cfg.thread_budget = nr_threads;
+    cfg.budget = budget;
+    return RocksKeyValue::Open(dbpath, cfg, db);
+}
+
 
 // Initialize a database
+// Count the exemplar gVCF's records on each contig; from its index, if it has
+// one, otherwise by reading through it.
+static Status count_contig_records(const string& gvcf, vcfFile* vcf, const bcf_hdr_t* hdr,
+                                   size_t ncontigs, vector<uint64_t>& counts) {
+    counts.assign(ncontigs, 0);
+    const htsFormat* fmt = hts_get_format(vcf);
+    hts_idx_t* idx = nullptr;
+    tbx_t* tbx = nullptr;
+    if (fmt->format == bcf) {
+        idx = bcf_index_load(gvcf.c_str());
+    } else if (fmt->compression == bgzf) {
+        tbx = tbx_index_load(gvcf.c_str());
+    }
+    if (idx || tbx) {
+        int n = 0;
+        const char** names = idx ? bcf_index_seqnames(idx, hdr, &n) : tbx_seqnames(tbx, &n);
+        bool complete = true;
+        for (int i = 0; i < n; i++) {
+            uint64_t mapped = 0, unmapped = 0;
+            int rid = bcf_hdr_name2id(hdr, names[i]);
+            int tid = idx ? rid : i;
+            if (hts_idx_get_stat(idx ? idx : tbx->idx, tid, &mapped, &unmapped) < 0) {
+                complete = false;
+            } else if (rid >= 0 && rid < (int) ncontigs) {
+                counts[rid] = mapped;
+            }
+        }
+        free(names);
+        if (idx) hts_idx_destroy(idx);
+        if (tbx) tbx_destroy(tbx);
+        if (complete) {
+            return Status::OK();
+        }
+        counts.assign(ncontigs, 0);
+    }
+
+    unique_ptr<bcf1_t, void(*)(bcf1_t*)> rec(bcf_init(), &bcf_destroy);
+    int c;
+    while ((c = bcf_read(vcf, hdr, rec.get())) == 0) {
+        if (rec->rid >= 0 && rec->rid < (int) ncontigs) {
+            counts[rec->rid]++;
+        }
+    }
+    if (c != -1) {
+        return Status::IOError("reading exemplar gVCF", gvcf);
+    }
+    return Status::OK();
+}
+
+Status adaptive_bucket_lengths(std::shared_ptr<spdlog::logger> logger,
+                               const string &exemplar_gvcf,
+                               const vector<pair<string,size_t>> &contigs,
+                               size_t bucket_size,
+                               vector<int> &ans) {
+    Status s;
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(exemplar_gvcf.c_str(), "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    if (!vcf) {
+        return Status::IOError("Failed to open exemplar gVCF file at ", exemplar_gvcf);
+    }
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    if (!hdr) {
+        return Status::IOError("Failed to read gVCF file header from", exemplar_gvcf);
+    }
+    vector<uint64_t> counts;
+    S(count_contig_records(exemplar_gvcf, vcf.get(), hdr.get(), contigs.size(), counts));
+
+    // mean density over the contigs with records
+    uint64_t total_records = 0, total_len = 0;
+    for (size_t rid = 0; rid < contigs.size(); rid++) {
+        if (counts[rid]) {
+            total_records += counts[rid];
+            total_len += contigs[rid].second;
+        }
+    }
+
+    // size each contig's buckets to hold about as many records as a
+    // bucket_size bucket would at the mean density, within a factor of 8
+    const size_t min_len = std::max(bucket_size / 8, size_t(1));
+    const size_t max_len = std::min(bucket_size * 8, size_t(1000000000));
+    ans.clear();
+    for (size_t rid = 0; rid < contigs.size(); rid++) {
+        size_t len = max_len;
+        if (counts[rid] && total_records) {
+            double records_per_bucket = double(bucket_size) * total_records / total_len;
+            len = size_t(records_per_bucket * contigs[rid].second / counts[rid]);
+            len = std::min(std::max(len, min_len), max_len);
+            if (len >= 1000) {
+                len = len / 1000 * 1000;
+            }
+        }
+        ans.push_back(int(len));
+    }
+    return Status::OK();
+}
+
 Status db_init(std::shared_ptr<spdlog::logger> logger,
                const string &dbpath,
                const string &exemplar_gvcf,
                vector<pair<string,size_t>> &contigs,
-               size_t bucket_size) {
+               size_t bucket_size,
+               bool adaptive_buckets) {
     Status s;
     logger->info("init database, exemplar_vcf={}", exemplar_gvcf);
     if (check_dir_exists(dbpath)) {
@@ -1343,12 +1824,23 @@ Status db_init(std::shared_ptr<spdlog::logger> logger,
     RocksKeyValue::config cfg;
     cfg.pfx = GLnexus_prefix_spec();
     unique_ptr<KeyValue::DB> db;
+    vector<int> contig_bucket_sizes;
+    if (adaptive_buckets) {
+        S(adaptive_bucket_lengths(logger, exemplar_gvcf, contigs, bucket_size, contig_bucket_sizes));
+    }
     S(RocksKeyValue::Initialize(dbpath, cfg, db));
-    S(BCFKeyValueData::InitializeDB(db.get(), contigs, bucket_size));
+    S(BCFKeyValueData::InitializeDB(db.get(), contigs, bucket_size, contig_bucket_sizes));
 
     // report success
     logger->info("Initialized GLnexus database in {}", dbpath);
-    logger->info("bucket size: {}", bucket_size);
+    if (adaptive_buckets) {
+        auto minmax = std::minmax_element(contig_bucket_sizes.begin(), contig_bucket_sizes.end());
+        logger->info("bucket sizes: {}-{} by contig, following the record density of {}",
+                     (minmax.first != contig_bucket_sizes.end() ? *minmax.first : 0),
+                     (minmax.second != contig_bucket_sizes.end() ? *minmax.second : 0), exemplar_gvcf);
+    } else {
+        logger->info("bucket size: {}", bucket_size);
+    }
 
     stringstream ss;
     ss << "contigs:";
@@ -1369,11 +1861,8 @@ Status db_get_contigs(std::shared_ptr<spdlog::logger> logger,
     Status s;
     logger->info("db_get_contigs {}", dbpath);
 
-    RocksKeyValue::config cfg;
-    cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
-    cfg.pfx = GLnexus_prefix_spec();
     unique_ptr<KeyValue::DB> db;
-    S(RocksKeyValue::Open(dbpath, cfg, db));
+    S(open_db_read_only(dbpath, 0, 0, db));
     {
         unique_ptr<BCFKeyValueData> data;
         S(BCFKeyValueData::Open(db.get(), data));
@@ -1390,7 +1879,10 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                     const vector<range> &ranges_i,
                     std::vector<std::pair<std::string,size_t> > &contigs, // output param
                     std::unique_ptr<KeyValue::DB> *db_out, // output
-                    bool delete_gvcf_after_load) {
+                    bool delete_gvcf_after_load,
+                    const BCFKeyValueData::import_options& import_opts,
+                    size_t compression_dict_bytes,
+                    memory_budget* budget) {
     Status s;
 
     if (nr_threads == 0) {
@@ -1407,6 +1899,8 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
     cfg.pfx = GLnexus_prefix_spec();
     cfg.mem_budget = mem_budget;
     cfg.thread_budget = nr_threads;
+    cfg.budget = budget;
+    set_compression_dict(cfg, compression_dict_bytes);
     unique_ptr<KeyValue::DB> db;
     S(RocksKeyValue::Open(dbpath, cfg, db));
     unique_ptr<BCFKeyValueData> data;
@@ -1426,16 +1920,47 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
         logger->info("Beginning bulk load with no range filter.");
     }
 
+    BCFKeyValueData::import_options opts(import_opts);
+    // With fewer gVCFs than threads, put the threads the imports leave idle
+    // to use: parse each gVCF read sequentially ahead of its bucket building
+    // (one more thread per import), and inflate them on a shared htslib
+    // thread pool of those still remaining, so as to stay within nr_threads.
+    const size_t importers = min(gvcfs.size(), nr_threads);
+    size_t spare_threads = nr_threads - importers;
+    if (!opts.parse_ahead && spare_threads >= importers) {
+        opts.parse_ahead = 4096;
+        spare_threads -= importers;
+    }
+    unique_ptr<hts_tpool, void(*)(hts_tpool*)> hts_tpool_ptr(nullptr, &hts_tpool_destroy);
+    htsThreadPool hts_pool = { nullptr, 0 };
+    size_t hts_threads = 0;
+    if (!opts.hts_pool && spare_threads) {
+        hts_tpool_ptr.reset(hts_tpool_init(spare_threads));
+        if (hts_tpool_ptr) {
+            hts_pool.pool = hts_tpool_ptr.get();
+            opts.hts_pool = &hts_pool;
+            hts_threads = spare_threads;
+        }
+    }
+
     ctpl::thread_pool threadpool(nr_threads);
+    // With fewer gVCFs than threads, also import each (indexed) gVCF in
+    // parallel chunks, on a separate pool since the file tasks wait on them;
+    // its workers stand in for the waiting tasks, alongside the htslib pool.
+    unique_ptr<ctpl::thread_pool> chunkpool;
+    if (gvcfs.size() < nr_threads && !opts.pool) {
+        chunkpool.reset(new ctpl::thread_pool(max(nr_threads - hts_threads, (size_t) 2)));
+        opts.pool = chunkpool.get();
+    }
     vector<future<Status>> statuses;
     set<string> datasets_loaded;
     BCFKeyValueData::import_result stats;
     mutex mu;
-    string dataset;
 
-    // load the gVCFs on the thread pool
+    // infer dataset names as the gVCF filenames minus path and extension
+    vector<string> datasets;
     for (const auto& gvcf : gvcfs) {
-        // infer dataset name as the gVCF filename minus path and extension
+        string dataset;
         size_t p = gvcf.find_last_of('/');
         if (p != string::npos && p < gvcf.size()-1) {
             dataset = gvcf.substr(p+1);
@@ -1450,10 +1975,19 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                 }
             }
         }
+        datasets.push_back(move(dataset));
+    }
+    // give them consecutive IDs in the order given, however the parallel
+    // imports finish, so that they're adjacent in each bucket's key order
+    S(data->reserve_dataset_ids(datasets));
 
+    // load the gVCFs on the thread pool
+    for (size_t i = 0; i < gvcfs.size(); i++) {
+        const string& gvcf = gvcfs[i];
+        const string& dataset = datasets[i];
         auto fut = threadpool.push([&, gvcf, dataset](int tid) {
                 BCFKeyValueData::import_result rslt;
-                Status ls = data->import_gvcf(*metadata, dataset, gvcf, ranges, rslt);
+                Status ls = data->import_gvcf(*metadata, dataset, gvcf, ranges, rslt, opts);
                 if (ls.ok()) {
                     if (delete_gvcf_after_load && unlink(gvcf.c_str())) {
                         logger->warn("Loaded {} successfully, but failed deleting it afterwards.", gvcf);
@@ -1472,7 +2006,6 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                 return ls;
             });
         statuses.push_back(move(fut));
-        dataset.clear();
     }
 
     // collect results
@@ -1489,6 +2022,9 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                  datasets_loaded.size(), stats.samples.size(), stats.bytes,
                  stats.records, stats.duplicate_records,
                  stats.buckets, stats.max_bytes, stats.max_records, stats.skipped_records);
+    if (import_opts.compact_ref_bands) {
+        logger->info("Compacted {} reference bands into adjacent ones", stats.compacted_records);
+    }
 
     // call all_samples_sampleset to create the sample set including
     // the newly loaded ones. By doing this now we make it possible
@@ -1498,6 +2034,12 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
     string sampleset;
     S(data->all_samples_sampleset(sampleset));
     logger->info("Created sample set {}", sampleset);
+    // and the metadata snapshot, for other CLI functions to open the
+    // database quickly
+    s = data->write_metadata_snapshot();
+    if (s.bad() && s != StatusCode::NOT_IMPLEMENTED) {
+        return s;
+    }
 
     if (failures.size()) {
         for (const auto& p : failures) {
@@ -1521,6 +2063,104 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
     return Status::OK();
 }
 
+Status db_merge(std::shared_ptr<spdlog::logger> logger,
+                size_t mem_budget, size_t nr_threads,
+                const string &dbpath,
+                const vector<string> &src_dbpaths,
+                size_t compression_dict_bytes) {
+    Status s;
+
+    if (nr_threads == 0) {
+        nr_threads = std::thread::hardware_concurrency();
+    }
+
+    RocksKeyValue::config cfg;
+    cfg.mode = RocksKeyValue::OpenMode::BULK_LOAD;
+    cfg.pfx = GLnexus_prefix_spec();
+    cfg.mem_budget = mem_budget;
+    cfg.thread_budget = nr_threads;
+    set_compression_dict(cfg, compression_dict_bytes);
+    unique_ptr<KeyValue::DB> db;
+    S(RocksKeyValue::Open(dbpath, cfg, db));
+    unique_ptr<BCFKeyValueData> data;
+    S(BCFKeyValueData::Open(db.get(), data));
+    unique_ptr<MetadataCache> metadata;
+    S(MetadataCache::Start(*data, metadata));
+
+    // merge the source databases one at a time; each is a sorted stream of
+    // buckets, which the bulk load mode writes straight into new SST files
+    BCFKeyValueData::merge_result stats;
+    for (const auto& src_dbpath : src_dbpaths) {
+        unique_ptr<KeyValue::DB> src_db;
+        S(open_db_read_only(src_dbpath, mem_budget, nr_threads, src_db));
+        unique_ptr<BCFKeyValueData> src_data;
+        S(BCFKeyValueData::Open(src_db.get(), src_data));
+
+        BCFKeyValueData::merge_result rslt;
+        s = data->merge_database(*metadata, *src_data, rslt);
+        if (s.bad()) {
+            logger->error("Failed merging {}: {}", src_dbpath, s.str());
+            return s;
+        }
+        logger->info("Merged {} datasets with {} samples; {} bytes in {} buckets from {}",
+                     rslt.datasets.size(), rslt.samples.size(), rslt.bytes, rslt.buckets, src_dbpath);
+        stats.datasets.insert(rslt.datasets.begin(), rslt.datasets.end());
+        stats.samples.insert(rslt.samples.begin(), rslt.samples.end());
+        stats.buckets += rslt.buckets;
+        stats.bytes += rslt.bytes;
+    }
+    logger->info("Merged {} datasets with {} samples; {} bytes in {} buckets from {} databases",
+                 stats.datasets.size(), stats.samples.size(), stats.bytes, stats.buckets,
+                 src_dbpaths.size());
+
+    // create the all-samples sample set now, as db_bulk_load does
+    string sampleset;
+    S(data->all_samples_sampleset(sampleset));
+    logger->info("Created sample set {}", sampleset);
+    // and the metadata snapshot, for other CLI functions to open the
+    // database quickly
+    s = data->write_metadata_snapshot();
+    if (s.bad() && s != StatusCode::NOT_IMPLEMENTED) {
+        return s;
+    }
+
+    logger->info("Flushing database...");
+    data.reset();
+    S(db->flush());
+    logger->info("Compacting database...");
+    db.reset();
+    logger->info("Merge complete!");
+    return Status::OK();
+}
+
+Status db_image(std::shared_ptr<spdlog::logger> logger,
+                const string &dbpath, const string &image_path) {
+    Status s;
+    unique_ptr<KeyValue::DB> db;
+    S(open_db_read_only(dbpath, 0, 0, db));
+    vector<string> collections;
+    {
+        // check it's a GLnexus database, and that its all-samples sample set
+        // exists already (since it can't be written later)
+        unique_ptr<BCFKeyValueData> data;
+        S(BCFKeyValueData::Open(db.get(), data));
+        string sampleset;
+        S(data->all_samples_sampleset(sampleset));
+        for (const char* collnm : { "config", "sampleset", "sample_dataset", "header", "bcf",
+                                    "bcf_variants", "dictionary" }) {
+            KeyValue::CollectionHandle coll;
+            if (db->collection(collnm, coll).ok()) {
+                collections.push_back(collnm);
+            }
+        }
+    }
+
+    logger->info("Writing database image {}...", image_path);
+    S(MmapKeyValue::Write(*db, collections, image_path));
+    logger->info("Wrote database image {}", image_path);
+    return Status::OK();
+}
+
 Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
                         size_t mem_budget, size_t nr_threads,
                         const string &dbpath,
@@ -1530,18 +2170,15 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
                         unsigned &sample_count,
                         bool include_zero_copies) {
     Status s;
+    memory_budget budget(RocksKeyValue::calculate_mem_budget(mem_budget));
+    reserve_bcf_pools(budget, nr_threads);
     unique_ptr<KeyValue::DB> db;
 
     // open the database in read-only mode
-    RocksKeyValue::config cfg;
-    cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
-    cfg.pfx = GLnexus_prefix_spec();
-    cfg.mem_budget = mem_budget;
-    cfg.thread_budget = nr_threads;
-    S(RocksKeyValue::Open(dbpath, cfg, db));
+    S(open_db_read_only(dbpath, mem_budget, nr_threads, db, &budget));
 
     return discover_alleles(logger, nr_threads, db.get(), ranges, contigs, dsals,
-                            sample_count, include_zero_copies);
+                            sample_count, include_zero_copies, &budget);
 }
 
 Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
@@ -1550,7 +2187,8 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
                         const std::vector<std::pair<std::string,size_t> > &contigs,
                         discovered_alleles &dsals,
                         unsigned &sample_count,
-                        bool include_zero_copies) {
+                        bool include_zero_copies,
+                        memory_budget* budget) {
     Status s;
     unique_ptr<BCFKeyValueData> data;
     dsals.clear();
@@ -1564,6 +2202,7 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
     // start service, discover alleles
     service_config svccfg;
     svccfg.threads = nr_threads;
+    svccfg.budget = budget;
     unique_ptr<Service> svc;
     S(Service::Start(svccfg, *data, *data, svc));
 
@@ -1572,82 +2211,532 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
     logger->info("found sample set {}", sampleset);
 
     logger->info("discovering alleles in {} range(s) on {} threads", ranges.size(), nr_threads);
-    vector<discovered_alleles> valleles;
-    S(svc->discover_alleles(sampleset, ranges, sample_count, valleles, include_zero_copies));
-
-    for (auto it = valleles.begin(); it != valleles.end(); ++it) {
-        S(merge_discovered_alleles(*it, dsals));
-        it->clear(); // free some memory
-    }
+    S(svc->discover_alleles(sampleset, ranges, sample_count, dsals, include_zero_copies));
     logger->info("discovered {} alleles", dsals.size());
     return Status::OK();
 }
 
-Status unify_sites(std::shared_ptr<spdlog::logger> logger,
-                   const unifier_config &unifier_cfg,
-                   const vector<pair<string,size_t> > &contigs,
-                   discovered_alleles &dsals,
-                   unsigned sample_count,
-                   vector<unified_site> &sites,
-                   unifier_stats& stats) {
+Status discover_alleles_spilling(std::shared_ptr<spdlog::logger> logger,
+                                 size_t nr_threads, KeyValue::DB* db,
+                                 const vector<range> &ranges,
+                                 const std::vector<std::pair<std::string,size_t> > &contigs,
+                                 size_t mem_budget, const string &spill_prefix,
+                                 unsigned &sample_count,
+                                 bool include_zero_copies,
+                                 const std::function<Status(int,discovered_alleles&)>& per_contig,
+                                 memory_budget* budget) {
     Status s;
-    S(unified_sites(unifier_cfg, sample_count, dsals, sites, stats));
+    unique_ptr<BCFKeyValueData> data;
 
-    // sanity check, sites are in-order
-    if (sites.size() > 1) {
-        auto p = sites.begin();
-        for (auto q = p+1; q != sites.end(); ++p, ++q) {
-            if (q->pos < p->pos) {
-                return Status::Failure(
-                    "BUG: unified sites failed sanity check -- sites are out of order",
-                    p->pos.str(contigs)  + " " + q->pos.str(contigs));
+    if (nr_threads == 0) {
+        nr_threads = std::thread::hardware_concurrency();
+    }
+
+    // hold the alleles' share of the budget for as long as we're discovering
+    // and merging them (leaving the rest to the Service's results in flight)
+    struct budget_reservation {
+        memory_budget* budget;
+        size_t bytes = 0;
+        ~budget_reservation() {
+            if (budget) {
+                budget->unreserve(bytes);
             }
         }
+    } reservation{budget};
+    if (budget) {
+        reservation.bytes = budget->reserve(mem_budget);
+        mem_budget = reservation.bytes;
     }
 
-    return Status::OK();
-}
+    S(BCFKeyValueData::Open(db, data));
 
+    // start service, discover alleles
+    service_config svccfg;
+    svccfg.threads = nr_threads;
+    svccfg.budget = budget;
+    unique_ptr<Service> svc;
+    S(Service::Start(svccfg, *data, *data, svc));
 
-Status genotype(std::shared_ptr<spdlog::logger> logger,
+    string sampleset;
+    S(data->all_samples_sampleset(sampleset));
+    logger->info("found sample set {}", sampleset);
+
+    // the spill files, removed when we're done
+    struct spill_files : vector<string> {
+        ~spill_files() {
+            for (const auto& filename : *this) {
+                unlink(filename.c_str());
+            }
+        }
+    } spills;
+
+    // Merge each range's alleles into the current run, spilling it to a file
+    // when it outgrows the budget. The runs are sorted, but may overlap if the
+    // ranges aren't in order.
+    discovered_alleles run;
+    size_t run_bytes = 0;
+    auto spill = [&]() {
+        Status s;
+        string filename = spill_prefix + std::to_string(spills.size());
+        spills.push_back(filename);
+        S(capnp_write_discovered_alleles_to_file(run, contigs, sample_count, filename));
+        logger->info("spilled {} discovered alleles to {}", run.size(), filename);
+        run.clear();
+        run_bytes = 0;
+        return Status::OK();
+    };
+
+    logger->info("discovering alleles in {} range(s) on {} threads, holding up to {} MiB of them in memory",
+                 ranges.size(), nr_threads, mem_budget >> 20);
+    S(svc->discover_alleles(sampleset, ranges, sample_count, include_zero_copies, nullptr,
+                            [&](discovered_alleles& dsals) {
+                                Status s;
+                                run_bytes += discovered_alleles_bytes(dsals);
+                                S(merge_discovered_alleles(dsals, run));
+                                if (run_bytes > mem_budget) {
+                                    S(spill());
+                                }
+                                return Status::OK();
+                            }));
+
+    // Pass the alleles to per_contig contig by contig: add each to the table
+    // of its contig, first passing on those of the preceding contigs.
+    int rid = 0;
+    discovered_alleles contig_dsals;
+    size_t total = 0;
+    auto flush_until = [&](int next_rid) {
+        Status s;
+        for (; rid < next_rid; rid++) {
+            total += contig_dsals.size();
+            S(per_contig(rid, contig_dsals));
+            contig_dsals.clear();
+        }
+        return Status::OK();
+    };
+
+    if (spills.empty()) {
+        // it all fit
+        for (auto& p : run) {
+            assert(p.first.pos.rid >= rid && p.first.pos.rid < (int) contigs.size());
+            S(flush_until(p.first.pos.rid));
+            contig_dsals.push_back_sorted(move(p));
+        }
+        run.clear();
+        S(flush_until(contigs.size()));
+        logger->info("discovered {} alleles", total);
+        return Status::OK();
+    }
+    if (!run.empty()) {
+        S(spill());
+    }
+
+    // k-way merge of the spilled runs, reading them a chunk at a time. Ties
+    // are broken by run number, so that each allele's info is combined in
+    // the same order as when merging the ranges' alleles in memory.
+    vector<unique_ptr<discovered_alleles_file_reader>> readers;
+    for (const auto& filename : spills) {
+        readers.emplace_back(new discovered_alleles_file_reader);
+        S(readers.back()->open(filename));
+        if (readers.back()->contigs() != contigs) {
+            return Status::Invalid("spilled discovered alleles are for different contigs", filename);
+        }
+    }
+    auto reader_gt = [&](size_t lhs, size_t rhs) {
+        const allele& l = readers[lhs]->current().first;
+        const allele& r = readers[rhs]->current().first;
+        return r < l || (l == r && lhs > rhs);
+    };
+    vector<size_t> heap;
+    for (size_t i = 0; i < readers.size(); i++) {
+        if (readers[i]->valid()) {
+            heap.push_back(i);
+        }
+    }
+    make_heap(heap.begin(), heap.end(), reader_gt);
+    while (!heap.empty()) {
+        pop_heap(heap.begin(), heap.end(), reader_gt);
+        auto& reader = *readers[heap.back()];
+        auto& p = reader.current();
+        assert(p.first.pos.rid >= rid && p.first.pos.rid < (int) contigs.size());
+        S(flush_until(p.first.pos.rid));
+        if (!contig_dsals.empty() && (contig_dsals.end()-1)->first == p.first) {
+            S(merge_discovered_allele_info(p.first, p.second, (contig_dsals.end()-1)->second));
+        } else {
+            contig_dsals.push_back_sorted(move(p));
+        }
+        S(reader.next());
+        if (reader.valid()) {
+            push_heap(heap.begin(), heap.end(), reader_gt);
+        } else {
+            heap.pop_back();
+        }
+    }
+    S(flush_until(contigs.size()));
+    logger->info("discovered {} alleles, merged from {} spill files", total, spills.size());
+    return Status::OK();
+}
+
+Status unify_sites(std::shared_ptr<spdlog::logger> logger,
+                   const unifier_config &unifier_cfg,
+                   const vector<pair<string,size_t> > &contigs,
+                   discovered_alleles &dsals,
+                   unsigned sample_count,
+                   vector<unified_site> &sites,
+                   unifier_stats& stats,
+                   executor* pool) {
+    Status s;
+    if (pool) {
+        S(unified_sites(unifier_cfg, sample_count, dsals, sites, stats, *pool));
+    } else {
+        S(unified_sites(unifier_cfg, sample_count, dsals, sites, stats));
+    }
+
+    // sanity check, sites are in-order
+    if (sites.size() > 1) {
+        auto p = sites.begin();
+        for (auto q = p+1; q != sites.end(); ++p, ++q) {
+            if (q->pos < p->pos) {
+                return Status::Failure(
+                    "BUG: unified sites failed sanity check -- sites are out of order",
+                    p->pos.str(contigs)  + " " + q->pos.str(contigs));
+            }
+        }
+    }
+
+    return Status::OK();
+}
+
+
+// Open the database read-only, with a decoded bucket cache given a memory
+// budget (divided among numa_nodes partitions), start a service on it and call
+// run with the service and the all-samples sample set
+static Status with_genotyping_service(std::shared_ptr<spdlog::logger> logger,
+                                      size_t mem_budget, size_t nr_threads,
+                                      const string &dbpath,
+                                      const vector<string>& extra_header_lines,
+                                      size_t numa_nodes, size_t prefetch_distance,
+                                      std::map<std::string,uint64_t>* db_stats,
+                                      const function<Status(Service&,const string&)>& run) {
+    Status s;
+
+    // the database's block cache, the decoded bucket cache and the genotyping
+    // results in flight all draw from one budget
+    memory_budget budget(RocksKeyValue::calculate_mem_budget(mem_budget));
+    reserve_bcf_pools(budget, nr_threads);
+
+    // open the database in read-only mode
+    unique_ptr<KeyValue::DB> db;
+    S(open_db_read_only(dbpath, mem_budget, nr_threads, db, &budget));
+    // given a memory budget, also cache decoded buckets shared by nearby sites
+    unique_ptr<BCFKeyValueData> data;
+    S(BCFKeyValueData::Open(db.get(), data, mem_budget / 16, numa_nodes, &budget));
+    logger->info("memory budget {} MiB, of which {} MiB reserved (caches, record pools)",
+                 budget.total() >> 20, budget.reserved() >> 20);
+
+    // start service, genotype sites
+    service_config svccfg;
+    svccfg.threads = nr_threads;
+    svccfg.extra_header_lines = extra_header_lines;
+    svccfg.numa = numa_nodes > 1;
+    svccfg.prefetch_distance = prefetch_distance;
+    svccfg.budget = &budget;
+    unique_ptr<Service> svc;
+    S(Service::Start(svccfg, *data, *data, svc));
+
+    string sampleset;
+    S(data->all_samples_sampleset(sampleset));
+
+    S(run(*svc, sampleset));
+    logger->info("genotyping complete!");
+
+    auto stalls_ms = svc->threads_stalled_ms();
+    if (stalls_ms) {
+        logger->info("worker threads were cumulatively stalled for {}ms", stalls_ms);
+    }
+
+    std::shared_ptr<StatsRangeQuery> statsRq = data->getRangeStats();
+    logger->info(statsRq->str());
+
+    if (db_stats) {
+        S(db->statistics(*db_stats));
+    }
+
+    return Status::OK();
+}
+
+Status genotype(std::shared_ptr<spdlog::logger> logger,
                 size_t mem_budget, size_t nr_threads,
                 const string &dbpath,
                 const genotyper_config &genotyper_cfg,
                 const vector<unified_site> &sites,
                 const vector<string>& extra_header_lines,
-                const string &output_filename) {
+                const string &output_filename,
+                size_t output_shards,
+                std::map<std::string,uint64_t>* db_stats,
+                bool numa, size_t prefetch_distance) {
+    if (nr_threads == 0) {
+        nr_threads = std::thread::hardware_concurrency();
+    }
+    size_t numa_nodes = numa ? max(GLnexus::numa_nodes().size(), (size_t) 1) : 1;
+    if (numa_nodes > 1 && output_shards < numa_nodes) {
+        // at least one shard for each node to work on
+        output_shards = numa_nodes;
+    }
+
+    return with_genotyping_service(logger, mem_budget, nr_threads, dbpath, extra_header_lines,
+                                   numa_nodes, prefetch_distance, db_stats,
+                                   [&](Service& svc, const string& sampleset) {
+        logger->info("genotyping {} sites; sample set = {} mem_budget = {} threads = {}", sites.size(), sampleset, mem_budget, nr_threads);
+        if (numa_nodes > 1) {
+            logger->info("dividing threads and bucket cache among {} NUMA nodes", numa_nodes);
+        }
+        if (output_shards > 1) {
+            logger->info("writing output in {} shards", output_shards);
+        }
+        return svc.genotype_sites_sharded(genotyper_cfg, sampleset, sites, output_shards, output_filename);
+    });
+}
+
+Status genotype_shard(std::shared_ptr<spdlog::logger> logger,
+                      size_t mem_budget, size_t nr_threads,
+                      const string &dbpath,
+                      const genotyper_config &genotyper_cfg,
+                      const vector<unified_site> &sites,
+                      const vector<string>& extra_header_lines,
+                      size_t part,
+                      const string &output_filename,
+                      size_t prefetch_distance,
+                      size_t checkpoint_sites) {
+    if (nr_threads == 0) {
+        nr_threads = std::thread::hardware_concurrency();
+    }
+    return with_genotyping_service(logger, mem_budget, nr_threads, dbpath, extra_header_lines,
+                                   1, prefetch_distance, nullptr,
+                                   [&](Service& svc, const string& sampleset) {
+        logger->info("genotyping {} sites of shard {}; sample set = {} mem_budget = {} threads = {}",
+                     sites.size(), part, sampleset, mem_budget, nr_threads);
+        if (checkpoint_sites) {
+            // two chunks in flight, so that one's tail overlaps the next's start
+            const string checkpoint_dir = output_filename + ".checkpoint";
+            logger->info("checkpointing every {} sites in {}", checkpoint_sites, checkpoint_dir);
+            return svc.genotype_sites_checkpointed(genotyper_cfg, sampleset, sites, checkpoint_sites, 2,
+                                                   checkpoint_dir, output_filename, part == 0);
+        }
+        return svc.genotype_sites_shard(genotyper_cfg, sampleset, sites, part, output_filename);
+    });
+}
+
+Status split_ranges(const vector<range>& ranges, size_t n, vector<vector<range>>& shards) {
+    shards.clear();
+    if (n == 0) {
+        return Status::Invalid("split_ranges: no shards");
+    }
+    vector<range> sorted_ranges(ranges);
+    sort(sorted_ranges.begin(), sorted_ranges.end());
+    uint64_t total = 0;
+    for (const auto& r : sorted_ranges) {
+        total += r.size();
+    }
+
+    // start the next shard once those so far have their share of the total
+    // length, or if just enough ranges remain for one in each remaining shard
+    uint64_t cum = 0;
+    for (size_t i = 0; i < sorted_ranges.size(); i++) {
+        const range& r = sorted_ranges[i];
+        const size_t k = shards.size();
+        if (k == 0 || (k < n && (cum*n >= k*total || sorted_ranges.size() - i <= n - k))) {
+            shards.emplace_back();
+        }
+        shards.back().push_back(r);
+        cum += r.size();
+    }
+    return Status::OK();
+}
+
+Status write_bed_file(const vector<range>& ranges,
+                      const vector<pair<string,size_t> >& contigs,
+                      const string& filename) {
+    ofstream bedfile(filename);
+    for (const auto& r : ranges) {
+        if (r.rid < 0 || r.rid >= (int) contigs.size()) {
+            return Status::Invalid("write_bed_file: range on unknown contig");
+        }
+        bedfile << contigs[r.rid].first << '\t' << r.beg << '\t' << r.end << '\n';
+    }
+    bedfile.close();
+    if (bedfile.fail()) {
+        return Status::IOError("writing", filename);
+    }
+    return Status::OK();
+}
+
+Status merge_discovered_alleles_files(const vector<string>& filenames,
+                                      const vector<pair<string,size_t> >& contigs,
+                                      discovered_alleles& dsals,
+                                      unsigned& sample_count) {
+    Status s;
+    dsals.clear();
+    vector<discovered_alleles> shards(filenames.size());
+    for (size_t i = 0; i < filenames.size(); i++) {
+        unsigned N = 0;
+        vector<pair<string,size_t>> shard_contigs;
+        ifstream ifs(filenames[i], std::ifstream::in | std::ifstream::binary);
+        if (!ifs.good()) {
+            return Status::IOError("could not open file for reading", filenames[i]);
+        }
+        S(discovered_alleles_of_capnp_stream(ifs, N, shard_contigs, shards[i]));
+        if (shard_contigs != contigs) {
+            return Status::Invalid("discovered alleles are for different contigs", filenames[i]);
+        }
+        if (i > 0 && N != sample_count) {
+            return Status::Invalid("discovered alleles are for a different sample count", filenames[i]);
+        }
+        sample_count = N;
+    }
+    return merge_discovered_alleles(shards, dsals);
+}
+
+Status split_sites(const vector<unified_site>& sites, const vector<vector<range>>& shards,
+                   vector<vector<unified_site>>& ans) {
+    ans.clear();
+    ans.resize(shards.size());
+    vector<pair<int,int>> shard_begins;
+    for (const auto& shard : shards) {
+        if (shard.empty()) {
+            return Status::Invalid("split_sites: empty shard");
+        }
+        shard_begins.push_back(make_pair(shard.front().rid, shard.front().beg));
+        if (shard_begins.size() > 1 && shard_begins.back() <= shard_begins[shard_begins.size()-2]) {
+            return Status::Invalid("split_sites: shards out of order");
+        }
+    }
+    if (sites.empty()) {
+        return Status::OK();
+    }
+    if (shards.empty()) {
+        return Status::Invalid("split_sites: no shards");
+    }
+    const unified_site* prev = nullptr;
+    for (const auto& site : sites) {
+        if (prev && site.pos < prev->pos) {
+            return Status::Invalid("split_sites: sites aren't sorted");
+        }
+        prev = &site;
+        auto p = upper_bound(shard_begins.begin(), shard_begins.end(),
+                             make_pair(site.pos.rid, site.pos.beg));
+        size_t k = p == shard_begins.begin() ? 0 : (p - shard_begins.begin()) - 1;
+        ans[k].push_back(site);
+    }
+    return Status::OK();
+}
+
+Status write_perf_report(const string& filename, const string& phase,
+                         std::chrono::steady_clock::time_point t0, const perf::snapshot& perf_since,
+                         const map<string,uint64_t>& db_stats_since,
+                         const map<string,uint64_t>& db_stats) {
+    uint64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              std::chrono::steady_clock::now() - t0).count();
+    perf::snapshot stats = perf::current();
+    stats -= perf_since;
+    map<string,uint64_t> extra;
+    for (const auto& p : db_stats) {
+        auto q = db_stats_since.find(p.first);
+        uint64_t v = p.second - (q != db_stats_since.end() ? q->second : 0);
+        if (v) {
+            extra[p.first] = v;
+        }
+    }
+
+    ofstream out(filename, ios::app);
+    if (!out.good()) {
+        return Status::IOError("opening performance report", filename);
+    }
+    Status s = perf::report_json(phase, elapsed_ms, stats, extra, out);
+    out.close();
+    if (s.ok() && out.fail()) {
+        return Status::IOError("writing performance report", filename);
+    }
+    return s;
+}
+
+Status discover_unify_genotype(std::shared_ptr<spdlog::logger> logger,
+                               size_t mem_budget, size_t nr_threads,
+                               KeyValue::DB* db,
+                               const vector<range> &ranges,
+                               const vector<pair<string,size_t> > &contigs,
+                               const unifier_config &unifier_cfg,
+                               const genotyper_config &genotyper_cfg,
+                               const vector<string>& extra_header_lines,
+                               const string &output_filename,
+                               size_t pipeline_depth,
+                               unifier_stats& stats,
+                               bool numa, size_t prefetch_distance,
+                               memory_budget* budget) {
     Status s;
 
     if (nr_threads == 0) {
         nr_threads = std::thread::hardware_concurrency();
     }
+    size_t numa_nodes = numa ? max(GLnexus::numa_nodes().size(), (size_t) 1) : 1;
 
-    // open the database in read-only mode
-    RocksKeyValue::config cfg;
-    cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
-    cfg.pfx = GLnexus_prefix_spec();
-    cfg.mem_budget = mem_budget;
-    cfg.thread_budget = nr_threads;
-    unique_ptr<KeyValue::DB> db;
-    S(RocksKeyValue::Open(dbpath, cfg, db));
+    // given a memory budget, also cache decoded buckets shared by nearby sites
     unique_ptr<BCFKeyValueData> data;
-    S(BCFKeyValueData::Open(db.get(), data));
-
-    std::vector<std::pair<std::string,size_t> > contigs;
-    S(data->contigs(contigs));
+    S(BCFKeyValueData::Open(db, data, mem_budget / 16, numa_nodes, budget));
 
-    // start service, discover alleles, unify sites, genotype sites
     service_config svccfg;
     svccfg.threads = nr_threads;
     svccfg.extra_header_lines = extra_header_lines;
+    svccfg.numa = numa_nodes > 1;
+    svccfg.prefetch_distance = prefetch_distance;
+    svccfg.budget = budget;
     unique_ptr<Service> svc;
     S(Service::Start(svccfg, *data, *data, svc));
 
     string sampleset;
     S(data->all_samples_sampleset(sampleset));
 
-    logger->info("genotyping {} sites; sample set = {} mem_budget = {} threads = {}", sites.size(), sampleset, mem_budget, nr_threads);
-    S(svc->genotype_sites(genotyper_cfg, sampleset, sites, output_filename));
+    // one batch per contig, in contig order
+    map<int,vector<range>> ranges_by_contig;
+    for (const auto& rng : ranges) {
+        ranges_by_contig[rng.rid].push_back(rng);
+    }
+    vector<vector<range>> batches;
+    for (auto& p : ranges_by_contig) {
+        sort(p.second.begin(), p.second.end());
+        batches.push_back(move(p.second));
+    }
+
+    logger->info("discovering, unifying and genotyping {} range(s) on {} contig(s), {} at a time; sample set = {} mem_budget = {} threads = {}",
+                 ranges.size(), batches.size(), pipeline_depth, sampleset, mem_budget, nr_threads);
+
+    bool include_zero_copies = unifier_cfg.min_allele_copy_number == 0;
+    mutex mu;
+    size_t alleles = 0, sites = 0;
+    stats = unifier_stats();
+    auto produce = [&](size_t i, vector<unified_site>& batch_sites) {
+        Status s;
+        // discover the contig's alleles, its ranges concurrently
+        discovered_alleles dsals;
+        unsigned N = 0;
+        S(svc->discover_alleles(sampleset, batches[i], N, include_zero_copies, nullptr,
+                                [&](discovered_alleles& range_dsals) {
+                                    return merge_discovered_alleles(range_dsals, dsals);
+                                }));
+        size_t batch_alleles = dsals.size();
+
+        unifier_stats batch_stats;
+        S(unify_sites(logger, unifier_cfg, contigs, dsals, N, batch_sites, batch_stats));
+
+        lock_guard<mutex> lock(mu);
+        alleles += batch_alleles;
+        sites += batch_sites.size();
+        stats += batch_stats;
+        return Status::OK();
+    };
+
+    S(svc->genotype_sites_pipelined(genotyper_cfg, sampleset, batches.size(), pipeline_depth,
+                                    produce, output_filename));
+    logger->info("discovered {} alleles and unified them to {} sites", alleles, sites);
     logger->info("genotyping complete!");
 
     auto stalls_ms = svc->threads_stalled_ms();
@@ -1661,16 +2750,537 @@ Status genotype(std::shared_ptr<spdlog::logger> logger,
     return Status::OK();
 }
 
+Status genotype_incremental(std::shared_ptr<spdlog::logger> logger,
+                            size_t mem_budget, size_t nr_threads,
+                            KeyValue::DB* db,
+                            const vector<range> &ranges,
+                            const vector<pair<string,size_t> > &contigs,
+                            const unifier_config &unifier_cfg,
+                            const genotyper_config &genotyper_cfg,
+                            const vector<string>& extra_header_lines,
+                            const string &prior_alleles_filename,
+                            const string &prior_sites_filename,
+                            const string &prior_output_filename,
+                            const string &alleles_filename,
+                            const string &sites_filename,
+                            const string &output_filename,
+                            unifier_stats& stats) {
+    Status s;
+
+    if (nr_threads == 0) {
+        nr_threads = std::thread::hardware_concurrency();
+    }
+
+    // load the prior run's discovered alleles & unified sites, and the
+    // samples in its output
+    unsigned prior_N = 0;
+    discovered_alleles dsals;
+    {
+        vector<pair<string,size_t>> prior_contigs;
+        ifstream ifs(prior_alleles_filename, std::ifstream::in | std::ifstream::binary);
+        if (!ifs.good()) {
+            return Status::IOError("could not open file for reading", prior_alleles_filename);
+        }
+        S(discovered_alleles_of_capnp_stream(ifs, prior_N, prior_contigs, dsals));
+        if (prior_contigs != contigs) {
+            return Status::Invalid("prior discovered alleles are for different contigs", prior_alleles_filename);
+        }
+    }
+    vector<unified_site> prior_sites;
+    {
+        ifstream ifs(prior_sites_filename, std::ifstream::in | std::ifstream::binary);
+        if (!ifs.good()) {
+            return Status::IOError("could not open file for reading", prior_sites_filename);
+        }
+        S(unified_sites_of_capnp_stream(ifs, contigs, prior_sites));
+    }
+    set<string> prior_samples;
+    {
+        unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(prior_output_filename.c_str(), "r"),
+                                                   [](vcfFile* f) { bcf_close(f); });
+        if (!vcf) {
+            return Status::IOError("could not open file for reading", prior_output_filename);
+        }
+        unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+        if (!hdr) {
+            return Status::IOError("bcf_hdr_read", prior_output_filename);
+        }
+        for (int i = 0; i < bcf_hdr_nsamples(hdr); i++) {
+            prior_samples.insert(hdr->samples[i]);
+        }
+    }
+    if (prior_samples.size() != prior_N) {
+        return Status::Invalid("prior output and discovered alleles have different sample counts",
+                               prior_output_filename);
+    }
+
+    // given a memory budget, also cache decoded buckets shared by nearby sites
+    unique_ptr<BCFKeyValueData> data;
+    S(BCFKeyValueData::Open(db, data, mem_budget / 16));
+    unique_ptr<MetadataCache> metadata;
+    S(MetadataCache::Start(*data, metadata));
+
+    // the added samples are those in the database, but not the prior output;
+    // make a sample set of them, named after the version of the all-samples
+    // sample set ("*@N"), unless it exists already
+    string sampleset;
+    S(data->all_samples_sampleset(sampleset));
+    shared_ptr<const set<string>> all_samples;
+    S(metadata->sampleset_samples(sampleset, all_samples));
+    set<string> added_samples;
+    for (const auto& sample : *all_samples) {
+        if (prior_samples.find(sample) == prior_samples.end()) {
+            added_samples.insert(sample);
+        }
+    }
+    for (const auto& sample : prior_samples) {
+        if (all_samples->find(sample) == all_samples->end()) {
+            return Status::Invalid("sample in prior output is not in the database", sample);
+        }
+    }
+    if (added_samples.empty()) {
+        return Status::Invalid("the database has no samples beyond those in the prior output",
+                               prior_output_filename);
+    }
+    const string added_sampleset = "added_" + sampleset.substr(sampleset.find('@') + 1);
+    s = data->new_sampleset(*metadata, added_sampleset, added_samples);
+    if (s == StatusCode::EXISTS) {
+        shared_ptr<const set<string>> existing;
+        S(metadata->sampleset_samples(added_sampleset, existing));
+        if (*existing != added_samples) {
+            return Status::Invalid("sample set exists with different samples", added_sampleset);
+        }
+    } else if (s.bad()) {
+        return s;
+    }
+
+    service_config svccfg;
+    svccfg.threads = nr_threads;
+    svccfg.extra_header_lines = extra_header_lines;
+    unique_ptr<Service> svc;
+    S(Service::Start(svccfg, *data, *data, svc));
+
+    // discover alleles in the added samples only, merging them with the prior
+    logger->info("discovering alleles in {} added sample(s), in addition to {} prior", added_samples.size(), prior_N);
+    unsigned added_N = 0;
+    bool include_zero_copies = unifier_cfg.min_allele_copy_number == 0;
+    S(svc->discover_alleles(added_sampleset, ranges, added_N, include_zero_copies, nullptr,
+                            [&](discovered_alleles& range_dsals) {
+                                return merge_discovered_alleles(range_dsals, dsals);
+                            }));
+    const unsigned N = prior_N + added_N;
+    S(capnp_write_discovered_alleles_to_file(dsals, contigs, N, alleles_filename));
+
+    vector<unified_site> sites;
+    S(unify_sites(logger, unifier_cfg, contigs, dsals, N, sites, stats));
+    S(capnp_write_unified_sites_to_file(sites, contigs, sites_filename));
+
+    size_t reused = 0;
+    S(svc->genotype_sites_incremental(genotyper_cfg, sampleset, added_sampleset, prior_sites,
+                                      prior_output_filename, sites, output_filename, &reused));
+    logger->info("genotyping complete! {} of {} sites reused the prior genotypes", reused, sites.size());
+
+    std::shared_ptr<StatsRangeQuery> statsRq = data->getRangeStats();
+    logger->info(statsRq->str());
+
+    return Status::OK();
+}
+
+Status genotype_incremental(std::shared_ptr<spdlog::logger> logger,
+                            size_t mem_budget, size_t nr_threads,
+                            const string &dbpath,
+                            const vector<range> &ranges,
+                            const vector<pair<string,size_t> > &contigs,
+                            const unifier_config &unifier_cfg,
+                            const genotyper_config &genotyper_cfg,
+                            const vector<string>& extra_header_lines,
+                            const string &prior_alleles_filename,
+                            const string &prior_sites_filename,
+                            const string &prior_output_filename,
+                            const string &alleles_filename,
+                            const string &sites_filename,
+                            const string &output_filename,
+                            unifier_stats& stats) {
+    Status s;
+    RocksKeyValue::config cfg;
+    cfg.mode = RocksKeyValue::OpenMode::NORMAL;
+    cfg.pfx = GLnexus_prefix_spec();
+    cfg.mem_budget = mem_budget;
+    cfg.thread_budget = nr_threads;
+    unique_ptr<KeyValue::DB> db;
+    S(RocksKeyValue::Open(dbpath, cfg, db));
+    return genotype_incremental(logger, mem_budget, nr_threads, db.get(), ranges, contigs, unifier_cfg,
+                                genotyper_cfg, extra_header_lines, prior_alleles_filename,
+                                prior_sites_filename, prior_output_filename, alleles_filename,
+                                sites_filename, output_filename, stats);
+}
+
+// Query server
+
+static Status query_socket_address(const string& socket_path, sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(addr.sun_path)) {
+        return Status::Invalid("query socket path (empty or too long)", socket_path);
+    }
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    return Status::OK();
+}
+
+static Status send_all(int fd, const char* buf, size_t len) {
+    while (len) {
+        ssize_t n = ::send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return Status::IOError("writing to query socket");
+        }
+        buf += n;
+        len -= n;
+    }
+    return Status::OK();
+}
+
+// Read the request line from a connection (without the newline)
+static Status read_query_line(int fd, string& ans) {
+    ans.clear();
+    char buf[4096];
+    while (true) {
+        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return Status::IOError("reading query request");
+        }
+        ans.append(buf, n);
+        size_t nl = ans.find('\n');
+        if (nl != string::npos) {
+            ans.resize(nl);
+            return Status::OK();
+        }
+        if (n == 0) {
+            return Status::OK();
+        }
+        if (ans.size() > (1 << 20)) {
+            return Status::Invalid("query request too long");
+        }
+    }
+}
+
+// Parse a request line: the command, the ranges (sorted and disjoint) and the
+// sample set, if given
+static Status parse_query(const string& line, const vector<pair<string,size_t>>& contigs,
+                          string& command, vector<range>& ranges, string& sampleset) {
+    istringstream ss(line);
+    string ranges_txt, sampleset_txt, extra;
+    ss >> command >> ranges_txt >> sampleset_txt >> extra;
+    if ((command != "discover" && command != "genotype") || ranges_txt.empty() || !extra.empty()) {
+        return Status::Invalid("query (expected discover|genotype RANGES [SAMPLESET])", line);
+    }
+    if (!parse_ranges(contigs, ranges_txt, ranges) || ranges.empty()) {
+        return Status::Invalid("query ranges", ranges_txt);
+    }
+    sort(ranges.begin(), ranges.end());
+    for (size_t i = 1; i < ranges.size(); i++) {
+        if (ranges[i-1].overlaps(ranges[i])) {
+            return Status::Invalid("overlapping query ranges", ranges_txt);
+        }
+    }
+    if (!sampleset_txt.empty()) {
+        sampleset = sampleset_txt;
+    }
+    return Status::OK();
+}
+
+// Answer a query on the connection fd, genotyping via a scratch file next to
+// the socket. abort is set by the server once the deadline passes; the
+// deadline is checked once more before any output is sent, so that a query
+// finishing late is reported as aborted rather than answered.
+static Status answer_query(std::shared_ptr<spdlog::logger> logger, Service& svc,
+                           const vector<pair<string,size_t>>& contigs,
+                           const unifier_config& unifier_cfg, const genotyper_config& genotyper_cfg,
+                           const string& socket_path, const string& command,
+                           const vector<range>& ranges, const string& sampleset,
+                           int fd, std::atomic<bool>& abort,
+                           const chrono::steady_clock::time_point* deadline, bool& sent) {
+    Status s;
+    auto expired = [&]() {
+        return abort || (deadline && chrono::steady_clock::now() >= *deadline);
+    };
+    unsigned N = 0;
+    discovered_alleles dsals;
+    bool include_zero_copies = unifier_cfg.min_allele_copy_number == 0;
+    S(svc.discover_alleles(sampleset, ranges, N, dsals, include_zero_copies, &abort));
+
+    if (command == "discover") {
+        ostringstream os;
+        S(yaml_stream_of_discovered_alleles(N, contigs, dsals, os));
+        const string output = os.str();
+        if (expired()) {
+            return Status::Aborted("query deadline exceeded");
+        }
+        const string ans = "OK " + std::to_string(output.size()) + "\n" + output;
+        sent = true;
+        return send_all(fd, ans.c_str(), ans.size());
+    }
+
+    vector<unified_site> sites;
+    unifier_stats stats;
+    S(unify_sites(logger, unifier_cfg, contigs, dsals, N, sites, stats));
+
+    string scratch = socket_path + ".XXXXXX";
+    if (!mkdtemp(&scratch[0])) {
+        return Status::IOError("creating query scratch directory", scratch);
+    }
+    const string filename = scratch + "/out" +
+        (genotyper_cfg.output_format == GLnexusOutputFormat::BCF ? ".bcf"
+         : genotyper_cfg.output_format == GLnexusOutputFormat::SPARSE ? ".svcf" : ".vcf");
+    s = svc.genotype_sites(genotyper_cfg, sampleset, sites, filename, &abort);
+    struct stat st;
+    if (s.ok() && stat(filename.c_str(), &st) != 0) {
+        s = Status::IOError("reading query output", filename);
+    }
+    if (s.ok() && expired()) {
+        s = Status::Aborted("query deadline exceeded");
+    }
+    if (s.ok()) {
+        ifstream ifs(filename, ios::binary);
+        sent = true;
+        const string status_line = "OK " + std::to_string(st.st_size) + "\n";
+        s = send_all(fd, status_line.c_str(), status_line.size());
+        char buf[65536];
+        while (s.ok() && ifs.good()) {
+            ifs.read(buf, sizeof(buf));
+            s = send_all(fd, buf, ifs.gcount());
+        }
+        if (s.ok() && ifs.bad()) {
+            s = Status::IOError("reading query output", filename);
+        }
+    }
+    unlink(filename.c_str());
+    rmdir(scratch.c_str());
+    return s;
+}
+
+// Handle a connection to the query server, then close it
+static void handle_query(std::shared_ptr<spdlog::logger> logger, Service& svc, const string& all_samples,
+                         const vector<pair<string,size_t>>& contigs,
+                         const unifier_config& unifier_cfg, const genotyper_config& genotyper_cfg,
+                         const string& socket_path, int fd, std::atomic<bool>& abort,
+                         const chrono::steady_clock::time_point* deadline) {
+    auto t0 = chrono::steady_clock::now();
+    string line, command, sampleset = all_samples;
+    vector<range> ranges;
+    Status s = read_query_line(fd, line);
+    if (s.ok()) {
+        s = parse_query(line, contigs, command, ranges, sampleset);
+    }
+    // once the OK has been sent, a failure can only be signalled by cutting
+    // the output short of the length it states
+    bool sent = false;
+    if (s.ok()) {
+        s = answer_query(logger, svc, contigs, unifier_cfg, genotyper_cfg, socket_path,
+                         command, ranges, sampleset, fd, abort, deadline, sent);
+    }
+    if (s == StatusCode::ABORTED && deadline) {
+        s = Status::Aborted("query deadline exceeded");
+    }
+    if (s.bad() && !sent) {
+        const string err = "ERROR " + s.str() + "\n";
+        send_all(fd, err.c_str(), err.size());
+    }
+    close(fd);
+    uint64_t elapsed_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
+    if (s.ok()) {
+        logger->info("query [{}] answered in {}ms", line, elapsed_ms);
+    } else {
+        logger->warn("query [{}] failed after {}ms: {}", line, elapsed_ms, s.str());
+    }
+}
+
+Status serve(std::shared_ptr<spdlog::logger> logger,
+             size_t mem_budget, size_t nr_threads,
+             const string &dbpath,
+             const unifier_config &unifier_cfg,
+             const genotyper_config &genotyper_cfg,
+             const vector<string> &extra_header_lines,
+             size_t prefetch_distance,
+             const string &socket_path,
+             size_t max_concurrent, uint64_t deadline_ms,
+             std::atomic<bool>& stop) {
+    Status s;
+    if (max_concurrent == 0) {
+        return Status::Invalid("query server: max_concurrent must be positive");
+    }
+    if (nr_threads == 0) {
+        nr_threads = std::thread::hardware_concurrency();
+    }
+    sockaddr_un addr;
+    S(query_socket_address(socket_path, addr));
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            return Status::Exists("query socket path", socket_path);
+        }
+        unlink(socket_path.c_str());
+    }
+
+    vector<pair<string,size_t>> contigs;
+    S(db_get_contigs(logger, dbpath, contigs));
+
+    // the output is streamed back as a single file
+    genotyper_config cfg = genotyper_cfg;
+    cfg.output_residuals = false;
+    cfg.output_index = false;
+
+    return with_genotyping_service(logger, mem_budget, nr_threads, dbpath, extra_header_lines,
+                                   1, prefetch_distance, nullptr,
+                                   [&](Service& svc, const string& all_samples) {
+        int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (lfd < 0) {
+            return Status::IOError("creating query socket", socket_path);
+        }
+        if (::bind(lfd, (const sockaddr*) &addr, sizeof(addr)) || listen(lfd, 64)) {
+            close(lfd);
+            return Status::IOError("listening on query socket", socket_path);
+        }
+        logger->info("serving queries on {}, {} at a time; sample set = {} mem_budget = {} threads = {}",
+                     socket_path, max_concurrent, all_samples, mem_budget, nr_threads);
+
+        // requests in progress, with their deadlines and abort flags
+        mutex mu;
+        condition_variable cv;
+        map<uint64_t, pair<chrono::steady_clock::time_point, shared_ptr<atomic<bool>>>> in_flight;
+        uint64_t next_id = 0;
+        {
+            executor handlers(max_concurrent);
+            while (!stop) {
+                {
+                    unique_lock<mutex> lock(mu);
+                    auto now = chrono::steady_clock::now();
+                    for (auto& p : in_flight) {
+                        if (deadline_ms && now >= p.second.first) {
+                            *p.second.second = true;
+                        }
+                    }
+                    if (in_flight.size() >= max_concurrent) {
+                        // leave further connections waiting on the socket
+                        cv.wait_for(lock, chrono::milliseconds(100));
+                        continue;
+                    }
+                }
+                pollfd pfd = { lfd, POLLIN, 0 };
+                if (poll(&pfd, 1, 100) <= 0) {
+                    continue;
+                }
+                int fd = accept(lfd, nullptr, nullptr);
+                if (fd < 0) {
+                    continue;
+                }
+                // don't let a client which never sends its request hold a handler
+                timeval tv = { 10, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                auto abort = make_shared<atomic<bool>>(false);
+                const auto deadline = chrono::steady_clock::now() + chrono::milliseconds(deadline_ms);
+                uint64_t id;
+                {
+                    lock_guard<mutex> lock(mu);
+                    id = next_id++;
+                    in_flight[id] = make_pair(deadline, abort);
+                }
+                handlers.submit([&, fd, id, abort, deadline](int) {
+                    handle_query(logger, svc, all_samples, contigs, unifier_cfg, cfg, socket_path, fd, *abort,
+                                 deadline_ms ? &deadline : nullptr);
+                    lock_guard<mutex> lock(mu);
+                    in_flight.erase(id);
+                    cv.notify_all();
+                });
+            }
+            // the executor finishes the requests in progress
+        }
+        close(lfd);
+        unlink(socket_path.c_str());
+        logger->info("query server stopped after {} request(s)", next_id);
+        return Status::OK();
+    });
+}
+
+Status query_server(const string &socket_path, const string &request, std::ostream &out) {
+    Status s;
+    sockaddr_un addr;
+    S(query_socket_address(socket_path, addr));
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return Status::IOError("creating query socket");
+    }
+    if (connect(fd, (const sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return Status::IOError("connecting to query server", socket_path);
+    }
+    const string line = request + "\n";
+    s = send_all(fd, line.c_str(), line.size());
+    shutdown(fd, SHUT_WR);
+
+    // the status line, then the output
+    string status_line;
+    char buf[65536];
+    bool in_output = false;
+    uint64_t output_bytes = 0;
+    while (s.ok()) {
+        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            s = Status::IOError("reading from query server", socket_path);
+        } else if (n == 0) {
+            break;
+        } else if (in_output) {
+            out.write(buf, n);
+            output_bytes += n;
+        } else {
+            status_line.append(buf, n);
+            size_t nl = status_line.find('\n');
+            if (nl != string::npos) {
+                out.write(status_line.data() + nl + 1, status_line.size() - nl - 1);
+                output_bytes += status_line.size() - nl - 1;
+                status_line.resize(nl);
+                in_output = true;
+            }
+        }
+    }
+    close(fd);
+    S(s);
+    if (!in_output) {
+        return Status::IOError("truncated response from query server", socket_path);
+    }
+    if (status_line.substr(0, 3) != "OK ") {
+        return Status::Failure("query server", status_line.substr(0, 6) == "ERROR " ? status_line.substr(6) : status_line);
+    }
+    char* end = nullptr;
+    const uint64_t expected_bytes = strtoull(status_line.c_str() + 3, &end, 10);
+    if (end == status_line.c_str() + 3 || *end) {
+        return Status::IOError("malformed response from query server", status_line);
+    }
+    if (output_bytes != expected_bytes) {
+        return Status::IOError("truncated response from query server",
+                               std::to_string(output_bytes) + " of " + std::to_string(expected_bytes) + " bytes");
+    }
+    if (out.bad()) {
+        return Status::IOError("writing query output");
+    }
+    return Status::OK();
+}
+
 Status compare_db_itertion_algorithms(std::shared_ptr<spdlog::logger> logger,
                                       const std::string &dbpath,
                                       int n_iter) {
     Status s;
 
     unique_ptr<KeyValue::DB> db;
-    RocksKeyValue::config cfg;
-    cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
-    cfg.pfx = GLnexus_prefix_spec();
-    S(RocksKeyValue::Open(dbpath, cfg, db));
+    S(open_db_read_only(dbpath, 0, 0, db));
 
     unique_ptr<BCFKeyValueData> data;
     S(BCFKeyValueData::Open(db.get(), data));
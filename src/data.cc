@@ -2,6 +2,10 @@
 #include "data.h"
 #include "fcmm.hpp"
 #include "khash.h"
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
 
 using namespace std;
 
@@ -16,6 +20,18 @@ public:
 };
 using StringCache = fcmm::Fcmm<string,string,hash<string>,KStringHash>;
 using StringSetCache = fcmm::Fcmm<string,shared_ptr<const set<string>>,hash<string>,KStringHash>;
+
+// second hash function for integer IDs (multiplicative hashing)
+class IDHash {
+public:
+    size_t operator()(uint32_t id) const {
+        return (size_t) (id * 0x9E3779B97F4A7C15ULL);
+    }
+};
+using IDCache = fcmm::Fcmm<string,uint32_t,hash<string>,KStringHash>;
+using NameCache = fcmm::Fcmm<uint32_t,string,hash<uint32_t>,IDHash>;
+using IDVector = shared_ptr<const vector<uint32_t>>;
+using IDVectorsCache = fcmm::Fcmm<string,pair<IDVector,IDVector>,hash<string>,KStringHash>;
 // this is not a hard limit but the FCMM performance degrades if it's too low
 const size_t CACHE_SIZE = 4096;
 
@@ -25,6 +41,9 @@ struct MetadataCache::body {
     unique_ptr<StringSetCache> sampleset_samples_cache;
     unique_ptr<StringCache> sample_dataset_cache;
     unique_ptr<StringSetCache> sampleset_datasets_cache;
+    unique_ptr<IDCache> sample_id_cache, dataset_id_cache;
+    unique_ptr<NameCache> sample_name_cache, dataset_name_cache;
+    unique_ptr<IDVectorsCache> sampleset_ids_cache;
 };
 
 MetadataCache::MetadataCache() = default;
@@ -37,6 +56,11 @@ Status MetadataCache::Start(Metadata& inner, unique_ptr<MetadataCache>& ptr) {
     ptr->body_->sampleset_samples_cache = make_unique<StringSetCache>(CACHE_SIZE);
     ptr->body_->sample_dataset_cache = make_unique<StringCache>(16 * CACHE_SIZE);
     ptr->body_->sampleset_datasets_cache = make_unique<StringSetCache>(CACHE_SIZE);
+    ptr->body_->sample_id_cache = make_unique<IDCache>(16 * CACHE_SIZE);
+    ptr->body_->dataset_id_cache = make_unique<IDCache>(16 * CACHE_SIZE);
+    ptr->body_->sample_name_cache = make_unique<NameCache>(16 * CACHE_SIZE);
+    ptr->body_->dataset_name_cache = make_unique<NameCache>(16 * CACHE_SIZE);
+    ptr->body_->sampleset_ids_cache = make_unique<IDVectorsCache>(CACHE_SIZE);
     return ptr->body_->inner->contigs(ptr->body_->contigs);
 }
 
@@ -83,6 +107,41 @@ Status MetadataCache::sample_count(size_t& ans) const {
     return body_->inner->sample_count(ans);
 }
 
+// look up an ID or name, memoizing it
+template<class Cache, typename K, typename V, typename F>
+static Status cached_lookup(Cache& cache, const K& key, V& ans, F lookup) {
+    auto cached = cache.end();
+    if ((cached = cache.find(key)) != cache.end()) {
+        ans = cached->second;
+        return Status::OK();
+    }
+
+    Status s;
+    S(lookup(key, ans));
+    cache.insert(make_pair(key,ans));
+    return Status::OK();
+}
+
+Status MetadataCache::sample_id(const string& sample, uint32_t& ans) const {
+    return cached_lookup(*body_->sample_id_cache, sample, ans,
+                         [this](const string& k, uint32_t& v) { return body_->inner->sample_id(k, v); });
+}
+
+Status MetadataCache::dataset_id(const string& dataset, uint32_t& ans) const {
+    return cached_lookup(*body_->dataset_id_cache, dataset, ans,
+                         [this](const string& k, uint32_t& v) { return body_->inner->dataset_id(k, v); });
+}
+
+Status MetadataCache::sample_name(uint32_t id, string& ans) const {
+    return cached_lookup(*body_->sample_name_cache, id, ans,
+                         [this](uint32_t k, string& v) { return body_->inner->sample_name(k, v); });
+}
+
+Status MetadataCache::dataset_name(uint32_t id, string& ans) const {
+    return cached_lookup(*body_->dataset_name_cache, id, ans,
+                         [this](uint32_t k, string& v) { return body_->inner->dataset_name(k, v); });
+}
+
 const vector<pair<string,size_t> >& MetadataCache::contigs() const {
     return body_->contigs;
 }
@@ -112,12 +171,110 @@ Status MetadataCache::sampleset_datasets(const string& sampleset,
     return Status::OK();
 }
 
+Status MetadataCache::sampleset_ids(const string& sampleset,
+                                    shared_ptr<const vector<uint32_t>>& sample_ids,
+                                    shared_ptr<const vector<uint32_t>>& dataset_ids) const {
+    auto cached = body_->sampleset_ids_cache->end();
+    if ((cached = body_->sampleset_ids_cache->find(sampleset))
+            != body_->sampleset_ids_cache->end()) {
+        sample_ids = cached->second.first;
+        dataset_ids = cached->second.second;
+        assert(sample_ids && dataset_ids);
+        return Status::OK();
+    }
+
+    Status s;
+    shared_ptr<const set<string>> samples, datasets;
+    S(sampleset_datasets(sampleset, samples, datasets));
+
+    // resolve the IDs, also priming the reverse lookups which the query
+    // paths use to name the data sets in their results
+    auto resolve = [](const set<string>& names, IDCache& ids, NameCache& names_by_id,
+                      function<Status(const string&, uint32_t&)> lookup, IDVector& ans) {
+        Status s;
+        auto v = make_shared<vector<uint32_t>>();
+        v->reserve(names.size());
+        for (const auto& name : names) {
+            uint32_t id;
+            S(cached_lookup(ids, name, id, lookup));
+            names_by_id.insert(make_pair(id, name));
+            v->push_back(id);
+        }
+        sort(v->begin(), v->end());
+        assert(unique(v->begin(), v->end()) == v->end());
+        ans = move(v);
+        return Status::OK();
+    };
+    Metadata* inner = body_->inner;
+    IDVector sample_ids_new, dataset_ids_new;
+    S(resolve(*samples, *body_->sample_id_cache, *body_->sample_name_cache,
+              [inner](const string& k, uint32_t& v) { return inner->sample_id(k, v); },
+              sample_ids_new));
+    S(resolve(*datasets, *body_->dataset_id_cache, *body_->dataset_name_cache,
+              [inner](const string& k, uint32_t& v) { return inner->dataset_id(k, v); },
+              dataset_ids_new));
+
+    sample_ids = sample_ids_new;
+    dataset_ids = dataset_ids_new;
+    body_->sampleset_ids_cache->insert(make_pair(sampleset, make_pair(sample_ids, dataset_ids)));
+    return Status::OK();
+}
+
+struct DatasetSampleIndex::body {
+    vector<string> samples;
+    map<string,int> samples_index;
+
+    std::mutex mu;
+    unordered_map<string,shared_ptr<const entry>> entries;
+};
+
+DatasetSampleIndex::DatasetSampleIndex(const vector<string>& samples) : body_(new body) {
+    body_->samples = samples;
+    for (int j = 0; j < samples.size(); j++) {
+        assert(body_->samples_index.find(samples[j]) == body_->samples_index.end());
+        body_->samples_index[samples[j]] = j;
+    }
+}
+
+DatasetSampleIndex::~DatasetSampleIndex() = default;
+
+const vector<string>& DatasetSampleIndex::samples() const {
+    return body_->samples;
+}
+
+shared_ptr<const DatasetSampleIndex::entry> DatasetSampleIndex::get(const string& dataset,
+                                                                    const bcf_hdr_t* hdr) {
+    {
+        lock_guard<std::mutex> lock(body_->mu);
+        auto p = body_->entries.find(dataset);
+        if (p != body_->entries.end()) {
+            return p->second;
+        }
+    }
+
+    // build outside the lock; if another thread races us to it, either
+    // result will do as they're identical
+    auto ans = make_shared<entry>();
+    int bcf_nsamples = bcf_hdr_nsamples(hdr);
+    for (int i = 0; i < bcf_nsamples; i++) {
+        const auto p = body_->samples_index.find(bcf_hdr_int2id(hdr, BCF_DT_SAMPLE, i));
+        if (p != body_->samples_index.end()) {
+            ans->mapping[i] = p->second;
+            ans->bcf_samples.push_back(i);
+        }
+    }
+
+    lock_guard<std::mutex> lock(body_->mu);
+    return body_->entries.insert(make_pair(dataset, ans)).first->second;
+}
+
 Status BCFData::dataset_range_and_header(const string& dataset, const range& pos, bcf_predicate predicate,
                                          shared_ptr<const bcf_hdr_t>* hdr,
-                                         vector<shared_ptr<bcf1_t>>* records) {
+                                         vector<shared_ptr<bcf1_t>>* records,
+                                         const bcf_field_selection* fields) {
     Status s;
     S(dataset_header(dataset, hdr));
-    return dataset_range(dataset, hdr->get(), pos, predicate, records);
+    return dataset_range(dataset, hdr->get(), pos, predicate, records, fields);
 }
 
 // default sampleset_range implementation:
@@ -132,12 +289,14 @@ class DefaultRangeBCFIteratorImpl : public RangeBCFIterator {
     shared_ptr<const set<string>> datasets_;
     set<string>::const_iterator it_;
     bcf_predicate predicate_;
+    const bcf_field_selection* fields_;
 
 public:
     DefaultRangeBCFIteratorImpl(BCFData& data, range range, bool first_range, bcf_predicate predicate,
-                                shared_ptr<const set<string>>& datasets)
+                                shared_ptr<const set<string>>& datasets,
+                                const bcf_field_selection* fields)
         : data_(data), range_(range), first_range_(first_range),
-          datasets_(datasets), it_(datasets->begin()), predicate_(predicate) {}
+          datasets_(datasets), it_(datasets->begin()), predicate_(predicate), fields_(fields) {}
 
     Status next(string& dataset, shared_ptr<const bcf_hdr_t>& hdr,
                 vector<shared_ptr<bcf1_t>>& records) override {
@@ -147,7 +306,7 @@ public:
         dataset = *it_++;
 
         vector<shared_ptr<bcf1_t>> all_records;
-        Status s = data_.dataset_range_and_header(dataset, range_, predicate_, &hdr, &all_records);
+        Status s = data_.dataset_range_and_header(dataset, range_, predicate_, &hdr, &all_records, fields_);
         if (s.bad()) {
              if (s == StatusCode::NOT_FOUND) {
                 // censor this error so caller doesn't think this is the normal
@@ -193,7 +352,8 @@ Status BCFData::sampleset_range(const MetadataCache& metadata, const string& sam
                                 const range& pos, bcf_predicate predicate,
                                 shared_ptr<const set<string>>& samples,
                                 shared_ptr<const set<string>>& datasets,
-                                vector<unique_ptr<RangeBCFIterator>>& iterators) {
+                                vector<unique_ptr<RangeBCFIterator>>& iterators,
+                                const bcf_field_selection* fields) {
     const int RANGE_STEP = 100000;
     Status s;
     S(metadata.sampleset_datasets(sampleset, samples, datasets));
@@ -202,7 +362,7 @@ Status BCFData::sampleset_range(const MetadataCache& metadata, const string& sam
     bool first = true;
     for (int beg = pos.beg; beg < pos.end; beg += RANGE_STEP) {
         range sub(pos.rid, beg, min(pos.end,beg+RANGE_STEP));
-        iterators.push_back(make_unique<DefaultRangeBCFIteratorImpl>(*this, sub, first, predicate, datasets));
+        iterators.push_back(make_unique<DefaultRangeBCFIteratorImpl>(*this, sub, first, predicate, datasets, fields));
         first = false;
     }
 
@@ -2,7 +2,12 @@
 #include <math.h>
 #include <assert.h>
 #include <sstream>
+#include <limits>
 #include "diploid.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define GLNEXUS_AVX2_KERNELS
+#endif
 using namespace std;
 
 namespace GLnexus {
@@ -106,6 +111,199 @@ Status bcf_zygosity_by_GQ(const bcf_hdr_t* header, bcf1_t* record, const std::ve
 
 const double LOG0 = log(0.0);
 const double LOG10_E = log10(exp(1.0));
+
+// PL batch kernels: scalar versions, and AVX2 versions used if the CPU
+// supports it (the build otherwise targets ivybridge, which lacks AVX2)
+
+// missing PL entries become PL_INF
+static const int32_t PL_INF = numeric_limits<int32_t>::max();
+
+static bool PL_log_likelihoods_scalar(const int32_t* pl, size_t n, double* gll) {
+    for (size_t ik = 0; ik < n; ik++) {
+        auto x = pl[ik];
+        if (x == bcf_int32_missing || x == bcf_int32_vector_end) {
+            gll[ik] = LOG0;
+        } else if (x >= 0) {
+            gll[ik] = double(x)/(-10.0*LOG10_E);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool normalize_PL_scalar(const int32_t* pl, size_t n, int32_t* ans) {
+    for (size_t ik = 0; ik < n; ik++) {
+        auto x = pl[ik];
+        if (x == bcf_int32_missing || x == bcf_int32_vector_end) {
+            ans[ik] = PL_INF;
+        } else if (x >= 0) {
+            ans[ik] = x;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// AQ of each allele for each of the given samples, from normalized PLs, into
+// ans[al*samples.size()+i]. This gives the same result as alleles_topAQ on the
+// corresponding log-likelihoods, whose differences are PL differences.
+static void PL_alleles_AQ_scalar(unsigned n_allele, const vector<unsigned>& samples, size_t first,
+                                 const int32_t* npl, int* ans) {
+    const unsigned nGT = genotypes(n_allele);
+    vector<int32_t> minPL_with(n_allele), minPL_without(n_allele);
+    for (size_t i = first; i < samples.size(); i++) {
+        const int32_t* npl_i = npl + samples[i]*nGT;
+        fill(minPL_with.begin(), minPL_with.end(), PL_INF);
+        fill(minPL_without.begin(), minPL_without.end(), PL_INF);
+        for (unsigned k = 0; k < nGT; k++) {
+            auto p = gt_alleles(k);
+            for (unsigned al = 0; al < n_allele; al++) {
+                if (al == p.first || al == p.second) {
+                    minPL_with[al] = std::min(minPL_with[al], npl_i[k]);
+                } else {
+                    minPL_without[al] = std::min(minPL_without[al], npl_i[k]);
+                }
+            }
+        }
+        for (unsigned al = 0; al < n_allele; al++) {
+            int aq;
+            if (minPL_with[al] == PL_INF) {
+                aq = 0;
+            } else if (minPL_without[al] == PL_INF) {
+                aq = MAX_AQ;
+            } else {
+                aq = std::min(MAX_AQ, std::max(0, minPL_without[al] - minPL_with[al]));
+            }
+            ans[al*samples.size()+i] = aq;
+        }
+    }
+}
+
+#ifdef GLNEXUS_AVX2_KERNELS
+static bool have_avx2() {
+    static const bool ans = __builtin_cpu_supports("avx2");
+    return ans;
+}
+
+__attribute__((target("avx2")))
+static bool PL_log_likelihoods_avx2(const int32_t* pl, size_t n, double* gll) {
+    const __m128i missing = _mm_set1_epi32(bcf_int32_missing);
+    const __m128i vector_end = _mm_set1_epi32(bcf_int32_vector_end);
+    const __m128i zero = _mm_setzero_si128();
+    const __m256d log0 = _mm256_set1_pd(LOG0);
+    const __m256d divisor = _mm256_set1_pd(-10.0*LOG10_E);
+    size_t ik = 0;
+    for (; ik+4 <= n; ik += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(pl+ik));
+        __m128i absent = _mm_or_si128(_mm_cmpeq_epi32(x, missing), _mm_cmpeq_epi32(x, vector_end));
+        if (_mm_movemask_epi8(_mm_andnot_si128(absent, _mm_cmplt_epi32(x, zero)))) {
+            return false;
+        }
+        __m256d v = _mm256_div_pd(_mm256_cvtepi32_pd(x), divisor);
+        v = _mm256_blendv_pd(v, log0, _mm256_castsi256_pd(_mm256_cvtepi32_epi64(absent)));
+        _mm256_storeu_pd(gll+ik, v);
+    }
+    return PL_log_likelihoods_scalar(pl+ik, n-ik, gll+ik);
+}
+
+__attribute__((target("avx2")))
+static bool normalize_PL_avx2(const int32_t* pl, size_t n, int32_t* ans) {
+    const __m256i missing = _mm256_set1_epi32(bcf_int32_missing);
+    const __m256i vector_end = _mm256_set1_epi32(bcf_int32_vector_end);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i inf = _mm256_set1_epi32(PL_INF);
+    size_t ik = 0;
+    for (; ik+8 <= n; ik += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(pl+ik));
+        __m256i absent = _mm256_or_si256(_mm256_cmpeq_epi32(x, missing), _mm256_cmpeq_epi32(x, vector_end));
+        if (_mm256_movemask_epi8(_mm256_andnot_si256(absent, _mm256_cmpgt_epi32(zero, x)))) {
+            return false;
+        }
+        _mm256_storeu_si256((__m256i*)(ans+ik), _mm256_blendv_epi8(x, inf, absent));
+    }
+    return normalize_PL_scalar(pl+ik, n-ik, ans+ik);
+}
+
+// eight samples at a time, gathering their PLs for each genotype
+static const unsigned AVX2_MAX_ALLELES = 16;
+__attribute__((target("avx2")))
+static size_t PL_alleles_AQ_avx2(unsigned n_allele, const vector<unsigned>& samples,
+                                 const int32_t* npl, int* ans) {
+    assert(n_allele <= AVX2_MAX_ALLELES);
+    const unsigned nGT = genotypes(n_allele);
+    const __m256i inf = _mm256_set1_epi32(PL_INF);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max_aq = _mm256_set1_epi32(MAX_AQ);
+    __m256i minPL_with[AVX2_MAX_ALLELES], minPL_without[AVX2_MAX_ALLELES];
+    size_t i = 0;
+    for (; i+8 <= samples.size(); i += 8) {
+        __m256i base = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(samples.data()+i)),
+                                          _mm256_set1_epi32(nGT));
+        for (unsigned al = 0; al < n_allele; al++) {
+            minPL_with[al] = minPL_without[al] = inf;
+        }
+        unsigned k = 0;
+        for (unsigned a2 = 0; a2 < n_allele; a2++) {
+            for (unsigned a1 = 0; a1 <= a2; a1++, k++) {
+                assert(k == alleles_gt(a1, a2));
+                __m256i v = _mm256_i32gather_epi32(npl, _mm256_add_epi32(base, _mm256_set1_epi32(k)), 4);
+                for (unsigned al = 0; al < n_allele; al++) {
+                    if (al == a1 || al == a2) {
+                        minPL_with[al] = _mm256_min_epi32(minPL_with[al], v);
+                    } else {
+                        minPL_without[al] = _mm256_min_epi32(minPL_without[al], v);
+                    }
+                }
+            }
+        }
+        assert(k == nGT);
+        for (unsigned al = 0; al < n_allele; al++) {
+            __m256i aq = _mm256_sub_epi32(minPL_without[al], minPL_with[al]);
+            aq = _mm256_min_epi32(_mm256_max_epi32(aq, zero), max_aq);
+            aq = _mm256_blendv_epi8(aq, max_aq, _mm256_cmpeq_epi32(minPL_without[al], inf));
+            aq = _mm256_blendv_epi8(aq, zero, _mm256_cmpeq_epi32(minPL_with[al], inf));
+            _mm256_storeu_si256((__m256i*)(ans+al*samples.size()+i), aq);
+        }
+    }
+    return i;
+}
+#endif
+
+bool PL_log_likelihoods(const int32_t* pl, size_t n, double* gll) {
+    #ifdef GLNEXUS_AVX2_KERNELS
+    if (have_avx2()) {
+        return PL_log_likelihoods_avx2(pl, n, gll);
+    }
+    #endif
+    return PL_log_likelihoods_scalar(pl, n, gll);
+}
+
+bool PL_alleles_AQ(unsigned n_allele, unsigned n_sample, const vector<unsigned>& samples,
+                   const int32_t* pl, vector<int>& ans) {
+    const unsigned nGT = genotypes(n_allele);
+    vector<int32_t> npl(size_t(n_sample)*nGT);
+    ans.resize(size_t(n_allele)*samples.size());
+    size_t first = 0;
+    #ifdef GLNEXUS_AVX2_KERNELS
+    if (have_avx2()) {
+        if (!normalize_PL_avx2(pl, npl.size(), npl.data())) {
+            return false;
+        }
+        // (the gather offsets are 32-bit)
+        if (n_allele <= AVX2_MAX_ALLELES && npl.size() <= size_t(numeric_limits<int32_t>::max())) {
+            first = PL_alleles_AQ_avx2(n_allele, samples, npl.data(), ans.data());
+        }
+    } else
+    #endif
+    if (!normalize_PL_scalar(pl, npl.size(), npl.data())) {
+        return false;
+    }
+    PL_alleles_AQ_scalar(n_allele, samples, first, npl.data(), ans.data());
+    return true;
+}
+
 GLnexus::Status bcf_get_genotype_log_likelihoods(const bcf_hdr_t* header, bcf1_t *record, vector<double>& gll) {
     unsigned nGT = genotypes(record->n_allele);
     gll.resize(record->n_sample*nGT);
@@ -113,15 +311,8 @@ GLnexus::Status bcf_get_genotype_log_likelihoods(const bcf_hdr_t* header, bcf1_t
     // try loading genotype likelihoods from PL
     htsvecbox<int32_t> igl;
     if (bcf_get_format_int32(header, record, "PL", &igl.v, &igl.capacity) == record->n_sample*nGT) {
-        for (unsigned ik = 0; ik < record->n_sample*nGT; ik++) {
-            auto x = igl[ik];
-            if (x == bcf_int32_missing || x == bcf_int32_vector_end) {
-                gll[ik] = LOG0;
-            } else if (x >= 0) {
-                gll[ik] = double(igl[ik])/(-10.0*LOG10_E);
-            } else {
-                return Status::Invalid("bcf_get_genotype_log_likelihoods: negative PL entry");
-            }
+        if (!PL_log_likelihoods(igl.v, record->n_sample*nGT, gll.data())) {
+            return Status::Invalid("bcf_get_genotype_log_likelihoods: negative PL entry");
         }
         return Status::OK();
     }
@@ -191,21 +382,34 @@ GLnexus::Status alleles_topAQ(unsigned n_allele, unsigned n_sample, const vector
 // if no genotype likelihoods can be found in the record, then return a zero AQ for each allele
 GLnexus::Status bcf_alleles_topAQ(const bcf_hdr_t* hdr, bcf1_t* record, const vector<unsigned>& samples,
                                   vector<top_AQ>& ans) {
-    vector<double> gll;
-    GLnexus::Status s = bcf_get_genotype_log_likelihoods(hdr, record, gll);
-
-    if (s.ok()) {
-        return alleles_topAQ(record->n_allele, record->n_sample, samples, gll, ans);
-    } else if (s == GLnexus::StatusCode::NOT_FOUND) {
-        ans.resize(record->n_allele);
+    // working directly from the PLs (equivalent to alleles_topAQ on
+    // bcf_get_genotype_log_likelihoods)
+    const unsigned nGT = genotypes(record->n_allele);
+    htsvecbox<int32_t> pl;
+    ans.resize(record->n_allele);
+    if (bcf_get_format_int32(hdr, record, "PL", &pl.v, &pl.capacity) == record->n_sample*nGT) {
+        for (unsigned i : samples) {
+            if (i >= record->n_sample) return Status::Invalid("bcf_alleles_topAQ");
+        }
+        vector<int> aq;
+        if (!PL_alleles_AQ(record->n_allele, record->n_sample, samples, pl.v, aq)) {
+            return Status::Invalid("bcf_get_genotype_log_likelihoods: negative PL entry");
+        }
+        for (unsigned al = 0; al < record->n_allele; al++) {
+            ans[al].clear();
+            if (!samples.empty()) {
+                ans[al].add(aq.data() + al*samples.size(), samples.size());
+            }
+            assert(ans[al].V[0] >= 0 || samples.empty());
+        }
+    } else {
+        // no genotype likelihoods
         for (auto& v : ans) {
             v.clear();
             v.V[0] = 0;
         }
-        return Status::OK();
     }
-
-    return s;
+    return Status::OK();
 }
 
 namespace trio {
@@ -9,7 +9,8 @@ Status discover_alleles_from_iterator(const set<string>& samples,
                                       const range& pos,
                                       RangeBCFIterator& iterator,
                                       discovered_alleles& final_dsals,
-                                      bool include_zero_copies) {
+                                      bool include_zero_copies,
+                                      DatasetSampleIndex* sample_index) {
     Status s;
 
     // get dataset BCF records
@@ -20,14 +21,19 @@ Status discover_alleles_from_iterator(const set<string>& samples,
     while ((s = iterator.next(dataset, dataset_header, records)).ok()) {
         discovered_alleles dsals;
         // determine which of the dataset's samples are in the desired sample set
-        // TODO: FCMM-memoize this during the operation
-        size_t dataset_nsamples = bcf_hdr_nsamples(dataset_header.get());
-        vector<unsigned> dataset_relevant_samples;
-        for (unsigned i = 0; i < dataset_nsamples; i++) {
-            if (samples.find(string(bcf_hdr_int2id(dataset_header.get(), BCF_DT_SAMPLE, i))) != samples.end()) {
-                dataset_relevant_samples.push_back(i);
+        shared_ptr<const DatasetSampleIndex::entry> indexed;
+        vector<unsigned> unindexed;
+        if (sample_index) {
+            indexed = sample_index->get(dataset, dataset_header.get());
+        } else {
+            size_t dataset_nsamples = bcf_hdr_nsamples(dataset_header.get());
+            for (unsigned i = 0; i < dataset_nsamples; i++) {
+                if (samples.find(string(bcf_hdr_int2id(dataset_header.get(), BCF_DT_SAMPLE, i))) != samples.end()) {
+                    unindexed.push_back(i);
+                }
             }
         }
+        const vector<unsigned>& dataset_relevant_samples = indexed ? indexed->bcf_samples : unindexed;
 
         // for each BCF record
         vector<top_AQ> topAQ;
@@ -0,0 +1,366 @@
+#include "executor.h"
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace GLnexus {
+
+std::vector<std::vector<int>> numa_nodes() {
+    // parse e.g. "0-13,28-41"
+    auto parse_cpulist = [](const string& s) {
+        vector<int> ans;
+        istringstream is(s);
+        string item;
+        while (getline(is, item, ',')) {
+            int lo, hi;
+            if (sscanf(item.c_str(), "%d-%d", &lo, &hi) == 2) {
+                for (int c = lo; c <= hi; c++) {
+                    ans.push_back(c);
+                }
+            } else if (sscanf(item.c_str(), "%d", &lo) == 1) {
+                ans.push_back(lo);
+            }
+        }
+        return ans;
+    };
+
+    vector<vector<int>> ans;
+    for (int n = 0; ; n++) {
+        ifstream f("/sys/devices/system/node/node" + to_string(n) + "/cpulist");
+        string s;
+        if (!f.good() || !getline(f, s)) {
+            break;
+        }
+        vector<int> cpus = parse_cpulist(s);
+        if (!cpus.empty()) {
+            // (memory-only nodes have no CPUs)
+            ans.push_back(move(cpus));
+        }
+    }
+    if (ans.size() < 2) {
+        ans.clear();
+    }
+    return ans;
+}
+
+struct executor::body {
+    struct worker_deque {
+        mutex mu;
+        deque<task> tasks;
+    };
+    vector<unique_ptr<worker_deque>> deques;
+
+    // the workers' nodes, the workers on each node and (if NUMA-aware) the
+    // CPUs of each node
+    vector<size_t> worker_node;
+    vector<vector<size_t>> node_workers;
+    vector<vector<int>> node_cpus;
+
+    // mu guards the shared queues (one per node), the sleeping workers'
+    // condition and stopping
+    mutex mu;
+    condition_variable cv;
+    vector<deque<task>> shared;
+    size_t next_shared = 0;
+    bool stopping = false;
+
+    // tasks queued anywhere, updated under the lock of the queue concerned
+    atomic<size_t> queued;
+
+    vector<thread> threads;
+
+    bool pop_local(size_t i, task& t) {
+        auto& d = *deques[i];
+        lock_guard<mutex> lock(d.mu);
+        if (d.tasks.empty()) {
+            return false;
+        }
+        t = move(d.tasks.back());
+        d.tasks.pop_back();
+        queued--;
+        return true;
+    }
+
+    // pop from the shared queue of the worker's node, or if other_nodes, from
+    // any other node's
+    bool pop_shared(size_t i, bool other_nodes, task& t) {
+        const size_t n = worker_node[i];
+        lock_guard<mutex> lock(mu);
+        for (size_t k = other_nodes ? 1 : 0; k < (other_nodes ? shared.size() : 1); k++) {
+            auto& q = shared[(n+k) % shared.size()];
+            if (!q.empty()) {
+                t = move(q.front());
+                q.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool steal_from(size_t j, task& t) {
+        auto& d = *deques[j];
+        lock_guard<mutex> lock(d.mu);
+        if (d.tasks.empty()) {
+            return false;
+        }
+        t = move(d.tasks.front());
+        d.tasks.pop_front();
+        queued--;
+        return true;
+    }
+
+    // steal from another worker on the same node, or if other_nodes, on any
+    // other node
+    bool steal(size_t i, bool other_nodes, task& t) {
+        const size_t n = worker_node[i];
+        if (!other_nodes) {
+            const auto& peers = node_workers[n];
+            size_t me = find(peers.begin(), peers.end(), i) - peers.begin();
+            for (size_t k = 1; k < peers.size(); k++) {
+                if (steal_from(peers[(me+k) % peers.size()], t)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        for (size_t k = 1; k < deques.size(); k++) {
+            size_t j = (i+k) % deques.size();
+            if (worker_node[j] != n && steal_from(j, t)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool find_task(size_t i, task& t) {
+        return pop_local(i, t) || pop_shared(i, false, t) || steal(i, false, t)
+               || pop_shared(i, true, t) || steal(i, true, t);
+    }
+
+    void pin(size_t i);
+    void worker(size_t i);
+};
+
+// the executor, if any, of which the current thread is a worker
+static thread_local const void* tl_executor = nullptr;
+static thread_local int tl_worker = -1;
+static thread_local int tl_node = -1;
+
+void executor::body::pin(size_t i) {
+    const vector<int>& cpus = node_cpus[worker_node[i]];
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (int c : cpus) {
+        if (c >= 0 && c < CPU_SETSIZE) {
+            CPU_SET(c, &cpuset);
+        }
+    }
+    // failure (e.g. the node's CPUs are outside our cgroup) just leaves the
+    // thread unpinned
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+}
+
+void executor::body::worker(size_t i) {
+    tl_executor = this;
+    tl_worker = (int) i;
+    if (!node_cpus.empty()) {
+        pin(i);
+        tl_node = (int) worker_node[i];
+    }
+    task t;
+    while (true) {
+        if (find_task(i, t)) {
+            t((int) i);
+            t = nullptr;
+            continue;
+        }
+        unique_lock<mutex> lock(mu);
+        cv.wait(lock, [this]{ return queued > 0 || stopping; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
+
+executor::executor(size_t threads) : executor(threads, vector<vector<int>>()) {}
+
+executor::executor(size_t threads, const vector<vector<int>>& nodes) : body_(new body) {
+    threads = max(threads, size_t(1));
+    body_->queued = 0;
+    body_->node_cpus = nodes;
+    const size_t nnodes = max(nodes.size(), size_t(1));
+    body_->node_workers.resize(nnodes);
+    body_->shared.resize(nnodes);
+
+    // assign workers to nodes in proportion to their CPU counts
+    size_t total_cpus = 0;
+    for (const auto& cpus : nodes) {
+        total_cpus += cpus.size();
+    }
+    for (size_t i = 0; i < threads; i++) {
+        size_t n = 0;
+        if (nodes.size() > 1 && total_cpus) {
+            if (threads >= nnodes) {
+                // worker i goes to the node covering the point i/threads of
+                // the CPUs
+                size_t cum = 0, target = i * total_cpus / threads;
+                while (n+1 < nnodes && cum + nodes[n].size() <= target) {
+                    cum += nodes[n].size();
+                    n++;
+                }
+            } else {
+                n = i;
+            }
+        }
+        body_->worker_node.push_back(n);
+        body_->node_workers[n].push_back(i);
+        body_->deques.emplace_back(new body::worker_deque);
+    }
+    if (threads < nnodes) {
+        // not enough workers to go around; nodes without any are dropped
+        body_->node_workers.resize(threads);
+        body_->shared.resize(threads);
+        if (!body_->node_cpus.empty()) {
+            body_->node_cpus.resize(threads);
+        }
+    }
+    for (size_t i = 0; i < threads; i++) {
+        body_->threads.emplace_back([this, i]() { body_->worker(i); });
+    }
+}
+
+executor::~executor() {
+    {
+        lock_guard<mutex> lock(body_->mu);
+        body_->stopping = true;
+    }
+    body_->cv.notify_all();
+    for (auto& th : body_->threads) {
+        th.join();
+    }
+    assert(body_->queued == 0);
+}
+
+size_t executor::size() const {
+    return body_->threads.size();
+}
+
+size_t executor::nodes() const {
+    return body_->shared.size();
+}
+
+int executor::current_worker() const {
+    return tl_executor == body_.get() ? tl_worker : -1;
+}
+
+int executor::current_node() {
+    return tl_node;
+}
+
+int executor::set_current_node(int node) {
+    assert(tl_executor == nullptr);
+    int prev = tl_node;
+    tl_node = node;
+    return prev;
+}
+
+void executor::submit(task t, int node) {
+    int i = current_worker();
+    if (i >= 0 && (node < 0 || body_->worker_node[i] == (size_t) node % nodes())) {
+        auto& d = *body_->deques[i];
+        lock_guard<mutex> lock(d.mu);
+        d.tasks.push_back(move(t));
+        body_->queued++;
+    } else {
+        lock_guard<mutex> lock(body_->mu);
+        auto& shared = body_->shared;
+        size_t n = node >= 0 ? (size_t) node % shared.size() : body_->next_shared++ % shared.size();
+        shared[n].push_back(move(t));
+        body_->queued++;
+    }
+    // taking mu ensures a worker about to sleep sees the increment or gets
+    // the notification
+    { lock_guard<mutex> lock(body_->mu); }
+    body_->cv.notify_one();
+}
+
+struct task_group::state {
+    mutex mu;
+    condition_variable cv;
+    deque<function<void()>> queue;
+    size_t pending = 0; // queued or running
+};
+
+task_group::task_group(executor& ex, int node) : ex_(ex), node_(node), st_(make_shared<state>()) {}
+
+task_group::~task_group() {
+    wait();
+}
+
+void task_group::enqueue(function<void()> fn) {
+    {
+        lock_guard<mutex> lock(st_->mu);
+        st_->queue.push_back(move(fn));
+        st_->pending++;
+    }
+    st_->cv.notify_all();
+    // The ticket finds nothing to do if a waiter has run the task already.
+    // It holds the state so that it's safe to run after the group is gone.
+    auto st = st_;
+    ex_.submit([st](int) { run_one(*st); }, node_);
+}
+
+bool task_group::run_one(state& st) {
+    function<void()> fn;
+    {
+        lock_guard<mutex> lock(st.mu);
+        if (st.queue.empty()) {
+            return false;
+        }
+        fn = move(st.queue.front());
+        st.queue.pop_front();
+    }
+    fn();
+    fn = nullptr;
+    {
+        lock_guard<mutex> lock(st.mu);
+        assert(st.pending > 0);
+        st.pending--;
+    }
+    st.cv.notify_all();
+    return true;
+}
+
+void task_group::wait_until(const function<bool()>& ready) {
+    unique_lock<mutex> lock(st_->mu);
+    st_->cv.wait(lock, [&]{ return !st_->queue.empty() || st_->pending == 0 || ready(); });
+}
+
+void task_group::wait() {
+    while (true) {
+        if (run_one(*st_)) {
+            continue;
+        }
+        unique_lock<mutex> lock(st_->mu);
+        if (st_->pending == 0) {
+            return;
+        }
+        st_->cv.wait(lock, [&]{ return !st_->queue.empty() || st_->pending == 0; });
+    }
+}
+
+}
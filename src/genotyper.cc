@@ -1,8 +1,11 @@
 #include <assert.h>
 #include <algorithm>
+#include <mutex>
+#include <condition_variable>
 #include "genotyper.h"
 #include "diploid.h"
 #include "vcfutils.h"
+#include "executor.h"
 
 using namespace std;
 
@@ -130,7 +133,7 @@ Status revise_genotypes(const genotyper_config& cfg, const unified_site& us,
 
     // start by replacing the record with a duplicate, since it may not be safe to
     // mutate the "original"
-    auto record = shared_ptr<bcf1_t>(bcf_dup(vr.p.get()), &bcf_destroy);
+    auto record = bcf_dup_pooled(vr.p.get());
     vr.p = record;
     if (bcf_unpack(record.get(), BCF_UN_ALL)) return Status::Failure("genotyper::prepare_dataset_records bcf_unpack");
     unsigned nGT = diploid::genotypes(record->n_allele);
@@ -679,185 +682,231 @@ static Status translate_monoallelic(const genotyper_config& cfg, const unified_s
     return Status::OK();
 }
 
-Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data, const unified_site& site,
-                     const std::string& sampleset, const vector<string>& samples,
-                     const bcf_hdr_t* hdr, shared_ptr<bcf1_t>& ans,
-                     bool residualsFlag, shared_ptr<string> &residual_rec,
-                     atomic<bool>* ext_abort) {
-    Status s;
+// State accumulated for one site as the pertinent datasets are applied to it
+struct site_genotyping_state {
+    const unified_site& site;
 
-    // Initialize a vector for the unified genotype calls for each sample,
-    // starting with everything missing. We'll then loop through BCF records
-    // overlapping this site and fill in the genotypes as we encounter them.
-    vector<one_call> genotypes(2*samples.size());
+    // range encompassing all the original alleles
+    range query_range;
 
-    // Setup format field helpers
+    vector<one_call> genotypes;
     vector<unique_ptr<FormatFieldHelper>> format_helpers;
-    S(setup_format_helpers(format_helpers, cfg, site, samples));
+    unique_ptr<AlleleDepthHelper> adh;
+    vector<DatasetResidual> lost_calls_info;
+
+    site_genotyping_state(const unified_site& site_) : site(site_), query_range(site_.pos) {}
+};
+
+struct genotyper_plan {
+    format_helper_plan format_helpers;
+};
 
-    // query database for pertinent records across the samples -- the range
-    // encompassing all the original alleles
-    range query_range(site.pos);
+Status prepare_genotyper_plan(const genotyper_config& cfg, shared_ptr<const genotyper_plan>& ans) {
+    Status s;
+    auto plan = make_shared<genotyper_plan>();
+    S(plan_format_helpers(cfg, plan->format_helpers));
+    ans = plan;
+    return Status::OK();
+}
+
+// The range of input records pertinent to the site: its own, joined with
+// those of the alleles unified into it
+static range site_query_range(const unified_site& site) {
+    range ans(site.pos);
     for (const auto& p : site.unification) {
         const range& pr = p.first.pos;
-        assert(pr.rid == query_range.rid);
-        query_range.beg = min(query_range.beg, pr.beg);
-        query_range.end = max(query_range.end, pr.end);
+        assert(pr.rid == ans.rid);
+        ans.beg = min(ans.beg, pr.beg);
+        ans.end = max(ans.end, pr.end);
     }
-    shared_ptr<const set<string>> samples2, datasets;
-    vector<unique_ptr<RangeBCFIterator>> iterators;
-    S(data.sampleset_range(cache, sampleset, query_range, nullptr,
-                           samples2, datasets, iterators));
-    assert(samples.size() == samples2->size());
-
-    auto adh = NewAlleleDepthHelper(cfg);
-    vector<DatasetResidual> lost_calls_info;
+    return ans;
+}
 
-    map<string,int> samples_index;
-    for (int i = 0; i < samples.size(); i++) {
-        assert(samples_index.find(samples[i]) == samples_index.end());
-        samples_index[samples[i]] = i;
-    }
+static Status genotype_site_begin(const genotyper_config& cfg, const genotyper_plan& plan,
+                                  const unified_site& site, const vector<string>& samples,
+                                  unique_ptr<site_genotyping_state>& ans) {
+    Status s;
+    ans = make_unique<site_genotyping_state>(site);
 
-    // for each pertinent dataset
-    for (const auto& dataset : *datasets) {
-        if (ext_abort && *ext_abort) {
-            return Status::Aborted();
-        }
+    // Initialize a vector for the unified genotype calls for each sample,
+    // starting with everything missing. We'll then loop through BCF records
+    // overlapping this site and fill in the genotypes as we encounter them.
+    ans->genotypes.resize(2*samples.size());
 
-        // load BCF records overlapping the site by "merging" the iterators
-        shared_ptr<const bcf_hdr_t> dataset_header;
-        vector<vector<shared_ptr<bcf1_t>>> recordss(iterators.size());
-        vector<shared_ptr<bcf1_t>> records;
+    // Setup format field helpers
+    S(setup_format_helpers(ans->format_helpers, cfg, plan.format_helpers, site, samples));
 
-        for (const auto& iter : iterators) {
-            string this_dataset;
-            vector<shared_ptr<bcf1_t>> these_records;
-            S(iter->next(this_dataset, dataset_header, these_records));
-            if (dataset != this_dataset) {
-                return Status::Failure("genotype_site: iterator returned unexpected dataset",
-                                       this_dataset + " instead of " + dataset);
-            }
-            records.insert(records.end(), these_records.begin(), these_records.end());
-        }
+    ans->query_range = site_query_range(site);
 
-        assert(is_sorted(records.begin(), records.end(),
-                         [] (shared_ptr<bcf1_t>& p1, shared_ptr<bcf1_t>& p2) {
-                            return range(p1) < range(p2);
-                         }));
+    ans->adh = NewAlleleDepthHelper(cfg);
+    return Status::OK();
+}
 
-        // index the samples shared between the sample set and the BCFs.
-        // this could be cached on sampleset/dataset cross
-        map<int,int> sample_mapping;
-        int bcf_nsamples = bcf_hdr_nsamples(dataset_header.get());
-        for (int i = 0; i < bcf_nsamples; i++) {
-            string sample_i(bcf_hdr_int2id(dataset_header.get(), BCF_DT_SAMPLE, i));
-            const auto p = samples_index.find(sample_i);
-            if (p != samples_index.end()) {
-                sample_mapping[i] = p->second;
-            }
-        }
-        if (sample_mapping.empty()) {
-            continue;
+// load the next dataset's BCF records from each of the iterators, "merging"
+// them. The iterators yield the datasets in the same order, which is that of
+// the database keys (not necessarily of the dataset names), so the dataset is
+// named by the first of them.
+static Status next_dataset_records(const vector<unique_ptr<RangeBCFIterator>>& iterators,
+                                   string& dataset, shared_ptr<const bcf_hdr_t>& dataset_header,
+                                   vector<shared_ptr<bcf1_t>>& records) {
+    Status s;
+    records.clear();
+    dataset.clear();
+    for (size_t i = 0; i < iterators.size(); i++) {
+        string this_dataset;
+        vector<shared_ptr<bcf1_t>> these_records;
+        S(iterators[i]->next(this_dataset, dataset_header, these_records));
+        if (i == 0) {
+            dataset = this_dataset;
+        } else if (dataset != this_dataset) {
+            return Status::Failure("genotype_site: iterator returned unexpected dataset",
+                                   this_dataset + " instead of " + dataset);
         }
+        records.insert(records.end(), these_records.begin(), these_records.end());
+    }
 
-        // pre-process the records
-        vector<int> min_ref_depth(samples.size(), -1);
-        vector<shared_ptr<bcf1_t_plus>> all_records, variant_records, variant_records_used;
-        NoCallReason rnc = NoCallReason::MissingData;
-        S(prepare_dataset_records(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
-                                  sample_mapping, records, *adh, rnc, min_ref_depth,
-                                  all_records, variant_records));
+    assert(is_sorted(records.begin(), records.end(),
+                     [] (shared_ptr<bcf1_t>& p1, shared_ptr<bcf1_t>& p2) {
+                        return range(p1) < range(p2);
+                     }));
+    return Status::OK();
+}
 
-        if (rnc != NoCallReason::N_A) {
-            // no call for the samples in this dataset (several possible
-            // reasons)
-            for (const auto& p : sample_mapping) {
-                genotypes[p.second*2].RNC =
-                    genotypes[p.second*2+1].RNC = rnc;
-            }
-        } else if (!site.monoallelic) {
-            // make genotype calls for the samples in this dataset
-            S(translate_genotypes(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
-                                  sample_mapping, variant_records, *adh, min_ref_depth,
-                                  genotypes, variant_records_used));
-        } else {
-            S(translate_monoallelic(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
-                                    sample_mapping, variant_records, *adh, min_ref_depth,
-                                    genotypes, variant_records_used));
+// Apply the records of one dataset (those overlapping the site's query range) to
+// the genotype calls and FORMAT fields of the samples it contains.
+static Status genotype_site_dataset(const genotyper_config& cfg, const vector<string>& samples,
+                                    const string& dataset,
+                                    const shared_ptr<const bcf_hdr_t>& dataset_header,
+                                    const map<int,int>& sample_mapping,
+                                    const vector<shared_ptr<bcf1_t>>& records,
+                                    bool residualsFlag, site_genotyping_state& st) {
+    Status s;
+    const unified_site& site = st.site;
+    vector<one_call>& genotypes = st.genotypes;
+    vector<unique_ptr<FormatFieldHelper>>& format_helpers = st.format_helpers;
+    auto& adh = st.adh;
+    vector<DatasetResidual>& lost_calls_info = st.lost_calls_info;
+    int bcf_nsamples = bcf_hdr_nsamples(dataset_header.get());
+
+    // pre-process the records
+    vector<int> min_ref_depth(samples.size(), -1);
+    vector<shared_ptr<bcf1_t_plus>> all_records, variant_records, variant_records_used;
+    NoCallReason rnc = NoCallReason::MissingData;
+    S(prepare_dataset_records(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
+                              sample_mapping, records, *adh, rnc, min_ref_depth,
+                              all_records, variant_records));
+
+    if (rnc != NoCallReason::N_A) {
+        // no call for the samples in this dataset (several possible
+        // reasons)
+        for (const auto& p : sample_mapping) {
+            genotypes[p.second*2].RNC =
+                genotypes[p.second*2+1].RNC = rnc;
         }
+    } else if (!site.monoallelic) {
+        // make genotype calls for the samples in this dataset
+        S(translate_genotypes(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
+                              sample_mapping, variant_records, *adh, min_ref_depth,
+                              genotypes, variant_records_used));
+    } else {
+        S(translate_monoallelic(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
+                                sample_mapping, variant_records, *adh, min_ref_depth,
+                                genotypes, variant_records_used));
+    }
 
-        // Update FORMAT fields for this dataset.
-        if (!(cfg.squeeze && variant_records.empty() && !all_records.empty())) {
-            S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site,
-                                format_helpers, all_records, variant_records_used));
-            // But if rnc = MissingData, PartialData, UnphasedVariants, or OverlappingVariants, then
-            // we must censor the FORMAT fields as potentially unreliable/misleading.
-            for (const auto& p : sample_mapping) {
-                auto rnc1 = genotypes[p.second*2].RNC;
-                auto rnc2 = genotypes[p.second*2+1].RNC;
-                bool half_call = site.monoallelic || genotypes[p.second*2].half_call || genotypes[p.second*2+1].half_call;
-
-                if (rnc1 == NoCallReason::MissingData || rnc1 == NoCallReason::PartialData) {
-                    assert(rnc1 == rnc2);
-                    for (const auto& fh : format_helpers) {
-                        S(fh->censor(p.second, false));
-                    }
-                } else if (rnc1 == NoCallReason::UnphasedVariants || rnc2 == NoCallReason::UnphasedVariants ||
-                        rnc1 == NoCallReason::OverlappingVariants || rnc2 == NoCallReason::OverlappingVariants) {
-                    for (const auto& fh : format_helpers) {
-                        if (fh->field_info.name != "DP" && fh->field_info.name != "FT") { // whitelist
-                            S(fh->censor(p.second, half_call));
-                        }
+    // Update FORMAT fields for this dataset.
+    if (!(cfg.squeeze && variant_records.empty() && !all_records.empty())) {
+        S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site,
+                            format_helpers, all_records, variant_records_used));
+        // But if rnc = MissingData, PartialData, UnphasedVariants, or OverlappingVariants, then
+        // we must censor the FORMAT fields as potentially unreliable/misleading.
+        for (const auto& p : sample_mapping) {
+            auto rnc1 = genotypes[p.second*2].RNC;
+            auto rnc2 = genotypes[p.second*2+1].RNC;
+            bool half_call = site.monoallelic || genotypes[p.second*2].half_call || genotypes[p.second*2+1].half_call;
+
+            if (rnc1 == NoCallReason::MissingData || rnc1 == NoCallReason::PartialData) {
+                assert(rnc1 == rnc2);
+                for (const auto& fh : format_helpers) {
+                    S(fh->censor(p.second, false));
+                }
+            } else if (rnc1 == NoCallReason::UnphasedVariants || rnc2 == NoCallReason::UnphasedVariants ||
+                    rnc1 == NoCallReason::OverlappingVariants || rnc2 == NoCallReason::OverlappingVariants) {
+                for (const auto& fh : format_helpers) {
+                    if (fh->field_info.name != "DP" && fh->field_info.name != "FT") { // whitelist
+                        S(fh->censor(p.second, half_call));
                     }
-                } else if (half_call) {
-                    for (const auto& fh : format_helpers) {
-                        if (fh->field_info.name != "DP" && fh->field_info.name != "GQ"
-                            && fh->field_info.name != "FT") {
-                            S(fh->censor(p.second, true));
-                        }
+                }
+            } else if (half_call) {
+                for (const auto& fh : format_helpers) {
+                    if (fh->field_info.name != "DP" && fh->field_info.name != "GQ"
+                        && fh->field_info.name != "FT") {
+                        S(fh->censor(p.second, true));
                     }
                 }
             }
-        } else {
-            // Short path if cfg.squeeze && variant_records.empty() && !all_records.empty():
-            //   Update DP only and apply squeeze transform
-            S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site,
-                                   format_helpers, all_records, variant_records_used, true));
-            for (const auto& p : sample_mapping) {
-                genotypes[p.second*2].RNC = NoCallReason::N_A;
-                genotypes[p.second*2+1].RNC = NoCallReason::N_A;
-            }
         }
+    } else {
+        // Short path if cfg.squeeze && variant_records.empty() && !all_records.empty():
+        //   Update DP only and apply squeeze transform
+        S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site,
+                               format_helpers, all_records, variant_records_used, true));
+        for (const auto& p : sample_mapping) {
+            genotypes[p.second*2].RNC = NoCallReason::N_A;
+            genotypes[p.second*2+1].RNC = NoCallReason::N_A;
+        }
+    }
 
-        // Handle residuals
-        if (residualsFlag) {
-            // TODO: don't emit residuals for lost alleles which will be represented in
-            // a separate monoallelic site
-            const set<NoCallReason> non_residual_RNCs = { NoCallReason::N_A, NoCallReason::MissingData,
-                                                          NoCallReason::PartialData, NoCallReason::InsufficientDepth,
-                                                          NoCallReason::MonoallelicSite };
+    // Handle residuals
+    if (residualsFlag) {
+        // TODO: don't emit residuals for lost alleles which will be represented in
+        // a separate monoallelic site
+        const set<NoCallReason> non_residual_RNCs = { NoCallReason::N_A, NoCallReason::MissingData,
+                                                      NoCallReason::PartialData, NoCallReason::InsufficientDepth,
+                                                      NoCallReason::MonoallelicSite };
 
-            bool any_lost_calls = false;
-            for (int i = 0; i < bcf_nsamples; i++) {
-                if (non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2].RNC) == non_residual_RNCs.end() ||
-                    non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2 + 1].RNC) == non_residual_RNCs.end()) {
-                    any_lost_calls = true;
-                    break;
-                }
+        bool any_lost_calls = false;
+        for (int i = 0; i < bcf_nsamples; i++) {
+            if (non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2].RNC) == non_residual_RNCs.end() ||
+                non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2 + 1].RNC) == non_residual_RNCs.end()) {
+                any_lost_calls = true;
+                break;
             }
+        }
 
-            if (any_lost_calls) {
-                // missing call, keep it in memory
-                DatasetResidual dsr;
-                dsr.name = dataset;
-                dsr.header = dataset_header;
-                dsr.records = records;
-                lost_calls_info.push_back(dsr);
-            }
+        if (any_lost_calls) {
+            // missing call, keep it in memory
+            DatasetResidual dsr;
+            dsr.name = dataset;
+            dsr.header = dataset_header;
+            dsr.records = records;
+            lost_calls_info.push_back(dsr);
         }
     }
 
+    return Status::OK();
+}
+
+// Per-thread buffers reused by genotype_site_end from one site to the next
+struct site_end_scratch_buffers {
+    vector<const char*> c_alleles, rnc;
+    vector<float> af;
+    vector<int32_t> aq, gt;
+};
+static thread_local site_end_scratch_buffers site_end_scratch;
+
+// Generate the output BCF record once all the datasets have been applied
+static Status genotype_site_end(const genotyper_config& cfg, MetadataCache& cache,
+                                const vector<string>& samples, const bcf_hdr_t* hdr,
+                                site_genotyping_state& st, shared_ptr<bcf1_t>& ans,
+                                bool residualsFlag, shared_ptr<string>& residual_rec) {
+    const unified_site& site = st.site;
+    vector<one_call>& genotypes = st.genotypes;
+    const vector<unique_ptr<FormatFieldHelper>>& format_helpers = st.format_helpers;
+    const vector<DatasetResidual>& lost_calls_info = st.lost_calls_info;
+    Status s;
+
+
     // Clean up emission order of alleles
     for(size_t i=0; i < samples.size(); i++) {
         if ((genotypes[2*i].allele != bcf_gt_missing && genotypes[2*i+1].allele == bcf_gt_missing) ||
@@ -865,15 +914,19 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
             swap(genotypes[2*i], genotypes[2*i+1]);
         }
     }
-    // Create the destination BCF record for this site.
-    ans = shared_ptr<bcf1_t>(bcf_init(), &bcf_destroy);
+    // Create the destination BCF record for this site. This is a temporary,
+    // copied below into a compact record for output, so it's drawn from this
+    // thread's record pool (and the vectors below from its scratch buffers).
+    ans = bcf_init_pooled();
+    auto& scratch = site_end_scratch;
     ans->rid = site.pos.rid;
     ans->pos = site.pos.beg;
     ans->rlen = site.pos.end - site.pos.beg;
     ans->qual = site.qual;
 
     // alleles
-    vector<const char*> c_alleles;
+    vector<const char*>& c_alleles = scratch.c_alleles;
+    c_alleles.clear();
     for (const auto& allele : site.alleles) {
         c_alleles.push_back(allele.dna.c_str());
     }
@@ -882,7 +935,8 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
     }
 
     // AF
-    vector<float> af;
+    vector<float>& af = scratch.af;
+    af.clear();
     bool output_af = true;
     for (int i = 1; i < site.alleles.size(); i++) {
         auto f = site.alleles[i].frequency;
@@ -898,7 +952,8 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
     }
 
     // AQ
-    vector<int32_t> aq;
+    vector<int32_t>& aq = scratch.aq;
+    aq.clear();
     bool any_aq = false;
     for (int i = 1; i < site.alleles.size(); i++) {
         auto q = site.alleles[i].quality;
@@ -912,7 +967,8 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
     }
 
     // GT
-    vector<int32_t> gt;
+    vector<int32_t>& gt = scratch.gt;
+    gt.clear();
     for (const auto& c : genotypes) {
         gt.push_back(c.allele);
     }
@@ -927,7 +983,8 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
     }
 
     // RNC
-    vector<const char*> rnc;
+    vector<const char*>& rnc = scratch.rnc;
+    rnc.clear();
     for (const auto& c : genotypes) {
         char* v = (char*) "M";
         #define RNC_CASE(reason,code) case NoCallReason::reason: v = (char*) code ; break;
@@ -1007,11 +1064,383 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
             residual_rec = make_shared<string>();
             S(residuals_gen_record(site, hdr, ans.get(), lost_calls_info,
                                     cache, samples,
-                                    *residual_rec));
+                                    *residual_rec, cfg.residuals_format));
+        }
+    }
+
+    return Status::OK();
+}
+
+// The INFO and FORMAT fields of the input records consulted by the genotyper
+// under the given configuration, so that the others needn't be deserialized.
+// Returns nullptr if all fields are needed (for residuals, which reproduce
+// the input records in full).
+static const bcf_field_selection* genotyper_input_fields(const genotyper_config& cfg,
+                                                         bool residualsFlag,
+                                                         bcf_field_selection& ans) {
+    if (residualsFlag) {
+        return nullptr;
+    }
+    ans.format = { "GT", "GQ", "PL", "GL", cfg.ref_dp_format, cfg.allele_dp_format };
+    for (const auto& field : cfg.liftover_fields) {
+        auto& keys = field.from == RetainedFieldFrom::INFO ? ans.info : ans.format;
+        keys.insert(field.orig_names.begin(), field.orig_names.end());
+    }
+    return &ans;
+}
+
+// Apply the records of one dataset to each of the sites, selecting the records
+// overlapping each site's query range, just as if it had been queried
+// individually. The records are sorted by start position.
+static Status genotype_sites_dataset(const genotyper_config& cfg, const vector<string>& samples,
+                                     const string& dataset,
+                                     const shared_ptr<const bcf_hdr_t>& dataset_header,
+                                     const map<int,int>& sample_mapping,
+                                     const vector<shared_ptr<bcf1_t>>& records, bool residualsFlag,
+                                     vector<unique_ptr<site_genotyping_state>>& sts,
+                                     vector<shared_ptr<bcf1_t>>& site_records) {
+    Status s;
+    for (auto& st : sts) {
+        site_records.clear();
+        for (const auto& rec : records) {
+            range rng(rec);
+            if (rng.beg >= st->query_range.end) {
+                break;
+            }
+            if (rng.overlaps(st->query_range)) {
+                site_records.push_back(rec);
+            }
+        }
+        S(genotype_site_dataset(cfg, samples, dataset, dataset_header, sample_mapping,
+                                site_records, residualsFlag, *st));
+    }
+    return Status::OK();
+}
+
+// Alternative to the sequential dataset loop, for sample sets much larger
+// than slice_samples: the datasets are divided into contiguous slices, each
+// retrieved and applied, concurrently on the thread pool, to its own
+// genotyping states covering just the samples it contains. The slices' states
+// are then absorbed into the sites' states in order, giving the same results
+// as the sequential loop.
+static Status genotype_sites_sliced(const genotyper_config& cfg, MetadataCache& cache, BCFData& data,
+                                    const string& sampleset, const vector<string>& samples,
+                                    const range& query_range, const bcf_field_selection* fields,
+                                    bool residualsFlag, const genotyper_plan& plan,
+                                    vector<unique_ptr<site_genotyping_state>>& sts,
+                                    executor& pool, size_t slice_samples,
+                                    atomic<bool>* ext_abort, DatasetSampleIndex& sample_index) {
+    Status s;
+    shared_ptr<const set<string>> samples2, datasets;
+    S(cache.sampleset_datasets(sampleset, samples2, datasets));
+    assert(samples.size() == samples2->size());
+
+    const vector<string> dataset_list(datasets->begin(), datasets->end());
+    const size_t n_slices = min(dataset_list.size(),
+                                (samples.size() + slice_samples - 1) / max(slice_samples, (size_t) 1));
+    if (n_slices == 0) {
+        return Status::OK();
+    }
+
+    struct slice {
+        // slice sample i is sample slice_samples[i] of the sample set
+        vector<int> slice_samples;
+        vector<unique_ptr<site_genotyping_state>> sts;
+        Status status;
+    };
+    vector<slice> slices(n_slices);
+    atomic<bool> abort(false);
+
+    auto genotype_slice = [&](size_t i) {
+        Status s;
+        slice& sl = slices[i];
+        const size_t lo = dataset_list.size()*i/n_slices, hi = dataset_list.size()*(i+1)/n_slices;
+
+        // retrieve the slice's headers and records
+        vector<string> slice_datasets;
+        vector<shared_ptr<const bcf_hdr_t>> headers;
+        vector<map<int,int>> sample_mappings;
+        vector<vector<shared_ptr<bcf1_t>>> records;
+        map<int,int> slice_index;
+        for (size_t j = lo; j < hi; j++) {
+            if (abort || (ext_abort && *ext_abort)) {
+                return Status::Aborted();
+            }
+            shared_ptr<const bcf_hdr_t> dataset_header;
+            S(data.dataset_header(dataset_list[j], &dataset_header));
+            // (copied, to be remapped onto the slice's samples below)
+            map<int,int> sample_mapping = sample_index.get(dataset_list[j], dataset_header.get())->mapping;
+            if (sample_mapping.empty()) {
+                continue;
+            }
+            vector<shared_ptr<bcf1_t>> dataset_records;
+            S(data.dataset_range(dataset_list[j], dataset_header.get(), query_range, nullptr,
+                                 &dataset_records, fields));
+            for (const auto& p : sample_mapping) {
+                slice_index[p.second] = -1;
+            }
+            slice_datasets.push_back(dataset_list[j]);
+            headers.push_back(move(dataset_header));
+            sample_mappings.push_back(move(sample_mapping));
+            records.push_back(move(dataset_records));
+        }
+
+        // index the slice's samples, and map the datasets' samples onto them
+        vector<string> slice_sample_names;
+        for (auto& p : slice_index) {
+            p.second = sl.slice_samples.size();
+            sl.slice_samples.push_back(p.first);
+            slice_sample_names.push_back(samples[p.first]);
+        }
+        for (auto& sample_mapping : sample_mappings) {
+            for (auto& p : sample_mapping) {
+                p.second = slice_index.at(p.second);
+            }
+        }
+
+        for (const auto& st : sts) {
+            unique_ptr<site_genotyping_state> slice_st;
+            S(genotype_site_begin(cfg, plan, st->site, slice_sample_names, slice_st));
+            sl.sts.push_back(move(slice_st));
+        }
+        vector<shared_ptr<bcf1_t>> site_records;
+        for (size_t j = 0; j < slice_datasets.size(); j++) {
+            if (abort || (ext_abort && *ext_abort)) {
+                return Status::Aborted();
+            }
+            S(genotype_sites_dataset(cfg, slice_sample_names, slice_datasets[j], headers[j],
+                                     sample_mappings[j], records[j], residualsFlag, sl.sts,
+                                     site_records));
+            records[j].clear();
+        }
+        return Status::OK();
+    };
+    // Waiting on the group runs its queued slices on this thread, so it's
+    // safe even when this is itself a task occupying the executor's workers.
+    task_group group(pool);
+    for (size_t i = 0; i < n_slices; i++) {
+        group.run([&, i]() {
+            slices[i].status = genotype_slice(i);
+            if (slices[i].status.bad()) {
+                abort = true;
+            }
+        });
+    }
+    group.wait();
+
+    // absorb the slices into the sites' states
+    for (auto& sl : slices) {
+        S(sl.status);
+        assert(sl.sts.size() == sts.size());
+        for (size_t k = 0; k < sts.size(); k++) {
+            site_genotyping_state& st = *sts[k];
+            site_genotyping_state& slice_st = *sl.sts[k];
+            for (size_t i = 0; i < sl.slice_samples.size(); i++) {
+                st.genotypes[2*sl.slice_samples[i]] = slice_st.genotypes[2*i];
+                st.genotypes[2*sl.slice_samples[i]+1] = slice_st.genotypes[2*i+1];
+            }
+            assert(st.format_helpers.size() == slice_st.format_helpers.size());
+            for (size_t j = 0; j < st.format_helpers.size(); j++) {
+                S(st.format_helpers[j]->absorb(*slice_st.format_helpers[j], sl.slice_samples));
+            }
+            st.lost_calls_info.insert(st.lost_calls_info.end(),
+                                      make_move_iterator(slice_st.lost_calls_info.begin()),
+                                      make_move_iterator(slice_st.lost_calls_info.end()));
+        }
+        sl.sts.clear();
+    }
+
+    return Status::OK();
+}
+
+Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data, const unified_site& site,
+                     const std::string& sampleset, const vector<string>& samples,
+                     const bcf_hdr_t* hdr, shared_ptr<bcf1_t>& ans,
+                     bool residualsFlag, shared_ptr<string> &residual_rec,
+                     atomic<bool>* ext_abort, executor* pool, size_t slice_samples,
+                     const genotyper_plan* plan, DatasetSampleIndex* sample_index) {
+    Status s;
+    shared_ptr<const genotyper_plan> plan_buf;
+    if (!plan) {
+        S(prepare_genotyper_plan(cfg, plan_buf));
+        plan = plan_buf.get();
+    }
+    unique_ptr<DatasetSampleIndex> sample_index_buf;
+    if (!sample_index) {
+        sample_index_buf.reset(new DatasetSampleIndex(samples));
+        sample_index = sample_index_buf.get();
+    }
+    assert(sample_index->samples().size() == samples.size());
+    unique_ptr<site_genotyping_state> st;
+    S(genotype_site_begin(cfg, *plan, site, samples, st));
+
+    bcf_field_selection fields_buf;
+    const bcf_field_selection* fields = genotyper_input_fields(cfg, residualsFlag, fields_buf);
+    if (pool && slice_samples && samples.size() > slice_samples) {
+        vector<unique_ptr<site_genotyping_state>> sts;
+        sts.push_back(move(st));
+        S(genotype_sites_sliced(cfg, cache, data, sampleset, samples, sts[0]->query_range, fields,
+                                residualsFlag, *plan, sts, *pool, slice_samples, ext_abort,
+                                *sample_index));
+        return genotype_site_end(cfg, cache, samples, hdr, *sts[0], ans, residualsFlag, residual_rec);
+    }
+
+    // query database for pertinent records across the samples
+    shared_ptr<const set<string>> samples2, datasets;
+    vector<unique_ptr<RangeBCFIterator>> iterators;
+    S(data.sampleset_range(cache, sampleset, st->query_range, nullptr,
+                           samples2, datasets, iterators, fields));
+    assert(samples.size() == samples2->size());
+
+    // for each pertinent dataset
+    for (size_t i = 0; i < datasets->size() && !iterators.empty(); i++) {
+        if (ext_abort && *ext_abort) {
+            return Status::Aborted();
+        }
+
+        string dataset;
+        shared_ptr<const bcf_hdr_t> dataset_header;
+        vector<shared_ptr<bcf1_t>> records;
+        S(next_dataset_records(iterators, dataset, dataset_header, records));
+        assert(datasets->count(dataset));
+
+        auto indexed = sample_index->get(dataset, dataset_header.get());
+        const map<int,int>& sample_mapping = indexed->mapping;
+        if (sample_mapping.empty()) {
+            continue;
+        }
+
+        S(genotype_site_dataset(cfg, samples, dataset, dataset_header, sample_mapping, records,
+                                residualsFlag, *st));
+    }
+
+    return genotype_site_end(cfg, cache, samples, hdr, *st, ans, residualsFlag, residual_rec);
+}
+
+Status genotype_site_group(const genotyper_config& cfg, MetadataCache& cache, BCFData& data,
+                           const vector<unified_site>& sites, size_t first, size_t last,
+                           const string& sampleset, const vector<string>& samples,
+                           const bcf_hdr_t* hdr, vector<shared_ptr<bcf1_t>>& ans,
+                           bool residualsFlag, vector<shared_ptr<string>>& residual_recs,
+                           atomic<bool>* ext_abort, executor* pool, size_t slice_samples,
+                           const genotyper_plan* plan, DatasetSampleIndex* sample_index) {
+    Status s;
+    if (first >= last || last > sites.size()) {
+        return Status::Invalid("genotype_site_group: invalid site index range");
+    }
+    shared_ptr<const genotyper_plan> plan_buf;
+    if (!plan) {
+        S(prepare_genotyper_plan(cfg, plan_buf));
+        plan = plan_buf.get();
+    }
+    unique_ptr<DatasetSampleIndex> sample_index_buf;
+    if (!sample_index) {
+        sample_index_buf.reset(new DatasetSampleIndex(samples));
+        sample_index = sample_index_buf.get();
+    }
+    assert(sample_index->samples().size() == samples.size());
+
+    vector<unique_ptr<site_genotyping_state>> sts;
+    range group_range(sites[first].pos);
+    for (size_t i = first; i < last; i++) {
+        unique_ptr<site_genotyping_state> st;
+        S(genotype_site_begin(cfg, *plan, sites[i], samples, st));
+        if (st->query_range.rid != group_range.rid) {
+            return Status::Invalid("genotype_site_group: sites span multiple contigs",
+                                   st->query_range.str());
         }
+        group_range.beg = min(group_range.beg, st->query_range.beg);
+        group_range.end = max(group_range.end, st->query_range.end);
+        sts.push_back(move(st));
+    }
+
+    bcf_field_selection fields_buf;
+    const bcf_field_selection* fields = genotyper_input_fields(cfg, residualsFlag, fields_buf);
+    if (pool && slice_samples && samples.size() > slice_samples) {
+        S(genotype_sites_sliced(cfg, cache, data, sampleset, samples, group_range, fields,
+                                residualsFlag, *plan, sts, *pool, slice_samples, ext_abort,
+                                *sample_index));
+    } else {
+        // query database once for the records overlapping any of the sites
+        shared_ptr<const set<string>> samples2, datasets;
+        vector<unique_ptr<RangeBCFIterator>> iterators;
+        S(data.sampleset_range(cache, sampleset, group_range, nullptr,
+                               samples2, datasets, iterators, fields));
+        assert(samples.size() == samples2->size());
+
+        // for each pertinent dataset, apply its records to each site they
+        // overlap. Proceeding dataset-major, we only need to hold one
+        // dataset's records in memory at a time.
+        vector<shared_ptr<bcf1_t>> site_records;
+        for (size_t i = 0; i < datasets->size() && !iterators.empty(); i++) {
+            if (ext_abort && *ext_abort) {
+                return Status::Aborted();
+            }
+
+            string dataset;
+            shared_ptr<const bcf_hdr_t> dataset_header;
+            vector<shared_ptr<bcf1_t>> records;
+            S(next_dataset_records(iterators, dataset, dataset_header, records));
+            assert(datasets->count(dataset));
+
+            auto indexed = sample_index->get(dataset, dataset_header.get());
+            const map<int,int>& sample_mapping = indexed->mapping;
+            if (sample_mapping.empty()) {
+                continue;
+            }
+
+            S(genotype_sites_dataset(cfg, samples, dataset, dataset_header, sample_mapping,
+                                     records, residualsFlag, sts, site_records));
+        }
+    }
+
+    ans.assign(sts.size(), nullptr);
+    residual_recs.assign(sts.size(), nullptr);
+    for (size_t i = 0; i < sts.size(); i++) {
+        S(genotype_site_end(cfg, cache, samples, hdr, *sts[i], ans[i], residualsFlag, residual_recs[i]));
+        sts[i].reset();
     }
 
     return Status::OK();
 }
 
+bool genotypes_reusable(const genotyper_config& cfg, const unified_site& prior,
+                        const unified_site& site) {
+    if (prior.pos != site.pos || prior.monoallelic != site.monoallelic
+        || prior.alleles.size() != site.alleles.size() || prior.unification != site.unification) {
+        return false;
+    }
+    for (size_t i = 0; i < site.alleles.size(); i++) {
+        const unified_allele& a = prior.alleles[i], & b = site.alleles[i];
+        if (a.dna != b.dna || a.normalized != b.normalized) {
+            return false;
+        }
+        if (cfg.revise_genotypes && !(a.frequency == b.frequency)) {
+            return false;
+        }
+    }
+    return !cfg.revise_genotypes || prior.lost_allele_frequency == site.lost_allele_frequency;
+}
+
+Status prefetch_site_group(const genotyper_config& cfg, const MetadataCache& cache, BCFData& data,
+                           const vector<unified_site>& sites, size_t first, size_t last,
+                           const string& sampleset, bool residualsFlag) {
+    if (first >= last || last > sites.size()) {
+        return Status::Invalid("prefetch_site_group: invalid site index range");
+    }
+    range group_range(sites[first].pos);
+    for (size_t i = first; i < last; i++) {
+        range rng = site_query_range(sites[i]);
+        if (rng.rid != group_range.rid) {
+            return Status::Invalid("prefetch_site_group: sites span multiple contigs", rng.str());
+        }
+        group_range.beg = min(group_range.beg, rng.beg);
+        group_range.end = max(group_range.end, rng.end);
+    }
+    bcf_field_selection fields_buf;
+    const bcf_field_selection* fields = genotyper_input_fields(cfg, residualsFlag, fields_buf);
+    return data.prefetch(cache, sampleset, group_range, nullptr, fields);
+}
+
+
 }
@@ -51,6 +51,20 @@ public:
 
     virtual Status update_record_format(const bcf_hdr_t* hdr, bcf1_t* record) = 0;
 
+    // Take over the data accumulated by another helper of the same kind, set
+    // up for a "slice" of the samples, in which sample i corresponds to
+    // sample slice_samples[i] of this one. The slice is left unusable.
+    virtual Status absorb(FormatFieldHelper& slice, const vector<int>& slice_samples) {
+        if ((size_t) slice.n_samples != slice_samples.size() || slice.count != count) {
+            return Status::Invalid("genotyper::FormatFieldHelper::absorb");
+        }
+        for (const auto& cs : slice.censored_samples) {
+            assert((size_t) cs.first < slice_samples.size() && slice_samples[cs.first] < n_samples);
+            censored_samples[slice_samples[cs.first]] = cs.second;
+        }
+        return Status::OK();
+    }
+
     virtual ~FormatFieldHelper() = default;
 
 protected:
@@ -78,21 +92,13 @@ protected:
         return expected_count;
     }
 
-    /// Given a format field for an input sample (unmapped_i), and
-    /// the unmapped_j-th value for this sample, find the corresponding
-    /// index of the this format field in the output.
+    /// Given the unmapped_j-th value of a format field for an input sample,
+    /// find the corresponding position of this value among the sample's
+    /// count values in the output.
     /// Returns a negative value if this value cannot be mapped to the output
-    /// (e.g. allele-specific info for a trimmed allele), and raises error
-    /// if the sample cannot be mapped
-    int get_out_ind_of_value(int unmapped_i, int unmapped_j,
-                                const map<int, int>& sample_mapping,
-                                const vector<int>& allele_mapping,
-                                const int n_allele_out) {
-        int mapped_i = sample_mapping.at(unmapped_i);
-
-        // Sample should always be mappable
-        assert (mapped_i >= 0);
-
+    /// (e.g. allele-specific info for a trimmed allele)
+    int get_out_pos_of_value(int unmapped_j, const vector<int>& allele_mapping,
+                             const int n_allele_out) {
         switch (field_info.number){
             case RetainedFieldNumber::ALT:
             case RetainedFieldNumber::ALLELES:
@@ -103,7 +109,7 @@ protected:
                     // Allele is not mappable (trimmed or is a gvcf record)
                     return -1;
                 } else {
-                    return mapped_i * count + mapped_j;
+                    return mapped_j;
                 }
             }
             case RetainedFieldNumber::GENOTYPE:
@@ -124,15 +130,38 @@ protected:
                 }
                 int mapped_j = diploid::alleles_gt(mapped_al1, mapped_al2);
                 assert(mapped_j >= 0 && mapped_j < count);
-                return mapped_i * count + mapped_j;
+                return mapped_j;
             }
             default:
             {
                 // RetainedFieldNumber::BASIC case
-                return mapped_i * count + unmapped_j;
+                return unmapped_j;
             }
         }
     }
+
+    /// The above for each of a record's n_val_per_sample values, which is the
+    /// same for all of its samples. Computing it once per record keeps the
+    /// per-sample loops of add_record_data free of field-number switches.
+    void get_out_pos_of_values(int n_val_per_sample, const vector<int>& allele_mapping,
+                               const int n_allele_out, vector<int>& ans) {
+        ans.resize(n_val_per_sample);
+        for (int j = 0; j < n_val_per_sample; j++) {
+            ans[j] = get_out_pos_of_value(j, allele_mapping, n_allele_out);
+        }
+    }
+
+    /// The index of an input sample's values in the output
+    int get_out_base_of_sample(int unmapped_i, const map<int, int>& sample_mapping) {
+        int mapped_i = sample_mapping.at(unmapped_i);
+
+        // Sample should always be mappable
+        assert (mapped_i >= 0);
+        return mapped_i * count;
+    }
+
+    // scratch space for get_out_pos_of_values
+    vector<int> out_pos_;
 };
 
 template <class T>
@@ -147,9 +176,8 @@ protected:
     // add_record_data
     vector<vector<T>> format_v;
 
-    // Combination function to handle combining multiple format values
+    // Combination functions to handle combining multiple format values
     // from multiple records
-    T (*combine_f) (const vector<T>&, T);
 
     static T max_element_wrapper(const vector<T>& v, T missing) {
         return (*max_element(v.begin(), v.end()));
@@ -251,7 +279,27 @@ protected:
 
         assert(format_v.size() == n_samples * count);
 
-        // Combine values using the combine_f function given
+        // Combine values using the combination function for the field
+        switch (field_info.combi_method) {
+            case FieldCombinationMethod::MIN:
+                combine_all<min_element_wrapper>(missing_value, ans, n_missing);
+                break;
+            case FieldCombinationMethod::MAX:
+                combine_all<max_element_wrapper>(missing_value, ans, n_missing);
+                break;
+            default:
+                combine_all<missing_element_wrapper>(missing_value, ans, n_missing);
+                break;
+        }
+
+        return Status::OK();
+    }
+
+    // the combination function is a template parameter so that it's inlined
+    // into the loop over all the values
+    template<T (*combine_f)(const vector<T>&, T)>
+    void combine_all(T missing_value, vector<T>& ans, int& n_missing) {
+        ans.reserve(format_v.size());
         for (auto& format_one : format_v) {
             ans.push_back(combine_f(format_one, missing_value));
 
@@ -260,8 +308,6 @@ protected:
 				n_missing++;
 			}
         }
-
-        return Status::OK();
     }
 
     virtual Status perform_censor(vector<T>& values, int& n_missing) {
@@ -286,24 +332,26 @@ protected:
 public:
 
     NumericFormatFieldHelper(const retained_format_field& field_info_, int n_samples_, int count_) : FormatFieldHelper(field_info_, n_samples_, count_) {
-
-        switch (field_info.combi_method) {
-            case FieldCombinationMethod::MIN:
-                combine_f = min_element_wrapper;
-                break;
-            case FieldCombinationMethod::MAX:
-                combine_f = max_element_wrapper;
-                break;
-            default:
-                combine_f = missing_element_wrapper;
-                break;
-        }
-
         format_v.resize(n_samples_ * count_);
     }
 
     virtual ~NumericFormatFieldHelper() = default;
 
+    Status absorb(FormatFieldHelper& slice, const vector<int>& slice_samples) override {
+        Status s;
+        S(FormatFieldHelper::absorb(slice, slice_samples));
+        auto numeric_slice = dynamic_cast<NumericFormatFieldHelper<T>*>(&slice);
+        if (!numeric_slice) {
+            return Status::Invalid("genotyper::NumericFormatFieldHelper::absorb", field_info.name);
+        }
+        for (size_t i = 0; i < slice_samples.size(); i++) {
+            for (int j = 0; j < count; j++) {
+                format_v[slice_samples[i]*count+j] = move(numeric_slice->format_v[i*count+j]);
+            }
+        }
+        return Status::OK();
+    }
+
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header,
                            bcf1_t* record, const map<int, int>& sample_mapping,
                            const vector<int>& allele_mapping, const int n_allele_out,
@@ -355,19 +403,18 @@ public:
                     return Status::Invalid("genotyper: unexpected result when fetching record FORMAT field", errmsg.str());
                 } // close rv != record->n_sample * count
 
+                get_out_pos_of_values(n_val_per_sample, allele_mapping, n_allele_out, out_pos_);
                 for (int i=0; i<record->n_sample; i++) {
+                    const int out_base = get_out_base_of_sample(i, sample_mapping);
+                    const T* v_i = v + i * n_val_per_sample;
                     for (int j=0; j<n_val_per_sample; j++) {
-
-                        int in_ind = i * n_val_per_sample + j;
-                        int out_ind = get_out_ind_of_value(i, j, sample_mapping, allele_mapping, n_allele_out);
-
-                        if (out_ind < 0) {
+                        if (out_pos_[j] < 0) {
                            continue;
                         }
 
+                        int out_ind = out_base + out_pos_[j];
                         assert(out_ind < format_v.size());
-                        assert(in_ind < rv);
-                        format_v[out_ind].push_back(v[in_ind]);
+                        format_v[out_ind].push_back(v_i[j]);
                     } // close for j loop
                 } // close for i loop
             } // close rv >= 0
@@ -580,6 +627,20 @@ public:
         outPL.assign(n_samples*count, bcf_int32_missing);
     }
 
+    Status absorb(FormatFieldHelper& slice, const vector<int>& slice_samples) override {
+        Status s;
+        S(FormatFieldHelper::absorb(slice, slice_samples));
+        auto pl_slice = dynamic_cast<PLFieldHelper2*>(&slice);
+        if (!pl_slice) {
+            return Status::Invalid("genotyper::PLFieldHelper2::absorb");
+        }
+        for (size_t i = 0; i < slice_samples.size(); i++) {
+            copy(pl_slice->outPL.begin() + i*count, pl_slice->outPL.begin() + (i+1)*count,
+                 outPL.begin() + slice_samples[i]*count);
+        }
+        return Status::OK();
+    }
+
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header, bcf1_t* record,
                            const map<int, int>& sample_mapping, const vector<int>& allele_mapping,
                            const int n_allele_out, const vector<string>& field_names, int n_val_per_sample) override {
@@ -765,6 +826,21 @@ public:
 
     virtual ~StringFormatFieldHelper() = default;
 
+    Status absorb(FormatFieldHelper& slice, const vector<int>& slice_samples) override {
+        Status s;
+        S(FormatFieldHelper::absorb(slice, slice_samples));
+        auto string_slice = dynamic_cast<StringFormatFieldHelper*>(&slice);
+        if (!string_slice) {
+            return Status::Invalid("genotyper::StringFormatFieldHelper::absorb", field_info.name);
+        }
+        for (size_t i = 0; i < slice_samples.size(); i++) {
+            for (int j = 0; j < count; j++) {
+                format_v[slice_samples[i]*count+j] = move(string_slice->format_v[i*count+j]);
+            }
+        }
+        return Status::OK();
+    }
+
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header,
                            bcf1_t* record, const map<int, int>& sample_mapping,
                            const vector<int>& allele_mapping, const int n_allele_out,
@@ -806,15 +882,16 @@ public:
             if (rv >= 0) {
                 found = true;
 
+                get_out_pos_of_values(n_val_per_sample, allele_mapping, n_allele_out, out_pos_);
                 for (int i=0; i<record->n_sample; i++) {
+                    const int out_base = get_out_base_of_sample(i, sample_mapping);
                     for (int j=0; j<n_val_per_sample; j++) {
                         int in_ind = i * n_val_per_sample + j;
-                        int out_ind = get_out_ind_of_value(i, j, sample_mapping, allele_mapping, n_allele_out);
-
-                        if (out_ind < 0) {
+                        if (out_pos_[j] < 0) {
                            continue;
                         }
 
+                        int out_ind = out_base + out_pos_[j];
                         assert(out_ind < format_v.size());
                         assert(in_ind < rv);
                         format_v[out_ind].push_back(v_raw[in_ind]);
@@ -881,15 +958,14 @@ public:
                 }
             }
 
-            if (!filters.empty()) {
+            const int out_pos = get_out_pos_of_value(0, allele_mapping, n_allele_out);
+            if (!filters.empty() && out_pos >= 0) {
                 for (int i = 0; i < record->n_sample; i++) {
-                    int out_ind = get_out_ind_of_value(i, 0, sample_mapping, allele_mapping, n_allele_out);
-                    if (out_ind >= 0) {
-                        assert(out_ind < format_v.size());
-                        auto& fv = format_v[out_ind];
-                        fv.insert(fv.end(), filters.begin(), filters.end());
-                        // nb: unique-ification of filter strings happens in StringFormatFieldHelper::combine_format_data
-                    }
+                    int out_ind = get_out_base_of_sample(i, sample_mapping) + out_pos;
+                    assert(out_ind < format_v.size());
+                    auto& fv = format_v[out_ind];
+                    fv.insert(fv.end(), filters.begin(), filters.end());
+                    // nb: unique-ification of filter strings happens in StringFormatFieldHelper::combine_format_data
                 }
             }
         }
@@ -899,72 +975,118 @@ public:
 };
 
 
-Status setup_format_helpers(vector<unique_ptr<FormatFieldHelper>>& format_helpers,
-                            const genotyper_config& cfg,
-                            const unified_site& site,
-                            const vector<string>& samples) {
-    for (const auto& format_field_info : cfg.liftover_fields) {
-        int count = -1;
-        if (format_field_info.number == RetainedFieldNumber::BASIC) {
-            count = format_field_info.count;
-        } else if (format_field_info.number == RetainedFieldNumber::ALT) {
-            // site.alleles.size() gives # alleles incl. REF
-            count = (site.alleles.size() - 1);
-        } else if (format_field_info.number == RetainedFieldNumber::ALLELES) {
-            count = (site.alleles.size());
-        } else if (format_field_info.number == RetainedFieldNumber::GENOTYPE) {
-            count = diploid::genotypes(site.alleles.size());
-            // TODO: censor if count > 15 (5 alleles) to prevent explosion
-        }
+// The kind of FormatFieldHelper used for each of the configured liftover
+// fields. These are determined (and the configuration checked) once for all
+// the sites to be genotyped, leaving only the helpers' instantiation, with the
+// sites' allele counts, for each site.
+enum class FormatFieldHelperKind { AD, DP, FT, PL, PL2, INT, FLOAT, STRING };
+struct format_helper_plan {
+    vector<pair<const retained_format_field*, FormatFieldHelperKind>> fields;
+};
 
-        if (count < 0) {
+Status plan_format_helpers(const genotyper_config& cfg, format_helper_plan& plan) {
+    plan.fields.clear();
+    for (const auto& format_field_info : cfg.liftover_fields) {
+        if (format_field_info.number != RetainedFieldNumber::BASIC &&
+            format_field_info.number != RetainedFieldNumber::ALT &&
+            format_field_info.number != RetainedFieldNumber::ALLELES &&
+            format_field_info.number != RetainedFieldNumber::GENOTYPE) {
             return Status::Failure("setup_format_helpers: failed to identify count for format field");
         }
 
+        FormatFieldHelperKind kind = FormatFieldHelperKind::INT;
         if (format_field_info.name == "AD") {
             if (format_field_info.type != RetainedFieldType::INT || format_field_info.number != RetainedFieldNumber::ALLELES) {
                 return Status::Invalid("genotyper misconfiguration: AD format field should have type=int, number=alleles");
             }
-            format_helpers.push_back(unique_ptr<FormatFieldHelper>(new ADFieldHelper(cfg.ref_dp_format, format_field_info, samples.size(), count)));
+            kind = FormatFieldHelperKind::AD;
         } else if (format_field_info.name == "DP") {
             if (format_field_info.type != RetainedFieldType::INT || format_field_info.number != RetainedFieldNumber::BASIC || format_field_info.count != 1) {
                 return Status::Invalid("genotyper misconfiguration: DP format field should have type=int, number=basic, count=1");
             }
-            format_helpers.push_back(unique_ptr<FormatFieldHelper>(new DPFieldHelper(format_field_info, samples.size(), count)));
+            kind = FormatFieldHelperKind::DP;
         } else if (format_field_info.name == "FT") {
             if (format_field_info.type != RetainedFieldType::STRING || format_field_info.number != RetainedFieldNumber::BASIC || format_field_info.count != 1) {
                 return Status::Invalid("genotyper misconfiguration: FT format field should have type=string, number=basic, count=1");
             }
-            format_helpers.push_back(unique_ptr<FormatFieldHelper>(new FilterFormatFieldHelper(format_field_info, samples.size(), count)));
+            kind = FormatFieldHelperKind::FT;
         } else if (format_field_info.name == "PL") {
             if (format_field_info.type != RetainedFieldType::INT || format_field_info.number != RetainedFieldNumber::GENOTYPE || format_field_info.combi_method != FieldCombinationMethod::MISSING) {
                 return Status::Invalid("genotyper misconfiguration: PL format field should have type=int, number=genotype, combi_method=missing");
             }
-            if (cfg.more_PL && !cfg.squeeze) {
-                format_helpers.push_back(unique_ptr<FormatFieldHelper>(new PLFieldHelper2(format_field_info, samples.size(), count)));
-            } else {
-                format_helpers.push_back(unique_ptr<FormatFieldHelper>(new PLFieldHelper(format_field_info, samples.size(), count)));
-            }
+            kind = (cfg.more_PL && !cfg.squeeze) ? FormatFieldHelperKind::PL2 : FormatFieldHelperKind::PL;
         } else switch (format_field_info.type) {
             case RetainedFieldType::INT:
-            {
-                format_helpers.push_back(unique_ptr<FormatFieldHelper>(new NumericFormatFieldHelper<int32_t>(format_field_info, samples.size(), count)));
+                kind = FormatFieldHelperKind::INT;
                 break;
-            }
             case RetainedFieldType::FLOAT:
-            {
-                format_helpers.push_back(unique_ptr<FormatFieldHelper>(new NumericFormatFieldHelper<float>(format_field_info, samples.size(), count)));
+                kind = FormatFieldHelperKind::FLOAT;
                 break;
-            }
             case RetainedFieldType::STRING:
-            {
             	if (format_field_info.number != RetainedFieldNumber::BASIC || format_field_info.count != 1) {
             		return Status::Invalid("genotyper misconfiguration: string format fields only support count: 1 and number: basic", format_field_info.name);
             	}
-                format_helpers.push_back(unique_ptr<FormatFieldHelper>(new StringFormatFieldHelper(format_field_info, samples.size(), count)));
+                kind = FormatFieldHelperKind::STRING;
+                break;
+            default:
+                continue;
+        }
+        plan.fields.push_back(make_pair(&format_field_info, kind));
+    }
+
+    return Status::OK();
+}
+
+Status setup_format_helpers(vector<unique_ptr<FormatFieldHelper>>& format_helpers,
+                            const genotyper_config& cfg,
+                            const format_helper_plan& plan,
+                            const unified_site& site,
+                            const vector<string>& samples) {
+    for (const auto& field : plan.fields) {
+        const retained_format_field& format_field_info = *field.first;
+        int count = -1;
+        if (format_field_info.number == RetainedFieldNumber::BASIC) {
+            count = format_field_info.count;
+        } else if (format_field_info.number == RetainedFieldNumber::ALT) {
+            // site.alleles.size() gives # alleles incl. REF
+            count = (site.alleles.size() - 1);
+        } else if (format_field_info.number == RetainedFieldNumber::ALLELES) {
+            count = (site.alleles.size());
+        } else if (format_field_info.number == RetainedFieldNumber::GENOTYPE) {
+            count = diploid::genotypes(site.alleles.size());
+            // TODO: censor if count > 15 (5 alleles) to prevent explosion
+        }
+        assert(count >= 0);
+
+        FormatFieldHelper* helper = nullptr;
+        switch (field.second) {
+            case FormatFieldHelperKind::AD:
+                helper = new ADFieldHelper(cfg.ref_dp_format, format_field_info, samples.size(), count);
+                break;
+            case FormatFieldHelperKind::DP:
+                helper = new DPFieldHelper(format_field_info, samples.size(), count);
+                break;
+            case FormatFieldHelperKind::FT:
+                helper = new FilterFormatFieldHelper(format_field_info, samples.size(), count);
+                break;
+            case FormatFieldHelperKind::PL:
+                helper = new PLFieldHelper(format_field_info, samples.size(), count);
+                break;
+            case FormatFieldHelperKind::PL2:
+                helper = new PLFieldHelper2(format_field_info, samples.size(), count);
+                break;
+            case FormatFieldHelperKind::INT:
+                helper = new NumericFormatFieldHelper<int32_t>(format_field_info, samples.size(), count);
+                break;
+            case FormatFieldHelperKind::FLOAT:
+                helper = new NumericFormatFieldHelper<float>(format_field_info, samples.size(), count);
+                break;
+            case FormatFieldHelperKind::STRING:
+                helper = new StringFormatFieldHelper(format_field_info, samples.size(), count);
                 break;
-            }
         }
+        assert(helper);
+        format_helpers.push_back(unique_ptr<FormatFieldHelper>(helper));
     }
 
     return Status::OK();
@@ -0,0 +1,59 @@
+#include "memory_budget.h"
+#include <assert.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace GLnexus {
+
+size_t memory_budget::reserved() const {
+    lock_guard<mutex> lock(mu_);
+    return reserved_;
+}
+
+size_t memory_budget::in_use() const {
+    lock_guard<mutex> lock(mu_);
+    return in_use_;
+}
+
+size_t memory_budget::available() const {
+    lock_guard<mutex> lock(mu_);
+    const size_t used = reserved_ + in_use_;
+    return used < total_ ? total_ - used : 0;
+}
+
+size_t memory_budget::reserve(size_t bytes) {
+    lock_guard<mutex> lock(mu_);
+    const size_t used = reserved_ + in_use_;
+    const size_t ans = used < total_ ? min(bytes, total_ - used) : 0;
+    reserved_ += ans;
+    return ans;
+}
+
+void memory_budget::unreserve(size_t bytes) {
+    lock_guard<mutex> lock(mu_);
+    assert(reserved_ >= bytes);
+    reserved_ -= min(bytes, reserved_);
+}
+
+bool memory_budget::try_acquire(size_t bytes) {
+    lock_guard<mutex> lock(mu_);
+    if (reserved_ + in_use_ + bytes > total_) {
+        return false;
+    }
+    in_use_ += bytes;
+    return true;
+}
+
+void memory_budget::take(size_t bytes) {
+    lock_guard<mutex> lock(mu_);
+    in_use_ += bytes;
+}
+
+void memory_budget::release(size_t bytes) {
+    lock_guard<mutex> lock(mu_);
+    assert(in_use_ >= bytes);
+    in_use_ -= min(bytes, in_use_);
+}
+
+}
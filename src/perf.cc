@@ -0,0 +1,232 @@
+#include "perf.h"
+#include <set>
+
+using namespace std;
+
+namespace GLnexus {
+namespace perf {
+
+static const char* counter_names[] = {
+    "buckets_read",
+    "bucket_bytes_read",
+    "records_decoded",
+    "records_in_range",
+    "bucket_cache_hits",
+    "bucket_cache_misses",
+    "sites_genotyped",
+    "output_records",
+    "output_bytes",
+    "stalled_ms",
+    "buckets_prefetched"
+};
+static_assert(sizeof(counter_names)/sizeof(counter_names[0]) == (unsigned)counter::COUNT,
+              "counter_names out of sync with perf::counter");
+
+static const char* timer_names[] = {
+    "fetch",
+    "decode",
+    "discover",
+    "unify",
+    "genotype",
+    "write"
+};
+static_assert(sizeof(timer_names)/sizeof(timer_names[0]) == (unsigned)timer::COUNT,
+              "timer_names out of sync with perf::timer");
+
+const char* counter_name(counter c) {
+    return counter_names[(unsigned)c];
+}
+
+const char* timer_name(timer t) {
+    return timer_names[(unsigned)t];
+}
+
+uint64_t timing::quantile_us(double q) const {
+    if (!count) {
+        return 0;
+    }
+    uint64_t target = max(uint64_t(1), uint64_t(ceil(q * count)));
+    uint64_t cum = 0;
+    for (unsigned i = 0; i < HISTOGRAM_BINS; i++) {
+        cum += histogram[i];
+        if (cum >= target) {
+            return 1ULL << i;
+        }
+    }
+    return 1ULL << (HISTOGRAM_BINS-1);
+}
+
+snapshot& snapshot::operator+=(const snapshot& rhs) {
+    for (unsigned c = 0; c < (unsigned)counter::COUNT; c++) {
+        counters[c] += rhs.counters[c];
+    }
+    for (unsigned t = 0; t < (unsigned)timer::COUNT; t++) {
+        timings[t].count += rhs.timings[t].count;
+        timings[t].total_us += rhs.timings[t].total_us;
+        for (unsigned i = 0; i < HISTOGRAM_BINS; i++) {
+            timings[t].histogram[i] += rhs.timings[t].histogram[i];
+        }
+    }
+    return *this;
+}
+
+snapshot& snapshot::operator-=(const snapshot& rhs) {
+    for (unsigned c = 0; c < (unsigned)counter::COUNT; c++) {
+        counters[c] -= rhs.counters[c];
+    }
+    for (unsigned t = 0; t < (unsigned)timer::COUNT; t++) {
+        timings[t].count -= rhs.timings[t].count;
+        timings[t].total_us -= rhs.timings[t].total_us;
+        for (unsigned i = 0; i < HISTOGRAM_BINS; i++) {
+            timings[t].histogram[i] -= rhs.timings[t].histogram[i];
+        }
+    }
+    return *this;
+}
+
+// One thread's counters. Only the owning thread updates them, so it can do
+// so with relaxed loads and stores rather than atomic read-modify-writes;
+// they're atomic just so that current() can read them concurrently.
+struct thread_counters {
+    atomic<uint64_t> counters[(unsigned)counter::COUNT];
+    atomic<uint64_t> count[(unsigned)timer::COUNT], total_us[(unsigned)timer::COUNT];
+    atomic<uint64_t> histogram[(unsigned)timer::COUNT][HISTOGRAM_BINS];
+
+    thread_counters() {
+        for (auto& x : counters) x = 0;
+        for (auto& x : count) x = 0;
+        for (auto& x : total_us) x = 0;
+        for (auto& h : histogram) {
+            for (auto& x : h) x = 0;
+        }
+    }
+
+    void add_to(snapshot& ans) const {
+        for (unsigned c = 0; c < (unsigned)counter::COUNT; c++) {
+            ans.counters[c] += counters[c].load(memory_order_relaxed);
+        }
+        for (unsigned t = 0; t < (unsigned)timer::COUNT; t++) {
+            ans.timings[t].count += count[t].load(memory_order_relaxed);
+            ans.timings[t].total_us += total_us[t].load(memory_order_relaxed);
+            for (unsigned i = 0; i < HISTOGRAM_BINS; i++) {
+                ans.timings[t].histogram[i] += histogram[t][i].load(memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// All the live threads' counters, plus the totals of those which have exited
+struct registry {
+    mutex mu;
+    set<const thread_counters*> live;
+    snapshot retired;
+};
+
+static registry& the_registry() {
+    // deliberately leaked, so it outlives any thread exiting during static
+    // destruction
+    static registry* r = new registry;
+    return *r;
+}
+
+struct thread_slot {
+    thread_counters c;
+    thread_slot() {
+        auto& r = the_registry();
+        lock_guard<mutex> lock(r.mu);
+        r.live.insert(&c);
+    }
+    ~thread_slot() {
+        auto& r = the_registry();
+        lock_guard<mutex> lock(r.mu);
+        r.live.erase(&c);
+        c.add_to(r.retired);
+    }
+};
+static thread_local thread_slot slot;
+
+static inline void bump(atomic<uint64_t>& x, uint64_t n) {
+    x.store(x.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void count(counter c, uint64_t n) {
+    bump(slot.c.counters[(unsigned)c], n);
+}
+
+void record(timer t, uint64_t us) {
+    auto& c = slot.c;
+    unsigned ti = (unsigned)t;
+    bump(c.count[ti], 1);
+    bump(c.total_us[ti], us);
+    unsigned bin = us ? 64 - __builtin_clzll(us) : 0;
+    bump(c.histogram[ti][min(bin, HISTOGRAM_BINS-1)], 1);
+}
+
+snapshot current() {
+    auto& r = the_registry();
+    lock_guard<mutex> lock(r.mu);
+    snapshot ans = r.retired;
+    for (auto c : r.live) {
+        c->add_to(ans);
+    }
+    return ans;
+}
+
+static string json_string(const string& s) {
+    ostringstream os;
+    os << '"';
+    for (char ch : s) {
+        if (ch == '"' || ch == '\\') {
+            os << '\\' << ch;
+        } else if ((unsigned char)ch < 0x20) {
+            os << "\\u" << hex << setw(4) << setfill('0') << (int)(unsigned char)ch << dec;
+        } else {
+            os << ch;
+        }
+    }
+    os << '"';
+    return os.str();
+}
+
+Status report_json(const string& phase, uint64_t elapsed_ms, const snapshot& stats,
+                   const map<string,uint64_t>& extra, ostream& out) {
+    out << "{\"phase\":" << json_string(phase)
+        << ",\"elapsed_ms\":" << elapsed_ms
+        << ",\"counters\":{";
+    for (unsigned c = 0; c < (unsigned)counter::COUNT; c++) {
+        out << (c ? "," : "") << '"' << counter_names[c] << "\":" << stats.counters[c];
+    }
+    out << "},\"timers\":{";
+    for (unsigned t = 0; t < (unsigned)timer::COUNT; t++) {
+        const timing& tm = stats.timings[t];
+        out << (t ? "," : "") << '"' << timer_names[t] << "\":{"
+            << "\"count\":" << tm.count
+            << ",\"total_ms\":" << tm.total_us/1000
+            << ",\"p50_us\":" << tm.quantile_us(0.5)
+            << ",\"p99_us\":" << tm.quantile_us(0.99)
+            << ",\"max_us\":" << tm.quantile_us(1.0)
+            << ",\"histogram_us\":{";
+        // keyed by the upper edge of each nonzero bin
+        bool first = true;
+        for (unsigned i = 0; i < HISTOGRAM_BINS; i++) {
+            if (tm.histogram[i]) {
+                out << (first ? "" : ",") << "\"" << (1ULL << i) << "\":" << tm.histogram[i];
+                first = false;
+            }
+        }
+        out << "}}";
+    }
+    out << "},\"extra\":{";
+    bool first = true;
+    for (const auto& p : extra) {
+        out << (first ? "" : ",") << json_string(p.first) << ":" << p.second;
+        first = false;
+    }
+    out << "}}" << endl;
+    if (out.fail()) {
+        return Status::IOError("writing performance report");
+    }
+    return Status::OK();
+}
+
+}}
@@ -5,6 +5,9 @@
 #include <vcf.h>
 #include "BCFSerialize.h"
 #include "residuals.h"
+#include "capnp_utils.h"
+#include <capnp/serialize-packed.h>
+#include <kj/debug.h>
 
 using namespace std;
 
@@ -18,13 +21,19 @@ static string concat(const std::vector<std::string>& samples) {
 }
 
 
-Status residuals_gen_record(const unified_site& site,
-                            const bcf_hdr_t *gl_hdr,
-                            bcf1_t *gl_call,
-                            const std::vector<DatasetResidual> &sites,
-                            const MetadataCache& cache,
-                            const std::vector<std::string>& samples,
-                            std::string &ynode) {
+// The contents of a residual, common to both formats
+struct residual_dataset {
+    std::string name;
+    std::vector<std::string> samples;
+    std::vector<std::string> records; // VCF lines
+};
+
+static Status yaml_of_residual(const vector<residual_dataset>& datasets,
+                               const unified_site& site,
+                               const vector<pair<string,size_t>>& contigs,
+                               const vector<string>& output_samples,
+                               const string& output_record,
+                               string& ynode) {
     Status s;
     YAML::Emitter out;
     out << YAML::BeginMap;
@@ -34,25 +43,15 @@ Status residuals_gen_record(const unified_site& site,
     out << YAML::BeginSeq;
 
     // for each dataset
-    vector<string> residual_samples;
-    for (const auto& ds_info : sites) {
-        ostringstream records_text;
-        // line with sample name(s)
-        for (int i = 0; i < bcf_hdr_nsamples(ds_info.header); i++) {
-            string sample_i = bcf_hdr_int2id(ds_info.header, BCF_DT_SAMPLE, i);
-            residual_samples.push_back(sample_i);
-            if (i > 0) {
-                records_text << '\t';
-            }
-            records_text << sample_i;
-        }
-        // gVCF records, one per line
-        for (const auto& rec : ds_info.records) {
-            records_text << "\n" << *(bcf1_to_string(ds_info.header.get(), rec.get()));
+    for (const auto& ds : datasets) {
+        // line with sample name(s), then the gVCF records, one per line
+        string records_text = concat(ds.samples);
+        for (const auto& rec : ds.records) {
+            records_text += "\n" + rec;
         }
         out << YAML::BeginMap;
-        out << YAML::Key << ds_info.name;
-        out << YAML::Value << YAML::Literal << records_text.str();
+        out << YAML::Key << ds.name;
+        out << YAML::Value << YAML::Literal << records_text;
         out << YAML::EndMap;
     }
     out << YAML::EndSeq;
@@ -60,11 +59,51 @@ Status residuals_gen_record(const unified_site& site,
 
     // write the unified site
     out << YAML::Key << "unified_site";
-    const auto& contigs = cache.contigs();
     S(site.yaml(contigs, out));
 
-
     // write the output bcf with the calls that GLnexus made for these samples
+    out << YAML::Key << "output_vcf";
+    out << YAML::Literal << concat(output_samples) + "\n" + output_record;
+
+    out << YAML::EndMap;
+
+    // Emit YAML format
+    ynode = string(out.c_str());
+    return Status::OK();
+}
+
+static string packed_bytes(::capnp::MessageBuilder& message) {
+    kj::VectorOutputStream buf;
+    ::capnp::writePackedMessage(buf, message);
+    auto bytes = buf.getArray();
+    return string((const char*) bytes.begin(), bytes.size());
+}
+
+Status residuals_gen_record(const unified_site& site,
+                            const bcf_hdr_t *gl_hdr,
+                            bcf1_t *gl_call,
+                            const std::vector<DatasetResidual> &sites,
+                            const MetadataCache& cache,
+                            const std::vector<std::string>& samples,
+                            std::string &rec,
+                            GLnexusResidualsFormat format) {
+    // for each dataset, the sample name(s) and gVCF records
+    vector<residual_dataset> datasets;
+    vector<string> residual_samples;
+    for (const auto& ds_info : sites) {
+        residual_dataset ds;
+        ds.name = ds_info.name;
+        for (int i = 0; i < bcf_hdr_nsamples(ds_info.header); i++) {
+            ds.samples.push_back(bcf_hdr_int2id(ds_info.header, BCF_DT_SAMPLE, i));
+            residual_samples.push_back(ds.samples.back());
+        }
+        for (const auto& record : ds_info.records) {
+            ds.records.push_back(*(bcf1_to_string(ds_info.header.get(), record.get())));
+        }
+        datasets.push_back(move(ds));
+    }
+
+    // the output bcf with the calls that GLnexus made for these samples
     // (including only the samples with residuals)
     vector<const char*> samples4subset;
     for (const string& sample : residual_samples) {
@@ -80,26 +119,49 @@ Status residuals_gen_record(const unified_site& site,
     if (bcf_subset(gl_hdr, subrec.get(), residual_samples.size(), imap.data())) {
         return Status::Failure("residuals_gen_record: bcf_subset failed");
     }
+    string output_record = *(bcf1_to_string(subhdr.get(), subrec.get()));
 
-    out << YAML::Key << "output_vcf";
-    out << YAML::Literal << concat(residual_samples) + "\n" + *(bcf1_to_string(subhdr.get(), subrec.get()));
-
-    out << YAML::EndMap;
+    if (format == GLnexusResidualsFormat::YAML) {
+        return yaml_of_residual(datasets, site, cache.contigs(), residual_samples, output_record, rec);
+    }
 
-    // Emit YAML format
-    ynode = string(out.c_str());
+    assert(format == GLnexusResidualsFormat::BINARY);
+    try {
+        ::capnp::MallocMessageBuilder message;
+        auto r = message.initRoot<capnp::ResidualsMessage>().initResidual();
+        auto ds_b = r.initDatasets(datasets.size());
+        for (size_t i = 0; i < datasets.size(); i++) {
+            const auto& ds = datasets[i];
+            ds_b[i].setName(ds.name.c_str());
+            auto samples_b = ds_b[i].initSamples(ds.samples.size());
+            for (size_t j = 0; j < ds.samples.size(); j++) {
+                samples_b.set(j, ds.samples[j].c_str());
+            }
+            auto records_b = ds_b[i].initRecords(ds.records.size());
+            for (size_t j = 0; j < ds.records.size(); j++) {
+                records_b.set(j, ds.records[j].c_str());
+            }
+        }
+        capnp_of_unified_site(site, r.initSite());
+        auto output_samples_b = r.initOutputSamples(residual_samples.size());
+        for (size_t j = 0; j < residual_samples.size(); j++) {
+            output_samples_b.set(j, residual_samples[j].c_str());
+        }
+        r.setOutputRecord(output_record.c_str());
+        rec = packed_bytes(message);
+    } catch (kj::Exception& exn) {
+        return Status::Failure("residuals_gen_record", exn.getDescription().cStr());
+    }
     return Status::OK();
 }
 
+static const uint16_t residuals_format_version = 1;
+
 // destructor
 ResidualsFile::~ResidualsFile() {
-    // write EOF marker
-    ofs_ << "..." << endl;
-
-    ofs_.close();
+    close();
 }
 
-
 Status ResidualsFile::Open(std::string filename,
                            std::unique_ptr<ResidualsFile> &ans) {
     ans = make_unique<ResidualsFile>(filename);
@@ -112,7 +174,47 @@ Status ResidualsFile::Open(std::string filename,
     return Status::OK();
 }
 
+Status ResidualsFile::Open(const genotyper_config& cfg, std::string filename,
+                           const std::vector<std::pair<std::string,size_t>>& contigs, bool header,
+                           std::unique_ptr<ResidualsFile> &ans) {
+    if (cfg.residuals_format == GLnexusResidualsFormat::YAML) {
+        return Open(filename, ans);
+    }
+
+    assert(cfg.residuals_format == GLnexusResidualsFormat::BINARY);
+    ans = make_unique<ResidualsFile>(filename, cfg.residuals_format);
+    string mode = "w";
+    if (cfg.output_compression_level >= 0) {
+        mode += std::to_string(cfg.output_compression_level);
+    }
+    ans->bgzf_ = bgzf_open(filename.c_str(), mode.c_str());
+    if (!ans->bgzf_) {
+        return Status::IOError("Error opening file for truncate ", filename);
+    }
+
+    if (header) {
+        string hdr;
+        try {
+            ::capnp::MallocMessageBuilder message;
+            auto h = message.initRoot<capnp::ResidualsMessage>().initHeader();
+            h.setVersion(residuals_format_version);
+            capnp_of_contigs(contigs, h.initContigs(contigs.size()));
+            hdr = packed_bytes(message);
+        } catch (kj::Exception& exn) {
+            return Status::Failure("ResidualsFile::Open", exn.getDescription().cStr());
+        }
+        return ans->write_record(hdr);
+    }
+    return Status::OK();
+}
+
 Status ResidualsFile::write_record(std::string &rec) {
+    if (format_ == GLnexusResidualsFormat::BINARY) {
+        if (!bgzf_ || bgzf_write(bgzf_, rec.c_str(), rec.size()) != (ssize_t) rec.size())
+            return Status::IOError("File cannot be written to ", filename_);
+        return Status::OK();
+    }
+
     if (!ofs_.good())
         return Status::Invalid("File cannot be written to ", filename_);
 
@@ -122,4 +224,114 @@ Status ResidualsFile::write_record(std::string &rec) {
     return Status::OK();
 }
 
+Status ResidualsFile::close() {
+    if (format_ == GLnexusResidualsFormat::BINARY) {
+        if (bgzf_) {
+            int ret = bgzf_close(bgzf_);
+            bgzf_ = nullptr;
+            if (ret != 0)
+                return Status::IOError("Error closing file ", filename_);
+        }
+        return Status::OK();
+    }
+
+    if (ofs_.is_open()) {
+        // write EOF marker
+        ofs_ << "..." << endl;
+
+        ofs_.close();
+        if (ofs_.fail())
+            return Status::IOError("Error closing file ", filename_);
+    }
+    return Status::OK();
+}
+
+// kj::InputStream reading a BGZF file
+class BGZFInputStream : public kj::InputStream {
+    BGZF* fp_;
+
+public:
+    BGZFInputStream(BGZF* fp) : fp_(fp) {}
+
+    size_t tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+        size_t n = 0;
+        while (n < minBytes) {
+            ssize_t ret = bgzf_read(fp_, (char*) buffer + n, maxBytes - n);
+            KJ_REQUIRE(ret >= 0, "bgzf_read failed");
+            if (ret == 0) {
+                break;
+            }
+            n += ret;
+        }
+        return n;
+    }
+};
+
+Status residuals_yaml_of_binary(const std::string& filename, std::ostream& out) {
+    Status s;
+    shared_ptr<BGZF> fp(bgzf_open(filename.c_str(), "r"), [](BGZF* p) { if (p) bgzf_close(p); });
+    if (!fp) {
+        return Status::IOError("Error opening file ", filename);
+    }
+
+    try {
+        BGZFInputStream in(fp.get());
+        kj::BufferedInputStreamWrapper buffered(in);
+
+        vector<pair<string,size_t>> contigs;
+        {
+            ::capnp::PackedMessageReader message(buffered);
+            auto msg = message.getRoot<capnp::ResidualsMessage>();
+            if (!msg.isHeader()) {
+                return Status::Invalid("binary residuals file lacks header", filename);
+            }
+            auto hdr = msg.getHeader();
+            if (hdr.getVersion() != residuals_format_version) {
+                return Status::Invalid("unsupported binary residuals format version", std::to_string(hdr.getVersion()));
+            }
+            contigs_of_capnp(hdr.getContigs(), contigs);
+        }
+
+        while (buffered.tryGetReadBuffer().size() > 0) {
+            ::capnp::PackedMessageReader message(buffered);
+            auto msg = message.getRoot<capnp::ResidualsMessage>();
+            if (!msg.isResidual()) {
+                return Status::Invalid("unexpected message in binary residuals file", filename);
+            }
+            auto r = msg.getResidual();
+
+            vector<residual_dataset> datasets;
+            for (auto ds_r : r.getDatasets()) {
+                residual_dataset ds;
+                ds.name = string_of_capnp(ds_r.getName());
+                for (auto sample : ds_r.getSamples()) {
+                    ds.samples.push_back(string_of_capnp(sample));
+                }
+                for (auto rec : ds_r.getRecords()) {
+                    ds.records.push_back(string_of_capnp(rec));
+                }
+                datasets.push_back(move(ds));
+            }
+            unified_site site(range(-1,-1,-1));
+            S(unified_site_of_capnp(r.getSite(), contigs, site));
+            vector<string> output_samples;
+            for (auto sample : r.getOutputSamples()) {
+                output_samples.push_back(string_of_capnp(sample));
+            }
+
+            string ynode;
+            S(yaml_of_residual(datasets, site, contigs, output_samples,
+                               string_of_capnp(r.getOutputRecord()), ynode));
+            out << "---" << endl;
+            out << ynode << endl;
+            out << endl;
+        }
+    } catch (kj::Exception& exn) {
+        return Status::Invalid("reading binary residuals file", exn.getDescription().cStr());
+    }
+
+    out << "..." << endl;
+    return out.good() ? Status::OK() : Status::IOError("writing YAML residuals");
+}
+
 }
@@ -5,46 +5,121 @@
 #include "genotyper.h"
 #include "residuals.h"
 #include "diploid.h"
+#include "BCFSerialize.h"
+#include "perf.h"
+#include <tbx.h>
+#include <bgzf.h>
+#include <hfile.h>
 #include <algorithm>
 #include <sstream>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <unordered_map>
+#include <deque>
 #include <assert.h>
 #include <tuple>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "ctpl_stl.h"
+#include "executor.h"
 
 using namespace std;
 
 namespace GLnexus{
 
+class BCFFileSink;
+
 // pImpl idiom
 struct Service::body {
     service_config cfg_;
     BCFData& data_;
     std::unique_ptr<MetadataCache> metadata_;
 
-    // thread pool for executing discover_alleles and genotype_sites operations
-    ctpl::thread_pool threadpool_;
+    // work-stealing thread pool for executing discover_alleles and
+    // genotype_sites operations, including nested fan-outs within them
+    executor threadpool_;
 
-    // "meta" thread pool for driving multiple concurrent discover_alleles and
-    // "genotype_sites operations
+    // "meta" thread pool for driving concurrent genotype_sites parts, each of
+    // which blocks writing its output in order while its genotyping tasks are
+    // throttled by a ReorderWindow. Keeping these drivers off threadpool_
+    // ensures they can't occupy the workers their own tasks need.
     ctpl::thread_pool metapool_;
 
+    // I/O thread pool for reading ahead (see service_config::prefetch_distance)
+    ctpl::thread_pool iopool_;
+
     atomic<uint64_t> threads_stalled_ms_;
 
-    body(BCFData& data) : data_(data) {}
+    // performance counters as of the service's start
+    perf::snapshot perf_base_;
+
+    // DatasetSampleIndex of each sample set used so far (they're immutable, so
+    // remain valid for the service's lifetime)
+    mutex sample_indices_mutex_;
+    map<string,shared_ptr<DatasetSampleIndex>> sample_indices_;
+
+    Status get_sample_index(const string& sampleset, shared_ptr<DatasetSampleIndex>& ans) {
+        Status s;
+        lock_guard<mutex> lock(sample_indices_mutex_);
+        auto p = sample_indices_.find(sampleset);
+        if (p == sample_indices_.end()) {
+            shared_ptr<const set<string>> samples;
+            S(metadata_->sampleset_samples(sampleset, samples));
+            vector<string> sample_list(samples->begin(), samples->end());
+            p = sample_indices_.insert(make_pair(sampleset, make_shared<DatasetSampleIndex>(sample_list))).first;
+        }
+        ans = p->second;
+        return Status::OK();
+    }
+
+    body(BCFData& data, size_t threads, bool numa)
+        : data_(data), threadpool_(threads, numa ? numa_nodes() : vector<vector<int>>()) {}
+
+    // Get the sample names & create the output BCF header for the sample set
+    Status prepare_output_header(const genotyper_config& cfg, const string& sampleset,
+                                 vector<string>& sample_names, shared_ptr<bcf_hdr_t>& hdr);
+
+    // Genotype sites [first,last), writing the results in order to out (and
+    // residualsFile, if any).
+    // concurrent_parts is the number of such operations running at once,
+    // among which the memory & thread budgets are divided. If node >= 0 the
+    // genotyping tasks are directed to that NUMA node's workers.
+    Status genotype_sites_part(const genotyper_config& cfg, const string& sampleset,
+                               const vector<string>& sample_names, const bcf_hdr_t* hdr,
+                               const vector<unified_site>& sites, size_t first, size_t last,
+                               size_t concurrent_parts, BCFFileSink& out,
+                               ResidualsFile* residualsFile,
+                               atomic<bool>* ext_abort, int node = -1);
+
+    // The NUMA node for the i'th of several concurrent parts, or -1 if the
+    // executor isn't NUMA-aware. Consecutive parts cover adjacent regions of
+    // the genome, so assigning them node by node keeps each region's buckets
+    // in one node's cache partition.
+    int part_node(size_t i, size_t parts) const {
+        size_t nodes = threadpool_.nodes();
+        return nodes > 1 ? (int) (i * nodes / max(parts, (size_t) 1)) : -1;
+    }
 };
 
 Service::Service(const service_config& cfg, BCFData& data) {
-    body_ = make_unique<Service::body>(data);
+    size_t threads = cfg.threads ? cfg.threads : thread::hardware_concurrency();
+    body_ = make_unique<Service::body>(data, threads, cfg.numa);
     body_->cfg_ = cfg;
-    if (body_->cfg_.threads == 0) {
-        body_->cfg_.threads = thread::hardware_concurrency();
+    body_->cfg_.threads = threads;
+    body_->metapool_.resize(threads);
+    if (cfg.prefetch_distance) {
+        body_->iopool_.resize(std::max(cfg.prefetch_threads, (size_t) 1));
     }
-    body_->threadpool_.resize(body_->cfg_.threads);
-    body_->metapool_.resize(body_->cfg_.threads);
     body_->threads_stalled_ms_ = 0;
+    body_->perf_base_ = perf::current();
 }
 
 Service::~Service() = default;
@@ -55,6 +130,111 @@ Status Service::Start(const service_config& cfg, Metadata& metadata, BCFData& da
     return MetadataCache::Start(metadata, svc->body_->metadata_);
 }
 
+// Reads ahead for a sequence of n queries made roughly in order by
+// concurrent tasks (site groups or ranges). When task i begins, it calls
+// advance(i), which schedules fetch(j) on the I/O pool for each of the
+// queries j up to i+distance not yet scheduled. The fetches are only hints,
+// so their errors are ignored (the query proper will encounter them), and
+// any whose query has already begun by the time an I/O thread reaches it is
+// skipped. The destructor cancels those not yet started, and waits for the
+// rest. A disabled instance (distance 0) does nothing.
+class ReadAhead {
+    ctpl::thread_pool& pool_;
+    const size_t distance_, n_;
+    const function<Status(size_t)> fetch_;
+    const int node_;
+    mutex mu_;
+    size_t issued_ = 0;     // fetches [0,issued_) have been scheduled
+    atomic<size_t> begun_;  // one plus the furthest task begun
+    atomic<bool> stop_;
+    deque<future<void>> pending_;
+
+public:
+    // node: the NUMA node on whose behalf the fetches are made (for the bucket
+    // cache partition they fill), or -1
+    ReadAhead(ctpl::thread_pool& pool, size_t distance, size_t n,
+              function<Status(size_t)> fetch, int node = -1)
+        : pool_(pool), distance_(distance), n_(n), fetch_(move(fetch)), node_(node),
+          begun_(0), stop_(false) {}
+
+    ~ReadAhead() {
+        stop_ = true;
+        for (auto& fut : pending_) {
+            fut.wait();
+        }
+    }
+
+    void advance(size_t i) {
+        if (!distance_) {
+            return;
+        }
+        size_t b = begun_;
+        while (b < i+1 && !begun_.compare_exchange_weak(b, i+1));
+
+        lock_guard<mutex> lock(mu_);
+        // forget completed fetches
+        while (!pending_.empty()
+               && pending_.front().wait_for(chrono::seconds(0)) == future_status::ready) {
+            pending_.pop_front();
+        }
+        issued_ = std::max(issued_, i+1);
+        for (; issued_ < std::min(n_, i+1+distance_); issued_++) {
+            const size_t j = issued_;
+            pending_.push_back(pool_.push([this, j](int) {
+                if (stop_ || j < begun_) {
+                    return;
+                }
+                int prev = executor::set_current_node(node_);
+                fetch_(j);
+                executor::set_current_node(prev);
+            }));
+        }
+    }
+};
+
+// Merge tables into ans by a parallel tree reduction on the executor. Each
+// round k-way merges groups of consecutive tables concurrently, the first
+// round occupying all the threads, until few enough remain to merge into ans
+// directly. (Combining the info of an allele discovered in several tables is
+// commutative and associative, so the grouping doesn't affect the result.)
+// tables are cleared by side-effect.
+static Status reduce_discovered_alleles(executor& pool, size_t threads,
+                                        vector<discovered_alleles>& tables,
+                                        discovered_alleles& ans) {
+    Status s;
+    threads = max(threads, size_t(1));
+
+    while (tables.size() > 2) {
+        size_t fanout = max(size_t(2), (tables.size() + threads - 1) / threads);
+        vector<discovered_alleles> merged((tables.size() + fanout - 1) / fanout);
+        vector<future<Status>> statuses;
+        task_group tasks(pool);
+        for (size_t j = 0; j < merged.size(); j++) {
+            statuses.push_back(tasks.push([&, j]() {
+                vector<discovered_alleles> group;
+                for (size_t i = j*fanout; i < min(tables.size(), (j+1)*fanout); i++) {
+                    group.push_back(move(tables[i]));
+                }
+                return merge_discovered_alleles(group, merged[j]);
+            }));
+        }
+
+        // wait for all the tasks, recording the first error if any
+        for (auto& fut : statuses) {
+            Status s_j(tasks.get(fut));
+            if (s.ok() && s_j.bad()) {
+                s = move(s_j);
+            }
+        }
+        if (s.bad()) {
+            return s;
+        }
+        tables = move(merged);
+    }
+
+    return merge_discovered_alleles(tables, ans);
+}
+
 Status Service::discover_alleles(const string& sampleset, const range& pos,
                                  unsigned& N, discovered_alleles& ans,
                                  bool include_zero_copies,
@@ -64,22 +244,20 @@ Status Service::discover_alleles(const string& sampleset, const range& pos,
     vector<unique_ptr<RangeBCFIterator>> iterators;
     Status s;
     N = 0;
+    perf::scoped_timer timer(perf::timer::discover);
 
     // Query for (iterators to) records overlapping pos in all the data sets.
     // We query for variant records only (excluding reference confidence records
     // which have only a symbolic ALT allele)
-    bcf_predicate predicate = [](const bcf_hdr_t* hdr, bcf1_t* bcf, bool &retval) {
-        if (bcf_unpack(bcf, BCF_UN_STR)) {
-            return Status::IOError("bcf_unpack");
-        }
-        retval = !is_gvcf_ref_record(bcf);
-        return Status::OK();
-    };
-    S(body_->data_.sampleset_range(*(body_->metadata_), sampleset, pos, predicate,
+    S(body_->data_.sampleset_range(*(body_->metadata_), sampleset, pos, bcf_variant_predicate,
                                    samples, datasets, iterators));
     N = samples->size();
+    shared_ptr<DatasetSampleIndex> sample_index;
+    S(body_->get_sample_index(sampleset, sample_index));
 
-    // Enqueue processing of each dataset on the thread pool.
+    // Enqueue processing of each dataset on the executor. This may itself be
+    // running as a task there (from the multi-range discover_alleles below),
+    // in which case waiting on the group runs its tasks on this thread.
     // TODO: improve cache-friendliness for long ranges
     atomic<bool> abort(false);
     vector<future<Status>> statuses;
@@ -88,17 +266,19 @@ Status Service::discover_alleles(const string& sampleset, const range& pos,
     // We assume that by virtue of preallocating, no mutex is necessary to
     // use it as follows because writes and reads of individual elements are
     // serialized by the futures.
+    task_group group(body_->threadpool_);
     size_t i = 0;
     for (const auto& iterator : iterators) {
         RangeBCFIterator* raw_iter = iterator.get();
-        auto fut = body_->threadpool_.push([&, i, raw_iter](int tid){
+        auto fut = group.push([&, i, raw_iter](){
             if (abort || (ext_abort && *ext_abort)) {
                 abort = true;
                 return Status::Aborted();
             }
 
             discovered_alleles dsals;
-            Status ls = discover_alleles_from_iterator(*samples, pos, *raw_iter, dsals, include_zero_copies);
+            Status ls = discover_alleles_from_iterator(*samples, pos, *raw_iter, dsals, include_zero_copies,
+                                                       sample_index.get());
             results[i] = move(dsals);
             return ls;
         });
@@ -108,21 +288,14 @@ Status Service::discover_alleles(const string& sampleset, const range& pos,
     }
     assert(statuses.size() == iterators.size());
 
-    // Retrieve the results and merge them into ans. Record the first error
-    // that occurs, if any, but always wait for all tasks to finish.
+    // Wait for the results. Record the first error that occurs, if any, but
+    // always wait for all tasks to finish.
     ans.clear();
     s = Status::OK();
     for (size_t i = 0; i < iterators.size(); i++) {
         // wait for task i to complete and find out its status
-        Status s_i(statuses[i].get());
-        discovered_alleles dsals = move(results[i]);
-
-        if (s.ok() && s_i.ok()) {
-            s = merge_discovered_alleles(dsals, ans);
-            if (s.bad()) {
-                abort = true;
-            }
-        } else if (s.ok() && s_i.bad()) {
+        Status s_i(group.get(statuses[i]));
+        if (s.ok() && s_i.bad()) {
             // record the first error, and tell remaining tasks to abort
             s = move(s_i);
             abort = true;
@@ -131,24 +304,48 @@ Status Service::discover_alleles(const string& sampleset, const range& pos,
     if (s.bad()) {
         return s;
     }
+
+    // merge the per-dataset results into ans
+    S(reduce_discovered_alleles(body_->threadpool_, body_->cfg_.threads, results, ans));
     return discovered_alleles_refcheck(ans, body_->metadata_->contigs());
 }
 
 Status Service::discover_alleles(const string& sampleset, const vector<range>& ranges,
-                                 unsigned& N, vector<discovered_alleles>& ans,
-                                 bool include_zero_copies, atomic<bool>* ext_abort) {
+                                 unsigned& N, bool include_zero_copies, atomic<bool>* ext_abort,
+                                 const function<Status(discovered_alleles&)>& consumer) {
+    // Each range is a task on the executor, which fans out over the datasets
+    // in a nested task group.
+    //
+    // With a memory budget, the tasks are submitted only as the budget admits
+    // their results (estimated as the mean of those so far), charged until
+    // the consumer has taken them; but always at least a thread pool's worth
+    // beyond the next one to be consumed. Submission is done by this thread
+    // between consuming results, so the tasks themselves never wait on the
+    // budget (which they otherwise might while this thread runs them inline
+    // in group.get).
     atomic<bool> abort(false);
     vector<future<Status>> statuses;
     vector<discovered_alleles> results(ranges.size());
+    vector<size_t> charges(ranges.size(), 0), result_bytes(ranges.size(), 0);
+    memory_budget* budget = body_->cfg_.budget;
+    const size_t min_tasks = std::max(body_->cfg_.threads, (size_t) 1);
+    atomic<size_t> produced_tasks(0), produced_bytes(0);
+    ReadAhead readahead(body_->iopool_, body_->cfg_.prefetch_distance, ranges.size(),
+                        [&](size_t j) {
+                            return body_->data_.prefetch(*(body_->metadata_), sampleset,
+                                                         ranges[j], bcf_variant_predicate);
+                        });
+    task_group group(body_->threadpool_);
     N = 0;
 
-    size_t i = 0;
-    for (const auto& range : ranges) {
-        auto fut = body_->metapool_.push([&, i, range](int tid){
+    auto submit = [&](size_t i) {
+        const auto& range = ranges[i];
+        auto fut = group.push([&, i, range](){
             if (abort || (ext_abort && *ext_abort)) {
                 abort = true;
                 return Status::Aborted();
             }
+            readahead.advance(i);
 
             discovered_alleles dsals;
             unsigned tmpN;
@@ -158,35 +355,98 @@ Status Service::discover_alleles(const string& sampleset, const vector<range>& r
                     // tmpN should be the same across all ranges
                     N = tmpN;
                 }
+                if (budget) {
+                    result_bytes[i] = discovered_alleles_bytes(dsals);
+                    budget->take(result_bytes[i]);
+                    budget->release(charges[i]);
+                    charges[i] = 0;
+                    produced_tasks++;
+                    produced_bytes += result_bytes[i];
+                }
                 results[i] = move(dsals);
             }
             return ls;
         });
-
         statuses.push_back(move(fut));
-        i++;
-    }
+    };
+
+    // submit task i if it's admitted
+    auto admit = [&](size_t i, size_t next) {
+        if (!budget) {
+            submit(i);
+            return true;
+        }
+        const size_t n = produced_tasks;
+        const size_t estimate = n ? produced_bytes / n : 0;
+        if (i < next + min_tasks) {
+            budget->take(estimate);
+        } else if (!budget->try_acquire(estimate)) {
+            return false;
+        }
+        charges[i] = estimate;
+        submit(i);
+        return true;
+    };
 
-    ans.clear();
     Status s = Status::OK();
-    for (i = 0; i < ranges.size(); i++) {
+    size_t submitted = 0;
+    for (size_t i = 0; i < ranges.size(); i++) {
+        while (submitted < ranges.size() && admit(submitted, i)) {
+            submitted++;
+        }
+        assert(submitted > i);
+
         // wait for task i to complete and find out its status
-        Status s_i(statuses[i].get());
+        Status s_i(group.get(statuses[i]));
         discovered_alleles dsals = move(results[i]);
+        if (budget) {
+            // the charge remains if the task failed
+            budget->release(charges[i]);
+        }
 
         if (s.ok() && s_i.ok()) {
-            ans.push_back(move(dsals));
+            s = consumer(dsals);
+            if (s.bad()) {
+                abort = true;
+            }
         } else if (s.ok() && s_i.bad()) {
             // record the first error, and tell remaining tasks to abort
             s = move(s_i);
             abort = true;
         }
+        if (budget) {
+            budget->release(result_bytes[i]);
+        }
     }
-    assert(s.bad() || ans.size() == ranges.size());
 
     return s;
 }
 
+Status Service::discover_alleles(const string& sampleset, const vector<range>& ranges,
+                                 unsigned& N, vector<discovered_alleles>& ans,
+                                 bool include_zero_copies, atomic<bool>* ext_abort) {
+    ans.clear();
+    Status s = discover_alleles(sampleset, ranges, N, include_zero_copies, ext_abort,
+                                [&](discovered_alleles& dsals) {
+                                    ans.push_back(move(dsals));
+                                    return Status::OK();
+                                });
+    assert(s.bad() || ans.size() == ranges.size());
+    return s;
+}
+
+Status Service::discover_alleles(const string& sampleset, const vector<range>& ranges,
+                                 unsigned& N, discovered_alleles& ans,
+                                 bool include_zero_copies, atomic<bool>* ext_abort) {
+    ans.clear();
+    // Ranges are usually given in sorted order, in which case each merge just
+    // appends to ans.
+    return discover_alleles(sampleset, ranges, N, include_zero_copies, ext_abort,
+                            [&](discovered_alleles& dsals) {
+                                return merge_discovered_alleles(dsals, ans);
+                            });
+}
+
 static Status prepare_bcf_header(const vector<pair<string,size_t> >& contigs,
                                  const vector<string>& samples,
                                  const vector<retained_format_field> format_fields,
@@ -240,41 +500,96 @@ static Status prepare_bcf_header(const vector<pair<string,size_t> >& contigs,
     return Status::OK();
 }
 
+// Header lines of the SPARSE output format (see GLnexusOutputFormat). The
+// file format is distinct from VCF's, the VCF version it encodes recorded
+// along with the sample names, which the #CHROM line omits; sparse_to_vcf
+// (cli_utils.h) reverses the encoding.
+static const char* sparse_fileformat = "GLnexusSparseV1";
+static const char* sparse_header_line =
+    "##GLnexusSparse=Version 1, encoding the VCF of version ##GLnexusSparseVCF whose samples are those of "
+    "##GLnexusSparseSamples, tab-separated. In place of the sample columns, each record has a column DEFAULT, "
+    "the cell (formatted per FORMAT) of each sample not otherwise given; a column RUN, the cell of the samples "
+    "in the next column, RUNS, which gives runs of sample indices (from 0) e.g. 0-3,7 (or . if none); and then "
+    "a column INDEX=CELL for each other sample.";
+static const char* sparse_version_key = "GLnexusSparseVCF";
+static const char* sparse_samples_key = "GLnexusSparseSamples";
+
 class BCFFileSink {
     bool open_ = true;
     const string& filename_;
     bcf_hdr_t* header_;
-    vcfFile *outfile_;;
+    vcfFile *outfile_;
+    const genotyper_config& cfg_;
+
+    // buffers for the SPARSE format: the record's cells, cell i at
+    // cells_.s + cell_offsets_[i] (null-terminated), and their frequencies
+    kstring_t line_ = {0, 0, nullptr}, cells_ = {0, 0, nullptr};
+    vector<size_t> cell_offsets_;
+    unordered_map<string, pair<size_t,int>> cell_counts_; // (count, first sample)
+
+    // Format the record as a line of the SPARSE format, and write it
+    Status write_sparse(bcf1_t* record);
 
-    BCFFileSink(const std::string& filename, bcf_hdr_t* hdr, vcfFile* outfile)
-        : filename_(filename), header_(hdr), outfile_(outfile)
+protected:
+    BCFFileSink(const std::string& filename, bcf_hdr_t* hdr, vcfFile* outfile,
+                const genotyper_config& cfg)
+        : filename_(filename), header_(hdr), outfile_(outfile), cfg_(cfg)
         {}
 
+    // Open the output file & write the header (see Open)
+    static Status open_file(const genotyper_config& cfg, const string& filename,
+                            bcf_hdr_t* hdr, size_t threads, bool write_header,
+                            vcfFile*& ans);
+
 public:
-    static Status Open(const genotyper_config& cfg,
-                       const string& filename,
-                       bcf_hdr_t* hdr,
-                       unique_ptr<BCFFileSink>& ans) {
+    static bool ends_with(const string& str, const string& suffix) {
+        return str.size() >= suffix.size()
+               && str.compare(str.size()-suffix.size(), suffix.size(), suffix) == 0;
+    }
 
-        vcfFile* outfile;
-        if (cfg.output_format == GLnexusOutputFormat::VCF) {
-            // open as (uncompressed) vcf
-            outfile = vcf_open(filename.c_str(), "w");
-        } else if (cfg.output_format == GLnexusOutputFormat::BCF) {
-            // open as bcf
-            outfile = bcf_open(filename.c_str(), "wb1");
+    // Will the output be BGZF-compressed?
+    static bool compressed(const genotyper_config& cfg, const string& filename) {
+        return cfg.output_format == GLnexusOutputFormat::BCF
+               || ((cfg.output_format == GLnexusOutputFormat::VCF
+                    || cfg.output_format == GLnexusOutputFormat::SPARSE)
+                   && ends_with(filename, ".gz"));
+    }
+
+    // Build the CSI (BCF) or tabix (VCF.gz, SPARSE .gz) index of a completed
+    // output file. The SPARSE format's leading columns are those of VCF.
+    //
+    // htslib 1.9 can't track BGZF virtual offsets while the blocks are being
+    // compressed asynchronously, so the index is built in a quick pass over
+    // the completed file.
+    static Status build_index(const genotyper_config& cfg, const string& filename) {
+        if (cfg.output_format == GLnexusOutputFormat::BCF) {
+            if (bcf_index_build(filename.c_str(), 14) != 0) {
+                return Status::IOError("bcf_index_build", filename);
+            }
+        } else if (compressed(cfg, filename)) {
+            if (tbx_index_build(filename.c_str(), 0, &tbx_conf_vcf) != 0) {
+                return Status::IOError("tbx_index_build", filename);
+            }
         } else {
-            return Status::Invalid("BCFFileSink::Open: Invalid output format");
-        }
-        if (!outfile) {
-            return Status::IOError("failed to open BCF file for writing", filename);
-        }
-        if (bcf_hdr_write(outfile, hdr) != 0) {
-            bcf_close(outfile);
-            return Status::IOError("bcf_hdr_write", filename);
+            return Status::Invalid("BCFFileSink: output_index requires compressed output", filename);
         }
+        return Status::OK();
+    }
 
-        ans.reset(new BCFFileSink(filename, hdr, outfile));
+    // threads: genotyping thread budget, used to size the compression thread
+    // pool automatically.
+    // write_header: normally true; false when writing a part of the output to
+    // be concatenated after another part which includes the header.
+    static Status Open(const genotyper_config& cfg,
+                       const string& filename,
+                       bcf_hdr_t* hdr,
+                       size_t threads,
+                       unique_ptr<BCFFileSink>& ans,
+                       bool write_header = true) {
+        Status s;
+        vcfFile* outfile;
+        S(open_file(cfg, filename, hdr, threads, write_header, outfile));
+        ans.reset(new BCFFileSink(filename, hdr, outfile, cfg));
         return Status::OK();
     }
 
@@ -282,10 +597,18 @@ public:
         if (open_) {
             bcf_close(outfile_);
         }
+        free(line_.s);
+        free(cells_.s);
     }
 
     virtual Status write(bcf1_t* record) {
         if (!open_) return Status::Invalid("BCFFilkSink::write() called on closed writer");
+        perf::scoped_timer timer(perf::timer::write);
+        perf::count(perf::counter::output_records);
+        if (cfg_.output_format == GLnexusOutputFormat::SPARSE) {
+            return write_sparse(record);
+        }
+        perf::count(perf::counter::output_bytes, record->shared.l + record->indiv.l);
         return bcf_write(outfile_, header_, record) == 0
                 ? Status::OK() : Status::IOError("bcf_write", filename_);
 
@@ -294,139 +617,1815 @@ public:
     virtual Status close() {
         if (!open_) return Status::Invalid("BCFFileSink::close() called on closed writer");
         open_ = false;
-        return bcf_close(outfile_) == 0
-                ? Status::OK() : Status::IOError("bcf_close", filename_);
+        if (bcf_close(outfile_) != 0) {
+            return Status::IOError("bcf_close", filename_);
+        }
+        if (cfg_.output_index) {
+            return build_index(cfg_, filename_);
+        }
+        return Status::OK();
     }
 };
 
-Status Service::genotype_sites(const genotyper_config& cfg, const string& sampleset,
-                               const vector<unified_site>& sites,
-                               const string& filename,
-                               atomic<bool>* ext_abort) {
-    Status s;
-    shared_ptr<const set<string>> samples;
-    S(body_->metadata_->sampleset_samples(sampleset, samples));
-    vector<string> sample_names(samples->begin(), samples->end());
+Status BCFFileSink::open_file(const genotyper_config& cfg, const string& filename,
+                              bcf_hdr_t* hdr, size_t threads, bool write_header,
+                              vcfFile*& ans) {
+    if (cfg.output_compression_level < -1 || cfg.output_compression_level > 9) {
+        return Status::Invalid("BCFFileSink::Open: invalid output_compression_level");
+    }
+    string level = cfg.output_compression_level >= 0
+                    ? std::to_string(cfg.output_compression_level) : "";
 
-    // create a BCF header for this sample set
-    // TODO: make optional
-    shared_ptr<bcf_hdr_t> hdr;
-    S(prepare_bcf_header(body_->metadata_->contigs(), sample_names, cfg.liftover_fields,
-                         body_->cfg_.extra_header_lines, hdr));
+    vcfFile* outfile;
+    if (cfg.output_format == GLnexusOutputFormat::VCF || cfg.output_format == GLnexusOutputFormat::SPARSE) {
+        if (compressed(cfg, filename)) {
+            // bgzipped vcf
+            outfile = vcf_open(filename.c_str(), ("wz" + level).c_str());
+        } else {
+            // open as (uncompressed) vcf
+            outfile = vcf_open(filename.c_str(), "w");
+        }
+    } else if (cfg.output_format == GLnexusOutputFormat::BCF) {
+        // open as bcf
+        outfile = bcf_open(filename.c_str(), ("wb" + level).c_str());
+    } else {
+        return Status::Invalid("BCFFileSink::Open: Invalid output format");
+    }
+    if (cfg.output_index && (!compressed(cfg, filename) || filename == "-")) {
+        return Status::Invalid("BCFFileSink::Open: output_index requires compressed output to a file", filename);
+    }
+    if (!outfile) {
+        return Status::IOError("failed to open BCF file for writing", filename);
+    }
+    // compress BGZF blocks on dedicated threads, in parallel with the
+    // (single-threaded) serialization of the records
+    if (compressed(cfg, filename)) {
+        size_t output_threads = cfg.output_threads ? cfg.output_threads
+                                                   : std::max(threads/4, (size_t) 1);
+        if (hts_set_threads(outfile, (int) output_threads) != 0) {
+            bcf_close(outfile);
+            return Status::Failure("hts_set_threads", filename);
+        }
+    }
+    if (write_header && cfg.output_format == GLnexusOutputFormat::SPARSE) {
+        // the VCF header without the samples, which are listed on a header
+        // line of their own instead
+        string samples_line = string("##") + sparse_samples_key + "=";
+        for (int i = 0; i < bcf_hdr_nsamples(hdr); i++) {
+            samples_line += (i ? "\t" : "") + string(hdr->samples[i]);
+        }
+        string version_line = string("##") + sparse_version_key + "=" + bcf_hdr_get_version(hdr);
+        shared_ptr<bcf_hdr_t> sparse_hdr(bcf_hdr_subset(hdr, 0, nullptr, nullptr), &bcf_hdr_destroy);
+        if (!sparse_hdr
+            || bcf_hdr_set_version(sparse_hdr.get(), sparse_fileformat) != 0
+            || bcf_hdr_append(sparse_hdr.get(), sparse_header_line) != 0
+            || bcf_hdr_append(sparse_hdr.get(), version_line.c_str()) != 0
+            || bcf_hdr_append(sparse_hdr.get(), samples_line.c_str()) != 0
+            || bcf_hdr_sync(sparse_hdr.get()) != 0) {
+            bcf_close(outfile);
+            return Status::Failure("BCFFileSink::Open: preparing SPARSE header");
+        }
+        if (bcf_hdr_write(outfile, sparse_hdr.get()) != 0) {
+            bcf_close(outfile);
+            return Status::IOError("bcf_hdr_write", filename);
+        }
+    } else if (write_header && bcf_hdr_write(outfile, hdr) != 0) {
+        bcf_close(outfile);
+        return Status::IOError("bcf_hdr_write", filename);
+    }
 
-    // open output BCF file
-    unique_ptr<BCFFileSink> bcf_out;
-    S(BCFFileSink::Open(cfg, filename, hdr.get(), bcf_out));
+    ans = outfile;
+    return Status::OK();
+}
 
-    // set up the residuals file
-    unique_ptr<ResidualsFile> residualsFile = nullptr;
-    string res_filename;
-    if (filename != "-" && filename.find('.') > 0) {
-        int lastindex = filename.find_last_of('.');
-        string rawname = filename.substr(0, lastindex);
-        res_filename = rawname + ".residuals.yml";
+Status BCFFileSink::write_sparse(bcf1_t* record) {
+    if (bcf_unpack(record, BCF_UN_ALL) != 0) {
+        return Status::Failure("BCFFileSink::write: bcf_unpack", filename_);
+    }
+    const int n_sample = record->n_sample;
+    if (n_sample == 0) {
+        return Status::Failure("BCFFileSink::write: SPARSE record without samples", filename_);
+    }
+
+    // the site columns, formatted by htslib with the sample columns
+    // suppressed, then the FORMAT column
+    line_.l = 0;
+    record->n_sample = 0;
+    int ret = vcf_format(header_, record, &line_);
+    record->n_sample = n_sample;
+    if (ret != 0 || line_.l == 0) {
+        return Status::Failure("BCFFileSink::write: vcf_format", filename_);
+    }
+    line_.s[--line_.l] = 0; // newline
+    // (fields without data are skipped, as by vcf_format)
+    kputc('\t', &line_);
+    bool first = true;
+    for (int k = 0; k < record->n_fmt; k++) {
+        if (record->d.fmt[k].p) {
+            if (!first) {
+                kputc(':', &line_);
+            }
+            first = false;
+            kputs(bcf_hdr_int2id(header_, BCF_DT_ID, record->d.fmt[k].id), &line_);
+        }
+    }
+
+    // format each cell as vcf_format would, counting the distinct ones
+    const int gt_id = bcf_hdr_id2int(header_, BCF_DT_ID, "GT");
+    cells_.l = 0;
+    cell_offsets_.resize(n_sample);
+    cell_counts_.clear();
+    for (int i = 0; i < n_sample; i++) {
+        cell_offsets_[i] = cells_.l;
+        first = true;
+        for (int k = 0; k < record->n_fmt; k++) {
+            bcf_fmt_t* fmt = &record->d.fmt[k];
+            if (!fmt->p) {
+                continue;
+            }
+            if (!first) {
+                kputc(':', &cells_);
+            }
+            first = false;
+            if (fmt->id == gt_id) {
+                bcf_format_gt(fmt, i, &cells_);
+            } else {
+                bcf_fmt_array(&cells_, fmt->n, fmt->type, fmt->p + i*fmt->size);
+            }
+        }
+        if (first) {
+            kputc('.', &cells_);
+        }
+        kputc(0, &cells_);
+    }
+    for (int i = 0; i < n_sample; i++) {
+        auto it = cell_counts_.emplace(string(cells_.s + cell_offsets_[i]), make_pair((size_t) 0, i)).first;
+        it->second.first++;
+    }
+
+    // DEFAULT & RUN: the most frequent cells, ties going to the earliest
+    auto more_frequent = [](const pair<size_t,int>& a, const pair<size_t,int>& b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+    const string *default_cell = nullptr, *run_cell = nullptr;
+    pair<size_t,int> default_count(0, n_sample), run_count(0, n_sample);
+    for (const auto& p : cell_counts_) {
+        if (more_frequent(p.second, default_count)) {
+            run_cell = default_cell;
+            run_count = default_count;
+            default_cell = &p.first;
+            default_count = p.second;
+        } else if (more_frequent(p.second, run_count)) {
+            run_cell = &p.first;
+            run_count = p.second;
+        }
+    }
+    assert(default_cell);
+    kputc('\t', &line_);
+    kputsn(default_cell->c_str(), default_cell->size(), &line_);
+    kputc('\t', &line_);
+    if (run_cell) {
+        kputsn(run_cell->c_str(), run_cell->size(), &line_);
     } else {
-        res_filename = "/tmp/residuals.yml";
+        kputc('.', &line_);
     }
-    if (cfg.output_residuals) {
-        S(ResidualsFile::Open(res_filename, residualsFile));
+
+    // RUNS, e.g. 0-3,7
+    kputc('\t', &line_);
+    const size_t runs_pos = line_.l;
+    int run_beg = -1;
+    auto end_run = [&](int i) {
+        if (run_beg >= 0) {
+            if (line_.l > runs_pos) {
+                kputc(',', &line_);
+            }
+            kputw(run_beg, &line_);
+            if (i - 1 > run_beg) {
+                kputc('-', &line_);
+                kputw(i - 1, &line_);
+            }
+            run_beg = -1;
+        }
+    };
+    for (int i = 0; i < n_sample; i++) {
+        bool in_run = run_cell && *run_cell == cells_.s + cell_offsets_[i];
+        if (in_run && run_beg < 0) {
+            run_beg = i;
+        } else if (!in_run) {
+            end_run(i);
+        }
+    }
+    end_run(n_sample);
+    if (line_.l == runs_pos) {
+        kputc('.', &line_);
+    }
+
+    // the other cells, each INDEX=CELL
+    for (int i = 0; i < n_sample; i++) {
+        const char* cell = cells_.s + cell_offsets_[i];
+        if (*default_cell == cell || (run_cell && *run_cell == cell)) {
+            continue;
+        }
+        kputc('\t', &line_);
+        kputw(i, &line_);
+        kputc('=', &line_);
+        kputs(cell, &line_);
+    }
+    kputc('\n', &line_);
+
+    perf::count(perf::counter::output_bytes, line_.l);
+    ret = outfile_->format.compression != no_compression
+            ? bgzf_write(outfile_->fp.bgzf, line_.s, line_.l)
+            : hwrite(outfile_->fp.hfile, line_.s, line_.l);
+    return ret == (int) line_.l ? Status::OK() : Status::IOError("BCFFileSink::write", filename_);
+}
+
+// Bounded reorder window between the genotyping tasks, which may complete out
+// of order, and the single thread writing their results out in order. Before
+// starting task i, a worker waits until either (i) i is among the next
+// min_tasks tasks the writer will consume, or (ii) the completed results
+// awaiting the writer occupy less than max_bytes. Thus the number of results
+// buffered adapts to their size, while memory usage stays bounded by roughly
+// max_bytes plus the results of the tasks in progress. Waiting workers are
+// woken as soon as the writer consumes something.
+//
+// With a memory budget, (ii) further requires the budget to have room for the
+// task's results, estimated as the mean of those produced so far. The
+// estimate is charged to the budget when the task is admitted (forcibly under
+// (i)), adjusted to the actual size when it's produced, and released when the
+// writer consumes it. Budget released elsewhere is noticed by polling.
+class ReorderWindow {
+    const size_t max_bytes_, min_tasks_;
+    memory_budget* const budget_;
+    mutex mu_;
+    condition_variable cv_;
+    size_t next_ = 0;   // index of the next task the writer will consume
+    size_t bytes_ = 0;  // size of the results completed but not yet consumed
+    size_t produced_tasks_ = 0, produced_bytes_ = 0; // totals, for the estimate
+
+    // whether task i may start, charging its estimate to the budget if so
+    bool admissible(size_t i, size_t& charge) {
+        const bool forced = i < next_ + min_tasks_;
+        if (!forced && bytes_ >= max_bytes_) {
+            return false;
+        }
+        if (!budget_) {
+            return true;
+        }
+        const size_t estimate = produced_tasks_ ? produced_bytes_ / produced_tasks_ : 0;
+        if (forced) {
+            budget_->take(estimate);
+        } else if (!budget_->try_acquire(estimate)) {
+            return false;
+        }
+        charge = estimate;
+        return true;
+    }
+
+public:
+    ReorderWindow(size_t max_bytes, size_t min_tasks, memory_budget* budget = nullptr)
+        : max_bytes_(max_bytes), min_tasks_(std::max(min_tasks, (size_t) 1)), budget_(budget) {}
+
+    // Wait for task i to be admitted. Returns the time spent waiting, in
+    // milliseconds. Returns early if abort is set (caller should recheck).
+    // charge is set to the amount charged to the budget for the task, which
+    // the caller passes back to produced() or, if it doesn't get that far,
+    // release().
+    uint64_t admit(size_t i, const atomic<bool>& abort, atomic<bool>* ext_abort, size_t& charge) {
+        charge = 0;
+        unique_lock<mutex> lock(mu_);
+        if (admissible(i, charge)) {
+            return 0;
+        }
+        auto t0 = chrono::steady_clock::now();
+        while (!admissible(i, charge) && !abort && !(ext_abort && *ext_abort)) {
+            // the timeout serves to notice external abort, and budget
+            // released by others
+            cv_.wait_for(lock, chrono::milliseconds(100));
+        }
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
+    }
+
+    // A task has completed, producing results of the given size.
+    void produced(size_t bytes, size_t charge) {
+        lock_guard<mutex> lock(mu_);
+        bytes_ += bytes;
+        produced_tasks_++;
+        produced_bytes_ += bytes;
+        if (budget_) {
+            budget_->take(bytes);
+            budget_->release(charge);
+        }
+    }
+
+    // A task admitted with the given charge has failed or aborted.
+    void release(size_t charge) {
+        if (budget_) {
+            budget_->release(charge);
+        }
+    }
+
+    // The writer has consumed the results of the next task, of the given size.
+    void consumed(size_t bytes) {
+        {
+            lock_guard<mutex> lock(mu_);
+            assert(bytes_ >= bytes);
+            bytes_ -= std::min(bytes, bytes_);
+            next_++;
+            if (budget_) {
+                budget_->release(bytes);
+            }
+        }
+        cv_.notify_all();
+    }
+};
+
+Status Service::body::genotype_sites_part(const genotyper_config& cfg, const string& sampleset,
+                                          const vector<string>& sample_names, const bcf_hdr_t* hdr,
+                                          const vector<unified_site>& sites, size_t first, size_t last,
+                                          size_t concurrent_parts, BCFFileSink& out,
+                                          ResidualsFile* residualsFile,
+                                          atomic<bool>* ext_abort, int node) {
+    Status s;
+    assert(first <= last && last <= sites.size());
+    shared_ptr<const genotyper_plan> plan;
+    S(prepare_genotyper_plan(cfg, plan));
+    // sample_names are the sample set's, in order (prepare_output_header)
+    shared_ptr<DatasetSampleIndex> sample_index;
+    S(get_sample_index(sampleset, sample_index));
+    assert(sample_index->samples() == sample_names);
+
+    // Partition the sites into groups of consecutive sites falling within the
+    // same window (nominally, storage bucket) of the contig. Each group is
+    // processed as one task which retrieves and deserializes the pertinent
+    // records just once for all its sites.
+    vector<pair<size_t,size_t>> groups;
+    const size_t grid_bp = std::max(cfg_.genotype_grid_bp, (size_t) 1);
+    const size_t grid_max_sites = std::max(cfg_.genotype_grid_max_sites, (size_t) 1);
+    for (size_t i = first; i < last; i++) {
+        if (groups.empty()) {
+            groups.push_back(make_pair(i, i+1));
+            continue;
+        }
+        auto& g = groups.back();
+        const range& pos0 = sites[g.first].pos;
+        const range& pos = sites[i].pos;
+        if (pos.rid == pos0.rid && pos.beg/grid_bp == pos0.beg/grid_bp
+            && g.second - g.first < grid_max_sites) {
+            assert(g.second == i);
+            g.second = i+1;
+        } else {
+            groups.push_back(make_pair(i, i+1));
+        }
     }
 
-    // Enqueue processing of each site as a task on the thread pool.
+    // Enqueue processing of each group of sites as a task on the thread pool.
     vector<future<Status>> statuses;
-    vector<tuple<shared_ptr<bcf1_t>,shared_ptr<string>>> results(sites.size());
+    vector<tuple<shared_ptr<bcf1_t>,shared_ptr<string>>> results(last-first);
     // ^^^ results to be filled by side-effect in the individual tasks below.
     // We assume that by virtue of preallocating, no mutex is necessary to
     // use it as follows because writes and reads of individual elements are
     // serialized by the futures.
-    atomic<size_t> results_retrieved(0);
+    concurrent_parts = std::max(concurrent_parts, (size_t) 1);
+    ReorderWindow window(cfg_.genotype_window_bytes/concurrent_parts,
+                         cfg_.threads/concurrent_parts, cfg_.budget);
+    auto result_bytes = [](const shared_ptr<bcf1_t>& bcf, const shared_ptr<string>& residual_rec) {
+        size_t ans = 0;
+        if (bcf) {
+            // the record has been synced by bcf_dup() so this accounts for
+            // (most of) its memory usage
+            ans += sizeof(bcf1_t) + bcf->shared.l + bcf->indiv.l;
+        }
+        if (residual_rec) {
+            ans += residual_rec->size();
+        }
+        return ans;
+    };
     atomic<bool> abort(false);
-    for (size_t i = 0; i < sites.size(); i++) {
-        auto fut = body_->threadpool_.push([&, i](int tid){
+    ReadAhead readahead(iopool_, cfg_.prefetch_distance, groups.size(), [&](size_t gi) {
+        return prefetch_site_group(cfg, *metadata_, data_, sites, groups[gi].first,
+                                   groups[gi].second, sampleset, residualsFile != nullptr);
+    }, node);
+    for (size_t gi = 0; gi < groups.size(); gi++) {
+        auto fut = threadpool_.push([&, gi](int tid){
+            if (abort || (ext_abort && *ext_abort)) {
+                abort = true;
+                return Status::Aborted();
+            }
+
+            size_t charge = 0;
+            uint64_t stalled_ms = window.admit(gi, abort, ext_abort, charge);
+            if (stalled_ms) {
+                threads_stalled_ms_ += stalled_ms;
+                perf::count(perf::counter::stalled_ms, stalled_ms);
+            }
             if (abort || (ext_abort && *ext_abort)) {
                 abort = true;
+                window.release(charge);
                 return Status::Aborted();
             }
+            readahead.advance(gi);
 
-            uint64_t stalled_ms = 0;
-            while (i > results_retrieved+4*body_->cfg_.threads) {
-                // throttle worker thread if the results retrieval, below, is falling
-                // too far behind. Otherwise memory usage would be unbounded because
-                // the results have to be retrieved and written out before they can
-                // be deallocated.
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                stalled_ms += 10;
-            }
-            if (i < body_->cfg_.threads && results_retrieved == 0) {
-                // throttle startup so that database cache can burn in
-                std::this_thread::sleep_for(std::chrono::milliseconds(i*10));
-                stalled_ms += i*10;
-            }
-            if (stalled_ms) body_->threads_stalled_ms_ += stalled_ms;
-
-            shared_ptr<string> residual_rec = nullptr;
-            shared_ptr<bcf1_t> bcf;
-            Status ls = genotype_site(cfg, *(body_->metadata_), body_->data_, sites[i],
-                                      sampleset, sample_names, hdr.get(), bcf,
-                                      residualsFile != nullptr, residual_rec,
-                                      &abort);
+            const size_t gfirst = groups[gi].first, glast = groups[gi].second;
+            vector<shared_ptr<bcf1_t>> bcfs;
+            vector<shared_ptr<string>> residual_recs;
+            perf::scoped_timer timer(perf::timer::genotype);
+            perf::count(perf::counter::sites_genotyped, glast-gfirst);
+            Status ls = genotype_site_group(cfg, *metadata_, data_, sites,
+                                            gfirst, glast, sampleset, sample_names, hdr,
+                                            bcfs, residualsFile != nullptr, residual_recs,
+                                            &abort, &threadpool_, cfg_.genotype_slice_samples,
+                                            plan.get(), sample_index.get());
+            timer.stop();
             if (ls.bad()) {
+                window.release(charge);
                 return ls;
             }
 
-            results[i] = make_tuple(move(bcf), residual_rec);
+            assert(bcfs.size() == glast-gfirst && residual_recs.size() == glast-gfirst);
+            size_t bytes = 0;
+            for (size_t i = gfirst; i < glast; i++) {
+                bytes += result_bytes(bcfs[i-gfirst], residual_recs[i-gfirst]);
+                results[i-first] = make_tuple(move(bcfs[i-gfirst]), move(residual_recs[i-gfirst]));
+            }
+            window.produced(bytes, charge);
             return ls;
-        });
+        }, node);
         statuses.push_back(move(fut));
     }
-    assert(statuses.size() == sites.size());
+    assert(statuses.size() == groups.size());
 
     // Retrieve the resulting BCF records, and write them to the output file,
     // in the given order. Record the first error that occurs, if any, but
     // always wait for all tasks to finish.
     s = Status::OK();
-    for (size_t i = 0; i < sites.size(); i++) {
-        // wait for task i to complete and find out its status
-        Status s_i(statuses[i].get());
-        // always retrieve the result BCF record, if any, to ensure we'll free
-        // the memory it takes ASAP
-        shared_ptr<bcf1_t> bcf_i = move(std::get<0>(results[i]));
-        assert(std::get<0>(results[i]) == nullptr);
-        shared_ptr<string> residual_rec =  move(std::get<1>(results[i]));
-        assert(std::get<1>(results[i]) == nullptr);
+    for (size_t gi = 0; gi < groups.size(); gi++) {
+        // wait for task gi to complete and find out its status
+        Status s_i(statuses[gi].get());
+        size_t bytes = 0;
+        for (size_t i = groups[gi].first; i < groups[gi].second; i++) {
+            // always retrieve the result BCF record, if any, to ensure we'll free
+            // the memory it takes ASAP
+            shared_ptr<bcf1_t> bcf_i = move(std::get<0>(results[i-first]));
+            assert(std::get<0>(results[i-first]) == nullptr);
+            shared_ptr<string> residual_rec =  move(std::get<1>(results[i-first]));
+            assert(std::get<1>(results[i-first]) == nullptr);
+            bytes += result_bytes(bcf_i, residual_rec);
 
-        if (s.ok() && s_i.ok()) {
-            // if everything's OK, proceed to write the record
-            if (bcf_i) {
-                s = bcf_out->write(bcf_i.get());
-            }
-            if (s.bad()) {
-                abort = true;
-            } else if (residual_rec != nullptr) {
-                // We have a residuals record, write it to disk.
-                s = residualsFile->write_record(*residual_rec);
+            if (s.ok() && s_i.ok()) {
+                // if everything's OK, proceed to write the record
+                if (bcf_i) {
+                    s = out.write(bcf_i.get());
+                }
                 if (s.bad()) {
                     abort = true;
+                } else if (residual_rec != nullptr) {
+                    // We have a residuals record, write it to disk.
+                    s = residualsFile->write_record(*residual_rec);
+                    if (s.bad()) {
+                        abort = true;
+                    }
                 }
+            } else if (s.ok() && s_i.bad()) {
+                // record the first error, and tell remaining tasks to abort
+                s = move(s_i);
+                abort = true;
             }
-        } else if (s.ok() && s_i.bad()) {
-            // record the first error, and tell remaining tasks to abort
-            s = move(s_i);
-            abort = true;
         }
-        results_retrieved++;
+        window.consumed(bytes);
     }
-    if (s.bad()) {
-        return s;
+    return s;
+}
+
+// Derive the residuals filename from the output filename
+static string residuals_filename(const genotyper_config& cfg, const string& filename) {
+    const string ext = cfg.residuals_format == GLnexusResidualsFormat::BINARY
+                        ? ".residuals.cflat.gz" : ".residuals.yml";
+    if (filename != "-" && filename.find('.') > 0) {
+        int lastindex = filename.find_last_of('.');
+        string rawname = filename.substr(0, lastindex);
+        return rawname + ext;
     }
+    return "/tmp/residuals" + ext;
+}
 
-    // TODO: for very large sample sets, bucket cache-friendliness might be
-    // improved by genotyping in grid squares of N>1 sites and M>1 samples
+Status Service::body::prepare_output_header(const genotyper_config& cfg, const string& sampleset,
+                                            vector<string>& sample_names,
+                                            shared_ptr<bcf_hdr_t>& hdr) {
+    Status s;
+    shared_ptr<const set<string>> samples;
+    S(metadata_->sampleset_samples(sampleset, samples));
+    sample_names.assign(samples->begin(), samples->end());
 
-    // close the output file
-    return bcf_out->close();
+    // create a BCF header for this sample set
+    // TODO: make optional
+    return prepare_bcf_header(metadata_->contigs(), sample_names, cfg.liftover_fields,
+                              cfg_.extra_header_lines, hdr);
 }
 
-uint64_t Service::threads_stalled_ms() const { return body_->threads_stalled_ms_; }
+Status Service::genotype_sites(const genotyper_config& cfg, const string& sampleset,
+                               const vector<unified_site>& sites,
+                               const string& filename,
+                               atomic<bool>* ext_abort) {
+    Status s;
+    vector<string> sample_names;
+    shared_ptr<bcf_hdr_t> hdr;
+    S(body_->prepare_output_header(cfg, sampleset, sample_names, hdr));
+
+    // open output BCF file
+    unique_ptr<BCFFileSink> bcf_out;
+    S(BCFFileSink::Open(cfg, filename, hdr.get(), body_->cfg_.threads, bcf_out));
+
+    // set up the residuals file
+    unique_ptr<ResidualsFile> residualsFile = nullptr;
+    if (cfg.output_residuals) {
+        S(ResidualsFile::Open(cfg, residuals_filename(cfg, filename), body_->metadata_->contigs(),
+                              true, residualsFile));
+    }
+
+    S(body_->genotype_sites_part(cfg, sampleset, sample_names, hdr.get(), sites, 0, sites.size(), 1,
+                                 *bcf_out, residualsFile.get(), ext_abort));
+    if (residualsFile) {
+        S(residualsFile->close());
+    }
+
+    // close the output file
+    return bcf_out->close();
+}
+
+// Concatenates part files into filename ("-" for standard output), one at a
+// time as they become available. For BGZF-compressed parts, we just drop the
+// end-of-file marker block from each part and append one to the combined
+// output; the BGZF blocks themselves are copied verbatim, with no
+// recompression.
+static const char bgzf_eof[] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+static const size_t bgzf_eof_len = sizeof(bgzf_eof) - 1;
+static_assert(bgzf_eof_len == 28, "BGZF EOF marker length");
+
+class OutputConcatenator {
+    const string filename_;
+    const bool bgzf_;
+    FILE* out_ = nullptr;
+    vector<char> buf_;
+
+    OutputConcatenator(const string& filename, bool bgzf, FILE* out)
+        : filename_(filename), bgzf_(bgzf), out_(out), buf_(4 << 20) {}
+
+public:
+    static Status Open(const string& filename, bool bgzf, unique_ptr<OutputConcatenator>& ans) {
+        FILE* out = filename == "-" ? stdout : fopen(filename.c_str(), "wb");
+        if (!out) {
+            return Status::IOError("failed to open file for writing", filename);
+        }
+        ans.reset(new OutputConcatenator(filename, bgzf, out));
+        return Status::OK();
+    }
+
+    ~OutputConcatenator() {
+        if (out_ && out_ != stdout) {
+            fclose(out_);
+        }
+    }
+
+    Status append(const string& part) {
+        Status s;
+        FILE* in = fopen(part.c_str(), "rb");
+        if (!in) {
+            return Status::IOError("failed to open part file", part);
+        }
+        // determine how much of the part to copy
+        long len = -1;
+        if (fseek(in, 0, SEEK_END) == 0) {
+            len = ftell(in);
+        }
+        if (len >= (long) bgzf_eof_len && bgzf_) {
+            char tail[bgzf_eof_len];
+            if (fseek(in, len - bgzf_eof_len, SEEK_SET) != 0
+                || fread(tail, 1, bgzf_eof_len, in) != bgzf_eof_len) {
+                len = -1;
+            } else if (memcmp(tail, bgzf_eof, bgzf_eof_len) == 0) {
+                len -= bgzf_eof_len;
+            }
+        }
+        if (len < 0 || fseek(in, 0, SEEK_SET) != 0) {
+            fclose(in);
+            return Status::IOError("failed to read part file", part);
+        }
+        while (len > 0) {
+            size_t n = fread(buf_.data(), 1, std::min((size_t) len, buf_.size()), in);
+            if (n == 0 || fwrite(buf_.data(), 1, n, out_) != n) {
+                s = Status::IOError("failed to concatenate part file", part);
+                break;
+            }
+            len -= n;
+        }
+        fclose(in);
+        return s;
+    }
+
+    Status close() {
+        Status s;
+        assert(out_);
+        if (bgzf_ && fwrite(bgzf_eof, 1, bgzf_eof_len, out_) != bgzf_eof_len) {
+            s = Status::IOError("failed to write BGZF EOF marker", filename_);
+        }
+        if (out_ == stdout) {
+            if (fflush(out_) != 0 && s.ok()) {
+                s = Status::IOError("fflush", filename_);
+            }
+        } else if (fclose(out_) != 0 && s.ok()) {
+            s = Status::IOError("fclose", filename_);
+        }
+        out_ = nullptr;
+        return s;
+    }
+};
+
+// Concatenate the part files into filename, as above.
+static Status concat_output_parts(const vector<string>& parts, bool bgzf, const string& filename) {
+    Status s;
+    unique_ptr<OutputConcatenator> out;
+    S(OutputConcatenator::Open(filename, bgzf, out));
+    for (const auto& part : parts) {
+        S(out->append(part));
+    }
+    return out->close();
+}
+
+Status Service::genotype_sites_sharded(const genotyper_config& cfg, const string& sampleset,
+                                       const vector<unified_site>& sites, size_t shards,
+                                       const string& filename,
+                                       atomic<bool>* ext_abort) {
+    Status s;
+    shards = std::max(std::min(shards, sites.size()), (size_t) 1);
+    if (shards == 1) {
+        return genotype_sites(cfg, sampleset, sites, filename, ext_abort);
+    }
+    if (cfg.output_index && (!BCFFileSink::compressed(cfg, filename) || filename == "-")) {
+        return Status::Invalid("genotype_sites_sharded: output_index requires compressed output to a file", filename);
+    }
+
+    vector<string> sample_names;
+    shared_ptr<bcf_hdr_t> hdr;
+    S(body_->prepare_output_header(cfg, sampleset, sample_names, hdr));
+
+    // Residuals are written to their own part files, like the output, and
+    // likewise concatenated in shard order (binary residuals as BGZF blocks,
+    // YAML documents as plain text).
+    const bool residuals_parts = cfg.output_residuals;
+    const bool residuals_bgzf = cfg.residuals_format == GLnexusResidualsFormat::BINARY;
+
+    // The part files go alongside the output file, or in /tmp if writing to
+    // standard output. Only the first part includes the header. The parts
+    // divide the compression threads evenly, and are indexed only once
+    // concatenated.
+    string part_prefix = filename != "-" ? filename
+                                         : ("/tmp/GLnexus.genotype_sites." + std::to_string(getpid()));
+    vector<string> part_filenames, residuals_part_filenames;
+    for (size_t i = 0; i < shards; i++) {
+        part_filenames.push_back(part_prefix + ".part" + std::to_string(i));
+        if (residuals_parts) {
+            residuals_part_filenames.push_back(residuals_filename(cfg, filename) + ".part" + std::to_string(i));
+        }
+    }
+    auto remove_parts = [&]() {
+        for (const auto& fn : part_filenames) {
+            remove(fn.c_str());
+        }
+        for (const auto& fn : residuals_part_filenames) {
+            remove(fn.c_str());
+        }
+    };
+    genotyper_config part_cfg = cfg;
+    part_cfg.output_index = false;
+    if (part_cfg.output_threads == 0) {
+        part_cfg.output_threads = std::max(body_->cfg_.threads/4/shards, (size_t) 1);
+    }
+    vector<unique_ptr<BCFFileSink>> sinks(shards);
+    vector<unique_ptr<ResidualsFile>> residuals_sinks(shards);
+    for (size_t i = 0; i < shards; i++) {
+        s = BCFFileSink::Open(part_cfg, part_filenames[i], hdr.get(), body_->cfg_.threads,
+                              sinks[i], i == 0);
+        if (s.ok() && residuals_parts) {
+            s = ResidualsFile::Open(cfg, residuals_part_filenames[i], body_->metadata_->contigs(),
+                                    i == 0, residuals_sinks[i]);
+        }
+        if (s.bad()) {
+            sinks.clear();
+            residuals_sinks.clear();
+            remove_parts();
+            return s;
+        }
+    }
+
+    // Genotype contiguous shards of the sites concurrently, each writing its
+    // own part file.
+    atomic<bool> abort(false);
+    vector<future<Status>> statuses;
+    for (size_t i = 0; i < shards; i++) {
+        size_t first = i*sites.size()/shards, last = (i+1)*sites.size()/shards;
+        auto fut = body_->metapool_.push([&, i, first, last](int tid){
+            Status ls = body_->genotype_sites_part(part_cfg, sampleset, sample_names, hdr.get(),
+                                                   sites, first, last, shards, *sinks[i],
+                                                   residuals_sinks[i].get(),
+                                                   &abort, body_->part_node(i, shards));
+            if (ls.ok()) {
+                ls = sinks[i]->close();
+            }
+            if (ls.ok() && residuals_sinks[i]) {
+                ls = residuals_sinks[i]->close();
+            }
+            if (ls.bad()) {
+                abort = true;
+            }
+            return ls;
+        });
+        statuses.push_back(move(fut));
+    }
+
+    // Wait for all shards, recording the first error, if any, and relaying
+    // any external abort signal.
+    s = Status::OK();
+    for (auto& fut : statuses) {
+        while (fut.wait_for(chrono::milliseconds(100)) != future_status::ready) {
+            if (ext_abort && *ext_abort) {
+                abort = true;
+            }
+        }
+        Status s_i(fut.get());
+        if (s.ok() && s_i.bad()) {
+            s = move(s_i);
+        }
+    }
+    sinks.clear();
+    residuals_sinks.clear();
+
+    if (s.ok()) {
+        s = concat_output_parts(part_filenames, BCFFileSink::compressed(cfg, filename), filename);
+    }
+    if (s.ok() && residuals_parts) {
+        s = concat_output_parts(residuals_part_filenames, residuals_bgzf, residuals_filename(cfg, filename));
+    }
+    remove_parts();
+    if (s.ok() && cfg.output_index) {
+        s = BCFFileSink::build_index(cfg, filename);
+    }
+    return s;
+}
+
+Status Service::genotype_sites_shard(const genotyper_config& cfg, const string& sampleset,
+                                     const vector<unified_site>& sites, size_t part,
+                                     const string& filename,
+                                     atomic<bool>* ext_abort) {
+    Status s;
+    if (cfg.output_index) {
+        return Status::Invalid("genotype_sites_shard: output_index applies only to the concatenated shards", filename);
+    }
+
+    vector<string> sample_names;
+    shared_ptr<bcf_hdr_t> hdr;
+    S(body_->prepare_output_header(cfg, sampleset, sample_names, hdr));
+
+    // as with the part files of genotype_sites_sharded, only the first
+    // shard includes the header(s)
+    unique_ptr<BCFFileSink> bcf_out;
+    S(BCFFileSink::Open(cfg, filename, hdr.get(), body_->cfg_.threads, bcf_out, part == 0));
+    unique_ptr<ResidualsFile> residualsFile = nullptr;
+    if (cfg.output_residuals) {
+        S(ResidualsFile::Open(cfg, residuals_filename(cfg, filename), body_->metadata_->contigs(),
+                              part == 0, residualsFile));
+    }
+
+    S(body_->genotype_sites_part(cfg, sampleset, sample_names, hdr.get(), sites, 0, sites.size(), 1,
+                                 *bcf_out, residualsFile.get(), ext_abort));
+    if (residualsFile) {
+        S(residualsFile->close());
+    }
+    return bcf_out->close();
+}
+
+Status Service::concatenate_shards(const genotyper_config& cfg, const vector<string>& parts,
+                                   const string& filename) {
+    Status s;
+    const bool bgzf = BCFFileSink::compressed(cfg, filename);
+    for (const auto& part : parts) {
+        if (BCFFileSink::compressed(cfg, part) != bgzf) {
+            return Status::Invalid("concatenate_shards: shard and output compression differ", part);
+        }
+    }
+    if (cfg.output_index && (!bgzf || filename == "-")) {
+        return Status::Invalid("concatenate_shards: output_index requires compressed output to a file", filename);
+    }
+
+    S(concat_output_parts(parts, bgzf, filename));
+    if (cfg.output_residuals) {
+        vector<string> residuals_parts;
+        for (const auto& part : parts) {
+            residuals_parts.push_back(residuals_filename(cfg, part));
+        }
+        S(concat_output_parts(residuals_parts,
+                              cfg.residuals_format == GLnexusResidualsFormat::BINARY,
+                              residuals_filename(cfg, filename)));
+    }
+    if (cfg.output_index) {
+        S(BCFFileSink::build_index(cfg, filename));
+    }
+    return Status::OK();
+}
+
+// parse a sample index of a SPARSE record
+static bool parse_sparse_index(const string& str, int n_sample, int& ans) {
+    char* end = nullptr;
+    errno = 0;
+    long i = strtol(str.c_str(), &end, 10);
+    if (str.empty() || *end || errno || i < 0 || i >= n_sample) {
+        return false;
+    }
+    ans = (int) i;
+    return true;
+}
+
+Status Service::sparse_to_vcf(const genotyper_config& cfg, const string& sparse_filename,
+                              const string& filename) {
+    if (cfg.output_format == GLnexusOutputFormat::SPARSE) {
+        return Status::Invalid("sparse_to_vcf: output format must be VCF or BCF", filename);
+    }
+    unique_ptr<htsFile, void(*)(htsFile*)> in(hts_open(sparse_filename.c_str(), "r"),
+                                               [](htsFile* f) { hts_close(f); });
+    if (!in) {
+        return Status::IOError("sparse_to_vcf: opening", sparse_filename);
+    }
+    kstring_t str = {0, 0, nullptr}, rec_str = {0, 0, nullptr};
+    auto decode = [&]() {
+        Status s;
+        string line;
+        auto next_line = [&]() {
+            int ret = hts_getline(in.get(), KS_SEP_LINE, &str);
+            if (ret >= 0) {
+                line.assign(str.s, str.l);
+            }
+            return ret;
+        };
+        auto starts_with = [&](const string& prefix) {
+            return line.compare(0, prefix.size(), prefix) == 0;
+        };
+
+        // reconstitute the VCF header, with the VCF file format and samples
+        const string version_prefix = string("##") + sparse_version_key + "=";
+        const string samples_prefix = string("##") + sparse_samples_key + "=";
+        string header_text, version, samples;
+        bool sparse = false;
+        int ret;
+        while ((ret = next_line()) >= 0 && starts_with("##")) {
+            if (line == string("##fileformat=") + sparse_fileformat) {
+                sparse = true;
+            } else if (starts_with(version_prefix)) {
+                version = line.substr(version_prefix.size());
+            } else if (starts_with(samples_prefix)) {
+                samples = line.substr(samples_prefix.size());
+            } else if (!starts_with("##GLnexusSparse=")) {
+                header_text += line + "\n";
+            }
+        }
+        if (!sparse || version.empty() || ret < 0 || !starts_with("#CHROM")) {
+            return Status::Invalid("sparse_to_vcf: not GLnexus SPARSE output", sparse_filename);
+        }
+        header_text = "##fileformat=" + version + "\n" + header_text + line
+                      + (samples.empty() ? "" : "\tFORMAT\t" + samples) + "\n";
+        shared_ptr<bcf_hdr_t> hdr(bcf_hdr_init("r"), &bcf_hdr_destroy);
+        if (!hdr || bcf_hdr_parse(hdr.get(), &header_text[0]) != 0) {
+            return Status::Failure("sparse_to_vcf: parsing header", sparse_filename);
+        }
+        const int n_sample = bcf_hdr_nsamples(hdr.get());
+
+        unique_ptr<BCFFileSink> out;
+        S(BCFFileSink::Open(cfg, filename, hdr.get(), 1, out));
+        unique_ptr<bcf1_t, void(*)(bcf1_t*)> rec(bcf_init(), &bcf_destroy);
+        vector<string> cols;
+        vector<size_t> cell_col(n_sample);
+        while ((ret = next_line()) >= 0) {
+            cols.clear();
+            for (size_t p = 0, q; p <= line.size(); p = q + 1) {
+                q = std::min(line.find('\t', p), line.size());
+                cols.push_back(line.substr(p, q - p));
+            }
+            // the site columns, FORMAT, DEFAULT, RUN, RUNS, and INDEX=CELL...
+            if (cols.size() < 12) {
+                return Status::Invalid("sparse_to_vcf: malformed record", line.substr(0, 100));
+            }
+            std::fill(cell_col.begin(), cell_col.end(), 9);
+            if (cols[11] != ".") {
+                istringstream runs(cols[11]);
+                string run;
+                while (getline(runs, run, ',')) {
+                    size_t dash = run.find('-');
+                    int beg, end;
+                    if (!parse_sparse_index(run.substr(0, dash), n_sample, beg)
+                        || !parse_sparse_index(dash == string::npos ? run : run.substr(dash+1), n_sample, end)
+                        || end < beg) {
+                        return Status::Invalid("sparse_to_vcf: malformed sample run", run);
+                    }
+                    for (int i = beg; i <= end; i++) {
+                        cell_col[i] = 10;
+                    }
+                }
+            }
+            for (size_t c = 12; c < cols.size(); c++) {
+                size_t eq = cols[c].find('=');
+                int i;
+                if (eq == string::npos || !parse_sparse_index(cols[c].substr(0, eq), n_sample, i)) {
+                    return Status::Invalid("sparse_to_vcf: malformed sample cell", cols[c]);
+                }
+                cols[c].erase(0, eq+1);
+                cell_col[i] = c;
+            }
+
+            rec_str.l = 0;
+            for (size_t c = 0; c < 9; c++) {
+                if (c) {
+                    kputc('\t', &rec_str);
+                }
+                kputsn(cols[c].c_str(), cols[c].size(), &rec_str);
+            }
+            for (int i = 0; i < n_sample; i++) {
+                kputc('\t', &rec_str);
+                kputsn(cols[cell_col[i]].c_str(), cols[cell_col[i]].size(), &rec_str);
+            }
+            if (vcf_parse(&rec_str, hdr.get(), rec.get()) != 0) {
+                return Status::Invalid("sparse_to_vcf: vcf_parse", line.substr(0, 100));
+            }
+            S(out->write(rec.get()));
+        }
+        if (ret < -1) {
+            return Status::IOError("sparse_to_vcf: reading", sparse_filename);
+        }
+        return out->close();
+    };
+    Status s = decode();
+    free(str.s);
+    free(rec_str.s);
+    return s;
+}
+
+Status Service::genotype_sites_pipelined(const genotyper_config& cfg, const string& sampleset,
+                                         size_t batches, size_t max_in_flight,
+                                         const function<Status(size_t,vector<unified_site>&)>& produce,
+                                         const string& filename,
+                                         atomic<bool>* ext_abort) {
+    Status s;
+    if (batches == 0) {
+        // just the header
+        return genotype_sites(cfg, sampleset, vector<unified_site>(), filename, ext_abort);
+    }
+    max_in_flight = std::max(std::min(max_in_flight, batches), (size_t) 1);
+    if (cfg.output_index && (!BCFFileSink::compressed(cfg, filename) || filename == "-")) {
+        return Status::Invalid("genotype_sites_pipelined: output_index requires compressed output to a file", filename);
+    }
+
+    vector<string> sample_names;
+    shared_ptr<bcf_hdr_t> hdr;
+    S(body_->prepare_output_header(cfg, sampleset, sample_names, hdr));
+
+    // residuals as in genotype_sites_sharded
+    const bool residuals_parts = cfg.output_residuals;
+    const bool residuals_bgzf = cfg.residuals_format == GLnexusResidualsFormat::BINARY;
+
+    // Each batch is genotyped into its own part file, as in
+    // genotype_sites_sharded, which is appended to the output (and removed)
+    // as soon as it and the preceding batches are complete.
+    string part_prefix = filename != "-" ? filename
+                                         : ("/tmp/GLnexus.genotype_sites." + std::to_string(getpid()));
+    auto part_filename = [&](size_t i) { return part_prefix + ".part" + std::to_string(i); };
+    auto residuals_part_filename = [&](size_t i) {
+        return residuals_filename(cfg, filename) + ".part" + std::to_string(i);
+    };
+    genotyper_config part_cfg = cfg;
+    part_cfg.output_index = false;
+    if (part_cfg.output_threads == 0) {
+        part_cfg.output_threads = std::max(body_->cfg_.threads/4/max_in_flight, (size_t) 1);
+    }
+    const bool bgzf = BCFFileSink::compressed(cfg, filename);
+    unique_ptr<OutputConcatenator> out, residuals_out;
+    S(OutputConcatenator::Open(filename, bgzf, out));
+    if (residuals_parts) {
+        S(OutputConcatenator::Open(residuals_filename(cfg, filename), residuals_bgzf, residuals_out));
+    }
+
+    atomic<bool> abort(false);
+    auto batch = [&](size_t i) {
+        return body_->metapool_.push([&, i](int tid){
+            Status ls;
+            vector<unified_site> sites;
+            unique_ptr<BCFFileSink> sink;
+            unique_ptr<ResidualsFile> residuals_sink;
+            string part = part_filename(i);
+            if (abort || (ext_abort && *ext_abort)) {
+                ls = Status::Aborted();
+            } else if ((ls = produce(i, sites)).ok() &&
+                       (ls = BCFFileSink::Open(part_cfg, part, hdr.get(), body_->cfg_.threads,
+                                               sink, i == 0)).ok() &&
+                       (!residuals_parts ||
+                        (ls = ResidualsFile::Open(cfg, residuals_part_filename(i), body_->metadata_->contigs(),
+                                                  i == 0, residuals_sink)).ok())) {
+                ls = body_->genotype_sites_part(part_cfg, sampleset, sample_names, hdr.get(),
+                                                sites, 0, sites.size(), max_in_flight, *sink,
+                                                residuals_sink.get(),
+                                                &abort, body_->part_node(i % max_in_flight, max_in_flight));
+                if (ls.ok()) {
+                    ls = sink->close();
+                }
+                if (ls.ok() && residuals_sink) {
+                    ls = residuals_sink->close();
+                }
+            }
+            if (ls.bad()) {
+                abort = true;
+            }
+            return ls;
+        });
+    };
+
+    // Keep up to max_in_flight batches in progress; as each completes (in
+    // order), append its part to the output and start the next batch.
+    deque<future<Status>> statuses;
+    size_t next = 0;
+    for (; next < max_in_flight; next++) {
+        statuses.push_back(batch(next));
+    }
+    for (size_t i = 0; i < batches; i++) {
+        auto& fut = statuses.front();
+        while (fut.wait_for(chrono::milliseconds(100)) != future_status::ready) {
+            if (ext_abort && *ext_abort) {
+                abort = true;
+            }
+        }
+        Status s_i(fut.get());
+        statuses.pop_front();
+        if (s.ok() && s_i.bad()) {
+            s = move(s_i);
+        }
+        if (s.ok()) {
+            s = out->append(part_filename(i));
+            if (s.ok() && residuals_out) {
+                s = residuals_out->append(residuals_part_filename(i));
+            }
+            if (s.bad()) {
+                abort = true;
+            }
+        }
+        remove(part_filename(i).c_str());
+        if (residuals_parts) {
+            remove(residuals_part_filename(i).c_str());
+        }
+        if (next < batches) {
+            statuses.push_back(batch(next++));
+        }
+    }
+    assert(statuses.empty());
+
+    if (s.ok()) {
+        s = out->close();
+    }
+    if (s.ok() && residuals_out) {
+        s = residuals_out->close();
+    }
+    out.reset();
+    residuals_out.reset();
+    if (s.ok() && cfg.output_index) {
+        s = BCFFileSink::build_index(cfg, filename);
+    }
+    return s;
+}
+
+// Flush a file (or directory) to stable storage
+static Status sync_path(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return Status::IOError("failed to open for fsync", path);
+    }
+    int rc = fsync(fd);
+    close(fd);
+    if (rc != 0) {
+        return Status::IOError("fsync", path);
+    }
+    return Status::OK();
+}
+
+// Fingerprint the inputs determining the output of a checkpointed job, so that
+// a checkpoint isn't resumed by a different one
+static Status checkpoint_fingerprint(const genotyper_config& cfg, const string& sampleset,
+                                     const vector<string>& sample_names,
+                                     const vector<unified_site>& sites,
+                                     size_t checkpoint_sites, bool header, string& ans) {
+    Status s;
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&](const void* data, size_t len) {
+        const unsigned char* p = (const unsigned char*) data;
+        for (size_t i = 0; i < len; i++) {
+            hash = (hash ^ p[i]) * 1099511628211ULL;
+        }
+    };
+    auto mix_str = [&](const string& str) {
+        mix(str.c_str(), str.size() + 1);
+    };
+    auto mix_range = [&](const range& r) {
+        int64_t v[3] = {r.rid, r.beg, r.end};
+        mix(v, sizeof(v));
+    };
+
+    YAML::Emitter yaml;
+    S(cfg.yaml(yaml));
+    mix_str(yaml.c_str());
+    mix_str(sampleset);
+    for (const auto& sample : sample_names) {
+        mix_str(sample);
+    }
+    uint64_t params[3] = {checkpoint_sites, header ? 1ULL : 0ULL, sites.size()};
+    mix(params, sizeof(params));
+    for (const auto& site : sites) {
+        mix_range(site.pos);
+        int64_t v[2] = {site.qual, site.monoallelic ? 1 : 0};
+        mix(v, sizeof(v));
+        mix(&site.lost_allele_frequency, sizeof(site.lost_allele_frequency));
+        for (const auto& al : site.alleles) {
+            mix_str(al.dna);
+            mix(&al.quality, sizeof(al.quality));
+            mix(&al.frequency, sizeof(al.frequency));
+        }
+        for (const auto& p : site.unification) {
+            mix_range(p.first.pos);
+            mix_str(p.first.dna);
+            mix(&p.second, sizeof(p.second));
+        }
+    }
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) hash);
+    ans = hex;
+    return Status::OK();
+}
+
+// The manifest of a checkpointed job: its fingerprint, number of chunks and
+// those committed so far
+static const char* checkpoint_manifest = "manifest.yml";
+
+static Status read_checkpoint_manifest(const string& checkpoint_dir, const string& fingerprint,
+                                       size_t chunks, set<size_t>& committed) {
+    committed.clear();
+    const string filename = checkpoint_dir + "/" + checkpoint_manifest;
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        // nothing committed yet
+        return Status::OK();
+    }
+    try {
+        YAML::Node n = YAML::LoadFile(filename);
+        if (!n.IsMap() || !n["fingerprint"] || !n["chunks"] || !n["committed"]
+            || !n["committed"].IsSequence()) {
+            return Status::Invalid("checkpoint manifest is malformed", filename);
+        }
+        if (n["fingerprint"].as<string>() != fingerprint || n["chunks"].as<size_t>() != chunks) {
+            return Status::Invalid("checkpoint belongs to a different job (sites, sample set or configuration)",
+                                   checkpoint_dir);
+        }
+        for (const auto& item : n["committed"]) {
+            size_t i = item.as<size_t>();
+            if (i >= chunks) {
+                return Status::Invalid("checkpoint manifest is malformed", filename);
+            }
+            committed.insert(i);
+        }
+    } catch (YAML::Exception& exn) {
+        return Status::Invalid("checkpoint manifest YAML parse error", filename + " " + exn.msg);
+    }
+    return Status::OK();
+}
+
+// Rewrite the manifest atomically: write a temporary file, flush it to
+// storage and rename it over the manifest.
+static Status write_checkpoint_manifest(const string& checkpoint_dir, const string& fingerprint,
+                                        size_t chunks, const set<size_t>& committed) {
+    Status s;
+    YAML::Emitter yaml;
+    yaml << YAML::BeginMap;
+    yaml << YAML::Key << "fingerprint" << YAML::Value << fingerprint;
+    yaml << YAML::Key << "chunks" << YAML::Value << chunks;
+    yaml << YAML::Key << "committed" << YAML::Value << YAML::Flow << YAML::BeginSeq;
+    for (size_t i : committed) {
+        yaml << i;
+    }
+    yaml << YAML::EndSeq << YAML::EndMap;
+
+    const string filename = checkpoint_dir + "/" + checkpoint_manifest;
+    const string tmp = filename + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        return Status::IOError("failed to open file for writing", tmp);
+    }
+    const size_t len = strlen(yaml.c_str());
+    bool ok = fwrite(yaml.c_str(), 1, len, f) == len && fputc('\n', f) != EOF
+              && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !ok) {
+        return Status::IOError("failed to write checkpoint manifest", tmp);
+    }
+    if (rename(tmp.c_str(), filename.c_str()) != 0) {
+        return Status::IOError("failed to rename checkpoint manifest", filename);
+    }
+    return sync_path(checkpoint_dir);
+}
+
+Status Service::genotype_sites_checkpointed(const genotyper_config& cfg, const string& sampleset,
+                                            const vector<unified_site>& sites, size_t checkpoint_sites,
+                                            size_t max_in_flight, const string& checkpoint_dir,
+                                            const string& filename, bool header,
+                                            atomic<bool>* ext_abort) {
+    Status s;
+    if (checkpoint_sites == 0 || checkpoint_dir.empty()) {
+        return Status::Invalid("genotype_sites_checkpointed: checkpoint_sites and checkpoint_dir are required");
+    }
+    if (cfg.output_residuals && cfg.residuals_format != GLnexusResidualsFormat::BINARY) {
+        return Status::Invalid("genotype_sites_checkpointed: residuals must be in the binary format");
+    }
+    if (cfg.output_index && (!header || !BCFFileSink::compressed(cfg, filename) || filename == "-")) {
+        return Status::Invalid("genotype_sites_checkpointed: output_index requires compressed output to a file, with the header", filename);
+    }
+    const size_t chunks = std::max((sites.size() + checkpoint_sites - 1) / checkpoint_sites, (size_t) 1);
+    max_in_flight = std::max(std::min(max_in_flight, chunks), (size_t) 1);
+
+    vector<string> sample_names;
+    shared_ptr<bcf_hdr_t> hdr;
+    S(body_->prepare_output_header(cfg, sampleset, sample_names, hdr));
+    string fingerprint;
+    S(checkpoint_fingerprint(cfg, sampleset, sample_names, sites, checkpoint_sites, header, fingerprint));
+
+    // Each chunk is genotyped into a temporary part file, which is renamed
+    // into place once it's complete and flushed to storage; then the chunk is
+    // recorded in the manifest. The part files keep the output's extension,
+    // which determines whether they're compressed.
+    if (mkdir(checkpoint_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        return Status::IOError("failed to create checkpoint directory", checkpoint_dir);
+    }
+    const bool bgzf = BCFFileSink::compressed(cfg, filename);
+    auto part_filename = [&](size_t i, bool tmp) {
+        return checkpoint_dir + "/" + (tmp ? "tmp." : "") + "part" + std::to_string(i) + (bgzf ? ".gz" : "");
+    };
+    auto residuals_part_filename = [&](size_t i, bool tmp) {
+        return checkpoint_dir + "/" + (tmp ? "tmp." : "") + "part" + std::to_string(i) + ".residuals";
+    };
+
+    // skip the chunks committed by an earlier, interrupted run (provided
+    // their part files are still there)
+    set<size_t> committed;
+    S(read_checkpoint_manifest(checkpoint_dir, fingerprint, chunks, committed));
+    for (auto p = committed.begin(); p != committed.end(); ) {
+        struct stat st;
+        if (stat(part_filename(*p, false).c_str(), &st) != 0
+            || (cfg.output_residuals && stat(residuals_part_filename(*p, false).c_str(), &st) != 0)) {
+            p = committed.erase(p);
+        } else {
+            p++;
+        }
+    }
+    vector<size_t> pending;
+    for (size_t i = 0; i < chunks; i++) {
+        if (!committed.count(i)) {
+            pending.push_back(i);
+        }
+    }
+    genotyper_config part_cfg = cfg;
+    part_cfg.output_index = false;
+    if (part_cfg.output_threads == 0) {
+        part_cfg.output_threads = std::max(body_->cfg_.threads/4/max_in_flight, (size_t) 1);
+    }
+    mutex manifest_mutex;
+    atomic<bool> abort(false);
+    auto chunk = [&](size_t k) {
+        const size_t i = pending[k];
+        return body_->metapool_.push([&, i, k](int tid){
+            Status ls;
+            const size_t first = std::min(i*checkpoint_sites, sites.size());
+            const size_t last = std::min(first + checkpoint_sites, sites.size());
+            unique_ptr<BCFFileSink> sink;
+            unique_ptr<ResidualsFile> residuals_sink;
+            if (abort || (ext_abort && *ext_abort)) {
+                ls = Status::Aborted();
+            } else if ((ls = BCFFileSink::Open(part_cfg, part_filename(i, true), hdr.get(),
+                                               body_->cfg_.threads, sink, header && i == 0)).ok() &&
+                       (!cfg.output_residuals ||
+                        (ls = ResidualsFile::Open(cfg, residuals_part_filename(i, true),
+                                                  body_->metadata_->contigs(), header && i == 0,
+                                                  residuals_sink)).ok())) {
+                ls = body_->genotype_sites_part(part_cfg, sampleset, sample_names, hdr.get(),
+                                                sites, first, last, max_in_flight, *sink,
+                                                residuals_sink.get(), &abort,
+                                                body_->part_node(k % max_in_flight, max_in_flight));
+                if (ls.ok()) {
+                    ls = sink->close();
+                }
+                if (ls.ok() && residuals_sink) {
+                    ls = residuals_sink->close();
+                }
+            }
+            // commit the chunk
+            if (ls.ok()) {
+                ls = sync_path(part_filename(i, true));
+            }
+            if (ls.ok() && cfg.output_residuals) {
+                ls = sync_path(residuals_part_filename(i, true));
+            }
+            if (ls.ok() && cfg.output_residuals
+                && rename(residuals_part_filename(i, true).c_str(), residuals_part_filename(i, false).c_str()) != 0) {
+                ls = Status::IOError("failed to rename part file", residuals_part_filename(i, false));
+            }
+            if (ls.ok() && rename(part_filename(i, true).c_str(), part_filename(i, false).c_str()) != 0) {
+                ls = Status::IOError("failed to rename part file", part_filename(i, false));
+            }
+            if (ls.ok()) {
+                lock_guard<mutex> lock(manifest_mutex);
+                committed.insert(i);
+                ls = write_checkpoint_manifest(checkpoint_dir, fingerprint, chunks, committed);
+            }
+            if (ls.bad()) {
+                abort = true;
+            }
+            return ls;
+        });
+    };
+
+    // Keep up to max_in_flight chunks in progress, as genotype_sites_pipelined
+    // does its batches, but committing them in whatever order they complete.
+    deque<future<Status>> statuses;
+    size_t next = 0;
+    for (; next < std::min(max_in_flight, pending.size()); next++) {
+        statuses.push_back(chunk(next));
+    }
+    while (!statuses.empty()) {
+        auto& fut = statuses.front();
+        while (fut.wait_for(chrono::milliseconds(100)) != future_status::ready) {
+            if (ext_abort && *ext_abort) {
+                abort = true;
+            }
+        }
+        Status s_i(fut.get());
+        statuses.pop_front();
+        if (s.ok() && s_i.bad()) {
+            s = move(s_i);
+        }
+        if (next < pending.size()) {
+            statuses.push_back(chunk(next++));
+        }
+    }
+    if (s.bad()) {
+        // leave the committed chunks for the next attempt
+        return s;
+    }
+    assert(committed.size() == chunks);
+
+    // concatenate the parts into the output, and only then discard the
+    // checkpoint
+    vector<string> parts, residuals_parts;
+    for (size_t i = 0; i < chunks; i++) {
+        parts.push_back(part_filename(i, false));
+        residuals_parts.push_back(residuals_part_filename(i, false));
+    }
+    S(concat_output_parts(parts, bgzf, filename));
+    if (cfg.output_residuals) {
+        S(concat_output_parts(residuals_parts, true, residuals_filename(cfg, filename)));
+    }
+    if (cfg.output_index) {
+        S(BCFFileSink::build_index(cfg, filename));
+    }
+    remove((checkpoint_dir + "/" + checkpoint_manifest).c_str());
+    for (size_t i = 0; i < chunks; i++) {
+        remove(parts[i].c_str());
+        if (cfg.output_residuals) {
+            remove(residuals_parts[i].c_str());
+        }
+    }
+    rmdir(checkpoint_dir.c_str());
+    return Status::OK();
+}
+
+// Copy one FORMAT field into the combined record ans, in which output sample
+// j is sample sources[j].second of the input record recs[sources[j].first].
+// Each sample's values are padded to the widest of the inputs, and samples
+// whose record lacks the field get the missing value.
+template<class T>
+static Status combine_format_values(const bcf_hdr_t* hdr, const char* key, int type,
+                                    T missing, T vector_end,
+                                    const vector<pair<int,int>>& sources,
+                                    bcf_hdr_t* const hdrs[2], bcf1_t* const recs[2],
+                                    bcf1_t* ans) {
+    htsvecbox<T> vals[2];
+    int width[2] = {0, 0};
+    for (int f = 0; f < 2; f++) {
+        int n = bcf_get_format_values(hdrs[f], recs[f], key, (void**) &vals[f].v,
+                                      &vals[f].capacity, type);
+        if (n >= 0) {
+            width[f] = n / bcf_hdr_nsamples(hdrs[f]);
+        } else if (n != -1 && n != -3) {
+            // (-1: not in the header; -3: not in the record)
+            return Status::Failure("bcf_get_format_values", key);
+        }
+    }
+    const int w = std::max(std::max(width[0], width[1]), 1);
+    vector<T> out(sources.size()*w, vector_end);
+    for (size_t j = 0; j < sources.size(); j++) {
+        const int f = sources[j].first;
+        if (width[f]) {
+            const T* v = vals[f].v + sources[j].second*width[f];
+            std::copy(v, v + width[f], out.begin() + j*w);
+        } else {
+            out[j*w] = missing;
+        }
+    }
+    if (bcf_update_format(hdr, ans, key, out.data(), out.size(), type) != 0) {
+        return Status::Failure("bcf_update_format", key);
+    }
+    return Status::OK();
+}
+
+// Copy one INFO field of rec (in rec_hdr) into ans
+template<class T>
+static Status copy_info_values(const bcf_hdr_t* hdr, const bcf_hdr_t* rec_hdr, bcf1_t* rec,
+                               const char* key, int type, bcf1_t* ans) {
+    htsvecbox<T> vals;
+    int n = bcf_get_info_values(rec_hdr, rec, key, (void**) &vals.v, &vals.capacity, type);
+    if (n < 0 || bcf_update_info(hdr, ans, key, vals.v, n, type) != 0) {
+        return Status::Failure("copying INFO field", key);
+    }
+    return Status::OK();
+}
+
+// Combine the sample columns of two records for the same site, the prior
+// (recs[0]) and the added samples' (recs[1]), into one record for the output
+// header hdr, in which output sample j is sample sources[j].second of
+// recs[sources[j].first]. The site-level fields (QUAL, ID, FILTER & INFO)
+// are taken from the added samples' record, which was genotyped on the
+// current unified site.
+static Status combine_sample_columns(const bcf_hdr_t* hdr, const vector<pair<int,int>>& sources,
+                                     bcf_hdr_t* const hdrs[2], bcf1_t* const recs[2],
+                                     shared_ptr<bcf1_t>& ans) {
+    Status s;
+    for (int f = 0; f < 2; f++) {
+        if (bcf_unpack(recs[f], BCF_UN_ALL) != 0) {
+            return Status::Failure("bcf_unpack");
+        }
+    }
+    const bcf_hdr_t* site_hdr = hdrs[1];
+    bcf1_t* site = recs[1];
+
+    ans = shared_ptr<bcf1_t>(bcf_init(), &bcf_destroy);
+    ans->rid = site->rid;
+    ans->pos = site->pos;
+    ans->rlen = site->rlen;
+    ans->qual = site->qual;
+    if (bcf_update_alleles(hdr, ans.get(), (const char**) site->d.allele, site->n_allele) != 0) {
+        return Status::Failure("bcf_update_alleles");
+    }
+    if (bcf_update_id(hdr, ans.get(), site->d.id) != 0) {
+        return Status::Failure("bcf_update_id");
+    }
+    for (int i = 0; i < site->d.n_flt; i++) {
+        const char* flt = bcf_hdr_int2id(site_hdr, BCF_DT_ID, site->d.flt[i]);
+        if (bcf_add_filter(hdr, ans.get(), bcf_hdr_id2int(hdr, BCF_DT_ID, flt)) != 1) {
+            return Status::Failure("bcf_add_filter", flt);
+        }
+    }
+    for (int i = 0; i < site->n_info; i++) {
+        const int id = site->d.info[i].key;
+        const char* key = bcf_hdr_int2id(site_hdr, BCF_DT_ID, id);
+        const int type = bcf_hdr_id2type(site_hdr, BCF_HL_INFO, id);
+        if (type == BCF_HT_FLAG) {
+            if (bcf_update_info_flag(hdr, ans.get(), key, nullptr, 1) != 0) {
+                return Status::Failure("bcf_update_info_flag", key);
+            }
+        } else if (type == BCF_HT_STR) {
+            S(copy_info_values<char>(hdr, site_hdr, site, key, type, ans.get()));
+        } else {
+            // (floats are copied bitwise, as int32s)
+            S(copy_info_values<int32_t>(hdr, site_hdr, site, key, type, ans.get()));
+        }
+    }
+
+    // FORMAT fields, in the order of the added samples' record (with any
+    // only in the prior record following)
+    vector<string> keys;
+    for (int f = 1; f >= 0; f--) {
+        for (int i = 0; i < recs[f]->n_fmt; i++) {
+            string key = bcf_hdr_int2id(hdrs[f], BCF_DT_ID, recs[f]->d.fmt[i].id);
+            if (find(keys.begin(), keys.end(), key) == keys.end()) {
+                keys.push_back(move(key));
+            }
+        }
+    }
+    for (const auto& key : keys) {
+        int id = bcf_hdr_id2int(hdr, BCF_DT_ID, key.c_str());
+        if (id < 0 || !bcf_hdr_idinfo_exists(hdr, BCF_HL_FMT, id)) {
+            return Status::Invalid("combine_sample_columns: FORMAT field absent from output header", key);
+        }
+        if (key == "GT") {
+            // (declared a String, but stored as integers)
+            S(combine_format_values<int32_t>(hdr, "GT", BCF_HT_INT, bcf_gt_missing,
+                                             bcf_int32_vector_end, sources, hdrs, recs, ans.get()));
+            continue;
+        }
+        switch (bcf_hdr_id2type(hdr, BCF_HL_FMT, id)) {
+            case BCF_HT_INT:
+                S(combine_format_values<int32_t>(hdr, key.c_str(), BCF_HT_INT, bcf_int32_missing,
+                                                 bcf_int32_vector_end, sources, hdrs, recs, ans.get()));
+                break;
+            case BCF_HT_REAL:
+                // floats are handled bitwise, as int32s
+                S(combine_format_values<int32_t>(hdr, key.c_str(), BCF_HT_REAL, bcf_float_missing,
+                                                 bcf_float_vector_end, sources, hdrs, recs, ans.get()));
+                break;
+            case BCF_HT_STR:
+                S(combine_format_values<char>(hdr, key.c_str(), BCF_HT_STR, '.', '\0',
+                                              sources, hdrs, recs, ans.get()));
+                break;
+            default:
+                return Status::Invalid("combine_sample_columns: unexpected FORMAT field type", key);
+        }
+    }
+    return Status::OK();
+}
+
+// Does the output record rec (from a file produced for the same contigs)
+// represent the unified site?
+static bool record_of_site(bcf1_t* rec, const unified_site& site) {
+    if (bcf_unpack(rec, BCF_UN_STR) != 0 || rec->rid != site.pos.rid || rec->pos != site.pos.beg
+        || rec->n_allele != site.alleles.size()) {
+        return false;
+    }
+    for (int i = 0; i < rec->n_allele; i++) {
+        if (site.alleles[i].dna != rec->d.allele[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Output sink for genotype_sites_incremental. The genotyping writes the
+// records of the sites genotyped afresh, in order; before each (and on close)
+// the sink writes those of any preceding sites reusing their prior columns,
+// combining the record read from the prior output with that read from the
+// added samples' output.
+class IncrementalBCFFileSink : public BCFFileSink {
+    using vcfFile_ptr = unique_ptr<vcfFile, void(*)(vcfFile*)>;
+    using bcf_hdr_ptr = unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)>;
+
+    bcf_hdr_t* hdr_;
+    const vector<unified_site>& sites_;
+    const vector<unified_site>& prior_sites_;
+    // the prior site reused for each site, or -1 if it's genotyped afresh
+    const vector<int>& prior_index_;
+    // the prior output [0] and the added samples' output [1]
+    vector<vcfFile_ptr> inputs_;
+    vector<bcf_hdr_ptr> input_hdrs_;
+    vector<pair<int,int>> sources_;
+    size_t next_ = 0;       // next site to write
+    int prior_next_ = 0;    // index of the next record in the prior output
+
+    IncrementalBCFFileSink(const string& filename, bcf_hdr_t* hdr, vcfFile* outfile,
+                           const genotyper_config& cfg,
+                           const vector<unified_site>& sites,
+                           const vector<unified_site>& prior_sites,
+                           const vector<int>& prior_index)
+        : BCFFileSink(filename, hdr, outfile, cfg), hdr_(hdr), sites_(sites),
+          prior_sites_(prior_sites), prior_index_(prior_index) {}
+
+    static void close_vcf(vcfFile* f) { bcf_close(f); }
+
+    Status read(int f, shared_ptr<bcf1_t>& ans) {
+        ans = shared_ptr<bcf1_t>(bcf_init(), &bcf_destroy);
+        int ret = bcf_read(inputs_[f].get(), input_hdrs_[f].get(), ans.get());
+        if (ret == -1) {
+            return Status::Invalid("genotype_sites_incremental: output ended prematurely",
+                                   f ? "added samples" : "prior");
+        } else if (ret != 0) {
+            return Status::IOError("bcf_read");
+        }
+        return Status::OK();
+    }
+
+    // write the records of the sites reusing prior columns up to the next
+    // site genotyped afresh
+    Status write_reused() {
+        Status s;
+        for (; next_ < sites_.size() && prior_index_[next_] >= 0; next_++) {
+            shared_ptr<bcf1_t> recs[2];
+            do {
+                S(read(0, recs[0]));
+            } while (prior_next_++ < prior_index_[next_]);
+            if (!record_of_site(recs[0].get(), prior_sites_[prior_index_[next_]])) {
+                return Status::Invalid("genotype_sites_incremental: prior output doesn't correspond to the prior sites",
+                                       prior_sites_[prior_index_[next_]].pos.str());
+            }
+            S(read(1, recs[1]));
+            if (!record_of_site(recs[1].get(), sites_[next_])) {
+                return Status::Failure("genotype_sites_incremental: unexpected record for added samples",
+                                       sites_[next_].pos.str());
+            }
+            bcf_hdr_t* const hdrs[2] = { input_hdrs_[0].get(), input_hdrs_[1].get() };
+            bcf1_t* const rs[2] = { recs[0].get(), recs[1].get() };
+            shared_ptr<bcf1_t> combined;
+            S(combine_sample_columns(hdr_, sources_, hdrs, rs, combined));
+            S(BCFFileSink::write(combined.get()));
+        }
+        return Status::OK();
+    }
+
+public:
+    // hdr: the output header, for the whole sample set, whose samples must be
+    // exactly those of the prior and added samples' outputs
+    static Status Open(const genotyper_config& cfg, const string& filename, bcf_hdr_t* hdr,
+                       size_t threads, const string& prior_filename,
+                       const string& added_filename,
+                       const vector<unified_site>& sites,
+                       const vector<unified_site>& prior_sites,
+                       const vector<int>& prior_index,
+                       unique_ptr<BCFFileSink>& ans) {
+        Status s;
+        vector<vcfFile_ptr> inputs;
+        vector<bcf_hdr_ptr> input_hdrs;
+        for (const string& fn : {prior_filename, added_filename}) {
+            inputs.emplace_back(bcf_open(fn.c_str(), "r"), &close_vcf);
+            if (!inputs.back()) {
+                return Status::IOError("bcf_open", fn);
+            }
+            input_hdrs.emplace_back(bcf_hdr_read(inputs.back().get()), &bcf_hdr_destroy);
+            if (!input_hdrs.back()) {
+                return Status::IOError("bcf_hdr_read", fn);
+            }
+        }
+
+        vector<pair<int,int>> sources;
+        for (int j = 0; j < bcf_hdr_nsamples(hdr); j++) {
+            const char* sample = hdr->samples[j];
+            int i0 = bcf_hdr_id2int(input_hdrs[0].get(), BCF_DT_SAMPLE, sample);
+            int i1 = bcf_hdr_id2int(input_hdrs[1].get(), BCF_DT_SAMPLE, sample);
+            if ((i0 >= 0) == (i1 >= 0)) {
+                return Status::Invalid(i0 >= 0 ? "genotype_sites_incremental: added sample already in prior output"
+                                               : "genotype_sites_incremental: sample in neither prior output nor added sample set",
+                                       sample);
+            }
+            sources.push_back(i0 >= 0 ? make_pair(0, i0) : make_pair(1, i1));
+        }
+        if ((size_t) (bcf_hdr_nsamples(input_hdrs[0]) + bcf_hdr_nsamples(input_hdrs[1])) != sources.size()) {
+            return Status::Invalid("genotype_sites_incremental: prior output has samples not in the sample set",
+                                   prior_filename);
+        }
+
+        vcfFile* outfile;
+        S(open_file(cfg, filename, hdr, threads, true, outfile));
+        auto sink = new IncrementalBCFFileSink(filename, hdr, outfile, cfg, sites,
+                                               prior_sites, prior_index);
+        ans.reset(sink);
+        sink->inputs_ = move(inputs);
+        sink->input_hdrs_ = move(input_hdrs);
+        sink->sources_ = move(sources);
+        return Status::OK();
+    }
+
+    Status write(bcf1_t* record) override {
+        Status s;
+        S(write_reused());
+        if (next_ >= sites_.size()) {
+            return Status::Failure("genotype_sites_incremental: too many records");
+        }
+        assert(prior_index_[next_] < 0);
+        next_++;
+        return BCFFileSink::write(record);
+    }
+
+    Status close() override {
+        Status s = write_reused();
+        if (s.ok() && next_ != sites_.size()) {
+            s = Status::Failure("genotype_sites_incremental: too few records");
+        }
+        inputs_.clear();
+        input_hdrs_.clear();
+        Status s2 = BCFFileSink::close();
+        return s.ok() ? s2 : s;
+    }
+};
+
+Status Service::genotype_sites_incremental(const genotyper_config& cfg, const string& sampleset,
+                                           const string& added_sampleset,
+                                           const vector<unified_site>& prior_sites,
+                                           const string& prior_filename,
+                                           const vector<unified_site>& sites,
+                                           const string& filename,
+                                           size_t* reused,
+                                           atomic<bool>* ext_abort) {
+    Status s;
+    if (cfg.trim_uncalled_alleles) {
+        // (the prior and added samples' records would have different alleles)
+        return Status::Invalid("genotype_sites_incremental: incompatible with trim_uncalled_alleles");
+    }
+    if (cfg.output_format == GLnexusOutputFormat::SPARSE) {
+        // (the prior output is read back as VCF/BCF)
+        return Status::NotImplemented("genotype_sites_incremental: SPARSE output format");
+    }
+    if (cfg.output_index && (!BCFFileSink::compressed(cfg, filename) || filename == "-")) {
+        return Status::Invalid("genotype_sites_incremental: output_index requires compressed output to a file", filename);
+    }
+    auto by_pos = [](const unified_site& a, const unified_site& b) { return a.pos < b.pos; };
+    if (!std::is_sorted(prior_sites.begin(), prior_sites.end(), by_pos)
+        || !std::is_sorted(sites.begin(), sites.end(), by_pos)) {
+        return Status::Invalid("genotype_sites_incremental: sites must be sorted by position");
+    }
+
+    // Find the prior site, if any, whose genotypes each site can reuse. They
+    // must be taken up in order, so that the prior output can be read
+    // through once.
+    vector<int> prior_index(sites.size(), -1);
+    vector<unified_site> fresh_sites, reused_sites;
+    int last = -1;
+    for (size_t i = 0; i < sites.size(); i++) {
+        auto p = std::lower_bound(prior_sites.begin(), prior_sites.end(), sites[i].pos,
+                                  [](const unified_site& site, const range& pos) { return site.pos < pos; });
+        for (; p != prior_sites.end() && p->pos == sites[i].pos; p++) {
+            int k = p - prior_sites.begin();
+            if (k > last && genotypes_reusable(cfg, *p, sites[i])) {
+                prior_index[i] = last = k;
+                break;
+            }
+        }
+        if (prior_index[i] >= 0) {
+            reused_sites.push_back(sites[i]);
+        } else {
+            fresh_sites.push_back(sites[i]);
+        }
+    }
+    if (reused) {
+        *reused = reused_sites.size();
+    }
+
+    // Genotype the added samples at the reused sites, into a temporary BCF
+    // file (going alongside the output file, or a fresh one in /tmp if
+    // writing to standard output)
+    string added_filename = filename + ".added";
+    if (filename == "-") {
+        string tmpl = "/tmp/GLnexus.genotype_sites.added.XXXXXX";
+        int fd = mkstemp(&tmpl[0]);
+        if (fd < 0) {
+            return Status::IOError("genotype_sites_incremental: creating temporary file", tmpl);
+        }
+        close(fd);
+        added_filename = tmpl;
+    }
+    genotyper_config added_cfg = cfg;
+    added_cfg.output_format = GLnexusOutputFormat::BCF;
+    added_cfg.output_compression_level = 0;
+    added_cfg.output_residuals = false;
+    added_cfg.output_index = false;
+    s = genotype_sites(added_cfg, added_sampleset, reused_sites, added_filename, ext_abort);
+    if (s.bad()) {
+        remove(added_filename.c_str());
+        return s;
+    }
+
+    // Genotype the whole sample set at the other sites, with the sink merging
+    // in the reused sites in order.
+    vector<string> sample_names;
+    shared_ptr<bcf_hdr_t> hdr;
+    unique_ptr<BCFFileSink> bcf_out;
+    s = body_->prepare_output_header(cfg, sampleset, sample_names, hdr);
+    if (s.ok()) {
+        s = IncrementalBCFFileSink::Open(cfg, filename, hdr.get(), body_->cfg_.threads,
+                                         prior_filename, added_filename, sites, prior_sites,
+                                         prior_index, bcf_out);
+    }
+    unique_ptr<ResidualsFile> residualsFile = nullptr;
+    if (s.ok() && cfg.output_residuals) {
+        s = ResidualsFile::Open(cfg, residuals_filename(cfg, filename), body_->metadata_->contigs(),
+                                true, residualsFile);
+    }
+    if (s.ok()) {
+        s = body_->genotype_sites_part(cfg, sampleset, sample_names, hdr.get(), fresh_sites,
+                                       0, fresh_sites.size(), 1, *bcf_out, residualsFile.get(),
+                                       ext_abort);
+    }
+    if (s.ok() && residualsFile) {
+        s = residualsFile->close();
+    }
+    if (s.ok()) {
+        s = bcf_out->close();
+    }
+    bcf_out.reset();
+    remove(added_filename.c_str());
+    return s;
+}
+
+uint64_t Service::threads_stalled_ms() const { return body_->threads_stalled_ms_; }
+
+perf::snapshot Service::perf_stats() const {
+    perf::snapshot ans = perf::current();
+    ans -= body_->perf_base_;
+    return ans;
+}
 
 }
@@ -72,37 +72,128 @@ bool is_iupac_nucleotides(const std::string& s) {
     return true;
 }
 
+Status merge_discovered_allele_info(const allele& allele, const discovered_allele_info& ai,
+                                    discovered_allele_info& dest) {
+    if (ai.in_target == dest.in_target) {
+        if (ai.is_ref != dest.is_ref) {
+            return Status::Invalid("allele appears as both REF and ALT", allele.dna + "@" + allele.pos.str());
+        }
+        dest.all_filtered = dest.all_filtered && ai.all_filtered;
+        dest.topAQ += ai.topAQ;
+        dest.zGQ += ai.zGQ;
+        // we expect in_target to be the same but JIC choose the larger
+        if (ai.in_target.size() > dest.in_target.size()) {
+            dest.in_target = ai.in_target;
+        }
+    } else if (dest.in_target < ai.in_target) {
+        // It seems that the same allele has been discovered in >1 distinct
+        // target ranges. To avoid double-counting copy number, topAQ,
+        // etc., we'll (arbitrarily) keep the info from the "greater"
+        // target range.
+        dest = ai;
+    }
+    return Status::OK();
+}
+
 // Add src alleles to dest alleles. Identical alleles alleles are merged,
 // updating topAQ and combining zygosity_by_GQ
 Status merge_discovered_alleles(const discovered_alleles& src, discovered_alleles& dest) {
-    for (auto& dsal : src) {
-        UNPAIR(dsal,allele,ai)
-        auto p = dest.find(allele);
-        if (p == dest.end()) {
-            dest[allele] = ai;
-        } else if (ai.in_target == p->second.in_target) {
-            if (ai.is_ref != p->second.is_ref) {
-                return Status::Invalid("allele appears as both REF and ALT", allele.dna + "@" + allele.pos.str());
-            }
-            p->second.all_filtered = p->second.all_filtered && ai.all_filtered;
-            p->second.topAQ += ai.topAQ;
-            p->second.zGQ += ai.zGQ;
-            // we expect in_target to be the same but JIC choose the larger
-            if (ai.in_target.size() > p->second.in_target.size()) {
-                p->second.in_target = ai.in_target;
-            }
-        } else if (p->second.in_target < ai.in_target) {
-            // It seems that the same allele has been discovered in >1 distinct
-            // target ranges. To avoid double-counting copy number, topAQ,
-            // etc., we'll (arbitrarily) keep the info from the "greater"
-            // target range.
-            p->second = ai;
+    Status s;
+    if (src.empty()) {
+        return Status::OK();
+    }
+
+    // common case: src lies entirely after dest (e.g. successive batches of
+    // records from one dataset), so just append
+    if (dest.empty() || (dest.end()-1)->first < src.begin()->first) {
+        dest.reserve(dest.size() + src.size());
+        for (const auto& dsal : src) {
+            dest.push_back_sorted(discovered_alleles::value_type(dsal));
+        }
+        return Status::OK();
+    }
+
+    // otherwise, linear merge of the two sorted tables
+    discovered_alleles ans;
+    ans.reserve(dest.size() + src.size());
+    auto d = dest.begin();
+    auto e = src.begin();
+    while (d != dest.end() || e != src.end()) {
+        if (e == src.end() || (d != dest.end() && d->first < e->first)) {
+            ans.push_back_sorted(move(*d++));
+        } else if (d == dest.end() || e->first < d->first) {
+            ans.push_back_sorted(discovered_alleles::value_type(*e++));
+        } else {
+            S(merge_discovered_allele_info(e->first, e->second, d->second));
+            ans.push_back_sorted(move(*d++));
+            e++;
+        }
+    }
+    dest.swap(ans);
+
+    return Status::OK();
+}
+
+Status merge_discovered_alleles(vector<discovered_alleles>& srcs, discovered_alleles& dest) {
+    Status s;
+
+    // dest goes first among the inputs, and ties are broken by input index,
+    // so that each allele's info is combined in the same order as it would be
+    // by successive two-way merges.
+    vector<discovered_alleles> inputs;
+    inputs.reserve(srcs.size() + 1);
+    size_t total = dest.size();
+    inputs.push_back(move(dest));
+    dest.clear();
+    for (auto& src : srcs) {
+        total += src.size();
+        inputs.push_back(move(src));
+    }
+    srcs.clear();
+
+    // min-heap of cursors into the inputs
+    using cursor = pair<discovered_alleles::iterator,size_t>;
+    auto cursor_gt = [](const cursor& lhs, const cursor& rhs) {
+        return rhs.first->first < lhs.first->first ||
+               (lhs.first->first == rhs.first->first && lhs.second > rhs.second);
+    };
+    vector<cursor> heap;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (!inputs[i].empty()) {
+            heap.push_back(make_pair(inputs[i].begin(), i));
         }
     }
+    make_heap(heap.begin(), heap.end(), cursor_gt);
+
+    discovered_alleles ans;
+    ans.reserve(total);
+    while (!heap.empty()) {
+        pop_heap(heap.begin(), heap.end(), cursor_gt);
+        cursor& c = heap.back();
+        if (!ans.empty() && (ans.end()-1)->first == c.first->first) {
+            S(merge_discovered_allele_info(c.first->first, c.first->second, (ans.end()-1)->second));
+        } else {
+            ans.push_back_sorted(move(*c.first));
+        }
+        if (++c.first != inputs[c.second].end()) {
+            push_heap(heap.begin(), heap.end(), cursor_gt);
+        } else {
+            inputs[c.second].clear(); // free some memory
+            heap.pop_back();
+        }
+    }
+    dest.swap(ans);
 
     return Status::OK();
 }
 
+size_t discovered_alleles_bytes(const discovered_alleles& dsals) {
+    size_t ans = dsals.size() * sizeof(discovered_alleles::value_type);
+    for (const auto& p : dsals) {
+        ans += p.first.dna.capacity();
+    }
+    return ans;
+}
 
 Status range_yaml(const std::vector<std::pair<std::string,size_t> >& contigs,
                   const range& r, YAML::Emitter& yaml, bool omit_ref) {
@@ -825,6 +916,14 @@ Status genotyper_config::yaml(YAML::Emitter& ans) const {
     ans << YAML::Key << "allele_dp_format" << YAML::Value << allele_dp_format;
     ans << YAML::Key << "ref_dp_format" << YAML::Value << ref_dp_format;
     ans << YAML::Key << "output_residuals" << YAML::Value << output_residuals;
+    ans << YAML::Key << "residuals_format" << YAML::Value;
+    if (residuals_format == GLnexusResidualsFormat::YAML) {
+        ans << "YAML";
+    } else if (residuals_format == GLnexusResidualsFormat::BINARY) {
+        ans << "BINARY";
+    } else {
+        return Status::Invalid("genotyper_config::yaml: invalid residuals_format");
+    }
     ans << YAML::Key << "more_PL" << YAML::Value << more_PL;
     ans << YAML::Key << "squeeze" << YAML::Value << squeeze;
     ans << YAML::Key << "trim_uncalled_alleles" << YAML::Value << trim_uncalled_alleles;
@@ -835,9 +934,14 @@ Status genotyper_config::yaml(YAML::Emitter& ans) const {
         ans << "BCF";
     } else if (output_format == GLnexusOutputFormat::VCF) {
         ans << "VCF";
+    } else if (output_format == GLnexusOutputFormat::SPARSE) {
+        ans << "SPARSE";
     } else {
         return Status::Invalid("genotyper_config::yaml: invalid output_format");
     }
+    ans << YAML::Key << "output_compression_level" << YAML::Value << output_compression_level;
+    ans << YAML::Key << "output_threads" << YAML::Value << output_threads;
+    ans << YAML::Key << "output_index" << YAML::Value << output_index;
 
     ans << YAML::Key <<  "liftover_fields";
     ans << YAML::Value << YAML::BeginSeq;
@@ -914,6 +1018,19 @@ Status genotyper_config::of_yaml(const YAML::Node& yaml, genotyper_config& ans)
         ans.output_residuals = n_output_residuals.as<bool>();
     }
 
+    const auto n_residuals_format = yaml["residuals_format"];
+    if (n_residuals_format) {
+        V(n_residuals_format.IsScalar(), "invalid residuals_format");
+        string s_residuals_format = n_residuals_format.Scalar();
+        if (s_residuals_format == "YAML") {
+            ans.residuals_format = GLnexusResidualsFormat::YAML;
+        } else if (s_residuals_format == "BINARY") {
+            ans.residuals_format = GLnexusResidualsFormat::BINARY;
+        } else {
+            return Status::Invalid("genotyper_config::of_yaml: invalid residuals_format. Must be one of {YAML, BINARY}.");
+        }
+    }
+
     const auto n_more_PL = yaml["more_PL"];
     if (n_more_PL) {
         V(n_more_PL.IsScalar(), "invalid more_PL");
@@ -947,11 +1064,33 @@ Status genotyper_config::of_yaml(const YAML::Node& yaml, genotyper_config& ans)
             ans.output_format = GLnexusOutputFormat::BCF;
         } else if (s_output_format == "VCF") {
             ans.output_format = GLnexusOutputFormat::VCF;
+        } else if (s_output_format == "SPARSE") {
+            ans.output_format = GLnexusOutputFormat::SPARSE;
         } else {
-            return Status::Invalid("genotyper_config::of_yaml: invalid output_format. Must be one of {BCF, VCF}.");
+            return Status::Invalid("genotyper_config::of_yaml: invalid output_format. Must be one of {BCF, VCF, SPARSE}.");
         }
     }
 
+    const auto n_output_compression_level = yaml["output_compression_level"];
+    if (n_output_compression_level) {
+        V(n_output_compression_level.IsScalar(), "invalid output_compression_level");
+        ans.output_compression_level = n_output_compression_level.as<int>();
+        V(ans.output_compression_level >= -1 && ans.output_compression_level <= 9,
+          "invalid output_compression_level");
+    }
+
+    const auto n_output_threads = yaml["output_threads"];
+    if (n_output_threads) {
+        V(n_output_threads.IsScalar() && n_output_threads.as<int>() >= 0, "invalid output_threads");
+        ans.output_threads = n_output_threads.as<int>();
+    }
+
+    const auto n_output_index = yaml["output_index"];
+    if (n_output_index) {
+        V(n_output_index.IsScalar(), "invalid output_index");
+        ans.output_index = n_output_index.as<bool>();
+    }
+
     const auto n_liftover_fields = yaml["liftover_fields"];
     if (n_liftover_fields) {
         V(n_liftover_fields.IsSequence(), "invalid liftover_fields");
@@ -979,4 +1118,71 @@ bool is_gvcf_ref_record(const bcf1_t* record) {
     return record->n_allele == 1 || (record->n_allele == 2 && is_symbolic_allele(record->d.allele[1]));
 }
 
+// Each thread's free list of records for bcf_init_pooled, bounded by the
+// bytes retained: the record buffers and the unpacking buffers which
+// bcf_clear keeps. A record released once the thread's free list has been
+// destroyed (during thread exit) is just freed.
+static thread_local int bcf_pool_state = 0; // 0 = not yet constructed, 1 = live, 2 = destroyed
+struct bcf_pool {
+    vector<bcf1_t*> free;
+    size_t bytes = 0;
+    bcf_pool() { bcf_pool_state = 1; }
+    ~bcf_pool() {
+        bcf_pool_state = 2;
+        for (auto v : free) {
+            bcf_destroy(v);
+        }
+    }
+};
+static thread_local bcf_pool bcf_pool_tl;
+
+// Memory retained by a cleared bcf1_t
+static size_t bcf_retained_bytes(const bcf1_t* v) {
+    return sizeof(bcf1_t) + v->shared.m + v->indiv.m
+           + v->d.m_fmt*sizeof(bcf_fmt_t) + v->d.m_info*sizeof(bcf_info_t)
+           + v->d.m_id + v->d.m_als + v->d.m_allele*sizeof(char*)
+           + v->d.m_flt*sizeof(int) + v->d.n_var*sizeof(variant_t);
+}
+
+static void bcf_release_pooled(bcf1_t* v) {
+    if (v && bcf_pool_state != 2) {
+        auto& pool = bcf_pool_tl;
+        bcf_clear(v);
+        size_t bytes = bcf_retained_bytes(v);
+        if (pool.bytes + bytes <= BCF_POOL_MAX_BYTES) {
+            pool.free.push_back(v);
+            pool.bytes += bytes;
+            return;
+        }
+    }
+    if (v) {
+        bcf_destroy(v);
+    }
+}
+
+shared_ptr<bcf1_t> bcf_init_pooled() {
+    bcf1_t* v = nullptr;
+    if (bcf_pool_state != 2) {
+        auto& pool = bcf_pool_tl;
+        if (!pool.free.empty()) {
+            v = pool.free.back();
+            pool.free.pop_back();
+            pool.bytes -= bcf_retained_bytes(v);
+        }
+    }
+    if (!v) {
+        v = bcf_init();
+        if (!v) {
+            throw std::bad_alloc();
+        }
+    }
+    return shared_ptr<bcf1_t>(v, &bcf_release_pooled);
+}
+
+shared_ptr<bcf1_t> bcf_dup_pooled(bcf1_t* src) {
+    auto ans = bcf_init_pooled();
+    bcf_copy(ans.get(), src);
+    return ans;
+}
+
 } // namespace GLnexus
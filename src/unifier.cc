@@ -2,6 +2,8 @@
 #include <assert.h>
 #include <math.h>
 #include "unifier.h"
+#include "perf.h"
+#include "executor.h"
 #include <iostream>
 
 using namespace std;
@@ -207,13 +209,12 @@ auto partition(discovered_or_minimized_alleles& alleles) {
     range rng(-1,-1,-1);
     discovered_or_minimized_alleles als;
 
-    for (auto pit = alleles.begin(); pit != alleles.end(); alleles.erase(pit++)) {
-        const auto& it = *pit;
+    for (auto& it : alleles) {
         assert(rng <= it.first.pos);
         if (rng.rid != it.first.pos.rid || rng.end < it.first.pos.beg) {
             if (rng.rid != -1) {
                 assert(!als.empty());
-                ans[rng] = als;
+                ans[rng] = move(als);
             }
             rng = it.first.pos;
             als.clear();
@@ -223,12 +224,14 @@ auto partition(discovered_or_minimized_alleles& alleles) {
         assert(rng <= it.first.pos);
         rng.end = max(rng.end, it.first.pos.end);
         assert(it.first.pos.within(rng));
-        als.insert(it);
+        als.insert(move(it));
     }
 
+    alleles.clear();
+
     if (rng.rid != -1) {
         assert(!als.empty());
-        ans[rng] = als;
+        ans[rng] = move(als);
     }
 
     return ans;
@@ -597,6 +600,7 @@ Status unified_sites(const unifier_config& cfg,
                      unifier_stats& stats_out) {
     Status s;
     unifier_stats stats;
+    perf::scoped_timer timer(perf::timer::unify);
 
     /* desperate-straits debugging:
     for (const auto& allele : alleles) {
@@ -651,4 +655,71 @@ Status unified_sites(const unifier_config& cfg,
     return Status::OK();
 }
 
+// Split alleles into chunks of at least chunk_alleles (except the last),
+// cutting only between active regions, i.e. at positions which no allele
+// spans or abuts. The chunks are in order, each sorted.
+static void split_at_gaps(discovered_alleles& alleles, size_t chunk_alleles,
+                          vector<discovered_alleles>& chunks) {
+    chunks.clear();
+    range rng(-1,-1,-1);
+    for (auto& it : alleles) {
+        // as in partition
+        if (rng.rid != it.first.pos.rid || rng.end < it.first.pos.beg) {
+            if (chunks.empty() || chunks.back().size() >= chunk_alleles) {
+                chunks.emplace_back();
+            }
+            rng = it.first.pos;
+        }
+        rng.end = max(rng.end, it.first.pos.end);
+        chunks.back().push_back_sorted(move(it));
+    }
+    alleles.clear();
+}
+
+Status unified_sites(const unifier_config& cfg,
+                     unsigned N, discovered_alleles& alleles,
+                     vector<unified_site>& ans,
+                     unifier_stats& stats_out,
+                     executor& pool, size_t chunk_alleles) {
+    Status s;
+    vector<discovered_alleles> chunks;
+    split_at_gaps(alleles, max(chunk_alleles, (size_t) 1), chunks);
+
+    // Each chunk comprises whole active regions, which unified_sites treats
+    // independently, and its sites (including any monoallelic ones) lie
+    // within the chunk's extent, which precedes the next chunk's. So the
+    // in-order concatenation of the chunks' results is the same as the
+    // result for all the alleles at once.
+    vector<vector<unified_site>> chunk_sites(chunks.size());
+    vector<unifier_stats> chunk_stats(chunks.size());
+    vector<future<Status>> statuses;
+    task_group group(pool);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        statuses.push_back(group.push([&, i]() {
+            return unified_sites(cfg, N, chunks[i], chunk_sites[i], chunk_stats[i]);
+        }));
+    }
+
+    // record the first error, if any, but always wait for all the chunks
+    unifier_stats stats;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        Status s_i(group.get(statuses[i]));
+        if (s.ok() && s_i.bad()) {
+            s = move(s_i);
+        }
+        if (s.ok()) {
+            ans.insert(ans.end(), make_move_iterator(chunk_sites[i].begin()),
+                                  make_move_iterator(chunk_sites[i].end()));
+            stats += chunk_stats[i];
+        }
+        chunk_sites[i].clear();
+    }
+    if (s.bad()) {
+        return s;
+    }
+
+    stats_out = stats;
+    return Status::OK();
+}
+
 }
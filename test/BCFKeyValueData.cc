@@ -1,12 +1,25 @@
 #include <iostream>
+#include <fstream>
+#include <unistd.h>
 #include <map>
 #include <chrono>
+#include <tuple>
 #include "BCFKeyValueData.h"
 #include "BCFSerialize.h"
+#include "MmapKeyValue.h"
 #include "compare_queries.h"
 #include "catch.hpp"
 #include "ctpl_stl.h"
+#include "executor.h"
+#include "perf.h"
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <defs.capnp.h>
+#include <tbx.h>
+#include <thread_pool.h>
 using namespace std;
+
+#include "BCFKeyValueData_utils.h"
 using namespace GLnexus;
 
 // Trivial in-memory KeyValue implementation used in unit tests.
@@ -511,6 +524,20 @@ TEST_CASE("BCFKeyValueData::import_gvcf") {
         REQUIRE(version == "1");
     }
 
+    SECTION("reject reserved data set name") {
+        Status s = data->import_gvcf(*cache, "#x", "test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf", samples_imported);
+        REQUIRE(s == StatusCode::INVALID);
+
+        KeyValue::CollectionHandle coll;
+        REQUIRE(db.collection("sampleset", coll).ok());
+        string version;
+        REQUIRE(db.get(coll, "*", version).ok());
+        REQUIRE(version == "0");
+
+        s = data->import_gvcf(*cache, "x#", "test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf", samples_imported);
+        REQUIRE(s.ok());
+    }
+
     SECTION("reject duplicate sample") {
         Status s = data->import_gvcf(*cache, "y", "test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf", samples_imported);
         REQUIRE(s.ok());
@@ -604,8 +631,8 @@ TEST_CASE("BCFKeyValueData BCF retrieval") {
         REQUIRE(string(records[1]->d.allele[1]) == "<NON_REF>");
 
         // min_alleles predicate
-        bcf_predicate predicate = [](const bcf_hdr_t* hdr, bcf1_t* bcf, bool &retval) {
-            retval = (bcf->n_allele >= 3);
+        bcf_predicate predicate = [](const bcf_hdr_t* hdr, const bcf_raw_view& rec, bool &retval) {
+            retval = (rec.n_allele() >= 3);
             return Status::OK();
         };
         s = data->dataset_range("NA12878D", hdr.get(), range(0, 0, 1000000000), predicate, &records);
@@ -618,6 +645,36 @@ TEST_CASE("BCFKeyValueData BCF retrieval") {
         REQUIRE(string(records[0]->d.allele[1]) == "T");
         REQUIRE(string(records[0]->d.allele[2]) == "<NON_REF>");
 
+        // field selection
+        bcf_field_selection fields;
+        fields.info = {"DP"};
+        fields.format = {"GT", "DP", "bogus"};
+        s = data->dataset_range("NA12878D", hdr.get(), range(0, 0, 1000000000), nullptr, &records, &fields);
+        REQUIRE(s.ok());
+        REQUIRE(records.size() == 5);
+        REQUIRE(records[1]->pos == 10009463);
+        REQUIRE(records[1]->rlen == 2);
+        REQUIRE(records[1]->n_allele == 3);
+        REQUIRE(string(records[1]->d.allele[0]) == "TA");
+        REQUIRE(records[1]->n_info == 1);
+        REQUIRE(bcf_get_info(hdr.get(), records[1].get(), "DP")->v1.i == 12);
+        REQUIRE(bcf_get_info(hdr.get(), records[1].get(), "MQ") == nullptr);
+        REQUIRE(records[1]->n_fmt == 2);
+        htsvecbox<int32_t> v;
+        REQUIRE(bcf_get_genotypes(hdr.get(), records[1].get(), &v.v, &v.capacity) == 2);
+        REQUIRE(bcf_gt_allele(v[0]) == 0);
+        REQUIRE(bcf_gt_allele(v[1]) == 1);
+        REQUIRE(bcf_get_format_int32(hdr.get(), records[1].get(), "DP", &v.v, &v.capacity) == 1);
+        REQUIRE(v[0] == 12);
+        REQUIRE(bcf_get_format_int32(hdr.get(), records[1].get(), "AD", &v.v, &v.capacity) < 0);
+        REQUIRE(records[4]->pos == 10009468);
+        REQUIRE(records[4]->rlen == 3);
+        REQUIRE(records[4]->n_info == 0);
+        REQUIRE(records[4]->n_fmt == 2);
+        REQUIRE(bcf_get_format_int32(hdr.get(), records[4].get(), "DP", &v.v, &v.capacity) == 1);
+        REQUIRE(v[0] == 13);
+        REQUIRE(bcf_get_format_int32(hdr.get(), records[4].get(), "PL", &v.v, &v.capacity) < 0);
+
         // empty results
         s = data->dataset_range("NA12878D", hdr.get(), range(0, 0, 1000), nullptr, &records);
         REQUIRE((records.size() == 0));
@@ -633,9 +690,313 @@ TEST_CASE("BCFKeyValueData BCF retrieval") {
     }
 }
 
+TEST_CASE("BCFKeyValueData reference band compaction") {
+    // (bucket size, compact_ref_bands, ref_band_gq_tolerance); with buckets
+    // of size 5004734 there's a boundary at 10009468, between the last two
+    // reference bands
+    vector<tuple<size_t,bool,int>> configs = {
+        make_tuple(30000, false, 5), make_tuple(30000, true, 5), make_tuple(30000, true, 99),
+        make_tuple(5004734, true, 5)
+    };
+
+    for (const auto& config : configs) {
+        size_t interval_len = get<0>(config);
+        KeyValueMem::DB db({});
+        auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+        REQUIRE(T::InitializeDB(&db, contigs, interval_len).ok());
+        unique_ptr<T> data;
+        REQUIRE(T::Open(&db, data).ok());
+        unique_ptr<MetadataCache> cache;
+        REQUIRE(MetadataCache::Start(*data, cache).ok());
+
+        T::import_options opts;
+        opts.compact_ref_bands = get<1>(config);
+        opts.ref_band_gq_tolerance = get<2>(config);
+        T::import_result rslt;
+        Status s = data->import_gvcf(*cache, "NA12878D", "test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf",
+                                     {}, rslt, opts);
+        REQUIRE(s.ok());
+
+        shared_ptr<const bcf_hdr_t> hdr;
+        REQUIRE(data->dataset_header("NA12878D", &hdr).ok());
+        vector<shared_ptr<bcf1_t>> records;
+        REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 0, 1000000000), nullptr, &records).ok());
+        REQUIRE(rslt.compacted_records + records.size() == 5);
+
+        // the variant record, and the bands either side of it, are unaffected
+        REQUIRE(records.size() >= 3);
+        REQUIRE(records[0]->pos == 10009461);
+        REQUIRE(records[0]->rlen == 2);
+        REQUIRE(records[1]->pos == 10009463);
+        REQUIRE(records[1]->n_allele == 3);
+        REQUIRE(records[2]->pos == 10009465);
+
+        htsvecbox<int32_t> v;
+        auto fmt = [&](shared_ptr<bcf1_t>& rec, const char* key) {
+            int n = bcf_get_format_int32(hdr.get(), rec.get(), key, &v.v, &v.capacity);
+            vector<int32_t> ans;
+            for (int i = 0; i < n; i++) {
+                ans.push_back(v[i]);
+            }
+            return ans;
+        };
+
+        if (!opts.compact_ref_bands || interval_len != 30000) {
+            REQUIRE(rslt.compacted_records == 0);
+            REQUIRE(records.size() == 5);
+            REQUIRE(records[3]->pos == 10009466);
+            REQUIRE(records[3]->rlen == 2);
+            REQUIRE(records[4]->pos == 10009468);
+            REQUIRE(records[4]->rlen == 3);
+        } else if (opts.ref_band_gq_tolerance == 5) {
+            // GQ 36 & 39 merged, but not GQ 0
+            REQUIRE(rslt.compacted_records == 1);
+            REQUIRE(records.size() == 4);
+            REQUIRE(records[2]->rlen == 1);
+            REQUIRE(fmt(records[2], "GQ") == vector<int32_t>({0}));
+
+            REQUIRE(records[3]->pos == 10009466);
+            REQUIRE(records[3]->rlen == 5);
+            REQUIRE(bcf_get_info(hdr.get(), records[3].get(), "END")->v1.i == 10009471);
+            REQUIRE(is_gvcf_ref_record(records[3].get()));
+            REQUIRE(fmt(records[3], "GQ") == vector<int32_t>({36}));
+            REQUIRE(fmt(records[3], "DP") == vector<int32_t>({12}));
+            REQUIRE(fmt(records[3], "MIN_DP") == vector<int32_t>({12}));
+            REQUIRE(fmt(records[3], "PL") == vector<int32_t>({0, 36, 410}));
+            htsvecbox<int> gt;
+            REQUIRE(bcf_get_genotypes(hdr.get(), records[3].get(), &gt.v, &gt.capacity) == 2);
+            REQUIRE(bcf_gt_allele(gt[0]) == 0);
+            REQUIRE(bcf_gt_allele(gt[1]) == 0);
+        } else {
+            // all three trailing bands merged
+            REQUIRE(rslt.compacted_records == 2);
+            REQUIRE(records.size() == 3);
+            REQUIRE(records[2]->rlen == 6);
+            REQUIRE(bcf_get_info(hdr.get(), records[2].get(), "END")->v1.i == 10009471);
+            REQUIRE(fmt(records[2], "GQ") == vector<int32_t>({0}));
+            REQUIRE(fmt(records[2], "DP") == vector<int32_t>({12}));
+            REQUIRE(fmt(records[2], "MIN_DP") == vector<int32_t>({12}));
+            REQUIRE(fmt(records[2], "PL") == vector<int32_t>({0, 0, 342}));
+        }
+
+        // range queries see the merged band
+        REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 10009469, 10009470), nullptr, &records).ok());
+        REQUIRE(records.size() == 1);
+        REQUIRE(is_gvcf_ref_record(records[0].get()));
+    }
+}
+
+TEST_CASE("BCFKeyValueData bucket format versions") {
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    // small buckets, so the records are spread across several
+    REQUIRE(T::InitializeDB(&db, contigs, 3).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    Status s = data->import_gvcf(*cache, "NA12878D", "test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf", samples_imported);
+    REQUIRE(s.ok());
+    shared_ptr<const bcf_hdr_t> hdr;
+    REQUIRE(data->dataset_header("NA12878D", &hdr).ok());
+
+    bcf_predicate predicate = [](const bcf_hdr_t* hdr, const bcf_raw_view& rec, bool &retval) {
+        Status s;
+        bool is_ref = true;
+        S(rec.is_gvcf_ref_record(is_ref));
+        retval = !is_ref;
+        return Status::OK();
+    };
+    vector<shared_ptr<bcf1_t>> all_records, variant_records, gt_dp_records;
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 0, 1000000000), nullptr, &all_records).ok());
+    REQUIRE(all_records.size() == 5);
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 0, 1000000000), predicate, &variant_records).ok());
+    REQUIRE(variant_records.size() == 1);
+    bcf_field_selection gt_dp;
+    gt_dp.format = {"GT", "DP"};
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 0, 1000000000), nullptr, &gt_dp_records, &gt_dp).ok());
+    REQUIRE(gt_dp_records.size() == 5);
+
+    htsvecbox<int32_t> v;
+    auto fmt = [&](const shared_ptr<bcf1_t>& rec, const char* key) {
+        int n = bcf_get_format_int32(hdr.get(), rec.get(), key, &v.v, &v.capacity);
+        vector<int32_t> ans;
+        for (int i = 0; i < n; i++) {
+            ans.push_back(v[i]);
+        }
+        return ans;
+    };
+    auto same_formats = [&](const shared_ptr<bcf1_t>& rec1, const shared_ptr<bcf1_t>& rec2) {
+        for (const char* key : {"GT", "GQ", "DP", "AD", "MIN_DP", "PL", "SB"}) {
+            if (fmt(rec1, key) != fmt(rec2, key)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    for (int i = 0; i < all_records.size(); i++) {
+        REQUIRE(gt_dp_records[i]->n_fmt == 2);
+        REQUIRE(fmt(gt_dp_records[i], "GT") == fmt(all_records[i], "GT"));
+        REQUIRE(fmt(gt_dp_records[i], "DP") == fmt(all_records[i], "DP"));
+        REQUIRE(fmt(gt_dp_records[i], "GQ").empty());
+        REQUIRE(!fmt(all_records[i], "GQ").empty());
+    }
+
+    // the imported buckets have columns of the record ranges and types, and
+    // of the integer FORMAT fields split out of the records; rewrite each of
+    // them in the original format, without
+    KeyValue::CollectionHandle coll;
+    REQUIRE(db.collection("bcf", coll).ok());
+    unique_ptr<KeyValue::Iterator> it;
+    REQUIRE(db.iterator(coll, "", it).ok());
+    vector<pair<string,string>> legacy_buckets;
+    size_t n_records = 0;
+    while (it->valid()) {
+        auto value = it->value();
+        ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)value.data, value.size / sizeof(::capnp::word)));
+        auto bucket = message.getRoot<capnp::BCFBucket>();
+        REQUIRE(bucket.getVersion() == 2);
+        auto records = bucket.getRecords();
+        auto columns = bucket.getColumns();
+        REQUIRE(columns.getBegs().size() == records.size());
+        REQUIRE(columns.getEnds().size() == records.size());
+        REQUIRE(columns.getVariant().size() == records.size());
+        REQUIRE(columns.getFormats().size() > 0);
+        for (auto col : columns.getFormats()) {
+            REQUIRE(bcf_hdr_id2type(hdr.get(), BCF_HL_FMT, col.getKey()) == BCF_HT_INT);
+            REQUIRE(col.getRecords().size() == col.getPositions().size());
+            REQUIRE(col.getRecords().size() == col.getTypes().size());
+            REQUIRE(col.getRecords().size() == col.getWidths().size());
+            REQUIRE(col.getRecords().size() == col.getOffsets().size());
+        }
+        BCFBucketFormatColumns format_columns;
+        REQUIRE(format_columns.Init(bucket).ok());
+        REQUIRE(!format_columns.empty());
+
+        ::capnp::MallocMessageBuilder b;
+        auto legacy = b.initRoot<capnp::BCFBucket>();
+        auto legacy_records = legacy.initRecords(records.size());
+        vector<vector<uint8_t>> spliced(records.size());
+        for (int i = 0; i < records.size(); i++) {
+            range rng(-1,-1,-1);
+            REQUIRE(bcf_raw_range(records[i].begin(), 0, records[i].size(), rng).ok());
+            REQUIRE(columns.getBegs()[i] == rng.beg);
+            REQUIRE(columns.getEnds()[i] == rng.end);
+            REQUIRE(columns.getVariant()[i] == (rng.beg == 10009463));
+
+            // the stored records lack the columnar fields, GT among them
+            bcf_raw_view view;
+            int reclen = 0;
+            REQUIRE(bcf_raw_view::of_mem(records[i].begin(), 0, records[i].size(), view, reclen).ok());
+            int type, n;
+            const uint8_t *data;
+            REQUIRE(view.format(bcf_hdr_id2int(hdr.get(), BCF_DT_ID, "GT"), type, n, data) == StatusCode::NOT_FOUND);
+
+            REQUIRE(format_columns.read(i, records[i].begin(), records[i].size(), nullptr, spliced[i]).ok());
+            REQUIRE(spliced[i].size() > records[i].size());
+            legacy_records.set(i, kj::arrayPtr((kj::byte*) spliced[i].data(), spliced[i].size()));
+        }
+        n_records += records.size();
+
+        legacy.setSkips(bucket.getSkips());
+        auto words = ::capnp::messageToFlatArray(b);
+        auto bytes = words.asBytes();
+        legacy_buckets.push_back(make_pair(it->key().str(), string((char*)bytes.begin(), bytes.size())));
+        REQUIRE(it->next().ok());
+    }
+    REQUIRE(n_records > all_records.size()); // records spanning buckets are duplicated
+    for (const auto& p : legacy_buckets) {
+        REQUIRE(db.put(coll, p.first, p.second).ok());
+    }
+
+    // results from the original format are identical
+    REQUIRE(T::Open(&db, data).ok());
+    vector<shared_ptr<bcf1_t>> records;
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 0, 1000000000), nullptr, &records).ok());
+    REQUIRE(records.size() == all_records.size());
+    for (int i = 0; i < records.size(); i++) {
+        REQUIRE(bcf_shallow_compare(records[i].get(), all_records[i].get()));
+        REQUIRE(same_formats(records[i], all_records[i]));
+    }
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 0, 1000000000), predicate, &records).ok());
+    REQUIRE(records.size() == 1);
+    REQUIRE(bcf_shallow_compare(records[0].get(), variant_records[0].get()));
+    REQUIRE(same_formats(records[0], variant_records[0]));
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 0, 1000000000), nullptr, &records, &gt_dp).ok());
+    REQUIRE(records.size() == gt_dp_records.size());
+    for (int i = 0; i < records.size(); i++) {
+        REQUIRE(bcf_shallow_compare(records[i].get(), gt_dp_records[i].get()));
+        REQUIRE(same_formats(records[i], gt_dp_records[i]));
+    }
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 10009463, 10009466), nullptr, &records).ok());
+    REQUIRE(records.size() == 2);
+}
+
 // Test subtle cases of record search. The terminology is, search for range X,
 // where the records in the database are {A1, A2, ..} for dataset A.
 //
+TEST_CASE("BCFKeyValueData variant record index") {
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    // small buckets, so that the variant record spans two of them
+    REQUIRE(T::InitializeDB(&db, contigs, 3).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    Status s = data->import_gvcf(*cache, "NA12878D", "test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf", samples_imported);
+    REQUIRE(s.ok());
+    shared_ptr<const bcf_hdr_t> hdr;
+    REQUIRE(data->dataset_header("NA12878D", &hdr).ok());
+
+    // the index holds just the buckets with the variant record
+    KeyValue::CollectionHandle coll;
+    REQUIRE(db.collection("bcf_variants", coll).ok());
+    unique_ptr<KeyValue::Iterator> it;
+    REQUIRE(db.iterator(coll, "", it).ok());
+    size_t n_buckets = 0;
+    while (it->valid()) {
+        auto value = it->value();
+        ::capnp::UnalignedFlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)value.data, value.size / sizeof(::capnp::word)));
+        auto bucket = message.getRoot<capnp::BCFBucket>();
+        REQUIRE(bucket.getRecords().size() == 1);
+        REQUIRE(bucket.getColumns().getBegs()[0] == 10009463);
+        REQUIRE(bucket.getColumns().getVariant()[0]);
+        n_buckets++;
+        REQUIRE(it->next().ok());
+    }
+    REQUIRE(n_buckets == 2);
+
+    // queries for variant records are served from the index, with the same
+    // results as otherwise
+    bcf_predicate predicate = [](const bcf_hdr_t* hdr, const bcf_raw_view& rec, bool &retval) {
+        Status s;
+        bool is_ref = true;
+        S(rec.is_gvcf_ref_record(is_ref));
+        retval = !is_ref;
+        return Status::OK();
+    };
+    vector<range> queries = { range(0, 0, 1000000000), range(0, 10009463, 10009464),
+                              range(0, 10009464, 10009465), range(0, 10009465, 10009470) };
+    for (const auto& q : queries) {
+        vector<shared_ptr<bcf1_t>> records1, records2;
+        REQUIRE(data->dataset_range("NA12878D", hdr.get(), q, predicate, &records1).ok());
+        REQUIRE(data->dataset_range("NA12878D", hdr.get(), q, bcf_variant_predicate, &records2).ok());
+        REQUIRE(records1.size() == records2.size());
+        for (size_t i = 0; i < records1.size(); i++) {
+            REQUIRE(*bcf1_to_string(hdr.get(), records1[i].get()) ==
+                    *bcf1_to_string(hdr.get(), records2[i].get()));
+        }
+
+        bool has_variants = false;
+        REQUIRE(data->dataset_has_variants("NA12878D", hdr.get(), q, has_variants).ok());
+        REQUIRE(has_variants == !records1.empty());
+        REQUIRE(has_variants == (q.beg < 10009465));
+    }
+}
+
 TEST_CASE("BCFKeyValueData range overlap with a single dataset") {
     std::vector<int> intervals = {9, 11, 13, 10000};
 
@@ -702,6 +1063,515 @@ TEST_CASE("BCFKeyValueData range overlap with a single dataset") {
     }
 }
 
+TEST_CASE("BCFKeyValueData per-contig bucket lengths") {
+    auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    vector<vector<shared_ptr<bcf1_t>>> results;
+    vector<uint64_t> buckets;
+    // uniform buckets of 11bp, then the same specified for contig 21 alone
+    for (bool per_contig : {false, true}) {
+        KeyValueMem::DB db({});
+        if (per_contig) {
+            REQUIRE(T::InitializeDB(&db, contigs, 30000, {11}).ok());
+        } else {
+            REQUIRE(T::InitializeDB(&db, contigs, 11).ok());
+        }
+        unique_ptr<T> data;
+        REQUIRE(T::Open(&db, data).ok());
+        unique_ptr<MetadataCache> cache;
+        REQUIRE(MetadataCache::Start(*data, cache).ok());
+        T::import_result rslt;
+        REQUIRE(data->import_gvcf(*cache, "synth_A", "test/data/synthetic_A.21.gvcf", {}, rslt).ok());
+        buckets.push_back(rslt.buckets);
+
+        // reopen, reading the bucket lengths back
+        cache.reset();
+        data.reset();
+        REQUIRE(T::Open(&db, data).ok());
+        shared_ptr<const bcf_hdr_t> hdr;
+        REQUIRE(data->dataset_header("synth_A", &hdr).ok());
+        vector<shared_ptr<bcf1_t>> records;
+        REQUIRE(data->dataset_range("synth_A", hdr.get(), range(0, 2003, 3006), nullptr, &records).ok());
+        REQUIRE(records.size() > 0);
+        results.push_back(records);
+    }
+    REQUIRE(buckets[0] > 1);
+    REQUIRE(buckets[0] == buckets[1]);
+    REQUIRE(results[0].size() == results[1].size());
+
+    // invalid specifications
+    KeyValueMem::DB db({});
+    REQUIRE(T::InitializeDB(&db, contigs, 30000, {11, 11}) == StatusCode::INVALID);
+    REQUIRE(T::InitializeDB(&db, contigs, 30000, {0}) == StatusCode::INVALID);
+}
+
+TEST_CASE("BCFKeyValueData sample tiles") {
+    auto contigs = {make_pair<string,uint64_t>("A", 1000000),
+                    make_pair<string,uint64_t>("B", 1000000),
+                    make_pair<string,uint64_t>("C", 1000000)};
+    KeyValueMem::DB db({});
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+
+    T::import_result rslt;
+    T::import_options opts;
+    opts.sample_tile_size = 2;
+    REQUIRE(data->import_gvcf(*cache, "trio1", "test/data/discover_alleles_trio1.vcf", {}, rslt, opts).ok());
+    REQUIRE(rslt.samples == (set<string>({"trio1.fa", "trio1.mo", "trio1.ch"})));
+
+    // the import statistics count each gVCF record once, and the buckets of
+    // every tile
+    {
+        KeyValueMem::DB db2({});
+        REQUIRE(T::InitializeDB(&db2, contigs).ok());
+        unique_ptr<T> data2;
+        REQUIRE(T::Open(&db2, data2).ok());
+        unique_ptr<MetadataCache> cache2;
+        REQUIRE(MetadataCache::Start(*data2, cache2).ok());
+        T::import_result untiled;
+        REQUIRE(data2->import_gvcf(*cache2, "trio1", "test/data/discover_alleles_trio1.vcf", {}, untiled).ok());
+        REQUIRE(untiled.records > 0);
+        REQUIRE(rslt.records == untiled.records);
+        REQUIRE(rslt.max_records == untiled.max_records);
+        REQUIRE(rslt.duplicate_records == untiled.duplicate_records);
+        REQUIRE(rslt.skipped_records == untiled.skipped_records);
+        REQUIRE(rslt.compacted_records == untiled.compacted_records);
+        REQUIRE(rslt.buckets == 2*untiled.buckets);
+        REQUIRE(rslt.bytes > 0);
+    }
+
+    // the samples are divided among the tiles in header column order
+    string dataset;
+    REQUIRE(cache->sample_dataset("trio1.fa", dataset).ok());
+    REQUIRE(dataset == "trio1.tile0");
+    REQUIRE(cache->sample_dataset("trio1.mo", dataset).ok());
+    REQUIRE(dataset == "trio1.tile0");
+    REQUIRE(cache->sample_dataset("trio1.ch", dataset).ok());
+    REQUIRE(dataset == "trio1.tile1");
+
+    shared_ptr<const bcf_hdr_t> hdr;
+    REQUIRE(data->dataset_header("trio1", &hdr) == StatusCode::NOT_FOUND);
+    size_t n_records = 0;
+    for (const auto& tile : {make_pair("trio1.tile0", 2), make_pair("trio1.tile1", 1)}) {
+        REQUIRE(data->dataset_header(tile.first, &hdr).ok());
+        REQUIRE(bcf_hdr_nsamples(hdr.get()) == tile.second);
+        vector<shared_ptr<bcf1_t>> records;
+        REQUIRE(data->dataset_range(tile.first, hdr.get(), range(0, 0, 1000000), nullptr, &records).ok());
+        REQUIRE(records.size() > 0);
+        for (const auto& rec : records) {
+            REQUIRE(rec->n_sample == tile.second);
+            REQUIRE(bcf_unpack(rec.get(), BCF_UN_ALL) == 0);
+        }
+        if (n_records) {
+            REQUIRE(records.size() == n_records);
+        }
+        n_records = records.size();
+    }
+
+    // a sample set drawn from one tile reads only that tile
+    REQUIRE(data->new_sampleset(*cache, "ch", set<string>{"trio1.ch"}).ok());
+    shared_ptr<const set<string>> samples, datasets;
+    vector<unique_ptr<RangeBCFIterator>> iterators;
+    REQUIRE(data->sampleset_range(*cache, "ch", range(0, 0, 1000000), nullptr,
+                                  samples, datasets, iterators).ok());
+    REQUIRE(*datasets == set<string>{"trio1.tile1"});
+
+    // the tile names are taken
+    T::import_result rslt2;
+    REQUIRE(data->import_gvcf(*cache, "trio1.tile1", "test/data/discover_alleles_trio2.vcf", {}, rslt2)
+            == StatusCode::EXISTS);
+}
+
+TEST_CASE("BCFKeyValueData shared headers") {
+    auto contigs = {make_pair<string,uint64_t>("A", 1000000),
+                    make_pair<string,uint64_t>("B", 1000000),
+                    make_pair<string,uint64_t>("C", 1000000)};
+    KeyValueMem::DB db({});
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+
+    // the trio gVCFs' headers differ only in their samples
+    T::import_result rslt;
+    T::import_options opts;
+    opts.sample_tile_size = 2;
+    REQUIRE(data->import_gvcf(*cache, "trio1", "test/data/discover_alleles_trio1.vcf", {}, rslt, opts).ok());
+    REQUIRE(data->import_gvcf(*cache, "trio2", "test/data/discover_alleles_trio2.vcf", {}, rslt).ok());
+
+    // one template is stored for the three data sets
+    KeyValue::CollectionHandle coll;
+    REQUIRE(db.collection("header", coll).ok());
+    unique_ptr<KeyValue::Iterator> it;
+    REQUIRE(db.iterator(coll, "", it).ok());
+    vector<string> keys;
+    for (; it->valid(); REQUIRE(it->next().ok())) {
+        keys.push_back(it->key().str());
+    }
+    REQUIRE(keys.size() == 4);
+    REQUIRE(keys[0][0] == '#');
+    REQUIRE(keys[1] == "trio1.tile0");
+    string tmpl;
+    REQUIRE(db.get(coll, keys[0], tmpl).ok());
+    REQUIRE(tmpl.find("\tINFO\n") != string::npos);
+    REQUIRE(tmpl.find("trio1") == string::npos);
+
+    // the headers are as in the gVCF, and share the template's dictionaries
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open("test/data/discover_alleles_trio2.vcf", "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    REQUIRE(vcf);
+    shared_ptr<bcf_hdr_t> vcf_hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    REQUIRE(vcf_hdr);
+    shared_ptr<const bcf_hdr_t> hdr, hdr0, hdr1;
+    REQUIRE(data->dataset_header("trio2", &hdr).ok());
+    REQUIRE(bcf_write_header(hdr.get()) == bcf_write_header(vcf_hdr.get()));
+    REQUIRE(data->dataset_header("trio1.tile0", &hdr0).ok());
+    REQUIRE(data->dataset_header("trio1.tile1", &hdr1).ok());
+    REQUIRE(bcf_hdr_nsamples(hdr0.get()) == 2);
+    REQUIRE(string(hdr0->samples[1]) == "trio1.mo");
+    REQUIRE(bcf_hdr_nsamples(hdr1.get()) == 1);
+    REQUIRE(string(hdr1->samples[0]) == "trio1.ch");
+    REQUIRE(hdr0->id[BCF_DT_ID] == hdr->id[BCF_DT_ID]);
+    REQUIRE(hdr1->id[BCF_DT_CTG] == hdr->id[BCF_DT_CTG]);
+    REQUIRE(bcf_hdr_id2int(hdr1.get(), BCF_DT_SAMPLE, "trio1.ch") == 0);
+    REQUIRE(bcf_hdr_id2int(hdr1.get(), BCF_DT_SAMPLE, "trio2.ch") < 0);
+    shared_ptr<bcf_hdr_t> dup(bcf_hdr_dup(hdr0.get()), &bcf_hdr_destroy);
+    REQUIRE(bcf_write_header(dup.get()) == bcf_write_header(hdr0.get()));
+
+    // the records read through them, with or without a field selection
+    bcf_field_selection fields;
+    fields.format = {"GT", "bogus"};
+    for (const bcf_field_selection* sel : vector<const bcf_field_selection*>{nullptr, &fields}) {
+        vector<shared_ptr<bcf1_t>> records;
+        REQUIRE(data->dataset_range("trio2", hdr.get(), range(0, 0, 1000000), nullptr, &records, sel).ok());
+        REQUIRE(records.size() > 0);
+        REQUIRE(records[0]->n_sample == 3);
+        REQUIRE(records[0]->n_fmt == 1);
+        htsvecbox<int32_t> gt;
+        REQUIRE(bcf_get_genotypes(hdr.get(), records[0].get(), &gt.v, &gt.capacity) == 6);
+        REQUIRE(data->dataset_range("trio1.tile1", hdr1.get(), range(0, 0, 1000000), nullptr, &records, sel).ok());
+        REQUIRE(records[0]->n_sample == 1);
+    }
+
+    // a full header stored by an older version is still read
+    unique_ptr<KeyValue::WriteBatch> wb;
+    REQUIRE(db.begin_writes(wb).ok());
+    REQUIRE(wb->put(coll, "trio2", bcf_write_header(vcf_hdr.get())).ok());
+    REQUIRE(wb->commit().ok());
+    cache.reset();
+    data.reset();
+    REQUIRE(T::Open(&db, data).ok());
+    REQUIRE(data->dataset_header("trio2", &hdr).ok());
+    REQUIRE(bcf_write_header(hdr.get()) == bcf_write_header(vcf_hdr.get()));
+    REQUIRE(hdr->id[BCF_DT_ID] != hdr0->id[BCF_DT_ID]);
+    vector<shared_ptr<bcf1_t>> records;
+    REQUIRE(data->dataset_range("trio2", hdr.get(), range(0, 0, 1000000), nullptr, &records, &fields).ok());
+    REQUIRE(records.size() > 0);
+    REQUIRE(records[0]->n_fmt == 1);
+}
+
+TEST_CASE("BCFKeyValueData ID dictionary") {
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("A", 1000000),
+                    make_pair<string,uint64_t>("B", 1000000),
+                    make_pair<string,uint64_t>("C", 1000000)};
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+
+    // import in reverse name order, so that the ID order differs
+    T::import_result rslt;
+    REQUIRE(data->import_gvcf(*cache, "trio2", "test/data/discover_alleles_trio2.vcf", {}, rslt).ok());
+    REQUIRE(data->import_gvcf(*cache, "trio1", "test/data/discover_alleles_trio1.vcf", {}, rslt).ok());
+
+    uint32_t id;
+    string name;
+    REQUIRE(cache->dataset_id("trio2", id).ok());
+    REQUIRE(id == 0);
+    REQUIRE(cache->dataset_id("trio1", id).ok());
+    REQUIRE(id == 1);
+    REQUIRE(cache->dataset_name(1, name).ok());
+    REQUIRE(name == "trio1");
+    REQUIRE(cache->dataset_id("trio3", id) == StatusCode::NOT_FOUND);
+    REQUIRE(cache->dataset_name(2, name) == StatusCode::NOT_FOUND);
+
+    // each data set's samples get consecutive IDs, in name order
+    REQUIRE(cache->sample_id("trio2.ch", id).ok());
+    REQUIRE(id == 0);
+    REQUIRE(cache->sample_id("trio2.mo", id).ok());
+    REQUIRE(id == 2);
+    REQUIRE(cache->sample_id("trio1.ch", id).ok());
+    REQUIRE(id == 3);
+    REQUIRE(cache->sample_name(5, name).ok());
+    REQUIRE(name == "trio1.mo");
+
+    // the buckets are keyed by data set ID
+    KeyValue::CollectionHandle coll;
+    REQUIRE(db.collection("bcf", coll).ok());
+    unique_ptr<KeyValue::Iterator> it;
+    REQUIRE(db.iterator(coll, "", it).ok());
+    size_t n_buckets = 0;
+    while (it->valid()) {
+        REQUIRE(it->key().size == BCFKeyValueDataPrefixLength() + 4);
+        n_buckets++;
+        REQUIRE(it->next().ok());
+    }
+    REQUIRE(n_buckets > 0);
+
+    string sampleset;
+    REQUIRE(cache->all_samples_sampleset(sampleset).ok());
+    shared_ptr<const vector<uint32_t>> sample_ids, dataset_ids;
+    REQUIRE(cache->sampleset_ids(sampleset, sample_ids, dataset_ids).ok());
+    REQUIRE(*sample_ids == vector<uint32_t>({0, 1, 2, 3, 4, 5}));
+    REQUIRE(*dataset_ids == vector<uint32_t>({0, 1}));
+
+    // range queries yield the data sets in ID order
+    shared_ptr<const set<string>> samples, datasets;
+    vector<unique_ptr<RangeBCFIterator>> iterators;
+    REQUIRE(data->sampleset_range(*cache, sampleset, range(0, 0, 1000000), nullptr,
+                                  samples, datasets, iterators).ok());
+    REQUIRE(iterators.size() > 0);
+    vector<string> order;
+    shared_ptr<const bcf_hdr_t> hdr;
+    vector<shared_ptr<bcf1_t>> records;
+    size_t n_records = 0;
+    while (iterators[0]->next(name, hdr, records).ok()) {
+        order.push_back(name);
+        n_records += records.size();
+    }
+    REQUIRE(order == vector<string>({"trio2", "trio1"}));
+    REQUIRE(n_records > 0);
+
+    // the dictionary persists
+    data.reset();
+    cache.reset();
+    REQUIRE(T::Open(&db, data).ok());
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    REQUIRE(cache->sample_name(2, name).ok());
+    REQUIRE(name == "trio2.mo");
+    REQUIRE(db.collection("dictionary", coll).ok());
+    string next;
+    REQUIRE(db.get(coll, "#datasets", next).ok());
+    REQUIRE(next == "2");
+    REQUIRE(db.get(coll, "#samples", next).ok());
+    REQUIRE(next == "6");
+}
+
+TEST_CASE("BCFKeyValueData metadata snapshot") {
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("A", 1000000),
+                    make_pair<string,uint64_t>("B", 1000000),
+                    make_pair<string,uint64_t>("C", 1000000)};
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+
+    T::import_result rslt;
+    REQUIRE(data->import_gvcf(*cache, "trio2", "test/data/discover_alleles_trio2.vcf", {}, rslt).ok());
+    REQUIRE(data->new_sampleset(*cache, "kids", {"trio2.ch"}).ok());
+    REQUIRE(data->write_metadata_snapshot().ok());
+
+    KeyValue::CollectionHandle coll;
+    REQUIRE(db.collection("config", coll).ok());
+    string snapshot;
+    REQUIRE(db.get(coll, "metadata_snapshot", snapshot).ok());
+
+    // the reopened database answers from the snapshot
+    auto reopen = [&]() {
+        cache.reset();
+        data.reset();
+        Status s = T::Open(&db, data);
+        if (s.ok()) {
+            s = MetadataCache::Start(*data, cache);
+        }
+        return s;
+    };
+    REQUIRE(reopen().ok());
+    size_t count;
+    REQUIRE(data->sample_count(count).ok());
+    REQUIRE(count == 3);
+    string sampleset, name;
+    REQUIRE(data->all_samples_sampleset(sampleset).ok());
+    REQUIRE(sampleset == "*@1");
+    shared_ptr<const set<string>> samples;
+    REQUIRE(data->sampleset_samples(sampleset, samples).ok());
+    REQUIRE(*samples == set<string>({"trio2.ch", "trio2.fa", "trio2.mo"}));
+    REQUIRE(data->sampleset_samples("kids", samples).ok());
+    REQUIRE(*samples == set<string>({"trio2.ch"}));
+    REQUIRE(data->sampleset_samples("nope", samples) == StatusCode::NOT_FOUND);
+    REQUIRE(data->sample_dataset("trio2.fa", name).ok());
+    REQUIRE(name == "trio2");
+    REQUIRE(data->sample_dataset("trio1.fa", name) == StatusCode::NOT_FOUND);
+    uint32_t id;
+    REQUIRE(data->sample_id("trio2.mo", id).ok());
+    REQUIRE(id == 2);
+    REQUIRE(data->sample_name(1, name).ok());
+    REQUIRE(name == "trio2.fa");
+    REQUIRE(data->sample_name(3, name) == StatusCode::NOT_FOUND);
+    REQUIRE(data->dataset_id("trio2", id).ok());
+    REQUIRE(id == 0);
+    REQUIRE(data->dataset_name(0, name).ok());
+    REQUIRE(name == "trio2");
+
+    // ...rather than from the collections, as we can tell by altering them
+    KeyValue::CollectionHandle coll_sample_dataset;
+    REQUIRE(db.collection("sample_dataset", coll_sample_dataset).ok());
+    REQUIRE(db.put(coll_sample_dataset, "trio2.fa", "bogus").ok());
+    REQUIRE(reopen().ok());
+    REQUIRE(data->sample_dataset("trio2.fa", name).ok());
+    REQUIRE(name == "trio2");
+    REQUIRE(db.put(coll_sample_dataset, "trio2.fa", "trio2").ok());
+
+    // sample sets created since are found in the database
+    REQUIRE(data->new_sampleset(*cache, "parents", {"trio2.fa", "trio2.mo"}).ok());
+    REQUIRE(reopen().ok());
+    REQUIRE(data->sampleset_samples("parents", samples).ok());
+    REQUIRE(samples->size() == 2);
+
+    // importing another data set makes the snapshot stale
+    REQUIRE(data->import_gvcf(*cache, "trio1", "test/data/discover_alleles_trio1.vcf", {}, rslt).ok());
+    REQUIRE(data->sample_dataset("trio1.fa", name).ok());
+    REQUIRE(name == "trio1");
+    REQUIRE(data->sample_count(count).ok());
+    REQUIRE(count == 6);
+    REQUIRE(data->all_samples_sampleset(sampleset).ok());
+    REQUIRE(sampleset == "*@2");
+    for (int pass = 0; pass < 2; pass++) {
+        // reopened with the stale snapshot, then with a fresh one
+        REQUIRE(reopen().ok());
+        REQUIRE(data->sample_count(count).ok());
+        REQUIRE(count == 6);
+        REQUIRE(data->all_samples_sampleset(sampleset).ok());
+        REQUIRE(sampleset == "*@2");
+        REQUIRE(data->sampleset_samples(sampleset, samples).ok());
+        REQUIRE(samples->size() == 6);
+        REQUIRE(data->sample_id("trio1.ch", id).ok());
+        REQUIRE(id == 3);
+        REQUIRE(data->dataset_name(1, name).ok());
+        REQUIRE(name == "trio1");
+        REQUIRE(data->sampleset_samples("kids", samples).ok());
+        REQUIRE(*samples == set<string>({"trio2.ch"}));
+        REQUIRE(data->write_metadata_snapshot().ok());
+    }
+    string snapshot2;
+    REQUIRE(db.get(coll, "metadata_snapshot", snapshot2).ok());
+    REQUIRE(snapshot2.size() > snapshot.size());
+
+    // a corrupt snapshot is detected
+    REQUIRE(db.put(coll, "metadata_snapshot", snapshot2.substr(0, snapshot2.size()-1)).ok());
+    REQUIRE(reopen() == StatusCode::INVALID);
+}
+
+TEST_CASE("BCFKeyValueData on a memory-mapped database image") {
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("A", 1000000),
+                    make_pair<string,uint64_t>("B", 1000000),
+                    make_pair<string,uint64_t>("C", 1000000)};
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    T::import_result rslt;
+    REQUIRE(data->import_gvcf(*cache, "trio1", "test/data/discover_alleles_trio1.vcf", {}, rslt).ok());
+    REQUIRE(data->import_gvcf(*cache, "trio2", "test/data/discover_alleles_trio2.vcf", {}, rslt).ok());
+    string sampleset;
+    REQUIRE(data->all_samples_sampleset(sampleset).ok());
+    REQUIRE(data->write_metadata_snapshot().ok());
+
+    const string image = "/tmp/GLnexus_unit_tests.image";
+    REQUIRE(system(("rm -f " + image).c_str()) == 0);
+    vector<string> collections = { "config", "sampleset", "sample_dataset", "header", "bcf",
+                                   "bcf_variants", "dictionary" };
+    REQUIRE(MmapKeyValue::Write(db, collections, image).ok());
+    REQUIRE(MmapKeyValue::Write(db, collections, image) == StatusCode::EXISTS);
+    REQUIRE(MmapKeyValue::IsImage(image));
+    REQUIRE(!MmapKeyValue::IsImage("test/data/discover_alleles_trio1.vcf"));
+
+    unique_ptr<KeyValue::DB> mdb;
+    REQUIRE(MmapKeyValue::Open(image, mdb).ok());
+
+    // the collections' contents are identical
+    for (const auto& collnm : collections) {
+        KeyValue::CollectionHandle coll, mcoll;
+        REQUIRE(db.collection(collnm, coll).ok());
+        REQUIRE(mdb->collection(collnm, mcoll).ok());
+        unique_ptr<KeyValue::Iterator> it, mit;
+        REQUIRE(db.iterator(coll, "", it).ok());
+        REQUIRE(mdb->iterator(mcoll, "", mit).ok());
+        while (it->valid()) {
+            REQUIRE(mit->valid());
+            REQUIRE(it->key().str() == mit->key().str());
+            REQUIRE(it->value().str() == mit->value().str());
+            string value;
+            REQUIRE(mdb->get(mcoll, it->key().str(), value).ok());
+            REQUIRE(value == it->value().str());
+            REQUIRE(it->next().ok());
+            REQUIRE(mit->next().ok());
+        }
+        REQUIRE(!mit->valid());
+    }
+
+    // queries through BCFKeyValueData agree
+    unique_ptr<T> mdata;
+    REQUIRE(T::Open(mdb.get(), mdata).ok());
+    unique_ptr<MetadataCache> mcache;
+    REQUIRE(MetadataCache::Start(*mdata, mcache).ok());
+    string msampleset;
+    REQUIRE(mdata->all_samples_sampleset(msampleset).ok());
+    REQUIRE(msampleset == sampleset);
+    shared_ptr<const set<string>> samples, msamples, datasets, mdatasets;
+    REQUIRE(cache->sampleset_datasets(sampleset, samples, datasets).ok());
+    REQUIRE(mcache->sampleset_datasets(sampleset, msamples, mdatasets).ok());
+    REQUIRE(*samples == *msamples);
+    REQUIRE(*datasets == *mdatasets);
+    size_t n = 0;
+    for (const auto& dataset : *datasets) {
+        shared_ptr<const bcf_hdr_t> hdr, mhdr;
+        REQUIRE(data->dataset_header(dataset, &hdr).ok());
+        REQUIRE(mdata->dataset_header(dataset, &mhdr).ok());
+        for (int rid = 0; rid < 3; rid++) {
+            vector<shared_ptr<bcf1_t>> records, mrecords;
+            REQUIRE(data->dataset_range(dataset, hdr.get(), range(rid, 0, 1000000), nullptr, &records).ok());
+            REQUIRE(mdata->dataset_range(dataset, mhdr.get(), range(rid, 0, 1000000), nullptr, &mrecords).ok());
+            REQUIRE(records.size() == mrecords.size());
+            for (size_t i = 0; i < records.size(); i++) {
+                REQUIRE(*bcf1_to_string(hdr.get(), records[i].get()) ==
+                        *bcf1_to_string(mhdr.get(), mrecords[i].get()));
+            }
+            n += records.size();
+        }
+    }
+    REQUIRE(n > 0);
+    vector<unique_ptr<RangeBCFIterator>> iterators;
+    REQUIRE(mdata->sampleset_range(*mcache, sampleset, range(0, 0, 1000000), nullptr,
+                                   msamples, mdatasets, iterators).ok());
+    REQUIRE(iterators.size() > 0);
+
+    // the image is immutable
+    KeyValue::CollectionHandle coll;
+    REQUIRE(mdb->collection("config", coll).ok());
+    REQUIRE(mdb->put(coll, "x", "y") == StatusCode::INVALID);
+    unique_ptr<KeyValue::WriteBatch> wb;
+    REQUIRE(mdb->begin_writes(wb) == StatusCode::INVALID);
+    REQUIRE(mdb->create_collection("x") == StatusCode::INVALID);
+
+    // a truncated image is detected
+    mcache.reset();
+    mdata.reset();
+    mdb.reset();
+    REQUIRE(truncate(image.c_str(), 1000) == 0);
+    REQUIRE(MmapKeyValue::Open(image, mdb) == StatusCode::INVALID);
+    REQUIRE(system(("rm -f " + image).c_str()) == 0);
+}
+
 // --------------------------------------------------------------------
 // Confidence intervals are VCF records that reflect identify with the
 // reference genome. Such a record could be very long, nearly the
@@ -1023,8 +1893,8 @@ TEST_CASE("BCFData::sampleset_range") {
     REQUIRE(s == StatusCode::NOT_FOUND);
 
     // min_alleles predicate
-    bcf_predicate predicate = [](const bcf_hdr_t* hdr, bcf1_t* bcf, bool &retval) {
-        retval = (bcf->n_allele >= 3);
+    bcf_predicate predicate = [](const bcf_hdr_t* hdr, const bcf_raw_view& rec, bool &retval) {
+        retval = (rec.n_allele() >= 3);
         return Status::OK();
     };
     rng = range(0, 100000, 300500);
@@ -1193,8 +2063,8 @@ TEST_CASE("BCFKeyValueData::sampleset_range") {
     REQUIRE(iterators[1]->next(dataset, hdr, records) == StatusCode::NOT_FOUND);
 
     // repeat with min_alleles predicate
-    bcf_predicate predicate = [](const bcf_hdr_t* hdr, bcf1_t* bcf, bool &retval) {
-        retval = (bcf->n_allele >= 3);
+    bcf_predicate predicate = [](const bcf_hdr_t* hdr, const bcf_raw_view& rec, bool &retval) {
+        retval = (rec.n_allele() >= 3);
         return Status::OK();
     };
     rng = range(0, 290000, 300050);
@@ -1394,6 +2264,51 @@ TEST_CASE("BCFKeyValueData compare iterator implementations") {
     case -1: break;  // Query used too much memory, continue
     }
 
+    // A sample set omitting the middle dataset, which the bucket iterators
+    // seek past
+    REQUIRE(data->new_sampleset(*cache, "outer", {"HX0001", "HX0003"}).ok());
+    rc = compare_queries::compare_query(*data, *cache, "outer", rng);
+    REQUIRE(rc == 1);
+    auto read_all = [&](bool base) {
+        shared_ptr<const set<string>> samples, datasets;
+        vector<unique_ptr<RangeBCFIterator>> iterators;
+        if (base) {
+            REQUIRE(data->sampleset_range_base(*cache, "outer", rng, nullptr,
+                                               samples, datasets, iterators).ok());
+        } else {
+            REQUIRE(data->sampleset_range(*cache, "outer", rng, nullptr,
+                                          samples, datasets, iterators).ok());
+        }
+        REQUIRE(*datasets == set<string>({"1", "3"}));
+        map<string,vector<shared_ptr<bcf1_t>>> ans;
+        for (const auto& it : iterators) {
+            string dataset;
+            shared_ptr<const bcf_hdr_t> hdr;
+            Status ls;
+            while (true) {
+                vector<shared_ptr<bcf1_t>> records;
+                ls = it->next(dataset, hdr, records);
+                if (ls.bad()) break;
+                REQUIRE(datasets->count(dataset) == 1);
+                auto& v = ans[dataset];
+                v.insert(v.end(), records.begin(), records.end());
+            }
+            REQUIRE(ls == StatusCode::NOT_FOUND);
+        }
+        return ans;
+    };
+    auto base_records = read_all(true), seek_records = read_all(false);
+    REQUIRE(base_records.size() == 2);
+    REQUIRE(seek_records.size() == base_records.size());
+    for (const auto& p : base_records) {
+        REQUIRE(p.second.size() > 0);
+        const auto& w = seek_records.at(p.first);
+        REQUIRE(w.size() == p.second.size());
+        for (size_t i = 0; i < w.size(); i++) {
+            REQUIRE(bcf_shallow_compare(p.second[i].get(), w[i].get()));
+        }
+    }
+
     //cout << "Compared " << (nIter+1) << " range queries between the two iterators" << endl;
 }
 
@@ -1494,7 +2409,7 @@ TEST_CASE("BCFKeyValueData NA12878 import and query") {
     std::shared_ptr<const std::set<std::string>> psamples, pdatasets;
     std::vector<std::unique_ptr<RangeBCFIterator>> iterators;
     s = data->sampleset_range(*cache, all_samples, range(16, 0, 83257441),
-                              [](const bcf_hdr_t*, bcf1_t*, bool &retval) { retval=true; return Status::OK(); },
+                              [](const bcf_hdr_t*, const bcf_raw_view&, bool &retval) { retval=true; return Status::OK(); },
                               psamples, pdatasets, iterators);
     REQUIRE(s.ok());
 
@@ -1574,4 +2489,373 @@ TEST_CASE("BCFKeyValueData NA12878 import and query") {
     // check scan efficiency
     auto stats = data->getRangeStats();
     REQUIRE(double(stats->nBCFRecordsInRange) / stats->nBCFRecordsRead >= 0.25);
+    REQUIRE(stats->nBucketCacheHits == 0);
+    REQUIRE(stats->nBucketCacheMisses == 0);
+
+    // repeat random queries with the decoded bucket cache, sized so that
+    // there'll be some evictions
+    unique_ptr<T> cached_data;
+    REQUIRE(T::Open(&db, cached_data, 1<<20).ok());
+    statuses.clear();
+    for (size_t i = 0; i < 2500; i++) {
+        auto fut = threadpool.push([&, i](int tid){
+            Status ls;
+            auto qrec = all_chr17[(i * 7919) % all_chr17.size()];
+            int lo = max(0, qrec->pos - int(i % 10));
+            range q(16, lo, lo + int(i % 7) + 1);
+
+            std::vector<std::shared_ptr<bcf1_t> > resultset, truthset;
+            ls = cached_data->dataset_range("NA12878", hdr.get(), q, nullptr, &resultset);
+            if (ls.bad()) {
+                return ls;
+            }
+            ls = data->dataset_range("NA12878", hdr.get(), q, nullptr, &truthset);
+            if (ls.bad()) {
+                return ls;
+            }
+            if (resultset.size() != truthset.size()) {
+                return Status::Failure("cached and uncached results had different sizes");
+            }
+            for (int j = 0; j < resultset.size(); j++) {
+                if (!bcf_shallow_compare(resultset[j].get(), truthset[j].get())) {
+                    return Status::Failure("cached and uncached results differed");
+                }
+            }
+            return Status::OK();
+        });
+        statuses.push_back(move(fut));
+    }
+    for (auto& fut : statuses) {
+        Status s_i(fut.get());
+        REQUIRE(s_i.ok());
+    }
+
+    auto cached_stats = cached_data->getRangeStats();
+    REQUIRE(cached_stats->nBucketCacheHits > 0);
+    REQUIRE(cached_stats->nBucketCacheMisses > 0);
+    REQUIRE(cached_stats->nBucketCacheEvictions > 0);
+    REQUIRE(cached_stats->nBucketCacheHits + cached_stats->nBucketCacheMisses >= 2500);
+
+    // a repeated query is served entirely from the cache
+    REQUIRE(T::Open(&db, cached_data, 64<<20).ok());
+    range q(16, 0, 1000000);
+    std::vector<std::shared_ptr<bcf1_t> > records1, records2;
+    REQUIRE(cached_data->dataset_range("NA12878", hdr.get(), q, nullptr, &records1).ok());
+    cached_stats = cached_data->getRangeStats();
+    REQUIRE(cached_stats->nBucketCacheHits == 0);
+    auto misses = cached_stats->nBucketCacheMisses;
+    auto records_read = cached_stats->nBCFRecordsRead;
+    REQUIRE(misses > 0);
+    REQUIRE(cached_data->dataset_range("NA12878", hdr.get(), q, nullptr, &records2).ok());
+    cached_stats = cached_data->getRangeStats();
+    REQUIRE(cached_stats->nBucketCacheHits == misses);
+    REQUIRE(cached_stats->nBucketCacheMisses == misses);
+    REQUIRE(cached_stats->nBCFRecordsRead == records_read);
+    REQUIRE(records1 == records2);
+
+    // with the cache partitioned between (pretend) NUMA nodes, each node's
+    // workers decode and cache the buckets for themselves. (A task directed
+    // to one node may be picked up by an idle worker on the other, so note
+    // where each query actually ran.)
+    REQUIRE(T::Open(&db, cached_data, 64<<20, 2).ok());
+    executor numa_pool(2, {{0}, {0}});
+    set<int> nodes_used;
+    for (int i = 0; i < 8; i++) {
+        int node = -1;
+        REQUIRE(numa_pool.push([&](int) {
+            node = executor::current_node();
+            std::vector<std::shared_ptr<bcf1_t> > records;
+            return cached_data->dataset_range("NA12878", hdr.get(), q, nullptr, &records);
+        }, i % 2).get().ok());
+        REQUIRE((node == 0 || node == 1));
+        nodes_used.insert(node);
+    }
+    cached_stats = cached_data->getRangeStats();
+    REQUIRE(cached_stats->nBucketCacheMisses == nodes_used.size()*misses);
+    REQUIRE(cached_stats->nBucketCacheHits == (8 - nodes_used.size())*misses);
+
+    // prefetching the range decodes its buckets into the cache, from which
+    // the query proper is then served entirely
+    REQUIRE(T::Open(&db, cached_data, 64<<20).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*cached_data, cache).ok());
+    string sampleset;
+    REQUIRE(cache->all_samples_sampleset(sampleset).ok());
+    auto prefetched = perf::current()[perf::counter::buckets_prefetched];
+    REQUIRE(cached_data->prefetch(*cache, sampleset, q, nullptr).ok());
+    REQUIRE(perf::current()[perf::counter::buckets_prefetched] > prefetched);
+    cached_stats = cached_data->getRangeStats();
+    REQUIRE(cached_stats->nBucketCacheHits == 0);
+    REQUIRE(cached_stats->nBucketCacheMisses == 0);
+    REQUIRE(cached_stats->nBCFRecordsRead == records_read);
+    std::vector<std::shared_ptr<bcf1_t> > records3;
+    REQUIRE(cached_data->dataset_range("NA12878", hdr.get(), q, nullptr, &records3).ok());
+    cached_stats = cached_data->getRangeStats();
+    REQUIRE(cached_stats->nBucketCacheHits == misses);
+    REQUIRE(cached_stats->nBucketCacheMisses == 0);
+    REQUIRE(cached_stats->nBCFRecordsRead == records_read);
+    REQUIRE(records3.size() == records1.size());
+    for (size_t j = 0; j < records3.size(); j++) {
+        REQUIRE(bcf_shallow_compare(records3[j].get(), records1[j].get()));
+    }
+
+    // prefetching it again reads nothing more
+    prefetched = perf::current()[perf::counter::buckets_prefetched];
+    REQUIRE(cached_data->prefetch(*cache, sampleset, q, nullptr).ok());
+    REQUIRE(perf::current()[perf::counter::buckets_prefetched] == prefetched);
+}
+
+TEST_CASE("BCFKeyValueData range-restricted import using the gVCF index") {
+    if (getenv("ROCKSDB_VALGRIND_RUN")) {
+        // this test is too slow under valgrind
+        return;
+    }
+    // copy the gVCF so that we can index it
+    const string fn = "/tmp/GLnexus_indexed_import.g.vcf.gz";
+    REQUIRE(system(("cp test/data/NA12878.g.vcf.gz " + fn + " && rm -f " + fn + ".tbi " + fn + ".csi").c_str()) == 0);
+
+    vector<pair<string,uint64_t>> contigs;
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(fn.c_str(), "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    int ncontigs = 0;
+    const char **contignames = bcf_hdr_seqnames(hdr.get(), &ncontigs);
+    for (int i = 0; i < ncontigs; i++) {
+        contigs.push_back(make_pair(string(contignames[i]),
+                                    hdr->id[BCF_DT_CTG][i].val->info[0]));
+    }
+    free(contignames);
+
+    // overlapping, abutting and nearby ranges on chr17; also a range on chrM,
+    // which has no records
+    set<range> range_filter = {
+        range(15, 0, 100000),
+        range(16, 1000000, 2000000), range(16, 1500000, 2500000), range(16, 2500000, 2600000),
+        range(16, 2600100, 2700000),
+        range(20, 20000000, 30000000),
+        range(24, 0, 16569)
+    };
+
+    auto import = [&](KeyValueMem::DB& db, T::import_result& rslt) {
+        REQUIRE(T::InitializeDB(&db, contigs).ok());
+        unique_ptr<T> data;
+        REQUIRE(T::Open(&db, data).ok());
+        unique_ptr<MetadataCache> cache;
+        REQUIRE(MetadataCache::Start(*data, cache).ok());
+        REQUIRE(data->import_gvcf(*cache, "NA12878", fn, range_filter, rslt).ok());
+    };
+
+    // import without, then with, the index
+    KeyValueMem::DB db1({}), db2({});
+    T::import_result rslt1, rslt2;
+    import(db1, rslt1);
+    REQUIRE(tbx_index_build(fn.c_str(), 0, &tbx_conf_vcf) == 0);
+    import(db2, rslt2);
+    REQUIRE(rslt1.records > 0);
+    REQUIRE(rslt1.records == rslt2.records);
+    REQUIRE(rslt1.duplicate_records == rslt2.duplicate_records);
+    REQUIRE(rslt1.buckets == rslt2.buckets);
+    REQUIRE(rslt1.bytes == rslt2.bytes);
+
+    // the imported records are identical, and all overlap the range filter
+    unique_ptr<T> data1, data2;
+    REQUIRE(T::Open(&db1, data1).ok());
+    REQUIRE(T::Open(&db2, data2).ok());
+    size_t n = 0;
+    for (int rid = 0; rid < ncontigs; rid++) {
+        std::vector<std::shared_ptr<bcf1_t> > records1, records2;
+        range q(rid, 0, contigs[rid].second);
+        REQUIRE(data1->dataset_range("NA12878", hdr.get(), q, nullptr, &records1).ok());
+        REQUIRE(data2->dataset_range("NA12878", hdr.get(), q, nullptr, &records2).ok());
+        REQUIRE(records1.size() == records2.size());
+        for (size_t i = 0; i < records1.size(); i++) {
+            REQUIRE(*bcf1_to_string(hdr.get(), records1[i].get()) ==
+                    *bcf1_to_string(hdr.get(), records2[i].get()));
+            range rng(records1[i]);
+            REQUIRE(any_of(range_filter.begin(), range_filter.end(),
+                           [&rng](const range& r) { return r.overlaps(rng); }));
+        }
+        n += records1.size();
+    }
+    REQUIRE(n == rslt1.records - rslt1.duplicate_records);
+
+    REQUIRE(system(("rm -f " + fn + " " + fn + ".tbi").c_str()) == 0);
+}
+
+TEST_CASE("BCFKeyValueData parallel chunked import of an indexed gVCF") {
+    if (getenv("ROCKSDB_VALGRIND_RUN")) {
+        // this test is too slow under valgrind
+        return;
+    }
+    const string fn = "/tmp/GLnexus_chunked_import.g.vcf.gz";
+    REQUIRE(system(("cp test/data/NA12878.g.vcf.gz " + fn + " && rm -f " + fn + ".csi").c_str()) == 0);
+    REQUIRE(tbx_index_build(fn.c_str(), 0, &tbx_conf_vcf) == 0);
+
+    vector<pair<string,uint64_t>> contigs;
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(fn.c_str(), "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    int ncontigs = 0;
+    const char **contignames = bcf_hdr_seqnames(hdr.get(), &ncontigs);
+    for (int i = 0; i < ncontigs; i++) {
+        contigs.push_back(make_pair(string(contignames[i]),
+                                    hdr->id[BCF_DT_CTG][i].val->info[0]));
+    }
+    free(contignames);
+
+    ctpl::thread_pool pool(4);
+    auto import = [&](KeyValueMem::DB& db, const set<range>& range_filter, ctpl::thread_pool* p,
+                      T::import_result& rslt) {
+        REQUIRE(T::InitializeDB(&db, contigs).ok());
+        unique_ptr<T> data;
+        REQUIRE(T::Open(&db, data).ok());
+        unique_ptr<MetadataCache> cache;
+        REQUIRE(MetadataCache::Start(*data, cache).ok());
+        T::import_options opts;
+        opts.pool = p;
+        REQUIRE(data->import_gvcf(*cache, "NA12878", fn, range_filter, rslt, opts).ok());
+    };
+
+    // without and with a range filter, whose boundaries needn't coincide
+    // with those of the chunks
+    vector<set<range>> range_filters = {
+        {},
+        { range(16, 1000000, 2000000), range(16, 2600100, 2700000), range(20, 20000000, 30000000) }
+    };
+    for (const auto& range_filter : range_filters) {
+        KeyValueMem::DB db1({}), db2({});
+        T::import_result rslt1, rslt2;
+        import(db1, range_filter, nullptr, rslt1);
+        import(db2, range_filter, &pool, rslt2);
+        REQUIRE(rslt1.records > 0);
+        REQUIRE(rslt1.records == rslt2.records);
+        REQUIRE(rslt1.duplicate_records == rslt2.duplicate_records);
+        REQUIRE(rslt1.buckets == rslt2.buckets);
+        REQUIRE(rslt1.bytes == rslt2.bytes);
+        REQUIRE(rslt1.samples == rslt2.samples);
+
+        // the stored records are identical
+        unique_ptr<T> data1, data2;
+        REQUIRE(T::Open(&db1, data1).ok());
+        REQUIRE(T::Open(&db2, data2).ok());
+        for (int rid = 0; rid < ncontigs; rid++) {
+            std::vector<std::shared_ptr<bcf1_t> > records1, records2;
+            range q(rid, 0, contigs[rid].second);
+            REQUIRE(data1->dataset_range("NA12878", hdr.get(), q, nullptr, &records1).ok());
+            REQUIRE(data2->dataset_range("NA12878", hdr.get(), q, nullptr, &records2).ok());
+            REQUIRE(records1.size() == records2.size());
+            for (size_t i = 0; i < records1.size(); i++) {
+                REQUIRE(*bcf1_to_string(hdr.get(), records1[i].get()) ==
+                        *bcf1_to_string(hdr.get(), records2[i].get()));
+            }
+        }
+    }
+
+    REQUIRE(system(("rm -f " + fn + " " + fn + ".tbi").c_str()) == 0);
+}
+
+TEST_CASE("BCFKeyValueData threaded decompression and parse-ahead") {
+    if (getenv("ROCKSDB_VALGRIND_RUN")) {
+        // this test is too slow under valgrind
+        return;
+    }
+    htsThreadPool hts_pool = { hts_tpool_init(4), 0 };
+    REQUIRE(hts_pool.pool);
+
+    // import the gVCF into a new database, plainly or with threading
+    auto import = [&](KeyValueMem::DB& db, const string& fn, const vector<pair<string,uint64_t>>& contigs,
+                      bool threaded, T::import_result& rslt) {
+        REQUIRE(T::InitializeDB(&db, contigs).ok());
+        unique_ptr<T> data;
+        REQUIRE(T::Open(&db, data).ok());
+        unique_ptr<MetadataCache> cache;
+        REQUIRE(MetadataCache::Start(*data, cache).ok());
+        T::import_options opts;
+        if (threaded) {
+            opts.hts_pool = &hts_pool;
+            opts.parse_ahead = 100;
+        }
+        return data->import_gvcf(*cache, "x", fn, {}, rslt, opts);
+    };
+    // the stored headers and records are identical
+    auto compare = [&](KeyValueMem::DB& db1, KeyValueMem::DB& db2, const vector<pair<string,uint64_t>>& contigs) {
+        unique_ptr<T> data1, data2;
+        REQUIRE(T::Open(&db1, data1).ok());
+        REQUIRE(T::Open(&db2, data2).ok());
+        shared_ptr<const bcf_hdr_t> hdr1, hdr2;
+        REQUIRE(data1->dataset_header("x", &hdr1).ok());
+        REQUIRE(data2->dataset_header("x", &hdr2).ok());
+        REQUIRE(hdr1->n[BCF_DT_ID] == hdr2->n[BCF_DT_ID]);
+        size_t n = 0;
+        for (int rid = 0; rid < (int) contigs.size(); rid++) {
+            std::vector<std::shared_ptr<bcf1_t> > records1, records2;
+            range q(rid, 0, contigs[rid].second);
+            REQUIRE(data1->dataset_range("x", hdr1.get(), q, nullptr, &records1).ok());
+            REQUIRE(data2->dataset_range("x", hdr2.get(), q, nullptr, &records2).ok());
+            REQUIRE(records1.size() == records2.size());
+            for (size_t i = 0; i < records1.size(); i++) {
+                REQUIRE(*bcf1_to_string(hdr1.get(), records1[i].get()) ==
+                        *bcf1_to_string(hdr2.get(), records2[i].get()));
+            }
+            n += records1.size();
+        }
+        return n;
+    };
+
+    SECTION("bgzipped gVCF") {
+        const string fn = "test/data/NA12878.g.vcf.gz";
+        vector<pair<string,uint64_t>> contigs;
+        unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(fn.c_str(), "r"),
+                                                   [](vcfFile* f) { bcf_close(f); });
+        unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+        int ncontigs = 0;
+        const char **contignames = bcf_hdr_seqnames(hdr.get(), &ncontigs);
+        for (int i = 0; i < ncontigs; i++) {
+            contigs.push_back(make_pair(string(contignames[i]),
+                                        hdr->id[BCF_DT_CTG][i].val->info[0]));
+        }
+        free(contignames);
+
+        KeyValueMem::DB db1({}), db2({});
+        T::import_result rslt1, rslt2;
+        REQUIRE(import(db1, fn, contigs, false, rslt1).ok());
+        REQUIRE(import(db2, fn, contigs, true, rslt2).ok());
+        REQUIRE(rslt1.records > 0);
+        REQUIRE(rslt1.records == rslt2.records);
+        REQUIRE(rslt1.buckets == rslt2.buckets);
+        REQUIRE(rslt1.bytes == rslt2.bytes);
+        REQUIRE(compare(db1, db2, contigs) > 0);
+    }
+
+    SECTION("undeclared INFO field") {
+        // parsing the field adds it to the header partway through, so the
+        // records parsed ahead are discarded and the file read again
+        const string fn = "/tmp/GLnexus_parse_ahead.g.vcf";
+        {
+            ofstream vcf(fn);
+            vcf << "##fileformat=VCFv4.2\n"
+                << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n"
+                << "##INFO=<ID=END,Number=1,Type=Integer,Description=\"End position\">\n"
+                << "##contig=<ID=1,length=1000000>\n"
+                << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tS1\n";
+            for (int i = 0; i < 1000; i++) {
+                vcf << "1\t" << (100*i + 1) << "\t.\tA\tG\t50\t.\t" << (i >= 700 ? "FOO=1" : ".")
+                    << "\tGT\t0/1\n";
+            }
+        }
+        vector<pair<string,uint64_t>> contigs = { make_pair(string("1"), 1000000) };
+        KeyValueMem::DB db1({}), db2({});
+        T::import_result rslt1, rslt2;
+        Status s1 = import(db1, fn, contigs, false, rslt1);
+        Status s2 = import(db2, fn, contigs, true, rslt2);
+        REQUIRE((StatusCode) s1 == (StatusCode) s2);
+        if (s1.ok()) {
+            REQUIRE(rslt1.records == rslt2.records);
+            REQUIRE(rslt1.buckets == rslt2.buckets);
+            REQUIRE(compare(db1, db2, contigs) == 1000);
+        }
+        REQUIRE(system(("rm -f " + fn).c_str()) == 0);
+    }
+
+    hts_tpool_destroy(hts_pool.pool);
 }
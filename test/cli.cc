@@ -1,10 +1,19 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <sstream>
+#include <thread>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
 #include "spdlog/spdlog.h"
 #include "BCFKeyValueData.h"
 #include "BCFSerialize.h"
 #include "cli_utils.h"
+#include "service.h"
 #include "catch.hpp"
 #include "spdlog/sinks/null_sink.h"
 
@@ -46,6 +55,24 @@ TEST_CASE("cli") {
         REQUIRE(s.ok());
         REQUIRE(contigs.size() >= 1);
 
+        // loaded in parallel, the data sets have consecutive IDs in the order given
+        {
+            unique_ptr<KeyValue::DB> db;
+            RocksKeyValue::config cfg;
+            cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
+            cfg.pfx = cli::utils::GLnexus_prefix_spec();
+            REQUIRE(RocksKeyValue::Open(DB_PATH, cfg, db).ok());
+            unique_ptr<BCFKeyValueData> data;
+            REQUIRE(BCFKeyValueData::Open(db.get(), data).ok());
+            uint32_t first_id = 0;
+            REQUIRE(data->dataset_id("F1", first_id).ok());
+            for (uint32_t i = 1; i < 4; i++) {
+                uint32_t id = 0;
+                REQUIRE(data->dataset_id("F" + to_string(i+1), id).ok());
+                REQUIRE(id == first_id + i);
+            }
+        }
+
         // construct ranges that cover the entire contig set
         ranges.clear();
         for (int rid=0; rid < contigs.size(); rid++) {
@@ -101,6 +128,332 @@ TEST_CASE("cli") {
         filename = DB_DIR + "/results.bcf";
         s = cli::utils::genotype(console, 0, nr_threads, DB_PATH, genotyper_cfg, sites, {}, filename);
         REQUIRE(s.ok());
+
+        // the pipelined discovery, unification and genotyping produces the
+        // same output
+        genotyper_config vcf_cfg = genotyper_cfg;
+        vcf_cfg.output_format = GLnexusOutputFormat::VCF;
+        s = cli::utils::genotype(console, 0, nr_threads, DB_PATH, vcf_cfg, sites, {}, DB_DIR + "/results.vcf");
+        REQUIRE(s.ok());
+        {
+            unique_ptr<KeyValue::DB> db;
+            RocksKeyValue::config cfg;
+            cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
+            cfg.pfx = cli::utils::GLnexus_prefix_spec();
+            REQUIRE(RocksKeyValue::Open(DB_PATH, cfg, db).ok());
+            for (size_t depth : {1, 2, 8}) {
+                unifier_stats stats2;
+                s = cli::utils::discover_unify_genotype(console, 0, nr_threads, db.get(), ranges, contigs,
+                                                        unifier_cfg, vcf_cfg, {}, DB_DIR + "/results_pipelined.vcf",
+                                                        depth, stats2);
+                REQUIRE(s.ok());
+                REQUIRE(stats2.unified_alleles == stats.unified_alleles);
+                REQUIRE(stats2.lost_alleles == stats.lost_alleles);
+                REQUIRE(stats2.filtered_alleles == stats.filtered_alleles);
+
+                ifstream f1(DB_DIR + "/results.vcf"), f2(DB_DIR + "/results_pipelined.vcf");
+                stringstream ss1, ss2;
+                ss1 << f1.rdbuf();
+                ss2 << f2.rdbuf();
+                REQUIRE(ss1.str().size() > 0);
+                REQUIRE(ss1.str() == ss2.str());
+            }
+        }
+
+        // bounded-memory discovery, spilling the alleles to files (after every
+        // range with a zero budget, in or out of order), gives the same sites
+        {
+            unique_ptr<KeyValue::DB> db;
+            RocksKeyValue::config cfg;
+            cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
+            cfg.pfx = cli::utils::GLnexus_prefix_spec();
+            REQUIRE(RocksKeyValue::Open(DB_PATH, cfg, db).ok());
+            vector<range> halves;
+            for (const auto& r : ranges) {
+                halves.push_back(range(r.rid, r.beg, (r.beg+r.end)/2));
+                halves.push_back(range(r.rid, (r.beg+r.end)/2, r.end));
+            }
+            vector<range> reversed(halves.rbegin(), halves.rend());
+            for (const auto& spill_ranges : {ranges, halves, reversed}) {
+                for (size_t budget : {size_t(0), size_t(1) << 30}) {
+                    vector<unified_site> spill_sites;
+                    unifier_stats spill_stats;
+                    unsigned spill_sample_count = 0;
+                    int next_rid = 0;
+                    string spill_prefix = DB_DIR + "/spill.";
+                    s = cli::utils::discover_alleles_spilling(console, nr_threads, db.get(), spill_ranges, contigs,
+                                                              budget, spill_prefix, spill_sample_count, false,
+                                                              [&](int rid, discovered_alleles& contig_dsals) {
+                        REQUIRE(rid == next_rid++);
+                        for (const auto& p : contig_dsals) {
+                            REQUIRE(p.first.pos.rid == rid);
+                        }
+                        REQUIRE(ifstream(spill_prefix + "0").good() == (budget == 0));
+                        unifier_stats contig_stats;
+                        Status s = cli::utils::unify_sites(console, unifier_cfg, contigs, contig_dsals,
+                                                           spill_sample_count, spill_sites, contig_stats);
+                        spill_stats += contig_stats;
+                        return s;
+                    });
+                    REQUIRE(s.ok());
+                    REQUIRE(next_rid == contigs.size());
+                    REQUIRE(spill_sample_count == sample_count);
+                    REQUIRE(spill_sites == sites);
+                    REQUIRE(spill_stats.unified_alleles == stats.unified_alleles);
+                    REQUIRE(!ifstream(spill_prefix + "0").good());
+                }
+            }
+
+            // drawing on a shared budget, the alleles' share is reserved
+            // from it until we're done
+            memory_budget shared_budget(size_t(1) << 30);
+            vector<unified_site> spill_sites;
+            unsigned spill_sample_count = 0;
+            s = cli::utils::discover_alleles_spilling(console, nr_threads, db.get(), ranges, contigs,
+                                                      size_t(1) << 28, DB_DIR + "/spill.", spill_sample_count,
+                                                      false, [&](int rid, discovered_alleles& contig_dsals) {
+                REQUIRE(shared_budget.reserved() == (size_t(1) << 28));
+                unifier_stats contig_stats;
+                return cli::utils::unify_sites(console, unifier_cfg, contigs, contig_dsals,
+                                               spill_sample_count, spill_sites, contig_stats);
+            }, &shared_budget);
+            REQUIRE(s.ok());
+            REQUIRE(spill_sites == sites);
+            REQUIRE(shared_budget.reserved() == 0);
+            REQUIRE(shared_budget.in_use() == 0);
+        }
+
+        // query server: the same output for on-demand queries, answered
+        // concurrently
+        {
+            const string socket_path = DB_DIR + "/query.sock";
+            atomic<bool> stop(false);
+            Status server_status;
+            thread server([&]() {
+                server_status = cli::utils::serve(console, 0, nr_threads, DB_PATH, unifier_cfg, vcf_cfg, {}, 0,
+                                                  socket_path, 2, 0, stop);
+            });
+            auto socket_exists = [&]() {
+                struct stat st;
+                return stat(socket_path.c_str(), &st) == 0;
+            };
+            for (int i = 0; i < 6000 && !socket_exists(); i++) {
+                this_thread::sleep_for(chrono::milliseconds(10));
+            }
+            REQUIRE(socket_exists());
+
+            string all_contigs;
+            for (const auto& contig : contigs) {
+                all_contigs += (all_contigs.empty() ? "" : ",") + contig.first;
+            }
+            ifstream vcf(DB_DIR + "/results.vcf"), dsals_yml(DB_DIR + "/dsals.yml");
+            stringstream expected_vcf, expected_dsals;
+            expected_vcf << vcf.rdbuf();
+            expected_dsals << dsals_yml.rdbuf();
+
+            vector<Status> statuses(3);
+            vector<stringstream> outputs(3);
+            vector<thread> clients;
+            for (size_t i = 0; i < 3; i++) {
+                clients.emplace_back([&, i]() {
+                    statuses[i] = cli::utils::query_server(socket_path, "genotype " + all_contigs, outputs[i]);
+                });
+            }
+            for (auto& t : clients) {
+                t.join();
+            }
+            for (size_t i = 0; i < 3; i++) {
+                REQUIRE(statuses[i].ok());
+                REQUIRE(outputs[i].str() == expected_vcf.str());
+            }
+
+            stringstream dsals_out;
+            s = cli::utils::query_server(socket_path, "discover " + all_contigs, dsals_out);
+            REQUIRE(s.ok());
+            REQUIRE(dsals_out.str() == expected_dsals.str());
+
+            stringstream bad_out;
+            s = cli::utils::query_server(socket_path, "genotype nonexistent:1-100", bad_out);
+            REQUIRE(s == StatusCode::FAILURE);
+            REQUIRE(bad_out.str().empty());
+            s = cli::utils::query_server(socket_path, "genotype 1 nonexistent_sampleset", bad_out);
+            REQUIRE(s == StatusCode::FAILURE);
+
+            stop = true;
+            server.join();
+            REQUIRE(server_status.ok());
+            REQUIRE(!socket_exists());
+            s = cli::utils::query_server(socket_path, "discover 1", bad_out);
+            REQUIRE(s == StatusCode::IO_ERROR);
+
+            // queries exceeding a tiny deadline are aborted
+            stop = false;
+            thread hasty_server([&]() {
+                server_status = cli::utils::serve(console, 0, nr_threads, DB_PATH, unifier_cfg, vcf_cfg, {}, 0,
+                                                  socket_path, 2, 1, stop);
+            });
+            for (int i = 0; i < 6000 && !socket_exists(); i++) {
+                this_thread::sleep_for(chrono::milliseconds(10));
+            }
+            REQUIRE(socket_exists());
+            stringstream late_out;
+            s = cli::utils::query_server(socket_path, "genotype " + all_contigs, late_out);
+            REQUIRE(s == StatusCode::FAILURE);
+            REQUIRE(s.str().find("deadline") != string::npos);
+            REQUIRE(late_out.str().empty());
+            stop = true;
+            hasty_server.join();
+            REQUIRE(server_status.ok());
+
+            // a response cut short of its stated length is an error
+            int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+            REQUIRE(lfd >= 0);
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+            REQUIRE(::bind(lfd, (const sockaddr*) &addr, sizeof(addr)) == 0);
+            REQUIRE(listen(lfd, 1) == 0);
+            thread truncating_server([&]() {
+                int fd = accept(lfd, nullptr, nullptr);
+                if (fd >= 0) {
+                    char buf[256];
+                    ignore_retval(recv(fd, buf, sizeof(buf), 0));
+                    const string response = "OK 100\nonly some of it";
+                    ignore_retval(send(fd, response.c_str(), response.size(), 0));
+                    close(fd);
+                }
+            });
+            stringstream truncated_out;
+            s = cli::utils::query_server(socket_path, "discover 1", truncated_out);
+            truncating_server.join();
+            close(lfd);
+            unlink(socket_path.c_str());
+            REQUIRE(s == StatusCode::IO_ERROR);
+            REQUIRE(truncated_out.str() == "only some of it");
+        }
+
+        // distributed: discover and genotype range shards separately, merging
+        // the alleles and concatenating the outputs; the output is the same
+        {
+            vector<vector<range>> shards;
+            REQUIRE(cli::utils::split_ranges(ranges, 3, shards).ok());
+            REQUIRE(shards.size() == 3);
+            for (size_t i = 1; i < shards.size(); i++) {
+                REQUIRE(shards[i-1].back() < shards[i].front());
+            }
+
+            vector<string> dsals_filenames;
+            for (size_t i = 0; i < shards.size(); i++) {
+                string bedfile = DB_DIR + "/shard" + to_string(i) + ".bed";
+                REQUIRE(cli::utils::write_bed_file(shards[i], contigs, bedfile).ok());
+                vector<range> shard_ranges;
+                REQUIRE(cli::utils::parse_bed_file(console, bedfile, contigs, shard_ranges).ok());
+                REQUIRE(shard_ranges == shards[i]);
+
+                discovered_alleles shard_dsals;
+                unsigned shard_sample_count = 0;
+                s = cli::utils::discover_alleles(console, 0, nr_threads, DB_PATH, shard_ranges, contigs,
+                                                 shard_dsals, shard_sample_count);
+                REQUIRE(s.ok());
+                REQUIRE(shard_sample_count == sample_count);
+                dsals_filenames.push_back(DB_DIR + "/shard" + to_string(i) + ".dsals.cflat");
+                s = cli::utils::capnp_write_discovered_alleles_to_file(shard_dsals, contigs, shard_sample_count,
+                                                                       dsals_filenames.back());
+                REQUIRE(s.ok());
+            }
+
+            discovered_alleles merged_dsals;
+            unsigned merged_sample_count = 0;
+            s = cli::utils::merge_discovered_alleles_files(dsals_filenames, contigs, merged_dsals, merged_sample_count);
+            REQUIRE(s.ok());
+            REQUIRE(merged_sample_count == sample_count);
+            vector<unified_site> dist_sites;
+            unifier_stats dist_stats;
+            s = cli::utils::unify_sites(console, unifier_cfg, contigs, merged_dsals, merged_sample_count,
+                                        dist_sites, dist_stats);
+            REQUIRE(s.ok());
+            REQUIRE(dist_sites == sites);
+
+            vector<vector<unified_site>> sites_by_shard;
+            REQUIRE(cli::utils::split_sites(dist_sites, shards, sites_by_shard).ok());
+            REQUIRE(sites_by_shard.size() == shards.size());
+            vector<string> parts;
+            size_t n_sites = 0;
+            for (size_t i = 0; i < shards.size(); i++) {
+                n_sites += sites_by_shard[i].size();
+                parts.push_back(DB_DIR + "/shard" + to_string(i) + ".vcf");
+                s = cli::utils::genotype_shard(console, 0, nr_threads, DB_PATH, vcf_cfg, sites_by_shard[i],
+                                               {}, i, parts.back());
+                REQUIRE(s.ok());
+            }
+            REQUIRE(n_sites == sites.size());
+            s = Service::concatenate_shards(vcf_cfg, parts, DB_DIR + "/results_dist.vcf");
+            REQUIRE(s.ok());
+
+            ifstream f1(DB_DIR + "/results.vcf"), f2(DB_DIR + "/results_dist.vcf");
+            stringstream ss1, ss2;
+            ss1 << f1.rdbuf();
+            ss2 << f2.rdbuf();
+            REQUIRE(ss1.str() == ss2.str());
+
+            // the shards' outputs must match the output's compression
+            s = Service::concatenate_shards(vcf_cfg, parts, DB_DIR + "/results_dist.vcf.gz");
+            REQUIRE(s == StatusCode::INVALID);
+        }
+
+        // partitioned load: load disjoint subsets of the gVCFs into copies of
+        // the initialized database and merge them; the results are the same
+        {
+            vector<string> part_dbs;
+            for (size_t i = 0; i < 2; i++) {
+                part_dbs.push_back(DB_DIR + "/part" + to_string(i) + ".DB");
+                vector<pair<string,size_t>> part_contigs;
+                REQUIRE(cli::utils::db_init(console, part_dbs.back(), exemplar_gvcf, part_contigs).ok());
+                vector<string> part_gvcfs(gvcfs.begin() + 2*i, gvcfs.begin() + 2*i + 2);
+                s = cli::utils::db_bulk_load(console, 0, nr_threads, part_gvcfs, part_dbs.back(),
+                                             {}, part_contigs);
+                REQUIRE(s.ok());
+            }
+            string merged_db = DB_DIR + "/merged.DB";
+            vector<pair<string,size_t>> merged_contigs;
+            REQUIRE(cli::utils::db_init(console, merged_db, exemplar_gvcf, merged_contigs).ok());
+            s = cli::utils::db_merge(console, 0, nr_threads, merged_db, part_dbs);
+            REQUIRE(s.ok());
+
+            discovered_alleles merged_dsals;
+            unsigned merged_sample_count = 0;
+            s = cli::utils::discover_alleles(console, 0, nr_threads, merged_db, ranges, contigs,
+                                             merged_dsals, merged_sample_count);
+            REQUIRE(s.ok());
+            REQUIRE(merged_sample_count == sample_count);
+            vector<unified_site> merged_sites;
+            unifier_stats merged_stats;
+            s = cli::utils::unify_sites(console, unifier_cfg, contigs, merged_dsals, merged_sample_count,
+                                        merged_sites, merged_stats);
+            REQUIRE(s.ok());
+            REQUIRE(merged_sites == sites);
+
+            s = cli::utils::genotype(console, 0, nr_threads, merged_db, vcf_cfg, merged_sites, {},
+                                     DB_DIR + "/results_merged.vcf");
+            REQUIRE(s.ok());
+            ifstream f1(DB_DIR + "/results.vcf"), f2(DB_DIR + "/results_merged.vcf");
+            stringstream ss1, ss2;
+            ss1 << f1.rdbuf();
+            ss2 << f2.rdbuf();
+            REQUIRE(ss1.str() == ss2.str());
+
+            // merging the same samples again
+            s = cli::utils::db_merge(console, 0, nr_threads, merged_db, {part_dbs[0]});
+            REQUIRE(s == StatusCode::EXISTS);
+
+            // a database with different buckets
+            string other_db = DB_DIR + "/other.DB";
+            vector<pair<string,size_t>> other_contigs;
+            REQUIRE(cli::utils::db_init(console, other_db, exemplar_gvcf, other_contigs, 1000).ok());
+            s = cli::utils::db_merge(console, 0, nr_threads, merged_db, {other_db});
+            REQUIRE(s == StatusCode::INVALID);
+        }
     }
 
     SECTION("read contigs") {
@@ -125,6 +478,186 @@ TEST_CASE("cli") {
         REQUIRE(contigs[3].second == 4000);
     }
 
+    SECTION("incremental genotyping") {
+        string dir = "/tmp/cli_incremental";
+        REQUIRE(system(("rm -rf " + dir).c_str()) == 0);
+        REQUIRE(system(("mkdir -p " + dir).c_str()) == 0);
+        string dbpath = dir + "/DB";
+        vector<string> gvcfs;
+        for (auto fname : {"F1.gvcf.gz", "F2.gvcf.gz", "F3.gvcf.gz", "F4.gvcf.gz"}) {
+            gvcfs.push_back("test/data/cli/" + string(fname));
+        }
+        vector<pair<string,size_t>> contigs;
+        REQUIRE(cli::utils::db_init(console, dbpath, gvcfs[0], contigs).ok());
+        vector<range> ranges;
+        for (int rid = 0; rid < contigs.size(); rid++) {
+            ranges.push_back(range(rid, 0, contigs[rid].second));
+        }
+        unifier_config unifier_cfg;
+        genotyper_config genotyper_cfg;
+        string config_txt, config_crc32c;
+        REQUIRE(cli::utils::load_config(console, "gatk", unifier_cfg, genotyper_cfg,
+                                        config_txt, config_crc32c).ok());
+        unifier_cfg.min_AQ1 = 0;
+        unifier_cfg.min_AQ2 = 0;
+        genotyper_cfg.output_format = GLnexusOutputFormat::VCF;
+
+        // genotype the database's samples afresh, writing the discovered
+        // alleles and the sites for a later increment
+        auto genotype_all = [&](const string& name) {
+            discovered_alleles dsals;
+            unsigned sample_count;
+            REQUIRE(cli::utils::discover_alleles(console, 0, nr_threads, dbpath, ranges, contigs,
+                                                 dsals, sample_count).ok());
+            REQUIRE(cli::utils::capnp_write_discovered_alleles_to_file(dsals, contigs, sample_count,
+                                                                       dir + "/" + name + ".dsals.cflat").ok());
+            vector<unified_site> sites;
+            unifier_stats stats;
+            REQUIRE(cli::utils::unify_sites(console, unifier_cfg, contigs, dsals, sample_count,
+                                            sites, stats).ok());
+            REQUIRE(cli::utils::capnp_write_unified_sites_to_file(sites, contigs,
+                                                                  dir + "/" + name + ".sites.cflat").ok());
+            REQUIRE(cli::utils::genotype(console, 0, nr_threads, dbpath, genotyper_cfg, sites, {},
+                                         dir + "/" + name + ".vcf").ok());
+        };
+        auto slurp = [](const string& fn) {
+            ifstream ifs(fn);
+            stringstream ss;
+            ss << ifs.rdbuf();
+            return ss.str();
+        };
+
+        // the prior cohort: F1-F3
+        REQUIRE(cli::utils::db_bulk_load(console, 0, nr_threads, {gvcfs[0], gvcfs[1], gvcfs[2]},
+                                         dbpath, {}, contigs).ok());
+        genotype_all("prior");
+
+        // add F4, and compare the increment with genotyping everyone afresh
+        REQUIRE(cli::utils::db_bulk_load(console, 0, nr_threads, {gvcfs[3]}, dbpath, {}, contigs).ok());
+        unifier_stats stats;
+        Status s = cli::utils::genotype_incremental(console, 0, nr_threads, dbpath, ranges, contigs,
+                                                    unifier_cfg, genotyper_cfg, {},
+                                                    dir + "/prior.dsals.cflat", dir + "/prior.sites.cflat",
+                                                    dir + "/prior.vcf", dir + "/grown.dsals.cflat",
+                                                    dir + "/grown.sites.cflat", dir + "/grown.vcf", stats);
+        REQUIRE(s.ok());
+        genotype_all("full");
+        string full = slurp(dir + "/full.vcf");
+        REQUIRE(full.size() > 0);
+        REQUIRE(slurp(dir + "/grown.vcf") == full);
+
+        // nothing more to add
+        s = cli::utils::genotype_incremental(console, 0, nr_threads, dbpath, ranges, contigs,
+                                             unifier_cfg, genotyper_cfg, {},
+                                             dir + "/grown.dsals.cflat", dir + "/grown.sites.cflat",
+                                             dir + "/grown.vcf", dir + "/grown2.dsals.cflat",
+                                             dir + "/grown2.sites.cflat", dir + "/grown2.vcf", stats);
+        REQUIRE(s == StatusCode::INVALID);
+    }
+
+    SECTION("genotyping in database key order") {
+        // The bucket iterators yield the data sets in the order of their IDs,
+        // which needn't be that of their names. Genotyping must produce the
+        // same output however they're ordered.
+        string dir = "/tmp/cli_key_order";
+        REQUIRE(system(("rm -rf " + dir).c_str()) == 0);
+        REQUIRE(system(("mkdir -p " + dir).c_str()) == 0);
+
+        auto genotype_db = [&](const string& name, const vector<string>& gvcfs,
+                               const BCFKeyValueData::import_options& import_opts) {
+            string dbpath = dir + "/" + name + ".DB";
+            vector<pair<string,size_t>> contigs;
+            REQUIRE(cli::utils::db_init(console, dbpath, gvcfs[0], contigs).ok());
+            // the data sets get IDs in the given order
+            REQUIRE(cli::utils::db_bulk_load(console, 0, 1, gvcfs, dbpath, {}, contigs, nullptr, false,
+                                             import_opts).ok());
+            vector<range> ranges;
+            for (int rid = 0; rid < contigs.size(); rid++) {
+                ranges.push_back(range(rid, 0, contigs[rid].second));
+            }
+
+            discovered_alleles dsals;
+            unsigned sample_count;
+            REQUIRE(cli::utils::discover_alleles(console, 0, nr_threads, dbpath, ranges, contigs,
+                                                 dsals, sample_count).ok());
+            unifier_config unifier_cfg;
+            genotyper_config genotyper_cfg;
+            string config_txt, config_crc32c;
+            REQUIRE(cli::utils::load_config(console, "gatk", unifier_cfg, genotyper_cfg,
+                                            config_txt, config_crc32c).ok());
+            unifier_cfg.min_AQ1 = 0;
+            unifier_cfg.min_AQ2 = 0;
+            genotyper_cfg.output_format = GLnexusOutputFormat::VCF;
+            vector<unified_site> sites;
+            unifier_stats stats;
+            REQUIRE(cli::utils::unify_sites(console, unifier_cfg, contigs, dsals, sample_count,
+                                            sites, stats).ok());
+            REQUIRE(sites.size() > 0);
+            string output = dir + "/" + name + ".vcf";
+            REQUIRE(cli::utils::genotype(console, 0, nr_threads, dbpath, genotyper_cfg, sites, {},
+                                         output).ok());
+
+            ifstream f(output);
+            stringstream ss;
+            ss << f.rdbuf();
+            return ss.str();
+        };
+
+        // data sets imported in the reverse of their name order
+        vector<string> gvcfs;
+        for (auto fname : {"F1.gvcf.gz", "F2.gvcf.gz", "F3.gvcf.gz", "F4.gvcf.gz"}) {
+            gvcfs.push_back("test/data/cli/" + string(fname));
+        }
+        string forward = genotype_db("forward", gvcfs, BCFKeyValueData::import_options());
+        REQUIRE(forward.size() > 0);
+        reverse(gvcfs.begin(), gvcfs.end());
+        REQUIRE(genotype_db("reverse", gvcfs, BCFKeyValueData::import_options()) == forward);
+
+        // a gVCF divided into more than ten sample tiles, whose names don't
+        // sort in the order of their IDs (wide.tile10 < wide.tile2)
+        string wide = dir + "/wide.gvcf";
+        {
+            ofstream vcf(wide);
+            vcf << "##fileformat=VCFv4.2" << endl
+                << "##ALT=<ID=NON_REF,Description=\"Represents any possible alternative allele at this location\">" << endl
+                << "##FILTER=<ID=PASS,Description=\"All filters passed\">" << endl
+                << "##INFO=<ID=END,Number=1,Type=Integer,Description=\"Stop position of the interval\">" << endl
+                << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">" << endl
+                << "##FORMAT=<ID=AD,Number=.,Type=Integer,Description=\"Allelic depths\">" << endl
+                << "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Read depth\">" << endl
+                << "##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Genotype Quality\">" << endl
+                << "##FORMAT=<ID=MIN_DP,Number=1,Type=Integer,Description=\"Minimum DP observed within the band\">" << endl
+                << "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Phred-scaled genotype likelihoods\">" << endl
+                << "##contig=<ID=1,length=10000>" << endl
+                << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+            const int n_samples = 12;
+            for (int i = 0; i < n_samples; i++) {
+                vcf << "\tW" << (i < 9 ? "0" : "") << (i+1);
+            }
+            vcf << endl;
+            vcf << "1\t1001\t.\tA\tG,<NON_REF>\t.\tPASS\t.\tGT:AD:DP:GQ:PL";
+            for (int i = 0; i < n_samples; i++) {
+                vcf << (i%2 ? "\t0/1:7,7,0:14:36:16,0,240,46,246,292" : "\t1/1:0,12,0:12:30:300,30,0,300,30,300");
+            }
+            vcf << endl;
+            vcf << "1\t1002\t.\tC\t<NON_REF>\t.\tPASS\tEND=1010\tGT:DP:GQ:MIN_DP:PL";
+            for (int i = 0; i < n_samples; i++) {
+                vcf << "\t0/0:20:60:18:0,60,600";
+            }
+            vcf << endl;
+            vcf << "1\t1011\t.\tC\tA,<NON_REF>\t.\tPASS\t.\tGT:AD:DP:GQ:PL";
+            for (int i = 0; i < n_samples; i++) {
+                vcf << (i%3 ? "\t0/0:20,0,0:20:60:0,60,600,60,600,600" : "\t0/1:10,9,0:19:85:85,0,100,120,130,250");
+            }
+            vcf << endl;
+        }
+        string untiled = genotype_db("untiled", {wide}, BCFKeyValueData::import_options());
+        REQUIRE(untiled.size() > 0);
+        BCFKeyValueData::import_options tiled_opts;
+        tiled_opts.sample_tile_size = 1;
+        REQUIRE(genotype_db("tiled", {wide}, tiled_opts) == untiled);
+    }
+
     SECTION("describe config presets") {
         cout << cli::utils::describe_config_presets();
     }
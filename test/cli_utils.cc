@@ -141,6 +141,42 @@ TEST_CASE("cli_utils") {
         REQUIRE(dsals.size() == dsals2.size());
     }
 
+    SECTION("capnp_discovered_alleles") {
+        discovered_alleles dsals;
+        for (auto yaml : {da_yaml1, da_yaml2, da_yaml3}) {
+            discovered_alleles dal;
+            REQUIRE(discovered_alleles_of_yaml(YAML::Load(yaml), contigs, dal).ok());
+            REQUIRE(merge_discovered_alleles(dal, dsals).ok());
+        }
+        dsals.begin()->second.in_target = range(0, 90, 200);
+
+        std::stringstream ss;
+        Status s = utils::capnp_stream_of_discovered_alleles(3, contigs, dsals, ss);
+        REQUIRE(s.ok());
+
+        std::vector<std::pair<std::string,size_t> > contigs2;
+        discovered_alleles dsals2;
+        s = utils::discovered_alleles_of_capnp_stream(ss, N, contigs2, dsals2);
+        REQUIRE(s.ok());
+        REQUIRE(N == 3);
+        REQUIRE(contigs == contigs2);
+        REQUIRE(dsals == dsals2);
+        REQUIRE(dsals2.begin()->second.in_target == range(0, 90, 200));
+
+        // an empty list
+        std::stringstream ss2;
+        REQUIRE(utils::capnp_stream_of_discovered_alleles(1, contigs, discovered_alleles(), ss2).ok());
+        REQUIRE(utils::discovered_alleles_of_capnp_stream(ss2, N, contigs2, dsals2).ok());
+        REQUIRE(dsals2.empty());
+
+        // truncated or garbage input
+        string buf = ss.str();
+        std::stringstream ss3(buf.substr(0, buf.size()/2));
+        REQUIRE(utils::discovered_alleles_of_capnp_stream(ss3, N, contigs2, dsals2).bad());
+        std::stringstream ss4(da_yaml1);
+        REQUIRE(utils::discovered_alleles_of_capnp_stream(ss4, N, contigs2, dsals2).bad());
+    }
+
     const char* bad_yaml_1 = 1 + R"(
 contigs: xxx
 alleles: yyy
@@ -273,6 +309,30 @@ unification:
         }
     }
 
+    SECTION("capnp_of_unified_sites") {
+        vector<unified_site> sites;
+        for (auto yaml : {snp, del}) {
+            unified_site us(range(-1,-1,-1));
+            REQUIRE(unified_site::of_yaml(YAML::Load(yaml), contigs, us).ok());
+            sites.push_back(us);
+        }
+
+        stringstream ss;
+        REQUIRE(utils::capnp_stream_of_unified_sites(sites, contigs, ss).ok());
+
+        vector<unified_site> sites2;
+        Status s = utils::unified_sites_of_capnp_stream(ss, contigs, sites2);
+        REQUIRE(s.ok());
+        REQUIRE(sites == sites2);
+
+        // mismatched contigs
+        stringstream ss2;
+        REQUIRE(utils::capnp_stream_of_unified_sites(sites, contigs, ss2).ok());
+        vector<pair<string,size_t>> contigs2 = contigs;
+        contigs2.pop_back();
+        REQUIRE(utils::unified_sites_of_capnp_stream(ss2, contigs2, sites2).bad());
+    }
+
     SECTION("LoadYAMLFile") {
         string tmp_file_name = "/tmp/xxx.yml";
         std::remove(tmp_file_name.c_str());
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <memory>
+#include <random>
 #include "diploid.h"
 #include "catch.hpp"
 #include "utils.cc"
@@ -93,6 +94,60 @@ TEST_CASE("diploid::bcf_get_genotype_log_likelihoods") {
     }
 }
 
+TEST_CASE("diploid PL batch kernels") {
+    // compare with the log-likelihood computations on pseudorandom PLs,
+    // including missing values, for sample counts around the vector width
+    std::mt19937 rng(42);
+    for (unsigned n_allele = 1; n_allele <= 18; n_allele++) {
+        for (unsigned n_sample : {1, 7, 8, 9, 37}) {
+            auto nGT = diploid::genotypes(n_allele);
+            vector<int32_t> pl(n_sample*nGT);
+            for (auto& x : pl) {
+                auto r = rng() % 10;
+                x = r == 0 ? bcf_int32_missing : (r == 1 ? bcf_int32_vector_end : int32_t(rng() % 12000));
+            }
+            if (rng() % 3 == 0) {
+                for (unsigned k = 0; k < nGT; k++) {
+                    pl[k] = bcf_int32_missing;
+                }
+            }
+            vector<unsigned> samples;
+            for (unsigned i = 0; i < n_sample; i++) {
+                if (rng() % 4) {
+                    samples.push_back(i);
+                }
+            }
+
+            vector<double> gll(pl.size());
+            REQUIRE(diploid::PL_log_likelihoods(pl.data(), pl.size(), gll.data()));
+            for (size_t k = 0; k < pl.size(); k++) {
+                if (pl[k] < 0) {
+                    REQUIRE(gll[k] == log(0));
+                } else {
+                    REQUIRE(gll[k] == double(pl[k])/(-10.0*log10(exp(1.0))));
+                }
+            }
+
+            vector<int> aq;
+            REQUIRE(diploid::PL_alleles_AQ(n_allele, n_sample, samples, pl.data(), aq));
+            REQUIRE(aq.size() == n_allele*samples.size());
+            for (size_t i = 0; i < samples.size(); i++) {
+                vector<top_AQ> AQ;
+                REQUIRE(diploid::alleles_topAQ(n_allele, n_sample, {samples[i]}, gll, AQ).ok());
+                for (unsigned al = 0; al < n_allele; al++) {
+                    REQUIRE(aq[al*samples.size()+i] == AQ[al].V[0]);
+                }
+            }
+        }
+    }
+
+    vector<int32_t> neg {0, 5, -3, 1, 2, 3, 4, 5, 6, 7};
+    vector<double> gll(neg.size());
+    vector<int> aq;
+    REQUIRE(!diploid::PL_log_likelihoods(neg.data(), neg.size(), gll.data()));
+    REQUIRE(!diploid::PL_alleles_AQ(2, 3, {0}, neg.data(), aq));
+}
+
 TEST_CASE("diploid::alleles_topAQ") {
     // tests with one overwhelmingly likely genotype
     for (int n_allele=2; n_allele<16; n_allele++) {
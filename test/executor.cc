@@ -0,0 +1,153 @@
+#include <atomic>
+#include <vector>
+#include "executor.h"
+#include "memory_budget.h"
+#include "catch.hpp"
+using namespace std;
+using namespace GLnexus;
+
+// recursive fan-out, each level waiting on its own group from within a task
+static long fib(executor& ex, int n) {
+    if (n < 12) {
+        return n < 2 ? n : fib(ex, n-1) + fib(ex, n-2);
+    }
+    task_group group(ex);
+    auto a = group.push([&]() { return fib(ex, n-1); });
+    auto b = group.push([&]() { return fib(ex, n-2); });
+    return group.get(a) + group.get(b);
+}
+
+TEST_CASE("executor") {
+    SECTION("push") {
+        executor ex(4);
+        REQUIRE(ex.size() == 4);
+        REQUIRE(ex.current_worker() == -1);
+        atomic<bool> tid_ok(true);
+        vector<future<int>> futs;
+        for (int i = 0; i < 1000; i++) {
+            futs.push_back(ex.push([&, i](int tid) {
+                if (tid < 0 || tid >= 4 || ex.current_worker() != tid) {
+                    tid_ok = false;
+                }
+                return i;
+            }));
+        }
+        long sum = 0;
+        for (auto& fut : futs) {
+            sum += fut.get();
+        }
+        REQUIRE(sum == 999*1000/2);
+        REQUIRE(tid_ok);
+    }
+
+    SECTION("nested groups") {
+        executor ex(4);
+        REQUIRE(fib(ex, 24) == 46368);
+
+        atomic<int> count(0);
+        {
+            task_group group(ex);
+            for (int i = 0; i < 100; i++) {
+                group.run([&]() {
+                    task_group inner(ex);
+                    for (int j = 0; j < 10; j++) {
+                        inner.run([&]() { count++; });
+                    }
+                });
+            }
+            group.wait();
+            REQUIRE(count == 1000);
+        }
+    }
+
+    SECTION("waiting on a group from the only worker") {
+        executor ex(1);
+        auto fut = ex.push([&](int) {
+            task_group group(ex);
+            auto inner = group.push([]() { return 42; });
+            return group.get(inner);
+        });
+        REQUIRE(fut.get() == 42);
+        REQUIRE(fib(ex, 16) == 987);
+    }
+
+    SECTION("NUMA nodes") {
+        // two pretend nodes sharing CPU 0, which is all we can count on
+        executor ex(3, {{0}, {0}});
+        REQUIRE(ex.size() == 3);
+        REQUIRE(ex.nodes() == 2);
+        REQUIRE(executor::current_node() == -1);
+
+        atomic<bool> node_ok(true);
+        vector<future<int>> futs;
+        for (int i = 0; i < 200; i++) {
+            futs.push_back(ex.push([&](int) {
+                int n = executor::current_node();
+                if (n < 0 || n >= 2) {
+                    node_ok = false;
+                }
+                return n;
+            }, i % 2));
+        }
+        for (auto& fut : futs) {
+            fut.get();
+        }
+        REQUIRE(node_ok);
+
+        task_group group(ex, 1);
+        auto fut = group.push([&]() { return fib(ex, 18); });
+        REQUIRE(group.get(fut) == 2584);
+
+        // more nodes than workers
+        executor ex2(1, {{0}, {0}, {0}});
+        REQUIRE(ex2.nodes() == 1);
+        REQUIRE(ex2.push([](int) { return executor::current_node(); }, 2).get() == 0);
+
+        // as found on this host (empty if just one node)
+        auto nodes = numa_nodes();
+        REQUIRE(nodes.size() != 1);
+        executor ex3(2, nodes);
+        REQUIRE(ex3.nodes() == max(nodes.size(), size_t(1)));
+    }
+
+    SECTION("destructor runs queued tasks") {
+        atomic<int> count(0);
+        {
+            executor ex(2);
+            for (int i = 0; i < 100; i++) {
+                ex.submit([&](int) { count++; });
+            }
+        }
+        REQUIRE(count == 100);
+    }
+}
+
+TEST_CASE("memory_budget") {
+    memory_budget budget(1000);
+    REQUIRE(budget.total() == 1000);
+    REQUIRE(budget.available() == 1000);
+
+    // reservations are granted as far as the budget goes
+    REQUIRE(budget.reserve(600) == 600);
+    REQUIRE(budget.reserve(600) == 400);
+    REQUIRE(budget.available() == 0);
+    budget.unreserve(400);
+    REQUIRE(budget.reserved() == 600);
+
+    // transient usage is charged only if there's room, unless it's taken
+    REQUIRE(budget.try_acquire(300));
+    REQUIRE_FALSE(budget.try_acquire(200));
+    REQUIRE(budget.try_acquire(100));
+    REQUIRE(budget.available() == 0);
+    budget.take(500);
+    REQUIRE(budget.in_use() == 900);
+    REQUIRE(budget.available() == 0);
+    REQUIRE_FALSE(budget.try_acquire(1));
+    REQUIRE_FALSE(budget.try_acquire(0));
+    REQUIRE(budget.reserve(100) == 0);
+    budget.release(900);
+    REQUIRE(budget.in_use() == 0);
+    REQUIRE(budget.try_acquire(0));
+    budget.unreserve(600);
+    REQUIRE(budget.available() == 1000);
+}
@@ -171,3 +171,35 @@ unification:
         REVISE_GENOTYPES_CASE(1, 1, 14, "21	1000	.	T	A,<NON_REF>	.	.	.	GT:AD:DP:GQ:PL	1/1:0,2,0:2:16:32,16,0,240,46,246");
     }
 }
+
+TEST_CASE("prepare_genotyper_plan") {
+    const char* genotyper_cfg_yml = 1 + R"(
+liftover_fields:
+- orig_names: [GQ]
+  name: GQ
+  description: '##FORMAT=<ID=GQ,Number=1,Type=Integer,Description="Genotype Quality">'
+  type: int
+  number: basic
+  combi_method: min
+  count: 1
+- orig_names: [AD]
+  name: AD
+  description: '##FORMAT=<ID=AD,Number=R,Type=Integer,Description="Allelic depths">'
+  type: int
+  number: alleles
+  combi_method: min
+  default_type: zero
+  count: 0
+)";
+    YAML::Node yaml = YAML::Load(genotyper_cfg_yml);
+    genotyper_config genotyper_cfg;
+    REQUIRE(GLnexus::genotyper_config::of_yaml(yaml, genotyper_cfg).ok());
+    shared_ptr<const genotyper_plan> plan;
+    REQUIRE(prepare_genotyper_plan(genotyper_cfg, plan).ok());
+    REQUIRE(plan);
+
+    // misconfigured AD, detected upfront rather than at the first site
+    genotyper_cfg.liftover_fields[1].number = RetainedFieldNumber::BASIC;
+    genotyper_cfg.liftover_fields[1].count = 1;
+    REQUIRE(prepare_genotyper_plan(genotyper_cfg, plan) == StatusCode::INVALID);
+}
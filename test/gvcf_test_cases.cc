@@ -5,6 +5,7 @@
 #include "utils.cc"
 #include "catch.hpp"
 #include "cli_utils.h"
+#include "executor.h"
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/null_sink.h"
 #include "sys/stat.h"
@@ -354,6 +355,8 @@ public:
             cout << s.str() << endl;
         }
         REQUIRE(s.ok());
+        discovered_alleles als_copy = als;
+        const size_t sites0 = sites.size();
 
         unifier_stats stats;
         s = unified_sites(unifier_cfg, N, als, sites, stats);
@@ -363,6 +366,19 @@ public:
         REQUIRE(s.ok());
 
         REQUIRE(is_sorted(sites.begin(), sites.end()));
+
+        // parallel unification, splitting at every opportunity, gives the
+        // same results
+        {
+            executor pool(4);
+            vector<unified_site> chunked_sites;
+            unifier_stats chunked_stats;
+            REQUIRE(unified_sites(unifier_cfg, N, als_copy, chunked_sites, chunked_stats, pool, 1).ok());
+            REQUIRE(chunked_sites == vector<unified_site>(sites.begin()+sites0, sites.end()));
+            REQUIRE(chunked_stats.unified_alleles == stats.unified_alleles);
+            REQUIRE(chunked_stats.lost_alleles == stats.lost_alleles);
+            REQUIRE(chunked_stats.filtered_alleles == stats.filtered_alleles);
+        }
         sort(truth_sites.begin(), truth_sites.end());
 
         // Print debug comparison before failing
@@ -292,6 +292,194 @@ TEST_CASE("htslib gVCF representation") {
 }
 
 
+TEST_CASE("bcf_raw_view") {
+    UPD(vcfFile, vcf, bcf_open("test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf", "r"), [](vcfFile* f) { bcf_close(f); });
+    UPD(bcf_hdr_t, hdr, bcf_hdr_read(vcf), &bcf_hdr_destroy);
+    shared_ptr<bcf1_t> vt;
+    vector<shared_ptr<bcf1_t>> records;
+
+    do {
+        if (vt) {
+            records.push_back(vt);
+        }
+        vt = shared_ptr<bcf1_t>(bcf_init(), &bcf_destroy);
+    } while (bcf_read(vcf, hdr, vt.get()) == 0);
+    REQUIRE(records.size() == 5);
+
+    // decode integer values of the given BCF type
+    auto int_value = [](int type, const uint8_t* p, int i) {
+        switch (type) {
+            case BCF_BT_INT8: return int32_t(((const int8_t*)p)[i]);
+            case BCF_BT_INT16: { int16_t x; memcpy(&x, p + 2*i, 2); return int32_t(x); }
+            case BCF_BT_INT32: { int32_t x; memcpy(&x, p + 4*i, 4); return x; }
+        }
+        REQUIRE(false);
+        return int32_t(0);
+    };
+    int END = bcf_hdr_id2int(hdr, BCF_DT_ID, "END");
+    int DP = bcf_hdr_id2int(hdr, BCF_DT_ID, "DP");
+    int PL = bcf_hdr_id2int(hdr, BCF_DT_ID, "PL");
+    int SB = bcf_hdr_id2int(hdr, BCF_DT_ID, "SB");
+
+    for (const auto& rec : records) {
+        // view the serialized record
+        int memlen = GLnexus::bcf_raw_calc_packed_len(rec.get());
+        vector<uint8_t> buf(memlen);
+        GLnexus::bcf_raw_write_to_mem(rec.get(), memlen, buf.data());
+        GLnexus::bcf_raw_view view;
+        int reclen = 0;
+        REQUIRE(GLnexus::bcf_raw_view::of_mem(buf.data(), 0, buf.size(), view, reclen).ok());
+        REQUIRE(reclen == memlen);
+
+        // truncated buffer
+        GLnexus::bcf_raw_view view2;
+        REQUIRE(GLnexus::bcf_raw_view::of_mem(buf.data(), 0, buf.size()-1, view2, reclen) == GLnexus::StatusCode::INVALID);
+
+        // also view the bcf1_t directly, before it's unpacked
+        REQUIRE(GLnexus::bcf_raw_view::of_bcf1(rec.get(), view2).ok());
+        REQUIRE(bcf_unpack(rec.get(), BCF_UN_ALL) == 0);
+
+        for (const auto* v : {&view, &view2}) {
+            REQUIRE(v->rng() == GLnexus::range(rec));
+            REQUIRE(v->n_allele() == rec->n_allele);
+            REQUIRE(v->n_sample() == 1);
+            for (unsigned i = 0; i < rec->n_allele; i++) {
+                const char* al;
+                size_t len;
+                REQUIRE(v->allele(i, al, len).ok());
+                REQUIRE(string(al, len) == string(rec->d.allele[i]));
+            }
+            const char* al;
+            size_t len;
+            REQUIRE(v->allele(rec->n_allele, al, len) == GLnexus::StatusCode::INVALID);
+            bool is_ref = false;
+            REQUIRE(v->is_gvcf_ref_record(is_ref).ok());
+            REQUIRE(is_ref == GLnexus::is_gvcf_ref_record(rec.get()));
+
+            int type, n;
+            const uint8_t* data;
+            GLnexus::Status s = v->info(END, type, n, data);
+            bcf_info_t *info = bcf_get_info(hdr, rec.get(), "END");
+            if (info) {
+                REQUIRE(s.ok());
+                REQUIRE(n == 1);
+                REQUIRE(int_value(type, data, 0) == info->v1.i);
+            } else {
+                REQUIRE(s == GLnexus::StatusCode::NOT_FOUND);
+            }
+
+            REQUIRE(v->format(DP, type, n, data).ok());
+            REQUIRE(n == 1);
+            GLnexus::htsvecbox<int32_t> dp;
+            REQUIRE(bcf_get_format_int32(hdr, rec.get(), "DP", &dp.v, &dp.capacity) == 1);
+            REQUIRE(int_value(type, data, 0) == dp[0]);
+
+            REQUIRE(v->format(PL, type, n, data).ok());
+            REQUIRE(n == rec->n_allele*(rec->n_allele+1)/2);
+            GLnexus::htsvecbox<int32_t> pl;
+            REQUIRE(bcf_get_format_int32(hdr, rec.get(), "PL", &pl.v, &pl.capacity) == n);
+            for (int i = 0; i < n; i++) {
+                REQUIRE(int_value(type, data, i) == pl[i]);
+            }
+
+            REQUIRE(v->format(SB, type, n, data) == (is_ref ? GLnexus::StatusCode::NOT_FOUND : GLnexus::StatusCode::OK));
+        }
+    }
+
+    // a record without any alleles isn't a reference record
+    shared_ptr<bcf1_t> empty(bcf_init(), &bcf_destroy);
+    empty->rid = records[0]->rid;
+    empty->pos = records[0]->pos;
+    REQUIRE(empty->n_allele == 0);
+    REQUIRE_FALSE(GLnexus::is_gvcf_ref_record(empty.get()));
+    {
+        int memlen = GLnexus::bcf_raw_calc_packed_len(empty.get());
+        vector<uint8_t> buf(memlen);
+        GLnexus::bcf_raw_write_to_mem(empty.get(), memlen, buf.data());
+        GLnexus::bcf_raw_view view, view2;
+        int reclen = 0;
+        REQUIRE(GLnexus::bcf_raw_view::of_mem(buf.data(), 0, buf.size(), view, reclen).ok());
+        REQUIRE(GLnexus::bcf_raw_view::of_bcf1(empty.get(), view2).ok());
+        for (const auto* v : {&view, &view2}) {
+            REQUIRE(v->n_allele() == 0);
+            bool is_ref = true;
+            REQUIRE(v->is_gvcf_ref_record(is_ref).ok());
+            REQUIRE_FALSE(is_ref);
+        }
+    }
+
+    // a modified record can't be viewed
+    bcf_update_info_int32(hdr, records[0].get(), "END", nullptr, 0);
+    GLnexus::bcf_raw_view view;
+    REQUIRE(GLnexus::bcf_raw_view::of_bcf1(records[0].get(), view) == GLnexus::StatusCode::INVALID);
+}
+
+TEST_CASE("bcf_raw_split_int_formats") {
+    UPD(vcfFile, vcf, bcf_open("test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf", "r"), [](vcfFile* f) { bcf_close(f); });
+    UPD(bcf_hdr_t, hdr, bcf_hdr_read(vcf), &bcf_hdr_destroy);
+    shared_ptr<bcf1_t> vt;
+    vector<shared_ptr<bcf1_t>> records;
+
+    do {
+        if (vt) {
+            records.push_back(vt);
+        }
+        vt = shared_ptr<bcf1_t>(bcf_init(), &bcf_destroy);
+    } while (bcf_read(vcf, hdr, vt.get()) == 0);
+    REQUIRE(records.size() == 5);
+
+    vector<int> GT_DP = { bcf_hdr_id2int(hdr, BCF_DT_ID, "GT"), bcf_hdr_id2int(hdr, BCF_DT_ID, "DP") };
+    sort(GT_DP.begin(), GT_DP.end());
+
+    for (const auto& rec : records) {
+        int memlen = GLnexus::bcf_raw_calc_packed_len(rec.get());
+        vector<uint8_t> buf(memlen);
+        GLnexus::bcf_raw_write_to_mem(rec.get(), memlen, buf.data());
+
+        // split out the integer FORMAT fields: all of them, here
+        vector<uint8_t> rest;
+        vector<GLnexus::bcf_raw_format_entry> entries;
+        REQUIRE(GLnexus::bcf_raw_split_int_formats(buf.data(), buf.size(), rest, entries).ok());
+        REQUIRE(entries.size() == rec->n_fmt);
+        GLnexus::bcf_raw_view view;
+        int reclen = 0;
+        REQUIRE(GLnexus::bcf_raw_view::of_mem(rest.data(), 0, rest.size(), view, reclen).ok());
+        REQUIRE(reclen == rest.size());
+        REQUIRE(view.rng() == GLnexus::range(rec));
+        REQUIRE(view.n_fmt() == 0);
+        REQUIRE(view.n_sample() == 1);
+        for (unsigned j = 0; j < entries.size(); j++) {
+            REQUIRE(entries[j].position == j);
+            REQUIRE(bcf_hdr_id2type(hdr, BCF_HL_FMT, entries[j].key) == BCF_HT_INT);
+            REQUIRE(entries[j].n_values == entries[j].width);
+        }
+
+        // splicing them back restores the record exactly
+        vector<uint8_t> spliced;
+        REQUIRE(GLnexus::bcf_raw_splice_formats(rest.data(), rest.size(), entries, spliced).ok());
+        REQUIRE(spliced == buf);
+
+        // or just those selected, as bcf_raw_view::read would select them
+        for (auto& entry : entries) {
+            if (!binary_search(GT_DP.begin(), GT_DP.end(), entry.key)) {
+                entry.data = nullptr;
+            }
+        }
+        REQUIRE(GLnexus::bcf_raw_splice_formats(rest.data(), rest.size(), entries, spliced).ok());
+        REQUIRE(GLnexus::bcf_raw_view::of_mem(buf.data(), 0, buf.size(), view, reclen).ok());
+        shared_ptr<bcf1_t> selected(bcf_init(), &bcf_destroy);
+        REQUIRE(view.read(selected.get(), nullptr, &GT_DP).ok());
+        REQUIRE(selected->n_fmt == 2);
+        vector<uint8_t> selected_buf(GLnexus::bcf_raw_calc_packed_len(selected.get()));
+        GLnexus::bcf_raw_write_to_mem(selected.get(), selected_buf.size(), selected_buf.data());
+        REQUIRE(spliced == selected_buf);
+
+        // entries not fitting the record
+        entries.erase(entries.begin());
+        REQUIRE(GLnexus::bcf_raw_splice_formats(rest.data(), rest.size(), entries, spliced) == GLnexus::StatusCode::INVALID);
+    }
+}
+
 /*
 Ensure the code we've torn out remains functionally equivalent going
 forward -- i.e. the test should break in the unlikely event a future
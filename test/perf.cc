@@ -0,0 +1,66 @@
+#include <iostream>
+#include <thread>
+#include "perf.h"
+#include "catch.hpp"
+using namespace std;
+using namespace GLnexus;
+
+TEST_CASE("perf counters") {
+    perf::snapshot s0 = perf::current();
+
+    // counts from threads which have since exited are retained
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([](){
+            for (uint64_t i = 0; i < 1000; i++) {
+                perf::count(perf::counter::buckets_read);
+                perf::count(perf::counter::bucket_bytes_read, 10);
+                perf::record(perf::timer::fetch, i);
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    perf::count(perf::counter::output_records, 3);
+    {
+        perf::scoped_timer timer(perf::timer::write);
+        timer.stop();
+        timer.stop();
+    }
+
+    perf::snapshot s = perf::current();
+    s -= s0;
+    REQUIRE(s[perf::counter::buckets_read] == 4000);
+    REQUIRE(s[perf::counter::bucket_bytes_read] == 40000);
+    REQUIRE(s[perf::counter::output_records] == 3);
+    REQUIRE(s[perf::timer::fetch].count == 4000);
+    REQUIRE(s[perf::timer::fetch].total_us == 4*999*1000/2);
+    REQUIRE(s[perf::timer::write].count == 1);
+
+    // histogram bin i counts durations in [2^(i-1), 2^i) us
+    const perf::timing& fetch = s[perf::timer::fetch];
+    REQUIRE(fetch.histogram[0] == 4);
+    REQUIRE(fetch.histogram[1] == 4);
+    REQUIRE(fetch.histogram[2] == 8);
+    REQUIRE(fetch.histogram[10] == 4*(1000-512));
+    REQUIRE(fetch.quantile_us(0.5) == 512);
+    REQUIRE(fetch.quantile_us(0.99) == 1024);
+    REQUIRE(fetch.quantile_us(0.0) == 1);
+    REQUIRE(perf::timing().quantile_us(0.5) == 0);
+
+    perf::snapshot s2 = s;
+    s2 += s;
+    REQUIRE(s2[perf::counter::buckets_read] == 8000);
+    REQUIRE(s2[perf::timer::fetch].histogram[10] == 8*(1000-512));
+
+    ostringstream json;
+    REQUIRE(perf::report_json("test \"phase\"", 42, s, {{"rocksdb.block.cache.hit", 7}}, json).ok());
+    string txt = json.str();
+    REQUIRE(txt.find("{\"phase\":\"test \\\"phase\\\"\",\"elapsed_ms\":42,") == 0);
+    REQUIRE(txt.find("\"buckets_read\":4000") != string::npos);
+    REQUIRE(txt.find("\"fetch\":{\"count\":4000,\"total_ms\":1998,\"p50_us\":512,\"p99_us\":1024,\"max_us\":1024,") != string::npos);
+    REQUIRE(txt.find("\"extra\":{\"rocksdb.block.cache.hit\":7}}") != string::npos);
+    REQUIRE(txt.back() == '\n');
+    REQUIRE(count(txt.begin(), txt.end(), '\n') == 1);
+}
@@ -69,6 +69,19 @@ TEST_CASE("RocksDB open/initialize states") {
     REQUIRE(db->get(coll, "foo", v).ok());
     REQUIRE(v == "bar");
 
+    // batched lookup
+    REQUIRE(db->put(coll, "baz", "qux").ok());
+    std::vector<std::shared_ptr<KeyValue::Data>> values;
+    std::vector<Status> statuses;
+    REQUIRE(db->multi_get0(coll, {"foo", "bogus", "baz"}, values, statuses).ok());
+    REQUIRE(values.size() == 3);
+    REQUIRE(statuses.size() == 3);
+    REQUIRE(statuses[0].ok());
+    REQUIRE(values[0]->str() == "bar");
+    REQUIRE(statuses[1] == StatusCode::NOT_FOUND);
+    REQUIRE(statuses[2].ok());
+    REQUIRE(values[2]->str() == "qux");
+
     data.reset();
     db.reset();
 
@@ -110,6 +123,126 @@ TEST_CASE("RocksDB open/initialize states") {
     RocksKeyValue::destroy(dbPath);
 }
 
+TEST_CASE("RocksKeyValue sorted writes") {
+    string dbPath = createRandomDBFileName();
+    RocksKeyValue::config opt;
+    std::unique_ptr<KeyValue::DB> db;
+    REQUIRE(RocksKeyValue::Initialize(dbPath, opt, db).ok());
+    REQUIRE(db->create_collection("test").ok());
+    REQUIRE(db->create_collection("test2").ok());
+
+    // not supported outside of bulk-load mode
+    std::unique_ptr<KeyValue::WriteBatch> wb;
+    REQUIRE(db->begin_sorted_writes(wb) == StatusCode::NOT_IMPLEMENTED);
+    db.reset();
+
+    opt.mode = RocksKeyValue::OpenMode::BULK_LOAD;
+    REQUIRE(RocksKeyValue::Open(dbPath, opt, db).ok());
+    KeyValue::CollectionHandle coll, coll2;
+    REQUIRE(db->collection("test",coll).ok());
+    REQUIRE(db->collection("test2",coll2).ok());
+    REQUIRE(db->put(coll, "c", "memtable").ok());
+    REQUIRE(db->begin_sorted_writes(wb).ok());
+    REQUIRE(wb->put(coll, "a", "1").ok());
+    REQUIRE(wb->put(coll2, "a", "x").ok());
+    REQUIRE(wb->put(coll, "b", "2").ok());
+    REQUIRE(wb->put(coll, "c", "3").ok());
+    // out of order: begins another file, which takes precedence
+    REQUIRE(wb->put(coll, "b", "4").ok());
+    std::string v;
+    REQUIRE(db->get(coll, "a", v) == StatusCode::NOT_FOUND);
+    REQUIRE(wb->commit().ok());
+    wb.reset();
+
+    REQUIRE(db->get(coll, "a", v).ok());
+    REQUIRE(v == "1");
+    REQUIRE(db->get(coll, "b", v).ok());
+    REQUIRE(v == "4");
+    REQUIRE(db->get(coll, "c", v).ok());
+    REQUIRE(v == "3");
+    REQUIRE(db->get(coll2, "a", v).ok());
+    REQUIRE(v == "x");
+
+    // uncommitted writes are discarded
+    REQUIRE(db->begin_sorted_writes(wb).ok());
+    REQUIRE(wb->put(coll, "d", "5").ok());
+    wb.reset();
+    REQUIRE(db->get(coll, "d", v) == StatusCode::NOT_FOUND);
+    db.reset();
+
+    // the ingested data persist
+    opt.mode = RocksKeyValue::OpenMode::READ_ONLY;
+    REQUIRE(RocksKeyValue::Open(dbPath, opt, db).ok());
+    REQUIRE(db->collection("test",coll).ok());
+    REQUIRE(db->get(coll, "b", v).ok());
+    REQUIRE(v == "4");
+    db.reset();
+
+    RocksKeyValue::destroy(dbPath);
+}
+
+TEST_CASE("RocksKeyValue compression dictionaries") {
+    string dbPath = createRandomDBFileName();
+    RocksKeyValue::config opt;
+    opt.compression_dict_bytes = 16384;
+    opt.dict_collections = { "test" };
+    std::unique_ptr<KeyValue::DB> db;
+    REQUIRE(RocksKeyValue::Initialize(dbPath, opt, db).ok());
+    REQUIRE(db->create_collection("test").ok());
+    REQUIRE(db->create_collection("test2").ok());
+    db.reset();
+
+    // many similar values, through both the memtable and sorted writes
+    auto value = [](int i) {
+        ostringstream os;
+        for (int j = 0; j < 100; j++) {
+            os << "chr21\t" << (i*1000 + j) << "\t.\tA\t<NON_REF>\t.\t.\tEND=" << (i*1000 + j + 1)
+               << "\tGT:DP:GQ:MIN_DP:PL\t0/0:" << (j % 40) << ":99:" << (j % 30) << ":0,60,900\n";
+        }
+        return os.str();
+    };
+    auto key = [](int i) {
+        ostringstream os;
+        os << setfill('0') << setw(8) << i;
+        return os.str();
+    };
+    opt.mode = RocksKeyValue::OpenMode::BULK_LOAD;
+    REQUIRE(RocksKeyValue::Open(dbPath, opt, db).ok());
+    KeyValue::CollectionHandle coll, coll2;
+    REQUIRE(db->collection("test",coll).ok());
+    REQUIRE(db->collection("test2",coll2).ok());
+    std::unique_ptr<KeyValue::WriteBatch> wb;
+    REQUIRE(db->begin_sorted_writes(wb).ok());
+    for (int i = 0; i < 500; i++) {
+        REQUIRE(wb->put(coll, key(i), value(i)).ok());
+        REQUIRE(wb->put(coll2, key(i), value(i)).ok());
+    }
+    REQUIRE(wb->commit().ok());
+    wb.reset();
+    for (int i = 500; i < 1000; i++) {
+        REQUIRE(db->put(coll, key(i), value(i)).ok());
+    }
+    REQUIRE(db->flush().ok());
+    db.reset();
+
+    // the files are readable without the configuration
+    opt = RocksKeyValue::config();
+    opt.mode = RocksKeyValue::OpenMode::READ_ONLY;
+    REQUIRE(RocksKeyValue::Open(dbPath, opt, db).ok());
+    REQUIRE(db->collection("test",coll).ok());
+    REQUIRE(db->collection("test2",coll2).ok());
+    std::string v;
+    for (int i : {0, 1, 250, 499, 500, 777, 999}) {
+        REQUIRE(db->get(coll, key(i), v).ok());
+        REQUIRE(v == value(i));
+    }
+    REQUIRE(db->get(coll2, key(321), v).ok());
+    REQUIRE(v == value(321));
+    db.reset();
+
+    RocksKeyValue::destroy(dbPath);
+}
+
 TEST_CASE("RocksDB initialization") {
     std::string dbPath = createRandomDBFileName();
     RocksKeyValue::config opt;
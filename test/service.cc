@@ -1,6 +1,10 @@
 #include <iostream>
 #include <algorithm>
+#include <fstream>
+#include <map>
+#include <sys/stat.h>
 #include <vcf.h>
+#include <tbx.h>
 #include "service.h"
 #include "unifier.h"
 #include "genotyper.h"
@@ -34,17 +38,43 @@ public:
     }
 
     Status dataset_range(const string& dataset, const bcf_hdr_t *hdr, const range& pos,
-                         bcf_predicate predicate, vector<shared_ptr<bcf1_t>>* records) override {
+                         bcf_predicate predicate, vector<shared_ptr<bcf1_t>>* records,
+                         const bcf_field_selection* fields = nullptr) override {
         if (i_++ % fail_every_ == 0) {
             failed_once_ = true;
             return Status::IOError("SIM");
         }
-        return inner_.dataset_range(dataset, hdr, pos, predicate, records);
+        return inner_.dataset_range(dataset, hdr, pos, predicate, records, fields);
     }
 
     bool failed_once() { return failed_once_; }
 };
 
+TEST_CASE("DatasetSampleIndex") {
+    DatasetSampleIndex index({"ch", "fa", "gr"});
+    REQUIRE(index.samples().size() == 3);
+
+    shared_ptr<bcf_hdr_t> hdr(bcf_hdr_init("w"), &bcf_hdr_destroy);
+    REQUIRE(bcf_hdr_add_sample(hdr.get(), "fa") == 0);
+    REQUIRE(bcf_hdr_add_sample(hdr.get(), "mo") == 0);
+    REQUIRE(bcf_hdr_add_sample(hdr.get(), "ch") == 0);
+    bcf_hdr_sync(hdr.get());
+
+    auto e = index.get("trio", hdr.get());
+    REQUIRE(e->mapping == (map<int,int>{{0, 1}, {2, 0}}));
+    REQUIRE(e->bcf_samples == (vector<unsigned>{0, 2}));
+
+    // the entry is built just once per dataset
+    REQUIRE(index.get("trio", hdr.get()) == e);
+
+    shared_ptr<bcf_hdr_t> hdr2(bcf_hdr_init("w"), &bcf_hdr_destroy);
+    REQUIRE(bcf_hdr_add_sample(hdr2.get(), "xx") == 0);
+    bcf_hdr_sync(hdr2.get());
+    auto e2 = index.get("other", hdr2.get());
+    REQUIRE(e2->mapping.empty());
+    REQUIRE(e2->bcf_samples.empty());
+}
+
 TEST_CASE("service::discover_alleles") {
     unique_ptr<VCFData> data;
     Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
@@ -106,6 +136,30 @@ TEST_CASE("service::discover_alleles") {
         REQUIRE(mals[6].empty());
     }
 
+    SECTION("multiple ranges, merged") {
+        vector<range> ranges;
+        ranges.push_back(range(0, 1000, 1001));
+        ranges.push_back(range(0, 1001, 1002));
+        ranges.push_back(range(0, 1010, 1013));
+        ranges.push_back(range(1, 1000, 1001));
+        ranges.push_back(range(1, 1010, 1012));
+        ranges.push_back(range(2, 1001, 1002));
+        vector<discovered_alleles> mals;
+        s = svc->discover_alleles("<ALL>", ranges, N, mals);
+        REQUIRE(s.ok());
+        discovered_alleles expected;
+        for (const auto& dsals : mals) {
+            REQUIRE(merge_discovered_alleles(dsals, expected).ok());
+        }
+
+        N = 0;
+        s = svc->discover_alleles("<ALL>", ranges, N, als);
+        REQUIRE(s.ok());
+        REQUIRE(N == 6);
+        REQUIRE(als.size() == 16);
+        REQUIRE(als == expected);
+    }
+
     SECTION("allele overlaps two ranges") {
         vector<range> ranges;
         ranges.push_back(range(1, 1000, 1002));
@@ -623,4 +677,578 @@ TEST_CASE("genotype residuals") {
     // It seems that a list of documents split by --- symbols
     // are parsed as a yaml map.
     REQUIRE(resFile.IsMap());
+
+    // sharded, the residuals are identical, in the same (site) order
+    ifstream ifs("/tmp/GLnexus_unit_tests.residuals.yml");
+    stringstream expected;
+    expected << ifs.rdbuf();
+    for (size_t shards : {2, 3}) {
+        const string prefix = "/tmp/GLnexus_unit_tests_residuals" + std::to_string(shards);
+        s = svc->genotype_sites_sharded(cfg, string("<ALL>"), sites, shards, prefix + ".bcf");
+        REQUIRE(s.ok());
+        ifstream ifs_sharded(prefix + ".residuals.yml");
+        stringstream actual;
+        actual << ifs_sharded.rdbuf();
+        REQUIRE(actual.str() == expected.str());
+    }
+}
+
+TEST_CASE("genotype residuals, binary") {
+    unique_ptr<VCFData> data;
+    Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
+    REQUIRE(s.ok());
+    unique_ptr<Service> svc;
+    s = Service::Start(service_config(), *data, *data, svc);
+    REQUIRE(s.ok());
+
+    discovered_alleles als;
+    unsigned N;
+    s = svc->discover_alleles("<ALL>", range(0, 0, 1000000), N, als);
+    REQUIRE(s.ok());
+
+    vector<unified_site> sites;
+    unifier_stats stats;
+    s = unified_sites(unifier_config(), N, als, sites, stats);
+    REQUIRE(s.ok());
+
+    genotyper_config cfg;
+    cfg.output_residuals = true;
+    s = svc->genotype_sites(cfg, string("<ALL>"), sites, "/tmp/GLnexus_unit_tests.bcf");
+    REQUIRE(s.ok());
+    ifstream ifs("/tmp/GLnexus_unit_tests.residuals.yml");
+    stringstream expected;
+    expected << ifs.rdbuf();
+    REQUIRE(expected.str().size() > 0);
+
+    // the binary residuals, converted to YAML, should be identical to the
+    // YAML residuals, however many shards they're written in
+    cfg.residuals_format = GLnexusResidualsFormat::BINARY;
+    for (size_t shards : {1, 2, 3}) {
+        const string prefix = "/tmp/GLnexus_unit_tests_binary_residuals" + std::to_string(shards);
+        s = svc->genotype_sites_sharded(cfg, string("<ALL>"), sites, shards, prefix + ".bcf");
+        REQUIRE(s.ok());
+
+        stringstream actual;
+        s = residuals_yaml_of_binary(prefix + ".residuals.cflat.gz", actual);
+        REQUIRE(s.ok());
+        REQUIRE(actual.str() == expected.str());
+    }
+
+    // reject a non-residuals file
+    stringstream devnull;
+    s = residuals_yaml_of_binary("/tmp/GLnexus_unit_tests.bcf", devnull);
+    REQUIRE(s.bad());
+}
+
+TEST_CASE("genotype site groups") {
+    unique_ptr<VCFData> data;
+    Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
+    REQUIRE(s.ok());
+    unique_ptr<Service> svc;
+    s = Service::Start(service_config(), *data, *data, svc);
+    REQUIRE(s.ok());
+
+    discovered_alleles als0, als1, als;
+    unsigned N;
+    s = svc->discover_alleles("<ALL>", range(0, 0, 1000000), N, als0);
+    REQUIRE(s.ok());
+    s = svc->discover_alleles("<ALL>", range(1, 0, 1000000), N, als1);
+    REQUIRE(s.ok());
+    REQUIRE(merge_discovered_alleles(als0, als).ok());
+    REQUIRE(merge_discovered_alleles(als1, als).ok());
+
+    vector<unified_site> sites;
+    unifier_stats stats;
+    s = unified_sites(unifier_config(), N, als, sites, stats);
+    REQUIRE(s.ok());
+    REQUIRE(sites.size() > 2);
+
+    genotyper_config cfg;
+    cfg.output_format = GLnexusOutputFormat::VCF;
+    auto genotype_vcf = [&](size_t grid_bp, size_t grid_max_sites, string& ans, size_t shards = 1,
+                            size_t slice_samples = 0, size_t prefetch_distance = 0,
+                            memory_budget* budget = nullptr) {
+        service_config svc_cfg;
+        svc_cfg.genotype_grid_bp = grid_bp;
+        svc_cfg.genotype_grid_max_sites = grid_max_sites;
+        svc_cfg.genotype_slice_samples = slice_samples;
+        svc_cfg.prefetch_distance = prefetch_distance;
+        svc_cfg.budget = budget;
+        unique_ptr<Service> svc2;
+        Status ls = Service::Start(svc_cfg, *data, *data, svc2);
+        if (ls.bad()) return ls;
+        const string tfn("/tmp/GLnexus_unit_tests_groups.vcf");
+        ls = svc2->genotype_sites_sharded(cfg, string("<ALL>"), sites, shards, tfn);
+        if (ls.bad()) return ls;
+        ifstream ifs(tfn);
+        stringstream ss;
+        ss << ifs.rdbuf();
+        ans = ss.str();
+        return Status::OK();
+    };
+
+    // one site per group, equivalent to genotyping each site individually
+    string expected;
+    REQUIRE(genotype_vcf(30000, 1, expected).ok());
+    REQUIRE(expected.size() > 0);
+
+    SECTION("one group per contig") {
+        string actual;
+        REQUIRE(genotype_vcf(1000000, 1000000, actual).ok());
+        REQUIRE(actual == expected);
+    }
+
+    SECTION("small groups") {
+        string actual;
+        REQUIRE(genotype_vcf(1000, 2, actual).ok());
+        REQUIRE(actual == expected);
+    }
+
+    SECTION("sharded output") {
+        string actual;
+        REQUIRE(genotype_vcf(30000, 32, actual, 3).ok());
+        REQUIRE(actual == expected);
+    }
+
+    SECTION("sample slices") {
+        string actual;
+        REQUIRE(genotype_vcf(30000, 1, actual, 1, 1).ok());
+        REQUIRE(actual == expected);
+        REQUIRE(genotype_vcf(1000, 2, actual, 1, 3).ok());
+        REQUIRE(actual == expected);
+    }
+
+    SECTION("read-ahead") {
+        string actual;
+        REQUIRE(genotype_vcf(1000, 2, actual, 1, 0, 4).ok());
+        REQUIRE(actual == expected);
+        REQUIRE(genotype_vcf(30000, 1, actual, 3, 0, 1).ok());
+        REQUIRE(actual == expected);
+    }
+
+    SECTION("memory budget") {
+        // a budget with no room admits only the tasks needed for progress
+        for (size_t total : {(size_t) 0, (size_t) 1000, (size_t) 1 << 30}) {
+            memory_budget budget(total);
+            string actual;
+            REQUIRE(genotype_vcf(1000, 2, actual, 1, 0, 0, &budget).ok());
+            REQUIRE(actual == expected);
+            REQUIRE(genotype_vcf(30000, 1, actual, 3, 0, 0, &budget).ok());
+            REQUIRE(actual == expected);
+            REQUIRE(budget.in_use() == 0);
+
+            // also discovery across several ranges
+            service_config svc_cfg;
+            svc_cfg.threads = 2;
+            svc_cfg.budget = &budget;
+            unique_ptr<Service> svc2;
+            REQUIRE(Service::Start(svc_cfg, *data, *data, svc2).ok());
+            vector<range> ranges;
+            for (int rid = 0; rid < 2; rid++) {
+                for (int beg = 0; beg < 1000000; beg += 1000) {
+                    ranges.push_back(range(rid, beg, beg+1000));
+                }
+            }
+            discovered_alleles als2;
+            unsigned N2;
+            REQUIRE(svc2->discover_alleles("<ALL>", ranges, N2, als2).ok());
+            REQUIRE(N2 == N);
+            REQUIRE(als2 == als);
+            REQUIRE(budget.in_use() == 0);
+        }
+    }
+}
+
+TEST_CASE("genotype_sites_checkpointed") {
+    unique_ptr<VCFData> data;
+    Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
+    REQUIRE(s.ok());
+    unique_ptr<Service> svc;
+    s = Service::Start(service_config(), *data, *data, svc);
+    REQUIRE(s.ok());
+
+    discovered_alleles als;
+    unsigned N;
+    s = svc->discover_alleles("<ALL>", {range(0, 0, 1000000), range(1, 0, 1000000)}, N, als);
+    REQUIRE(s.ok());
+    vector<unified_site> sites;
+    unifier_stats stats;
+    s = unified_sites(unifier_config(), N, als, sites, stats);
+    REQUIRE(s.ok());
+    REQUIRE(sites.size() > 4);
+
+    genotyper_config cfg;
+    cfg.output_format = GLnexusOutputFormat::VCF;
+    auto slurp = [](const string& fn) {
+        ifstream ifs(fn);
+        stringstream ss;
+        ss << ifs.rdbuf();
+        return ss.str();
+    };
+    const string expected_fn("/tmp/GLnexus_unit_tests_checkpointed_expected.vcf");
+    REQUIRE(svc->genotype_sites(cfg, string("<ALL>"), sites, expected_fn).ok());
+    const string expected = slurp(expected_fn);
+    REQUIRE(expected.size() > 0);
+
+    const string ckpt("/tmp/GLnexus_unit_tests_checkpoint");
+    const string tfn("/tmp/GLnexus_unit_tests_checkpointed.vcf");
+    REQUIRE(system(("rm -rf " + ckpt).c_str()) == 0);
+
+    SECTION("uninterrupted") {
+        for (size_t in_flight : {1, 3}) {
+            s = svc->genotype_sites_checkpointed(cfg, "<ALL>", sites, 2, in_flight, ckpt, tfn);
+            REQUIRE(s.ok());
+            REQUIRE(slurp(tfn) == expected);
+            // the checkpoint is removed on success
+            struct stat st;
+            REQUIRE(stat(ckpt.c_str(), &st) != 0);
+        }
+    }
+
+    SECTION("resumed") {
+        // all the chunks are committed, but writing the output fails
+        s = svc->genotype_sites_checkpointed(cfg, "<ALL>", sites, 2, 2, ckpt,
+                                             "/tmp/GLnexus_unit_tests_nonexistent/out.vcf");
+        REQUIRE(s == StatusCode::IO_ERROR);
+        ifstream manifest(ckpt + "/manifest.yml");
+        REQUIRE(manifest.good());
+
+        // as if the job had been interrupted before committing chunk 1
+        REQUIRE(remove((ckpt + "/part1").c_str()) == 0);
+
+        // resuming with a different job fails
+        s = svc->genotype_sites_checkpointed(cfg, "<ALL>", sites, 3, 2, ckpt, tfn);
+        REQUIRE(s == StatusCode::INVALID);
+        vector<unified_site> sites2(sites.begin(), sites.end()-1);
+        s = svc->genotype_sites_checkpointed(cfg, "<ALL>", sites2, 2, 2, ckpt, tfn);
+        REQUIRE(s == StatusCode::INVALID);
+
+        // resuming genotypes just chunk 1
+        uint64_t genotyped0 = perf::current()[perf::counter::sites_genotyped];
+        s = svc->genotype_sites_checkpointed(cfg, "<ALL>", sites, 2, 2, ckpt, tfn);
+        REQUIRE(s.ok());
+        REQUIRE(perf::current()[perf::counter::sites_genotyped] - genotyped0 == 2);
+        REQUIRE(slurp(tfn) == expected);
+    }
+
+    SECTION("residuals and header") {
+        cfg.output_residuals = true;
+        s = svc->genotype_sites_checkpointed(cfg, "<ALL>", sites, 2, 2, ckpt, tfn);
+        REQUIRE(s == StatusCode::INVALID);
+        cfg.output_residuals = false;
+
+        // without the header, as a later shard of genotype_sites_shard
+        REQUIRE(svc->genotype_sites_shard(cfg, "<ALL>", sites, 1, expected_fn).ok());
+        s = svc->genotype_sites_checkpointed(cfg, "<ALL>", sites, 2, 2, ckpt, tfn, false);
+        REQUIRE(s.ok());
+        REQUIRE(slurp(tfn) == slurp(expected_fn));
+    }
+}
+
+TEST_CASE("genotype_sites_incremental") {
+    unique_ptr<VCFData> data;
+    Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
+    REQUIRE(s.ok());
+    unique_ptr<Service> svc;
+    s = Service::Start(service_config(), *data, *data, svc);
+    REQUIRE(s.ok());
+    const vector<range> ranges = { range(0, 0, 1000000), range(1, 0, 1000000) };
+
+    // the prior cohort, trio1
+    discovered_alleles prior_als;
+    unsigned prior_N;
+    s = svc->discover_alleles("discover_alleles_trio1", ranges, prior_N, prior_als);
+    REQUIRE(s.ok());
+    vector<unified_site> prior_sites;
+    unifier_stats stats;
+    REQUIRE(unified_sites(unifier_config(), prior_N, prior_als, prior_sites, stats).ok());
+    genotyper_config cfg;
+    cfg.output_format = GLnexusOutputFormat::VCF;
+    const string prior_fn("/tmp/GLnexus_unit_tests_incremental_prior.vcf");
+    REQUIRE(svc->genotype_sites(cfg, "discover_alleles_trio1", prior_sites, prior_fn).ok());
+
+    // add trio2, discovering its alleles only
+    discovered_alleles als;
+    unsigned added_N;
+    s = svc->discover_alleles("discover_alleles_trio2", ranges, added_N, als);
+    REQUIRE(s.ok());
+    REQUIRE(merge_discovered_alleles(prior_als, als).ok());
+    vector<unified_site> sites;
+    REQUIRE(unified_sites(unifier_config(), prior_N + added_N, als, sites, stats).ok());
+
+    auto slurp = [](const string& fn) {
+        ifstream ifs(fn);
+        stringstream ss;
+        ss << ifs.rdbuf();
+        return ss.str();
+    };
+    const string expected_fn("/tmp/GLnexus_unit_tests_incremental_expected.vcf");
+    REQUIRE(svc->genotype_sites(cfg, "<ALL>", sites, expected_fn).ok());
+    string expected = slurp(expected_fn);
+    REQUIRE(expected.size() > 0);
+
+    SECTION("same output as genotyping the whole cohort") {
+        const string fn("/tmp/GLnexus_unit_tests_incremental.vcf");
+        size_t reused = 0;
+        s = svc->genotype_sites_incremental(cfg, "<ALL>", "discover_alleles_trio2", prior_sites,
+                                            prior_fn, sites, fn, &reused);
+        REQUIRE(s.ok());
+        REQUIRE(reused > 0);
+        REQUIRE(reused <= sites.size());
+        REQUIRE(slurp(fn) == expected);
+
+        // with nothing reusable, everything is genotyped afresh
+        s = svc->genotype_sites_incremental(cfg, "<ALL>", "discover_alleles_trio2", {},
+                                            prior_fn, sites, fn, &reused);
+        REQUIRE(s.ok());
+        REQUIRE(reused == 0);
+        REQUIRE(slurp(fn) == expected);
+    }
+
+    SECTION("invalid") {
+        const string fn("/tmp/GLnexus_unit_tests_incremental.vcf");
+        // the added samples overlap the prior output
+        s = svc->genotype_sites_incremental(cfg, "<ALL>", "discover_alleles_trio2", prior_sites,
+                                            expected_fn, sites, fn);
+        REQUIRE(s == StatusCode::INVALID);
+        // the prior output has samples outside the sample set
+        s = svc->genotype_sites_incremental(cfg, "discover_alleles_trio2", "discover_alleles_trio2",
+                                            prior_sites, prior_fn, sites, fn);
+        REQUIRE(s == StatusCode::INVALID);
+
+        genotyper_config trim_cfg = cfg;
+        trim_cfg.trim_uncalled_alleles = true;
+        s = svc->genotype_sites_incremental(trim_cfg, "<ALL>", "discover_alleles_trio2", prior_sites,
+                                            prior_fn, sites, fn);
+        REQUIRE(s == StatusCode::INVALID);
+    }
+}
+
+TEST_CASE("genotype_sites_sharded BCF") {
+    unique_ptr<VCFData> data;
+    Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
+    REQUIRE(s.ok());
+    unique_ptr<Service> svc;
+    s = Service::Start(service_config(), *data, *data, svc);
+    REQUIRE(s.ok());
+
+    discovered_alleles als;
+    unsigned N;
+    s = svc->discover_alleles("<ALL>", range(0, 0, 1000000), N, als);
+    REQUIRE(s.ok());
+    vector<unified_site> sites;
+    unifier_stats stats;
+    s = unified_sites(unifier_config(), N, als, sites, stats);
+    REQUIRE(s.ok());
+    REQUIRE(sites.size() > 2);
+
+    const string tfn("/tmp/GLnexus_unit_tests_sharded.bcf");
+    genotyper_config cfg;
+    cfg.output_index = true;
+    s = svc->genotype_sites_sharded(cfg, string("<ALL>"), sites, 3, tfn);
+    REQUIRE(s.ok());
+
+    // read back the concatenated BCF and check we get all the records, in
+    // order; also check the index is usable
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(tfn.c_str(), "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    REQUIRE(vcf);
+    shared_ptr<bcf_hdr_t> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    REQUIRE(hdr);
+    shared_ptr<bcf1_t> bcf(bcf_init(), &bcf_destroy);
+    size_t n = 0;
+    while (bcf_read(vcf.get(), hdr.get(), bcf.get()) == 0) {
+        REQUIRE(n < sites.size());
+        REQUIRE(bcf->pos == sites[n].pos.beg);
+        n++;
+    }
+    REQUIRE(n == sites.size());
+
+    hts_idx_t* idx = bcf_index_load(tfn.c_str());
+    REQUIRE(idx != nullptr);
+    hts_idx_destroy(idx);
+}
+
+TEST_CASE("genotype_sites SPARSE") {
+    unique_ptr<VCFData> data;
+    Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
+    REQUIRE(s.ok());
+    unique_ptr<Service> svc;
+    s = Service::Start(service_config(), *data, *data, svc);
+    REQUIRE(s.ok());
+
+    discovered_alleles als;
+    unsigned N;
+    s = svc->discover_alleles("<ALL>", {range(0, 0, 1000000), range(1, 0, 1000000)}, N, als);
+    REQUIRE(s.ok());
+    vector<unified_site> sites;
+    unifier_stats stats;
+    s = unified_sites(unifier_config(), N, als, sites, stats);
+    REQUIRE(s.ok());
+    REQUIRE(sites.size() > 2);
+
+    genotyper_config cfg;
+    cfg.output_format = GLnexusOutputFormat::VCF;
+    const string vcf_fn("/tmp/GLnexus_unit_tests_sparse.vcf");
+    REQUIRE(svc->genotype_sites(cfg, string("<ALL>"), sites, vcf_fn).ok());
+
+    auto read_lines = [](const string& fn) {
+        ifstream ifs(fn);
+        vector<string> ans;
+        string line;
+        while (getline(ifs, line)) {
+            ans.push_back(line);
+        }
+        return ans;
+    };
+    auto split_tabs = [](const string& line) {
+        istringstream ss(line);
+        vector<string> ans;
+        string col;
+        while (getline(ss, col, '\t')) {
+            ans.push_back(col);
+        }
+        return ans;
+    };
+
+    // the sparse equivalent of each VCF record: the most frequent cell, the
+    // next most frequent with the runs of samples having it, and the others
+    vector<string> vcf_lines = read_lines(vcf_fn), expected;
+    size_t n_records = 0;
+    for (const auto& line : vcf_lines) {
+        if (line.substr(0, 13) == "##fileformat=") {
+            // the header, with its own file format and the samples on a line
+            // of their own
+            expected.push_back("##fileformat=GLnexusSparseV1");
+            continue;
+        } else if (line.substr(0, 6) == "#CHROM") {
+            auto cols = split_tabs(line);
+            REQUIRE(cols.size() > 9);
+            string chrom, samples;
+            for (size_t c = 0; c < cols.size(); c++) {
+                if (c < 8) {
+                    chrom += (c ? "\t" : "") + cols[c];
+                } else if (c > 8) {
+                    samples += (c > 9 ? "\t" : "") + cols[c];
+                }
+            }
+            expected.push_back("##GLnexusSparseVCF=" + vcf_lines[0].substr(13));
+            expected.push_back("##GLnexusSparseSamples=" + samples);
+            expected.push_back(chrom);
+            continue;
+        } else if (line[0] == '#') {
+            expected.push_back(line);
+            continue;
+        }
+        n_records++;
+        auto cols = split_tabs(line);
+        REQUIRE(cols.size() > 9);
+        string ans;
+        for (size_t c = 0; c < 9; c++) {
+            ans += (c ? "\t" : "") + cols[c];
+        }
+        map<string, size_t> counts;
+        for (size_t i = 9; i < cols.size(); i++) {
+            counts[cols[i]]++;
+        }
+        string default_cell, run_cell;
+        size_t default_count = 0, run_count = 0;
+        for (size_t i = 9; i < cols.size(); i++) {
+            size_t n = counts[cols[i]];
+            if (cols[i] == default_cell || cols[i] == run_cell) {
+                continue;
+            } else if (n > default_count) {
+                run_cell = default_cell;
+                run_count = default_count;
+                default_cell = cols[i];
+                default_count = n;
+            } else if (n > run_count) {
+                run_cell = cols[i];
+                run_count = n;
+            }
+        }
+        string runs, cells;
+        for (size_t i = 0; i+9 < cols.size(); i++) {
+            if (run_count && cols[i+9] == run_cell) {
+                size_t j = i;
+                while (j+10 < cols.size() && cols[j+10] == run_cell) {
+                    j++;
+                }
+                runs += (runs.empty() ? "" : ",") + to_string(i);
+                if (j > i) {
+                    runs += "-" + to_string(j);
+                }
+                i = j;
+            } else if (cols[i+9] != default_cell) {
+                cells += "\t" + to_string(i) + "=" + cols[i+9];
+            }
+        }
+        expected.push_back(ans + "\t" + default_cell + "\t" + (run_count ? run_cell : ".")
+                           + "\t" + (runs.empty() ? "." : runs) + cells);
+    }
+    REQUIRE(n_records == sites.size());
+
+    // the expected lines, besides the one describing the format, and decoding
+    // back to the VCF
+    auto check_sparse = [&](const string& fn) {
+        vector<string> lines = read_lines(fn);
+        REQUIRE(lines.size() == expected.size() + 1);
+        size_t j = 0;
+        for (const auto& line : lines) {
+            if (line.substr(0, 16) == "##GLnexusSparse=") {
+                continue;
+            }
+            REQUIRE(j < expected.size());
+            REQUIRE(line == expected[j++]);
+        }
+        REQUIRE(j == expected.size());
+
+        genotyper_config vcf_cfg;
+        vcf_cfg.output_format = GLnexusOutputFormat::VCF;
+        const string decoded_fn("/tmp/GLnexus_unit_tests_sparse_decoded.vcf");
+        REQUIRE(Service::sparse_to_vcf(vcf_cfg, fn, decoded_fn).ok());
+        REQUIRE(read_lines(decoded_fn) == vcf_lines);
+    };
+
+    cfg.output_format = GLnexusOutputFormat::SPARSE;
+    SECTION("one writer") {
+        const string fn("/tmp/GLnexus_unit_tests_sparse.svcf");
+        REQUIRE(svc->genotype_sites(cfg, string("<ALL>"), sites, fn).ok());
+        check_sparse(fn);
+    }
+
+    SECTION("sharded") {
+        const string fn("/tmp/GLnexus_unit_tests_sparse_sharded.svcf");
+        REQUIRE(svc->genotype_sites_sharded(cfg, string("<ALL>"), sites, 3, fn).ok());
+        check_sparse(fn);
+    }
+
+    SECTION("compressed and indexed") {
+        const string fn("/tmp/GLnexus_unit_tests_sparse.svcf.gz");
+        cfg.output_index = true;
+        REQUIRE(svc->genotype_sites_sharded(cfg, string("<ALL>"), sites, 2, fn).ok());
+        REQUIRE(system(("gzip -dc " + fn + " > /tmp/GLnexus_unit_tests_sparse_gz.svcf").c_str()) == 0);
+        check_sparse("/tmp/GLnexus_unit_tests_sparse_gz.svcf");
+        genotyper_config vcf_cfg;
+        vcf_cfg.output_format = GLnexusOutputFormat::VCF;
+        REQUIRE(Service::sparse_to_vcf(vcf_cfg, fn, "/tmp/GLnexus_unit_tests_sparse_gz_decoded.vcf").ok());
+        REQUIRE(read_lines("/tmp/GLnexus_unit_tests_sparse_gz_decoded.vcf") == vcf_lines);
+        tbx_t* tbx = tbx_index_load(fn.c_str());
+        REQUIRE(tbx != nullptr);
+        tbx_destroy(tbx);
+    }
+
+    SECTION("decode only SPARSE") {
+        genotyper_config vcf_cfg;
+        vcf_cfg.output_format = GLnexusOutputFormat::VCF;
+        s = Service::sparse_to_vcf(vcf_cfg, vcf_fn, "/tmp/GLnexus_unit_tests_sparse_decoded.vcf");
+        REQUIRE(s == StatusCode::INVALID);
+    }
+
+    SECTION("incremental unsupported") {
+        size_t reused = 0;
+        s = svc->genotype_sites_incremental(cfg, "<ALL>", "<ALL>", sites, vcf_fn, sites,
+                                            "/tmp/GLnexus_unit_tests_sparse_incr.svcf", &reused);
+        REQUIRE(s == StatusCode::NOT_IMPLEMENTED);
+    }
 }
@@ -265,6 +265,69 @@ TEST_CASE("yaml_of_discovered_alleles") {
     }
 }
 
+TEST_CASE("merge_discovered_alleles") {
+    auto mk = [](int beg, const char* dna, bool is_ref, unsigned copies) {
+        discovered_allele_info ai;
+        ai.is_ref = is_ref;
+        ai.topAQ.V[0] = 99;
+        ai.zGQ.M[0][0] = copies;
+        return make_pair(allele(range(0, beg, beg+1), dna), ai);
+    };
+
+    SECTION("sorted table") {
+        discovered_alleles dal;
+        REQUIRE(dal.insert(mk(200, "A", true, 1)).second);
+        REQUIRE(dal.insert(mk(100, "G", false, 1)).second);
+        REQUIRE(dal.insert(mk(100, "A", true, 1)).second);
+        REQUIRE(dal.insert(mk(300, "C", true, 1)).second);
+        REQUIRE_FALSE(dal.insert(mk(100, "G", false, 5)).second);
+        REQUIRE(dal.size() == 4);
+        REQUIRE(is_sorted(dal.begin(), dal.end(),
+                          [](const discovered_alleles::value_type& lhs, const discovered_alleles::value_type& rhs) {
+                              return lhs.first < rhs.first;
+                          }));
+        REQUIRE(dal.find(allele(range(0, 100, 101), "G"))->second.zGQ.copy_number() == 1);
+        REQUIRE(dal.find(allele(range(0, 100, 101), "T")) == dal.end());
+        REQUIRE(dal.erase(allele(range(0, 200, 201), "A")) == 1);
+        REQUIRE(dal.count(allele(range(0, 200, 201), "A")) == 0);
+        REQUIRE(dal.size() == 3);
+    }
+
+    discovered_alleles dal1 { mk(100, "A", true, 1), mk(100, "G", false, 1), mk(300, "C", true, 1) };
+    discovered_alleles dal2 { mk(100, "A", true, 2), mk(200, "T", true, 2) };
+    discovered_alleles dal3 { mk(50, "C", true, 3), mk(100, "G", false, 3), mk(300, "C", true, 3) };
+
+    SECTION("two-way") {
+        discovered_alleles dest;
+        REQUIRE(merge_discovered_alleles(dal1, dest).ok());
+        REQUIRE(dest == dal1);
+        REQUIRE(merge_discovered_alleles(dal2, dest).ok());
+        REQUIRE(merge_discovered_alleles(dal3, dest).ok());
+        REQUIRE(dest.size() == 5);
+        REQUIRE(dest.begin()->first == allele(range(0, 50, 51), "C"));
+        REQUIRE(dest[allele(range(0, 100, 101), "A")].zGQ.copy_number() == 3);
+        REQUIRE(dest[allele(range(0, 100, 101), "G")].zGQ.copy_number() == 4);
+        REQUIRE(dest[allele(range(0, 300, 301), "C")].zGQ.copy_number() == 4);
+
+        // the k-way merge yields the same result
+        vector<discovered_alleles> srcs { dal2, dal3 };
+        discovered_alleles dest2(dal1);
+        REQUIRE(merge_discovered_alleles(srcs, dest2).ok());
+        REQUIRE(srcs.empty());
+        REQUIRE(dest2 == dest);
+    }
+
+    SECTION("REF/ALT conflict") {
+        discovered_alleles bad { mk(100, "G", true, 1) };
+        discovered_alleles dest(dal1);
+        REQUIRE(merge_discovered_alleles(bad, dest) == StatusCode::INVALID);
+
+        vector<discovered_alleles> srcs { dal2, dal3, bad };
+        dest = dal1;
+        REQUIRE(merge_discovered_alleles(srcs, dest) == StatusCode::INVALID);
+    }
+}
+
 TEST_CASE("unified_site::of_yaml") {
     vector<pair<string,size_t>> contigs;
     contigs.push_back(make_pair("16",12345));
@@ -776,6 +839,9 @@ TEST_CASE("genotyper_config") {
          ref_dp_format: MIN_DP
          output_residuals: false
          output_format: BCF
+         output_compression_level: 6
+         output_threads: 2
+         output_index: true
 )";
 
      const char* buf3 = 1 + R"(
@@ -807,7 +873,16 @@ liftover_fields:
 
  )";
 
-    const char* good_examples[] = {buf1, buf2, buf3};
+    const char* buf4 = 1 + R"(
+         required_dp: 0
+         allele_dp_format: AD
+         ref_symbolic_allele: <NON_REF>
+         ref_dp_format: MIN_DP
+         output_residuals: false
+         output_format: SPARSE
+)";
+
+    const char* good_examples[] = {buf1, buf2, buf3, buf4};
 
     SECTION("good examples") {
         for (const char* buf : good_examples) {
@@ -954,7 +1029,14 @@ liftover_fields:
 
  )";
 
-    const char* bad_examples[] = {bad_buf1, bad_buf2, bad_buf3, bad_buf4};
+    // check bad output_compression_level
+    const char* bad_buf5 = 1 + R"(
+         required_dp: 2
+         output_format: BCF
+         output_compression_level: 12
+)";
+
+    const char* bad_examples[] = {bad_buf1, bad_buf2, bad_buf3, bad_buf4, bad_buf5};
 
     SECTION("bad examples") {
         Status s;
@@ -986,3 +1068,45 @@ TEST_CASE("zygosity_by_GQ") {
         }
     }
 }
+
+TEST_CASE("bcf_init_pooled") {
+    shared_ptr<bcf_hdr_t> hdr(bcf_hdr_init("w"), &bcf_hdr_destroy);
+    REQUIRE(bcf_hdr_append(hdr.get(), "##contig=<ID=21,length=48129895>") == 0);
+    REQUIRE(bcf_hdr_sync(hdr.get()) == 0);
+
+    auto rec = bcf_init_pooled();
+    REQUIRE(rec);
+    rec->rid = 0;
+    rec->pos = 1000;
+    REQUIRE(bcf_update_alleles_str(hdr.get(), rec.get(), "A,G") == 0);
+    REQUIRE(rec->n_allele == 2);
+
+    // the duplicate is equivalent
+    auto dup = bcf_dup_pooled(rec.get());
+    REQUIRE(dup.get() != rec.get());
+    REQUIRE(dup->pos == 1000);
+    REQUIRE(bcf_unpack(dup.get(), BCF_UN_STR) == 0);
+    REQUIRE(dup->n_allele == 2);
+    REQUIRE(string(dup->d.allele[1]) == "G");
+    bcf1_t* d = dup.get();
+    dup.reset();
+
+    // a released record is recycled, cleared
+    bcf1_t* p = rec.get();
+    rec.reset();
+    auto rec2 = bcf_init_pooled();
+    REQUIRE(rec2.get() == p);
+    REQUIRE(rec2->pos == 0);
+    REQUIRE(rec2->n_allele == 0);
+    REQUIRE(rec2->shared.l == 0);
+
+    // but not one retaining more than the free list is bounded to
+    auto small = bcf_init_pooled();
+    REQUIRE(small.get() == d);
+    auto big = bcf_init_pooled();
+    REQUIRE(ks_resize(&big->shared, BCF_POOL_MAX_BYTES) == 0);
+    small.reset();
+    big.reset();
+    auto rec3 = bcf_init_pooled();
+    REQUIRE(rec3.get() == d);
+}
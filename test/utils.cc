@@ -3,6 +3,7 @@
 #include "service.h"
 #include "unifier.h"
 #include "genotyper.h"
+#include "BCFSerialize.h"
 using namespace std;
 using namespace GLnexus;
 #include "BCF_utils.h"
@@ -182,7 +183,8 @@ public:
 
     Status dataset_range(const string& dataset, const bcf_hdr_t *hdr,
                          const range& pos, bcf_predicate predicate,
-                         vector<shared_ptr<bcf1_t>>* records) override {
+                         vector<shared_ptr<bcf1_t>>* records,
+                         const bcf_field_selection* fields = nullptr) override {
         Status s;
         auto p = datasets_.find(dataset);
         if (p == datasets_.end()) {
@@ -197,7 +199,9 @@ public:
             if (predicate == nullptr) {
                 rec_ok = true;
             } else {
-                S(predicate(hdr, bcf.get(), rec_ok));
+                bcf_raw_view view;
+                S(bcf_raw_view::of_bcf1(bcf.get(), view));
+                S(predicate(hdr, view, rec_ok));
             }
             if (rec_ok)
                 records->push_back(bcf);